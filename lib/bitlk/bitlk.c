@@ -25,6 +25,7 @@
 #include <uuid/uuid.h>
 #include <time.h>
 #include <limits.h>
+#include <sys/mman.h>
 
 #include "bitlk.h"
 #include "internal.h"
@@ -238,7 +239,7 @@ static uint64_t filetime_to_unixtime(uint64_t time)
 	return (time - EPOCH_AS_FILETIME) / HUNDREDS_OF_NANOSECONDS;
 }
 
-static int parse_vmk_entry(struct crypt_device *cd, uint8_t *data, int start, int end, struct bitlk_vmk **vmk)
+static int parse_vmk_entry(struct crypt_device *cd, const uint8_t *data, int start, int end, struct bitlk_vmk **vmk)
 {
 	uint16_t key_entry_size = 0;
 	uint16_t key_entry_type = 0;
@@ -396,6 +397,60 @@ void BITLK_bitlk_metadata_free(struct bitlk_metadata *metadata)
 	BITLK_bitlk_fvek_free(metadata->fvek);
 }
 
+/*
+ * FVE metadata entries are parsed in place from read-only mapping of the device,
+ * devices (or images) that cannot be mapped are read into a buffer.
+ */
+struct bitlk_fve_area {
+	void *map;
+	size_t map_size;
+	uint8_t *buf;
+	const uint8_t *data;
+};
+
+static int bitlk_fve_area_get(struct crypt_device *cd, struct device *device, int devfd,
+			      uint64_t offset, size_t size, struct bitlk_fve_area *a)
+{
+	uint64_t dev_size, map_offset = offset & ~((uint64_t)crypt_getpagesize() - 1);
+
+	memset(a, 0, sizeof(*a));
+
+	/* never map past end of device (access would SIGBUS) */
+	if (!device_size(device, &dev_size) && offset + size <= dev_size) {
+		a->map_size = size + (offset - map_offset);
+		a->map = mmap(NULL, a->map_size, PROT_READ, MAP_SHARED, devfd, (off_t)map_offset);
+		if (a->map != MAP_FAILED) {
+			a->data = (const uint8_t *)a->map + (offset - map_offset);
+			return 0;
+		}
+		log_dbg(cd, "Cannot map BITLK metadata entries, reading them.");
+		a->map = NULL;
+		a->map_size = 0;
+	}
+
+	a->buf = malloc(size);
+	if (!a->buf)
+		return -ENOMEM;
+
+	if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				 a->buf, size, offset) != (ssize_t)size) {
+		free(a->buf);
+		a->buf = NULL;
+		return -EIO;
+	}
+
+	a->data = a->buf;
+	return 0;
+}
+
+static void bitlk_fve_area_put(struct bitlk_fve_area *a)
+{
+	if (a->map)
+		munmap(a->map, a->map_size);
+	free(a->buf);
+	memset(a, 0, sizeof(*a));
+}
+
 int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 {
 	int devfd;
@@ -404,9 +459,10 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 	struct bitlk_superblock sb = {};
 	struct bitlk_fve_metadata fve = {};
 	struct bitlk_entry_vmk entry_vmk = {};
-	uint8_t *fve_entries = NULL;
+	struct bitlk_fve_area fve_area = {};
+	const uint8_t *fve_entries = NULL;
 	uint32_t fve_metadata_size = 0;
-	int fve_offset = 0;
+	int fve_offset = 0, m;
 	char guid_buf[UUID_STR_LEN] = {0};
 	uint16_t entry_size = 0;
 	uint16_t entry_type = 0;
@@ -491,14 +547,23 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 	for (i = 0; i < 3; i++)
 		params->metadata_offset[i] = le64_to_cpu(sb.fve_offset[i]);
 
-	log_dbg(cd, "Reading BITLK FVE metadata of size %zu on device %s, offset %" PRIu64 ".",
-		sizeof(fve), device_path(device), params->metadata_offset[0]);
+	/* read FVE metadata from the first valid metadata area, other copies only if needed */
+	for (m = 0; m < 3; m++) {
+		log_dbg(cd, "Reading BITLK FVE metadata of size %zu on device %s, offset %" PRIu64 ".",
+			sizeof(fve), device_path(device), params->metadata_offset[m]);
+
+		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
+			device_alignment(device), &fve, sizeof(fve), params->metadata_offset[m]) == sizeof(fve) &&
+			!memcmp(fve.signature, BITLK_SIGNATURE, sizeof(fve.signature)) &&
+			le16_to_cpu(fve.fve_version) == 2 &&
+			le32_to_cpu(fve.metadata_size) > BITLK_FVE_METADATA_HEADER_LEN &&
+			le32_to_cpu(fve.metadata_size) <= BITLK_FVE_METADATA_SIZE - BITLK_FVE_METADATA_BLOCK_HEADER_LEN)
+			break;
 
-	/* read FVE metadata from the first metadata area */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-		device_alignment(device), &fve, sizeof(fve), params->metadata_offset[0]) != sizeof(fve) ||
-		memcmp(fve.signature, BITLK_SIGNATURE, sizeof(fve.signature)) ||
-		le16_to_cpu(fve.fve_version) != 2) {
+		log_dbg(cd, "Invalid BITLK FVE metadata in area %d.", m);
+	}
+
+	if (m == 3) {
 		log_err(cd, _("Failed to read BITLK FVE metadata from %s."), device_path(device));
 		r = -EINVAL;
 		goto out;
@@ -569,25 +634,21 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 
 	params->creation_time = filetime_to_unixtime(le64_to_cpu(fve.creation_time));
 
-	/* read and parse all FVE metadata entries */
-	fve_entries = malloc(fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN);
-	if (!fve_entries) {
-		r = -ENOMEM;
-		goto out;
-	}
-	memset(fve_entries, 0, (fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN));
-
+	/* parse all FVE metadata entries in place */
 	log_dbg(cd, "Reading BITLK FVE metadata entries of size %" PRIu32 " on device %s, offset %" PRIu64 ".",
 		fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN, device_path(device),
-		params->metadata_offset[0] + BITLK_FVE_METADATA_HEADERS_LEN);
+		params->metadata_offset[m] + BITLK_FVE_METADATA_HEADERS_LEN);
 
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-		device_alignment(device), fve_entries, fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN,
-		params->metadata_offset[0] + BITLK_FVE_METADATA_HEADERS_LEN) != (ssize_t)(fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN)) {
-		log_err(cd, _("Failed to read BITLK metadata entries from %s."), device_path(device));
-		r = -EINVAL;
+	r = bitlk_fve_area_get(cd, device, devfd, params->metadata_offset[m] + BITLK_FVE_METADATA_HEADERS_LEN,
+			       fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN, &fve_area);
+	if (r < 0) {
+		if (r == -EIO) {
+			log_err(cd, _("Failed to read BITLK metadata entries from %s."), device_path(device));
+			r = -EINVAL;
+		}
 		goto out;
 	}
+	fve_entries = fve_area.data;
 
 	end = fve_metadata_size - BITLK_FVE_METADATA_HEADER_LEN;
 	while (end - start > 2) {
@@ -671,8 +732,10 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 		/* volume description (utf-16 string) */
 		} else if (entry_type == BITLK_ENTRY_TYPE_DESCRIPTION) {
 			description = malloc((entry_size - BITLK_ENTRY_HEADER_LEN - BITLK_ENTRY_HEADER_LEN) * 2 + 1);
-			if (!description)
-				return -ENOMEM;
+			if (!description) {
+				r = -ENOMEM;
+				goto out;
+			}
 			r = crypt_utf16_to_utf8(&description, CONST_CAST(char16_t *)(fve_entries + start + BITLK_ENTRY_HEADER_LEN),
 					                  entry_size - BITLK_ENTRY_HEADER_LEN);
 			if (r < 0 || !description) {
@@ -688,8 +751,7 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 	}
 
 out:
-	if (fve_entries)
-		free(fve_entries);
+	bitlk_fve_area_put(&fve_area);
 	return r;
 }
 
@@ -947,6 +1009,8 @@ static int bitlk_kdf(struct crypt_device *cd,
 	struct crypt_hash *hd = NULL;
 	int len = 0;
 	char16_t *utf16Password = NULL;
+	/* FIPS requires certified backend implementation */
+	bool native = !strcmp(BITLK_KDF_HASH, "sha256") && !crypt_fips_mode();
 	int i = 0;
 	int r = 0;
 
@@ -989,11 +1053,16 @@ static int bitlk_kdf(struct crypt_device *cd,
 			goto out;
 	}
 
+	/* in-process hash avoids backend (AF_ALG socket) round trip in every iteration */
 	for (i = 0; i < BITLK_KDF_ITERATION_COUNT; i++) {
-		crypt_hash_write(hd, (const char*) &kdf, sizeof(kdf));
-		r = crypt_hash_final(hd, kdf.last_sha256, len);
-		if (r < 0)
-			goto out;
+		if (native)
+			native = !crypt_sha256_native((const char*) &kdf, sizeof(kdf), kdf.last_sha256);
+		if (!native) {
+			crypt_hash_write(hd, (const char*) &kdf, sizeof(kdf));
+			r = crypt_hash_final(hd, kdf.last_sha256, len);
+			if (r < 0)
+				goto out;
+		}
 		kdf.count = cpu_to_le64(le64_to_cpu(kdf.count) + 1);
 	}
 
@@ -1059,29 +1128,211 @@ out:
 	return r;
 }
 
+static int bitlk_kdf_passphrase_job(struct crypt_device *cd, struct crypt_kdf_job *job,
+				    const char *password, size_t password_len)
+{
+	int r = bitlk_kdf(cd, password, password_len, false, (const uint8_t *)job->salt, &job->derived_key);
+
+	return (!r && !job->derived_key) ? -ENOMEM : r;
+}
+
+static int bitlk_kdf_recovery_job(struct crypt_device *cd, struct crypt_kdf_job *job,
+				  const char *password, size_t password_len)
+{
+	int r = bitlk_kdf(cd, password, password_len, true, (const uint8_t *)job->salt, &job->derived_key);
+
+	return (!r && !job->derived_key) ? -ENOMEM : r;
+}
+
+/*
+ * KDF output depends only on password and VMK salt, so there is one KDF job
+ * for all passphrase (or recovery passphrase) VMKs with the same salt.
+ */
+struct bitlk_kdf_jobs {
+	struct crypt_kdf_job *jobs;
+	unsigned count;
+	const struct bitlk_metadata *params;
+	struct volume_key **open_fvek_key;
+};
+
+static bool bitlk_kdf_job_match(const struct crypt_kdf_job *job, bool recovery, const uint8_t *salt)
+{
+	return job->kdf == (recovery ? bitlk_kdf_recovery_job : bitlk_kdf_passphrase_job) &&
+	       !memcmp(job->salt, salt, BITLK_SALT_SIZE);
+}
+
+static int bitlk_kdf_jobs_init(struct bitlk_kdf_jobs *kj, const struct bitlk_metadata *params,
+			       const struct volume_key *recovery_key)
+{
+	const struct bitlk_vmk *vmk;
+	bool recovery;
+	unsigned i, n = 0;
+	int vmk_index;
+
+	for (vmk = params->vmks; vmk; vmk = vmk->next)
+		n++;
+
+	kj->jobs = n ? calloc(n, sizeof(*kj->jobs)) : NULL;
+	if (n && !kj->jobs)
+		return -ENOMEM;
+
+	for (vmk = params->vmks, vmk_index = 0; vmk; vmk = vmk->next, vmk_index++) {
+		if (vmk->protection == BITLK_PROTECTION_PASSPHRASE)
+			recovery = false;
+		else if (vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE && recovery_key)
+			recovery = true;
+		else
+			continue;
+
+		for (i = 0; i < kj->count; i++)
+			if (bitlk_kdf_job_match(&kj->jobs[i], recovery, vmk->salt))
+				break;
+		if (i < kj->count)
+			continue;
+
+		kj->jobs[i].salt = malloc(BITLK_SALT_SIZE);
+		if (!kj->jobs[i].salt)
+			return -ENOMEM;
+		memcpy(kj->jobs[i].salt, vmk->salt, BITLK_SALT_SIZE);
+		kj->jobs[i].salt_len = BITLK_SALT_SIZE;
+		kj->jobs[i].keyslot = vmk_index;
+		kj->jobs[i].kdf = recovery ? bitlk_kdf_recovery_job : bitlk_kdf_passphrase_job;
+		if (recovery) {
+			kj->jobs[i].password = recovery_key->key;
+			kj->jobs[i].password_len = recovery_key->keylength;
+		}
+		kj->count++;
+	}
+
+	return 0;
+}
+
+/* derived key of (already finished or now run) KDF job shared by VMKs with the same salt */
+static int bitlk_kdf_shared(struct crypt_device *cd, struct bitlk_kdf_jobs *kj,
+			    const char *password, size_t passwordLen,
+			    bool recovery, const uint8_t *salt, struct volume_key **vk)
+{
+	struct crypt_kdf_job *job = NULL;
+	unsigned i;
+	int r;
+
+	for (i = 0; i < kj->count && !job; i++)
+		if (bitlk_kdf_job_match(&kj->jobs[i], recovery, salt))
+			job = &kj->jobs[i];
+
+	if (!job)
+		return bitlk_kdf(cd, password, passwordLen, recovery, salt, vk);
+
+	if (!job->derived_key) {
+		r = job->kdf(cd, job, job->password ?: password, job->password ? job->password_len : passwordLen);
+		if (r < 0)
+			return r;
+	}
+
+	*vk = crypt_alloc_volume_key(job->derived_key->keylength, job->derived_key->key);
+	return *vk ? 0 : -ENOMEM;
+}
+
+static int bitlk_open_vmk(struct crypt_device *cd,
+			  const struct bitlk_vmk *vmk,
+			  struct volume_key *vmk_dec_key,
+			  const struct bitlk_metadata *params,
+			  struct volume_key **open_fvek_key)
+{
+	struct volume_key *open_vmk_key = NULL;
+	int r;
+
+	log_dbg(cd, "Trying to decrypt %s.", get_vmk_protection_string(vmk->protection));
+	r = decrypt_key(cd, &open_vmk_key, vmk->vk, vmk_dec_key,
+			vmk->mac_tag, BITLK_VMK_MAC_TAG_SIZE,
+			vmk->nonce, BITLK_NONCE_SIZE, false);
+	if (r < 0) {
+		log_dbg(cd, "Failed to decrypt VMK using provided passphrase.");
+		return r;
+	}
+
+	r = decrypt_key(cd, open_fvek_key, params->fvek->vk, open_vmk_key,
+			params->fvek->mac_tag, BITLK_VMK_MAC_TAG_SIZE,
+			params->fvek->nonce, BITLK_NONCE_SIZE, true);
+	if (r < 0)
+		log_dbg(cd, "Failed to decrypt FVEK using VMK.");
+
+	crypt_free_volume_key(open_vmk_key);
+	return r;
+}
+
+/* Runs in caller thread, in VMK order of the first VMK using the job */
+static int bitlk_kdf_verify(struct crypt_device *cd, struct crypt_kdf_job *job, void *usrptr)
+{
+	struct bitlk_kdf_jobs *kj = usrptr;
+	const struct bitlk_vmk *vmk;
+	bool recovery = job->kdf == bitlk_kdf_recovery_job;
+	int r;
+
+	if (job->r < 0)
+		return -ENOENT;
+
+	for (vmk = kj->params->vmks; vmk; vmk = vmk->next) {
+		if (vmk->protection != (recovery ? BITLK_PROTECTION_RECOVERY_PASSPHRASE :
+						   BITLK_PROTECTION_PASSPHRASE) ||
+		    !bitlk_kdf_job_match(job, recovery, vmk->salt))
+			continue;
+		r = bitlk_open_vmk(cd, vmk, job->derived_key, kj->params, kj->open_fvek_key);
+		if (!r || r == -ENOTSUP)
+			return r;
+	}
+
+	return -EPERM;
+}
+
 int BITLK_get_volume_key(struct crypt_device *cd,
 			 const char *password,
 			 size_t passwordLen,
 			 const struct bitlk_metadata *params,
 			 struct volume_key **open_fvek_key)
 {
-	int r = 0;
-	struct volume_key *open_vmk_key = NULL;
+	int r = 0, r_recovery = 0;
 	struct volume_key *vmk_dec_key = NULL;
 	struct volume_key *recovery_key = NULL;
 	const struct bitlk_vmk *next_vmk = NULL;
+	struct bitlk_kdf_jobs kj = { .params = params, .open_fvek_key = open_fvek_key };
+
+	/* recovery passphrase is parsed only once for all recovery VMKs */
+	for (next_vmk = params->vmks; next_vmk; next_vmk = next_vmk->next)
+		if (next_vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE) {
+			r_recovery = get_recovery_key(cd, password, passwordLen, &recovery_key);
+			break;
+		}
+
+	r = bitlk_kdf_jobs_init(&kj, params, recovery_key);
+	if (r < 0)
+		goto out;
+
+	/* Derive keys of all VMKs concurrently, the first VMK that opens FVEK wins */
+	if (crypt_keyslot_parallel_trial(cd) && kj.count > 1) {
+		log_dbg(cd, "Trying to open %u VMKs in parallel.", kj.count);
+		r = crypt_kdf_parallel_trial(cd, kj.jobs, kj.count, password, passwordLen,
+					     bitlk_kdf_verify, &kj);
+		if (!r)
+			goto out;
+	}
 
+	/*
+	 * Walk all VMKs in order (KDF outputs are shared, each is derived only once),
+	 * for startup keys and to report the same error as without parallel trial.
+	 */
+	r = 0;
 	next_vmk = params->vmks;
 	while (next_vmk) {
 		if (next_vmk->protection == BITLK_PROTECTION_PASSPHRASE) {
-			r = bitlk_kdf(cd, password, passwordLen, false, next_vmk->salt, &vmk_dec_key);
+			r = bitlk_kdf_shared(cd, &kj, password, passwordLen, false, next_vmk->salt, &vmk_dec_key);
 			if (r) {
 				/* something wrong happened, but we still want to check other key slots */
 				next_vmk = next_vmk->next;
 				continue;
 			}
 		} else if (next_vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE) {
-			r = get_recovery_key(cd, password, passwordLen, &recovery_key);
+			r = r_recovery;
 			if (r) {
 				/* something wrong happened, but we still want to check other key slots */
 				next_vmk = next_vmk->next;
@@ -1094,11 +1345,10 @@ int BITLK_get_volume_key(struct crypt_device *cd,
 				continue;
 			}
 			log_dbg(cd, "Trying to use given password as a recovery key.");
-			r = bitlk_kdf(cd, recovery_key->key, recovery_key->keylength,
-				      true, next_vmk->salt, &vmk_dec_key);
-			crypt_free_volume_key(recovery_key);
+			r = bitlk_kdf_shared(cd, &kj, recovery_key->key, recovery_key->keylength,
+					     true, next_vmk->salt, &vmk_dec_key);
 			if (r)
-				return r;
+				goto out;
 		} else if (next_vmk->protection == BITLK_PROTECTION_STARTUP_KEY) {
 			r = get_startup_key(cd, password, passwordLen, next_vmk, &vmk_dec_key, params);
 			if (r) {
@@ -1116,42 +1366,23 @@ int BITLK_get_volume_key(struct crypt_device *cd,
 			continue;
 		}
 
-		log_dbg(cd, "Trying to decrypt %s.", get_vmk_protection_string(next_vmk->protection));
-		r = decrypt_key(cd, &open_vmk_key, next_vmk->vk, vmk_dec_key,
-				next_vmk->mac_tag, BITLK_VMK_MAC_TAG_SIZE,
-				next_vmk->nonce, BITLK_NONCE_SIZE, false);
-		if (r < 0) {
-			log_dbg(cd, "Failed to decrypt VMK using provided passphrase.");
-			crypt_free_volume_key(vmk_dec_key);
-			if (r == -ENOTSUP)
-				return r;
-			next_vmk = next_vmk->next;
-			continue;
-		}
+		r = bitlk_open_vmk(cd, next_vmk, vmk_dec_key, params, open_fvek_key);
 		crypt_free_volume_key(vmk_dec_key);
-
-		r = decrypt_key(cd, open_fvek_key, params->fvek->vk, open_vmk_key,
-				params->fvek->mac_tag, BITLK_VMK_MAC_TAG_SIZE,
-				params->fvek->nonce, BITLK_NONCE_SIZE, true);
-		if (r < 0) {
-			log_dbg(cd, "Failed to decrypt FVEK using VMK.");
-			crypt_free_volume_key(open_vmk_key);
-			if (r == -ENOTSUP)
-				return r;
-		} else {
-			crypt_free_volume_key(open_vmk_key);
+		vmk_dec_key = NULL;
+		if (r == -ENOTSUP)
+			goto out;
+		if (!r)
 			break;
-		}
 
 		next_vmk = next_vmk->next;
 	}
 
-	if (r) {
+	if (r)
 		log_dbg(cd, "No more VMKs to try.");
-		return r;
-	}
-
-	return 0;
+out:
+	crypt_kdf_jobs_free(kj.jobs, kj.count);
+	crypt_free_volume_key(recovery_key);
+	return r;
 }
 
 static int _activate_check(struct crypt_device *cd,
@@ -0,0 +1,124 @@
+/*
+ * Argon2 BlaMka round for ARM NEON (AArch64 Advanced SIMD)
+ *
+ * Structure follows the SSE2 variant in blamka-round-opt.h,
+ * one uint64x2_t holds the same two words as one __m128i.
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#ifndef BLAKE_ROUND_MKA_NEON_H
+#define BLAKE_ROUND_MKA_NEON_H
+
+#include "blake2-impl.h"
+
+#include <arm_neon.h>
+
+#define ror64_32(x)                                                            \
+    vreinterpretq_u64_u32(vrev64q_u32(vreinterpretq_u32_u64(x)))
+#define ror64(x, c) vsriq_n_u64(vshlq_n_u64((x), 64 - (c)), (x), (c))
+
+static BLAKE2_INLINE uint64x2_t fBlaMka(uint64x2_t x, uint64x2_t y) {
+    const uint64x2_t z = vmull_u32(vmovn_u64(x), vmovn_u64(y));
+    return vaddq_u64(vaddq_u64(x, y), vaddq_u64(z, z));
+}
+
+#define G1(A0, B0, C0, D0, A1, B1, C1, D1)                                     \
+    do {                                                                       \
+        A0 = fBlaMka(A0, B0);                                                  \
+        A1 = fBlaMka(A1, B1);                                                  \
+                                                                               \
+        D0 = veorq_u64(D0, A0);                                                \
+        D1 = veorq_u64(D1, A1);                                                \
+                                                                               \
+        D0 = ror64_32(D0);                                                     \
+        D1 = ror64_32(D1);                                                     \
+                                                                               \
+        C0 = fBlaMka(C0, D0);                                                  \
+        C1 = fBlaMka(C1, D1);                                                  \
+                                                                               \
+        B0 = veorq_u64(B0, C0);                                                \
+        B1 = veorq_u64(B1, C1);                                                \
+                                                                               \
+        B0 = ror64(B0, 24);                                                    \
+        B1 = ror64(B1, 24);                                                    \
+    } while ((void)0, 0)
+
+#define G2(A0, B0, C0, D0, A1, B1, C1, D1)                                     \
+    do {                                                                       \
+        A0 = fBlaMka(A0, B0);                                                  \
+        A1 = fBlaMka(A1, B1);                                                  \
+                                                                               \
+        D0 = veorq_u64(D0, A0);                                                \
+        D1 = veorq_u64(D1, A1);                                                \
+                                                                               \
+        D0 = ror64(D0, 16);                                                    \
+        D1 = ror64(D1, 16);                                                    \
+                                                                               \
+        C0 = fBlaMka(C0, D0);                                                  \
+        C1 = fBlaMka(C1, D1);                                                  \
+                                                                               \
+        B0 = veorq_u64(B0, C0);                                                \
+        B1 = veorq_u64(B1, C1);                                                \
+                                                                               \
+        B0 = ror64(B0, 63);                                                    \
+        B1 = ror64(B1, 63);                                                    \
+    } while ((void)0, 0)
+
+/* vextq_u64(x, y, 1) is { x[1], y[0] } */
+#define DIAGONALIZE(A0, B0, C0, D0, A1, B1, C1, D1)                            \
+    do {                                                                       \
+        uint64x2_t t0 = vextq_u64(B0, B1, 1);                                  \
+        uint64x2_t t1 = vextq_u64(B1, B0, 1);                                  \
+        B0 = t0;                                                               \
+        B1 = t1;                                                               \
+                                                                               \
+        t0 = C0;                                                               \
+        C0 = C1;                                                               \
+        C1 = t0;                                                               \
+                                                                               \
+        t0 = vextq_u64(D0, D1, 1);                                             \
+        t1 = vextq_u64(D1, D0, 1);                                             \
+        D0 = t1;                                                               \
+        D1 = t0;                                                               \
+    } while ((void)0, 0)
+
+#define UNDIAGONALIZE(A0, B0, C0, D0, A1, B1, C1, D1)                          \
+    do {                                                                       \
+        uint64x2_t t0 = vextq_u64(B1, B0, 1);                                  \
+        uint64x2_t t1 = vextq_u64(B0, B1, 1);                                  \
+        B0 = t0;                                                               \
+        B1 = t1;                                                               \
+                                                                               \
+        t0 = C0;                                                               \
+        C0 = C1;                                                               \
+        C1 = t0;                                                               \
+                                                                               \
+        t0 = vextq_u64(D1, D0, 1);                                             \
+        t1 = vextq_u64(D0, D1, 1);                                             \
+        D0 = t1;                                                               \
+        D1 = t0;                                                               \
+    } while ((void)0, 0)
+
+#define BLAKE2_ROUND(A0, A1, B0, B1, C0, C1, D0, D1)                           \
+    do {                                                                       \
+        G1(A0, B0, C0, D0, A1, B1, C1, D1);                                    \
+        G2(A0, B0, C0, D0, A1, B1, C1, D1);                                    \
+                                                                               \
+        DIAGONALIZE(A0, B0, C0, D0, A1, B1, C1, D1);                           \
+                                                                               \
+        G1(A0, B0, C0, D0, A1, B1, C1, D1);                                    \
+        G2(A0, B0, C0, D0, A1, B1, C1, D1);                                    \
+                                                                               \
+        UNDIAGONALIZE(A0, B0, C0, D0, A1, B1, C1, D1);                         \
+    } while ((void)0, 0)
+
+#endif /* BLAKE_ROUND_MKA_NEON_H */
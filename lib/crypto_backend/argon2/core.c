@@ -271,90 +271,128 @@ static int fill_memory_blocks_st(argon2_instance_t *instance) {
 
 #if !defined(ARGON2_NO_THREADS)
 
-#ifdef _WIN32
-static unsigned __stdcall fill_segment_thr(void *thread_data)
-#else
-static void *fill_segment_thr(void *thread_data)
+/*
+ * Lane workers are created once per hash and kept for all passes and slices,
+ * the calling thread is worker 0. Each slice references blocks of all lanes
+ * from previous slices, so workers meet at a barrier after every slice.
+ */
+typedef struct Argon2_pool {
+    argon2_instance_t *instance;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t workers; /* including the calling thread */
+    uint32_t waiting;
+    uint32_t generation;
+    int start;
+} argon2_pool_t;
+
+static void pool_barrier(argon2_pool_t *pool) {
+    uint32_t generation;
+
+    pthread_mutex_lock(&pool->lock);
+    generation = pool->generation;
+    if (++pool->waiting == pool->workers) {
+        pool->waiting = 0;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->cond);
+    } else {
+        while (generation == pool->generation)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_fill(argon2_pool_t *pool, uint32_t index) {
+    argon2_instance_t *instance = pool->instance;
+    uint32_t r, s, l;
+
+    for (r = 0; r < instance->passes; ++r) {
+        for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
+            for (l = index; l < instance->lanes; l += pool->workers) {
+                argon2_position_t position = {r, l, (uint8_t)s, 0};
+                fill_segment(instance, position);
+            }
+            pool_barrier(pool);
+        }
+
+#ifdef GENKAT
+        if (index == 0)
+            internal_kat(instance, r); /* Print all memory blocks */
+        pool_barrier(pool);
 #endif
+    }
+}
+
+static void *fill_segment_thr(void *thread_data)
 {
     argon2_thread_data *my_data = thread_data;
-    fill_segment(my_data->instance_ptr, my_data->pos);
+    argon2_pool_t *pool = my_data->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->start)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_fill(pool, my_data->index);
     return 0;
 }
 
 /* Multi-threaded version for p > 1 case */
 static int fill_memory_blocks_mt(argon2_instance_t *instance) {
-    uint32_t r, s;
+    argon2_pool_t pool;
     argon2_thread_handle_t *thread = NULL;
     argon2_thread_data *thr_data = NULL;
+    uint32_t l, created = 0;
     int rc = ARGON2_OK;
 
     /* 1. Allocating space for threads */
-    thread = calloc(instance->lanes, sizeof(argon2_thread_handle_t));
-    if (thread == NULL) {
+    thread = calloc(instance->threads, sizeof(argon2_thread_handle_t));
+    thr_data = calloc(instance->threads, sizeof(argon2_thread_data));
+    if (thread == NULL || thr_data == NULL) {
         rc = ARGON2_MEMORY_ALLOCATION_ERROR;
         goto fail;
     }
 
-    thr_data = calloc(instance->lanes, sizeof(argon2_thread_data));
-    if (thr_data == NULL) {
-        rc = ARGON2_MEMORY_ALLOCATION_ERROR;
+    memset(&pool, 0, sizeof(pool));
+    pool.instance = instance;
+    if (pthread_mutex_init(&pool.lock, NULL)) {
+        rc = ARGON2_THREAD_FAIL;
+        goto fail;
+    }
+    if (pthread_cond_init(&pool.cond, NULL)) {
+        pthread_mutex_destroy(&pool.lock);
+        rc = ARGON2_THREAD_FAIL;
         goto fail;
     }
 
-    for (r = 0; r < instance->passes; ++r) {
-        for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
-            uint32_t l, ll;
+    /* 2. Creating workers, they wait until the worker count is final */
+    for (l = 1; l < instance->threads; ++l) {
+        thr_data[l].pool = &pool;
+        thr_data[l].index = l;
+        if (argon2_thread_create(&thread[l], &fill_segment_thr,
+                                 (void *)&thr_data[l]))
+            break;
+        created++;
+    }
 
-            /* 2. Calling threads */
-            for (l = 0; l < instance->lanes; ++l) {
-                argon2_position_t position;
-
-                /* 2.1 Join a thread if limit is exceeded */
-                if (l >= instance->threads) {
-                    if (argon2_thread_join(thread[l - instance->threads])) {
-                        rc = ARGON2_THREAD_FAIL;
-                        goto fail;
-                    }
-                }
-
-                /* 2.2 Create thread */
-                position.pass = r;
-                position.lane = l;
-                position.slice = (uint8_t)s;
-                position.index = 0;
-                thr_data[l].instance_ptr =
-                    instance; /* preparing the thread input */
-                memcpy(&(thr_data[l].pos), &position,
-                       sizeof(argon2_position_t));
-                if (argon2_thread_create(&thread[l], &fill_segment_thr,
-                                         (void *)&thr_data[l])) {
-                    /* Wait for already running threads */
-                    for (ll = 0; ll < l; ++ll)
-                        argon2_thread_join(thread[ll]);
-                    rc = ARGON2_THREAD_FAIL;
-                    goto fail;
-                }
-
-                /* fill_segment(instance, position); */
-                /*Non-thread equivalent of the lines above */
-            }
+    /* 3. Lane distribution does not change the result, run with what we got */
+    pthread_mutex_lock(&pool.lock);
+    pool.workers = created + 1;
+    pool.start = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
 
-            /* 3. Joining remaining threads */
-            for (l = instance->lanes - instance->threads; l < instance->lanes;
-                 ++l) {
-                if (argon2_thread_join(thread[l])) {
-                    rc = ARGON2_THREAD_FAIL;
-                    goto fail;
-                }
-            }
-        }
+    pool_fill(&pool, 0);
 
-#ifdef GENKAT
-        internal_kat(instance, r); /* Print all memory blocks */
-#endif
+    /* 4. Joining workers */
+    for (l = 1; l <= created; ++l) {
+        if (argon2_thread_join(thread[l])) {
+            rc = ARGON2_THREAD_FAIL;
+        }
     }
 
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
 fail:
     if (thread != NULL) {
         free(thread);
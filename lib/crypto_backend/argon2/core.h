@@ -93,10 +93,10 @@ typedef struct Argon2_position_t {
     uint32_t index;
 } argon2_position_t;
 
-/*Struct that holds the inputs for thread handling FillSegment*/
+/*Struct that holds the inputs for lane worker thread*/
 typedef struct Argon2_thread_data {
-    argon2_instance_t *instance_ptr;
-    argon2_position_t pos;
+    struct Argon2_pool *pool;
+    uint32_t index;
 } argon2_thread_data;
 
 /*************************Argon2 core functions********************************/
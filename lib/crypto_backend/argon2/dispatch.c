@@ -0,0 +1,67 @@
+/*
+ * Argon2 fill_segment runtime dispatch
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#include <pthread.h>
+
+#include "argon2.h"
+#include "core.h"
+#include "../cpu_features.h"
+
+/*
+ * Every variant is opt.c (or ref.c) compiled with different target flags,
+ * see Makemodule.am. The implementation is selected once, on first use.
+ */
+typedef void (*fill_segment_fn)(const argon2_instance_t *instance,
+                                argon2_position_t position);
+
+void fill_segment_ref(const argon2_instance_t *instance,
+                      argon2_position_t position);
+#if defined(__x86_64__) || defined(__i386__)
+void fill_segment_sse2(const argon2_instance_t *instance,
+                       argon2_position_t position);
+void fill_segment_ssse3(const argon2_instance_t *instance,
+                        argon2_position_t position);
+void fill_segment_avx2(const argon2_instance_t *instance,
+                       argon2_position_t position);
+void fill_segment_avx512(const argon2_instance_t *instance,
+                         argon2_position_t position);
+#elif defined(__aarch64__)
+void fill_segment_neon(const argon2_instance_t *instance,
+                       argon2_position_t position);
+#endif
+
+static fill_segment_fn fill_segment_impl = fill_segment_ref;
+static pthread_once_t fill_segment_once = PTHREAD_ONCE_INIT;
+
+static void fill_segment_select(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (crypt_cpu_has(CRYPT_CPU_AVX512F))
+        fill_segment_impl = fill_segment_avx512;
+    else if (crypt_cpu_has(CRYPT_CPU_AVX2))
+        fill_segment_impl = fill_segment_avx2;
+    else if (crypt_cpu_has(CRYPT_CPU_SSSE3))
+        fill_segment_impl = fill_segment_ssse3;
+    else if (crypt_cpu_has(CRYPT_CPU_SSE2))
+        fill_segment_impl = fill_segment_sse2;
+#elif defined(__aarch64__)
+    if (crypt_cpu_has(CRYPT_CPU_ARM_ASIMD))
+        fill_segment_impl = fill_segment_neon;
+#endif
+}
+
+void fill_segment(const argon2_instance_t *instance,
+                  argon2_position_t position) {
+    pthread_once(&fill_segment_once, fill_segment_select);
+    fill_segment_impl(instance, position);
+}
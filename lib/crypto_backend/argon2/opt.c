@@ -15,6 +15,14 @@
  * software. If not, they may be obtained at the above URLs.
  */
 
+/*
+ * With runtime dispatch this file is compiled once per instruction set,
+ * each copy exporting fill_segment under its own name.
+ */
+#ifdef ARGON2_FILL_SEGMENT
+#define fill_segment ARGON2_FILL_SEGMENT
+#endif
+
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
@@ -23,7 +31,11 @@
 #include "core.h"
 
 #include "blake2/blake2.h"
+#if defined(__aarch64__)
+#include "blake2/blamka-round-neon.h"
+#else
 #include "blake2/blamka-round-opt.h"
+#endif
 
 /*
  * Function fills a new memory block and optionally XORs the old block over the new one.
@@ -106,6 +118,41 @@ static void fill_block(__m256i *state, const block *ref_block,
         _mm256_storeu_si256((__m256i *)next_block->v + i, state[i]);
     }
 }
+#elif defined(__aarch64__)
+static void fill_block(uint64x2_t *state, const block *ref_block,
+                       block *next_block, int with_xor) {
+    uint64x2_t block_XY[ARGON2_OWORDS_IN_BLOCK];
+    unsigned int i;
+
+    if (with_xor) {
+        for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+            state[i] = veorq_u64(state[i], vld1q_u64(ref_block->v + 2 * i));
+            block_XY[i] = veorq_u64(state[i], vld1q_u64(next_block->v + 2 * i));
+        }
+    } else {
+        for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+            block_XY[i] = state[i] =
+                veorq_u64(state[i], vld1q_u64(ref_block->v + 2 * i));
+        }
+    }
+
+    for (i = 0; i < 8; ++i) {
+        BLAKE2_ROUND(state[8 * i + 0], state[8 * i + 1], state[8 * i + 2],
+            state[8 * i + 3], state[8 * i + 4], state[8 * i + 5],
+            state[8 * i + 6], state[8 * i + 7]);
+    }
+
+    for (i = 0; i < 8; ++i) {
+        BLAKE2_ROUND(state[8 * 0 + i], state[8 * 1 + i], state[8 * 2 + i],
+            state[8 * 3 + i], state[8 * 4 + i], state[8 * 5 + i],
+            state[8 * 6 + i], state[8 * 7 + i]);
+    }
+
+    for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+        state[i] = veorq_u64(state[i], block_XY[i]);
+        vst1q_u64(next_block->v + 2 * i, state[i]);
+    }
+}
 #else
 static void fill_block(__m128i *state, const block *ref_block,
                        block *next_block, int with_xor) {
@@ -153,6 +200,9 @@ static void next_addresses(block *address_block, block *input_block) {
 #elif defined(__AVX2__)
     __m256i zero_block[ARGON2_HWORDS_IN_BLOCK];
     __m256i zero2_block[ARGON2_HWORDS_IN_BLOCK];
+#elif defined(__aarch64__)
+    uint64x2_t zero_block[ARGON2_OWORDS_IN_BLOCK];
+    uint64x2_t zero2_block[ARGON2_OWORDS_IN_BLOCK];
 #else
     __m128i zero_block[ARGON2_OWORDS_IN_BLOCK];
     __m128i zero2_block[ARGON2_OWORDS_IN_BLOCK];
@@ -182,6 +232,8 @@ void fill_segment(const argon2_instance_t *instance,
     __m512i state[ARGON2_512BIT_WORDS_IN_BLOCK];
 #elif defined(__AVX2__)
     __m256i state[ARGON2_HWORDS_IN_BLOCK];
+#elif defined(__aarch64__)
+    uint64x2_t state[ARGON2_OWORDS_IN_BLOCK];
 #else
     __m128i state[ARGON2_OWORDS_IN_BLOCK];
 #endif
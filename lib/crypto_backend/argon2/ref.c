@@ -15,6 +15,11 @@
  * software. If not, they may be obtained at the above URLs.
  */
 
+/* with runtime dispatch this is the portable fallback */
+#ifdef ARGON2_DISPATCH
+#define fill_segment fill_segment_ref
+#endif
+
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
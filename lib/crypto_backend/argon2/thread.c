@@ -20,6 +20,9 @@
 #include "thread.h"
 #if defined(_WIN32)
 #include <windows.h>
+#else
+int (*argon2_thread_start_hook)(void **handle, argon2_thread_func_t func, void *args);
+int (*argon2_thread_join_hook)(void *handle);
 #endif
 
 int argon2_thread_create(argon2_thread_handle_t *handle,
@@ -31,7 +34,11 @@ int argon2_thread_create(argon2_thread_handle_t *handle,
     *handle = _beginthreadex(NULL, 0, func, args, 0, NULL);
     return *handle != 0 ? 0 : -1;
 #else
-    return pthread_create(handle, NULL, func, args);
+    handle->hook = NULL;
+    if (argon2_thread_start_hook) {
+        return argon2_thread_start_hook(&handle->hook, func, args) ? -1 : 0;
+    }
+    return pthread_create(&handle->thread, NULL, func, args);
 #endif
 }
 
@@ -42,7 +49,10 @@ int argon2_thread_join(argon2_thread_handle_t handle) {
     }
     return -1;
 #else
-    return pthread_join(handle, NULL);
+    if (handle.hook) {
+        return argon2_thread_join_hook(handle.hook);
+    }
+    return pthread_join(handle.thread, NULL);
 #endif
 }
 
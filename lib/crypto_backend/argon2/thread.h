@@ -37,7 +37,16 @@ typedef uintptr_t argon2_thread_handle_t;
 #else
 #include <pthread.h>
 typedef void *(*argon2_thread_func_t)(void *);
-typedef pthread_t argon2_thread_handle_t;
+typedef struct {
+    pthread_t thread;
+    void *hook;
+} argon2_thread_handle_t;
+
+/* Optional external thread provider (libcryptsetup executor); a failed
+ * start hook is a failed thread creation.
+ */
+extern int (*argon2_thread_start_hook)(void **handle, argon2_thread_func_t func, void *args);
+extern int (*argon2_thread_join_hook)(void *handle);
 #endif
 
 /* Creates a thread
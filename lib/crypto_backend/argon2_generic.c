@@ -20,15 +20,156 @@
  */
 
 #include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 #include "crypto_backend_internal.h"
 #if HAVE_ARGON2_H
 #include <argon2.h>
 #else
 #include "argon2/argon2.h"
 #endif
+#if USE_INTERNAL_ARGON2 && !HAVE_ARGON2_H
+#include "argon2/thread.h"
+#endif
 
 #define CONST_CAST(x) (x)(uintptr_t)
 
+/* Argon2 context is allocated in the calling thread, lane threads are spawned later */
+static __thread bool argon2_numa_interleave;
+
+void crypt_pbkdf_numa_interleave(bool enable)
+{
+	argon2_numa_interleave = enable;
+}
+
+/* Lane threads of the bundled implementation only, system libargon2 spawns its own */
+void crypt_backend_thread_hooks(int (*start)(void **handle, void *(*fn)(void *arg), void *arg),
+				int (*join)(void *handle))
+{
+#if USE_INTERNAL_ARGON2 && !HAVE_ARGON2_H
+	argon2_thread_start_hook = start;
+	argon2_thread_join_hook = join;
+#endif
+}
+
+#if USE_INTERNAL_ARGON2 || HAVE_ARGON2_H
+#define ARGON2_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+static size_t argon2_mapping_size(size_t size)
+{
+	size_t align = size < ARGON2_HUGE_PAGE_SIZE ? (size_t)sysconf(_SC_PAGESIZE) : ARGON2_HUGE_PAGE_SIZE;
+
+	return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Same limit as crypt_pbkdf_memory_limit_kb() applies to PBKDF memory cost,
+ * never pin or prefault more than half of physical memory.
+ */
+static bool argon2_can_pin(size_t size)
+{
+	long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+
+	if (pages <= 0 || page_size <= 0)
+		return false;
+
+	return size <= (uint64_t)pages * (uint64_t)page_size / 2;
+}
+
+#define NUMA_MASK_BITS 1024
+#define NUMA_LONG_BITS (8 * sizeof(unsigned long))
+
+/*
+ * Lanes reference blocks of all other lanes and the lane threads run on any CPU,
+ * interleaving avoids saturating memory bandwidth of the node that prefaults it.
+ * Only not yet faulted pages are placed by the policy.
+ */
+static bool argon2_interleave(void *p, size_t len)
+{
+#if defined(SYS_get_mempolicy) && defined(SYS_mbind)
+	unsigned long mask[NUMA_MASK_BITS / NUMA_LONG_BITS] = { 0 };
+	unsigned i, nodes = 0;
+
+	if (syscall(SYS_get_mempolicy, NULL, mask, NUMA_MASK_BITS, NULL, MPOL_F_MEMS_ALLOWED))
+		return false;
+
+	for (i = 0; i < NUMA_MASK_BITS / NUMA_LONG_BITS; i++)
+		nodes += __builtin_popcountl(mask[i]);
+
+	return nodes > 1 && !syscall(SYS_mbind, p, len, MPOL_INTERLEAVE, mask, NUMA_MASK_BITS, 0);
+#else
+	return false;
+#endif
+}
+
+/*
+ * Block array is mapped from huge pages if available (explicit 2MiB pool first,
+ * then THP advice), prefaulted and locked. Pinned memory avoids page faults
+ * spread across the fill and keeps the KDF state out of swap.
+ * Every step except the mapping itself is only an optimization.
+ */
+static int argon2_allocate(uint8_t **memory, size_t size)
+{
+	size_t len = argon2_mapping_size(size);
+	bool pin = argon2_can_pin(len), numa = argon2_numa_interleave;
+	void *p = MAP_FAILED;
+
+	*memory = NULL;
+
+#ifdef MAP_HUGETLB
+	/* with NUMA interleaving the policy must be set before prefault */
+	if (pin && len >= ARGON2_HUGE_PAGE_SIZE) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB |
+			 (numa ? 0 : MAP_POPULATE), -1, 0);
+		if (p != MAP_FAILED && numa) {
+			(void)argon2_interleave(p, len);
+			(void)madvise(p, len, MADV_POPULATE_WRITE);
+		}
+	}
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		if (numa)
+			(void)argon2_interleave(p, len);
+#ifdef MADV_HUGEPAGE
+		if (len >= ARGON2_HUGE_PAGE_SIZE)
+			(void)madvise(p, len, MADV_HUGEPAGE);
+#endif
+		if (pin)
+			(void)madvise(p, len, MADV_POPULATE_WRITE);
+	}
+
+	/* mlock also populates what is left, RLIMIT_MEMLOCK can deny it */
+	if (pin)
+		(void)mlock(p, len);
+
+	*memory = p;
+	return 0;
+}
+
+static void argon2_deallocate(uint8_t *memory, size_t size)
+{
+	if (memory)
+		munmap(memory, argon2_mapping_size(size));
+}
+#endif
+
 int argon2(const char *type, const char *password, size_t password_length,
 	   const char *salt, size_t salt_length,
 	   char *key, size_t key_length,
@@ -51,6 +192,8 @@ int argon2(const char *type, const char *password, size_t password_length,
 		.pwdlen = (uint32_t)password_length,
 		.salt = CONST_CAST(uint8_t *)salt,
 		.saltlen = (uint32_t)salt_length,
+		.allocate_cbk = argon2_allocate,
+		.free_cbk = argon2_deallocate,
 	};
 	int r;
 
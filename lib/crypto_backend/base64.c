@@ -28,51 +28,68 @@
 
 #include "crypto_backend.h"
 
-#define WHITESPACE " \t\n\r"
-
 /* https://tools.ietf.org/html/rfc4648#section-4 */
+static const char base64_table[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				     "abcdefghijklmnopqrstuvwxyz"
+				     "0123456789+/";
+
+/*
+ * Reverse lookup table, values with any of the two top bits set are not
+ * base64 characters (padding, whitespace or invalid).
+ * NUL is whitespace (systemd code matched it with strchr(WHITESPACE)).
+ */
+#define B64_SPECIAL 0xc0
+#define B64_WS 0x41
+
+#define XX 0x80   /* invalid */
+#define PD 0x40   /* padding */
+#define WS B64_WS /* whitespace */
+
+static const uint8_t unbase64_table[256] = {
+	WS, XX, XX, XX, XX, XX, XX, XX, XX, WS, WS, XX, XX, WS, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	WS, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, PD, XX, XX,
+	XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+	XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+#undef XX
+#undef PD
+#undef WS
+
 static char base64char(int x)
 {
-	static const char table[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-				      "abcdefghijklmnopqrstuvwxyz"
-				      "0123456789+/";
-	return table[x & 63];
+	return base64_table[x & 63];
 }
 
 static int unbase64char(char c)
 {
-	unsigned offset;
-
-	if (c >= 'A' && c <= 'Z')
-		return c - 'A';
-
-	offset = 'Z' - 'A' + 1;
-
-	if (c >= 'a' && c <= 'z')
-		return c - 'a' + offset;
-
-	offset += 'z' - 'a' + 1;
-
-	if (c >= '0' && c <= '9')
-		return c - '0' + offset;
+	uint8_t v = unbase64_table[(unsigned char)c];
 
-	offset += '9' - '0' + 1;
-
-	if (c == '+')
-		return offset;
-
-	offset++;
-
-	if (c == '/')
-		return offset;
+	return (v & B64_SPECIAL) ? -EINVAL : v;
+}
 
-	return -EINVAL;
+static int base64_whitespace(char c)
+{
+	return unbase64_table[(unsigned char)c] == B64_WS;
 }
 
 int crypt_base64_encode(char **out, size_t *out_length, const char *in, size_t in_length)
 {
 	char *r, *z;
 	const uint8_t *x;
+	uint32_t w;
 
 	assert(in || in_length == 0);
 	assert(out);
@@ -84,10 +101,12 @@ int crypt_base64_encode(char **out, size_t *out_length, const char *in, size_t i
 
 	for (x = (const uint8_t *)in; x < (const uint8_t*)in + (in_length / 3) * 3; x += 3) {
 		/* x[0] == XXXXXXXX; x[1] == YYYYYYYY; x[2] == ZZZZZZZZ */
-		*(z++) = base64char(x[0] >> 2);                    /* 00XXXXXX */
-		*(z++) = base64char((x[0] & 3) << 4 | x[1] >> 4);  /* 00XXYYYY */
-		*(z++) = base64char((x[1] & 15) << 2 | x[2] >> 6); /* 00YYYYZZ */
-		*(z++) = base64char(x[2] & 63);                    /* 00ZZZZZZ */
+		w = (uint32_t)x[0] << 16 | (uint32_t)x[1] << 8 | x[2];
+		z[0] = base64_table[w >> 18];        /* 00XXXXXX */
+		z[1] = base64_table[(w >> 12) & 63]; /* 00XXYYYY */
+		z[2] = base64_table[(w >> 6) & 63];  /* 00YYYYZZ */
+		z[3] = base64_table[w & 63];         /* 00ZZZZZZ */
+		z += 4;
 	}
 
 	switch (in_length % 3) {
@@ -128,7 +147,7 @@ static int unbase64_next(const char **p, size_t *l)
 		if (*l == 0)
 			return -EPIPE;
 
-		if (!strchr(WHITESPACE, **p))
+		if (!base64_whitespace(**p))
 			break;
 
 		/* Skip leading whitespace */
@@ -148,7 +167,7 @@ static int unbase64_next(const char **p, size_t *l)
 
 		if (*l == 0)
 			break;
-		if (!strchr(WHITESPACE, **p))
+		if (!base64_whitespace(**p))
 			break;
 
 		/* Skip following whitespace */
@@ -180,7 +199,33 @@ int crypt_base64_decode(char **out, size_t *out_length, const char *in, size_t i
 	if (!buf)
 		return -ENOMEM;
 
-	for (x = in, z = buf;;) {
+	x = in;
+	z = buf;
+
+	/*
+	 * Fast path for complete groups of four base64 characters. It stops on the first
+	 * group with padding, whitespace or an invalid character; the rest of input is
+	 * processed by the strict character by character loop below.
+	 */
+	while (in_length >= 4) {
+		uint32_t a = unbase64_table[(unsigned char)x[0]],
+			 b = unbase64_table[(unsigned char)x[1]],
+			 c = unbase64_table[(unsigned char)x[2]],
+			 d = unbase64_table[(unsigned char)x[3]], w;
+
+		if ((a | b | c | d) & B64_SPECIAL)
+			break;
+
+		w = a << 18 | b << 12 | c << 6 | d;
+		z[0] = (uint8_t)(w >> 16);
+		z[1] = (uint8_t)(w >> 8);
+		z[2] = (uint8_t)w;
+		z += 3;
+		x += 4;
+		in_length -= 4;
+	}
+
+	for (;;) {
 		int a, b, c, d; /* a == 00XXXXXX; b == 00YYYYYY; c == 00ZZZZZZ; d == 00WWWWWW */
 
 		a = unbase64_next(&x, &in_length);
@@ -0,0 +1,225 @@
+/*
+ * ChaCha20 keystream generator (for bulk random data)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crypto_backend_internal.h"
+
+#define CHACHA20_KEY_SIZE	32
+#define CHACHA20_NONCE_SIZE	8
+#define CHACHA20_BLOCK_SIZE	64
+
+/*
+ * Original ChaCha20 variant with 64-bit nonce and 64-bit block counter,
+ * so the keystream cannot wrap for any device size.
+ */
+struct crypt_chacha20 {
+	uint32_t state[16];
+	uint8_t block[CHACHA20_BLOCK_SIZE];	/* unused rest of the last block */
+	unsigned int used;
+};
+
+static inline uint32_t rotl32(uint32_t v, int c)
+{
+	return (v << c) | (v >> (32 - c));
+}
+
+static inline uint32_t load32_le(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32_le(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d = rotl32(d ^ a, 16); \
+	c += d; b = rotl32(b ^ c, 12); \
+	a += b; d = rotl32(d ^ a, 8);  \
+	c += d; b = rotl32(b ^ c, 7)
+
+static void chacha20_block(uint32_t *state, uint8_t *out)
+{
+	uint32_t x[16];
+	int i;
+
+	memcpy(x, state, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8],  x[12]);
+		QUARTERROUND(x[1], x[5], x[9],  x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8],  x[13]);
+		QUARTERROUND(x[3], x[4], x[9],  x[14]);
+	}
+
+	for (i = 0; i < 16; i++)
+		store32_le(&out[i * 4], x[i] + state[i]);
+
+	if (!++state[12])
+		state[13]++;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+/*
+ * Four consecutive blocks computed at once, one block per vector lane
+ * (generic vector extension, SSE2 or NEON code is generated where available).
+ */
+#define CHACHA20_LANES	4
+
+typedef uint32_t chacha_v4 __attribute__((vector_size(16)));
+
+static inline chacha_v4 rotl_v4(chacha_v4 v, int c)
+{
+	return (v << c) | (v >> (32 - c));
+}
+
+#define QUARTERROUND_V4(a, b, c, d) \
+	a += b; d = rotl_v4(d ^ a, 16); \
+	c += d; b = rotl_v4(b ^ c, 12); \
+	a += b; d = rotl_v4(d ^ a, 8);  \
+	c += d; b = rotl_v4(b ^ c, 7)
+
+static void chacha20_blocks4(uint32_t *state, uint8_t *out)
+{
+	chacha_v4 x[16], s[16];
+	uint64_t counter = state[12] | ((uint64_t)state[13] << 32);
+	int i, l;
+
+	for (i = 0; i < 16; i++)
+		s[i] = (chacha_v4){ state[i], state[i], state[i], state[i] };
+	for (l = 0; l < CHACHA20_LANES; l++) {
+		s[12][l] = (counter + l) & 0xffffffff;
+		s[13][l] = (counter + l) >> 32;
+	}
+	memcpy(x, s, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+		QUARTERROUND_V4(x[0], x[4], x[8],  x[12]);
+		QUARTERROUND_V4(x[1], x[5], x[9],  x[13]);
+		QUARTERROUND_V4(x[2], x[6], x[10], x[14]);
+		QUARTERROUND_V4(x[3], x[7], x[11], x[15]);
+		QUARTERROUND_V4(x[0], x[5], x[10], x[15]);
+		QUARTERROUND_V4(x[1], x[6], x[11], x[12]);
+		QUARTERROUND_V4(x[2], x[7], x[8],  x[13]);
+		QUARTERROUND_V4(x[3], x[4], x[9],  x[14]);
+	}
+
+	for (i = 0; i < 16; i++)
+		x[i] += s[i];
+
+	for (l = 0; l < CHACHA20_LANES; l++)
+		for (i = 0; i < 16; i++)
+			store32_le(&out[l * CHACHA20_BLOCK_SIZE + i * 4], x[i][l]);
+
+	counter += CHACHA20_LANES;
+	state[12] = counter & 0xffffffff;
+	state[13] = counter >> 32;
+}
+#endif
+
+int crypt_chacha20_init(struct crypt_chacha20 **ctx, const char *key, size_t key_length,
+			const char *nonce, size_t nonce_length)
+{
+	static const char sigma[16] = "expand 32-byte k";
+	struct crypt_chacha20 *h;
+	int i;
+
+	if (key_length != CHACHA20_KEY_SIZE || nonce_length != CHACHA20_NONCE_SIZE)
+		return -EINVAL;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	for (i = 0; i < 4; i++)
+		h->state[i] = load32_le((const uint8_t *)&sigma[i * 4]);
+	for (i = 0; i < 8; i++)
+		h->state[4 + i] = load32_le((const uint8_t *)&key[i * 4]);
+	h->state[12] = h->state[13] = 0;
+	h->state[14] = load32_le((const uint8_t *)&nonce[0]);
+	h->state[15] = load32_le((const uint8_t *)&nonce[4]);
+	h->used = CHACHA20_BLOCK_SIZE;
+
+	*ctx = h;
+	return 0;
+}
+
+/* Set 64-bit block counter (the keystream position in 64 bytes blocks) */
+void crypt_chacha20_seek(struct crypt_chacha20 *ctx, uint64_t block)
+{
+	ctx->state[12] = block & 0xffffffff;
+	ctx->state[13] = block >> 32;
+	ctx->used = CHACHA20_BLOCK_SIZE;
+}
+
+void crypt_chacha20_keystream(struct crypt_chacha20 *ctx, char *out, size_t length)
+{
+	uint8_t *p = (uint8_t *)out;
+	size_t len;
+
+	if (ctx->used < CHACHA20_BLOCK_SIZE) {
+		len = CHACHA20_BLOCK_SIZE - ctx->used;
+		if (len > length)
+			len = length;
+		memcpy(p, &ctx->block[ctx->used], len);
+		ctx->used += len;
+		p += len;
+		length -= len;
+	}
+
+#ifdef CHACHA20_LANES
+	while (length >= CHACHA20_LANES * CHACHA20_BLOCK_SIZE) {
+		chacha20_blocks4(ctx->state, p);
+		p += CHACHA20_LANES * CHACHA20_BLOCK_SIZE;
+		length -= CHACHA20_LANES * CHACHA20_BLOCK_SIZE;
+	}
+#endif
+	while (length >= CHACHA20_BLOCK_SIZE) {
+		chacha20_block(ctx->state, p);
+		p += CHACHA20_BLOCK_SIZE;
+		length -= CHACHA20_BLOCK_SIZE;
+	}
+
+	if (length) {
+		chacha20_block(ctx->state, ctx->block);
+		memcpy(p, ctx->block, length);
+		ctx->used = length;
+	}
+}
+
+void crypt_chacha20_destroy(struct crypt_chacha20 *ctx)
+{
+	if (!ctx)
+		return;
+
+	crypt_backend_memzero(ctx, sizeof(*ctx));
+	free(ctx);
+}
@@ -0,0 +1,392 @@
+/*
+ * Native AES-XTS and AES-CBC sector engine (x86 AES-NI)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crypto_backend_internal.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+#include <immintrin.h>
+
+#define AESNI __attribute__((target("aes,sse2")))
+
+#define AES_BLOCK_SIZE	16
+#define AES_MAX_ROUNDS	14
+
+enum { AES_NATIVE_XTS, AES_NATIVE_CBC };
+
+struct crypt_aes_native {
+	int mode;
+	unsigned rounds;
+	__m128i ek[AES_MAX_ROUNDS + 1];	/* data encryption key schedule */
+	__m128i dk[AES_MAX_ROUNDS + 1];	/* data decryption key schedule */
+	__m128i tk[AES_MAX_ROUNDS + 1];	/* XTS tweak key schedule */
+};
+
+/* Key expansion as described in the Intel AES-NI white paper */
+static AESNI __m128i aes128_assist(__m128i t1, __m128i t2)
+{
+	__m128i t3;
+
+	t2 = _mm_shuffle_epi32(t2, 0xff);
+	t3 = _mm_slli_si128(t1, 0x4);
+	t1 = _mm_xor_si128(t1, t3);
+	t3 = _mm_slli_si128(t3, 0x4);
+	t1 = _mm_xor_si128(t1, t3);
+	t3 = _mm_slli_si128(t3, 0x4);
+	t1 = _mm_xor_si128(t1, t3);
+
+	return _mm_xor_si128(t1, t2);
+}
+
+static AESNI void aes128_expand(__m128i *k, const void *key)
+{
+	__m128i t = _mm_loadu_si128((const __m128i *)key);
+
+	k[0] = t;
+	k[1] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x01));
+	k[2] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x02));
+	k[3] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x04));
+	k[4] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x08));
+	k[5] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x10));
+	k[6] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x20));
+	k[7] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x40));
+	k[8] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x80));
+	k[9] = t = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x1b));
+	k[10] = aes128_assist(t, _mm_aeskeygenassist_si128(t, 0x36));
+}
+
+static AESNI __m128i aes256_assist1(__m128i t1, __m128i t2)
+{
+	__m128i t4;
+
+	t2 = _mm_shuffle_epi32(t2, 0xff);
+	t4 = _mm_slli_si128(t1, 0x4);
+	t1 = _mm_xor_si128(t1, t4);
+	t4 = _mm_slli_si128(t4, 0x4);
+	t1 = _mm_xor_si128(t1, t4);
+	t4 = _mm_slli_si128(t4, 0x4);
+	t1 = _mm_xor_si128(t1, t4);
+
+	return _mm_xor_si128(t1, t2);
+}
+
+static AESNI __m128i aes256_assist2(__m128i t1, __m128i t3)
+{
+	__m128i t2, t4;
+
+	t4 = _mm_aeskeygenassist_si128(t1, 0x0);
+	t2 = _mm_shuffle_epi32(t4, 0xaa);
+	t4 = _mm_slli_si128(t3, 0x4);
+	t3 = _mm_xor_si128(t3, t4);
+	t4 = _mm_slli_si128(t4, 0x4);
+	t3 = _mm_xor_si128(t3, t4);
+	t4 = _mm_slli_si128(t4, 0x4);
+	t3 = _mm_xor_si128(t3, t4);
+
+	return _mm_xor_si128(t3, t2);
+}
+
+static AESNI void aes256_expand(__m128i *k, const void *key)
+{
+	__m128i t1 = _mm_loadu_si128((const __m128i *)key);
+	__m128i t3 = _mm_loadu_si128((const __m128i *)key + 1);
+
+	k[0] = t1;
+	k[1] = t3;
+	k[2] = t1 = aes256_assist1(t1, _mm_aeskeygenassist_si128(t3, 0x01));
+	k[3] = t3 = aes256_assist2(t1, t3);
+	k[4] = t1 = aes256_assist1(t1, _mm_aeskeygenassist_si128(t3, 0x02));
+	k[5] = t3 = aes256_assist2(t1, t3);
+	k[6] = t1 = aes256_assist1(t1, _mm_aeskeygenassist_si128(t3, 0x04));
+	k[7] = t3 = aes256_assist2(t1, t3);
+	k[8] = t1 = aes256_assist1(t1, _mm_aeskeygenassist_si128(t3, 0x08));
+	k[9] = t3 = aes256_assist2(t1, t3);
+	k[10] = t1 = aes256_assist1(t1, _mm_aeskeygenassist_si128(t3, 0x10));
+	k[11] = t3 = aes256_assist2(t1, t3);
+	k[12] = t1 = aes256_assist1(t1, _mm_aeskeygenassist_si128(t3, 0x20));
+	k[13] = aes256_assist2(t1, t3);
+	k[14] = aes256_assist1(t1, _mm_aeskeygenassist_si128(k[13], 0x40));
+}
+
+static AESNI int aes_expand(__m128i *k, unsigned *rounds, const void *key, size_t key_length)
+{
+	if (key_length == 16) {
+		aes128_expand(k, key);
+		*rounds = 10;
+	} else if (key_length == 32) {
+		aes256_expand(k, key);
+		*rounds = 14;
+	} else
+		return -ENOTSUP;
+
+	return 0;
+}
+
+static AESNI void aes_decrypt_keys(__m128i *dk, const __m128i *ek, unsigned rounds)
+{
+	unsigned i;
+
+	dk[0] = ek[rounds];
+	for (i = 1; i < rounds; i++)
+		dk[i] = _mm_aesimc_si128(ek[rounds - i]);
+	dk[rounds] = ek[0];
+}
+
+static AESNI __m128i aes_enc1(const __m128i *k, unsigned rounds, __m128i b)
+{
+	unsigned i;
+
+	b = _mm_xor_si128(b, k[0]);
+	for (i = 1; i < rounds; i++)
+		b = _mm_aesenc_si128(b, k[i]);
+
+	return _mm_aesenclast_si128(b, k[rounds]);
+}
+
+static AESNI __m128i aes_dec1(const __m128i *k, unsigned rounds, __m128i b)
+{
+	unsigned i;
+
+	b = _mm_xor_si128(b, k[0]);
+	for (i = 1; i < rounds; i++)
+		b = _mm_aesdec_si128(b, k[i]);
+
+	return _mm_aesdeclast_si128(b, k[rounds]);
+}
+
+/* Four independent blocks interleaved to hide AES instruction latency */
+static AESNI void aes_crypt4(const __m128i *k, unsigned rounds, __m128i *b, bool encrypt)
+{
+	unsigned i;
+
+	b[0] = _mm_xor_si128(b[0], k[0]);
+	b[1] = _mm_xor_si128(b[1], k[0]);
+	b[2] = _mm_xor_si128(b[2], k[0]);
+	b[3] = _mm_xor_si128(b[3], k[0]);
+
+	if (encrypt) {
+		for (i = 1; i < rounds; i++) {
+			b[0] = _mm_aesenc_si128(b[0], k[i]);
+			b[1] = _mm_aesenc_si128(b[1], k[i]);
+			b[2] = _mm_aesenc_si128(b[2], k[i]);
+			b[3] = _mm_aesenc_si128(b[3], k[i]);
+		}
+		b[0] = _mm_aesenclast_si128(b[0], k[rounds]);
+		b[1] = _mm_aesenclast_si128(b[1], k[rounds]);
+		b[2] = _mm_aesenclast_si128(b[2], k[rounds]);
+		b[3] = _mm_aesenclast_si128(b[3], k[rounds]);
+	} else {
+		for (i = 1; i < rounds; i++) {
+			b[0] = _mm_aesdec_si128(b[0], k[i]);
+			b[1] = _mm_aesdec_si128(b[1], k[i]);
+			b[2] = _mm_aesdec_si128(b[2], k[i]);
+			b[3] = _mm_aesdec_si128(b[3], k[i]);
+		}
+		b[0] = _mm_aesdeclast_si128(b[0], k[rounds]);
+		b[1] = _mm_aesdeclast_si128(b[1], k[rounds]);
+		b[2] = _mm_aesdeclast_si128(b[2], k[rounds]);
+		b[3] = _mm_aesdeclast_si128(b[3], k[rounds]);
+	}
+}
+
+/* XTS tweak multiplication by x in GF(2^128), little endian */
+static AESNI __m128i xts_next_tweak(__m128i t)
+{
+	__m128i carry = _mm_srai_epi32(t, 31);
+
+	carry = _mm_shuffle_epi32(carry, 0x93);
+	carry = _mm_and_si128(carry, _mm_set_epi32(1, 1, 1, 0x87));
+
+	return _mm_xor_si128(_mm_slli_epi32(t, 1), carry);
+}
+
+static AESNI void xts_crypt(struct crypt_aes_native *ctx, char *buffer,
+			    size_t length, const char *iv, bool encrypt)
+{
+	const __m128i *k = encrypt ? ctx->ek : ctx->dk;
+	__m128i *p = (__m128i *)buffer;
+	__m128i t[4], b[4];
+	size_t i, j, blocks = length / AES_BLOCK_SIZE;
+
+	t[0] = aes_enc1(ctx->tk, ctx->rounds, _mm_loadu_si128((const __m128i *)iv));
+
+	for (i = 0; i + 4 <= blocks; i += 4) {
+		t[1] = xts_next_tweak(t[0]);
+		t[2] = xts_next_tweak(t[1]);
+		t[3] = xts_next_tweak(t[2]);
+
+		for (j = 0; j < 4; j++)
+			b[j] = _mm_xor_si128(_mm_loadu_si128(&p[i + j]), t[j]);
+
+		aes_crypt4(k, ctx->rounds, b, encrypt);
+
+		for (j = 0; j < 4; j++)
+			_mm_storeu_si128(&p[i + j], _mm_xor_si128(b[j], t[j]));
+
+		t[0] = xts_next_tweak(t[3]);
+	}
+
+	for (; i < blocks; i++) {
+		b[0] = _mm_xor_si128(_mm_loadu_si128(&p[i]), t[0]);
+		b[0] = encrypt ? aes_enc1(k, ctx->rounds, b[0]) : aes_dec1(k, ctx->rounds, b[0]);
+		_mm_storeu_si128(&p[i], _mm_xor_si128(b[0], t[0]));
+		t[0] = xts_next_tweak(t[0]);
+	}
+}
+
+static AESNI void cbc_encrypt(struct crypt_aes_native *ctx, char *buffer,
+			      size_t length, const char *iv)
+{
+	__m128i *p = (__m128i *)buffer;
+	__m128i c = _mm_loadu_si128((const __m128i *)iv);
+	size_t i, blocks = length / AES_BLOCK_SIZE;
+
+	/* CBC encryption is serial by definition */
+	for (i = 0; i < blocks; i++) {
+		c = aes_enc1(ctx->ek, ctx->rounds, _mm_xor_si128(_mm_loadu_si128(&p[i]), c));
+		_mm_storeu_si128(&p[i], c);
+	}
+}
+
+static AESNI void cbc_decrypt(struct crypt_aes_native *ctx, char *buffer,
+			      size_t length, const char *iv)
+{
+	__m128i *p = (__m128i *)buffer;
+	__m128i prev = _mm_loadu_si128((const __m128i *)iv);
+	__m128i c[4], b[4];
+	size_t i, j, blocks = length / AES_BLOCK_SIZE;
+
+	for (i = 0; i + 4 <= blocks; i += 4) {
+		for (j = 0; j < 4; j++)
+			b[j] = c[j] = _mm_loadu_si128(&p[i + j]);
+
+		aes_crypt4(ctx->dk, ctx->rounds, b, false);
+
+		_mm_storeu_si128(&p[i], _mm_xor_si128(b[0], prev));
+		for (j = 1; j < 4; j++)
+			_mm_storeu_si128(&p[i + j], _mm_xor_si128(b[j], c[j - 1]));
+		prev = c[3];
+	}
+
+	for (; i < blocks; i++) {
+		c[0] = _mm_loadu_si128(&p[i]);
+		_mm_storeu_si128(&p[i], _mm_xor_si128(aes_dec1(ctx->dk, ctx->rounds, c[0]), prev));
+		prev = c[0];
+	}
+}
+
+static AESNI int aes_native_setkey(struct crypt_aes_native *ctx, const char *key, size_t key_length)
+{
+	unsigned tweak_rounds;
+	int r;
+
+	if (ctx->mode == AES_NATIVE_XTS) {
+		key_length /= 2;
+		r = aes_expand(ctx->tk, &tweak_rounds, key + key_length, key_length);
+		if (r)
+			return r;
+	}
+
+	r = aes_expand(ctx->ek, &ctx->rounds, key, key_length);
+	if (r)
+		return r;
+
+	aes_decrypt_keys(ctx->dk, ctx->ek, ctx->rounds);
+
+	return 0;
+}
+
+int crypt_aes_native_init(struct crypt_aes_native **ctx, const char *name,
+			  const char *mode, const void *key, size_t key_length)
+{
+	struct crypt_aes_native *h;
+	int r;
+
+	if (!ctx || !name || !mode || !key)
+		return -EINVAL;
+
+	if (strcmp(name, "aes") || (strcmp(mode, "xts") && strcmp(mode, "cbc")))
+		return -ENOTSUP;
+
+	if (!crypt_cpu_has(CRYPT_CPU_AES | CRYPT_CPU_SSE2))
+		return -ENOTSUP;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+	memset(h, 0, sizeof(*h));
+
+	h->mode = strcmp(mode, "xts") ? AES_NATIVE_CBC : AES_NATIVE_XTS;
+
+	r = aes_native_setkey(h, key, key_length);
+	if (r) {
+		crypt_aes_native_destroy(h);
+		return r;
+	}
+
+	*ctx = h;
+	return 0;
+}
+
+void crypt_aes_native_destroy(struct crypt_aes_native *ctx)
+{
+	if (!ctx)
+		return;
+
+	crypt_backend_memzero(ctx, sizeof(*ctx));
+	free(ctx);
+}
+
+int crypt_aes_native_crypt(struct crypt_aes_native *ctx, char *buffer,
+			   size_t length, const char *iv, bool encrypt)
+{
+	if (!ctx || !buffer || !iv || length % AES_BLOCK_SIZE)
+		return -EINVAL;
+
+	if (ctx->mode == AES_NATIVE_XTS)
+		xts_crypt(ctx, buffer, length, iv, encrypt);
+	else if (encrypt)
+		cbc_encrypt(ctx, buffer, length, iv);
+	else
+		cbc_decrypt(ctx, buffer, length, iv);
+
+	return 0;
+}
+
+#else /* AES-NI */
+int crypt_aes_native_init(struct crypt_aes_native **ctx, const char *name,
+			  const char *mode, const void *key, size_t key_length)
+{
+	return -ENOTSUP;
+}
+
+void crypt_aes_native_destroy(struct crypt_aes_native *ctx)
+{
+}
+
+int crypt_aes_native_crypt(struct crypt_aes_native *ctx, char *buffer,
+			   size_t length, const char *iv, bool encrypt)
+{
+	return -EINVAL;
+}
+#endif
@@ -20,7 +20,11 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "crypto_backend_internal.h"
 
 #ifndef CLOCK_MONOTONIC_RAW
@@ -56,10 +60,10 @@ static int time_ms(struct timespec *start, struct timespec *end, double *ms)
 }
 
 static int cipher_perf_one(const char *name, const char *mode, char *buffer, size_t buffer_size,
-			  const char *key, size_t key_size, const char *iv, size_t iv_size, int enc)
+			  size_t block, const char *key, size_t key_size, const char *iv, size_t iv_size, int enc)
 {
 	struct crypt_cipher_kernel cipher;
-	size_t done = 0, block = CIPHER_BLOCK_BYTES;
+	size_t done = 0;
 	int r;
 
 	if (buffer_size < block)
@@ -103,7 +107,8 @@ static int cipher_measure(const char *name, const char *mode, char *buffer, size
 	if (clock_gettime(CLOCK_MONOTONIC_RAW, &start) < 0)
 		return -EINVAL;
 
-	r = cipher_perf_one(name, mode, buffer, buffer_size, key, key_size, iv, iv_size, encrypt);
+	r = cipher_perf_one(name, mode, buffer, buffer_size, CIPHER_BLOCK_BYTES,
+			    key, key_size, iv, iv_size, encrypt);
 	if (r < 0)
 		return r;
 
@@ -159,3 +164,105 @@ int crypt_cipher_perf_kernel(const char *name, const char *mode, char *buffer, s
 
 	return  0;
 }
+
+struct cipher_perf_thread {
+	pthread_t thread;
+	const char *name;
+	const char *mode;
+	size_t buffer_size;
+	size_t block_size;
+	const char *key;
+	size_t key_size;
+	const char *iv;
+	size_t iv_size;
+	double mbs[2];
+	int r;
+};
+
+static void *cipher_perf_thread_run(void *arg)
+{
+	struct cipher_perf_thread *t = arg;
+	struct timespec start, end;
+	void *buffer = NULL;
+	uint64_t bytes;
+	double ms = 0.0;
+	int enc;
+
+	if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), t->buffer_size)) {
+		t->r = -ENOMEM;
+		return NULL;
+	}
+	memset(buffer, 0, t->buffer_size);
+
+	for (enc = 1; enc >= 0 && !t->r; enc--) {
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &start) < 0) {
+			t->r = -EINVAL;
+			break;
+		}
+
+		bytes = 0;
+		do {
+			t->r = cipher_perf_one(t->name, t->mode, buffer, t->buffer_size, t->block_size,
+					       t->key, t->key_size, t->iv, t->iv_size, enc);
+			if (t->r < 0 || clock_gettime(CLOCK_MONOTONIC_RAW, &end) < 0)
+				break;
+			bytes += t->buffer_size;
+			time_ms(&start, &end, &ms);
+		} while (ms < 1000.0);
+
+		if (!t->r)
+			t->mbs[enc] = speed_mbs(bytes, ms);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Aggregate throughput of threads running concurrently, each with its own
+ * buffer and cipher context and one request per block (sector) like dm-crypt.
+ */
+int crypt_cipher_perf_kernel_parallel(const char *name, const char *mode,
+				      size_t buffer_size, size_t block_size, unsigned int threads,
+				      const char *key, size_t key_size, const char *iv, size_t iv_size,
+				      double *encryption_mbs, double *decryption_mbs)
+{
+	struct cipher_perf_thread *t;
+	unsigned int i, started;
+	int r = 0;
+
+	if (!threads || !block_size || block_size > buffer_size ||
+	    !encryption_mbs || !decryption_mbs)
+		return -EINVAL;
+
+	t = calloc(threads, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	for (started = 0; started < threads; started++) {
+		t[started].name = name;
+		t[started].mode = mode;
+		t[started].buffer_size = buffer_size - buffer_size % block_size;
+		t[started].block_size = block_size;
+		t[started].key = key;
+		t[started].key_size = key_size;
+		t[started].iv = iv;
+		t[started].iv_size = iv_size;
+		if (pthread_create(&t[started].thread, NULL, cipher_perf_thread_run, &t[started])) {
+			r = -ENOMEM;
+			break;
+		}
+	}
+
+	*encryption_mbs = *decryption_mbs = 0.0;
+	for (i = 0; i < started; i++) {
+		pthread_join(t[i].thread, NULL);
+		if (t[i].r < 0 && !r)
+			r = t[i].r;
+		*encryption_mbs += t[i].mbs[1];
+		*decryption_mbs += t[i].mbs[0];
+	}
+
+	free(t);
+	return r;
+}
@@ -0,0 +1,115 @@
+/*
+ * Runtime CPU feature detection
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pthread.h>
+#include "cpu_features.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#define CPU_X86 1
+#endif
+
+#if defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#include <sys/auxv.h>
+#ifndef HWCAP_ASIMD
+#define HWCAP_ASIMD (1 << 1)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CPU_ARM 1
+#endif
+
+/* XCR0 state components: SSE, AVX (YMM), AVX-512 (opmask, ZMM_Hi256, Hi16_ZMM) */
+#define XCR0_YMM	0x06
+#define XCR0_ZMM	0xe6
+
+static uint32_t cpu_features;
+static pthread_once_t cpu_features_once = PTHREAD_ONCE_INIT;
+
+#if CPU_X86
+static uint32_t xcr0_read(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return lo;
+}
+
+static void cpu_features_detect(void)
+{
+	unsigned int eax, ebx, ecx, edx, ebx7 = 0;
+	uint32_t xcr0 = 0;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+
+	if (edx & bit_SSE2)
+		cpu_features |= CRYPT_CPU_SSE2;
+	if (ecx & bit_SSSE3)
+		cpu_features |= CRYPT_CPU_SSSE3;
+	if (ecx & bit_SSE4_1)
+		cpu_features |= CRYPT_CPU_SSE41;
+	if (ecx & bit_AES)
+		cpu_features |= CRYPT_CPU_AES;
+	if (ecx & bit_PCLMUL)
+		cpu_features |= CRYPT_CPU_PCLMUL;
+
+	/* Without OSXSAVE the OS does not save YMM/ZMM registers on context switch */
+	if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX))
+		xcr0 = xcr0_read();
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		ebx7 = ebx;
+
+	if (ebx7 & bit_SHA)
+		cpu_features |= CRYPT_CPU_SHA;
+	if ((ebx7 & bit_AVX2) && (xcr0 & XCR0_YMM) == XCR0_YMM)
+		cpu_features |= CRYPT_CPU_AVX2;
+	if ((ebx7 & bit_AVX512F) && (xcr0 & XCR0_ZMM) == XCR0_ZMM)
+		cpu_features |= CRYPT_CPU_AVX512F;
+}
+#elif CPU_ARM
+static void cpu_features_detect(void)
+{
+	unsigned long hwcap = getauxval(AT_HWCAP);
+
+	if (hwcap & HWCAP_ASIMD)
+		cpu_features |= CRYPT_CPU_ARM_ASIMD;
+	if (hwcap & HWCAP_SHA2)
+		cpu_features |= CRYPT_CPU_ARM_SHA2;
+	if (hwcap & HWCAP_CRC32)
+		cpu_features |= CRYPT_CPU_ARM_CRC32;
+}
+#else
+static void cpu_features_detect(void)
+{
+}
+#endif
+
+bool crypt_cpu_has(uint32_t features)
+{
+	pthread_once(&cpu_features_once, cpu_features_detect);
+
+	return (cpu_features & features) == features;
+}
@@ -0,0 +1,46 @@
+/*
+ * Runtime CPU feature detection
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _CRYPTO_CPU_FEATURES_H
+#define _CRYPTO_CPU_FEATURES_H
+
+/* Kept C89 clean, it is included by the bundled Argon2 code as well */
+#include <stdbool.h>
+#include <stdint.h>
+
+/* x86 (AVX2 and AVX512F also require the OS to save the extended state) */
+#define CRYPT_CPU_SSE2		(1 << 0)
+#define CRYPT_CPU_SSSE3		(1 << 1)
+#define CRYPT_CPU_SSE41		(1 << 2)
+#define CRYPT_CPU_AES		(1 << 3)
+#define CRYPT_CPU_PCLMUL	(1 << 4)
+#define CRYPT_CPU_SHA		(1 << 5)
+#define CRYPT_CPU_AVX2		(1 << 6)
+#define CRYPT_CPU_AVX512F	(1 << 7)
+
+/* ARMv8 */
+#define CRYPT_CPU_ARM_ASIMD	(1 << 16)
+#define CRYPT_CPU_ARM_SHA2	(1 << 17)
+#define CRYPT_CPU_ARM_CRC32	(1 << 18)
+
+/* All requested features are usable, detected once per process */
+bool crypt_cpu_has(uint32_t features);
+
+#endif /* _CRYPTO_CPU_FEATURES_H */
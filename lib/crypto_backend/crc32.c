@@ -39,9 +39,24 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "crypto_backend.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CRC32_X86 1
+#define PCLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
+
+#if defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#include <arm_acle.h>
+#define CRC32_ARM 1
+#define CRC32 __attribute__((target("+crc")))
+#endif
+
 static const uint32_t crc32_tab[] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
 	0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
@@ -97,6 +112,158 @@ static const uint32_t crc32_tab[] = {
 	0x2d02ef8dL
 };
 
+/* Slicing-by-8 tables, the first one is crc32_tab */
+static uint32_t crc32_tab8[8][256];
+static pthread_once_t crc32_tab8_once = PTHREAD_ONCE_INIT;
+
+static void crc32_tab8_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc32_tab8[0][i] = crc32_tab[i];
+
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc32_tab8[k][i] = (crc32_tab8[k - 1][i] >> 8) ^
+					   crc32_tab[crc32_tab8[k - 1][i] & 0xff];
+}
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t one, two;
+
+	pthread_once(&crc32_tab8_once, crc32_tab8_init);
+
+	while (len >= 8) {
+		one = get_le32(p) ^ crc;
+		two = get_le32(p + 4);
+		crc = crc32_tab8[7][one & 0xff] ^
+		      crc32_tab8[6][(one >> 8) & 0xff] ^
+		      crc32_tab8[5][(one >> 16) & 0xff] ^
+		      crc32_tab8[4][one >> 24] ^
+		      crc32_tab8[3][two & 0xff] ^
+		      crc32_tab8[2][(two >> 8) & 0xff] ^
+		      crc32_tab8[1][(two >> 16) & 0xff] ^
+		      crc32_tab8[0][two >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = crc32_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if CRC32_X86
+#define CRC32_PCLMUL_MIN 64
+
+/*
+ * Carry-less multiplication folding (Intel "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction"), constants for the reflected
+ * polynomial 0xedb88320. Length must be at least 64 and multiple of 16.
+ */
+static PCLMUL uint32_t crc32_pclmul(uint32_t crc, const unsigned char *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8, k;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	len -= 64;
+
+	/* fold by 4 x 128 bits */
+	k = k1k2;
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* fold into 128 bits */
+	k = k3k4;
+	x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+		p += 16;
+		len -= 16;
+	}
+
+	/* fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+#if CRC32_ARM
+/* ARMv8 CRC32 instructions use the same (not Castagnoli) polynomial */
+static CRC32 uint32_t crc32_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, v);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = __crc32b(crc, *p++);
+
+	return crc;
+}
+#endif
+
 /*
  * This a generic crc32() function, it takes seed as an argument,
  * and does __not__ xor at the end. Then individual users can do
@@ -104,11 +271,27 @@ static const uint32_t crc32_tab[] = {
  */
 uint32_t crypt_crc32(uint32_t seed, const unsigned char *buf, size_t len)
 {
-	uint32_t crc = seed;
-	const unsigned char *p = buf;
+#if CRC32_X86
+	if (len >= CRC32_PCLMUL_MIN && crypt_cpu_has(CRYPT_CPU_PCLMUL | CRYPT_CPU_SSE41)) {
+		size_t bulk = len & ~(size_t)15;
 
-	while(len-- > 0)
-		crc = crc32_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		seed = crc32_pclmul(seed, buf, bulk);
+		buf += bulk;
+		len -= bulk;
+	}
+#elif CRC32_ARM
+	if (crypt_cpu_has(CRYPT_CPU_ARM_CRC32))
+		return crc32_armv8(seed, buf, len);
+#endif
+	return crc32_slice8(seed, buf, len);
+}
 
-	return crc;
+/* Stores running CRC after every byte (TCRYPT keyfile pool needs it) */
+void crypt_crc32_trace(uint32_t seed, const unsigned char *buf, size_t len, uint32_t *crcs)
+{
+	uint32_t crc = seed;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		crcs[i] = crc = crc32_tab[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
 }
@@ -32,6 +32,8 @@
 #define char16_t uint16_t
 #endif
 
+#include "cpu_features.h"
+
 struct crypt_hash;
 struct crypt_hmac;
 struct crypt_cipher;
@@ -51,6 +53,10 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name);
 int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length);
 int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length);
 void crypt_hash_destroy(struct crypt_hash *ctx);
+/* drop written data, context is as after init */
+int crypt_hash_reset(struct crypt_hash *ctx);
+/* copy current state (e.g. after salt prefix) of src to dst of the same algorithm */
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src);
 
 /* HMAC */
 int crypt_hmac_size(const char *name);
@@ -78,6 +84,10 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		const char *salt, size_t salt_length,
 		char *key, size_t key_length,
 		uint32_t iterations, uint32_t memory, uint32_t parallel);
+/* Interleave Argon2 memory over NUMA nodes in PBKDF calls of the calling thread */
+void crypt_pbkdf_numa_interleave(bool enable);
+void crypt_backend_thread_hooks(int (*start)(void **handle, void *(*fn)(void *arg), void *arg),
+				int (*join)(void *handle));
 int crypt_pbkdf_perf(const char *kdf, const char *hash,
 		const char *password, size_t password_size,
 		const char *salt, size_t salt_size,
@@ -86,13 +96,78 @@ int crypt_pbkdf_perf(const char *kdf, const char *hash,
 		uint32_t *iterations_out, uint32_t *memory_out,
 		int (*progress)(uint32_t time_ms, void *usrptr), void *usrptr);
 
+/* Benchmark measurement options, results of the final measurement */
+#define CRYPT_PBKDF_BENCH_CLOCK_DEFAULT 0 /* CPU time for PBKDF2, wall time for Argon2 */
+#define CRYPT_PBKDF_BENCH_CLOCK_CPU     1
+#define CRYPT_PBKDF_BENCH_CLOCK_WALL    2
+struct crypt_pbkdf_bench {
+	unsigned samples;      /* > 1 for median with outlier rejection */
+	bool pin_cpu;          /* pin single threaded benchmark to one CPU */
+	int clock;
+	unsigned samples_used; /* samples left after outlier rejection */
+	double deviation;      /* relative standard deviation [%] */
+};
+
+/* Argon2 search starts with one measurement of hinted costs (if set) */
+int crypt_pbkdf_perf_hint(const char *kdf, const char *hash,
+		const char *password, size_t password_size,
+		const char *salt, size_t salt_size,
+		size_t volume_key_size, uint32_t time_ms,
+		uint32_t max_memory_kb, uint32_t parallel_threads,
+		uint32_t hint_iterations, uint32_t hint_memory,
+		uint32_t *iterations_out, uint32_t *memory_out,
+		struct crypt_pbkdf_bench *bench,
+		int (*progress)(uint32_t time_ms, void *usrptr), void *usrptr);
+
+/* PBKDF2 of independent jobs in SIMD lanes (sha256, sha512 only, -ENOTSUP otherwise) */
+struct crypt_pbkdf2_job {
+	const char *password;
+	size_t password_length;
+	const char *salt;
+	size_t salt_length;
+	uint32_t iterations;
+	char *key;
+	size_t key_length;
+};
+int crypt_pbkdf2_multi(const char *hash, struct crypt_pbkdf2_job *jobs, unsigned count);
+/* minimal number of independent blocks to prefer lanes, 0 if never */
+unsigned crypt_pbkdf2_multi_lanes(const char *hash);
+
+/* Hash of equal sized messages with common prefix and suffix in SIMD lanes (sha256, sha512 only) */
+struct crypt_hash_multi;
+int crypt_hash_multi_init(struct crypt_hash_multi **ctx, const char *name,
+			  const char *prefix, size_t prefix_length,
+			  const char *suffix, size_t suffix_length);
+/* messages are stored one after another, digests too */
+int crypt_hash_multi(struct crypt_hash_multi *ctx, const char *data, size_t length,
+		     unsigned count, char *digests);
+void crypt_hash_multi_destroy(struct crypt_hash_multi *ctx);
+/* number of messages hashed at once, 0 if backend hash is faster */
+unsigned crypt_hash_multi_lanes(const char *name);
+
 /* CRC32 */
 uint32_t crypt_crc32(uint32_t seed, const unsigned char *buf, size_t len);
+/* running CRC after every byte stored to crcs (len entries) */
+void crypt_crc32_trace(uint32_t seed, const unsigned char *buf, size_t len, uint32_t *crcs);
 
 /* Base64 */
 int crypt_base64_encode(char **out, size_t *out_length, const char *in, size_t in_length);
 int crypt_base64_decode(char **out, size_t *out_length, const char *in, size_t in_length);
 
+/* ChaCha20 keystream, 32 bytes key and 8 bytes nonce */
+struct crypt_chacha20;
+int crypt_chacha20_init(struct crypt_chacha20 **ctx, const char *key, size_t key_length,
+			const char *nonce, size_t nonce_length);
+void crypt_chacha20_seek(struct crypt_chacha20 *ctx, uint64_t block);
+void crypt_chacha20_keystream(struct crypt_chacha20 *ctx, char *out, size_t length);
+void crypt_chacha20_destroy(struct crypt_chacha20 *ctx);
+
+/* In-process one-shot SHA-256 for iterated hash KDFs, -ENOTSUP in FIPS mode */
+int crypt_sha256_native(const char *data, size_t length, char *digest);
+/* The same with block aligned (64 bytes) prefix hashed before data */
+int crypt_sha256_native_prefix(const char *prefix, size_t prefix_length,
+			       const char *data, size_t length, char *digest);
+
 /* UTF8/16 */
 int crypt_utf16_to_utf8(char **out, const char16_t *s, size_t length /* bytes! */);
 int crypt_utf8_to_utf16(char16_t **out, const char *s, size_t length);
@@ -115,11 +190,18 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx);
 int crypt_cipher_perf_kernel(const char *name, const char *mode, char *buffer, size_t buffer_size,
 			     const char *key, size_t key_size, const char *iv, size_t iv_size,
 			     double *encryption_mbs, double *decryption_mbs);
+int crypt_cipher_perf_kernel_parallel(const char *name, const char *mode,
+				      size_t buffer_size, size_t block_size, unsigned int threads,
+				      const char *key, size_t key_size, const char *iv, size_t iv_size,
+				      double *encryption_mbs, double *decryption_mbs);
 
 /* Check availability of a cipher (in kernel only) */
 int crypt_cipher_check_kernel(const char *name, const char *mode,
 			      const char *integrity, size_t key_length);
 
+/* Number of kernel (AF_ALG) cipher requests issued by the process */
+uint64_t crypt_cipher_kernel_calls(void);
+
 /* Storage encryption wrappers */
 int crypt_storage_init(struct crypt_storage **ctx, size_t sector_size,
 		       const char *cipher, const char *cipher_mode,
@@ -31,6 +31,11 @@ int pkcs5_pbkdf2(const char *hash,
 		 unsigned int dkLen, char *DK,
 		 unsigned int hash_block_size);
 
+/* multi-lane PBKDF2 if faster than backend for this key length, -ENOTSUP otherwise */
+int crypt_pbkdf2_multi_try(const char *hash, const char *password, size_t password_length,
+			   const char *salt, size_t salt_length,
+			   char *key, size_t key_length, uint32_t iterations);
+
 /* Argon2 implementation wrapper */
 int argon2(const char *type, const char *password, size_t password_length,
 	   const char *salt, size_t salt_length,
@@ -42,6 +47,8 @@ int argon2(const char *type, const char *password, size_t password_length,
 struct crypt_cipher_kernel {
 	int tfmfd;
 	int opfd;
+	int pipefd[2];	/* zero-copy input path, created on first use */
+	bool splice_disabled;
 };
 
 int crypt_cipher_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
@@ -58,6 +65,23 @@ int crypt_bitlk_decrypt_key_kernel(const void *key, size_t key_length,
 				   const char *iv, size_t iv_length,
 				   const char *tag, size_t tag_length);
 
+/*
+ * In-place processing of count consecutive sectors, each with its own IV
+ * (ivs contains count IVs of iv_length bytes), -ENOTSUP if backend has no
+ * faster path than one crypt_cipher_encrypt/decrypt call per sector.
+ */
+int crypt_cipher_sectors(struct crypt_cipher *ctx, char *buffer, size_t sector_size,
+			 size_t count, const char *ivs, size_t iv_length, bool encrypt);
+
+/* Native AES-XTS/CBC engine for sector storage, -ENOTSUP if not available */
+struct crypt_aes_native;
+
+int crypt_aes_native_init(struct crypt_aes_native **ctx, const char *name,
+			  const char *mode, const void *key, size_t key_length);
+int crypt_aes_native_crypt(struct crypt_aes_native *ctx, char *buffer,
+			   size_t length, const char *iv, bool encrypt);
+void crypt_aes_native_destroy(struct crypt_aes_native *ctx);
+
 /* Internal implementation for constant time memory comparison */
 static inline int crypt_internal_memeq(const void *m1, const void *m2, size_t n)
 {
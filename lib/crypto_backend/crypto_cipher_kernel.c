@@ -24,9 +24,11 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "crypto_backend_internal.h"
 
 #ifdef ENABLE_AF_ALG
@@ -44,6 +46,23 @@
 #define ALG_SET_AEAD_AUTHSIZE 5
 #endif
 
+/*
+ * Input of page aligned bulk requests is spliced into the op socket
+ * instead of copied. Below the minimum the two extra syscalls cost more
+ * than the copy, the maximum is the default pipe capacity (so single
+ * vmsplice never blocks).
+ */
+#define CIPHER_SPLICE_MIN	(16 * 1024)
+#define CIPHER_SPLICE_MAX	(64 * 1024)
+
+/* Number of AF_ALG cipher requests in the process */
+static uint64_t cipher_kernel_calls = 0;
+
+uint64_t crypt_cipher_kernel_calls(void)
+{
+	return __atomic_load_n(&cipher_kernel_calls, __ATOMIC_RELAXED);
+}
+
 /*
  * ciphers
  *
@@ -59,6 +78,8 @@ static int _crypt_cipher_init(struct crypt_cipher_kernel *ctx,
 		return -EINVAL;
 
 	ctx->opfd = -1;
+	ctx->pipefd[0] = ctx->pipefd[1] = -1;
+	ctx->splice_disabled = false;
 	ctx->tfmfd = socket(AF_ALG, SOCK_SEQPACKET, 0);
 	if (ctx->tfmfd < 0) {
 		crypt_cipher_destroy_kernel(ctx);
@@ -108,6 +129,68 @@ int crypt_cipher_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
 	return _crypt_cipher_init(ctx, key, key_length, 0, &sa);
 }
 
+static bool _crypt_cipher_can_splice(struct crypt_cipher_kernel *ctx,
+				     const char *in, size_t in_length)
+{
+	long page_size;
+
+	if (ctx->splice_disabled || in_length < CIPHER_SPLICE_MIN || in_length > CIPHER_SPLICE_MAX)
+		return false;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0 || ((uintptr_t)in | in_length) & (page_size - 1))
+		return false;
+
+	if (ctx->pipefd[0] < 0 && pipe2(ctx->pipefd, O_CLOEXEC) < 0) {
+		ctx->pipefd[0] = ctx->pipefd[1] = -1;
+		ctx->splice_disabled = true;
+		return false;
+	}
+
+	return true;
+}
+
+/* Drop data possibly left in pipe after failed splice */
+static void _crypt_cipher_splice_reset(struct crypt_cipher_kernel *ctx)
+{
+	close(ctx->pipefd[0]);
+	close(ctx->pipefd[1]);
+	ctx->pipefd[0] = ctx->pipefd[1] = -1;
+}
+
+/*
+ * Map user pages into pipe and move them to op socket, no data copy.
+ * Returns -ENOTSUP if nothing reached the socket (caller can fall back
+ * to copy), -EIO if operation data is incomplete.
+ */
+static int _crypt_cipher_splice(struct crypt_cipher_kernel *ctx,
+				const char *in, size_t in_length)
+{
+	struct iovec iov = {
+		.iov_base = (void*)(uintptr_t)in,
+		.iov_len = in_length,
+	};
+	ssize_t len;
+
+	len = vmsplice(ctx->pipefd[1], &iov, 1, 0);
+	if (len != (ssize_t)in_length) {
+		if (len < 0 && (errno == EINVAL || errno == ENOSYS))
+			ctx->splice_disabled = true;
+		_crypt_cipher_splice_reset(ctx);
+		return -ENOTSUP;
+	}
+
+	len = splice(ctx->pipefd[0], NULL, ctx->opfd, NULL, in_length, 0);
+	if (len == (ssize_t)in_length)
+		return 0;
+
+	if (len < 0 && (errno == EINVAL || errno == ENOSYS))
+		ctx->splice_disabled = true;
+	_crypt_cipher_splice_reset(ctx);
+
+	return len <= 0 ? -ENOTSUP : -EIO;
+}
+
 /* The in/out should be aligned to page boundary */
 static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
 			       const char *in, size_t in_length,
@@ -166,10 +249,27 @@ static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
 		memcpy(alg_iv->iv, iv, iv_length);
 	}
 
-	len = sendmsg(ctx->opfd, &msg, 0);
-	if (len != (ssize_t)(in_length))
-		r = -EIO;
-	else {
+	if (_crypt_cipher_can_splice(ctx, in, in_length)) {
+		/* control message only, data follows through the pipe */
+		msg.msg_iov = NULL;
+		msg.msg_iovlen = 0;
+		len = sendmsg(ctx->opfd, &msg, MSG_MORE);
+		if (len != 0)
+			r = -EIO;
+		else
+			r = _crypt_cipher_splice(ctx, in, in_length);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+	} else
+		r = -ENOTSUP;
+
+	/* copy path, it also completes pending operation if splice failed */
+	if (r == -ENOTSUP) {
+		len = sendmsg(ctx->opfd, &msg, 0);
+		r = len != (ssize_t)(in_length) ? -EIO : 0;
+	}
+
+	if (!r) {
 		len = read(ctx->opfd, out, out_length);
 		if (len != (ssize_t)out_length)
 			r = -EIO;
@@ -183,6 +283,7 @@ int crypt_cipher_encrypt_kernel(struct crypt_cipher_kernel *ctx,
 				const char *in, char *out, size_t length,
 				const char *iv, size_t iv_length)
 {
+	__atomic_fetch_add(&cipher_kernel_calls, 1, __ATOMIC_RELAXED);
 	return _crypt_cipher_crypt(ctx, in, length, out, length,
 				   iv, iv_length, ALG_OP_ENCRYPT);
 }
@@ -191,6 +292,7 @@ int crypt_cipher_decrypt_kernel(struct crypt_cipher_kernel *ctx,
 				const char *in, char *out, size_t length,
 				const char *iv, size_t iv_length)
 {
+	__atomic_fetch_add(&cipher_kernel_calls, 1, __ATOMIC_RELAXED);
 	return _crypt_cipher_crypt(ctx, in, length, out, length,
 				   iv, iv_length, ALG_OP_DECRYPT);
 }
@@ -202,8 +304,14 @@ void crypt_cipher_destroy_kernel(struct crypt_cipher_kernel *ctx)
 	if (ctx->opfd >= 0)
 		close(ctx->opfd);
 
+	if (ctx->pipefd[0] >= 0)
+		close(ctx->pipefd[0]);
+	if (ctx->pipefd[1] >= 0)
+		close(ctx->pipefd[1]);
+
 	ctx->tfmfd = -1;
 	ctx->opfd = -1;
+	ctx->pipefd[0] = ctx->pipefd[1] = -1;
 }
 
 int crypt_cipher_check_kernel(const char *name, const char *mode,
@@ -312,6 +420,11 @@ int crypt_bitlk_decrypt_key_kernel(const void *key, size_t key_length,
 }
 
 #else /* ENABLE_AF_ALG */
+uint64_t crypt_cipher_kernel_calls(void)
+{
+	return 0;
+}
+
 int crypt_cipher_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
 			     const char *mode, const void *key, size_t key_length)
 {
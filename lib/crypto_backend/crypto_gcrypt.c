@@ -264,6 +264,28 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	crypt_hash_restart(ctx);
+	return 0;
+}
+
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	gcry_md_hd_t hd;
+
+	if (dst->hash_id != src->hash_id)
+		return -EINVAL;
+
+	/* libgcrypt can copy only to a new handle */
+	if (gcry_md_copy(&hd, src->hd))
+		return -EINVAL;
+
+	gcry_md_close(dst->hd);
+	dst->hd = hd;
+	return 0;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
 	gcry_md_close(ctx->hd);
@@ -394,12 +416,19 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		char *key, size_t key_length,
 		uint32_t iterations, uint32_t memory, uint32_t parallel)
 {
+	int r;
+
 	if (!kdf)
 		return -EINVAL;
 
-	if (!strcmp(kdf, "pbkdf2"))
+	if (!strcmp(kdf, "pbkdf2")) {
+		r = crypt_pbkdf2_multi_try(hash, password, password_length, salt, salt_length,
+					   key, key_length, iterations);
+		if (r != -ENOTSUP)
+			return r;
 		return pbkdf2(hash, password, password_length, salt, salt_length,
 			      key, key_length, iterations);
+	}
 	else if (!strncmp(kdf, "argon2", 6))
 		return argon2(kdf, password, password_length, salt, salt_length,
 			      key, key_length, iterations, memory, parallel);
@@ -511,6 +540,17 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 	return ctx->use_kernel;
 }
 
+int crypt_cipher_sectors(struct crypt_cipher *ctx __attribute__((unused)),
+			 char *buffer __attribute__((unused)),
+			 size_t sector_size __attribute__((unused)),
+			 size_t count __attribute__((unused)),
+			 const char *ivs __attribute__((unused)),
+			 size_t iv_length __attribute__((unused)),
+			 bool encrypt __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
 			    const char *in, char *out, size_t length,
 			    const char *iv, size_t iv_length,
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/utsname.h>
 #include <linux/if_alg.h>
@@ -76,14 +77,130 @@ struct crypt_hash {
 	int tfmfd;
 	int opfd;
 	int hash_len;
+	bool pending;
+	char salg_name[64];
 };
 
 struct crypt_hmac {
 	int tfmfd;
 	int opfd;
 	int hash_len;
+	bool pending;
+	char salg_name[64];
+	char *key;
+	size_t key_length;
 };
 
+/*
+ * Pool of idle hash/hmac sockets. Bound (and keyed) tfm socket with
+ * its accepted op socket is reusable once the digest was read, this
+ * avoids socket/bind/setsockopt/accept for every short lived context.
+ */
+#define SOCKET_POOL_SIZE 16
+
+struct socket_pool_entry {
+	char salg_name[64];
+	char *key;
+	size_t key_length;
+	int tfmfd;
+	int opfd;
+};
+
+static struct socket_pool_entry socket_pool[SOCKET_POOL_SIZE];
+static unsigned socket_pool_count;
+static pthread_mutex_t socket_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void socket_pool_entry_free(struct socket_pool_entry *e)
+{
+	close(e->tfmfd);
+	close(e->opfd);
+	if (e->key) {
+		crypt_backend_memzero(e->key, e->key_length);
+		free(e->key);
+	}
+	memset(e, 0, sizeof(*e));
+}
+
+static bool socket_pool_get(const char *salg_name, const void *key, size_t key_length,
+			    int *tfmfd, int *opfd)
+{
+	struct socket_pool_entry *e;
+	bool found = false;
+	unsigned i;
+
+	pthread_mutex_lock(&socket_pool_lock);
+	for (i = 0; i < socket_pool_count; i++) {
+		e = &socket_pool[i];
+		if (strcmp(e->salg_name, salg_name) || e->key_length != key_length ||
+		    (key_length && crypt_internal_memeq(e->key, key, key_length)))
+			continue;
+
+		*tfmfd = e->tfmfd;
+		*opfd = e->opfd;
+		if (e->key) {
+			crypt_backend_memzero(e->key, e->key_length);
+			free(e->key);
+		}
+		socket_pool[i] = socket_pool[--socket_pool_count];
+		memset(&socket_pool[socket_pool_count], 0, sizeof(*e));
+		found = true;
+		break;
+	}
+	pthread_mutex_unlock(&socket_pool_lock);
+
+	return found;
+}
+
+static void socket_pool_put(const char *salg_name, const void *key, size_t key_length,
+			    int tfmfd, int opfd)
+{
+	struct socket_pool_entry *e;
+	char *key_copy = NULL;
+
+	if (key_length) {
+		key_copy = malloc(key_length);
+		if (!key_copy)
+			goto out;
+		memcpy(key_copy, key, key_length);
+	}
+
+	pthread_mutex_lock(&socket_pool_lock);
+	/* evict the oldest entry */
+	if (socket_pool_count == SOCKET_POOL_SIZE) {
+		socket_pool_entry_free(&socket_pool[0]);
+		memmove(&socket_pool[0], &socket_pool[1], sizeof(*e) * (SOCKET_POOL_SIZE - 1));
+		socket_pool_count--;
+	}
+
+	e = &socket_pool[socket_pool_count++];
+	strncpy(e->salg_name, salg_name, sizeof(e->salg_name) - 1);
+	e->key = key_copy;
+	e->key_length = key_length;
+	e->tfmfd = tfmfd;
+	e->opfd = opfd;
+	pthread_mutex_unlock(&socket_pool_lock);
+	return;
+out:
+	close(tfmfd);
+	close(opfd);
+}
+
+static void socket_pool_flush(void)
+{
+	pthread_mutex_lock(&socket_pool_lock);
+	while (socket_pool_count)
+		socket_pool_entry_free(&socket_pool[--socket_pool_count]);
+	pthread_mutex_unlock(&socket_pool_lock);
+}
+
+/* forked child must not share op sockets with parent */
+static void socket_pool_atfork_child(void)
+{
+	pthread_mutex_init(&socket_pool_lock, NULL);
+	while (socket_pool_count)
+		socket_pool_entry_free(&socket_pool[--socket_pool_count]);
+}
+
 struct crypt_cipher {
 	struct crypt_cipher_kernel ck;
 };
@@ -126,6 +243,7 @@ int crypt_backend_init(bool fips __attribute__((unused)))
 		.salg_name = "sha256",
 	};
 	int r, tfmfd = -1, opfd = -1;
+	static bool atfork_registered = false;
 
 	if (crypto_backend_initialised)
 		return 0;
@@ -144,12 +262,16 @@ int crypt_backend_init(bool fips __attribute__((unused)))
 	close(tfmfd);
 	close(opfd);
 
+	if (!atfork_registered && !pthread_atfork(NULL, NULL, socket_pool_atfork_child))
+		atfork_registered = true;
+
 	crypto_backend_initialised = 1;
 	return 0;
 }
 
 void crypt_backend_destroy(void)
 {
+	socket_pool_flush();
 	crypto_backend_initialised = 0;
 }
 
@@ -202,10 +324,14 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 		return -EINVAL;
 	}
 	h->hash_len = ha->length;
+	h->pending = false;
 
 	strncpy((char *)sa.salg_name, ha->kernel_name, sizeof(sa.salg_name)-1);
+	strncpy(h->salg_name, (char *)sa.salg_name, sizeof(h->salg_name)-1);
+	h->salg_name[sizeof(h->salg_name)-1] = '\0';
 
-	if (crypt_kernel_socket_init(&sa, &h->tfmfd, &h->opfd, NULL, 0) < 0) {
+	if (!socket_pool_get(h->salg_name, NULL, 0, &h->tfmfd, &h->opfd) &&
+	    crypt_kernel_socket_init(&sa, &h->tfmfd, &h->opfd, NULL, 0) < 0) {
 		free(h);
 		return -EINVAL;
 	}
@@ -218,6 +344,7 @@ int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length)
 {
 	ssize_t r;
 
+	ctx->pending = true;
 	r = send(ctx->opfd, buffer, length, MSG_MORE);
 	if (r < 0 || (size_t)r < length)
 		return -EIO;
@@ -236,15 +363,54 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	if (r < 0)
 		return -EIO;
 
+	/* digest read resets the hash state, socket can be reused */
+	ctx->pending = false;
+
+	return 0;
+}
+
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	char tmp[64];
+	int r;
+
+	if (!ctx->pending)
+		return 0;
+
+	r = crypt_hash_final(ctx, tmp, ctx->hash_len);
+	crypt_backend_memzero(tmp, sizeof(tmp));
+	return r;
+}
+
+/* accept() on operation socket creates new one with copy of the hash state */
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	int opfd;
+
+	if (strcmp(dst->salg_name, src->salg_name))
+		return -EINVAL;
+
+	opfd = accept(src->opfd, NULL, 0);
+	if (opfd < 0)
+		return -errno;
+
+	if (dst->opfd >= 0)
+		close(dst->opfd);
+	dst->opfd = opfd;
+	dst->pending = src->pending;
 	return 0;
 }
 
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
-	if (ctx->tfmfd >= 0)
-		close(ctx->tfmfd);
-	if (ctx->opfd >= 0)
-		close(ctx->opfd);
+	if (!ctx->pending && ctx->tfmfd >= 0 && ctx->opfd >= 0)
+		socket_pool_put(ctx->salg_name, NULL, 0, ctx->tfmfd, ctx->opfd);
+	else {
+		if (ctx->tfmfd >= 0)
+			close(ctx->tfmfd);
+		if (ctx->opfd >= 0)
+			close(ctx->opfd);
+	}
 	memset(ctx, 0, sizeof(*ctx));
 	free(ctx);
 }
@@ -276,6 +442,7 @@ int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
 		return -EINVAL;
 	}
 	h->hash_len = ha->length;
+	h->pending = false;
 
 	r = snprintf((char *)sa.salg_name, sizeof(sa.salg_name),
 		 "hmac(%s)", ha->kernel_name);
@@ -283,8 +450,26 @@ int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
 		free(h);
 		return -EINVAL;
 	}
+	strncpy(h->salg_name, (char *)sa.salg_name, sizeof(h->salg_name)-1);
+	h->salg_name[sizeof(h->salg_name)-1] = '\0';
+
+	h->key_length = key_length;
+	h->key = NULL;
+	if (key_length) {
+		h->key = malloc(key_length);
+		if (!h->key) {
+			free(h);
+			return -ENOMEM;
+		}
+		memcpy(h->key, key, key_length);
+	}
 
-	if (crypt_kernel_socket_init(&sa, &h->tfmfd, &h->opfd, key, key_length) < 0) {
+	if (!socket_pool_get(h->salg_name, key, key_length, &h->tfmfd, &h->opfd) &&
+	    crypt_kernel_socket_init(&sa, &h->tfmfd, &h->opfd, key, key_length) < 0) {
+		if (h->key) {
+			crypt_backend_memzero(h->key, key_length);
+			free(h->key);
+		}
 		free(h);
 		return -EINVAL;
 	}
@@ -297,6 +482,7 @@ int crypt_hmac_write(struct crypt_hmac *ctx, const char *buffer, size_t length)
 {
 	ssize_t r;
 
+	ctx->pending = true;
 	r = send(ctx->opfd, buffer, length, MSG_MORE);
 	if (r < 0 || (size_t)r < length)
 		return -EIO;
@@ -315,15 +501,25 @@ int crypt_hmac_final(struct crypt_hmac *ctx, char *buffer, size_t length)
 	if (r < 0)
 		return -EIO;
 
+	ctx->pending = false;
+
 	return 0;
 }
 
 void crypt_hmac_destroy(struct crypt_hmac *ctx)
 {
-	if (ctx->tfmfd >= 0)
-		close(ctx->tfmfd);
-	if (ctx->opfd >= 0)
-		close(ctx->opfd);
+	if (!ctx->pending && ctx->tfmfd >= 0 && ctx->opfd >= 0)
+		socket_pool_put(ctx->salg_name, ctx->key, ctx->key_length, ctx->tfmfd, ctx->opfd);
+	else {
+		if (ctx->tfmfd >= 0)
+			close(ctx->tfmfd);
+		if (ctx->opfd >= 0)
+			close(ctx->opfd);
+	}
+	if (ctx->key) {
+		crypt_backend_memzero(ctx->key, ctx->key_length);
+		free(ctx->key);
+	}
 	memset(ctx, 0, sizeof(*ctx));
 	free(ctx);
 }
@@ -343,6 +539,7 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		uint32_t iterations, uint32_t memory, uint32_t parallel)
 {
 	struct hash_alg *ha;
+	int r;
 
 	if (!kdf)
 		return -EINVAL;
@@ -352,6 +549,11 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		if (!ha)
 			return -EINVAL;
 
+		r = crypt_pbkdf2_multi_try(hash, password, password_length, salt, salt_length,
+					   key, key_length, iterations);
+		if (r != -ENOTSUP)
+			return r;
+
 		return pkcs5_pbkdf2(hash, password, password_length, salt, salt_length,
 				    iterations, key_length, key, ha->block_length);
 	} else if (!strncmp(kdf, "argon2", 6)) {
@@ -408,6 +610,17 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
 	return true;
 }
 
+int crypt_cipher_sectors(struct crypt_cipher *ctx __attribute__((unused)),
+			 char *buffer __attribute__((unused)),
+			 size_t sector_size __attribute__((unused)),
+			 size_t count __attribute__((unused)),
+			 const char *ivs __attribute__((unused)),
+			 size_t iv_length __attribute__((unused)),
+			 bool encrypt __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
 			    const char *in, char *out, size_t length,
 			    const char *iv, size_t iv_length,
@@ -278,6 +278,21 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	crypt_hash_restart(ctx);
+	return 0;
+}
+
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	if (dst->hash != src->hash)
+		return -EINVAL;
+
+	memcpy(&dst->nettle_ctx, &src->nettle_ctx, sizeof(dst->nettle_ctx));
+	return 0;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
 	memset(ctx, 0, sizeof(*ctx));
@@ -375,6 +390,11 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		return -EINVAL;
 
 	if (!strcmp(kdf, "pbkdf2")) {
+		r = crypt_pbkdf2_multi_try(hash, password, password_length, salt, salt_length,
+					   key, key_length, iterations);
+		if (r != -ENOTSUP)
+			return r;
+
 		r = crypt_hmac_init(&h, hash, password, password_length);
 		if (r < 0)
 			return r;
@@ -439,6 +459,17 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
 	return true;
 }
 
+int crypt_cipher_sectors(struct crypt_cipher *ctx __attribute__((unused)),
+			 char *buffer __attribute__((unused)),
+			 size_t sector_size __attribute__((unused)),
+			 size_t count __attribute__((unused)),
+			 const char *ivs __attribute__((unused)),
+			 size_t iv_length __attribute__((unused)),
+			 bool encrypt __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
 			    const char *in, char *out, size_t length,
 			    const char *iv, size_t iv_length,
@@ -189,6 +189,27 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	return crypt_hash_restart(ctx);
+}
+
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	unsigned char state[512];
+	int state_len = 0, r = 0;
+
+	if (dst->hash != src->hash)
+		return -EINVAL;
+
+	if (PK11_SaveContext(src->md, state, &state_len, sizeof(state)) != SECSuccess ||
+	    PK11_RestoreContext(dst->md, state, state_len) != SECSuccess)
+		r = -EINVAL;
+
+	crypt_backend_memzero(state, sizeof(state));
+	return r;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
 	PK11_DestroyContext(ctx->md, PR_TRUE);
@@ -322,6 +343,7 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		uint32_t iterations, uint32_t memory, uint32_t parallel)
 {
 	struct hash_alg *ha;
+	int r;
 
 	if (!kdf)
 		return -EINVAL;
@@ -331,6 +353,11 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		if (!ha)
 			return -EINVAL;
 
+		r = crypt_pbkdf2_multi_try(hash, password, password_length, salt, salt_length,
+					   key, key_length, iterations);
+		if (r != -ENOTSUP)
+			return r;
+
 		return pkcs5_pbkdf2(hash, password, password_length, salt, salt_length,
 				    iterations, key_length, key, ha->block_length);
 	} else if (!strncmp(kdf, "argon2", 6)) {
@@ -387,6 +414,17 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
 	return true;
 }
 
+int crypt_cipher_sectors(struct crypt_cipher *ctx __attribute__((unused)),
+			 char *buffer __attribute__((unused)),
+			 size_t sector_size __attribute__((unused)),
+			 size_t count __attribute__((unused)),
+			 const char *ivs __attribute__((unused)),
+			 size_t iv_length __attribute__((unused)),
+			 bool encrypt __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
 			    const char *in, char *out, size_t length,
 			    const char *iv, size_t iv_length,
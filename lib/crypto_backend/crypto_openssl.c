@@ -30,6 +30,8 @@
 
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
@@ -43,6 +45,23 @@ static OSSL_PROVIDER *ossl_legacy = NULL;
 static OSSL_PROVIDER *ossl_default = NULL;
 static OSSL_LIB_CTX  *ossl_ctx = NULL;
 static char backend_version[256] = "OpenSSL";
+
+/*
+ * Provider fetch is expensive (locking and name lookups), so fetched
+ * algorithm objects are kept until backend exit. The cache holds one
+ * reference, every user gets its own one.
+ */
+#define ALG_CACHE_SIZE 32
+
+struct alg_cache_entry {
+	char name[32];
+	void *alg;
+};
+
+static struct alg_cache_entry md_cache[ALG_CACHE_SIZE];
+static struct alg_cache_entry cipher_cache[ALG_CACHE_SIZE];
+static EVP_MAC *hmac_cache = NULL;
+static pthread_mutex_t alg_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 #define CONST_CAST(x) (x)(uintptr_t)
@@ -141,6 +160,17 @@ static void HMAC_CTX_free(HMAC_CTX *md)
 static void openssl_backend_exit(void)
 {
 #if OPENSSL_VERSION_MAJOR >= 3
+	int i;
+
+	for (i = 0; i < ALG_CACHE_SIZE; i++) {
+		EVP_MD_free(md_cache[i].alg);
+		EVP_CIPHER_free(cipher_cache[i].alg);
+	}
+	memset(md_cache, 0, sizeof(md_cache));
+	memset(cipher_cache, 0, sizeof(cipher_cache));
+	EVP_MAC_free(hmac_cache);
+	hmac_cache = NULL;
+
 	if (ossl_legacy)
 		OSSL_PROVIDER_unload(ossl_legacy);
 	if (ossl_default)
@@ -263,10 +293,52 @@ static const char *crypt_hash_compat_name(const char *name)
 	return hash_name;
 }
 
+#if OPENSSL_VERSION_MAJOR >= 3
+/* Returns cached object or index of free slot (-1 if cache is full) in *slot */
+static void *alg_cache_find(struct alg_cache_entry *cache, const char *name, int *slot)
+{
+	int i;
+
+	for (i = 0; i < ALG_CACHE_SIZE && cache[i].alg; i++)
+		if (!strcmp(cache[i].name, name))
+			return cache[i].alg;
+
+	*slot = (i < ALG_CACHE_SIZE && strlen(name) < sizeof(cache[i].name)) ? i : -1;
+	return NULL;
+}
+
+static void alg_cache_add(struct alg_cache_entry *cache, int slot, const char *name, void *alg)
+{
+	strcpy(cache[slot].name, name);
+	cache[slot].alg = alg;
+}
+#endif
+
 static const EVP_MD *hash_id_get(const char *name)
 {
 #if OPENSSL_VERSION_MAJOR >= 3
-	return EVP_MD_fetch(ossl_ctx, crypt_hash_compat_name(name), NULL);
+	const char *md_name = crypt_hash_compat_name(name);
+	EVP_MD *hash_id;
+	int slot;
+
+	if (!md_name)
+		return NULL;
+
+	pthread_mutex_lock(&alg_cache_lock);
+	hash_id = alg_cache_find(md_cache, md_name, &slot);
+	if (!hash_id) {
+		hash_id = EVP_MD_fetch(ossl_ctx, md_name, NULL);
+		/* not cached object is owned by caller */
+		if (!hash_id || slot < 0) {
+			pthread_mutex_unlock(&alg_cache_lock);
+			return hash_id;
+		}
+		alg_cache_add(md_cache, slot, md_name, hash_id);
+	}
+	EVP_MD_up_ref(hash_id);
+	pthread_mutex_unlock(&alg_cache_lock);
+
+	return hash_id;
 #else
 	return EVP_get_digestbyname(crypt_hash_compat_name(name));
 #endif
@@ -282,7 +354,23 @@ static void hash_id_free(const EVP_MD *hash_id)
 static const EVP_CIPHER *cipher_type_get(const char *name)
 {
 #if OPENSSL_VERSION_MAJOR >= 3
-	return EVP_CIPHER_fetch(ossl_ctx, name, NULL);
+	EVP_CIPHER *cipher_type;
+	int slot;
+
+	pthread_mutex_lock(&alg_cache_lock);
+	cipher_type = alg_cache_find(cipher_cache, name, &slot);
+	if (!cipher_type) {
+		cipher_type = EVP_CIPHER_fetch(ossl_ctx, name, NULL);
+		if (!cipher_type || slot < 0) {
+			pthread_mutex_unlock(&alg_cache_lock);
+			return cipher_type;
+		}
+		alg_cache_add(cipher_cache, slot, name, cipher_type);
+	}
+	EVP_CIPHER_up_ref(cipher_type);
+	pthread_mutex_unlock(&alg_cache_lock);
+
+	return cipher_type;
 #else
 	return EVP_get_cipherbyname(name);
 #endif
@@ -382,6 +470,22 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 	return 0;
 }
 
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	return crypt_hash_restart(ctx);
+}
+
+int crypt_hash_copy(struct crypt_hash *dst, struct crypt_hash *src)
+{
+	if (EVP_MD_type(dst->hash_id) != EVP_MD_type(src->hash_id))
+		return -EINVAL;
+
+	if (EVP_MD_CTX_copy_ex(dst->md, src->md) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
 	hash_id_free(ctx->hash_id);
@@ -410,7 +514,13 @@ int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
 	if (!h)
 		return -ENOMEM;
 
-	h->mac = EVP_MAC_fetch(ossl_ctx, OSSL_MAC_NAME_HMAC, NULL);
+	pthread_mutex_lock(&alg_cache_lock);
+	if (!hmac_cache)
+		hmac_cache = EVP_MAC_fetch(ossl_ctx, OSSL_MAC_NAME_HMAC, NULL);
+	h->mac = hmac_cache;
+	if (h->mac)
+		EVP_MAC_up_ref(h->mac);
+	pthread_mutex_unlock(&alg_cache_lock);
 	if (!h->mac) {
 		free(h);
 		return -EINVAL;
@@ -595,12 +705,19 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		char *key, size_t key_length,
 		uint32_t iterations, uint32_t memory, uint32_t parallel)
 {
+	int r;
+
 	if (!kdf)
 		return -EINVAL;
 
-	if (!strcmp(kdf, "pbkdf2"))
+	if (!strcmp(kdf, "pbkdf2")) {
+		r = crypt_pbkdf2_multi_try(hash, password, password_length, salt, salt_length,
+					   key, key_length, iterations);
+		if (r != -ENOTSUP)
+			return r;
 		return openssl_pbkdf2(password, password_length, salt, salt_length,
 				      iterations, hash, key, key_length);
+	}
 	if (!strncmp(kdf, "argon2", 6))
 		return openssl_argon2(kdf, password, password_length, salt, salt_length,
 				      key, key_length, iterations, memory, parallel);
@@ -774,6 +891,36 @@ bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 	return ctx->use_kernel;
 }
 
+/*
+ * Key schedule stays in pre-initialized context, only IV is set per sector.
+ * Without padding all sector blocks are processed in update, no final needed.
+ */
+int crypt_cipher_sectors(struct crypt_cipher *ctx, char *buffer, size_t sector_size,
+			 size_t count, const char *ivs, size_t iv_length, bool encrypt)
+{
+	EVP_CIPHER_CTX *hd;
+	size_t i;
+	int len;
+
+	if (ctx->use_kernel)
+		return -ENOTSUP;
+
+	if (ctx->u.lib.iv_length != iv_length || sector_size > INT_MAX)
+		return -EINVAL;
+
+	hd = encrypt ? ctx->u.lib.hd_enc : ctx->u.lib.hd_dec;
+
+	for (i = 0; i < count; i++, buffer += sector_size, ivs += iv_length) {
+		if (EVP_CipherInit_ex(hd, NULL, NULL, NULL, (const unsigned char *)ivs, -1) != 1 ||
+		    EVP_CipherUpdate(hd, (unsigned char *)buffer, &len,
+				     (const unsigned char *)buffer, (int)sector_size) != 1 ||
+		    len != (int)sector_size)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length __attribute__((unused)),
 			    const char *in, char *out, size_t length,
 			    const char *iv, size_t iv_length,
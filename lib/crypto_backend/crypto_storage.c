@@ -23,10 +23,19 @@
 #include <errno.h>
 #include <strings.h>
 #include "bitops.h"
-#include "crypto_backend.h"
+#include "crypto_backend_internal.h"
 
 #define SECTOR_SHIFT	9
 
+/*
+ * Without IV all sectors can be processed in one cipher call, limit
+ * the size to fit into AF_ALG socket send buffer.
+ */
+#define STORAGE_BATCH_MAX	(64 * 1024)
+
+/* Number of sector IVs generated at once */
+#define STORAGE_IV_BULK		64
+
 /*
  * Internal IV helper
  * IV documentation: https://gitlab.com/cryptsetup/cryptsetup/wikis/DMCrypt
@@ -34,16 +43,22 @@
 struct crypt_sector_iv {
 	enum { IV_NONE, IV_NULL, IV_PLAIN, IV_PLAIN64, IV_ESSIV, IV_BENBI, IV_PLAIN64BE, IV_EBOIV } type;
 	int iv_size;
-	char *iv;
+	char *iv;		/* STORAGE_IV_BULK IVs */
 	struct crypt_cipher *cipher;
 	int shift;
+	/* IV type specific loop, NULL if IVs are constant */
+	void (*fill)(const struct crypt_sector_iv *ctx, uint64_t sector,
+		     uint64_t step, size_t count);
 };
 
 /* Block encryption storage context */
 struct crypt_storage {
 	size_t sector_size;
 	unsigned iv_shift;
+	uint64_t iv_step;	/* IV increment per sector */
 	struct crypt_cipher *cipher;
+	struct crypt_aes_native *native;
+	bool cipher_sectors;	/* backend processes IV batch in one call */
 	struct crypt_sector_iv cipher_iv;
 };
 
@@ -55,6 +70,49 @@ static int int_log2(unsigned int x)
 	return r;
 }
 
+/*
+ * Specialized IV loops, one per IV type. The IV buffer is zeroed at init
+ * and only the sector dependent bytes are rewritten. ESSIV and EBOIV buffer
+ * is encrypted in place, so the constant part must be cleared again.
+ */
+#define SECTOR_IV_FILL(name, store)						\
+static void crypt_sector_iv_fill_##name(const struct crypt_sector_iv *ctx,	\
+					uint64_t sector, uint64_t step, size_t count)	\
+{										\
+	const size_t iv_size = ctx->iv_size;					\
+	const int shift = ctx->shift;						\
+	char *iv = ctx->iv;							\
+	uint64_t val;								\
+	uint32_t val32;								\
+										\
+	(void)shift; (void)val; (void)val32;					\
+	for (; count; count--, sector += step, iv += iv_size) {			\
+		store;								\
+	}									\
+}
+
+SECTOR_IV_FILL(plain,
+	val32 = cpu_to_le32(sector & 0xffffffff);
+	memcpy(iv, &val32, sizeof(val32)))
+SECTOR_IV_FILL(plain64,
+	val = cpu_to_le64(sector);
+	memcpy(iv, &val, sizeof(val)))
+/* iv_size is at least of size u64; usually it is 16 bytes */
+SECTOR_IV_FILL(plain64be,
+	val = cpu_to_be64(sector);
+	memcpy(iv + iv_size - sizeof(val), &val, sizeof(val)))
+SECTOR_IV_FILL(benbi,
+	val = cpu_to_be64((sector << shift) + 1);
+	memcpy(iv + iv_size - sizeof(val), &val, sizeof(val)))
+SECTOR_IV_FILL(essiv,
+	val = cpu_to_le64(sector);
+	memcpy(iv, &val, sizeof(val));
+	memset(iv + sizeof(val), 0, iv_size - sizeof(val)))
+SECTOR_IV_FILL(eboiv,
+	val = cpu_to_le64(sector << shift);
+	memcpy(iv, &val, sizeof(val));
+	memset(iv + sizeof(val), 0, iv_size - sizeof(val)))
+
 static int crypt_sector_iv_init(struct crypt_sector_iv *ctx,
 			 const char *cipher_name, const char *mode_name,
 			 const char *iv_name, const void *key, size_t key_length,
@@ -81,10 +139,13 @@ static int crypt_sector_iv_init(struct crypt_sector_iv *ctx,
 		ctx->type = IV_NULL;
 	} else if (!strcasecmp(iv_name, "plain64")) {
 		ctx->type = IV_PLAIN64;
+		ctx->fill = crypt_sector_iv_fill_plain64;
 	} else if (!strcasecmp(iv_name, "plain64be")) {
 		ctx->type = IV_PLAIN64BE;
+		ctx->fill = crypt_sector_iv_fill_plain64be;
 	} else if (!strcasecmp(iv_name, "plain")) {
 		ctx->type = IV_PLAIN;
+		ctx->fill = crypt_sector_iv_fill_plain;
 	} else if (!strncasecmp(iv_name, "essiv:", 6)) {
 		struct crypt_hash *h = NULL;
 		char *hash_name = strchr(iv_name, ':');
@@ -124,6 +185,7 @@ static int crypt_sector_iv_init(struct crypt_sector_iv *ctx,
 			return r;
 
 		ctx->type = IV_ESSIV;
+		ctx->fill = crypt_sector_iv_fill_essiv;
 	} else if (!strncasecmp(iv_name, "benbi", 5)) {
 		int log = int_log2(ctx->iv_size);
 		if (log > SECTOR_SHIFT)
@@ -131,6 +193,7 @@ static int crypt_sector_iv_init(struct crypt_sector_iv *ctx,
 
 		ctx->type = IV_BENBI;
 		ctx->shift = SECTOR_SHIFT - log;
+		ctx->fill = crypt_sector_iv_fill_benbi;
 	} else if (!strncasecmp(iv_name, "eboiv", 5)) {
 		r = crypt_cipher_init(&ctx->cipher, cipher_name, "ecb",
 				      key, key_length);
@@ -139,65 +202,36 @@ static int crypt_sector_iv_init(struct crypt_sector_iv *ctx,
 
 		ctx->type = IV_EBOIV;
 		ctx->shift = int_log2(sector_size);
+		ctx->fill = crypt_sector_iv_fill_eboiv;
 	} else
 		return -ENOENT;
 
-	ctx->iv = malloc(ctx->iv_size);
+	ctx->iv = calloc(STORAGE_IV_BULK, ctx->iv_size);
 	if (!ctx->iv)
 		return -ENOMEM;
 
 	return 0;
 }
 
-static int crypt_sector_iv_generate(struct crypt_sector_iv *ctx, uint64_t sector)
+/*
+ * Generate IVs for count sectors (at most STORAGE_IV_BULK) starting
+ * at sector, sector numbers grow by step. ESSIV and EBOIV use single
+ * multi-block ECB encryption for all IVs.
+ */
+static int crypt_sector_iv_generate(struct crypt_sector_iv *ctx, uint64_t sector,
+				    uint64_t step, size_t count)
 {
-	uint64_t val, *u64_iv;
-	uint32_t *u32_iv;
-
-	switch (ctx->type) {
-	case IV_NONE:
-		break;
-	case IV_NULL:
-		memset(ctx->iv, 0, ctx->iv_size);
-		break;
-	case IV_PLAIN:
-		memset(ctx->iv, 0, ctx->iv_size);
-		u32_iv = (void *)ctx->iv;
-		*u32_iv = cpu_to_le32(sector & 0xffffffff);
-		break;
-	case IV_PLAIN64:
-		memset(ctx->iv, 0, ctx->iv_size);
-		u64_iv = (void *)ctx->iv;
-		*u64_iv = cpu_to_le64(sector);
-		break;
-	case IV_PLAIN64BE:
-		memset(ctx->iv, 0, ctx->iv_size);
-		/* iv_size is at least of size u64; usually it is 16 bytes */
-		u64_iv = (void *)&ctx->iv[ctx->iv_size - sizeof(uint64_t)];
-		*u64_iv = cpu_to_be64(sector);
-		break;
-	case IV_ESSIV:
-		memset(ctx->iv, 0, ctx->iv_size);
-		u64_iv = (void *)ctx->iv;
-		*u64_iv = cpu_to_le64(sector);
-		return crypt_cipher_encrypt(ctx->cipher,
-			ctx->iv, ctx->iv, ctx->iv_size, NULL, 0);
-		break;
-	case IV_BENBI:
-		memset(ctx->iv, 0, ctx->iv_size);
-		val = cpu_to_be64((sector << ctx->shift) + 1);
-		memcpy(ctx->iv + ctx->iv_size - sizeof(val), &val, sizeof(val));
-		break;
-	case IV_EBOIV:
-		memset(ctx->iv, 0, ctx->iv_size);
-		u64_iv = (void *)ctx->iv;
-		*u64_iv = cpu_to_le64(sector << ctx->shift);
-		return crypt_cipher_encrypt(ctx->cipher,
-			ctx->iv, ctx->iv, ctx->iv_size, NULL, 0);
-		break;
-	default:
+	if (count > STORAGE_IV_BULK)
 		return -EINVAL;
-	}
+
+	if (!ctx->fill)
+		return 0;
+
+	ctx->fill(ctx, sector, step, count);
+
+	if (ctx->type == IV_ESSIV || ctx->type == IV_EBOIV)
+		return crypt_cipher_encrypt(ctx->cipher, ctx->iv, ctx->iv,
+					    ctx->iv_size * count, NULL, 0);
 
 	return 0;
 }
@@ -208,7 +242,7 @@ static void crypt_sector_iv_destroy(struct crypt_sector_iv *ctx)
 		crypt_cipher_destroy(ctx->cipher);
 
 	if (ctx->iv) {
-		memset(ctx->iv, 0, ctx->iv_size);
+		memset(ctx->iv, 0, ctx->iv_size * STORAGE_IV_BULK);
 		free(ctx->iv);
 	}
 
@@ -248,10 +282,14 @@ int crypt_storage_init(struct crypt_storage **ctx,
 		cipher_iv++;
 	}
 
-	r = crypt_cipher_init(&s->cipher, cipher, mode_name, key, key_length);
-	if (r) {
-		crypt_storage_destroy(s);
-		return r;
+	/* prefer in-library engine, avoids AF_ALG round trip per sector (FIPS requires backend) */
+	if (crypt_fips_mode() ||
+	    crypt_aes_native_init(&s->native, cipher, mode_name, key, key_length)) {
+		r = crypt_cipher_init(&s->cipher, cipher, mode_name, key, key_length);
+		if (r) {
+			crypt_storage_destroy(s);
+			return r;
+		}
 	}
 
 	r = crypt_sector_iv_init(&s->cipher_iv, cipher, mode_name, cipher_iv, key, key_length, sector_size);
@@ -262,46 +300,42 @@ int crypt_storage_init(struct crypt_storage **ctx,
 
 	s->sector_size = sector_size;
 	s->iv_shift = large_iv ? int_log2(sector_size) - SECTOR_SHIFT : 0;
+	s->iv_step = (sector_size >> SECTOR_SHIFT) >> s->iv_shift;
+
+	/* empty batch only probes for backend support */
+	s->cipher_sectors = s->cipher && s->cipher_iv.type != IV_NONE &&
+		!crypt_cipher_sectors(s->cipher, NULL, sector_size, 0, NULL, s->cipher_iv.iv_size, true);
 
 	*ctx = s;
 	return 0;
 }
 
-int crypt_storage_decrypt(struct crypt_storage *ctx,
-		       uint64_t iv_offset,
-		       uint64_t length, char *buffer)
+/* Sectors are independent of IV (ECB or cipher_null), process many at once */
+static int crypt_storage_batch(struct crypt_storage *ctx, uint64_t length,
+			       char *buffer, bool encrypt)
 {
-	uint64_t i;
+	uint64_t i, len;
 	int r = 0;
 
-	if (length & (ctx->sector_size - 1))
-		return -EINVAL;
+	for (i = 0; i < length && !r; i += len) {
+		len = length - i;
+		if (len > STORAGE_BATCH_MAX)
+			len = STORAGE_BATCH_MAX;
 
-	if (iv_offset & ((ctx->sector_size >> SECTOR_SHIFT) - 1))
-		return -EINVAL;
-
-	for (i = 0; i < length; i += ctx->sector_size) {
-		r = crypt_sector_iv_generate(&ctx->cipher_iv, (iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift);
-		if (r)
-			break;
-		r = crypt_cipher_decrypt(ctx->cipher,
-					 &buffer[i],
-					 &buffer[i],
-					 ctx->sector_size,
-					 ctx->cipher_iv.iv,
-					 ctx->cipher_iv.iv_size);
-		if (r)
-			break;
+		if (encrypt)
+			r = crypt_cipher_encrypt(ctx->cipher, &buffer[i], &buffer[i], len, NULL, 0);
+		else
+			r = crypt_cipher_decrypt(ctx->cipher, &buffer[i], &buffer[i], len, NULL, 0);
 	}
 
 	return r;
 }
 
-int crypt_storage_encrypt(struct crypt_storage *ctx,
-		       uint64_t iv_offset,
-		       uint64_t length, char *buffer)
+static int crypt_storage_crypt(struct crypt_storage *ctx, uint64_t iv_offset,
+			       uint64_t length, char *buffer, bool encrypt)
 {
-	uint64_t i;
+	uint64_t i, count, j;
+	const char *iv;
 	int r = 0;
 
 	if (length & (ctx->sector_size - 1))
@@ -310,23 +344,58 @@ int crypt_storage_encrypt(struct crypt_storage *ctx,
 	if (iv_offset & ((ctx->sector_size >> SECTOR_SHIFT) - 1))
 		return -EINVAL;
 
-	for (i = 0; i < length; i += ctx->sector_size) {
-		r = crypt_sector_iv_generate(&ctx->cipher_iv, (iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift);
-		if (r)
-			break;
-		r = crypt_cipher_encrypt(ctx->cipher,
-					 &buffer[i],
-					 &buffer[i],
-					 ctx->sector_size,
-					 ctx->cipher_iv.iv,
-					 ctx->cipher_iv.iv_size);
+	if (ctx->cipher_iv.type == IV_NONE)
+		return crypt_storage_batch(ctx, length, buffer, encrypt);
+
+	for (i = 0; i < length && !r; i += count * ctx->sector_size) {
+		count = (length - i) / ctx->sector_size;
+		if (count > STORAGE_IV_BULK)
+			count = STORAGE_IV_BULK;
+
+		r = crypt_sector_iv_generate(&ctx->cipher_iv,
+			(iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift, ctx->iv_step, count);
 		if (r)
 			break;
+
+		if (ctx->cipher_sectors) {
+			r = crypt_cipher_sectors(ctx->cipher, &buffer[i], ctx->sector_size, count,
+						 ctx->cipher_iv.iv, ctx->cipher_iv.iv_size, encrypt);
+			continue;
+		}
+
+		for (j = 0; j < count && !r; j++) {
+			iv = ctx->cipher_iv.iv + j * ctx->cipher_iv.iv_size;
+			if (ctx->native)
+				r = crypt_aes_native_crypt(ctx->native, &buffer[i + j * ctx->sector_size],
+							   ctx->sector_size, iv, encrypt);
+			else if (encrypt)
+				r = crypt_cipher_encrypt(ctx->cipher, &buffer[i + j * ctx->sector_size],
+							 &buffer[i + j * ctx->sector_size],
+							 ctx->sector_size, iv, ctx->cipher_iv.iv_size);
+			else
+				r = crypt_cipher_decrypt(ctx->cipher, &buffer[i + j * ctx->sector_size],
+							 &buffer[i + j * ctx->sector_size],
+							 ctx->sector_size, iv, ctx->cipher_iv.iv_size);
+		}
 	}
 
 	return r;
 }
 
+int crypt_storage_decrypt(struct crypt_storage *ctx,
+		       uint64_t iv_offset,
+		       uint64_t length, char *buffer)
+{
+	return crypt_storage_crypt(ctx, iv_offset, length, buffer, false);
+}
+
+int crypt_storage_encrypt(struct crypt_storage *ctx,
+		       uint64_t iv_offset,
+		       uint64_t length, char *buffer)
+{
+	return crypt_storage_crypt(ctx, iv_offset, length, buffer, true);
+}
+
 void crypt_storage_destroy(struct crypt_storage *ctx)
 {
 	if (!ctx)
@@ -337,11 +406,16 @@ void crypt_storage_destroy(struct crypt_storage *ctx)
 	if (ctx->cipher)
 		crypt_cipher_destroy(ctx->cipher);
 
+	crypt_aes_native_destroy(ctx->native);
+
 	memset(ctx, 0, sizeof(*ctx));
 	free(ctx);
 }
 
 bool crypt_storage_kernel_only(struct crypt_storage *ctx)
 {
+	if (ctx->native)
+		return false;
+
 	return crypt_cipher_kernel_only(ctx->cipher);
 }
@@ -0,0 +1,901 @@
+/*
+ * Multi-lane PBKDF2-HMAC and multi-buffer hash (SHA-256, SHA-512)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crypto_backend_internal.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MB_X86 1
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+#define MB_INLINE static inline __attribute__((always_inline))
+
+/*
+ * Every PBKDF2 output block T_i = F(P, S, c, i) is an independent chain of
+ * c HMAC iterations. Blocks of all jobs are scheduled into SIMD lanes
+ * (GCC vector extensions, compiled to SSE2/AVX2/NEON as available), lane is
+ * refilled with next block as soon as its chain is done.
+ *
+ * The first iteration (HMAC over salt and block index) uses backend HMAC,
+ * only the fixed size U_n -> U_n+1 steps run in lanes.
+ *
+ * Lanes pay off only with AVX2 (8 x SHA-256 or 4 x SHA-512 in one register),
+ * otherwise (and for too few blocks) backend PBKDF2 is faster, see
+ * crypt_pbkdf2_multi_lanes().
+ *
+ * The same lanes hash independent equal sized messages with common
+ * prefix and suffix (see crypt_hash_multi()).
+ */
+#define MB_VEC_SIZE	32
+#define MB_MAX_BLOCK	128
+#define MB_MAX_HASH	64
+
+typedef uint32_t v32 __attribute__((vector_size(MB_VEC_SIZE)));
+typedef uint64_t v64 __attribute__((vector_size(MB_VEC_SIZE)));
+
+#define LANES32 (MB_VEC_SIZE / sizeof(uint32_t))
+#define LANES64 (MB_VEC_SIZE / sizeof(uint64_t))
+#define MB_MAX_LANES LANES32
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t sha512_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define SHA_ROUND(a, b, c, d, e, f, g, h, k, w, S0, S1) do { \
+	t1 = h + S1(e) + ((e & f) ^ (~e & g)) + k + w; \
+	t2 = S0(a) + ((a & b) ^ (a & c) ^ (b & c)); \
+	d += t1; \
+	h = t1 + t2; \
+} while (0)
+
+#define S256_0(x) (ROR32(x, 2) ^ ROR32(x, 13) ^ ROR32(x, 22))
+#define S256_1(x) (ROR32(x, 6) ^ ROR32(x, 11) ^ ROR32(x, 25))
+#define s256_0(x) (ROR32(x, 7) ^ ROR32(x, 18) ^ ((x) >> 3))
+#define s256_1(x) (ROR32(x, 17) ^ ROR32(x, 19) ^ ((x) >> 10))
+
+#define S512_0(x) (ROR64(x, 28) ^ ROR64(x, 34) ^ ROR64(x, 39))
+#define S512_1(x) (ROR64(x, 14) ^ ROR64(x, 18) ^ ROR64(x, 41))
+#define s512_0(x) (ROR64(x, 1) ^ ROR64(x, 8) ^ ((x) >> 7))
+#define s512_1(x) (ROR64(x, 19) ^ ROR64(x, 61) ^ ((x) >> 6))
+
+/* state += compress(state, w), w is overwritten by message schedule */
+MB_INLINE void sha256_compress(v32 *st, v32 *w)
+{
+	v32 a = st[0], b = st[1], c = st[2], d = st[3],
+	    e = st[4], f = st[5], g = st[6], h = st[7], t1, t2;
+	int i;
+
+	for (i = 0; i < 64; i += 8) {
+		if (i >= 16) {
+			int j;
+			for (j = i; j < i + 8; j++)
+				w[j & 15] += s256_1(w[(j - 2) & 15]) + w[(j - 7) & 15] + s256_0(w[(j - 15) & 15]);
+		}
+		SHA_ROUND(a, b, c, d, e, f, g, h, sha256_k[i + 0], w[(i + 0) & 15], S256_0, S256_1);
+		SHA_ROUND(h, a, b, c, d, e, f, g, sha256_k[i + 1], w[(i + 1) & 15], S256_0, S256_1);
+		SHA_ROUND(g, h, a, b, c, d, e, f, sha256_k[i + 2], w[(i + 2) & 15], S256_0, S256_1);
+		SHA_ROUND(f, g, h, a, b, c, d, e, sha256_k[i + 3], w[(i + 3) & 15], S256_0, S256_1);
+		SHA_ROUND(e, f, g, h, a, b, c, d, sha256_k[i + 4], w[(i + 4) & 15], S256_0, S256_1);
+		SHA_ROUND(d, e, f, g, h, a, b, c, sha256_k[i + 5], w[(i + 5) & 15], S256_0, S256_1);
+		SHA_ROUND(c, d, e, f, g, h, a, b, sha256_k[i + 6], w[(i + 6) & 15], S256_0, S256_1);
+		SHA_ROUND(b, c, d, e, f, g, h, a, sha256_k[i + 7], w[(i + 7) & 15], S256_0, S256_1);
+	}
+
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+	st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+MB_INLINE void sha512_compress(v64 *st, v64 *w)
+{
+	v64 a = st[0], b = st[1], c = st[2], d = st[3],
+	    e = st[4], f = st[5], g = st[6], h = st[7], t1, t2;
+	int i;
+
+	for (i = 0; i < 80; i += 8) {
+		if (i >= 16) {
+			int j;
+			for (j = i; j < i + 8; j++)
+				w[j & 15] += s512_1(w[(j - 2) & 15]) + w[(j - 7) & 15] + s512_0(w[(j - 15) & 15]);
+		}
+		SHA_ROUND(a, b, c, d, e, f, g, h, sha512_k[i + 0], w[(i + 0) & 15], S512_0, S512_1);
+		SHA_ROUND(h, a, b, c, d, e, f, g, sha512_k[i + 1], w[(i + 1) & 15], S512_0, S512_1);
+		SHA_ROUND(g, h, a, b, c, d, e, f, sha512_k[i + 2], w[(i + 2) & 15], S512_0, S512_1);
+		SHA_ROUND(f, g, h, a, b, c, d, e, sha512_k[i + 3], w[(i + 3) & 15], S512_0, S512_1);
+		SHA_ROUND(e, f, g, h, a, b, c, d, sha512_k[i + 4], w[(i + 4) & 15], S512_0, S512_1);
+		SHA_ROUND(d, e, f, g, h, a, b, c, sha512_k[i + 5], w[(i + 5) & 15], S512_0, S512_1);
+		SHA_ROUND(c, d, e, f, g, h, a, b, sha512_k[i + 6], w[(i + 6) & 15], S512_0, S512_1);
+		SHA_ROUND(b, c, d, e, f, g, h, a, sha512_k[i + 7], w[(i + 7) & 15], S512_0, S512_1);
+	}
+
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+	st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+/*
+ * Lane state, words of U, T and HMAC inner/outer midstates.
+ * For SHA-256 only low 32 bits of each word are used.
+ */
+struct mb_lanes {
+	v32 is32[8], os32[8], u32[8], t32[8];
+	v64 is64[8], os64[8], u64[8], t64[8];
+};
+
+struct crypt_hash_multi;
+
+struct mb_hash {
+	const char *name;
+	unsigned lanes;
+	size_t block_size;	/* bytes */
+	size_t hash_size;	/* bytes */
+	void (*midstate)(const unsigned char *block, uint64_t *state);
+	void (*load)(struct mb_lanes *l, unsigned lane, const uint64_t *is, const uint64_t *os,
+		     const unsigned char *u);
+	void (*store)(const struct mb_lanes *l, unsigned lane, unsigned char *t);
+	void (*iterate)(struct mb_lanes *l, uint32_t n);
+	void (*block)(const unsigned char *block, uint64_t *state);
+	void (*multi)(const struct crypt_hash_multi *ctx, const unsigned char *data,
+		      size_t length, unsigned count, unsigned char *digests);
+};
+
+/* Hash state after prefix, message tail is prefix remainder, message, suffix */
+struct crypt_hash_multi {
+	const struct mb_hash *h;
+	uint64_t state[8];
+	uint64_t prefix_length;		/* bytes already in state */
+	unsigned char tail[MB_MAX_BLOCK];
+	size_t tail_length;
+	unsigned char *suffix;
+	size_t suffix_length;
+};
+
+static uint32_t be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t be64(const unsigned char *p)
+{
+	return (uint64_t)be32(p) << 32 | be32(p + 4);
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, (uint32_t)v);
+}
+
+/* midstates are computed once per block chain (or prefix), lane 0 is enough */
+static void sha256_block(const unsigned char *block, uint64_t *state)
+{
+	v32 st[8], w[16];
+	int i;
+
+	memset(st, 0, sizeof(st));
+	memset(w, 0, sizeof(w));
+	for (i = 0; i < 8; i++)
+		st[i][0] = (uint32_t)state[i];
+	for (i = 0; i < 16; i++)
+		w[i][0] = be32(block + 4 * i);
+
+	sha256_compress(st, w);
+
+	for (i = 0; i < 8; i++)
+		state[i] = st[i][0];
+}
+
+static void sha512_block(const unsigned char *block, uint64_t *state)
+{
+	v64 st[8], w[16];
+	int i;
+
+	memset(st, 0, sizeof(st));
+	memset(w, 0, sizeof(w));
+	for (i = 0; i < 8; i++)
+		st[i][0] = state[i];
+	for (i = 0; i < 16; i++)
+		w[i][0] = be64(block + 8 * i);
+
+	sha512_compress(st, w);
+
+	for (i = 0; i < 8; i++)
+		state[i] = st[i][0];
+}
+
+static void sha256_midstate(const unsigned char *block, uint64_t *state)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		state[i] = sha256_iv[i];
+	sha256_block(block, state);
+}
+
+static void sha512_midstate(const unsigned char *block, uint64_t *state)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		state[i] = sha512_iv[i];
+	sha512_block(block, state);
+}
+
+static void sha256_load(struct mb_lanes *l, unsigned lane, const uint64_t *is, const uint64_t *os,
+			const unsigned char *u)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		l->is32[i][lane] = (uint32_t)is[i];
+		l->os32[i][lane] = (uint32_t)os[i];
+		l->u32[i][lane] = l->t32[i][lane] = be32(u + 4 * i);
+	}
+}
+
+static void sha512_load(struct mb_lanes *l, unsigned lane, const uint64_t *is, const uint64_t *os,
+			const unsigned char *u)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		l->is64[i][lane] = is[i];
+		l->os64[i][lane] = os[i];
+		l->u64[i][lane] = l->t64[i][lane] = be64(u + 8 * i);
+	}
+}
+
+static void sha256_store(const struct mb_lanes *l, unsigned lane, unsigned char *t)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		put_be32(t + 4 * i, l->t32[i][lane]);
+}
+
+static void sha512_store(const struct mb_lanes *l, unsigned lane, unsigned char *t)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		put_be64(t + 8 * i, l->t64[i][lane]);
+}
+
+/* U = HMAC(P, U), T ^= U; message is always one hash output (one padded block) */
+MB_INLINE void sha256_iterate_lanes(struct mb_lanes *l, uint32_t n)
+{
+	v32 st[8], w[16];
+	int i;
+
+	while (n--) {
+		memcpy(st, l->is32, sizeof(st));
+		memcpy(w, l->u32, sizeof(l->u32));
+		memset(&w[8], 0, 8 * sizeof(*w));
+		w[8] += 0x80000000;
+		w[15] += (64 + 32) * 8;
+		sha256_compress(st, w);
+
+		memcpy(w, st, sizeof(st));
+		memcpy(st, l->os32, sizeof(st));
+		memset(&w[8], 0, 8 * sizeof(*w));
+		w[8] += 0x80000000;
+		w[15] += (64 + 32) * 8;
+		sha256_compress(st, w);
+
+		for (i = 0; i < 8; i++) {
+			l->u32[i] = st[i];
+			l->t32[i] ^= st[i];
+		}
+	}
+}
+
+MB_INLINE void sha512_iterate_lanes(struct mb_lanes *l, uint32_t n)
+{
+	v64 st[8], w[16];
+	int i;
+
+	while (n--) {
+		memcpy(st, l->is64, sizeof(st));
+		memcpy(w, l->u64, sizeof(l->u64));
+		memset(&w[8], 0, 8 * sizeof(*w));
+		w[8] += 0x8000000000000000ULL;
+		w[15] += (128 + 64) * 8;
+		sha512_compress(st, w);
+
+		memcpy(w, st, sizeof(st));
+		memcpy(st, l->os64, sizeof(st));
+		memset(&w[8], 0, 8 * sizeof(*w));
+		w[8] += 0x8000000000000000ULL;
+		w[15] += (128 + 64) * 8;
+		sha512_compress(st, w);
+
+		for (i = 0; i < 8; i++) {
+			l->u64[i] = st[i];
+			l->t64[i] ^= st[i];
+		}
+	}
+}
+
+static void mb_copy(unsigned char *dst, uint64_t dst_offset, size_t dst_length,
+		    const unsigned char *src, uint64_t src_offset, size_t src_length)
+{
+	uint64_t start = dst_offset > src_offset ? dst_offset : src_offset;
+	uint64_t end = dst_offset + dst_length < src_offset + src_length ?
+		       dst_offset + dst_length : src_offset + src_length;
+
+	if (start < end)
+		memcpy(dst + (start - dst_offset), src + (start - src_offset), end - start);
+}
+
+/*
+ * Returns pointer to message block k (counted after prefix state), the block
+ * is assembled in blk only if it is not entirely inside message data.
+ */
+static const unsigned char *mb_message_block(const struct crypt_hash_multi *ctx,
+	const unsigned char *data, size_t length, uint64_t k, uint64_t blocks,
+	unsigned char *blk)
+{
+	size_t bs = ctx->h->block_size;
+	uint64_t off = k * bs, data_end = ctx->tail_length + length;
+	uint64_t msg_end = data_end + ctx->suffix_length;
+
+	if (off >= ctx->tail_length && off + bs <= data_end)
+		return data + (off - ctx->tail_length);
+
+	memset(blk, 0, bs);
+	mb_copy(blk, off, bs, ctx->tail, 0, ctx->tail_length);
+	mb_copy(blk, off, bs, data, ctx->tail_length, length);
+	mb_copy(blk, off, bs, ctx->suffix, data_end, ctx->suffix_length);
+
+	if (msg_end >= off && msg_end < off + bs)
+		blk[msg_end - off] = 0x80;
+
+	/* length in bits, upper 64 bits of SHA-512 length are always zero */
+	if (k == blocks - 1)
+		put_be64(blk + bs - 8, (ctx->prefix_length + msg_end) * 8);
+
+	return blk;
+}
+
+static uint64_t mb_message_blocks(const struct crypt_hash_multi *ctx, size_t length, size_t length_size)
+{
+	uint64_t msg_length = ctx->tail_length + length + ctx->suffix_length;
+
+	return (msg_length + 1 + length_size + ctx->h->block_size - 1) / ctx->h->block_size;
+}
+
+MB_INLINE void sha256_multi_lanes(const struct crypt_hash_multi *ctx, const unsigned char *data,
+				  size_t length, unsigned count, unsigned char *digests)
+{
+	unsigned char blk[MB_MAX_BLOCK];
+	const unsigned char *p;
+	v32 st[8], w[16];
+	uint64_t k, blocks = mb_message_blocks(ctx, length, 8);
+	unsigned i, lane;
+
+	for (i = 0; i < 8; i++) {
+		memset(&st[i], 0, sizeof(st[i]));
+		st[i] += ctx->prefix_length ? (uint32_t)ctx->state[i] : sha256_iv[i];
+	}
+
+	memset(w, 0, sizeof(w));
+	for (k = 0; k < blocks; k++) {
+		for (lane = 0; lane < count; lane++) {
+			p = mb_message_block(ctx, data + lane * length, length, k, blocks, blk);
+			for (i = 0; i < 16; i++)
+				w[i][lane] = be32(p + 4 * i);
+		}
+		sha256_compress(st, w);
+	}
+
+	for (lane = 0; lane < count; lane++)
+		for (i = 0; i < 8; i++)
+			put_be32(digests + lane * 32 + 4 * i, st[i][lane]);
+}
+
+MB_INLINE void sha512_multi_lanes(const struct crypt_hash_multi *ctx, const unsigned char *data,
+				  size_t length, unsigned count, unsigned char *digests)
+{
+	unsigned char blk[MB_MAX_BLOCK];
+	const unsigned char *p;
+	v64 st[8], w[16];
+	uint64_t k, blocks = mb_message_blocks(ctx, length, 16);
+	unsigned i, lane;
+
+	for (i = 0; i < 8; i++) {
+		memset(&st[i], 0, sizeof(st[i]));
+		st[i] += ctx->prefix_length ? ctx->state[i] : sha512_iv[i];
+	}
+
+	memset(w, 0, sizeof(w));
+	for (k = 0; k < blocks; k++) {
+		for (lane = 0; lane < count; lane++) {
+			p = mb_message_block(ctx, data + lane * length, length, k, blocks, blk);
+			for (i = 0; i < 16; i++)
+				w[i][lane] = be64(p + 8 * i);
+		}
+		sha512_compress(st, w);
+	}
+
+	for (lane = 0; lane < count; lane++)
+		for (i = 0; i < 8; i++)
+			put_be64(digests + lane * 64 + 8 * i, st[i][lane]);
+}
+
+static void sha256_multi(const struct crypt_hash_multi *ctx, const unsigned char *data,
+			 size_t length, unsigned count, unsigned char *digests)
+{
+	sha256_multi_lanes(ctx, data, length, count, digests);
+}
+
+static void sha512_multi(const struct crypt_hash_multi *ctx, const unsigned char *data,
+			 size_t length, unsigned count, unsigned char *digests)
+{
+	sha512_multi_lanes(ctx, data, length, count, digests);
+}
+
+static void sha256_iterate(struct mb_lanes *l, uint32_t n)
+{
+	sha256_iterate_lanes(l, n);
+}
+
+static void sha512_iterate(struct mb_lanes *l, uint32_t n)
+{
+	sha512_iterate_lanes(l, n);
+}
+
+#if MB_X86
+static AVX2 void sha256_iterate_avx2(struct mb_lanes *l, uint32_t n)
+{
+	sha256_iterate_lanes(l, n);
+}
+
+static AVX2 void sha512_iterate_avx2(struct mb_lanes *l, uint32_t n)
+{
+	sha512_iterate_lanes(l, n);
+}
+
+static AVX2 void sha256_multi_avx2(const struct crypt_hash_multi *ctx, const unsigned char *data,
+				   size_t length, unsigned count, unsigned char *digests)
+{
+	sha256_multi_lanes(ctx, data, length, count, digests);
+}
+
+static AVX2 void sha512_multi_avx2(const struct crypt_hash_multi *ctx, const unsigned char *data,
+				   size_t length, unsigned count, unsigned char *digests)
+{
+	sha512_multi_lanes(ctx, data, length, count, digests);
+}
+
+/* the same test the native SHA-256 uses to select its SHA-NI path */
+static bool sha_ni_available(void)
+{
+	return crypt_cpu_has(CRYPT_CPU_SHA | CRYPT_CPU_SSE41);
+}
+#endif
+
+static const struct mb_hash mb_hashes[] = {
+	{ "sha256", LANES32, 64,  32, sha256_midstate, sha256_load, sha256_store, sha256_iterate,
+	  sha256_block, sha256_multi },
+	{ "sha512", LANES64, 128, 64, sha512_midstate, sha512_load, sha512_store, sha512_iterate,
+	  sha512_block, sha512_multi },
+	{ NULL, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+#if MB_X86
+static const struct mb_hash mb_hashes_avx2[] = {
+	{ "sha256", LANES32, 64,  32, sha256_midstate, sha256_load, sha256_store, sha256_iterate_avx2,
+	  sha256_block, sha256_multi_avx2 },
+	{ "sha512", LANES64, 128, 64, sha512_midstate, sha512_load, sha512_store, sha512_iterate_avx2,
+	  sha512_block, sha512_multi_avx2 },
+	{ NULL, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+#endif
+
+static const struct mb_hash *mb_hash_table(void)
+{
+#if MB_X86
+	if (crypt_cpu_has(CRYPT_CPU_AVX2))
+		return mb_hashes_avx2;
+#endif
+	return mb_hashes;
+}
+
+static const struct mb_hash *mb_hash_get(const char *name)
+{
+	const struct mb_hash *table = mb_hash_table();
+	int i;
+
+	for (i = 0; name && table[i].name; i++)
+		if (!strcmp(table[i].name, name))
+			return &table[i];
+
+	return NULL;
+}
+
+/* One PBKDF2 output block (chain) */
+struct mb_task {
+	struct crypt_pbkdf2_job *job;
+	uint32_t index;
+};
+
+struct mb_job_ctx {
+	uint64_t is[8], os[8];
+};
+
+static int mb_job_init(const struct mb_hash *h, const struct crypt_pbkdf2_job *job,
+		       struct mb_job_ctx *ctx)
+{
+	unsigned char key[MB_MAX_BLOCK], pad[MB_MAX_BLOCK];
+	struct crypt_hash *hd;
+	size_t i;
+	int r = 0;
+
+	memset(key, 0, sizeof(key));
+
+	if (job->password_length > h->block_size) {
+		if (crypt_hash_init(&hd, h->name))
+			return -EINVAL;
+		r = crypt_hash_write(hd, job->password, job->password_length);
+		if (!r)
+			r = crypt_hash_final(hd, (char *)key, h->hash_size);
+		crypt_hash_destroy(hd);
+		if (r)
+			return r;
+	} else if (job->password_length)
+		memcpy(key, job->password, job->password_length);
+
+	for (i = 0; i < h->block_size; i++)
+		pad[i] = key[i] ^ 0x36;
+	h->midstate(pad, ctx->is);
+
+	for (i = 0; i < h->block_size; i++)
+		pad[i] = key[i] ^ 0x5c;
+	h->midstate(pad, ctx->os);
+
+	crypt_backend_memzero(key, sizeof(key));
+	crypt_backend_memzero(pad, sizeof(pad));
+
+	return r;
+}
+
+/* U_1 = HMAC(P, S || INT(i)) */
+static int mb_first_iteration(const struct mb_hash *h, const struct mb_task *t, unsigned char *u)
+{
+	struct crypt_hmac *hmac;
+	unsigned char idx[4];
+	int r;
+
+	if (crypt_hmac_init(&hmac, h->name, t->job->password, t->job->password_length))
+		return -EINVAL;
+
+	put_be32(idx, t->index);
+	r = crypt_hmac_write(hmac, t->job->salt, t->job->salt_length);
+	if (!r)
+		r = crypt_hmac_write(hmac, (const char *)idx, sizeof(idx));
+	if (!r)
+		r = crypt_hmac_final(hmac, (char *)u, h->hash_size);
+
+	crypt_hmac_destroy(hmac);
+	return r;
+}
+
+static void mb_task_store(const struct mb_hash *h, const struct mb_task *t, const unsigned char *block)
+{
+	size_t off = (size_t)(t->index - 1) * h->hash_size;
+	size_t len = t->job->key_length - off;
+
+	memcpy(t->job->key + off, block, len > h->hash_size ? h->hash_size : len);
+}
+
+int crypt_pbkdf2_multi(const char *hash, struct crypt_pbkdf2_job *jobs, unsigned count)
+{
+	const struct mb_hash *h = mb_hash_get(hash);
+	struct mb_lanes *l = NULL;
+	struct mb_task *tasks = NULL, lane_task[MB_MAX_LANES];
+	struct mb_job_ctx *ctx = NULL;
+	uint32_t lane_left[MB_MAX_LANES], n;
+	unsigned char u[MB_MAX_HASH];
+	unsigned i, j, ntasks = 0, next = 0, active;
+	int r = -ENOMEM;
+
+	/* FIPS requires certified backend implementation */
+	if (!h || crypt_fips_mode())
+		return -ENOTSUP;
+
+	if (!jobs || !count)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!jobs[i].iterations || !jobs[i].key_length || !jobs[i].key ||
+		    jobs[i].key_length > 4294967295U)
+			return -EINVAL;
+		ntasks += (jobs[i].key_length + h->hash_size - 1) / h->hash_size;
+	}
+
+	tasks = malloc(ntasks * sizeof(*tasks));
+	ctx = malloc(count * sizeof(*ctx));
+	/* vector members need proper alignment */
+	if (posix_memalign((void **)&l, MB_VEC_SIZE, sizeof(*l)))
+		l = NULL;
+	if (!tasks || !ctx || !l)
+		goto out;
+	memset(l, 0, sizeof(*l));
+
+	for (i = 0, ntasks = 0; i < count; i++) {
+		r = mb_job_init(h, &jobs[i], &ctx[i]);
+		if (r < 0)
+			goto out;
+		for (j = 0; j * h->hash_size < jobs[i].key_length; j++) {
+			tasks[ntasks].job = &jobs[i];
+			tasks[ntasks++].index = j + 1;
+		}
+	}
+
+	memset(lane_left, 0, sizeof(lane_left));
+	active = 0;
+	r = 0;
+
+	do {
+		/* refill idle lanes, chains with one iteration are done right away */
+		for (i = 0; i < h->lanes; i++) {
+			while (!lane_left[i] && next < ntasks) {
+				lane_task[i] = tasks[next++];
+				r = mb_first_iteration(h, &lane_task[i], u);
+				if (r < 0)
+					goto out;
+				if (lane_task[i].job->iterations == 1) {
+					mb_task_store(h, &lane_task[i], u);
+					continue;
+				}
+				h->load(l, i, ctx[lane_task[i].job - jobs].is,
+					ctx[lane_task[i].job - jobs].os, u);
+				lane_left[i] = lane_task[i].job->iterations - 1;
+				active++;
+			}
+		}
+
+		if (!active)
+			break;
+
+		/* run until first lane finishes */
+		for (i = 0, n = UINT32_MAX; i < h->lanes; i++)
+			if (lane_left[i] && lane_left[i] < n)
+				n = lane_left[i];
+
+		h->iterate(l, n);
+
+		for (i = 0; i < h->lanes; i++) {
+			if (!lane_left[i])
+				continue;
+			lane_left[i] -= n;
+			if (!lane_left[i]) {
+				h->store(l, i, u);
+				mb_task_store(h, &lane_task[i], u);
+				active--;
+			}
+		}
+	} while (active || next < ntasks);
+out:
+	crypt_backend_memzero(u, sizeof(u));
+	if (l) {
+		crypt_backend_memzero(l, sizeof(*l));
+		free(l);
+	}
+	if (ctx) {
+		crypt_backend_memzero(ctx, count * sizeof(*ctx));
+		free(ctx);
+	}
+	free(tasks);
+
+	return r;
+}
+
+/*
+ * Minimal number of independent blocks for lanes to be faster than backend,
+ * measured against OpenSSL (with and without SHA extensions).
+ */
+unsigned crypt_pbkdf2_multi_lanes(const char *hash)
+{
+#if MB_X86
+	const struct mb_hash *h;
+
+	if (mb_hash_table() != mb_hashes_avx2 || !(h = mb_hash_get(hash)))
+		return 0;
+
+	if (h->hash_size == 32)
+		return sha_ni_available() ? 3 : 2;
+	return 2;
+#else
+	return 0;
+#endif
+}
+
+int crypt_pbkdf2_multi_try(const char *hash, const char *password, size_t password_length,
+			   const char *salt, size_t salt_length,
+			   char *key, size_t key_length, uint32_t iterations)
+{
+	struct crypt_pbkdf2_job job = {
+		.password = password, .password_length = password_length,
+		.salt = salt, .salt_length = salt_length,
+		.iterations = iterations,
+		.key = key, .key_length = key_length
+	};
+	unsigned min_blocks = crypt_pbkdf2_multi_lanes(hash);
+	size_t hash_size;
+
+	/* FIPS requires certified backend implementation */
+	if (!min_blocks || !key_length || crypt_fips_mode())
+		return -ENOTSUP;
+
+	hash_size = mb_hash_get(hash)->hash_size;
+	if ((key_length + hash_size - 1) / hash_size < min_blocks)
+		return -ENOTSUP;
+
+	return crypt_pbkdf2_multi(hash, &job, 1);
+}
+
+int crypt_hash_multi_init(struct crypt_hash_multi **ctx, const char *name,
+			  const char *prefix, size_t prefix_length,
+			  const char *suffix, size_t suffix_length)
+{
+	const struct mb_hash *h = mb_hash_get(name);
+	struct crypt_hash_multi *c;
+	size_t bs;
+
+	if (!h)
+		return -ENOTSUP;
+
+	if (!ctx || (prefix_length && !prefix) || (suffix_length && !suffix))
+		return -EINVAL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->h = h;
+	bs = h->block_size;
+
+	if (suffix_length) {
+		c->suffix = malloc(suffix_length);
+		if (!c->suffix) {
+			free(c);
+			return -ENOMEM;
+		}
+		memcpy(c->suffix, suffix, suffix_length);
+		c->suffix_length = suffix_length;
+	}
+
+	/* full prefix blocks are hashed only once */
+	while (prefix_length >= bs) {
+		if (c->prefix_length)
+			h->block((const unsigned char *)prefix, c->state);
+		else
+			h->midstate((const unsigned char *)prefix, c->state);
+		c->prefix_length += bs;
+		prefix += bs;
+		prefix_length -= bs;
+	}
+
+	memcpy(c->tail, prefix, prefix_length);
+	c->tail_length = prefix_length;
+
+	*ctx = c;
+	return 0;
+}
+
+int crypt_hash_multi(struct crypt_hash_multi *ctx, const char *data, size_t length,
+		     unsigned count, char *digests)
+{
+	unsigned n;
+
+	if (!ctx || !data || !digests)
+		return -EINVAL;
+
+	while (count) {
+		n = count > ctx->h->lanes ? ctx->h->lanes : count;
+		ctx->h->multi(ctx, (const unsigned char *)data, length, n, (unsigned char *)digests);
+		data += (size_t)n * length;
+		digests += (size_t)n * ctx->h->hash_size;
+		count -= n;
+	}
+
+	return 0;
+}
+
+void crypt_hash_multi_destroy(struct crypt_hash_multi *ctx)
+{
+	if (!ctx)
+		return;
+
+	free(ctx->suffix);
+	crypt_backend_memzero(ctx, sizeof(*ctx));
+	free(ctx);
+}
+
+/*
+ * Number of messages hashed at once, 0 if backend hash is faster
+ * (backend SHA-256 with SHA extensions beats AVX2 lanes).
+ */
+unsigned crypt_hash_multi_lanes(const char *name)
+{
+#if MB_X86
+	const struct mb_hash *h;
+
+	if (crypt_fips_mode() || mb_hash_table() != mb_hashes_avx2 || !(h = mb_hash_get(name)))
+		return 0;
+
+	if (h->hash_size == 32 && sha_ni_available())
+		return 0;
+
+	return h->lanes;
+#else
+	return 0;
+#endif
+}
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <sched.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -37,6 +38,8 @@
 #define BENCH_PERCENT_ATMOST 110
 #define BENCH_SAMPLES_FAST 3
 #define BENCH_SAMPLES_SLOW 1
+#define BENCH_SAMPLES_ROBUST 5
+#define BENCH_SAMPLES_MAX 64
 
 /* These PBKDF2 limits must be never violated */
 int crypt_pbkdf_get_limits(const char *kdf, struct crypt_pbkdf_limits *limits)
@@ -100,51 +103,176 @@ static long timespec_ms(struct timespec *start, struct timespec *end)
 	        (end->tv_nsec - start->tv_nsec) / (1000 * 1000);
 }
 
-static int measure_argon2(const char *kdf, const char *password, size_t password_length,
-			  const char *salt, size_t salt_length,
-			  char *key, size_t key_length,
-			  uint32_t t_cost, uint32_t m_cost, uint32_t parallel,
-			  size_t samples, long ms_atleast, long *out_ms)
+static int measure_once(const char *kdf, const char *hash,
+			const char *password, size_t password_length,
+			const char *salt, size_t salt_length,
+			char *key, size_t key_length,
+			uint32_t iterations, uint32_t memory, uint32_t parallel,
+			int clock, long *out_ms)
 {
-	long ms, ms_min = LONG_MAX;
+	struct rusage rstart, rend;
+	struct timespec tstart, tend;
+	long ms;
 	int r;
-	size_t i;
 
-	for (i = 0; i < samples; i++) {
-		struct timespec tstart, tend;
+	if (getrusage(RUSAGE_SELF, &rstart) < 0 ||
+	    clock_gettime(CLOCK_MONOTONIC_RAW, &tstart) < 0)
+		return -EINVAL;
+
+	r = crypt_pbkdf(kdf, hash, password, password_length, salt,
+			salt_length, key, key_length, iterations, memory, parallel);
+	if (r < 0)
+		return r;
+
+	if (getrusage(RUSAGE_SELF, &rend) < 0 ||
+	    clock_gettime(CLOCK_MONOTONIC_RAW, &tend) < 0)
+		return -EINVAL;
+
+	/* CPU time of multithreaded Argon2 is the sum of all lanes */
+	if (clock == CRYPT_PBKDF_BENCH_CLOCK_CPU)
+		ms = time_ms(&rstart, &rend) / (parallel > 1 ? (long)parallel : 1);
+	else
+		ms = timespec_ms(&tstart, &tend);
+
+	if (ms < 0)
+		return -EINVAL;
+
+	*out_ms = ms;
+	return 0;
+}
+
+/* Enough for deviation of few samples, avoids libm dependency */
+static double bench_sqrt(double x)
+{
+	double y = x > 1. ? x : 1.;
+	int i;
+
+	if (x <= 0.)
+		return 0.;
+
+	for (i = 0; i < 32; i++)
+		y = (y + x / y) / 2.;
+
+	return y;
+}
 
-		/*
-		 * NOTE: We must use clock_gettime here, because Argon2 can run over
-		 * multiple threads, and thus we care about real time, not CPU time!
-		 */
-		if (clock_gettime(CLOCK_MONOTONIC_RAW, &tstart) < 0)
-			return -EINVAL;
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static long median(long *v, size_t n)
+{
+	qsort(v, n, sizeof(*v), cmp_long);
+	return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
 
-		r = crypt_pbkdf(kdf, NULL, password, password_length, salt,
-		                salt_length, key, key_length, t_cost, m_cost, parallel);
+/*
+ * Median of samples after dropping outliers (farther than 3 scaled MADs
+ * from median, but never within 5 % of it), result is the median of the rest.
+ * Relative standard deviation of kept samples goes to bench.
+ */
+static long robust_ms(long *ms, size_t n, struct crypt_pbkdf_bench *bench)
+{
+	long dev[BENCH_SAMPLES_MAX], med, limit;
+	double mean = 0., var = 0.;
+	size_t i, kept = 0;
+
+	for (i = 0; i < n; i++)
+		dev[i] = ms[i];
+	med = median(dev, n);
+
+	for (i = 0; i < n; i++)
+		dev[i] = labs(ms[i] - med);
+	limit = (long)(3 * 1.4826 * median(dev, n));
+	if (limit < med / 20)
+		limit = med / 20;
+
+	for (i = 0; i < n; i++)
+		if (labs(ms[i] - med) <= limit)
+			ms[kept++] = ms[i];
+
+	for (i = 0; i < kept; i++)
+		mean += ms[i];
+	mean /= kept;
+	for (i = 0; i < kept; i++)
+		var += (ms[i] - mean) * (ms[i] - mean);
+
+	bench->samples_used = (unsigned)kept;
+	bench->deviation = (kept > 1 && mean > 0.) ? bench_sqrt(var / (kept - 1)) * 100. / mean : 0.;
+
+	return median(ms, kept);
+}
+
+/*
+ * Legacy mode returns minimum of samples with early exit if a sample
+ * reaches ms_atleast; robust mode (bench->samples > 1) runs all samples
+ * of slow measurements.
+ */
+static int measure_kdf(const char *kdf, const char *hash,
+		       const char *password, size_t password_length,
+		       const char *salt, size_t salt_length,
+		       char *key, size_t key_length,
+		       uint32_t iterations, uint32_t memory, uint32_t parallel,
+		       size_t samples, long ms_atleast, int clock,
+		       struct crypt_pbkdf_bench *bench, long *out_ms)
+{
+	long ms[BENCH_SAMPLES_MAX], ms_min = LONG_MAX;
+	bool robust = bench && bench->samples > 1 && samples == BENCH_SAMPLES_SLOW;
+	int r;
+	size_t i;
+
+	if (robust)
+		samples = bench->samples > BENCH_SAMPLES_MAX ? BENCH_SAMPLES_MAX : bench->samples;
+
+	for (i = 0; i < samples; i++) {
+		r = measure_once(kdf, hash, password, password_length, salt, salt_length,
+				 key, key_length, iterations, memory, parallel, clock, &ms[i]);
 		if (r < 0)
 			return r;
 
-		if (clock_gettime(CLOCK_MONOTONIC_RAW, &tend) < 0)
-			return -EINVAL;
-
-		ms = timespec_ms(&tstart, &tend);
-		if (ms < 0)
-			return -EINVAL;
+		if (robust)
+			continue;
 
-		if (ms < ms_atleast) {
+		if (ms[i] < ms_atleast) {
 			/* early exit */
-			ms_min = ms;
+			ms_min = ms[i];
 			break;
 		}
-		if (ms < ms_min) {
-			ms_min = ms;
+		if (ms[i] < ms_min) {
+			ms_min = ms[i];
+		}
+	}
+
+	if (robust)
+		*out_ms = robust_ms(ms, samples, bench);
+	else {
+		*out_ms = ms_min;
+		if (bench) {
+			bench->samples_used = 1;
+			bench->deviation = 0.;
 		}
 	}
-	*out_ms = ms_min;
 	return 0;
 }
 
+/* Pin calling thread to its current CPU (single threaded KDF only) */
+static bool pin_cpu(cpu_set_t *old)
+{
+	cpu_set_t set;
+	int cpu;
+
+	cpu = sched_getcpu();
+	if (cpu < 0 || sched_getaffinity(0, sizeof(*old), old) < 0)
+		return false;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return !sched_setaffinity(0, sizeof(set), &set);
+}
+
 #define CONTINUE 0
 #define FINAL   1
 static int next_argon2_params(uint32_t *t_cost, uint32_t *m_cost,
@@ -210,7 +338,9 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 			      size_t salt_length, size_t key_length,
 			      uint32_t min_t_cost, uint32_t min_m_cost, uint32_t max_m_cost,
 			      uint32_t parallel, uint32_t target_ms,
+			      uint32_t hint_t_cost, uint32_t hint_m_cost,
 			      uint32_t *out_t_cost, uint32_t *out_m_cost,
+			      int clock, struct crypt_pbkdf_bench *bench,
 			      int (*progress)(uint32_t time_ms, void *usrptr),
 			      void *usrptr)
 {
@@ -237,11 +367,35 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 	t_cost = min_t_cost;
 	m_cost = min_m_cost;
 
+	/*
+	 * 0. Previously calibrated parameters need only one confirmation run,
+	 * if it is out of range, search continues from there.
+	 */
+	if (hint_t_cost && hint_m_cost) {
+		t_cost = hint_t_cost < min_t_cost ? min_t_cost : hint_t_cost;
+		m_cost = hint_m_cost < min_m_cost ? min_m_cost :
+			 hint_m_cost > max_m_cost ? max_m_cost : hint_m_cost;
+
+		r = measure_kdf(kdf, NULL, password, password_length, salt, salt_length,
+		                key, key_length, t_cost, m_cost, parallel,
+		                BENCH_SAMPLES_SLOW, ms_atleast, clock, bench, &ms);
+		if (!r) {
+			*out_t_cost = t_cost;
+			*out_m_cost = m_cost;
+			if (progress && progress((uint32_t)ms, usrptr))
+				r = -EINTR;
+		}
+
+		if (r < 0 || (ms >= ms_atleast && ms <= ms_atmost))
+			goto out;
+	} else
+		ms = 0;
+
 	/* 1. Find some small parameters, s. t. ms >= BENCH_MIN_MS: */
-	while (1) {
-		r = measure_argon2(kdf, password, password_length, salt, salt_length,
-		                   key, key_length, t_cost, m_cost, parallel,
-		                   BENCH_SAMPLES_FAST, BENCH_MIN_MS, &ms);
+	while (ms < BENCH_MIN_MS) {
+		r = measure_kdf(kdf, NULL, password, password_length, salt, salt_length,
+		                key, key_length, t_cost, m_cost, parallel,
+		                BENCH_SAMPLES_FAST, BENCH_MIN_MS, clock, bench, &ms);
 		if (!r) {
 			/* Update parameters to actual measurement */
 			*out_t_cost = t_cost;
@@ -295,9 +449,9 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 			break;
 		}
 
-		r = measure_argon2(kdf, password, password_length, salt, salt_length,
-		                   key, key_length, t_cost, m_cost, parallel,
-		                   BENCH_SAMPLES_SLOW, ms_atleast, &ms);
+		r = measure_kdf(kdf, NULL, password, password_length, salt, salt_length,
+		                key, key_length, t_cost, m_cost, parallel,
+		                BENCH_SAMPLES_SLOW, ms_atleast, clock, bench, &ms);
 
 		if (!r) {
 			/* Update parameters to actual measurement */
@@ -324,10 +478,10 @@ static int crypt_pbkdf_check(const char *kdf, const char *hash,
 		      const char *password, size_t password_length,
 		      const char *salt, size_t salt_length,
 		      size_t key_length, uint32_t *iter_secs, uint32_t target_ms,
+		      int clock, struct crypt_pbkdf_bench *bench,
 		      int (*progress)(uint32_t time_ms, void *usrptr), void *usrptr)
 
 {
-	struct rusage rstart, rend;
 	int r = 0, step = 0;
 	long ms = 0;
 	char *key = NULL;
@@ -344,23 +498,18 @@ static int crypt_pbkdf_check(const char *kdf, const char *hash,
 	*iter_secs = 0;
 	iterations = 1 << 15;
 	while (1) {
-		if (getrusage(RUSAGE_SELF, &rstart) < 0) {
-			r = -EINVAL;
-			goto out;
-		}
-
-		r = crypt_pbkdf(kdf, hash, password, password_length, salt,
-				salt_length, key, key_length, iterations, 0, 0);
-
+		r = measure_kdf(kdf, hash, password, password_length, salt, salt_length,
+				key, key_length, iterations, 0, 0, BENCH_SAMPLES_SLOW,
+				0, clock, NULL, &ms);
+
+		/* Only the final step is measured with all robust samples */
+		if (!r && ms > 500 && bench)
+			r = measure_kdf(kdf, hash, password, password_length, salt, salt_length,
+					key, key_length, iterations, 0, 0, BENCH_SAMPLES_SLOW,
+					0, clock, bench, &ms);
 		if (r < 0)
 			goto out;
 
-		if (getrusage(RUSAGE_SELF, &rend) < 0) {
-			r = -EINVAL;
-			goto out;
-		}
-
-		ms = time_ms(&rstart, &rend);
 		if (ms) {
 			PBKDF2_temp = (double)iterations * target_ms / ms;
 			if (PBKDF2_temp > UINT32_MAX) {
@@ -400,16 +549,20 @@ out:
 	return r;
 }
 
-int crypt_pbkdf_perf(const char *kdf, const char *hash,
+int crypt_pbkdf_perf_hint(const char *kdf, const char *hash,
 		const char *password, size_t password_size,
 		const char *salt, size_t salt_size,
 		size_t volume_key_size, uint32_t time_ms,
 		uint32_t max_memory_kb, uint32_t parallel_threads,
+		uint32_t hint_iterations, uint32_t hint_memory,
 		uint32_t *iterations_out, uint32_t *memory_out,
+		struct crypt_pbkdf_bench *bench,
 		int (*progress)(uint32_t time_ms, void *usrptr), void *usrptr)
 {
 	struct crypt_pbkdf_limits pbkdf_limits;
-	int r = -EINVAL;
+	cpu_set_t old_cpus;
+	bool pinned = false;
+	int r = -EINVAL, clock;
 	uint32_t min_memory;
 
 	if (!kdf || !iterations_out || !memory_out)
@@ -426,10 +579,23 @@ int crypt_pbkdf_perf(const char *kdf, const char *hash,
 	*memory_out = 0;
 	*iterations_out = 0;
 
+	/*
+	 * Argon2 can run over multiple threads, and thus we care about real time
+	 * by default, PBKDF2 uses CPU time.
+	 */
+	clock = bench ? bench->clock : CRYPT_PBKDF_BENCH_CLOCK_DEFAULT;
+	if (clock == CRYPT_PBKDF_BENCH_CLOCK_DEFAULT)
+		clock = !strcmp(kdf, "pbkdf2") ? CRYPT_PBKDF_BENCH_CLOCK_CPU :
+						 CRYPT_PBKDF_BENCH_CLOCK_WALL;
+
+	/* Pinned multithreaded Argon2 would run serialized */
+	if (bench && bench->pin_cpu && (!strcmp(kdf, "pbkdf2") || parallel_threads <= 1))
+		pinned = pin_cpu(&old_cpus);
+
 	if (!strcmp(kdf, "pbkdf2"))
 		r = crypt_pbkdf_check(kdf, hash, password, password_size,
 				      salt, salt_size, volume_key_size,
-				      iterations_out, time_ms, progress, usrptr);
+				      iterations_out, time_ms, clock, bench, progress, usrptr);
 
 	else if (!strncmp(kdf, "argon2", 6))
 		r = crypt_argon2_check(kdf, password, password_size,
@@ -437,7 +603,25 @@ int crypt_pbkdf_perf(const char *kdf, const char *hash,
 				       pbkdf_limits.min_iterations,
 				       min_memory,
 				       max_memory_kb,
-				       parallel_threads, time_ms, iterations_out,
-				       memory_out, progress, usrptr);
+				       parallel_threads, time_ms,
+				       hint_iterations, hint_memory, iterations_out,
+				       memory_out, clock, bench, progress, usrptr);
+
+	if (pinned)
+		(void)sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+
 	return r;
 }
+
+int crypt_pbkdf_perf(const char *kdf, const char *hash,
+		const char *password, size_t password_size,
+		const char *salt, size_t salt_size,
+		size_t volume_key_size, uint32_t time_ms,
+		uint32_t max_memory_kb, uint32_t parallel_threads,
+		uint32_t *iterations_out, uint32_t *memory_out,
+		int (*progress)(uint32_t time_ms, void *usrptr), void *usrptr)
+{
+	return crypt_pbkdf_perf_hint(kdf, hash, password, password_size, salt, salt_size,
+				     volume_key_size, time_ms, max_memory_kb, parallel_threads,
+				     0, 0, iterations_out, memory_out, NULL, progress, usrptr);
+}
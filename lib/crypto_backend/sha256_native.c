@@ -0,0 +1,257 @@
+/*
+ * In-process SHA-256 (portable, x86 SHA-NI, ARMv8 SHA2 extensions)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crypto_backend_internal.h"
+
+/*
+ * Iterated KDFs hashing a short fixed size message (BitLocker does it 2^20
+ * times) spend nearly all time in backend call overhead, with the kernel
+ * backend every iteration is a send() and read() on AF_ALG socket.
+ * This one-shot SHA-256 runs completely in process.
+ */
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SHA256_X86 1
+#define SHANI __attribute__((target("sha,sse4.1")))
+#endif
+
+#if defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#include <arm_neon.h>
+#define SHA256_ARM 1
+#define SHA2 __attribute__((target("+sha2")))
+#endif
+
+#define SHA256_BLOCK_SIZE	64
+#define SHA256_DIGEST_SIZE	32
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+typedef void (*sha256_compress_fn)(uint32_t *state, const unsigned char *data, size_t blocks);
+
+static inline uint32_t ror32(uint32_t v, int c)
+{
+	return (v >> c) | (v << (32 - c));
+}
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void sha256_compress_generic(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+	uint32_t a, b, c, d, e, f, g, h, t1, t2, w[64];
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++)
+			w[i] = get_be32(data + 4 * i);
+		for (; i < 64; i++)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			       (ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+			     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+			     ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	crypt_backend_memzero(w, sizeof(w));
+}
+
+#if SHA256_X86
+/* State is kept as ABEF and CDGH word pairs, as sha256rnds2 expects */
+static SHANI void sha256_compress_shani(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp, m[4];
+	int i;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	while (blocks--) {
+		abef = state0;
+		cdgh = state1;
+
+		/* m[] is a ring of the last 16 message words, four in each register */
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), bswap);
+			else {
+				tmp = _mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+				m[i & 3] = _mm_sha256msg2_epu32(tmp, m[(i + 3) & 3]);
+			}
+			msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+#if SHA256_ARM
+static SHA2 void sha256_compress_armv8(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+	uint32x4_t abcd, efgh, abcd0, efgh0, msg, tmp, m[4];
+	int i;
+
+	abcd = vld1q_u32(&state[0]);
+	efgh = vld1q_u32(&state[4]);
+
+	while (blocks--) {
+		abcd0 = abcd;
+		efgh0 = efgh;
+
+		/* m[] is a ring of the last 16 message words, four in each register */
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+			else
+				m[i & 3] = vsha256su1q_u32(vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]),
+							   m[(i + 2) & 3], m[(i + 3) & 3]);
+			msg = vaddq_u32(m[i & 3], vld1q_u32(&sha256_k[4 * i]));
+			tmp = abcd;
+			abcd = vsha256hq_u32(abcd, efgh, msg);
+			efgh = vsha256h2q_u32(efgh, tmp, msg);
+		}
+
+		abcd = vaddq_u32(abcd, abcd0);
+		efgh = vaddq_u32(efgh, efgh0);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	vst1q_u32(&state[0], abcd);
+	vst1q_u32(&state[4], efgh);
+}
+#endif
+
+static sha256_compress_fn sha256_compress_get(void)
+{
+#if SHA256_X86
+	if (crypt_cpu_has(CRYPT_CPU_SHA | CRYPT_CPU_SSE41))
+		return sha256_compress_shani;
+#endif
+#if SHA256_ARM
+	if (crypt_cpu_has(CRYPT_CPU_ARM_SHA2))
+		return sha256_compress_armv8;
+#endif
+	return sha256_compress_generic;
+}
+
+int crypt_sha256_native_prefix(const char *prefix, size_t prefix_length,
+			       const char *data, size_t length, char *digest)
+{
+	sha256_compress_fn compress;
+	unsigned char tail[2 * SHA256_BLOCK_SIZE];
+	uint32_t state[8];
+	size_t blocks, rest, tail_length;
+	uint64_t total;
+	int i;
+
+	/* FIPS requires certified backend implementation */
+	if (crypt_fips_mode())
+		return -ENOTSUP;
+
+	if ((length && !data) || (prefix_length && !prefix) || !digest ||
+	    prefix_length % SHA256_BLOCK_SIZE)
+		return -EINVAL;
+
+	compress = sha256_compress_get();
+	memcpy(state, sha256_iv, sizeof(state));
+
+	if (prefix_length)
+		compress(state, (const unsigned char *)prefix, prefix_length / SHA256_BLOCK_SIZE);
+
+	blocks = length / SHA256_BLOCK_SIZE;
+	if (blocks)
+		compress(state, (const unsigned char *)data, blocks);
+
+	/* padding: 0x80, zeroes and 64-bit big-endian bit length, one or two blocks */
+	rest = length % SHA256_BLOCK_SIZE;
+	tail_length = rest < SHA256_BLOCK_SIZE - 8 ? SHA256_BLOCK_SIZE : 2 * SHA256_BLOCK_SIZE;
+	memset(tail, 0, sizeof(tail));
+	if (rest)
+		memcpy(tail, data + blocks * SHA256_BLOCK_SIZE, rest);
+	tail[rest] = 0x80;
+	total = (uint64_t)prefix_length + length;
+	put_be32(&tail[tail_length - 8], (uint32_t)(total >> 29));
+	put_be32(&tail[tail_length - 4], (uint32_t)(total << 3));
+	compress(state, tail, tail_length / SHA256_BLOCK_SIZE);
+
+	for (i = 0; i < 8; i++)
+		put_be32((unsigned char *)&digest[4 * i], state[i]);
+
+	crypt_backend_memzero(tail, sizeof(tail));
+	crypt_backend_memzero(state, sizeof(state));
+	return 0;
+}
+
+int crypt_sha256_native(const char *data, size_t length, char *digest)
+{
+	return crypt_sha256_native_prefix(NULL, 0, data, length, digest);
+}
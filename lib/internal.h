@@ -24,13 +24,16 @@
 #ifndef INTERNAL_H
 #define INTERNAL_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "nls.h"
 #include "bitops.h"
@@ -42,12 +45,22 @@
 #include "utils_io.h"
 #include "crypto_backend/crypto_backend.h"
 #include "utils_storage_wrappers.h"
+#include "utils_trace.h"
 
 #include "libcryptsetup.h"
 
 #include "libcryptsetup_macros.h"
 #include "libcryptsetup_symver.h"
 
+/*
+ * Unlock-only library (--enable-unlock-only) refuses format, dump and
+ * conversion at the API entry points and has no reencryption support,
+ * the unreachable code is then dropped by the linker (--gc-sections).
+ */
+#if CRYPTSETUP_UNLOCK_ONLY
+#undef USE_LUKS2_REENCRYPTION
+#endif
+
 #define LOG_MAX_LEN		4096
 #define MAX_DM_DEPS		32
 
@@ -88,11 +101,17 @@ int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 				   struct crypt_pbkdf_type *pbkdf,
 				   size_t volume_key_size);
 const char *crypt_get_cipher_spec(struct crypt_device *cd);
+int crypt_header_backup_load(struct crypt_device *cd, const char *requested_type,
+			     uint64_t *seqid);
+int crypt_header_backup_image(struct crypt_device *cd, char **image, size_t *image_size);
 
 /* Device backend */
 struct device;
 int device_alloc(struct crypt_device *cd, struct device **device, const char *path);
 int device_alloc_no_check(struct device **device, const char *path);
+int device_alloc_memory(struct crypt_device *cd, struct device **device,
+			const char *buffer, size_t buffer_size, uint64_t size);
+int device_memory_fd(struct device *device);
 void device_close(struct crypt_device *cd, struct device *device);
 void device_free(struct crypt_device *cd, struct device *device);
 const char *device_path(const struct device *device);
@@ -110,12 +129,29 @@ int device_open(struct crypt_device *cd, struct device *device, int flags);
 int device_open_excl(struct crypt_device *cd, struct device *device, int flags);
 void device_release_excl(struct crypt_device *cd, struct device *device);
 void device_disable_direct_io(struct device *device);
+void device_disable_zeroout(struct device *device);
+int device_zeroout_disabled(const struct device *device);
 int device_is_identical(struct device *device1, struct device *device2);
 int device_is_rotational(struct device *device);
+int device_queue_info(struct device *device, int *rotational, int *nvme, uint64_t *nr_requests);
+int device_discard_zeroes(struct device *device);
+enum zoned_model { ZONED_NONE = 0, ZONED_HOST_AWARE, ZONED_HOST_MANAGED };
+int device_zoned(struct device *device, uint64_t *zone_size);
+int device_inline_crypto(struct device *device, const char *mode, uint32_t data_unit_size);
+int device_layout_hints(struct device *device, uint64_t *stripe, uint64_t *erase_block);
+int device_zone_report(struct crypt_device *cd, struct device *device, uint64_t offset,
+		       uint64_t *zone_start, uint64_t *zone_length, uint64_t *write_pointer,
+		       bool *conventional);
+int device_zone_reset(struct crypt_device *cd, struct device *device,
+		      uint64_t offset, uint64_t length);
 size_t device_alignment(struct device *device);
 int device_direct_io(const struct device *device);
 int device_fallocate(struct device *device, uint64_t size);
 void device_sync(struct crypt_device *cd, struct device *device);
+ssize_t device_write_at(struct crypt_device *cd, struct device *device, int devfd,
+			const void *buf, size_t length, off_t offset);
+ssize_t device_read_at(struct crypt_device *cd, struct device *device, int devfd,
+		       void *buf, size_t length, off_t offset);
 int device_check_size(struct crypt_device *cd,
 		      struct device *device,
 		      uint64_t req_offset, int falloc);
@@ -128,6 +164,10 @@ int device_write_lock(struct crypt_device *cd, struct device *device);
 void device_read_unlock(struct crypt_device *cd, struct device *device);
 void device_write_unlock(struct crypt_device *cd, struct device *device);
 bool device_is_locked(struct device *device);
+/* LUKS2 seqid known to be on disk while the write lock is held continuously */
+void device_write_lock_seqid_set(struct device *device, uint64_t seqid);
+void device_write_lock_seqid_invalidate(struct device *device);
+bool device_write_lock_seqid_valid(struct device *device, uint64_t seqid);
 
 enum devcheck { DEV_OK = 0, DEV_EXCL = 1 };
 int device_check_access(struct crypt_device *cd,
@@ -156,21 +196,150 @@ int crypt_confirm(struct crypt_device *cd, const char *msg);
 
 char *crypt_lookup_dev(const char *dev_id);
 int crypt_dev_is_rotational(int major, int minor);
+int crypt_dev_is_nvme(int major, int minor);
+uint64_t crypt_dev_nr_requests(int major, int minor);
+int crypt_dev_discard_zeroes(int major, int minor);
+int crypt_dev_zoned(int major, int minor);
+uint64_t crypt_dev_discard_granularity(int major, int minor);
+uint64_t crypt_dev_md_stripe(int major, int minor);
+int crypt_dev_inline_crypto(int major, int minor, const char *mode, uint32_t data_unit_size);
 int crypt_dev_is_partition(const char *dev_path);
 char *crypt_get_partition_device(const char *dev_path, uint64_t offset, uint64_t size);
 char *crypt_get_base_device(const char *dev_path);
 uint64_t crypt_dev_partition_offset(const char *dev_path);
+int crypt_dev_io_stats(const char *dev_path, uint64_t *ios, uint64_t *ticks_ms);
+int crypt_dev_block_stats(const char *dev_path, struct crypt_io_stats *stats);
 int lookup_by_disk_id(const char *dm_uuid);
 int lookup_by_sysfs_uuid_field(const char *dm_uuid);
+void crypt_devpath_index_drop(void);
 int crypt_uuid_cmp(const char *dm_uuid, const char *hdr_uuid);
 
+/* Cipher and DM capability, PBKDF calibration and keyslot hint cache, see utils_cipher_cache.c */
+int crypt_cipher_cache_check(struct crypt_device *cd, const char *cipher, const char *mode,
+			     const char *integrity, size_t key_size);
+void crypt_cipher_cache_add(struct crypt_device *cd, const char *cipher, const char *mode,
+			    const char *integrity, size_t key_size);
+int crypt_cipher_cache_speed(const char *cipher, const char *mode, size_t key_size,
+			     size_t buffer_size, double *encryption_mbs, double *decryption_mbs);
+void crypt_cipher_cache_speed_add(const char *cipher, const char *mode, size_t key_size,
+				  size_t buffer_size, double encryption_mbs, double decryption_mbs);
+int crypt_pbkdf_cache_get(struct crypt_device *cd, const struct crypt_pbkdf_type *pbkdf,
+			  size_t volume_key_size, uint32_t *iterations, uint32_t *memory_kb);
+void crypt_pbkdf_cache_add(struct crypt_device *cd, const struct crypt_pbkdf_type *pbkdf,
+			   size_t volume_key_size, uint32_t iterations, uint32_t memory_kb);
+int crypt_dm_cache_get(struct crypt_device *cd, uint32_t *dm_flags, uint32_t *checked);
+void crypt_dm_cache_set(struct crypt_device *cd, uint32_t dm_flags, uint32_t checked);
+
+int crypt_keyslot_hint_get(struct crypt_device *cd, const char *credential);
+void crypt_keyslot_hint_set(struct crypt_device *cd, const char *credential, int keyslot);
+const char *crypt_keyslot_hint_credential(struct crypt_device *cd);
+bool crypt_keyslot_hint_enabled(struct crypt_device *cd);
+
+/* Worker threads, see utils_executor.c; on start failure run the work inline */
+#define CRYPT_THREAD_CONCURRENT	(1 << 0) /* must run alongside its siblings (barrier, pipeline) */
+#define CRYPT_THREAD_CANCEL	(1 << 1) /* own thread, can be cancelled */
+
+struct crypt_exec_task;
+struct crypt_thread {
+	pthread_t thread;
+	struct crypt_exec_task *task;
+	bool started;
+};
+
+int crypt_thread_start(struct crypt_thread *t, void *(*fn)(void *arg), void *arg, uint32_t flags);
+void crypt_thread_join(struct crypt_thread *t);
+int crypt_thread_cancel(struct crypt_thread *t);
+void crypt_executor_init(void);
+void crypt_executor_exit(void);
+
+/* Parallel keyslot trial, see utils_keyslot_trial.c */
+struct crypt_kdf_job {
+	int keyslot;
+	struct crypt_pbkdf_type pbkdf;
+	char *salt;
+	size_t salt_len;
+	struct volume_key *derived_key;
+	const char *password;	/* if set, used instead of the trial password */
+	size_t password_len;
+	/* if set, used instead of crypt_pbkdf() and allocates derived_key */
+	int (*kdf)(struct crypt_device *cd, struct crypt_kdf_job *job,
+		   const char *password, size_t password_len);
+	int r;
+};
+
+int crypt_kdf_parallel_trial(struct crypt_device *cd, struct crypt_kdf_job *jobs, unsigned count,
+	const char *password, size_t password_len,
+	int (*verify)(struct crypt_device *cd, struct crypt_kdf_job *job, void *usrptr),
+	void *usrptr);
+void crypt_kdf_jobs_free(struct crypt_kdf_job *jobs, unsigned count);
+bool crypt_keyslot_parallel_trial(struct crypt_device *cd);
+bool crypt_token_parallel_open(struct crypt_device *cd);
+unsigned crypt_token_keyring_cache_timeout(struct crypt_device *cd);
+uint32_t crypt_token_timeout(struct crypt_device *cd);
+uint32_t crypt_deactivate_timeout(struct crypt_device *cd);
+void crypt_token_stats_reset(struct crypt_device *cd);
+struct crypt_token_open_stats *crypt_token_stats(struct crypt_device *cd, int token);
+uint64_t crypt_verity_fec_memory_kb(struct crypt_device *cd);
+unsigned crypt_verity_threads(struct crypt_device *cd);
+
+/* Reencryption tuning set by crypt_reencrypt_set_* before reencryption init */
+struct crypt_reencrypt_tuning {
+	uint32_t threads;
+	uint32_t step_latency_ms;
+	uint32_t hotzone_batch;
+	uint64_t max_throughput;
+	uint32_t max_io_latency_ms;
+};
+const struct crypt_reencrypt_tuning *crypt_get_reencrypt_tuning(struct crypt_device *cd);
+struct crypt_vk_session *crypt_vk_session(struct crypt_device *cd);
+char **crypt_keystore_name(struct crypt_device *cd);
+struct crypt_async **crypt_async_handle(struct crypt_device *cd);
+int crypt_async_stage(struct crypt_device *cd, int stage);
+
+/* Performance counters, cd can be NULL (process totals only) */
+#define crypt_perf_add(cd, field, value) \
+	crypt_perf_add_offset(cd, offsetof(struct crypt_perf_stats, field), value)
+void crypt_perf_add_offset(struct crypt_device *cd, size_t offset, uint64_t value);
+uint64_t crypt_perf_time_us(void);
+
+struct crypt_perf_kdf {
+	uint64_t wall_us;
+	uint64_t cpu_us;
+	int span;
+};
+void crypt_perf_kdf_begin(struct crypt_device *cd, struct crypt_perf_kdf *k);
+void crypt_perf_kdf_end(struct crypt_device *cd, const struct crypt_perf_kdf *k);
+
+/*
+ * Latency spans, recorded only with CRYPT_DEBUG_JSON debug level.
+ * The outermost crypt_spans_finish() prints all spans as Chrome trace JSON.
+ * Span names must be string literals.
+ */
+int crypt_spans_start(struct crypt_device *cd, const char *name);
+void crypt_spans_finish(struct crypt_device *cd, int span);
+int crypt_span_begin(struct crypt_device *cd, const char *name);
+void crypt_span_end(struct crypt_device *cd, int span);
+
 size_t crypt_getpagesize(void);
 unsigned crypt_cpusonline(void);
 uint64_t crypt_getphysmemory_kb(void);
+uint64_t crypt_getcgroupmemory_kb(void);
+uint64_t crypt_getavailmemory_kb(void);
+uint32_t crypt_pbkdf_memory_limit_kb(const char **source);
+
+/* NUMA helpers, all placement calls are only hints (errors are ignored) */
+#define CRYPT_NUMA_MAX_NODES 64
+int crypt_numa_nodes(unsigned *nodes, unsigned max_nodes);
+int crypt_numa_node_cpus(unsigned node, cpu_set_t *cpus);
+int crypt_numa_memory_bind(void *addr, size_t len, unsigned node);
 
 int init_crypto(struct crypt_device *ctx);
 
-#define log_dbg(c, x...) crypt_logf(c, CRYPT_LOG_DEBUG, x)
+/* debug message is not even formatted if debug is disabled */
+#define log_dbg(c, x...) do { \
+	if (crypt_get_debug_level() <= CRYPT_LOG_DEBUG) \
+		crypt_logf(c, CRYPT_LOG_DEBUG, x); \
+} while (0)
 #define log_std(c, x...) crypt_logf(c, CRYPT_LOG_NORMAL, x)
 #define log_verbose(c, x...) crypt_logf(c, CRYPT_LOG_VERBOSE, x)
 #define log_err(c, x...) crypt_logf(c, CRYPT_LOG_ERROR, x)
@@ -211,6 +380,24 @@ int crypt_wipe_device(struct crypt_device *cd,
 	size_t wipe_block_size,
 	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 	void *usrptr);
+struct crypt_wipe_range {
+	uint64_t offset;
+	uint64_t length;
+};
+int crypt_wipe_device_ranges(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	const struct crypt_wipe_range *ranges,
+	unsigned int count,
+	size_t wipe_block_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr);
+int crypt_wipe_device_discard(struct crypt_device *cd,
+	struct device *device,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	const char **method);
 
 /* Internal integrity helpers */
 const char *crypt_get_integrity(struct crypt_device *cd);
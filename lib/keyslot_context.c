@@ -21,11 +21,229 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
 
 #include "luks1/luks.h"
-#include "luks2/luks2.h"
+#include "luks2/luks2_internal.h"
+#include "utils_keyring.h"
 #include "keyslot_context.h"
 
+#define VK_SESSION_DIGEST_LEN 32
+
+/*
+ * Volume key session (crypt_volume_key_session). The last volume key unlocked
+ * by passphrase or keyfile is kept in locked memory (and optionally in user
+ * keyring) with digests of the credential and of the metadata of unlocked
+ * keyslot. Both digests are salted by device UUID.
+ */
+struct crypt_vk_session_entry {
+	char credential[VK_SESSION_DIGEST_LEN];
+	char keyslot_digest[VK_SESSION_DIGEST_LEN];
+	int keyslot;
+	int segment;
+	size_t key_size;
+	char key[];
+};
+
+static int vk_session_digest(struct crypt_device *cd, const void *data, size_t data_len, char *digest)
+{
+	struct crypt_hash *hd = NULL;
+	const char *uuid = crypt_get_uuid(cd) ?: "";
+	int r;
+
+	if (crypt_hash_init(&hd, "sha256"))
+		return -EINVAL;
+
+	r = crypt_hash_write(hd, uuid, strlen(uuid) + 1);
+	if (!r)
+		r = crypt_hash_write(hd, data, data_len);
+	if (!r)
+		r = crypt_hash_final(hd, digest, VK_SESSION_DIGEST_LEN);
+
+	crypt_hash_destroy(hd);
+	return r ? -EINVAL : 0;
+}
+
+/* Any keyslot change (new passphrase means new salt) changes the digest */
+static int vk_session_keyslot_digest(struct crypt_device *cd, int keyslot, char *digest)
+{
+	struct luks2_hdr *hdr2 = crypt_get_hdr(cd, CRYPT_LUKS2);
+	struct luks_phdr *hdr1 = crypt_get_hdr(cd, CRYPT_LUKS1);
+	json_object *jobj_keyslot;
+	const char *str;
+	crypt_keyslot_info ki;
+
+	if (hdr2) {
+		jobj_keyslot = LUKS2_get_keyslot_jobj(hdr2, keyslot);
+		if (!jobj_keyslot)
+			return -ENOENT;
+		str = json_object_to_json_string_ext(jobj_keyslot, JSON_C_TO_STRING_PLAIN);
+		return vk_session_digest(cd, str, strlen(str), digest);
+	}
+
+	if (!hdr1)
+		return -EINVAL;
+
+	ki = LUKS_keyslot_info(hdr1, keyslot);
+	if (ki != CRYPT_SLOT_ACTIVE && ki != CRYPT_SLOT_ACTIVE_LAST)
+		return -ENOENT;
+
+	return vk_session_digest(cd, &hdr1->keyblock[keyslot], sizeof(hdr1->keyblock[keyslot]), digest);
+}
+
+static int vk_session_description(const char *credential, char *desc, size_t desc_len)
+{
+	char hex[2 * VK_SESSION_DIGEST_LEN + 1];
+
+	crypt_bytes_to_hex_buffer(hex, VK_SESSION_DIGEST_LEN, credential);
+	return snprintf(desc, desc_len, "cryptsetup:vk-session-%s", hex) < (int)desc_len ? 0 : -EINVAL;
+}
+
+static int vk_session_verify(struct crypt_device *cd,
+	const struct crypt_vk_session_entry *e,
+	int keyslot,
+	int segment,
+	struct volume_key **r_vk)
+{
+	struct luks2_hdr *hdr2 = crypt_get_hdr(cd, CRYPT_LUKS2);
+	char digest[VK_SESSION_DIGEST_LEN];
+	struct volume_key *vk;
+	int r;
+
+	if ((keyslot != CRYPT_ANY_SLOT && keyslot != e->keyslot) || segment != e->segment)
+		return -ENOENT;
+
+	r = vk_session_keyslot_digest(cd, e->keyslot, digest);
+	if (r < 0 || memcmp(digest, e->keyslot_digest, sizeof(digest))) {
+		log_dbg(cd, "Keyslot %d changed since volume key session entry was created.", e->keyslot);
+		return -ENOENT;
+	}
+
+	vk = crypt_alloc_volume_key(e->key_size, e->key);
+	if (!vk)
+		return -ENOMEM;
+
+	if (hdr2) {
+		r = LUKS2_keyslot_for_segment(hdr2, e->keyslot, segment);
+		if (!r)
+			r = LUKS2_digest_verify(cd, hdr2, vk, e->keyslot);
+		if (r >= 0)
+			crypt_volume_key_set_id(vk, r);
+	} else
+		r = LUKS_verify_volume_key(crypt_get_hdr(cd, CRYPT_LUKS1), vk);
+
+	if (r < 0) {
+		log_dbg(cd, "Volume key session entry does not match keyslot %d.", e->keyslot);
+		crypt_free_volume_key(vk);
+		return -ENOENT;
+	}
+
+	log_dbg(cd, "Reusing volume key of keyslot %d from volume key session.", e->keyslot);
+	*r_vk = vk;
+	return e->keyslot;
+}
+
+/* Returns keyslot of reused volume key or -ENOENT, caller then unlocks keyslot as usual */
+static int vk_session_get(struct crypt_device *cd,
+	const char *passphrase,
+	size_t passphrase_size,
+	int keyslot,
+	int segment,
+	struct volume_key **r_vk)
+{
+	struct crypt_vk_session *s = crypt_vk_session(cd);
+	struct crypt_vk_session_entry *e;
+	char credential[VK_SESSION_DIGEST_LEN], desc[128], *buf = NULL;
+	size_t buf_len = 0;
+	int r = -ENOENT;
+
+	if (!s || vk_session_digest(cd, passphrase, passphrase_size, credential))
+		return -ENOENT;
+
+	if (s->e && crypt_perf_time_us() > s->expires_us) {
+		log_dbg(cd, "Volume key session entry expired.");
+		crypt_safe_free(s->e);
+		s->e = NULL;
+	}
+
+	if (s->e && !memcmp(s->e->credential, credential, sizeof(credential)))
+		return vk_session_verify(cd, s->e, keyslot, segment, r_vk);
+
+	if (!(s->flags & CRYPT_VOLUME_KEY_SESSION_KEYRING) ||
+	    vk_session_description(credential, desc, sizeof(desc)) ||
+	    keyring_get_passphrase(desc, &buf, &buf_len))
+		return -ENOENT;
+
+	e = (struct crypt_vk_session_entry *)buf;
+	if (buf_len > sizeof(*e) && buf_len == sizeof(*e) + e->key_size &&
+	    !memcmp(e->credential, credential, sizeof(credential)))
+		r = vk_session_verify(cd, e, keyslot, segment, r_vk);
+
+	crypt_safe_memzero(buf, buf_len);
+	free(buf);
+	return r;
+}
+
+static void vk_session_put(struct crypt_device *cd,
+	const char *passphrase,
+	size_t passphrase_size,
+	int keyslot,
+	int segment,
+	const struct volume_key *vk)
+{
+	struct crypt_vk_session *s = crypt_vk_session(cd);
+	struct crypt_vk_session_entry *e;
+	size_t e_size;
+	char desc[128];
+
+	if (!s || !vk || keyslot < 0)
+		return;
+
+	e_size = sizeof(*e) + vk->keylength;
+	e = crypt_safe_alloc(e_size);
+	if (!e)
+		return;
+
+	if (vk_session_digest(cd, passphrase, passphrase_size, e->credential) ||
+	    vk_session_keyslot_digest(cd, keyslot, e->keyslot_digest)) {
+		crypt_safe_free(e);
+		return;
+	}
+	e->keyslot = keyslot;
+	e->segment = segment;
+	e->key_size = vk->keylength;
+	memcpy(e->key, vk->key, vk->keylength);
+
+	crypt_vk_session_drop(cd, s, false);
+	s->e = e;
+	s->expires_us = crypt_perf_time_us() + (uint64_t)s->timeout * 1000000;
+	log_dbg(cd, "Volume key of keyslot %d stored in volume key session.", keyslot);
+
+	if (!(s->flags & CRYPT_VOLUME_KEY_SESSION_KEYRING) ||
+	    vk_session_description(e->credential, desc, sizeof(desc)))
+		return;
+
+	if (keyring_add_key_in_user_keyring_timeout(USER_KEY, desc, e, e_size, s->timeout))
+		log_dbg(cd, "Cannot store volume key session in keyring.");
+}
+
+void crypt_vk_session_drop(struct crypt_device *cd, struct crypt_vk_session *s, bool revoke)
+{
+	char desc[128];
+
+	if (!s || !s->e)
+		return;
+
+	if (revoke && (s->flags & CRYPT_VOLUME_KEY_SESSION_KEYRING) &&
+	    !vk_session_description(s->e->credential, desc, sizeof(desc))) {
+		log_dbg(cd, "Revoking volume key session in keyring (%s).", desc);
+		keyring_revoke_and_unlink_key(USER_KEY, desc);
+	}
+
+	crypt_safe_free(s->e);
+	s->e = NULL;
+}
+
 static int get_luks2_key_by_passphrase(struct crypt_device *cd,
 	struct crypt_keyslot_context *kc,
 	int keyslot,
@@ -38,9 +256,15 @@ static int get_luks2_key_by_passphrase(struct crypt_device *cd,
 	assert(kc && kc->type == CRYPT_KC_TYPE_PASSPHRASE);
 	assert(r_vk);
 
+	r = vk_session_get(cd, kc->u.p.passphrase, kc->u.p.passphrase_size, keyslot, segment, r_vk);
+	if (r >= 0)
+		return r;
+
 	r = LUKS2_keyslot_open(cd, keyslot, segment, kc->u.p.passphrase, kc->u.p.passphrase_size, r_vk);
 	if (r < 0)
 		kc->error = r;
+	else
+		vk_session_put(cd, kc->u.p.passphrase, kc->u.p.passphrase_size, r, segment, *r_vk);
 
 	return r;
 }
@@ -56,10 +280,18 @@ static int get_luks1_volume_key_by_passphrase(struct crypt_device *cd,
 	assert(kc && kc->type == CRYPT_KC_TYPE_PASSPHRASE);
 	assert(r_vk);
 
+	r = vk_session_get(cd, kc->u.p.passphrase, kc->u.p.passphrase_size,
+			   keyslot, CRYPT_DEFAULT_SEGMENT, r_vk);
+	if (r >= 0)
+		return r;
+
 	r = LUKS_open_key_with_hdr(keyslot, kc->u.p.passphrase, kc->u.p.passphrase_size,
 				   crypt_get_hdr(cd, CRYPT_LUKS1), r_vk, cd);
 	if (r < 0)
 		kc->error = r;
+	else
+		vk_session_put(cd, kc->u.p.passphrase, kc->u.p.passphrase_size,
+			       r, CRYPT_DEFAULT_SEGMENT, *r_vk);
 
 	return r;
 }
@@ -135,10 +367,13 @@ static int get_luks2_key_by_keyfile(struct crypt_device *cd,
 		if (r)
 			return r;
 
-		r = LUKS2_keyslot_open(cd, keyslot, segment, passphrase, passphrase_size, &kc->i_vk);
-		if (r < 0) {
-			kc->error = r;
-			return r;
+		if (vk_session_get(cd, passphrase, passphrase_size, keyslot, segment, &kc->i_vk) < 0) {
+			r = LUKS2_keyslot_open(cd, keyslot, segment, passphrase, passphrase_size, &kc->i_vk);
+			if (r < 0) {
+				kc->error = r;
+				return r;
+			}
+			vk_session_put(cd, passphrase, passphrase_size, r, segment, kc->i_vk);
 		}
 	}
 
@@ -173,11 +408,15 @@ static int get_luks1_volume_key_by_keyfile(struct crypt_device *cd,
 		if (r)
 			return r;
 
-		r = LUKS_open_key_with_hdr(keyslot, passphrase, passphrase_size,
-					   crypt_get_hdr(cd, CRYPT_LUKS1), &kc->i_vk, cd);
-		if (r < 0) {
-			kc->error = r;
-			return r;
+		if (vk_session_get(cd, passphrase, passphrase_size, keyslot,
+				   CRYPT_DEFAULT_SEGMENT, &kc->i_vk) < 0) {
+			r = LUKS_open_key_with_hdr(keyslot, passphrase, passphrase_size,
+						   crypt_get_hdr(cd, CRYPT_LUKS1), &kc->i_vk, cd);
+			if (r < 0) {
+				kc->error = r;
+				return r;
+			}
+			vk_session_put(cd, passphrase, passphrase_size, r, CRYPT_DEFAULT_SEGMENT, kc->i_vk);
 		}
 	}
 
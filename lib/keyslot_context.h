@@ -85,6 +85,18 @@ struct crypt_keyslot_context {
 	keyslot_context_get_passphrase	get_passphrase;
 };
 
+/* Volume key session (crypt_volume_key_session) */
+struct crypt_vk_session_entry;
+
+struct crypt_vk_session {
+	unsigned timeout;
+	uint32_t flags;
+	uint64_t expires_us;
+	struct crypt_vk_session_entry *e;
+};
+
+void crypt_vk_session_drop(struct crypt_device *cd, struct crypt_vk_session *s, bool revoke);
+
 void crypt_keyslot_context_destroy_internal(struct crypt_keyslot_context *method);
 
 void crypt_keyslot_unlock_by_key_init_internal(struct crypt_keyslot_context *kc,
@@ -41,6 +41,16 @@ extern "C" {
 /**
  * @defgroup crypt-init Cryptsetup device context initialization
  * Set of functions for creating and destroying @e crypt_device context
+ *
+ * Threading: different @e crypt_device contexts can be used concurrently
+ * from different threads of one process (including device activation and
+ * deactivation). One context must not be used from more threads at the same
+ * time without external locking. Device-mapper capabilities are probed only
+ * once per process and the device-mapper log messages are always reported
+ * through the context of the calling thread. Global settings (default log
+ * callback, @link crypt_set_debug_level @endlink and
+ * @link crypt_metadata_locking @endlink) should be set before other threads
+ * are started.
  * @addtogroup crypt-init
  * @{
  */
@@ -65,6 +75,30 @@ struct crypt_keyslot_context;
  */
 int crypt_init(struct crypt_device **cd, const char *device);
 
+/**
+ * Initialize crypt device handle backed by anonymous memory.
+ *
+ * The device is suitable for metadata operations (format, load, header
+ * and keyslot manipulation) and for in-memory images without any file
+ * system or loop device access.
+ *
+ * @param cd Returns pointer to crypt device handle
+ * @param buffer initial content of the device or @e NULL
+ * @param buffer_size size of @e buffer
+ * @param device_size size of the device in bytes, it is at least @e buffer_size
+ * 	  and it must be multiple of 512 bytes
+ * @param fd Returns file descriptor of the memory (owned by the handle,
+ * 	  valid until @link crypt_free @endlink) or @e NULL
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note The device content is lost on @link crypt_free @endlink, use @e fd
+ * 	 to read the resulting image.
+ */
+int crypt_init_memory(struct crypt_device **cd,
+	const char *buffer, size_t buffer_size,
+	uint64_t device_size, int *fd);
+
 /**
  * Initialize crypt device handle with optional data device and check
  * if devices exist.
@@ -173,6 +207,22 @@ int crypt_set_data_device(struct crypt_device *cd, const char *device);
  */
 int crypt_set_data_offset(struct crypt_device *cd, uint64_t data_offset);
 
+/**
+ * Enable layout optimizer for following LUKS2 format.
+ * The optimizer aligns data offset also to zone size, RAID full stripe
+ * and flash erase block size, extends keyslots area to the aligned data offset
+ * and, if sector size is autodetected, uses 4096-byte sectors with integrity
+ * or when the cipher measurably benefits from them (short cipher benchmark).
+ * Only parameters not set explicitly are changed, decisions are reported
+ * in verbose log.
+ *
+ * @param cd crypt device handle
+ * @param enable 1 to enable, 0 to disable optimizer
+ *
+ * @returns 0 on success or negative errno value otherwise.
+ */
+int crypt_set_layout_optimize(struct crypt_device *cd, int enable);
+
 /** @} */
 
 /**
@@ -275,6 +325,18 @@ struct crypt_pbkdf_type {
 #define CRYPT_PBKDF_ITER_TIME_SET   (UINT32_C(1) << 0)
 /** Never run benchmarks, use pre-set value or defaults. */
 #define CRYPT_PBKDF_NO_BENCHMARK    (UINT32_C(1) << 1)
+/** Robust benchmark: pinned thread, median of samples with outlier rejection. */
+#define CRYPT_PBKDF_BENCH_ROBUST    (UINT32_C(1) << 2)
+/** Benchmark measures CPU time (default for PBKDF2). */
+#define CRYPT_PBKDF_BENCH_CPU_TIME  (UINT32_C(1) << 3)
+/** Benchmark measures wall clock time (default for Argon2). */
+#define CRYPT_PBKDF_BENCH_WALL_TIME (UINT32_C(1) << 4)
+/** Interleave Argon2 memory over NUMA nodes (lanes run on threads of all nodes). */
+#define CRYPT_PBKDF_NUMA_INTERLEAVE (UINT32_C(1) << 5)
+/** Number of robust benchmark samples (1-64), zero means default (5). */
+#define CRYPT_PBKDF_BENCH_SAMPLES(n) ((((uint32_t)(n)) & 0xff) << 8)
+/** Number of robust benchmark samples set in flags. */
+#define CRYPT_PBKDF_BENCH_SAMPLES_GET(flags) ((((uint32_t)(flags)) >> 8) & 0xff)
 
 /** PBKDF2 according to RFC2898, LUKS1 legacy */
 #define CRYPT_KDF_PBKDF2   "pbkdf2"
@@ -371,6 +433,47 @@ int crypt_memory_lock(struct crypt_device *cd, int lock) __attribute__((deprecat
  */
 int crypt_metadata_locking(struct crypt_device *cd, int enable);
 
+/**
+ * Set global cache of parsed on-disk metadata for repeated loads of the same device.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param enable 0 to disable cache (default) and drop all entries otherwise enable it
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Cache applies only to LUKS2. Cached metadata are used only if both binary
+ *	 headers (with sequence id and checksum of JSON area) did not change on disk.
+ * @note The switch is global on the library level.
+ */
+int crypt_metadata_cache(struct crypt_device *cd, int enable);
+
+/**
+ * Start batch of metadata changes. Until @link crypt_metadata_commit @endlink
+ * is called, key management calls (keyslots, tokens, labels, flags) update
+ * only in-memory metadata. Every change is validated as usual.
+ *
+ * @param cd crypt device handle
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Only for LUKS2. Keyslot binary areas are written immediately.
+ * @note Uncommitted changes are lost with @link crypt_free @endlink,
+ *	 reencryption and metadata reload are not allowed inside the batch.
+ */
+int crypt_metadata_begin(struct crypt_device *cd);
+
+/**
+ * Write all metadata changes made since @link crypt_metadata_begin @endlink
+ * with one header update and finish the batch.
+ *
+ * @param cd crypt device handle
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note If write fails, batch stays open and commit can be repeated.
+ */
+int crypt_metadata_commit(struct crypt_device *cd);
+
 /**
  * Set metadata header area sizes. This applies only to LUKS2.
  * These values limit amount of metadata anf number of supportable keyslots.
@@ -522,6 +625,18 @@ struct crypt_params_verity {
 #define CRYPT_VERITY_CREATE_HASH (UINT32_C(1) << 2)
 /** Root hash signature required for activation */
 #define CRYPT_VERITY_ROOT_HASH_SIGNATURE (UINT32_C(1) << 3)
+/** Keep root hash signature in user keyring (by root hash) for repeated activations */
+#define CRYPT_VERITY_ROOT_HASH_SIGNATURE_CACHE (UINT32_C(1) << 4)
+
+/**
+ * Structure used to describe changed data area for incremental VERITY update.
+ *
+ * @see crypt_verity_update
+ */
+struct crypt_verity_range {
+	uint64_t offset; /**< first changed data block */
+	uint64_t length; /**< number of changed data blocks */
+};
 
 /**
  *
@@ -556,6 +671,11 @@ struct crypt_params_tcrypt {
  *  VeraCrypt device is reported as TCRYPT type.
  */
 #define CRYPT_TCRYPT_VERA_MODES      (UINT32_C(1) << 4)
+/** Keep system header key in process memory and reuse it for other partitions
+ *  of the same drive (with the same passphrase, keyfiles and PIM).
+ *  Applies only with @link CRYPT_TCRYPT_SYSTEM_HEADER @endlink.
+ */
+#define CRYPT_TCRYPT_CACHE_SYSTEM_KEY (UINT32_C(1) << 5)
 
 /**
  *
@@ -646,6 +766,43 @@ int crypt_format(struct crypt_device *cd,
 	size_t volume_key_size,
 	void *params);
 
+/**
+ * One device of format batch.
+ */
+struct crypt_format_batch_entry {
+	struct crypt_device *cd;  /**< crypt device handle, not formatted */
+	void *params;             /**< crypt type specific parameters or @e NULL */
+	int result;               /**< returns result of the format */
+};
+
+/**
+ * Format more LUKS devices with the same cipher and new random volume keys.
+ *
+ * The first device is formatted alone and its keyslot PBKDF calibration
+ * is reused for the others, which are then formatted concurrently.
+ *
+ * @param entries array of devices to format
+ * @param count number of entries
+ * @param type type of LUKS format (@link CRYPT_LUKS1 @endlink or @link CRYPT_LUKS2 @endlink)
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode including IV specification (e.g. "xts-plain")
+ * @param volume_key_size size of volume key in bytes.
+ * @param passphrase passphrase for the new keyslot or @e NULL if no keyslot should be added
+ * @param passphrase_size size of @e passphrase
+ *
+ * @return @e 0 if all devices were formatted or the first negative errno value
+ * 	   otherwise. Result of every format is stored in the entry @e result.
+ *
+ * @note If the first device fails, no other device is formatted.
+ */
+int crypt_format_batch(struct crypt_format_batch_entry *entries, size_t count,
+	const char *type,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	const char *passphrase,
+	size_t passphrase_size);
+
 /**
  * Set format compatibility flags.
  *
@@ -692,6 +849,39 @@ int crypt_convert(struct crypt_device *cd,
 	const char *type,
 	void *params);
 
+/**
+ * One device of conversion batch.
+ */
+struct crypt_convert_batch_entry {
+	struct crypt_device *cd;  /**< crypt device handle with loaded LUKS header */
+	void *params;             /**< additional parameters as in @link crypt_convert @endlink */
+	int result;               /**< returns result of the conversion */
+};
+
+/**
+ * Convert more LUKS devices to another LUKS type.
+ *
+ * Devices are converted in order as with @link crypt_convert @endlink,
+ * a failed entry does not stop the batch.
+ *
+ * @param entries array of devices to convert
+ * @param count number of entries
+ * @param type type of target LUKS format (@link CRYPT_LUKS1 @endlink or @link CRYPT_LUKS2 @endlink)
+ * @param progress function called after every moved chunk of keyslot area
+ * 	  of the currently converted device
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 if all devices were converted or the first negative errno value
+ * 	   otherwise. Result of every conversion is stored in the entry @e result.
+ *
+ * @note Keyslot area move cannot be interrupted, return value of progress
+ * 	 function is ignored.
+ */
+int crypt_convert_batch(struct crypt_convert_batch_entry *entries, size_t count,
+	const char *type,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr);
+
 /**
  * Set new UUID for already existing device.
  *
@@ -939,6 +1129,66 @@ int crypt_resume_by_token_pin(struct crypt_device *cd,
 	const char *pin,
 	size_t pin_size,
 	void *usrptr);
+
+/**
+ * Suspend crypt device and keep its volume key wrapped in kernel keyring
+ * for @link crypt_resume_by_wrapped_key @endlink.
+ *
+ * The volume key is encrypted and authenticated (AES-XTS and HMAC-SHA256)
+ * with keys derived from @e wrapping_key by the context PBKDF, benchmarked
+ * as for a new keyslot (see @link crypt_set_pbkdf_type @endlink), and
+ * stored in the user keyring. It is revoked after @e timeout seconds or
+ * after successful resume.
+ *
+ * @note Anyone able to read the user keyring can run offline guessing
+ *       attacks against the blob, PBKDF only slows it down. Use a high
+ *       entropy wrapping key, not a short PIN or passphrase.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to suspend
+ * @param volume_key volume key, if @e NULL it is read from the active device
+ * @param volume_key_size size of @e volume_key
+ * @param wrapping_key high entropy secret (for example provided by TPM or token)
+ * @param wrapping_key_size size of @e wrapping_key
+ * @param timeout wrapped key lifetime in seconds, must not be 0
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note ENOKEY errno means the volume key of the active device is stored in
+ *       kernel keyring and cannot be read, it must be provided in @e volume_key.
+ *
+ * @note Only LUKS device type is supported
+ */
+int crypt_suspend_wrapped_key(struct crypt_device *cd,
+	const char *name,
+	const char *volume_key,
+	size_t volume_key_size,
+	const char *wrapping_key,
+	size_t wrapping_key_size,
+	unsigned timeout);
+
+/**
+ * Resume crypt device using volume key wrapped by
+ * @link crypt_suspend_wrapped_key @endlink. It does not run keyslot PBKDF,
+ * only the wrapping key PBKDF with parameters stored on suspend.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to resume
+ * @param wrapping_key secret used for wrapping the volume key
+ * @param wrapping_key_size size of @e wrapping_key
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note ENOKEY errno means no wrapped key is available (expired or not stored),
+ *       caller should fall back to passphrase or token resume.
+ *
+ * @note EPERM errno means the wrapping key is not correct or the wrapped
+ *       key was modified.
+ */
+int crypt_resume_by_wrapped_key(struct crypt_device *cd,
+	const char *name,
+	const char *wrapping_key,
+	size_t wrapping_key_size);
 /** @} */
 
 /**
@@ -1291,6 +1541,33 @@ int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
 	struct crypt_keyslot_context *new_kc,
 	uint32_t flags);
 
+/**
+ * Re-wrap several LUKS2 keyslots with current PBKDF settings in one operation.
+ * Each keyslot keeps its number and credential, only its key derivation
+ * (PBKDF type and costs, salt) and keyslot encryption are updated.
+ *
+ * @pre @e cd contains initialized and formatted LUKS2 device context.
+ *
+ * @param cd crypt device handle
+ * @param keyslots array of keyslot numbers
+ * @param kcs keyslot contexts providing passphrase for each keyslot
+ * @param count number of keyslots
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Every credential must open its keyslot (and all keyslots must unlock
+ *       the same volume key), otherwise nothing is changed. Key derivations
+ *       run in parallel threads and LUKS2 metadata is written only once.
+ *
+ * @warning Keyslots are overwritten in place. If the operation is interrupted
+ *          before metadata is written, the re-wrapped keyslots become unusable.
+ *          Use header backup (or another keyslot) to recover.
+ */
+int crypt_keyslot_rewrap_by_keyslot_context(struct crypt_device *cd,
+	const int *keyslots,
+	struct crypt_keyslot_context **kcs,
+	unsigned int count);
+
 /**
  * Destroy (and disable) key slot.
  *
@@ -1369,6 +1646,14 @@ int crypt_keyslot_destroy(struct crypt_device *cd, int keyslot);
 #define CRYPT_ACTIVATE_RECALCULATE_RESET (UINT32_C(1) << 26)
 /** dm-verity: try to use tasklets */
 #define CRYPT_ACTIVATE_TASKLETS (UINT32_C(1) << 27)
+/** try candidate keyslots concurrently (within memory limit) if unlocking with any keyslot, input only */
+#define CRYPT_ACTIVATE_PARALLEL_KEYSLOTS (UINT32_C(1) << 28)
+/** try keyslot that opened the same keyfile or token last time first and remember it, input only */
+#define CRYPT_ACTIVATE_KEYSLOT_HINT (UINT32_C(1) << 29)
+/** run token handlers concurrently if unlocking with any token without PIN, input only */
+#define CRYPT_ACTIVATE_PARALLEL_TOKENS (UINT32_C(1) << 30)
+/** use inline encryption hardware of data device (dm-default-key) if it supports the cipher, dm-crypt otherwise */
+#define CRYPT_ACTIVATE_INLINE_CRYPT (UINT32_C(1) << 31)
 
 /**
  * Active device runtime attributes
@@ -1394,6 +1679,46 @@ int crypt_get_active_device(struct crypt_device *cd,
 	const char *name,
 	struct crypt_active_device *cad);
 
+/**
+ * Summary of one active device managed by cryptsetup.
+ */
+struct crypt_active_device_summary {
+	char *name;          /**< device-mapper device name */
+	char *uuid;          /**< device-mapper UUID (including CRYPT- prefix) */
+	char *type;          /**< device type part of the UUID (e.g. LUKS2, PLAIN, VERITY, SUBDEV) */
+	char *target;        /**< target type of the first table segment or @e NULL */
+	uint64_t size;       /**< active device size in sectors */
+	uint32_t segments;   /**< number of table segments */
+	uint32_t flags;      /**< CRYPT_ACTIVATE_READONLY and CRYPT_ACTIVATE_SUSPENDED */
+	uint32_t major;      /**< device major number */
+	uint32_t minor;      /**< device minor number */
+	int32_t open_count;  /**< number of device openers */
+};
+
+/**
+ * List all active devices created by cryptsetup (crypt, verity, integrity
+ * and internal helper devices) in one pass.
+ *
+ * Only one device-mapper list and one status query per device are issued,
+ * no metadata are read and no device context is allocated.
+ *
+ * @param devices returns allocated array of device summaries
+ * @param count returns number of devices in array
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Release array with @link crypt_active_devices_free @endlink.
+ */
+int crypt_active_devices_list(struct crypt_active_device_summary **devices, size_t *count);
+
+/**
+ * Release array allocated by @link crypt_active_devices_list @endlink.
+ *
+ * @param devices array of device summaries (can be @e NULL)
+ * @param count number of devices in array
+ */
+void crypt_active_devices_free(struct crypt_active_device_summary *devices, size_t count);
+
 /**
  * Get detected number of integrity failures.
  *
@@ -1405,6 +1730,22 @@ int crypt_get_active_device(struct crypt_device *cd,
  */
 uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd,
 	const char *name);
+
+/**
+ * Get progress of automatic integrity tags recalculation.
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param name name of active INTEGRITY device
+ * @param position recalculated position in 512-byte sectors (optional)
+ * @param size provided data size in 512-byte sectors (optional)
+ *
+ * @return @e 1 if recalculation is running, @e 0 if it is finished
+ *	   (or was not requested), negative errno value otherwise.
+ */
+int crypt_get_active_integrity_recalculation(struct crypt_device *cd,
+	const char *name,
+	uint64_t *position,
+	uint64_t *size);
 /** @} */
 
 /**
@@ -1465,6 +1806,30 @@ int crypt_persistent_flags_set(struct crypt_device *cd,
 int crypt_persistent_flags_get(struct crypt_device *cd,
 	crypt_flags_type type,
 	uint32_t *flags);
+
+/** Verify suggested flags with short dm-crypt benchmark (requires root privilege) */
+#define CRYPT_TUNE_PROBE (UINT32_C(1) << 0)
+
+/**
+ * Suggest dm-crypt performance activation flags for data device.
+ * Decision is based on data device properties (rotational, NVMe,
+ * queue size), number of online CPUs and supported dm-crypt features,
+ * optionally verified by short benchmark of dm-crypt data path.
+ *
+ * @param cd crypt device handle with loaded metadata
+ * @param tune_flags @e 0 or @e CRYPT_TUNE_PROBE
+ * @param flags suggested combination of @e CRYPT_ACTIVATE_SAME_CPU_CRYPT,
+ *        @e CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS, @e CRYPT_ACTIVATE_NO_READ_WORKQUEUE
+ *        and @e CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Suggested flags can be stored in LUKS2 header with
+ *	 @link crypt_persistent_flags_set @endlink.
+ */
+int crypt_activation_flags_tune(struct crypt_device *cd,
+	uint32_t tune_flags,
+	uint32_t *flags);
 /** @} */
 
 /**
@@ -1576,6 +1941,11 @@ int crypt_activate_by_volume_key(struct crypt_device *cd,
  * @note For VERITY the volume key means root hash required for activation.
  *	Because kernel dm-verity is always read only, you have to provide
  *	CRYPT_ACTIVATE_READONLY flag always.
+ *
+ * @note If the device was loaded with @e CRYPT_VERITY_ROOT_HASH_SIGNATURE_CACHE
+ *	flag, the signature is kept in user keyring after activation and
+ *	signature can be @e NULL for a root hash with cached signature
+ *	(-ENOKEY is returned if there is none).
  */
 int crypt_activate_by_signed_key(struct crypt_device *cd,
 	const char *name,
@@ -1607,6 +1977,84 @@ int crypt_activate_by_keyring(struct crypt_device *cd,
 	int keyslot,
 	uint32_t flags);
 
+/**
+ * One device of activation batch.
+ *
+ * If @e passphrase is set, device is activated as with
+ * @link crypt_activate_by_passphrase @endlink, otherwise as with
+ * @link crypt_activate_by_volume_key @endlink.
+ */
+struct crypt_activate_batch_entry {
+	struct crypt_device *cd;  /**< loaded crypt device handle */
+	const char *name;         /**< name of device to create */
+	int keyslot;              /**< keyslot for passphrase or CRYPT_ANY_SLOT */
+	const char *passphrase;   /**< passphrase or @e NULL */
+	size_t passphrase_size;   /**< size of passphrase */
+	const char *volume_key;   /**< volume key (or @e NULL to use internal) */
+	size_t volume_key_size;   /**< size of volume_key */
+	uint32_t flags;           /**< activation flags */
+	int result;               /**< returns result of the activation */
+};
+
+/**
+ * Activate more devices and synchronize with udev only once.
+ *
+ * All device-mapper tables of the batch are created (and resumed) under one
+ * shared udev cookie and the function waits for udev only after the last
+ * device is activated. Device nodes of the batch are not guaranteed
+ * to exist before the function returns.
+ *
+ * @param entries array of devices to activate
+ * @param count number of entries
+ *
+ * @return @e 0 if all devices were activated or the first negative errno value
+ * 	   otherwise. Result of every activation is stored in the entry @e result.
+ *
+ * @note Entries are activated in order, a failed entry does not stop the batch.
+ * @note Internal (private) helper devices, like dm-integrity under dm-crypt,
+ * 	 are still synchronized with udev immediately.
+ */
+int crypt_activate_batch(struct crypt_activate_batch_entry *entries, size_t count);
+
+/**
+ * Activate more loop-AES devices using one keyfile.
+ *
+ * The keyfile is read and parsed only once and its keys are hashed once
+ * for every distinct hash and key size in the batch. All devices are
+ * synchronized with udev once, as with @link crypt_activate_batch @endlink.
+ *
+ * @param entries array of devices to activate, every @e cd must be formatted
+ * 	  (initialized) as @link CRYPT_LOOPAES @endlink. Passphrase, keyslot
+ * 	  and volume key fields are ignored.
+ * @param count number of entries
+ * @param keyfile keyfile (with keys in loop-AES format)
+ * @param keyfile_size number of bytes to read from keyfile, 0 is unlimited
+ * @param keyfile_offset number of bytes to skip at start of keyfile
+ *
+ * @return @e 0 if all devices were activated or the first negative errno value
+ * 	   otherwise. Result of every activation is stored in the entry @e result.
+ */
+int crypt_activate_loopaes_batch(struct crypt_activate_batch_entry *entries, size_t count,
+	const char *keyfile, size_t keyfile_size, uint64_t keyfile_offset);
+
+/**
+ * Split new dm-crypt mappings activated with the context to @e shards
+ * dm-crypt targets over consecutive areas of the data device. Every target
+ * is a separate dm-crypt instance with its own workqueues, so encryption
+ * scales better on hosts with many CPUs. The ciphertext on the device
+ * is the same as with a single target.
+ *
+ * @param cd crypt device handle
+ * @param shards number of targets (up to 256), @e 0 or @e 1 means one
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Shard boundaries are aligned to 1 MiB, small devices use fewer targets.
+ * @note Not used for devices with integrity protection. Sharded device
+ *	 cannot be refreshed or resized online.
+ */
+int crypt_set_dm_crypt_shards(struct crypt_device *cd, unsigned shards);
+
 /** lazy deactivation - remove once last user releases it */
 #define CRYPT_DEACTIVATE_DEFERRED (UINT32_C(1) << 0)
 /** force deactivation - if the device is busy, it is replaced by error device */
@@ -1634,6 +2082,18 @@ int crypt_deactivate_by_name(struct crypt_device *cd,
  * Deactivate crypt device. See @ref crypt_deactivate_by_name with empty @e flags.
  */
 int crypt_deactivate(struct crypt_device *cd, const char *name);
+
+/**
+ * Set time limit of forced deactivation (@ref CRYPT_DEACTIVATE_FORCE).
+ * Removal of busy device is retried whenever an opener closes it
+ * until the time limit expires.
+ *
+ * @param cd crypt device handle
+ * @param timeout_ms time limit in milliseconds, @e 0 means default (5 seconds)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_set_deactivate_timeout(struct crypt_device *cd, uint32_t timeout_ms);
 /** @} */
 
 /**
@@ -1725,12 +2185,15 @@ int crypt_dump(struct crypt_device *cd);
  *
  * @param cd crypt device handle (only LUKS2 format supported)
  * @param json buffer with JSON, if NULL use log callback for output
- * @param flags dump flags (reserved)
+ * @param flags dump flags (@e 0 or @link CRYPT_DUMP_JSON_COMPACT @endlink)
  *
  * @return @e 0 on success or negative errno value otherwise.
  */
 int crypt_dump_json(struct crypt_device *cd, const char **json, uint32_t flags);
 
+/** dump JSON on a single line without whitespace */
+#define CRYPT_DUMP_JSON_COMPACT (UINT32_C(1) << 0)
+
 /**
  * Get cipher used in device.
  *
@@ -1851,80 +2314,394 @@ int crypt_get_verity_info(struct crypt_device *cd,
 	struct crypt_params_verity *vp);
 
 /**
- * Get device parameters for INTEGRITY device.
+ * Update hash tree of VERITY device after data device change.
  *
- * @param cd crypt device handle
- * @param ip verity device info
+ * Only digests of changed data blocks and of their ancestors in the tree
+ * are recalculated, the hash device must contain hash tree created with
+ * the same parameters (and data size) for the previous data content.
  *
- * @e 0 on success or negative errno value otherwise.
+ * @param cd crypt device handle (VERITY device loaded with data device set)
+ * @param old_data_device optional device with previous data content,
+ *	  blocks that differ from the data device are detected by comparison
+ * @param ranges optional list of changed data block ranges
+ * @param ranges_count number of ranges
+ *
+ * @return @e 0 on success or negative errno value otherwise.
  *
+ * @note At least one of @e old_data_device or @e ranges must be set,
+ *	 both can be combined. New root hash can be read by
+ *	 @link crypt_volume_key_get @endlink afterwards.
+ * @note FEC cannot be updated incrementally, if FEC device is set,
+ *	 the whole FEC area is recalculated.
  */
-int crypt_get_integrity_info(struct crypt_device *cd,
-	struct crypt_params_integrity *ip);
-/** @} */
+int crypt_verity_update(struct crypt_device *cd,
+	const char *old_data_device,
+	const struct crypt_verity_range *ranges,
+	unsigned int ranges_count);
+
+/** Sample the first hash block of every part (default is a random one) */
+#define CRYPT_VERITY_SAMPLE_STRIDED (UINT32_C(1) << 0)
 
 /**
- * @defgroup crypt-benchmark Benchmarking
- * Benchmarking of algorithms
- * @addtogroup crypt-benchmark
- * @{
+ * Verify VERITY device in userspace using sampled data blocks.
+ *
+ * The whole hash tree is verified against the root hash, data blocks are
+ * verified only for @e samples bottom level hash blocks (each covers
+ * a contiguous range of data blocks). Bottom level is split to @e samples
+ * equal parts and one hash block from each of them is verified.
+ *
+ * @param cd crypt device handle (VERITY device loaded with data device set)
+ * @param root_hash root hash
+ * @param root_hash_size size of root hash
+ * @param samples number of sampled hash blocks
+ * @param flags @e CRYPT_VERITY_SAMPLE_* flags
+ * @param verified_blocks optional, number of verified data blocks
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *	   (@e -EPERM for data or hash tree corruption, @e -EFAULT for root hash mismatch).
+ *
+ * @note If @e samples is not lower than the number of bottom level hash blocks,
+ *	 the whole device is verified.
+ * @note Unlike verification in @link crypt_activate_by_volume_key @endlink,
+ *	 FEC is not used for repair.
  */
+int crypt_verity_verify_sample(struct crypt_device *cd,
+	const char *root_hash,
+	size_t root_hash_size,
+	uint64_t samples,
+	uint32_t flags,
+	uint64_t *verified_blocks);
 
 /**
- * Informational benchmark for ciphers.
+ * Set memory limit for staging buffers used in userspace VERITY FEC
+ * calculation (format, verification and update with FEC device).
+ *
+ * FEC input blocks of more encoding rounds are read at once by large
+ * sequential reads instead of one block at a time, the limit sets how
+ * many rounds fit in memory (split among encoding threads).
  *
  * @param cd crypt device handle
- * @param cipher (e.g. "aes")
- * @param cipher_mode (e.g. "xts"), IV generator is ignored
- * @param volume_key_size size of volume key in bytes
- * @param iv_size size of IV in bytes
- * @param buffer_size size of encryption buffer in bytes used in test
- * @param encryption_mbs measured encryption speed in MiB/s
- * @param decryption_mbs measured decryption speed in MiB/s
+ * @param memory_kb memory limit in kilobytes, @e 0 means default (64 MiB)
  *
  * @return @e 0 on success or negative errno value otherwise.
  *
- * @note If encryption_buffer_size is too small and encryption time
- *       cannot be properly measured, -ERANGE is returned.
+ * @note Limit lower than one round (data block size * (255 - FEC roots))
+ *	 means reading one block at a time.
  */
-int crypt_benchmark(struct crypt_device *cd,
-	const char *cipher,
-	const char *cipher_mode,
-	size_t volume_key_size,
-	size_t iv_size,
-	size_t buffer_size,
-	double *encryption_mbs,
-	double *decryption_mbs);
+int crypt_set_verity_fec_memory(struct crypt_device *cd, uint64_t memory_kb);
 
 /**
- * Informational benchmark for PBKDF.
+ * Set the maximal number of threads used for VERITY hash tree calculation.
+ *
+ * Useful if more VERITY devices are formatted concurrently and the
+ * online CPUs should be split among them.
  *
  * @param cd crypt device handle
- * @param pbkdf PBKDF parameters
- * @param password password for benchmark
- * @param password_size size of password
- * @param salt salt for benchmark
- * @param salt_size size of salt
- * @param volume_key_size output volume key size
- * @param progress callback function
- * @param usrptr provided identification in callback
+ * @param threads maximal number of hashing threads, @e 0 means default
+ *	  (number of online CPUs)
  *
  * @return @e 0 on success or negative errno value otherwise.
  */
-int crypt_benchmark_pbkdf(struct crypt_device *cd,
-	struct crypt_pbkdf_type *pbkdf,
-	const char *password,
-	size_t password_size,
-	const char *salt,
-	size_t salt_size,
-	size_t volume_key_size,
-	int (*progress)(uint32_t time_ms, void *usrptr),
-	void *usrptr);
-/** @} */
+int crypt_set_verity_threads(struct crypt_device *cd, unsigned threads);
 
 /**
- * @addtogroup crypt-keyslot
- * @{
+ * Calculate size of VERITY hash area (superblock and hash tree).
+ *
+ * The size allows placing more hash trees on one hash device,
+ * the next hash area can start at @e params->hash_area_offset + @e size.
+ *
+ * @param cd crypt device handle (data device is used if
+ *	  @e params->data_size is not set)
+ * @param params VERITY format parameters
+ * @param size hash area size in bytes
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_verity_hash_area_size(struct crypt_device *cd,
+	const struct crypt_params_verity *params,
+	uint64_t *size);
+
+/** Opaque handle of streamed VERITY hash tree creation */
+struct crypt_verity_hash_stream;
+
+/** Write data pushed to the stream also to the data device */
+#define CRYPT_VERITY_STREAM_WRITE_DATA (UINT32_C(1) << 0)
+
+/**
+ * Start streamed creation of VERITY hash tree (and FEC if FEC device is set).
+ *
+ * Data blocks are hashed as they are pushed by @link crypt_verity_hash_stream_write @endlink,
+ * the data device is not read, so image generation and hashing can be done
+ * in a single pass.
+ *
+ * @param cd crypt device handle, formatted by @link crypt_format @endlink
+ *	  as VERITY without @e CRYPT_VERITY_CREATE_HASH flag (data size must be set)
+ * @param flags @e CRYPT_VERITY_STREAM_* flags
+ * @param stream stream handle
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note FEC state of all RS rounds is kept in memory (the size of FEC area).
+ */
+int crypt_verity_hash_stream_init(struct crypt_device *cd,
+	uint32_t flags,
+	struct crypt_verity_hash_stream **stream);
+
+/**
+ * Push data to VERITY hash stream.
+ *
+ * @param cd crypt device handle
+ * @param stream stream handle
+ * @param data data in data device order, length need not be block aligned
+ * @param length length of data
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note After a failure the stream can only be freed.
+ */
+int crypt_verity_hash_stream_write(struct crypt_device *cd,
+	struct crypt_verity_hash_stream *stream,
+	const char *data,
+	size_t length);
+
+/**
+ * Finish VERITY hash stream, write last hash blocks (and FEC) and get root hash.
+ *
+ * @param cd crypt device handle
+ * @param stream stream handle
+ * @param root_hash buffer for root hash
+ * @param root_hash_size size of root hash buffer, updated to root hash size
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *	   (@e -EINVAL if pushed data do not match the whole data area).
+ *
+ * @note Root hash is also stored in @e cd and can be read by
+ *	 @link crypt_volume_key_get @endlink afterwards.
+ */
+int crypt_verity_hash_stream_final(struct crypt_device *cd,
+	struct crypt_verity_hash_stream *stream,
+	char *root_hash,
+	size_t *root_hash_size);
+
+/**
+ * Release VERITY hash stream.
+ *
+ * @param stream stream handle (can be @e NULL)
+ */
+void crypt_verity_hash_stream_free(struct crypt_verity_hash_stream *stream);
+
+/**
+ * Get device parameters for INTEGRITY device.
+ *
+ * @param cd crypt device handle
+ * @param ip verity device info
+ *
+ * @e 0 on success or negative errno value otherwise.
+ *
+ */
+int crypt_get_integrity_info(struct crypt_device *cd,
+	struct crypt_params_integrity *ip);
+/** @} */
+
+/**
+ * @defgroup crypt-benchmark Benchmarking
+ * Benchmarking of algorithms
+ * @addtogroup crypt-benchmark
+ * @{
+ */
+
+/**
+ * Informational benchmark for ciphers.
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode (e.g. "xts"), IV generator is ignored
+ * @param volume_key_size size of volume key in bytes
+ * @param iv_size size of IV in bytes
+ * @param buffer_size size of encryption buffer in bytes used in test
+ * @param encryption_mbs measured encryption speed in MiB/s
+ * @param decryption_mbs measured decryption speed in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note If encryption_buffer_size is too small and encryption time
+ *       cannot be properly measured, -ERANGE is returned.
+ */
+int crypt_benchmark(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t iv_size,
+	size_t buffer_size,
+	double *encryption_mbs,
+	double *decryption_mbs);
+
+/**
+ * Informational multi-threaded benchmark for ciphers.
+ * Every thread uses its own buffer and cipher context and encrypts
+ * the buffer sector by sector (similar to dm-crypt data path).
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode (e.g. "xts"), IV generator is ignored
+ * @param volume_key_size size of volume key in bytes
+ * @param sector_size size of single encryption request in bytes
+ * @param buffer_size size of encryption buffer of one thread in bytes
+ * @param threads number of concurrently running threads
+ * @param encryption_mbs measured aggregate encryption speed in MiB/s
+ * @param decryption_mbs measured aggregate decryption speed in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_benchmark_parallel(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t sector_size,
+	size_t buffer_size,
+	unsigned int threads,
+	double *encryption_mbs,
+	double *decryption_mbs);
+
+/**
+ * Informational benchmark of dm-crypt data path.
+ * Creates temporary dm-crypt device over dm-zero backing device and
+ * measures direct I/O throughput through the kernel (including dm-crypt
+ * workqueues and selected performance flags). Requires root privilege.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param cipher full dm-crypt cipher specification (e.g. "aes-xts-plain64")
+ * @param volume_key_size size of volume key in bytes
+ * @param sector_size encryption sector size in bytes (0 for default 512)
+ * @param flags combination of @e CRYPT_ACTIVATE_SAME_CPU_CRYPT,
+ *        @e CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS, @e CRYPT_ACTIVATE_NO_READ_WORKQUEUE
+ *        and @e CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE
+ * @param block_size size of single I/O request in bytes
+ * @param queue_depth number of I/O requests kept in flight
+ * @param random_io use random offsets instead of sequential I/O
+ * @param read_mbs measured read speed in MiB/s
+ * @param write_mbs measured write speed in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ * (@e -ENOTSUP if a requested flag is not supported by kernel).
+ */
+int crypt_benchmark_dm(struct crypt_device *cd,
+	const char *cipher,
+	size_t volume_key_size,
+	size_t sector_size,
+	uint32_t flags,
+	size_t block_size,
+	unsigned int queue_depth,
+	int random_io,
+	double *read_mbs,
+	double *write_mbs);
+
+/**
+ * Informational benchmark for PBKDF.
+ *
+ * @param cd crypt device handle
+ * @param pbkdf PBKDF parameters
+ * @param password password for benchmark
+ * @param password_size size of password
+ * @param salt salt for benchmark
+ * @param salt_size size of salt
+ * @param volume_key_size output volume key size
+ * @param progress callback function
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_benchmark_pbkdf(struct crypt_device *cd,
+	struct crypt_pbkdf_type *pbkdf,
+	const char *password,
+	size_t password_size,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	int (*progress)(uint32_t time_ms, void *usrptr),
+	void *usrptr);
+
+/**
+ * Informational benchmark for PBKDF with measurement variance.
+ *
+ * Same as @link crypt_benchmark_pbkdf @endlink, but also reports how stable
+ * the final measurement was. With @e CRYPT_PBKDF_BENCH_ROBUST flag it is
+ * repeated and outliers are rejected.
+ *
+ * @param cd crypt device handle
+ * @param pbkdf PBKDF parameters (including CRYPT_PBKDF_BENCH_* flags)
+ * @param password password for benchmark
+ * @param password_size size of password
+ * @param salt salt for benchmark
+ * @param salt_size size of salt
+ * @param volume_key_size output volume key size
+ * @param samples samples used after outlier rejection (or @e NULL)
+ * @param deviation relative standard deviation of the samples in percent (or @e NULL)
+ * @param progress callback function
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_benchmark_pbkdf_stats(struct crypt_device *cd,
+	struct crypt_pbkdf_type *pbkdf,
+	const char *password,
+	size_t password_size,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	unsigned int *samples,
+	double *deviation,
+	int (*progress)(uint32_t time_ms, void *usrptr),
+	void *usrptr);
+
+/**
+ * Get version string of crypto backend used by the library.
+ *
+ * Useful to record environment of benchmark results. The crypto backend
+ * is initialized if it was not done yet.
+ *
+ * @return backend name and version or @e NULL if backend cannot be initialized.
+ */
+const char *crypt_get_crypto_backend_version(void);
+
+/**
+ * Export PBKDF calibration cache.
+ *
+ * Argon2 costs found by keyslot benchmark are cached (keyed by CPU model,
+ * online CPU count, PBKDF type, hash, requested time, memory, threads and key size)
+ * and used as starting point of later benchmarks that need then only one
+ * confirmation measurement. The cache is kept in memory and, if run as root,
+ * in the locking directory.
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param path file to write the cache to
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_pbkdf_cache_export(struct crypt_device *cd, const char *path);
+
+/**
+ * Import PBKDF calibration cache previously exported by @link crypt_pbkdf_cache_export @endlink.
+ * Entries are merged with already cached ones.
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param path file to read the cache from
+ *
+ * @return number of imported entries or negative errno value otherwise.
+ */
+int crypt_pbkdf_cache_import(struct crypt_device *cd, const char *path);
+
+/**
+ * Drop all PBKDF calibration cache entries (in memory and stored).
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ */
+void crypt_pbkdf_cache_invalidate(struct crypt_device *cd);
+/** @} */
+
+/**
+ * @addtogroup crypt-keyslot
+ * @{
  */
 
 /**
@@ -2105,6 +2882,70 @@ int crypt_header_backup(struct crypt_device *cd,
 int crypt_header_restore(struct crypt_device *cd,
 	const char *requested_type,
 	const char *backup_file);
+
+/**
+ * Header backup archive with many devices and their header versions.
+ * Headers are stored deduplicated, keyed by device UUID.
+ */
+struct crypt_backup_archive;
+
+/** open archive read-only (restore only) */
+#define CRYPT_BACKUP_ARCHIVE_READONLY (UINT32_C(1) << 0)
+
+/**
+ * Open (or create) header backup archive.
+ *
+ * @param archive returns archive handle
+ * @param path archive file
+ * @param flags @e CRYPT_BACKUP_ARCHIVE_* flags
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Incomplete record at the end (interrupted write) is ignored
+ * 	 and removed if the archive is writable.
+ */
+int crypt_backup_archive_open(struct crypt_backup_archive **archive,
+	const char *path,
+	uint32_t flags);
+
+/**
+ * Store header and keyslots in archive.
+ *
+ * @param archive archive handle
+ * @param cd crypt device handle
+ * @param requested_type @link crypt-type @endlink or @e NULL for all known
+ *
+ * @return @e 0 if stored, @e 1 if the latest archived version of the header
+ * 	   is the same, or negative errno value otherwise.
+ */
+int crypt_backup_archive_add(struct crypt_backup_archive *archive,
+	struct crypt_device *cd,
+	const char *requested_type);
+
+/**
+ * Restore the latest archived header and keyslots of a device.
+ *
+ * @param archive archive handle
+ * @param cd crypt device handle
+ * @param requested_type @link crypt-type @endlink or @e NULL for all known
+ * @param uuid UUID of the archived header
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Restore works as @link crypt_header_restore @endlink with
+ * 	 the archived header as backup file.
+ */
+int crypt_backup_archive_restore(struct crypt_backup_archive *archive,
+	struct crypt_device *cd,
+	const char *requested_type,
+	const char *uuid);
+
+/**
+ * Release archive handle.
+ *
+ * @param archive archive handle
+ */
+void crypt_backup_archive_free(struct crypt_backup_archive *archive);
 /** @} */
 
 /**
@@ -2116,7 +2957,7 @@ int crypt_header_restore(struct crypt_device *cd,
 
 /** Debug all */
 #define CRYPT_DEBUG_ALL  -1
-/** Debug all with additional JSON dump (for LUKS2) */
+/** Debug all with additional JSON dump (for LUKS2) and activation latency trace */
 #define CRYPT_DEBUG_JSON  -2
 /** Debug none */
 #define CRYPT_DEBUG_NONE  0
@@ -2207,6 +3048,9 @@ typedef enum {
  *
  * @note If the error values is -EIO or -EINTR, some part of the device could
  *       be overwritten. Other error codes (-EINVAL, -ENOMEM) means that no IO was performed.
+ *
+ * @note On zoned devices zones of zone aligned area are reset first, zero wipe
+ *       then needs no writes. The area is written sequentially by a single thread.
  */
 int crypt_wipe(struct crypt_device *cd,
 	const char *dev_path, /* if null, use data device */
@@ -2219,8 +3063,46 @@ int crypt_wipe(struct crypt_device *cd,
 	void *usrptr
 );
 
+/**
+ * Wipe/Fill (part of) a device with the selected pattern using parallel writers.
+ * The area is split to regions written concurrently, each thread with its own queue.
+ *
+ * @param cd crypt device handle
+ * @param dev_path path to device to wipe or @e NULL if data device should be used
+ * @param pattern selected wipe pattern
+ * @param offset offset on device (in bytes)
+ * @param length length of area to be wiped (in bytes)
+ * @param wipe_block_size used block for wiping (one step) (in bytes)
+ * @param flags wipe flags
+ * @param threads number of parallel writers (0 or 1 means the same as @link crypt_wipe @endlink)
+ * @param progress callback function called after each @e wipe_block_size or @e NULL
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Callback is serialized, but it can be called from any writer thread.
+ *       Reported offset is the total wiped size added to @e offset.
+ *
+ * @note Special (Gutmann) pattern and areas not aligned to device block size
+ *       are always wiped in one thread.
+ */
+int crypt_wipe_parallel(struct crypt_device *cd,
+	const char *dev_path, /* if null, use data device */
+	crypt_wipe_pattern pattern,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	uint32_t flags,
+	unsigned int threads,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr
+);
+
 /** Use direct-io */
 #define CRYPT_WIPE_NO_DIRECT_IO (UINT32_C(1) << 0)
+/** Discard the area instead of writing zeroes if the device guarantees reading zeroes
+ *  afterwards (@e CRYPT_WIPE_ZERO pattern only, discarded area is verified by sampled read) */
+#define CRYPT_WIPE_ALLOW_DISCARD (UINT32_C(1) << 1)
 /** @} */
 
 /**
@@ -2349,6 +3231,161 @@ int crypt_token_luks2_keyring_get(struct crypt_device *cd,
 	int token,
 	struct crypt_token_params_luks2_keyring *params);
 
+/**
+ * Statistics of the last token unlock attempt of a token. All times
+ * are in microseconds.
+ */
+struct crypt_token_open_stats {
+	const char *type;    /**< token handler name, @e NULL if handler is missing */
+	int result;          /**< unlocked keyslot or negative errno of token open or keyslot unlock */
+	uint64_t load_us;    /**< token handler lookup (including external plugin load) */
+	uint64_t open_us;    /**< token handler open (@e 0 for a prefetched or cached secret) */
+	uint64_t keyslot_us; /**< keyslot unlock with token secret (PBKDF) */
+};
+
+/**
+ * Get statistics of the last unlock attempt with a token. Statistics are
+ * reset when the next token unlock (activation, resume, volume key
+ * or passphrase retrieval through a token) starts.
+ *
+ * @param cd crypt device handle
+ * @param token token id
+ * @param stats returned statistics
+ *
+ * @return @e 0 on success, -ENOENT if the token was not tried in the last
+ *	   token unlock or negative errno value otherwise.
+ *
+ * @note Returned @e type is valid until @link crypt_free @endlink.
+ */
+int crypt_token_open_stats(struct crypt_device *cd, int token, struct crypt_token_open_stats *stats);
+
+/**
+ * Performance counters of a crypt device context. All times are in microseconds.
+ */
+struct crypt_perf_stats {
+	uint64_t metadata_read_bytes;  /**< bytes read by metadata (blockwise) I/O */
+	uint64_t metadata_write_bytes; /**< bytes written by metadata (blockwise) I/O */
+	uint64_t header_reads;         /**< LUKS header reads */
+	uint64_t header_writes;        /**< LUKS header writes */
+	uint64_t fsyncs;               /**< device synchronizations */
+	uint64_t kdf_runs;             /**< keyslot key derivations */
+	uint64_t kdf_wall_us;          /**< wall time of key derivations */
+	uint64_t kdf_cpu_us;           /**< process CPU time during key derivations */
+	uint64_t kernel_crypto_calls;  /**< kernel crypto API (AF_ALG) cipher requests */
+	uint64_t dm_ioctls;            /**< device-mapper ioctls */
+	uint64_t udev_wait_us;         /**< time spent waiting for udev */
+};
+
+/**
+ * Get performance counters.
+ *
+ * @param cd crypt device handle, @e NULL for totals of the whole process
+ * @param stats returned counters
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Metadata I/O, kernel crypto, device-mapper and udev counters are
+ *	 collected per process, for a device they are reported
+ *	 as difference since its @link crypt_init @endlink. With more device
+ *	 contexts used concurrently, the values include operations of all of them.
+ */
+int crypt_get_perf_stats(struct crypt_device *cd, struct crypt_perf_stats *stats);
+
+/** Maximal number of latency histogram bins in @link crypt_io_stats @endlink */
+#define CRYPT_IO_STATS_BINS 16
+
+/**
+ * I/O statistics of an active device. All times are in microseconds.
+ */
+struct crypt_io_stats {
+	uint64_t reads;        /**< completed reads */
+	uint64_t writes;       /**< completed writes */
+	uint64_t read_bytes;   /**< bytes read */
+	uint64_t write_bytes;  /**< bytes written */
+	uint64_t read_us;      /**< time spent in reads */
+	uint64_t write_us;     /**< time spent in writes */
+	uint64_t io_us;        /**< time with I/O in progress (for throughput) */
+	uint32_t histogram_bins;                          /**< used histogram bins, 0 if not available */
+	uint64_t histogram_upper_us[CRYPT_IO_STATS_BINS]; /**< upper bound of bin, last one is UINT64_MAX */
+	uint64_t histogram[CRYPT_IO_STATS_BINS];          /**< number of I/Os (read and write) in bin */
+};
+
+/**
+ * Create device-mapper statistics region with latency histogram for
+ * an active device and, if it is a device-mapper device as well,
+ * for its backing device.
+ *
+ * @param cd crypt device handle
+ * @param name name of active device
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Region stays until the device is deactivated, calling it again
+ * 	 for the same device does not create another region.
+ */
+int crypt_io_stats_enable(struct crypt_device *cd, const char *name);
+
+/**
+ * Get I/O statistics of an active device and its backing device.
+ *
+ * @param cd crypt device handle
+ * @param name name of active device
+ * @param stats returned statistics of the active device
+ * @param backing returned statistics of the backing device or @e NULL
+ *
+ * @return @e 0 on success or negative errno value otherwise,
+ * 	   @e -ENOENT if statistics are not enabled for the device.
+ *
+ * @note Backing devices that are not device-mapper devices report
+ *	 block layer counters only (no histogram).
+ */
+int crypt_get_io_stats(struct crypt_device *cd, const char *name,
+	struct crypt_io_stats *stats, struct crypt_io_stats *backing);
+
+/**
+ * LUKS2 USB key token parameters.
+ *
+ * Key is read directly from a block device (USB stick or its partition)
+ * referenced by filesystem UUID or partition UUID (exactly one must be set).
+ * If the device is not present, the token waits for it up to @e timeout seconds.
+ */
+struct crypt_token_params_luks2_usbkey {
+	const char *uuid;     /**< filesystem UUID (/dev/disk/by-uuid link) */
+	const char *partuuid; /**< partition UUID (/dev/disk/by-partuuid link) */
+	uint64_t key_offset;  /**< key offset on device in bytes */
+	uint32_t key_size;    /**< key size in bytes */
+	uint32_t timeout;     /**< wait for device in seconds, @e 0 means no wait */
+};
+
+/**
+ * Create a new luks2 USB key token.
+ *
+ * @param cd crypt device handle
+ * @param token token id or @e CRYPT_ANY_TOKEN to allocate new one
+ * @param params luks2 USB key token params
+ *
+ * @return allocated token id or negative errno otherwise.
+ */
+int crypt_token_luks2_usbkey_set(struct crypt_device *cd,
+	int token,
+	const struct crypt_token_params_luks2_usbkey *params);
+
+/**
+ * Get LUKS2 USB key token params
+ *
+ * @param cd crypt device handle
+ * @param token existing luks2 USB key token id
+ * @param params returned luks2 USB key token params
+ *
+ * @return allocated token id or negative errno otherwise.
+ *
+ * @note do not call free() on params members. Members are valid only
+ * 	 until next libcryptsetup function is called.
+ */
+int crypt_token_luks2_usbkey_get(struct crypt_device *cd,
+	int token,
+	struct crypt_token_params_luks2_usbkey *params);
+
 /**
  * Assign a token to particular keyslot.
  * (There can be more keyslots assigned to one token id.)
@@ -2501,6 +3538,63 @@ typedef void (*crypt_token_dump_func) (struct crypt_device *cd, const char *json
  */
 typedef const char * (*crypt_token_version_func) (void);
 
+/**
+ * Token handler asynchronous open function prototype (optional).
+ * This function starts retrieving password from a token (without PIN)
+ * and returns immediately. Library waits for the returned file
+ * descriptor to become readable (poll() @e POLLIN) and then calls
+ * @link crypt_token_open_finish_func @endlink. Several tokens are
+ * waited for at once this way.
+ *
+ * @param cd crypt device handle
+ * @param token token id
+ * @param usrptr user data in @link crypt_activate_by_token @endlink
+ * @param ctx returned handler private context of this open
+ *
+ * @return file descriptor (owned by handler) on success or negative errno
+ *	   otherwise (with the same meaning as for @link crypt_token_open_func @endlink).
+ */
+typedef int (*crypt_token_open_async_func) (
+	struct crypt_device *cd,
+	int token,
+	void *usrptr,
+	void **ctx);
+
+/**
+ * Token handler asynchronous open finish function prototype (optional).
+ * Called when file descriptor returned by @link crypt_token_open_async_func @endlink
+ * is readable. Unless it returns -EINPROGRESS, @e ctx is released.
+ *
+ * @param cd crypt device handle
+ * @param token token id
+ * @param ctx handler context returned by async open
+ * @param buffer returned allocated buffer with password
+ * @param buffer_len length of the buffer
+ *
+ * @return 0 on success, -EINPROGRESS if password is not ready yet (library
+ *	   continues waiting) or negative errno otherwise.
+ */
+typedef int (*crypt_token_open_finish_func) (
+	struct crypt_device *cd,
+	int token,
+	void *ctx,
+	char **buffer,
+	size_t *buffer_len);
+
+/**
+ * Token handler asynchronous open cancel function prototype (optional).
+ * Called if result of async open is no longer needed (other token
+ * unlocked the device) or the token timeout expired. It must release @e ctx.
+ *
+ * @param cd crypt device handle
+ * @param token token id
+ * @param ctx handler context returned by async open
+ */
+typedef void (*crypt_token_cancel_func) (
+	struct crypt_device *cd,
+	int token,
+	void *ctx);
+
 /**
  * Token handler
  */
@@ -2550,6 +3644,30 @@ void crypt_token_external_disable(void);
 /** token version - ABI exported symbol for external token */
 #define CRYPT_TOKEN_ABI_VERSION     "cryptsetup_token_version"
 
+/** ABI version for asynchronous open of external token (all three symbols are needed) */
+#define CRYPT_TOKEN_ABI_VERSION2    "CRYPTSETUP_TOKEN_1.1"
+
+/** asynchronous open by token - ABI exported symbol for external token */
+#define CRYPT_TOKEN_ABI_OPEN_ASYNC  "cryptsetup_token_open_async"
+/** asynchronous open finish - ABI exported symbol for external token */
+#define CRYPT_TOKEN_ABI_OPEN_FINISH "cryptsetup_token_open_finish"
+/** asynchronous open cancel - ABI exported symbol for external token */
+#define CRYPT_TOKEN_ABI_CANCEL      "cryptsetup_token_cancel"
+
+/**
+ * Set time limit for token open in token activation without PIN.
+ * Asynchronous token handlers and handlers run concurrently
+ * (@link CRYPT_ACTIVATE_PARALLEL_TOKENS @endlink) are cancelled when the limit
+ * expires, as if the token hardware was missing. Blocking handler open
+ * called directly cannot be interrupted.
+ *
+ * @param cd crypt device handle
+ * @param timeout_ms time limit in milliseconds, @e 0 means no limit (default)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_token_set_timeout(struct crypt_device *cd, uint32_t timeout_ms);
+
 /**
  * Activate device or check key using a token.
  *
@@ -2625,6 +3743,79 @@ int crypt_activate_by_token_pin(struct crypt_device *cd,
 	size_t pin_size,
 	void *usrptr,
 	uint32_t flags);
+
+/**
+ * Cache secrets provided by token handlers in user keyring.
+ *
+ * Secret that unlocked a keyslot is stored in user keyring (user key type)
+ * with limited lifetime. Later token unlock (in any context and process
+ * of the same user) of a token with the same metadata (except assigned
+ * keyslots), for example the same hardware key used for more devices,
+ * uses the cached secret and skips token handler open (and PIN).
+ *
+ * @param cd crypt device handle
+ * @param timeout cached secret lifetime in seconds, @e 0 disables cache (default)
+ *
+ * @return @e 0 on success, -ENOTSUP if kernel keyring is not supported
+ *	   or negative errno otherwise.
+ *
+ * @note Cached secrets are readable by processes possessing user keyring.
+ *	 Keep the timeout short.
+ */
+int crypt_token_keyring_cache(struct crypt_device *cd, unsigned int timeout);
+
+/** Keep volume key session also in user keyring (shared by other contexts of the same device) */
+#define CRYPT_VOLUME_KEY_SESSION_KEYRING (UINT32_C(1) << 0)
+
+/**
+ * Start or end unlocked volume key session.
+ *
+ * Volume key unlocked by passphrase or keyfile in keyslot context operations
+ * (like @link crypt_keyslot_add_by_keyslot_context @endlink) is kept
+ * in locked memory of the context. Later keyslot context operation with
+ * the same credential reuses the key without running keyslot PBKDF,
+ * as long as the keyslot metadata is unchanged and the key still matches
+ * the volume key digest.
+ *
+ * @param cd crypt device handle (LUKS1 or LUKS2)
+ * @param timeout session lifetime in seconds, @e 0 ends the session and wipes the key
+ * @param flags @e CRYPT_VOLUME_KEY_SESSION_KEYRING or @e 0
+ *
+ * @return @e 0 on success, -ENOTSUP if keyring is requested but not supported
+ *	   or negative errno otherwise.
+ *
+ * @note With @e CRYPT_VOLUME_KEY_SESSION_KEYRING the volume key is readable
+ *	 by processes possessing user keyring until the timeout expires
+ *	 or the session is ended by this call with zero timeout.
+ */
+int crypt_volume_key_session(struct crypt_device *cd, unsigned int timeout, uint32_t flags);
+
+/**
+ * Start acquiring secrets of tokens in background.
+ *
+ * Token handlers (open without PIN) run in separate threads, so waiting
+ * for token hardware or network can overlap with other work (like
+ * unlocking other devices). Secrets are kept in locked memory and used
+ * (each only once) by the next token activation or unlock without PIN
+ * on the same context, that waits for all prefetches to finish.
+ * Prefetched secrets are dropped on header reload and in crypt_free.
+ *
+ * @param cd crypt device handle
+ * @param token token id or @e CRYPT_ANY_TOKEN for all usable tokens
+ * @param type restrict type of token, if @e NULL all types are allowed
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 on success (prefetch started), -EBUSY if secrets of previous
+ *	   prefetch were not used yet, -ENOENT if no token is usable or negative
+ *	   errno otherwise.
+ *
+ * @note Until the prefetch is used, @e cd metadata must not be modified,
+ *	 token handlers may read them in parallel.
+ */
+int crypt_token_prefetch(struct crypt_device *cd,
+	int token,
+	const char *type,
+	void *usrptr);
 /** @} */
 
 /**
@@ -2647,6 +3838,23 @@ int crypt_activate_by_token_pin(struct crypt_device *cd,
 #define CRYPT_REENCRYPT_RECOVERY           (UINT32_C(1) << 3)
 /** Reencryption requires metadata protection. (in/out) */
 #define CRYPT_REENCRYPT_REPAIR_NEEDED      (UINT32_C(1) << 4)
+/** Do not encrypt areas not allocated in data device (sparse file backed device
+ *  only, encryption without data shift only). These areas read as random data
+ *  after encryption. (in) */
+#define CRYPT_REENCRYPT_SKIP_HOLES         (UINT32_C(1) << 5)
+/** Switch between "checksum" and "journal" resilience per hotzone, whichever
+ *  is faster on the device (not with datashift or batched hotzones). Every switch
+ *  is stored in reencryption metadata before the hotzone is processed. (in) */
+#define CRYPT_REENCRYPT_ADAPTIVE_RESILIENCE (UINT32_C(1) << 6)
+/** With more userspace threads, spread the threads over NUMA nodes and keep
+ *  the part of the reencryption buffer processed by a thread on its node. (in) */
+#define CRYPT_REENCRYPT_NUMA_LOCAL         (UINT32_C(1) << 7)
+/** Clear the data device area freed by datashift with discard (if the device
+ *  reads zeroes afterwards) or zeroes instead of random data. (in) */
+#define CRYPT_REENCRYPT_DISCARD_UNUSED     (UINT32_C(1) << 8)
+/** Do not read the next hotzone ahead while the current one is processed
+ *  (offline reencryption without data shift only). (in) */
+#define CRYPT_REENCRYPT_NO_READ_AHEAD      (UINT32_C(1) << 9)
 
 /**
  * Reencryption direction
@@ -2671,7 +3879,7 @@ typedef enum {
 struct crypt_params_reencrypt {
 	crypt_reencrypt_mode_info mode;           /**< Reencryption mode, immutable after first init. */
 	crypt_reencrypt_direction_info direction; /**< Reencryption direction, immutable after first init. */
-	const char *resilience;                   /**< Resilience mode: "none", "checksum", "journal", "datashift",
+	const char *resilience;                   /**< Resilience mode: "none", "checksum", "journal", "journal-ring", "datashift",
 						       "datashift-checksum" or "datashift-journal".
 						       "datashift" mode is immutable, "datashift-" subvariant can be only
 						       changed to other "datashift-" subvariant */
@@ -2685,6 +3893,62 @@ struct crypt_params_reencrypt {
 	uint32_t flags;                           /**< Reencryption flags. */
 };
 
+/**
+ * Set number of threads used for userspace reencryption of data.
+ * It must be called before @link crypt_reencrypt_init_by_passphrase @endlink
+ * (or other reencryption init function) to take effect.
+ *
+ * @param cd crypt device handle
+ * @param threads number of threads, @e 0 or @e 1 means single thread
+ *	  (limited by number of online CPUs, ignored for zoned devices)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_reencrypt_set_threads(struct crypt_device *cd, uint32_t threads);
+
+/**
+ * Set adaptive hotzone size for reencryption. Hotzone size is adjusted so that
+ * single reencryption step takes about the requested time, max_hotzone_size
+ * in @link crypt_params_reencrypt @endlink is the upper bound.
+ * It must be called before reencryption is initialized to take effect.
+ *
+ * @param cd crypt device handle
+ * @param step_latency_ms target duration of single step in milliseconds,
+ *	  @e 0 means fixed hotzone size (ignored for "datashift" resilience)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_reencrypt_set_step_latency(struct crypt_device *cd, uint32_t step_latency_ms);
+
+/**
+ * Set number of hotzones protected by single checksums and segments commit
+ * ("checksum" resilience only).
+ * It must be called before reencryption is initialized to take effect.
+ *
+ * @param cd crypt device handle
+ * @param hotzone_batch number of max_hotzone_size sized chunks in one batch,
+ *	  @e 0 or @e 1 means no batching (limited by checksums area size)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_reencrypt_set_hotzone_batch(struct crypt_device *cd, uint32_t hotzone_batch);
+
+/**
+ * Set reencryption throttling.
+ * It must be called before reencryption is initialized to take effect.
+ *
+ * @param cd crypt device handle
+ * @param max_throughput limit of average reencryption throughput in bytes
+ *	  per second, @e 0 means unlimited
+ * @param max_io_latency_ms online reencryption only: back off between hotzones
+ *	  while average latency of I/O on the active device exceeds this value,
+ *	  @e 0 means no backoff
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_reencrypt_set_throttle(struct crypt_device *cd, uint64_t max_throughput,
+	uint32_t max_io_latency_ms);
+
 /**
  * Initialize reencryption metadata using passphrase.
  *
@@ -2772,6 +4036,38 @@ int crypt_reencrypt_run(struct crypt_device *cd,
 		    int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 		    void *usrptr);
 
+/**
+ * Statistics of single reencryption step (hotzone). All times are in microseconds.
+ */
+struct crypt_reencrypt_step_stats {
+	uint64_t offset;           /**< hotzone offset in bytes (relative to data segment) */
+	uint64_t length;           /**< hotzone length in bytes */
+	uint64_t read_us;          /**< hotzone data read */
+	uint64_t protect_us;       /**< resilience data calculation and write */
+	uint64_t decrypt_us;       /**< decryption of old data */
+	uint64_t encrypt_write_us; /**< encryption and write of new data */
+	uint64_t sync_us;          /**< data device sync */
+	uint64_t commit_us;        /**< segments metadata commits */
+	uint64_t total_us;         /**< whole step including device stack refresh */
+	uint64_t switch_us;        /**< online only: overlay table switch (application I/O stalled) */
+};
+
+/**
+ * Set callback reporting statistics of every reencryption step.
+ * It must be called after reencryption is initialized and before
+ * @link crypt_reencrypt_run @endlink.
+ *
+ * @param cd crypt device handle
+ * @param stats callback function called after each successful step,
+ *        or @e NULL to disable reporting
+ * @param usrptr callback specific data
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_reencrypt_set_stats_callback(struct crypt_device *cd,
+	void (*stats)(const struct crypt_reencrypt_step_stats *stats, void *usrptr),
+	void *usrptr);
+
 /**
  * Reencryption status info
  */
@@ -2837,6 +4133,173 @@ void crypt_safe_memzero(void *data, size_t size);
 
 /** @} */
 
+/**
+ * @defgroup crypt-executor Thread executor
+ * @addtogroup crypt-executor
+ * @{
+ */
+
+/**
+ * Set executor for internal parallel work (keyslot and token trials, header
+ * parsing, wipe, parallel encryption and checksums, verity hashing).
+ * The setting is global for the process. If a task cannot be started,
+ * the library runs it in the calling thread.
+ *
+ * @param submit function that runs @e task(@e task_arg) asynchronously,
+ *        returns 0 if the task was accepted. It is never called from inside
+ *        a submitted task. @e NULL means the built-in thread pool.
+ * @param concurrency maximal number of library worker threads in the process
+ *        plus one (the caller), 0 means no limit and 1 disables
+ *        parallelism completely
+ * @param usrptr user pointer passed to @e submit
+ *
+ * @returns 0 on success or negative errno value otherwise
+ *          (@e -EBUSY if library tasks are running).
+ *
+ * @note Work that must run concurrently (Argon2 lanes, streaming readers)
+ *       and cancellable token open threads never use @e submit,
+ *       they only respect @e concurrency.
+ */
+int crypt_set_executor(int (*submit)(void (*task)(void *task_arg), void *task_arg, void *usrptr),
+		       unsigned int concurrency, void *usrptr);
+
+/** @} */
+
+/**
+ * @defgroup crypt-async Asynchronous activation
+ * Activation runs as one executor task (see @link crypt_set_executor @endlink),
+ * the crypt device context must not be used by the caller until it completes.
+ * Completion makes the file descriptor returned by @link crypt_async_fd @endlink
+ * readable. If no executor thread is available, the activation completes
+ * in the calling thread before the function returns.
+ * @addtogroup crypt-async
+ * @{
+ */
+
+/** Opaque asynchronous activation handle */
+struct crypt_async;
+
+/** activation is waiting for executor thread */
+#define CRYPT_ASYNC_QUEUED	0
+/** activation started, metadata is being checked */
+#define CRYPT_ASYNC_STARTED	1
+/** token secret is being acquired */
+#define CRYPT_ASYNC_TOKEN	2
+/** keyslot KDF is running */
+#define CRYPT_ASYNC_KDF		3
+/** device-mapper device is being created */
+#define CRYPT_ASYNC_ACTIVATE	4
+/** activation finished */
+#define CRYPT_ASYNC_DONE	5
+
+/**
+ * Start asynchronous @link crypt_activate_by_passphrase @endlink.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to create, if @e NULL only check passphrase
+ * @param keyslot requested keyslot to check or @e CRYPT_ANY_SLOT
+ * @param passphrase passphrase used to unlock volume key (copied)
+ * @param passphrase_size size of @e passphrase (binary data)
+ * @param flags activation flags
+ * @param done optional completion callback, called from the executor thread
+ *        with the activation result before the descriptor is signalled;
+ *        it must not free the handle
+ * @param usrptr user pointer passed to @e done
+ * @param async returned handle, release it by @link crypt_async_free @endlink
+ *
+ * @return @e 0 if activation was started, negative errno value otherwise
+ *         (@e -EINVAL if another asynchronous activation runs on @e cd).
+ */
+int crypt_activate_by_passphrase_async(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags,
+	void (*done)(struct crypt_async *async, int r, void *usrptr),
+	void *usrptr,
+	struct crypt_async **async);
+
+/**
+ * Start asynchronous @link crypt_activate_by_token_pin @endlink.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to create, if @e NULL only check token
+ * @param type restrict type of token, if @e NULL all types are allowed
+ * @param token requested token to check or CRYPT_ANY_TOKEN to check all
+ * @param pin passphrase (or PIN) to unlock token (may be binary data, copied)
+ * @param pin_size size of @e pin
+ * @param token_usrptr provide user data to token plugin
+ * @param flags activation flags
+ * @param done optional completion callback, see
+ *        @link crypt_activate_by_passphrase_async @endlink
+ * @param usrptr user pointer passed to @e done
+ * @param async returned handle, release it by @link crypt_async_free @endlink
+ *
+ * @return @e 0 if activation was started, negative errno value otherwise.
+ */
+int crypt_activate_by_token_pin_async(struct crypt_device *cd,
+	const char *name,
+	const char *type,
+	int token,
+	const char *pin,
+	size_t pin_size,
+	void *token_usrptr,
+	uint32_t flags,
+	void (*done)(struct crypt_async *async, int r, void *usrptr),
+	void *usrptr,
+	struct crypt_async **async);
+
+/**
+ * Get completion file descriptor (eventfd, non-blocking). It becomes
+ * readable once the activation finished.
+ *
+ * @param async asynchronous activation handle
+ *
+ * @return file descriptor or negative errno value otherwise.
+ */
+int crypt_async_fd(struct crypt_async *async);
+
+/**
+ * Get result of asynchronous activation.
+ *
+ * @param async asynchronous activation handle
+ *
+ * @return value the synchronous variant would return or
+ *         @e -EINPROGRESS if activation is still running.
+ */
+int crypt_async_result(struct crypt_async *async);
+
+/**
+ * Get current stage of asynchronous activation.
+ *
+ * @param async asynchronous activation handle
+ *
+ * @return one of @e CRYPT_ASYNC_* stages or negative errno value otherwise.
+ */
+int crypt_async_progress(struct crypt_async *async);
+
+/**
+ * Request cancellation of asynchronous activation. A running KDF or token
+ * plugin is not interrupted, but no device is created after this call;
+ * the activation then finishes with @e -ECANCELED.
+ *
+ * @param async asynchronous activation handle
+ *
+ * @return @e 0 on success, @e -EALREADY if the activation already finished.
+ */
+int crypt_async_cancel(struct crypt_async *async);
+
+/**
+ * Release asynchronous activation handle. Running activation is cancelled
+ * and waited for.
+ *
+ * @param async asynchronous activation handle
+ */
+void crypt_async_free(struct crypt_async *async);
+
+/** @} */
+
 #ifdef __cplusplus
 }
 #endif
@@ -60,6 +60,8 @@
 
 #define DEFAULT_DISK_ALIGNMENT	1048576 /* 1MiB */
 #define DEFAULT_MEM_ALIGNMENT	4096
+#define DEFAULT_DEACTIVATE_TIMEOUT_MS	5000
+#define DM_CRYPT_SHARDS_MAX	256
 
 #define DM_UUID_LEN		129
 #define DM_BY_ID_PREFIX		"dm-uuid-"
@@ -25,8 +25,12 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <libdevmapper.h>
 #include <uuid/uuid.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>     /* for major, minor */
@@ -35,25 +39,48 @@
 #include "internal.h"
 
 #define DM_CRYPT_TARGET		"crypt"
+#define DM_DEFAULT_KEY_TARGET	"default-key"
 #define DM_VERITY_TARGET	"verity"
 #define DM_INTEGRITY_TARGET	"integrity"
 #define DM_LINEAR_TARGET	"linear"
 #define DM_ERROR_TARGET         "error"
 #define DM_ZERO_TARGET		"zero"
-#define RETRY_COUNT		5
+/* poll interval limits while waiting for device openers to close it */
+#define REMOVE_WAIT_MIN_MS	10
+#define REMOVE_WAIT_MAX_MS	500
+/* dm-crypt shard boundary alignment (in sectors, 1 MiB) */
+#define DM_CRYPT_SHARD_ALIGN	2048
 
-/* Set if DM target versions were probed */
+/* Set if DM target versions were probed, protected by _dm_check_lock */
 static bool _dm_ioctl_checked = false;
 static bool _dm_crypt_checked = false;
 static bool _dm_verity_checked = false;
 static bool _dm_integrity_checked = false;
 static bool _dm_zero_checked = false;
-
-static int _quiet_log = 0;
 static uint32_t _dm_flags = 0;
+static bool _dm_cache_tried = false;
+static pthread_mutex_t _dm_check_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Probed targets in persistent capability cache */
+#define DM_CHECKED_IOCTL	(1 << 0)
+#define DM_CHECKED_CRYPT	(1 << 1)
+#define DM_CHECKED_VERITY	(1 << 2)
+#define DM_CHECKED_INTEGRITY	(1 << 3)
+#define DM_CHECKED_ZERO		(1 << 4)
+
+/*
+ * libdevmapper log callback is process global but it is always called
+ * from the thread running the DM task, so the log context is per thread.
+ */
+static __thread int _quiet_log = 0;
+static __thread struct crypt_device *_context = NULL;
 
-static struct crypt_device *_context = NULL;
 static int _dm_use_count = 0;
+static pthread_mutex_t _dm_use_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Shared udev cookie of the running activation batch (per thread) */
+static __thread bool _dm_batch = false;
+static __thread uint32_t _dm_batch_cookie = 0;
 
 /* Check if we have DM flag to instruct kernel to force wipe buffers */
 #if !HAVE_DECL_DM_TASK_SECURE_DATA
@@ -66,13 +93,26 @@ static int dm_task_secure_data(struct dm_task *dmt) { return 1; }
 				DM_UDEV_DISABLE_DISK_RULES_FLAG | \
 				DM_UDEV_DISABLE_OTHER_RULES_FLAG
 #define _dm_task_set_cookie	dm_task_set_cookie
-#define _dm_udev_wait		dm_udev_wait
+#define _dm_udev_wait_cookie	dm_udev_wait
 #else
 #define CRYPT_TEMP_UDEV_FLAGS	0
 static int _dm_task_set_cookie(struct dm_task *dmt, uint32_t *cookie, uint16_t flags) { return 0; }
-static int _dm_udev_wait(uint32_t cookie) { return 0; };
+static int _dm_udev_wait_cookie(uint32_t cookie) { return 0; };
 #endif
 
+static int _dm_udev_wait(uint32_t cookie)
+{
+	uint64_t start = crypt_perf_time_us();
+	int r, span;
+
+	span = crypt_span_begin(_context, "udev_settle");
+	r = _dm_udev_wait_cookie(cookie);
+	crypt_span_end(_context, span);
+
+	crypt_perf_add(NULL, udev_wait_us, crypt_perf_time_us() - start);
+	return r;
+}
+
 static int _dm_use_udev(void)
 {
 #ifdef USE_UDEV /* cannot be enabled if devmapper is too old */
@@ -82,6 +122,18 @@ static int _dm_use_udev(void)
 #endif
 }
 
+/*
+ * Inside a batch the udev wait of public (non-private) devices is deferred
+ * to dm_udev_batch_end(). Private devices are stacked helpers that other
+ * tables reference by path, these must be always synced immediately.
+ */
+static uint32_t *_dm_udev_cookie(uint32_t *cookie, bool private)
+{
+	if (_dm_batch && !private)
+		return &_dm_batch_cookie;
+	return cookie;
+}
+
 __attribute__((format(printf, 4, 5)))
 static void set_dm_error(int level,
 			 const char *file __attribute__((unused)),
@@ -259,6 +311,16 @@ static void _dm_set_zero_compat(struct crypt_device *cd,
 	_dm_zero_checked = true;
 }
 
+/* All dm ioctls are issued here (trace point) */
+static int _dm_task_run(struct dm_task *dmt, int task)
+{
+	int r = dm_task_run(dmt);
+
+	crypt_perf_add(NULL, dm_ioctls, 1);
+	trace_dm_ioctl(task, r);
+	return r;
+}
+
 /* We use this for loading target module */
 static void _dm_check_target(dm_target_type target_type)
 {
@@ -282,13 +344,52 @@ static void _dm_check_target(dm_target_type target_type)
 		return;
 
 	if (dm_task_set_name(dmt, target_name))
-		dm_task_run(dmt);
+		_dm_task_run(dmt, DM_DEVICE_GET_TARGET_VERSION);
 
 	dm_task_destroy(dmt);
 #endif
 }
 
-static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_type)
+static uint32_t _dm_checked_mask(void)
+{
+	return (_dm_ioctl_checked     ? DM_CHECKED_IOCTL : 0) |
+	       (_dm_crypt_checked     ? DM_CHECKED_CRYPT : 0) |
+	       (_dm_verity_checked    ? DM_CHECKED_VERITY : 0) |
+	       (_dm_integrity_checked ? DM_CHECKED_INTEGRITY : 0) |
+	       (_dm_zero_checked      ? DM_CHECKED_ZERO : 0);
+}
+
+/* Reuse capabilities detected by another process with the same dm modules, no ioctl needed */
+static void _dm_cache_load(struct crypt_device *cd)
+{
+	uint32_t flags, checked;
+
+	_dm_cache_tried = true;
+
+	if (crypt_dm_cache_get(cd, &flags, &checked) || !(checked & DM_CHECKED_IOCTL))
+		return;
+
+	log_dbg(cd, "Using cached device-mapper capabilities (flags 0x%" PRIx32 ").", flags);
+
+	_dm_flags = flags;
+	_dm_ioctl_checked = true;
+	_dm_crypt_checked = checked & DM_CHECKED_CRYPT;
+	_dm_verity_checked = checked & DM_CHECKED_VERITY;
+	_dm_integrity_checked = checked & DM_CHECKED_INTEGRITY;
+	_dm_zero_checked = checked & DM_CHECKED_ZERO;
+}
+
+static bool _dm_target_checked(dm_target_type target_type)
+{
+	return (target_type == DM_CRYPT     && _dm_crypt_checked) ||
+	       (target_type == DM_VERITY    && _dm_verity_checked) ||
+	       (target_type == DM_INTEGRITY && _dm_integrity_checked) ||
+	       (target_type == DM_ZERO      && _dm_zero_checked) ||
+	       (target_type == DM_LINEAR) ||
+	       (_dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked && _dm_zero_checked);
+}
+
+static int _dm_check_versions_locked(struct crypt_device *cd, dm_target_type target_type)
 {
 	struct dm_task *dmt;
 	struct dm_versions *target, *last_target;
@@ -296,14 +397,15 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 	unsigned dm_maj, dm_min, dm_patch;
 	int r = 0;
 
-	if ((target_type == DM_CRYPT     && _dm_crypt_checked) ||
-	    (target_type == DM_VERITY    && _dm_verity_checked) ||
-	    (target_type == DM_INTEGRITY && _dm_integrity_checked) ||
-	    (target_type == DM_ZERO      && _dm_zero_checked) ||
-	    (target_type == DM_LINEAR) ||
-	    (_dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked && _dm_zero_checked))
+	if (_dm_target_checked(target_type))
 		return 1;
 
+	if (!_dm_cache_tried && !_dm_ioctl_checked) {
+		_dm_cache_load(cd);
+		if (_dm_target_checked(target_type))
+			return 1;
+	}
+
 	/* Shut up DM while checking */
 	_quiet_log = 1;
 
@@ -312,7 +414,7 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 	if (!(dmt = dm_task_create(DM_DEVICE_LIST_VERSIONS)))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_task_run(dmt, DM_DEVICE_LIST_VERSIONS))
 		goto out;
 
 	if (!dm_task_get_driver_version(dmt, dm_version, sizeof(dm_version)))
@@ -354,6 +456,11 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 			_dm_set_zero_compat(cd, (unsigned)target->version[0],
 					    (unsigned)target->version[1],
 					    (unsigned)target->version[2]);
+		} else if (!strcmp(DM_DEFAULT_KEY_TARGET, target->name)) {
+			log_dbg(cd, "Detected dm-default-key version %i.%i.%i.",
+				(unsigned)target->version[0], (unsigned)target->version[1],
+				(unsigned)target->version[2]);
+			_dm_flags |= DM_CRYPT_INLINE_SUPPORTED;
 		}
 		target = VOIDP_CAST(struct dm_versions *)((char *) target + target->next);
 	} while (last_target != target);
@@ -364,6 +471,7 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 			_dm_use_udev() ? "en" : "dis");
 
 	_dm_ioctl_checked = true;
+	crypt_dm_cache_set(cd, _dm_flags, _dm_checked_mask());
 out:
 	if (dmt)
 		dm_task_destroy(dmt);
@@ -372,46 +480,92 @@ out:
 	return r;
 }
 
+/* Versions are probed only once per process even if more threads race here */
+static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_type)
+{
+	int r;
+
+	pthread_mutex_lock(&_dm_check_lock);
+	r = _dm_check_versions_locked(cd, target_type);
+	pthread_mutex_unlock(&_dm_check_lock);
+
+	return r;
+}
+
 int dm_flags(struct crypt_device *cd, dm_target_type target, uint32_t *flags)
 {
+	int r = -ENODEV;
+
 	_dm_check_versions(cd, target);
+
+	pthread_mutex_lock(&_dm_check_lock);
 	*flags = _dm_flags;
 
 	if (target == DM_UNKNOWN &&
 	    _dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked && _dm_zero_checked)
-		return 0;
-
-	if ((target == DM_CRYPT     && _dm_crypt_checked) ||
-	    (target == DM_VERITY    && _dm_verity_checked) ||
-	    (target == DM_INTEGRITY && _dm_integrity_checked) ||
-	    (target == DM_ZERO      && _dm_zero_checked) ||
-	    (target == DM_LINEAR)) /* nothing to check */
-		return 0;
+		r = 0;
+	else if ((target == DM_CRYPT     && _dm_crypt_checked) ||
+		 (target == DM_VERITY    && _dm_verity_checked) ||
+		 (target == DM_INTEGRITY && _dm_integrity_checked) ||
+		 (target == DM_ZERO      && _dm_zero_checked) ||
+		 (target == DM_LINEAR)) /* nothing to check */
+		r = 0;
+	pthread_mutex_unlock(&_dm_check_lock);
 
-	return -ENODEV;
+	return r;
 }
 
 /* This doesn't run any kernel checks, just set up userspace libdevmapper */
 void dm_backend_init(struct crypt_device *cd)
 {
+	pthread_mutex_lock(&_dm_use_lock);
 	if (!_dm_use_count++) {
 		log_dbg(cd, "Initialising device-mapper backend library.");
 		dm_log_init(set_dm_error);
 		dm_log_init_verbose(10);
 	}
+	pthread_mutex_unlock(&_dm_use_lock);
 }
 
 void dm_backend_exit(struct crypt_device *cd)
 {
+	pthread_mutex_lock(&_dm_use_lock);
 	if (_dm_use_count && (!--_dm_use_count)) {
 		log_dbg(cd, "Releasing device-mapper backend.");
 		dm_log_init_verbose(0);
 		dm_log_init(NULL);
 		dm_lib_release();
 	}
+	pthread_mutex_unlock(&_dm_use_lock);
+}
+
+/* Start sharing one udev cookie for all following activations in this thread */
+void dm_udev_batch_begin(void)
+{
+	_dm_batch = true;
+	_dm_batch_cookie = 0;
+}
+
+/* Wait once for udev to process all devices created since batch begin */
+void dm_udev_batch_end(struct crypt_device *cd)
+{
+	if (!_dm_batch)
+		return;
+
+	if (_dm_batch_cookie && _dm_use_udev()) {
+		log_dbg(cd, "Waiting for udev to process activation batch.");
+		(void)_dm_udev_wait(_dm_batch_cookie);
+		dm_task_update_nodes();
+	}
+
+	_dm_batch = false;
+	_dm_batch_cookie = 0;
 }
 
-/* libdevmapper is not context friendly, switch context on every DM call. */
+/*
+ * libdevmapper is not context friendly, switch (thread local) context
+ * on every DM call.
+ */
 static int dm_init_context(struct crypt_device *cd, dm_target_type target)
 {
 	_context = cd;
@@ -444,7 +598,7 @@ char *dm_device_path(const char *prefix, int major, int minor)
 	if (!dm_task_set_minor(dmt, minor) ||
 	    !dm_task_set_major(dmt, major) ||
 	    !dm_task_no_flush(dmt) ||
-	    !dm_task_run(dmt) ||
+	    !_dm_task_run(dmt, DM_DEVICE_STATUS) ||
 	    !(name = dm_task_get_name(dmt))) {
 		dm_task_destroy(dmt);
 		return NULL;
@@ -623,12 +777,16 @@ static char *_uf(char *buf, size_t buf_size, const char *s, unsigned u)
 static char *get_dm_crypt_params(const struct dm_target *tgt, uint32_t flags)
 {
 	int r, max_size, null_cipher = 0, num_options = 0, keystr_len = 0;
-	char *params = NULL, *hexkey = NULL;
+	char *params = NULL, *p;
 	char sector_feature[32], features[512], integrity_dm[256], cipher_dm[256];
 
 	if (!tgt)
 		return NULL;
 
+	/* dm-default-key table has the same format, but only these options */
+	if (flags & CRYPT_ACTIVATE_INLINE_CRYPT)
+		flags &= CRYPT_ACTIVATE_ALLOW_DISCARDS | CRYPT_ACTIVATE_IV_LARGE_SECTORS;
+
 	r = cipher_c2dm(tgt->u.crypt.cipher, tgt->u.crypt.integrity, tgt->u.crypt.tag_size,
 			cipher_dm, sizeof(cipher_dm), integrity_dm, sizeof(integrity_dm));
 	if (r < 0)
@@ -670,39 +828,49 @@ static char *get_dm_crypt_params(const struct dm_target *tgt, uint32_t flags)
 	if (crypt_is_cipher_null(cipher_dm))
 		null_cipher = 1;
 
+	/*
+	 * Key (hex or keyring reference) is written directly into the table
+	 * line, no other copy of key is allocated.
+	 */
 	if (null_cipher)
-		hexkey = crypt_bytes_to_hex(0, NULL);
-	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY) {
+		keystr_len = CRYPT_HEX_LEN(0);
+	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY)
 		keystr_len = strlen(tgt->u.crypt.vk->key_description) + int_log10(tgt->u.crypt.vk->keylength) + 10;
-		hexkey = crypt_safe_alloc(keystr_len);
-		if (!hexkey)
-			goto out;
-		r = snprintf(hexkey, keystr_len, ":%zu:logon:%s", tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key_description);
-		if (r < 0 || r >= keystr_len)
-			goto out;
-	} else
-		hexkey = crypt_bytes_to_hex(tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key);
-
-	if (!hexkey)
-		goto out;
+	else
+		keystr_len = CRYPT_HEX_LEN(tgt->u.crypt.vk->keylength);
 
-	max_size = strlen(hexkey) + strlen(cipher_dm) +
+	max_size = keystr_len + strlen(cipher_dm) +
 		   strlen(device_block_path(tgt->data_device)) +
 		   strlen(features) + 64;
 	params = crypt_safe_alloc(max_size);
 	if (!params)
 		goto out;
 
-	r = snprintf(params, max_size, "%s %s %" PRIu64 " %s %" PRIu64 "%s",
-		     cipher_dm, hexkey, tgt->u.crypt.iv_offset,
-		     device_block_path(tgt->data_device), tgt->u.crypt.offset,
-		     features);
-	if (r < 0 || r >= max_size) {
-		crypt_safe_free(params);
-		params = NULL;
-	}
+	r = snprintf(params, max_size, "%s ", cipher_dm);
+	if (r < 0 || r >= max_size)
+		goto err;
+	p = params + r;
+
+	if (null_cipher)
+		crypt_bytes_to_hex_buffer(p, 0, NULL);
+	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY) {
+		r = snprintf(p, keystr_len, ":%zu:logon:%s", tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key_description);
+		if (r < 0 || r >= keystr_len)
+			goto err;
+		keystr_len = r;
+	} else
+		crypt_bytes_to_hex_buffer(p, tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key);
+	p += keystr_len;
+
+	r = snprintf(p, max_size - (p - params), " %" PRIu64 " %s %" PRIu64 "%s",
+		     tgt->u.crypt.iv_offset, device_block_path(tgt->data_device),
+		     tgt->u.crypt.offset, features);
+	if (r >= 0 && r < max_size - (p - params))
+		goto out;
+err:
+	crypt_safe_free(params);
+	params = NULL;
 out:
-	crypt_safe_free(hexkey);
 	return params;
 }
 
@@ -1045,7 +1213,7 @@ static int _dm_remove(const char *name, int udev_wait, int deferred)
 	if (udev_wait && !_dm_task_set_cookie(dmt, &cookie, DM_UDEV_DISABLE_LIBRARY_FALLBACK))
 		goto out;
 
-	r = dm_task_run(dmt);
+	r = _dm_task_run(dmt, DM_DEVICE_REMOVE);
 
 	if (udev_wait)
 		(void)_dm_udev_wait(cookie);
@@ -1073,7 +1241,7 @@ static int _dm_simple(int task, const char *name, uint32_t dmflags)
 	    (dmflags & DM_SUSPEND_NOFLUSH) && !dm_task_no_flush(dmt))
 		goto out;
 
-	r = dm_task_run(dmt);
+	r = _dm_task_run(dmt, task);
 out:
 	dm_task_destroy(dmt);
 	return r;
@@ -1101,7 +1269,7 @@ static int _error_device(const char *name, size_t size)
 	if (!dm_task_no_open_count(dmt))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_task_run(dmt, DM_DEVICE_RELOAD))
 		goto out;
 
 	if (_dm_resume_device(name, 0)) {
@@ -1158,14 +1326,90 @@ int dm_clear_device(struct crypt_device *cd, const char *name)
 	return r;
 }
 
+static uint64_t _dm_time_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns open count of device or negative errno */
+static int _dm_open_count(const char *name, uint32_t *major, uint32_t *minor)
+{
+	struct dm_task *dmt;
+	struct dm_info dmi;
+	int r = -EINVAL;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_INFO)))
+		return -EINVAL;
+
+	if (dm_task_set_name(dmt, name) && _dm_task_run(dmt, DM_DEVICE_INFO) && dm_task_get_info(dmt, &dmi)) {
+		r = dmi.exists ? dmi.open_count : -ENODEV;
+		*major = dmi.major;
+		*minor = dmi.minor;
+	}
+
+	dm_task_destroy(dmt);
+	return r;
+}
+
+/*
+ * Wait until device is not open or deadline expires. Userspace openers
+ * wake us up by closing the device node (inotify), kernel holders (mounted
+ * filesystem, stacked device) generate no event, so open count is also
+ * polled with growing interval.
+ */
+static void _dm_wait_unused(struct crypt_device *cd, const char *name, uint64_t deadline)
+{
+	char path[64];
+	struct pollfd pfd = { .fd = -1, .events = POLLIN };
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	uint32_t major = 0, minor = 0;
+	uint64_t now;
+	int r, wait_ms = REMOVE_WAIT_MIN_MS;
+
+	r = _dm_open_count(name, &major, &minor);
+	if (r <= 0)
+		return;
+
+	pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (pfd.fd >= 0 &&
+	    (snprintf(path, sizeof(path), "/dev/block/%u:%u", major, minor) < 0 ||
+	     inotify_add_watch(pfd.fd, path, IN_CLOSE) < 0)) {
+		close(pfd.fd);
+		pfd.fd = -1;
+	}
+
+	log_dbg(cd, "Waiting for %d opener(s) of device %s to close it.", r, name);
+
+	while (r > 0 && (now = _dm_time_ms()) < deadline) {
+		if (now + wait_ms > deadline)
+			wait_ms = deadline - now;
+
+		if (poll(&pfd, 1, wait_ms) > 0)
+			while (read(pfd.fd, buf, sizeof(buf)) > 0);
+		else if (wait_ms < REMOVE_WAIT_MAX_MS)
+			wait_ms = wait_ms * 2 > REMOVE_WAIT_MAX_MS ? REMOVE_WAIT_MAX_MS : wait_ms * 2;
+
+		r = _dm_open_count(name, &major, &minor);
+	}
+
+	if (pfd.fd >= 0)
+		close(pfd.fd);
+}
+
 int dm_remove_device(struct crypt_device *cd, const char *name, uint32_t flags)
 {
 	struct crypt_dm_active_device dmd = {};
 	int r = -EINVAL;
-	int retries = (flags & CRYPT_DEACTIVATE_FORCE) ? RETRY_COUNT : 1;
+	bool force = flags & CRYPT_DEACTIVATE_FORCE;
 	int deferred = (flags & CRYPT_DEACTIVATE_DEFERRED) ? 1 : 0;
 	int error_target = 0;
 	uint32_t dmt_flags;
+	uint64_t deadline = 0;
 
 	if (!name)
 		return -EINVAL;
@@ -1179,26 +1423,29 @@ int dm_remove_device(struct crypt_device *cd, const char *name, uint32_t flags)
 		return -ENOTSUP;
 	}
 
-	do {
-		r = _dm_remove(name, 1, deferred) ? 0 : -EINVAL;
-		if (--retries && r) {
-			log_dbg(cd, "WARNING: other process locked internal device %s, %s.",
-				name, retries ? "retrying remove" : "giving up");
-			sleep(1);
-			if ((flags & CRYPT_DEACTIVATE_FORCE) && !error_target) {
-				/* If force flag is set, replace device with error, read-only target.
-				 * it should stop processes from reading it and also removed underlying
-				 * device from mapping, so it is usable again.
-				 * Anyway, if some process try to read temporary cryptsetup device,
-				 * it is bug - no other process should try touch it (e.g. udev).
-				 */
-				if (!dm_query_device(cd, name, 0, &dmd)) {
-					_error_device(name, dmd.size);
-					error_target = 1;
-				}
+	if (force)
+		deadline = _dm_time_ms() + crypt_deactivate_timeout(cd);
+
+	while ((r = _dm_remove(name, 1, deferred) ? 0 : -EINVAL) && force &&
+	       _dm_time_ms() < deadline) {
+		log_dbg(cd, "WARNING: other process locked internal device %s, retrying remove.", name);
+		if (!error_target) {
+			/* If force flag is set, replace device with error, read-only target.
+			 * it should stop processes from reading it and also removed underlying
+			 * device from mapping, so it is usable again.
+			 * Anyway, if some process try to read temporary cryptsetup device,
+			 * it is bug - no other process should try touch it (e.g. udev).
+			 */
+			if (!dm_query_device(cd, name, 0, &dmd)) {
+				_error_device(name, dmd.size);
+				error_target = 1;
 			}
 		}
-	} while (r == -EINVAL && retries);
+		_dm_wait_unused(cd, name, deadline);
+	}
+
+	if (r && force)
+		log_dbg(cd, "Device %s is still in use, giving up.", name);
 
 	dm_task_update_nodes();
 	dm_exit_context();
@@ -1264,15 +1511,17 @@ int lookup_dm_dev_by_uuid(struct crypt_device *cd, const char *uuid, const char
 	/* cut of dm name */
 	*c = '\0';
 
-	/* Either udev or sysfs can report that device is active. */
-	r = lookup_by_disk_id(dev_uuid);
+	/*
+	 * Either udev or sysfs can report that device is active.
+	 * Sysfs is checked first, it is served from the device index.
+	 */
+	r = lookup_by_sysfs_uuid_field(dev_uuid + DM_BY_ID_PREFIX_LEN);
 	if (r > 0)
 		return r;
 
-	r_udev = r;
-	r = lookup_by_sysfs_uuid_field(dev_uuid + DM_BY_ID_PREFIX_LEN);
+	r_udev = lookup_by_disk_id(dev_uuid);
 
-	return r == -ENOENT ? r_udev : r;
+	return (r == -ENOENT || r_udev > 0) ? r_udev : r;
 }
 
 static int _add_dm_targets(struct dm_task *dmt, struct crypt_dm_active_device *dmd)
@@ -1283,7 +1532,8 @@ static int _add_dm_targets(struct dm_task *dmt, struct crypt_dm_active_device *d
 	do {
 		switch (tgt->type) {
 		case DM_CRYPT:
-			target = DM_CRYPT_TARGET;
+			target = (dmd->flags & CRYPT_ACTIVATE_INLINE_CRYPT) ?
+				 DM_DEFAULT_KEY_TARGET : DM_CRYPT_TARGET;
 			break;
 		case DM_VERITY:
 			target = DM_VERITY_TARGET;
@@ -1310,23 +1560,40 @@ static int _add_dm_targets(struct dm_task *dmt, struct crypt_dm_active_device *d
 	return 0;
 }
 
+static void _dm_target_params_invalidate(struct dm_target *tgt)
+{
+	crypt_safe_free(tgt->params);
+	tgt->params = NULL;
+	tgt->params_flags = 0;
+}
+
 static void _destroy_dm_targets_params(struct crypt_dm_active_device *dmd)
 {
 	struct dm_target *t = &dmd->segment;
 
 	do {
-		crypt_safe_free(t->params);
-		t->params = NULL;
+		_dm_target_params_invalidate(t);
 		t = t->next;
 	} while (t);
 }
 
+/*
+ * With keep_params, params stay in the targets after table load, so reloading
+ * the same (or partially updated) target list serializes only changed
+ * segments. Cached params are dropped in dm_*_target_set() if any input differs.
+ */
 static int _create_dm_targets_params(struct crypt_dm_active_device *dmd)
 {
 	int r;
 	struct dm_target *tgt = &dmd->segment;
 
 	do {
+		if (tgt->params && tgt->params_flags == dmd->flags) {
+			tgt = tgt->next;
+			continue;
+		}
+		_dm_target_params_invalidate(tgt);
+
 		if (tgt->type == DM_CRYPT)
 			tgt->params = get_dm_crypt_params(tgt, dmd->flags);
 		else if (tgt->type == DM_VERITY)
@@ -1346,6 +1613,7 @@ static int _create_dm_targets_params(struct crypt_dm_active_device *dmd)
 			r = -EINVAL;
 			goto err;
 		}
+		tgt->params_flags = dmd->flags;
 		tgt = tgt->next;
 	} while (tgt);
 
@@ -1362,12 +1630,14 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 	struct dm_info dmi;
 	char dev_uuid[DM_UUID_LEN] = {0};
 	int r = -EINVAL;
-	uint32_t cookie = 0, read_ahead = 0;
+	uint32_t cookie = 0, read_ahead = 0, *pcookie;
 	uint16_t udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
 
 	if (dmd->flags & CRYPT_ACTIVATE_PRIVATE)
 		udev_flags |= CRYPT_TEMP_UDEV_FLAGS;
 
+	pcookie = _dm_udev_cookie(&cookie, dmd->flags & CRYPT_ACTIVATE_PRIVATE);
+
 	/* All devices must have DM_UUID, only resize on old device is exception */
 	if (!dm_prepare_uuid(cd, name, type, dmd->uuid, dev_uuid, sizeof(dev_uuid)))
 		goto out;
@@ -1401,10 +1671,10 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 	    !dm_task_set_read_ahead(dmt, read_ahead, DM_READ_AHEAD_MINIMUM_FLAG))
 		goto out;
 #endif
-	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
+	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, pcookie, udev_flags))
 		goto out;
 
-	if (!dm_task_run(dmt)) {
+	if (!_dm_task_run(dmt, DM_DEVICE_CREATE)) {
 		r = dm_status_device(cd, name);;
 		if (r >= 0)
 			r = -EEXIST;
@@ -1416,7 +1686,7 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 	if (dm_task_get_info(dmt, &dmi))
 		r = 0;
 
-	if (_dm_use_udev()) {
+	if (cookie && _dm_use_udev()) {
 		(void)_dm_udev_wait(cookie);
 		cookie = 0;
 	}
@@ -1436,7 +1706,8 @@ out:
 	/* If code just loaded target module, update versions */
 	_dm_check_versions(cd, dmd->segment.type);
 
-	_destroy_dm_targets_params(dmd);
+	if (!dmd->keep_params)
+		_destroy_dm_targets_params(dmd);
 
 	return r;
 }
@@ -1445,12 +1716,14 @@ static int _dm_resume_device(const char *name, uint32_t dmflags)
 {
 	struct dm_task *dmt;
 	int r = -EINVAL;
-	uint32_t cookie = 0;
+	uint32_t cookie = 0, *pcookie;
 	uint16_t udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
 
 	if (dmflags & DM_RESUME_PRIVATE)
 		udev_flags |= CRYPT_TEMP_UDEV_FLAGS;
 
+	pcookie = _dm_udev_cookie(&cookie, dmflags & DM_RESUME_PRIVATE);
+
 	if (!(dmt = dm_task_create(DM_DEVICE_RESUME)))
 		return r;
 
@@ -1463,10 +1736,10 @@ static int _dm_resume_device(const char *name, uint32_t dmflags)
 	if ((dmflags & DM_SUSPEND_NOFLUSH) && !dm_task_no_flush(dmt))
 		goto out;
 
-	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
+	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, pcookie, udev_flags))
 		goto out;
 
-	if (dm_task_run(dmt))
+	if (_dm_task_run(dmt, DM_DEVICE_RESUME))
 		r = 0;
 out:
 	if (cookie && _dm_use_udev())
@@ -1514,7 +1787,7 @@ static int _dm_reload_device(struct crypt_device *cd, const char *name,
 		goto out;
 #endif
 
-	if (dm_task_run(dmt))
+	if (_dm_task_run(dmt, DM_DEVICE_RELOAD))
 		r = 0;
 out:
 	if (dmt)
@@ -1523,7 +1796,8 @@ out:
 	/* If code just loaded target module, update versions */
 	_dm_check_versions(cd, dmd->segment.type);
 
-	_destroy_dm_targets_params(dmd);
+	if (!dmd->keep_params)
+		_destroy_dm_targets_params(dmd);
 
 	return r;
 }
@@ -1582,6 +1856,8 @@ static void _dm_target_free_query_path(struct crypt_device *cd, struct dm_target
 
 static void _dm_target_erase(struct crypt_device *cd, struct dm_target *tgt)
 {
+	_dm_target_params_invalidate(tgt);
+
 	if (tgt->direction == TARGET_EMPTY)
 		return;
 
@@ -1667,14 +1943,20 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 		     struct crypt_dm_active_device *dmd)
 {
 	uint32_t dmt_flags = 0;
-	int r = -EINVAL;
+	int r = -EINVAL, span;
 
 	if (!type || !dmd)
 		return -EINVAL;
 
+	/* last point where asynchronous activation can be cancelled */
+	r = crypt_async_stage(cd, CRYPT_ASYNC_ACTIVATE);
+	if (r < 0)
+		return r;
+
 	if (dm_init_context(cd, dmd->segment.type))
 		return -ENOTSUP;
 
+	span = crypt_span_begin(cd, "dm_create");
 	r = _dm_create_device(cd, name, type, dmd);
 	if (!r || r == -EEXIST)
 		goto out;
@@ -1764,6 +2046,7 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 		r = -EINVAL;
 	}
 out:
+	crypt_span_end(cd, span);
 	/*
 	 * Print warning if activating dm-crypt cipher_null device unless it's reencryption helper or
 	 * keyslot encryption helper device (LUKS1 cipher_null devices).
@@ -1832,7 +2115,7 @@ static int dm_status_dmi(const char *name, struct dm_info *dmi,
 	if (!dm_task_set_name(dmt, name))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_task_run(dmt, DM_DEVICE_STATUS))
 		goto out;
 
 	if (!dm_task_get_info(dmt, dmi))
@@ -1855,6 +2138,7 @@ static int dm_status_dmi(const char *name, struct dm_info *dmi,
 
 	/* for target == NULL check all supported */
 	if (!target && (strcmp(target_type, DM_CRYPT_TARGET) &&
+			strcmp(target_type, DM_DEFAULT_KEY_TARGET) &&
 			strcmp(target_type, DM_VERITY_TARGET) &&
 			strcmp(target_type, DM_INTEGRITY_TARGET) &&
 			strcmp(target_type, DM_LINEAR_TARGET) &&
@@ -1965,6 +2249,59 @@ int dm_status_integrity_failures(struct crypt_device *cd, const char *name, uint
 	return 0;
 }
 
+/*
+ * Status line is "<mismatches> <provided data sectors> <recalculate sector or ->",
+ * returns 1 if recalculation is in progress.
+ */
+int dm_status_integrity_recalc(struct crypt_device *cd, const char *name,
+			       uint64_t *recalc_sector, uint64_t *data_sectors)
+{
+	int r;
+	struct dm_info dmi;
+	char *status_line = NULL, *p;
+	uint64_t sectors;
+
+	if (dm_init_context(cd, DM_INTEGRITY))
+		return -ENOTSUP;
+
+	r = dm_status_dmi(name, &dmi, DM_INTEGRITY_TARGET, &status_line);
+	if (r < 0 || !status_line) {
+		free(status_line);
+		dm_exit_context();
+		return r;
+	}
+
+	log_dbg(cd, "Integrity volume %s recalculation status is %s.", name, status_line);
+
+	r = -EINVAL;
+	p = status_line;
+	(void)strtoull(p, &p, 10);
+	if (*p != ' ')
+		goto out;
+	sectors = strtoull(p + 1, &p, 10);
+	if (*p != ' ')
+		goto out;
+	p++;
+
+	if (data_sectors)
+		*data_sectors = sectors;
+
+	if (*p == '-') {
+		if (recalc_sector)
+			*recalc_sector = sectors;
+		r = 0;
+	} else if (*p >= '0' && *p <= '9') {
+		if (recalc_sector)
+			*recalc_sector = strtoull(p, NULL, 10);
+		r = 1;
+	}
+out:
+	free(status_line);
+	dm_exit_context();
+
+	return r;
+}
+
 /* FIXME use hex wrapper, user val wrappers for line parsing */
 static int _dm_target_query_crypt(struct crypt_device *cd, uint32_t get_flags,
 				  char *params, struct dm_target *tgt,
@@ -2717,7 +3054,10 @@ static int dm_target_query(struct crypt_device *cd, struct dm_target *tgt, const
 
 	if (!strcmp(target_type, DM_CRYPT_TARGET))
 		r = _dm_target_query_crypt(cd, get_flags, params, tgt, act_flags);
-	else if (!strcmp(target_type, DM_VERITY_TARGET))
+	else if (!strcmp(target_type, DM_DEFAULT_KEY_TARGET)) {
+		r = _dm_target_query_crypt(cd, get_flags, params, tgt, act_flags);
+		*act_flags |= CRYPT_ACTIVATE_INLINE_CRYPT;
+	} else if (!strcmp(target_type, DM_VERITY_TARGET))
 		r = _dm_target_query_verity(cd, get_flags, params, tgt, act_flags);
 	else if (!strcmp(target_type, DM_INTEGRITY_TARGET))
 		r = _dm_target_query_integrity(cd, get_flags, params, tgt, act_flags);
@@ -2757,7 +3097,7 @@ static int _dm_query_device(struct crypt_device *cd, const char *name,
 	if (!dm_task_set_name(dmt, name))
 		goto out;
 	r = -ENODEV;
-	if (!dm_task_run(dmt))
+	if (!_dm_task_run(dmt, DM_DEVICE_TABLE))
 		goto out;
 
 	r = -EINVAL;
@@ -2856,6 +3196,155 @@ int dm_query_device(struct crypt_device *cd, const char *name,
 	return r;
 }
 
+void dm_list_devices_free(struct crypt_active_device_summary *devices, size_t count)
+{
+	size_t i;
+
+	if (!devices)
+		return;
+
+	for (i = 0; i < count; i++) {
+		free(devices[i].name);
+		free(devices[i].uuid);
+		free(devices[i].type);
+		free(devices[i].target);
+	}
+	free(devices);
+}
+
+/* Returns 1 if device matches prefix and summary was filled, 0 if skipped */
+static int _dm_summary(const char *name, const char *uuid_prefix,
+		       struct crypt_active_device_summary *d)
+{
+	struct dm_task *dmt;
+	struct dm_info dmi;
+	uint64_t start, length;
+	char *target_type, *params;
+	const char *uuid, *type, *type_end;
+	void *next = NULL;
+	int r = 0;
+
+	memset(d, 0, sizeof(*d));
+
+	if (!(dmt = dm_task_create(DM_DEVICE_STATUS)))
+		return -EINVAL;
+
+	if (!dm_task_set_name(dmt, name))
+		goto out;
+
+	/* Device removed in the meantime, ignore it */
+	if (!_dm_task_run(dmt, DM_DEVICE_STATUS) || !dm_task_get_info(dmt, &dmi) || !dmi.exists)
+		goto out;
+
+	uuid = dm_task_get_uuid(dmt);
+	if (!uuid || strncmp(uuid, uuid_prefix, strlen(uuid_prefix)))
+		goto out;
+
+	do {
+		next = dm_get_next_target(dmt, next, &start, &length, &target_type, &params);
+		if (!target_type)
+			continue;
+		if (!d->segments++ && !(d->target = strdup(target_type)))
+			goto err;
+		d->size += length;
+	} while (next);
+
+	type = uuid + strlen(uuid_prefix);
+	type_end = strchr(type, '-');
+	if (!(d->name = strdup(name)) || !(d->uuid = strdup(uuid)) ||
+	    !(d->type = strndup(type, type_end ? (size_t)(type_end - type) : strlen(type))))
+		goto err;
+
+	if (dmi.read_only)
+		d->flags |= CRYPT_ACTIVATE_READONLY;
+	if (dmi.suspended)
+		d->flags |= CRYPT_ACTIVATE_SUSPENDED;
+	d->major = dmi.major;
+	d->minor = dmi.minor;
+	d->open_count = dmi.open_count;
+
+	r = 1;
+out:
+	dm_task_destroy(dmt);
+	return r;
+err:
+	free(d->name);
+	free(d->uuid);
+	free(d->type);
+	free(d->target);
+	dm_task_destroy(dmt);
+	return -ENOMEM;
+}
+
+/*
+ * Bulk listing: one DM_DEVICE_LIST and one DM_DEVICE_STATUS (with info)
+ * per device. Name list does not contain UUIDs in older libdevmapper,
+ * so the UUID prefix is matched in the status reply.
+ */
+int dm_list_devices(struct crypt_device *cd, const char *uuid_prefix,
+		    struct crypt_active_device_summary **devices, size_t *count)
+{
+	struct crypt_active_device_summary *list = NULL, *tmp;
+	struct dm_task *dmt = NULL;
+	struct dm_names *names;
+	size_t n = 0, allocated = 0;
+	unsigned next = 0;
+	int r;
+
+	if (!uuid_prefix || !devices || !count)
+		return -EINVAL;
+
+	*devices = NULL;
+	*count = 0;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	r = -EINVAL;
+	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+		goto out;
+
+	if (!_dm_task_run(dmt, DM_DEVICE_LIST) || !(names = dm_task_get_names(dmt)))
+		goto out;
+
+	r = 0;
+	if (!names->dev)
+		goto out;
+
+	do {
+		names = VOIDP_CAST(struct dm_names *)((char *) names + next);
+		if (n == allocated) {
+			allocated = allocated ? 2 * allocated : 16;
+			tmp = realloc(list, allocated * sizeof(*list));
+			if (!tmp) {
+				r = -ENOMEM;
+				goto out;
+			}
+			list = tmp;
+		}
+
+		r = _dm_summary(names->name, uuid_prefix, &list[n]);
+		if (r < 0)
+			goto out;
+		n += r;
+		r = 0;
+		next = names->next;
+	} while (next);
+out:
+	if (r < 0)
+		dm_list_devices_free(list, n);
+	else if (n) {
+		*devices = list;
+		*count = n;
+	} else
+		free(list);
+
+	if (dmt)
+		dm_task_destroy(dmt);
+	dm_exit_context();
+	return r;
+}
+
 static int _process_deps(struct crypt_device *cd, const char *prefix, struct dm_deps *deps,
 			 char **names, size_t names_offset, size_t names_length)
 {
@@ -2925,7 +3414,7 @@ int dm_device_deps(struct crypt_device *cd, const char *name, const char *prefix
 			goto out;
 
 		r = -ENODEV;
-		if (!dm_task_run(dmt))
+		if (!_dm_task_run(dmt, DM_DEVICE_DEPS))
 			goto out;
 
 		r = -EINVAL;
@@ -2964,7 +3453,7 @@ out:
 	return r;
 }
 
-static int _dm_message(const char *name, const char *msg)
+static int _dm_message_sector(const char *name, uint64_t sector, const char *msg)
 {
 	int r = 0;
 	struct dm_task *dmt;
@@ -2978,13 +3467,48 @@ static int _dm_message(const char *name, const char *msg)
 	if (name && !dm_task_set_name(dmt, name))
 		goto out;
 
-	if (!dm_task_set_sector(dmt, (uint64_t) 0))
+	if (!dm_task_set_sector(dmt, sector))
 		goto out;
 
 	if (!dm_task_set_message(dmt, msg))
 		goto out;
 
-	r = dm_task_run(dmt);
+	r = _dm_task_run(dmt, DM_DEVICE_TARGET_MSG);
+out:
+	dm_task_destroy(dmt);
+	return r;
+}
+
+static int _dm_message(const char *name, const char *msg)
+{
+	return _dm_message_sector(name, 0, msg);
+}
+
+/*
+ * Kernel delivers target message only to the target mapping the message
+ * sector, send it to every dm-crypt target (sharded device).
+ */
+static int _dm_crypt_message(const char *name, const char *msg)
+{
+	struct dm_task *dmt;
+	void *next = NULL;
+	uint64_t start, length;
+	char *target_type, *params;
+	int r = 0;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_STATUS)))
+		return 0;
+
+	if (!dm_task_set_name(dmt, name) || !_dm_task_run(dmt, DM_DEVICE_STATUS))
+		goto out;
+
+	do {
+		next = dm_get_next_target(dmt, next, &start, &length, &target_type, &params);
+		if (!target_type || strcmp(target_type, DM_CRYPT_TARGET))
+			continue;
+		if (!(r = _dm_message_sector(name, start, msg)))
+			break;
+	} while (next);
 out:
 	dm_task_destroy(dmt);
 	return r;
@@ -3012,7 +3536,7 @@ int dm_suspend_device(struct crypt_device *cd, const char *name, uint32_t dmflag
 		goto out;
 
 	if (dmflags & DM_SUSPEND_WIPE_KEY) {
-		if (!_dm_message(name, "key wipe")) {
+		if (!_dm_crypt_message(name, "key wipe")) {
 			_dm_resume_device(name, 0);
 			goto out;
 		}
@@ -3024,6 +3548,42 @@ out:
 	return r;
 }
 
+/*
+ * Switch to inactive table of top device and leave lower device suspended:
+ * suspend top, suspend lower, resume top. The stack must be always suspended
+ * from top to bottom. Everything runs in one DM context, so I/O to the top
+ * device is stalled only for the three ioctls.
+ */
+int dm_suspend_lower_and_switch(struct crypt_device *cd, const char *top, const char *lower)
+{
+	uint32_t dmflags = DM_SUSPEND_SKIP_LOCKFS | DM_SUSPEND_NOFLUSH;
+	int r = -EINVAL;
+
+	if (!top || !lower)
+		return -EINVAL;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	if (!_dm_simple(DM_DEVICE_SUSPEND, top, dmflags)) {
+		log_err(cd, _("Failed to suspend device %s."), top);
+		goto out;
+	}
+
+	if (!_dm_simple(DM_DEVICE_SUSPEND, lower, dmflags)) {
+		log_err(cd, _("Failed to suspend device %s."), lower);
+		goto out;
+	}
+
+	/* inactive table (with suspended lower device) -> live */
+	r = _dm_resume_device(top, DM_RESUME_PRIVATE);
+	if (r)
+		log_err(cd, _("Failed to resume device %s."), top);
+out:
+	dm_exit_context();
+	return r;
+}
+
 int dm_resume_device(struct crypt_device *cd, const char *name, uint32_t dmflags)
 {
 	int r;
@@ -3080,7 +3640,7 @@ int dm_resume_and_reinstate_key(struct crypt_device *cd, const char *name,
 		r = -EINVAL;
 		goto out;
 	}
-	if (!_dm_message(name, msg) ||
+	if (!_dm_crypt_message(name, msg) ||
 	    _dm_resume_device(name, 0)) {
 		r = -EINVAL;
 		goto out;
@@ -3098,6 +3658,149 @@ int dm_cancel_deferred_removal(const char *name)
 	return _dm_message(name, "@cancel_deferred_remove") ? 0 : -ENOTSUP;
 }
 
+/*
+ * dm-stats region covering the whole device with latency histogram.
+ * Regions stay in kernel until removed or the device is deactivated,
+ * only regions with our program id are used.
+ */
+#define DM_STATS_PROGRAM_ID	"cryptsetup"
+#define DM_STATS_BOUNDS		"100us,500us,1ms,5ms,10ms,50ms,100ms,500ms"
+
+#if HAVE_DECL_DM_STATS_CREATE
+static int _dm_stats_bind(struct crypt_device *cd, const char *name,
+			  struct dm_stats **dms, uint64_t *region_id)
+{
+	uint64_t region;
+
+	*dms = dm_stats_create(DM_STATS_PROGRAM_ID);
+	if (!*dms)
+		return -ENOMEM;
+
+	if (!dm_stats_bind_name(*dms, name) || !dm_stats_list(*dms, DM_STATS_PROGRAM_ID)) {
+		log_dbg(cd, "Cannot list dm-stats regions of %s.", name);
+		dm_stats_destroy(*dms);
+		*dms = NULL;
+		return -ENOTSUP;
+	}
+
+	crypt_perf_add(NULL, dm_ioctls, 1);
+
+	*region_id = DM_STATS_REGION_NOT_PRESENT;
+	dm_stats_foreach_region(*dms) {
+		region = dm_stats_get_current_region(*dms);
+		if (dm_stats_get_region_nr_histogram_bins(*dms, region)) {
+			*region_id = region;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int dm_io_stats_create(struct crypt_device *cd, const char *name)
+{
+	struct dm_histogram *bounds;
+	struct dm_stats *dms;
+	uint64_t region_id;
+	int r;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	r = _dm_stats_bind(cd, name, &dms, &region_id);
+	if (r < 0 || region_id != DM_STATS_REGION_NOT_PRESENT)
+		goto out;
+
+	bounds = dm_histogram_bounds_from_string(DM_STATS_BOUNDS);
+	if (!bounds) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* whole device, one area, precise (ns) timestamps for histogram */
+	if (!dm_stats_create_region(dms, &region_id, 0, 0, -1, 1, bounds,
+				    DM_STATS_PROGRAM_ID, NULL)) {
+		log_dbg(cd, "Cannot create dm-stats region on %s.", name);
+		r = -ENOTSUP;
+	} else {
+		log_dbg(cd, "Created dm-stats region %" PRIu64 " on %s.", region_id, name);
+		crypt_perf_add(NULL, dm_ioctls, 1);
+	}
+
+	dm_histogram_bounds_destroy(bounds);
+out:
+	if (dms)
+		dm_stats_destroy(dms);
+	dm_exit_context();
+	return r;
+}
+
+int dm_io_stats_query(struct crypt_device *cd, const char *name, struct crypt_io_stats *stats)
+{
+	struct dm_histogram *h;
+	struct dm_stats *dms;
+	uint64_t region_id;
+	int i, r;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	r = _dm_stats_bind(cd, name, &dms, &region_id);
+	if (r < 0)
+		goto out;
+
+	if (region_id == DM_STATS_REGION_NOT_PRESENT) {
+		r = -ENOENT;
+		goto out;
+	}
+
+	if (!dm_stats_populate(dms, DM_STATS_PROGRAM_ID, region_id)) {
+		r = -EINVAL;
+		goto out;
+	}
+	crypt_perf_add(NULL, dm_ioctls, 1);
+
+	stats->reads = dm_stats_get_reads(dms, region_id, 0);
+	stats->writes = dm_stats_get_writes(dms, region_id, 0);
+	stats->read_bytes = dm_stats_get_read_sectors(dms, region_id, 0) << SECTOR_SHIFT;
+	stats->write_bytes = dm_stats_get_write_sectors(dms, region_id, 0) << SECTOR_SHIFT;
+	stats->read_us = dm_stats_get_read_nsecs(dms, region_id, 0) / 1000;
+	stats->write_us = dm_stats_get_write_nsecs(dms, region_id, 0) / 1000;
+	stats->io_us = dm_stats_get_io_nsecs(dms, region_id, 0) / 1000;
+
+	h = dm_stats_get_histogram(dms, region_id, 0);
+	for (i = 0; h && i < dm_histogram_get_nr_bins(h) && i < CRYPT_IO_STATS_BINS; i++) {
+		stats->histogram_upper_us[i] = dm_histogram_get_bin_upper(h, i) / 1000;
+		stats->histogram[i] = dm_histogram_get_bin_count(h, i);
+		stats->histogram_bins++;
+	}
+	/* the last bin has no upper bound */
+	if (stats->histogram_bins)
+		stats->histogram_upper_us[stats->histogram_bins - 1] = UINT64_MAX;
+out:
+	if (dms)
+		dm_stats_destroy(dms);
+	dm_exit_context();
+	return r;
+}
+#else
+int dm_io_stats_create(struct crypt_device *cd, const char *name)
+{
+	log_dbg(cd, "dm-stats not supported by libdevmapper, %s not updated.", name);
+	return -ENOTSUP;
+}
+
+int dm_io_stats_query(struct crypt_device *cd __attribute__((unused)),
+		      const char *name __attribute__((unused)),
+		      struct crypt_io_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	return -ENOTSUP;
+}
+#endif
+
 const char *dm_get_dir(void)
 {
 	return dm_dir();
@@ -3113,6 +3816,43 @@ int dm_is_dm_kernel_name(const char *name)
 	return strncmp(name, "dm-", 3) ? 0 : 1;
 }
 
+static bool _dm_target_same_device(struct device *device1, struct device *device2)
+{
+	if (device1 == device2)
+		return true;
+
+	if (!device1 || !device2)
+		return false;
+
+	return !crypt_strcmp(device_block_path(device1), device_block_path(device2));
+}
+
+/* Drop previous content of target (re)set to another type or parameters */
+static void _dm_target_reset(struct dm_target *tgt)
+{
+	if (tgt->direction == TARGET_SET && tgt->type == DM_CRYPT) {
+		free(CONST_CAST(void*)tgt->u.crypt.integrity);
+		tgt->u.crypt.integrity = NULL;
+	}
+	_dm_target_params_invalidate(tgt);
+}
+
+static bool _dm_crypt_target_same(const struct dm_target *tgt, struct device *data_device,
+	const struct volume_key *vk, const char *cipher, uint64_t iv_offset, uint64_t data_offset,
+	const char *integrity, uint32_t tag_size, uint32_t sector_size)
+{
+	return tgt->params && tgt->direction == TARGET_SET && tgt->type == DM_CRYPT &&
+	       tgt->u.crypt.vk == vk && vk &&
+	       !crypt_strcmp(tgt->u.crypt.vk->key_description, vk->key_description) &&
+	       !crypt_strcmp(tgt->u.crypt.cipher, cipher) &&
+	       !crypt_strcmp(tgt->u.crypt.integrity, tag_size ? (integrity ?: "none") : NULL) &&
+	       tgt->u.crypt.iv_offset == iv_offset &&
+	       tgt->u.crypt.offset == data_offset &&
+	       tgt->u.crypt.tag_size == tag_size &&
+	       tgt->u.crypt.sector_size == sector_size &&
+	       _dm_target_same_device(tgt->data_device, data_device);
+}
+
 int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_size,
 	struct device *data_device, struct volume_key *vk, const char *cipher,
 	uint64_t iv_offset, uint64_t data_offset, const char *integrity, uint32_t tag_size,
@@ -3120,6 +3860,16 @@ int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg
 {
 	char *dm_integrity = NULL;
 
+	/* Table line does not contain segment offset and size, keep cached params */
+	if (_dm_crypt_target_same(tgt, data_device, vk, cipher, iv_offset, data_offset,
+				  integrity, tag_size, sector_size)) {
+		tgt->data_device = data_device;
+		tgt->u.crypt.cipher = cipher;
+		tgt->offset = seg_offset;
+		tgt->size = seg_size;
+		return 0;
+	}
+
 	if (tag_size) {
 		/* Space for IV metadata only */
 		dm_integrity = strdup(integrity ?: "none");
@@ -3127,6 +3877,8 @@ int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg
 			return -ENOMEM;
 	}
 
+	_dm_target_reset(tgt);
+
 	tgt->data_device = data_device;
 
 	tgt->type = DM_CRYPT;
@@ -3145,6 +3897,52 @@ int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg
 	return 0;
 }
 
+/*
+ * Split single dm-crypt target into consecutive targets over the same data
+ * device. Every target is a separate dm-crypt instance with its own
+ * workqueues. IV and data offsets continue where the previous target ends,
+ * so the ciphertext is the same as with one target.
+ */
+int dm_crypt_target_shard(struct dm_target *tgt, unsigned shards)
+{
+	struct dm_target *t;
+	uint64_t align, chunk, offset;
+	int r;
+
+	if (!tgt || tgt->type != DM_CRYPT || tgt->next || tgt->u.crypt.tag_size || !shards)
+		return -EINVAL;
+
+	align = tgt->u.crypt.sector_size >> SECTOR_SHIFT;
+	if (align < DM_CRYPT_SHARD_ALIGN)
+		align = DM_CRYPT_SHARD_ALIGN;
+
+	if (shards > tgt->size / align)
+		shards = tgt->size / align;
+	if (shards < 2)
+		return 0;
+
+	chunk = tgt->size / shards;
+	chunk -= chunk % align;
+
+	r = dm_targets_allocate(tgt, shards);
+	if (r)
+		return r;
+
+	for (t = tgt->next, offset = chunk; t; t = t->next, offset += chunk) {
+		r = dm_crypt_target_set(t, tgt->offset + offset, t->next ? chunk : tgt->size - offset,
+					tgt->data_device, tgt->u.crypt.vk, tgt->u.crypt.cipher,
+					tgt->u.crypt.iv_offset + offset, tgt->u.crypt.offset + offset,
+					NULL, 0, tgt->u.crypt.sector_size);
+		if (r)
+			return r;
+	}
+
+	_dm_target_params_invalidate(tgt);
+	tgt->size = chunk;
+
+	return 0;
+}
+
 int dm_verity_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_size,
 	struct device *data_device, struct device *hash_device, struct device *fec_device,
 	const char *root_hash, uint32_t root_hash_size, const char* root_hash_sig_key_desc,
@@ -3153,6 +3951,8 @@ int dm_verity_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t se
 	if (!data_device || !hash_device || !vp)
 		return -EINVAL;
 
+	_dm_target_reset(tgt);
+
 	tgt->type = DM_VERITY;
 	tgt->direction = TARGET_SET;
 	tgt->offset = seg_offset;
@@ -3187,6 +3987,8 @@ int dm_integrity_target_set(struct crypt_device *cd,
 
 	_dm_check_versions(cd, DM_INTEGRITY);
 
+	_dm_target_reset(tgt);
+
 	tgt->type = DM_INTEGRITY;
 	tgt->direction = TARGET_SET;
 	tgt->offset = seg_offset;
@@ -3236,6 +4038,11 @@ int dm_linear_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t se
 	if (!data_device)
 		return -EINVAL;
 
+	if (!(tgt->params && tgt->direction == TARGET_SET && tgt->type == DM_LINEAR &&
+	      tgt->u.linear.offset == data_offset &&
+	      _dm_target_same_device(tgt->data_device, data_device)))
+		_dm_target_reset(tgt);
+
 	tgt->type = DM_LINEAR;
 	tgt->direction = TARGET_SET;
 	tgt->offset = seg_offset;
@@ -3249,6 +4056,9 @@ int dm_linear_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t se
 
 int dm_zero_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_size)
 {
+	if (!(tgt->direction == TARGET_SET && tgt->type == DM_ZERO))
+		_dm_target_reset(tgt);
+
 	tgt->type = DM_ZERO;
 	tgt->direction = TARGET_SET;
 	tgt->offset = seg_offset;
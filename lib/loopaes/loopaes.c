@@ -52,32 +52,15 @@ static unsigned char get_tweak(unsigned int keys_count)
 	return 0x00;
 }
 
-static int hash_key(const char *src, size_t src_len,
-		    char *dst, size_t dst_len,
-		    const char *hash_name)
-{
-	struct crypt_hash *hd = NULL;
-	int r;
-
-	if (crypt_hash_init(&hd, hash_name))
-		return -EINVAL;
-
-	r = crypt_hash_write(hd, src, src_len);
-	if (!r)
-		r = crypt_hash_final(hd, dst, dst_len);
-
-	crypt_hash_destroy(hd);
-	return r;
-}
-
 static int hash_keys(struct crypt_device *cd,
 		     struct volume_key **vk,
 		     const char *hash_override,
-		     const char **input_keys,
+		     const char * const *input_keys,
 		     unsigned int keys_count,
 		     unsigned int key_len_output,
 		     unsigned int key_len_input)
 {
+	struct crypt_hash *hd = NULL;
 	const char *hash_name;
 	char tweak, *key_ptr;
 	unsigned int i;
@@ -92,20 +75,29 @@ static int hash_keys(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
+	/* one hash context for all keys, crypt_hash_final() resets it */
+	if (crypt_hash_init(&hd, hash_name))
+		return -EINVAL;
+
 	*vk = crypt_alloc_volume_key((size_t)key_len_output * keys_count, NULL);
-	if (!*vk)
+	if (!*vk) {
+		crypt_hash_destroy(hd);
 		return -ENOMEM;
+	}
 
 	for (i = 0; i < keys_count; i++) {
 		key_ptr = &(*vk)->key[i * key_len_output];
-		r = hash_key(input_keys[i], key_len_input, key_ptr,
-			     key_len_output, hash_name);
+		r = crypt_hash_write(hd, input_keys[i], key_len_input);
+		if (!r)
+			r = crypt_hash_final(hd, key_ptr, key_len_output);
 		if (r < 0)
 			break;
 
 		key_ptr[0] ^= tweak;
 	}
 
+	crypt_hash_destroy(hd);
+
 	if (r < 0 && *vk) {
 		crypt_free_volume_key(*vk);
 		*vk = NULL;
@@ -126,14 +118,11 @@ static int keyfile_is_gpg(char *buffer, size_t buffer_len)
 	return r;
 }
 
-int LOOPAES_parse_keyfile(struct crypt_device *cd,
-			  struct volume_key **vk,
-			  const char *hash,
-			  unsigned int *keys_count,
+int LOOPAES_split_keyfile(struct crypt_device *cd,
+			  struct loopaes_keys *keys,
 			  char *buffer,
 			  size_t buffer_len)
 {
-	const char *keys[LOOPAES_KEYS_MAX];
 	unsigned int key_lengths[LOOPAES_KEYS_MAX];
 	unsigned int i, key_index, key_len, offset;
 
@@ -157,7 +146,7 @@ int LOOPAES_parse_keyfile(struct crypt_device *cd,
 	key_index = 0;
 	key_lengths[0] = 0;
 	while (offset < buffer_len && key_index < LOOPAES_KEYS_MAX) {
-		keys[key_index] = &buffer[offset];
+		keys->keys[key_index] = &buffer[offset];
 		key_lengths[key_index] = 0;;
 		while (offset < buffer_len && buffer[offset]) {
 			offset++;
@@ -191,9 +180,36 @@ int LOOPAES_parse_keyfile(struct crypt_device *cd,
 
 	log_dbg(cd, "Keyfile: %d keys of length %d.", key_index, key_len);
 
-	*keys_count = key_index;
-	return hash_keys(cd, vk, hash, keys, key_index,
-			 crypt_get_volume_key_size(cd), key_len);
+	keys->count = key_index;
+	keys->key_len = key_len;
+	return 0;
+}
+
+int LOOPAES_hash_keys(struct crypt_device *cd,
+		      struct volume_key **vk,
+		      const char *hash,
+		      const struct loopaes_keys *keys)
+{
+	return hash_keys(cd, vk, hash, keys->keys, keys->count,
+			 crypt_get_volume_key_size(cd), keys->key_len);
+}
+
+int LOOPAES_parse_keyfile(struct crypt_device *cd,
+			  struct volume_key **vk,
+			  const char *hash,
+			  unsigned int *keys_count,
+			  char *buffer,
+			  size_t buffer_len)
+{
+	struct loopaes_keys keys;
+	int r;
+
+	r = LOOPAES_split_keyfile(cd, &keys, buffer, buffer_len);
+	if (r < 0)
+		return r;
+
+	*keys_count = keys.count;
+	return LOOPAES_hash_keys(cd, vk, hash, &keys);
 }
 
 int LOOPAES_activate(struct crypt_device *cd,
@@ -30,6 +30,23 @@ struct volume_key;
 
 #define LOOPAES_KEYS_MAX 65
 
+/* keys of parsed keyfile, pointing into keyfile buffer */
+struct loopaes_keys {
+	const char *keys[LOOPAES_KEYS_MAX];
+	unsigned int count;
+	unsigned int key_len;
+};
+
+int LOOPAES_split_keyfile(struct crypt_device *cd,
+			  struct loopaes_keys *keys,
+			  char *buffer,
+			  size_t buffer_len);
+
+int LOOPAES_hash_keys(struct crypt_device *cd,
+		      struct volume_key **vk,
+		      const char *hash,
+		      const struct loopaes_keys *keys);
+
 int LOOPAES_parse_keyfile(struct crypt_device *cd,
 			  struct volume_key **vk,
 			  const char *hash,
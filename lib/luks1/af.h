@@ -64,4 +64,17 @@ int LUKS_decrypt_from_storage(
 	unsigned int sector,
 	struct crypt_device *ctx);
 
+int LUKS_read_from_storage(
+	char *dst, size_t dstLength,
+	unsigned int sector,
+	struct crypt_device *ctx);
+
+int LUKS_decrypt_from_buffer(
+	char *dst, size_t dstLength,
+	const char *cipher,
+	const char *cipher_mode,
+	struct volume_key *vk,
+	const char *src,
+	struct crypt_device *ctx);
+
 #endif
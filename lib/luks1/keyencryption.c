@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include "luks.h"
 #include "af.h"
@@ -46,6 +47,36 @@ static void _error_hint(struct crypt_device *ctx, const char *device,
 		log_err(ctx, _("Cipher specification should be in [cipher]-[mode]-[iv] format."));
 }
 
+/*
+ * Read-only keystore mapping is kept in crypt_device and only reloaded with
+ * the next keyslot key and offset, so keyslot trials do not pay device create
+ * and remove (with udev synchronization) every time. LUKS_keystore_drop()
+ * removes it after the trial sequence and in crypt_free().
+ * Lock also serializes concurrent keyslot trials of the process.
+ */
+static pthread_mutex_t keystore_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int keystore_id;
+
+static void keystore_drop(struct crypt_device *ctx)
+{
+	char **name = crypt_keystore_name(ctx);
+
+	if (!*name)
+		return;
+
+	log_dbg(ctx, "Removing reusable keystore device %s.", *name);
+	dm_remove_device(ctx, *name, CRYPT_DEACTIVATE_FORCE);
+	free(*name);
+	*name = NULL;
+}
+
+void LUKS_keystore_drop(struct crypt_device *ctx)
+{
+	pthread_mutex_lock(&keystore_lock);
+	keystore_drop(ctx);
+	pthread_mutex_unlock(&keystore_lock);
+}
+
 static int LUKS_endec_template(char *src, size_t srcLength,
 			       const char *cipher, const char *cipher_mode,
 			       struct volume_key *vk,
@@ -61,6 +92,8 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 	};
 	int r, devfd = -1, remove_dev = 0;
 	size_t bsize, keyslot_alignment, alignment;
+	char **cached = crypt_keystore_name(ctx);
+	bool reuse = (mode == O_RDONLY), active = false;
 
 	log_dbg(ctx, "Using dmcrypt to access keyslot area.");
 
@@ -78,10 +111,6 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 	if (mode == O_RDONLY)
 		dmd.flags |= CRYPT_ACTIVATE_READONLY;
 
-	if (snprintf(name, sizeof(name), "temporary-cryptsetup-%d", getpid()) < 0)
-		return -ENOMEM;
-	if (snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), name) < 0)
-		return -ENOMEM;
 	if (snprintf(cipher_spec, sizeof(cipher_spec), "%s-%s", cipher, cipher_mode) < 0)
 		return -ENOMEM;
 
@@ -102,18 +131,51 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 	r = dm_crypt_target_set(&dmd.segment, 0, dmd.size,
 			crypt_metadata_device(ctx), vk, cipher_spec, 0, sector,
 			NULL, 0, SECTOR_SIZE);
-	if (r)
-		goto out;
+	if (r) {
+		dm_targets_free(ctx, &dmd);
+		return r;
+	}
 
-	r = dm_create_device(ctx, name, "TEMP", &dmd);
-	if (r < 0) {
-		if (r != -EACCES && r != -ENOTSUP)
-			_error_hint(ctx, device_path(crypt_metadata_device(ctx)),
-				    cipher, cipher_mode, vk->keylength * 8);
-		r = -EIO;
+	pthread_mutex_lock(&keystore_lock);
+
+	if (reuse && *cached) {
+		strncpy(name, *cached, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		if (dm_reload_device(ctx, name, &dmd, 0, 1) < 0)
+			keystore_drop(ctx);
+		else
+			active = true;
+	}
+
+	if (!active) {
+		if (reuse)
+			r = snprintf(name, sizeof(name), "temporary-cryptsetup-%d-%u", getpid(), ++keystore_id);
+		else
+			r = snprintf(name, sizeof(name), "temporary-cryptsetup-%d", getpid());
+		if (r < 0) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		r = dm_create_device(ctx, name, "TEMP", &dmd);
+		if (r < 0) {
+			if (r != -EACCES && r != -ENOTSUP)
+				_error_hint(ctx, device_path(crypt_metadata_device(ctx)),
+					    cipher, cipher_mode, vk->keylength * 8);
+			r = -EIO;
+			goto out;
+		}
+
+		if (reuse && (*cached = strdup(name)))
+			log_dbg(ctx, "Keeping keystore device %s for next keyslot.", name);
+		else
+			remove_dev = 1;
+	}
+
+	if (snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), name) < 0) {
+		r = -ENOMEM;
 		goto out;
 	}
-	remove_dev = 1;
 
 	devfd = open(path, mode | O_DIRECT | O_SYNC);
 	if (devfd == -1) {
@@ -134,6 +196,9 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 		close(devfd);
 	if (remove_dev)
 		dm_remove_device(ctx, name, CRYPT_DEACTIVATE_FORCE);
+	else if (r < 0 && reuse)
+		keystore_drop(ctx);
+	pthread_mutex_unlock(&keystore_lock);
 	return r;
 }
 
@@ -266,3 +331,61 @@ int LUKS_decrypt_from_storage(char *dst, size_t dstLength,
 
 	return r;
 }
+
+/* Raw (still encrypted) read of keyslot areas, decrypted later in memory */
+int LUKS_read_from_storage(char *dst, size_t dstLength,
+			   unsigned int sector,
+			   struct crypt_device *ctx)
+{
+	struct device *device = crypt_metadata_device(ctx);
+	int devfd;
+
+	if (MISALIGNED_512(dstLength))
+		return -EINVAL;
+
+	if (device_is_locked(device))
+		devfd = device_open_locked(ctx, device, O_RDONLY);
+	else
+		devfd = device_open(ctx, device, O_RDONLY);
+	if (devfd < 0)
+		return -EIO;
+
+	if (read_lseek_blockwise(devfd, device_block_size(ctx, device),
+				 device_alignment(device), dst, dstLength,
+				 sector * SECTOR_SIZE) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Decrypt keyslot area already read by LUKS_read_from_storage().
+ * Returns -ENOTSUP if userspace crypto cannot be used, caller then
+ * must fallback to LUKS_decrypt_from_storage().
+ */
+int LUKS_decrypt_from_buffer(char *dst, size_t dstLength,
+			     const char *cipher,
+			     const char *cipher_mode,
+			     struct volume_key *vk,
+			     const char *src,
+			     struct crypt_device *ctx)
+{
+	struct crypt_storage *s;
+	int r;
+
+	if (MISALIGNED_512(dstLength))
+		return -EINVAL;
+
+	r = crypt_storage_init(&s, SECTOR_SIZE, cipher, cipher_mode, vk->key, vk->keylength, false);
+	if (r) {
+		log_dbg(ctx, "Userspace crypto wrapper cannot use %s-%s (%d).",
+			cipher, cipher_mode, r);
+		return -ENOTSUP;
+	}
+
+	memcpy(dst, src, dstLength);
+	r = crypt_storage_decrypt(s, 0, dstLength, dst);
+	crypt_storage_destroy(s);
+
+	return r;
+}
@@ -215,14 +215,14 @@ static const char *dbg_slot_state(crypt_keyslot_info ki)
 	}
 }
 
-int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
+/* Backup file content in memory (header and keyslots, page size aligned) */
+int LUKS_hdr_backup_image(struct crypt_device *ctx, char **image, size_t *image_size)
 {
 	struct device *device = crypt_metadata_device(ctx);
 	struct luks_phdr hdr;
-	int fd, devfd, r = 0;
+	int devfd, r = 0;
 	size_t hdr_size;
 	size_t buffer_size;
-	ssize_t ret;
 	char *buffer = NULL;
 
 	r = LUKS_read_phdr(&hdr, 1, 0, ctx);
@@ -232,7 +232,7 @@ int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
 	hdr_size = LUKS_device_sectors(&hdr) << SECTOR_SHIFT;
 	buffer_size = size_round_up(hdr_size, crypt_getpagesize());
 
-	buffer = malloc(buffer_size);
+	buffer = calloc(1, buffer_size);
 	if (!buffer || hdr_size < LUKS_ALIGN_KEYSLOTS || hdr_size > buffer_size) {
 		r = -ENOMEM;
 		goto out;
@@ -260,6 +260,29 @@ int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
 	if (hdr.keyblock[0].keyMaterialOffset * SECTOR_SIZE == LUKS_ALIGN_KEYSLOTS)
 		memset(buffer + sizeof(hdr), 0, LUKS_ALIGN_KEYSLOTS - sizeof(hdr));
 
+	*image = buffer;
+	*image_size = buffer_size;
+	buffer = NULL;
+out:
+	crypt_safe_memzero(&hdr, sizeof(hdr));
+	if (buffer) {
+		crypt_safe_memzero(buffer, buffer_size);
+		free(buffer);
+	}
+	return r;
+}
+
+int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
+{
+	int fd, r;
+	size_t buffer_size;
+	ssize_t ret;
+	char *buffer = NULL;
+
+	r = LUKS_hdr_backup_image(ctx, &buffer, &buffer_size);
+	if (r)
+		return r;
+
 	fd = open(backup_file, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR);
 	if (fd == -1) {
 		if (errno == EEXIST)
@@ -279,7 +302,6 @@ int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
 
 	r = 0;
 out:
-	crypt_safe_memzero(&hdr, sizeof(hdr));
 	crypt_safe_memzero(buffer, buffer_size);
 	free(buffer);
 	return r;
@@ -608,7 +630,7 @@ int LUKS_read_phdr(struct luks_phdr *hdr,
 		   int repair,
 		   struct crypt_device *ctx)
 {
-	int devfd, r = 0;
+	int devfd, r = 0, span;
 	struct device *device = crypt_metadata_device(ctx);
 	ssize_t hdr_size = sizeof(struct luks_phdr);
 
@@ -630,6 +652,7 @@ int LUKS_read_phdr(struct luks_phdr *hdr,
 		return -EINVAL;
 	}
 
+	span = crypt_span_begin(ctx, "header_read");
 	if (read_lseek_blockwise(devfd, device_block_size(ctx, device), device_alignment(device),
 			   hdr, hdr_size, 0) < hdr_size)
 		r = -EIO;
@@ -650,6 +673,9 @@ int LUKS_read_phdr(struct luks_phdr *hdr,
 		device_disable_direct_io(device);
 	}
 
+	crypt_span_end(ctx, span);
+	trace_metadata_read(CRYPT_LUKS1, device_path(device), r);
+	crypt_perf_add(ctx, header_reads, 1);
 	return r;
 }
 
@@ -699,6 +725,8 @@ int LUKS_write_phdr(struct luks_phdr *hdr,
 			    &convHdr, hdr_size, 0) < hdr_size ? -EIO : 0;
 	if (r)
 		log_err(ctx, _("Error during update of LUKS header on device %s."), device_path(device));
+	trace_metadata_write(CRYPT_LUKS1, device_path(device), r);
+	crypt_perf_add(ctx, header_writes, 1);
 
 	device_sync(ctx, device);
 
@@ -720,6 +748,9 @@ int LUKS_check_cipher(struct crypt_device *ctx, size_t keylength, const char *ci
 	struct volume_key *empty_key;
 	char buf[SECTOR_SIZE];
 
+	if (!crypt_cipher_cache_check(ctx, cipher, cipher_mode, NULL, keylength))
+		return 0;
+
 	log_dbg(ctx, "Checking if cipher %s-%s is usable.", cipher, cipher_mode);
 
 	empty_key = crypt_alloc_volume_key(keylength, NULL);
@@ -731,6 +762,9 @@ int LUKS_check_cipher(struct crypt_device *ctx, size_t keylength, const char *ci
 	if (!r)
 		r = LUKS_decrypt_from_storage(buf, sizeof(buf), cipher, cipher_mode, empty_key, 0, ctx);
 
+	if (!r)
+		crypt_cipher_cache_add(ctx, cipher, cipher_mode, NULL, keylength);
+
 	crypt_free_volume_key(empty_key);
 	crypt_safe_memzero(buf, sizeof(buf));
 	return r;
@@ -882,6 +916,7 @@ int LUKS_set_key(unsigned int keyIndex,
 	char *AfKey = NULL;
 	size_t AFEKSize;
 	struct crypt_pbkdf_type *pbkdf;
+	struct crypt_perf_kdf perf;
 	int r;
 
 	if(hdr->keyblock[keyIndex].active != LUKS_KEY_DISABLED) {
@@ -920,10 +955,14 @@ int LUKS_set_key(unsigned int keyIndex,
 	if (r < 0)
 		goto out;
 
+	trace_kdf_start(CRYPT_KDF_PBKDF2, hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	crypt_perf_kdf_begin(ctx, &perf);
 	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
 			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
 			derived_key->key, hdr->keyBytes,
 			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	crypt_perf_kdf_end(ctx, &perf);
+	trace_kdf_end(CRYPT_KDF_PBKDF2, r);
 	if (r < 0)
 		goto out;
 
@@ -990,35 +1029,88 @@ int LUKS_verify_volume_key(const struct luks_phdr *hdr,
 	return 0;
 }
 
+/* Encrypted copy of all active keyslot areas for any-slot trial */
+#define LUKS_KEYSLOT_CACHE_MAX (16 * 1024 * 1024)
+
+struct luks_keyslot_cache {
+	char *buf;
+	unsigned int sector;
+	size_t size;
+};
+
+static void LUKS_keyslot_cache_init(struct luks_phdr *hdr,
+		  struct luks_keyslot_cache *cache,
+		  struct crypt_device *ctx)
+{
+	unsigned int i, active = 0, start = UINT32_MAX, end = 0, area_end;
+
+	memset(cache, 0, sizeof(*cache));
+
+	for (i = 0; i < LUKS_NUMKEYS; i++) {
+		if (LUKS_keyslot_info(hdr, i) < CRYPT_SLOT_ACTIVE)
+			continue;
+		area_end = hdr->keyblock[i].keyMaterialOffset +
+			   AF_split_sectors(hdr->keyBytes, hdr->keyblock[i].stripes);
+		if (hdr->keyblock[i].keyMaterialOffset < start)
+			start = hdr->keyblock[i].keyMaterialOffset;
+		if (area_end > end)
+			end = area_end;
+		active++;
+	}
+
+	/* Single keyslot is read only once anyway */
+	if (active < 2 || ((uint64_t)end - start) * SECTOR_SIZE > LUKS_KEYSLOT_CACHE_MAX)
+		return;
+
+	cache->size = (size_t)(end - start) * SECTOR_SIZE;
+	cache->buf = malloc(cache->size);
+	if (!cache->buf)
+		return;
+	cache->sector = start;
+
+	if (LUKS_read_from_storage(cache->buf, cache->size, start, ctx) < 0) {
+		log_dbg(ctx, "Cannot read keyslot areas in advance.");
+		free(cache->buf);
+		cache->buf = NULL;
+		return;
+	}
+
+	log_dbg(ctx, "Read %u active keyslot areas (%zu bytes) at once.", active, cache->size);
+}
+
+static void LUKS_keyslot_cache_free(struct luks_keyslot_cache *cache)
+{
+	free(cache->buf);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static const char *LUKS_keyslot_cache_get(const struct luks_keyslot_cache *cache,
+		  unsigned int sector, size_t length)
+{
+	if (!cache || !cache->buf || sector < cache->sector ||
+	    (uint64_t)(sector - cache->sector) * SECTOR_SIZE + length > cache->size)
+		return NULL;
+
+	return cache->buf + (size_t)(sector - cache->sector) * SECTOR_SIZE;
+}
+
 /* Try to open a particular key slot */
-static int LUKS_open_key(unsigned int keyIndex,
-		  const char *password,
+static int LUKS_open_key_derived(unsigned int keyIndex,
 		  size_t passwordLen,
+		  struct volume_key *derived_key,
 		  struct luks_phdr *hdr,
 		  struct volume_key **vk,
+		  const struct luks_keyslot_cache *cache,
 		  struct crypt_device *ctx)
 {
-	crypt_keyslot_info ki = LUKS_keyslot_info(hdr, keyIndex);
-	struct volume_key *derived_key;
+	const char *area;
 	char *AfKey = NULL;
 	size_t AFEKSize;
-	int r;
-
-	log_dbg(ctx, "Trying to open key slot %d [%s].", keyIndex,
-		dbg_slot_state(ki));
-
-	if (ki < CRYPT_SLOT_ACTIVE)
-		return -ENOENT;
-
-	derived_key = crypt_alloc_volume_key(hdr->keyBytes, NULL);
-	if (!derived_key)
-		return -ENOMEM;
+	int r = -ENOTSUP;
 
 	*vk = crypt_alloc_volume_key(hdr->keyBytes, NULL);
-	if (!*vk) {
-		r = -ENOMEM;
-		goto out;
-	}
+	if (!*vk)
+		return -ENOMEM;
 
 	AFEKSize = AF_split_sectors(hdr->keyBytes, hdr->keyblock[keyIndex].stripes) * SECTOR_SIZE;
 	AfKey = crypt_safe_alloc(AFEKSize);
@@ -1027,22 +1119,20 @@ static int LUKS_open_key(unsigned int keyIndex,
 		goto out;
 	}
 
-	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
-			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
-			derived_key->key, hdr->keyBytes,
-			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
-	if (r < 0) {
-		log_err(ctx, _("Cannot open keyslot (using hash %s)."), hdr->hashSpec);
-		goto out;
+	area = LUKS_keyslot_cache_get(cache, hdr->keyblock[keyIndex].keyMaterialOffset, AFEKSize);
+	if (area)
+		r = LUKS_decrypt_from_buffer(AfKey, AFEKSize,
+					     hdr->cipherName, hdr->cipherMode,
+					     derived_key, area, ctx);
+	if (r == -ENOTSUP) {
+		log_dbg(ctx, "Reading key slot %d area.", keyIndex);
+		r = LUKS_decrypt_from_storage(AfKey,
+					      AFEKSize,
+					      hdr->cipherName, hdr->cipherMode,
+					      derived_key,
+					      hdr->keyblock[keyIndex].keyMaterialOffset,
+					      ctx);
 	}
-
-	log_dbg(ctx, "Reading key slot %d area.", keyIndex);
-	r = LUKS_decrypt_from_storage(AfKey,
-				      AFEKSize,
-				      hdr->cipherName, hdr->cipherMode,
-				      derived_key,
-				      hdr->keyblock[keyIndex].keyMaterialOffset,
-				      ctx);
 	if (r < 0)
 		goto out;
 
@@ -1061,39 +1151,192 @@ out:
 		*vk = NULL;
 	}
 	crypt_safe_free(AfKey);
+	return r;
+}
+
+static int LUKS_open_key(unsigned int keyIndex,
+		  const char *password,
+		  size_t passwordLen,
+		  struct luks_phdr *hdr,
+		  struct volume_key **vk,
+		  const struct luks_keyslot_cache *cache,
+		  struct crypt_device *ctx)
+{
+	crypt_keyslot_info ki = LUKS_keyslot_info(hdr, keyIndex);
+	struct volume_key *derived_key;
+	struct crypt_perf_kdf perf;
+	int r;
+
+	log_dbg(ctx, "Trying to open key slot %d [%s].", keyIndex,
+		dbg_slot_state(ki));
+
+	if (ki < CRYPT_SLOT_ACTIVE)
+		return -ENOENT;
+
+	derived_key = crypt_alloc_volume_key(hdr->keyBytes, NULL);
+	if (!derived_key)
+		return -ENOMEM;
+
+	trace_kdf_start(CRYPT_KDF_PBKDF2, hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	crypt_perf_kdf_begin(ctx, &perf);
+	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
+			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
+			derived_key->key, hdr->keyBytes,
+			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	crypt_perf_kdf_end(ctx, &perf);
+	trace_kdf_end(CRYPT_KDF_PBKDF2, r);
+	if (r < 0)
+		log_err(ctx, _("Cannot open keyslot (using hash %s)."), hdr->hashSpec);
+	else
+		r = LUKS_open_key_derived(keyIndex, passwordLen, derived_key, hdr, vk, cache, ctx);
+
 	crypt_free_volume_key(derived_key);
 	return r;
 }
 
-int LUKS_open_key_with_hdr(int keyIndex,
+struct luks_trial {
+	struct luks_phdr *hdr;
+	size_t passwordLen;
+	struct volume_key **vk;
+	const struct luks_keyslot_cache *cache;
+};
+
+static int LUKS_trial_verify(struct crypt_device *ctx, struct crypt_kdf_job *job, void *usrptr)
+{
+	struct luks_trial *t = usrptr;
+	int r;
+
+	if (job->r < 0) {
+		log_err(ctx, _("Cannot open keyslot (using hash %s)."), t->hdr->hashSpec);
+		return job->r;
+	}
+
+	r = LUKS_open_key_derived(job->keyslot, t->passwordLen, job->derived_key, t->hdr, t->vk, t->cache, ctx);
+
+	return r < 0 ? r : job->keyslot;
+}
+
+/* All active keyslots share cipher and hash, only salt and iterations differ */
+static int LUKS_open_key_parallel(const char *password,
+		  size_t passwordLen,
+		  struct luks_phdr *hdr,
+		  struct volume_key **vk,
+		  const struct luks_keyslot_cache *cache,
+		  struct crypt_device *ctx)
+{
+	struct luks_trial t = { .hdr = hdr, .passwordLen = passwordLen, .vk = vk, .cache = cache };
+	struct crypt_kdf_job *jobs;
+	unsigned int i, count = 0;
+	int r;
+
+	jobs = calloc(LUKS_NUMKEYS, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	for (i = 0; i < LUKS_NUMKEYS; i++) {
+		if (LUKS_keyslot_info(hdr, i) < CRYPT_SLOT_ACTIVE)
+			continue;
+
+		jobs[count].keyslot = i;
+		jobs[count].pbkdf.type = CRYPT_KDF_PBKDF2;
+		jobs[count].pbkdf.hash = hdr->hashSpec;
+		jobs[count].pbkdf.iterations = hdr->keyblock[i].passwordIterations;
+		jobs[count].salt_len = LUKS_SALTSIZE;
+		jobs[count].salt = malloc(LUKS_SALTSIZE);
+		jobs[count].derived_key = crypt_alloc_volume_key(hdr->keyBytes, NULL);
+		if (!jobs[count].salt || !jobs[count].derived_key) {
+			count++;
+			r = -ENOMEM;
+			goto out;
+		}
+		memcpy(jobs[count].salt, hdr->keyblock[i].passwordSalt, LUKS_SALTSIZE);
+		count++;
+	}
+
+	if (!count) {
+		r = -ENOENT;
+		goto out;
+	}
+
+	log_dbg(ctx, "Trying to open %u key slots in parallel.", count);
+	r = crypt_kdf_parallel_trial(ctx, jobs, count, password, passwordLen,
+				     LUKS_trial_verify, &t);
+out:
+	crypt_kdf_jobs_free(jobs, count);
+	return r;
+}
+
+static int _LUKS_open_key_with_hdr(int keyIndex,
 			   const char *password,
 			   size_t passwordLen,
 			   struct luks_phdr *hdr,
 			   struct volume_key **vk,
 			   struct crypt_device *ctx)
 {
+	struct luks_keyslot_cache cache;
 	unsigned int i, tried = 0;
 	int r;
 
 	if (keyIndex >= 0) {
-		r = LUKS_open_key(keyIndex, password, passwordLen, hdr, vk, ctx);
+		r = LUKS_open_key(keyIndex, password, passwordLen, hdr, vk, NULL, ctx);
 		return (r < 0) ? r : keyIndex;
 	}
 
-	for (i = 0; i < LUKS_NUMKEYS; i++) {
-		r = LUKS_open_key(i, password, passwordLen, hdr, vk, ctx);
+	/* Stale hint only costs one more keyslot trial */
+	r = crypt_keyslot_hint_get(ctx, crypt_keyslot_hint_credential(ctx));
+	if (r >= 0 && r < LUKS_NUMKEYS) {
+		i = r;
+		log_dbg(ctx, "Trying hinted key slot %u first.", i);
+		r = LUKS_open_key(i, password, passwordLen, hdr, vk, NULL, ctx);
 		if (r == 0)
 			return i;
+		if (r == -ENOMEM)
+			return r;
+	}
+
+	/* Wrong keyslots then cost only KDF, decryption and AF merge in memory */
+	LUKS_keyslot_cache_init(hdr, &cache, ctx);
+
+	if (crypt_keyslot_parallel_trial(ctx)) {
+		r = LUKS_open_key_parallel(password, passwordLen, hdr, vk, &cache, ctx);
+		goto out;
+	}
+
+	for (i = 0; i < LUKS_NUMKEYS; i++) {
+		r = LUKS_open_key(i, password, passwordLen, hdr, vk, &cache, ctx);
+		if (r == 0) {
+			r = i;
+			goto out;
+		}
 
 		/* Do not retry for errors that are no -EPERM or -ENOENT,
 		   former meaning password wrong, latter key slot inactive */
 		if ((r != -EPERM) && (r != -ENOENT))
-			return r;
+			goto out;
 		if (r == -EPERM)
 			tried++;
 	}
-	/* Warning, early returns above */
-	return tried ? -EPERM : -ENOENT;
+	r = tried ? -EPERM : -ENOENT;
+out:
+	LUKS_keyslot_cache_free(&cache);
+	return r;
+}
+
+int LUKS_open_key_with_hdr(int keyIndex,
+			   const char *password,
+			   size_t passwordLen,
+			   struct luks_phdr *hdr,
+			   struct volume_key **vk,
+			   struct crypt_device *ctx)
+{
+	int r;
+
+	r = _LUKS_open_key_with_hdr(keyIndex, password, passwordLen, hdr, vk, ctx);
+
+	/* keystore mapping (kernel only keyslot cipher) is reused only within trials */
+	LUKS_keystore_drop(ctx);
+
+	return r;
 }
 
 int LUKS_del_key(unsigned int keyIndex,
@@ -1225,6 +1468,8 @@ int LUKS1_activate(struct crypt_device *cd,
 int LUKS_wipe_header_areas(struct luks_phdr *hdr,
 	struct crypt_device *ctx)
 {
+	struct crypt_wipe_range ranges[LUKS_NUMKEYS];
+	unsigned count = 0;
 	int i, r;
 	uint64_t offset, length;
 	size_t wipe_block;
@@ -1248,7 +1493,7 @@ int LUKS_wipe_header_areas(struct luks_phdr *hdr,
 	if (r < 0)
 		return r;
 
-	/* Wipe keyslots areas */
+	/* Wipe keyslots areas (adjacent areas are merged) */
 	wipe_block = 1024 * 1024;
 	for (i = 0; i < LUKS_NUMKEYS; i++) {
 		r = LUKS_keyslot_area(hdr, i, &offset, &length);
@@ -1266,13 +1511,12 @@ int LUKS_wipe_header_areas(struct luks_phdr *hdr,
 		log_dbg(ctx, "Wiping keyslot %i area (0x%06" PRIx64 " - 0x%06" PRIx64") with random data.",
 			i, offset, length + offset);
 
-		r = crypt_wipe_device(ctx, crypt_metadata_device(ctx), CRYPT_WIPE_RANDOM,
-				offset, length, wipe_block, NULL, NULL);
-		if (r < 0)
-			return r;
+		ranges[count].offset = offset;
+		ranges[count++].length = length;
 	}
 
-	return r;
+	return crypt_wipe_device_ranges(ctx, crypt_metadata_device(ctx), CRYPT_WIPE_RANDOM,
+					ranges, count, wipe_block, NULL, NULL);
 }
 
 int LUKS_keyslot_pbkdf(struct luks_phdr *hdr, int keyslot, struct crypt_pbkdf_type *pbkdf)
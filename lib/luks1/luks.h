@@ -139,6 +139,11 @@ int LUKS_hdr_backup(
 	const char *backup_file,
 	struct crypt_device *ctx);
 
+int LUKS_hdr_backup_image(
+	struct crypt_device *ctx,
+	char **image,
+	size_t *image_size);
+
 int LUKS_hdr_restore(
 	const char *backup_file,
 	struct luks_phdr *hdr,
@@ -164,6 +169,9 @@ int LUKS_open_key_with_hdr(
 	struct volume_key **vk,
 	struct crypt_device *ctx);
 
+/* Remove dm-crypt keystore mapping kept for keyslot trials */
+void LUKS_keystore_drop(struct crypt_device *ctx);
+
 int LUKS_del_key(
 	unsigned int keyIndex,
 	struct luks_phdr *hdr,
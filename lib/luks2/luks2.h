@@ -47,6 +47,7 @@
 #define LUKS2_TOKEN_NAME_MAX 64
 
 #define LUKS2_TOKEN_KEYRING LUKS2_BUILTIN_TOKEN_PREFIX "keyring"
+#define LUKS2_TOKEN_USBKEY LUKS2_BUILTIN_TOKEN_PREFIX "usbkey"
 
 #define LUKS2_DIGEST_MAX 8
 
@@ -62,6 +63,9 @@
 /* 1 GiB */
 #define LUKS2_REENCRYPT_MAX_HOTZONE_LENGTH 0x40000000
 
+/* 1 MiB, lower bound for adaptive hotzone length */
+#define LUKS2_REENCRYPT_MIN_HOTZONE_LENGTH 0x100000
+
 /* supported reencryption requirement versions */
 #define LUKS2_REENCRYPT_REQ_VERSION         UINT8_C(2)
 #define LUKS2_DECRYPT_DATASHIFT_REQ_VERSION UINT8_C(3)
@@ -122,6 +126,12 @@ struct luks2_hdr {
 	char		uuid[LUKS2_UUID_L];
 	void		*jobj;
 	void		*jobj_rollback;
+	void		*index;		/* lookup index over jobj */
+	void		*validated;	/* sections of last validated jobj */
+	char		*tokens_json;	/* not yet parsed tokens section */
+	int		batch;		/* header writes deferred to batch commit */
+	int		batch_dirty;
+	void		*prefetch;	/* background token open, see luks2_token.c */
 };
 
 struct luks2_keyslot_params {
@@ -166,11 +176,15 @@ int LUKS2_hdr_version_unlocked(struct crypt_device *cd,
 	const char *backup_file);
 
 int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair);
+void LUKS2_hdr_cache_enable(int enable);
 int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_write_force(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_rollback(struct crypt_device *cd, struct luks2_hdr *hdr);
+int LUKS2_hdr_batch_begin(struct crypt_device *cd, struct luks2_hdr *hdr);
+int LUKS2_hdr_batch_commit(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_dump(struct crypt_device *cd, struct luks2_hdr *hdr);
-int LUKS2_hdr_dump_json(struct crypt_device *cd, struct luks2_hdr *hdr,	const char **json);
+int LUKS2_hdr_dump_json(struct crypt_device *cd, struct luks2_hdr *hdr,	const char **json,
+	uint32_t flags);
 
 int LUKS2_hdr_uuid(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
@@ -187,6 +201,9 @@ void LUKS2_hdr_free(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_backup(struct crypt_device *cd,
 		     struct luks2_hdr *hdr,
 		     const char *backup_file);
+int LUKS2_hdr_backup_image(struct crypt_device *cd,
+			   struct luks2_hdr *hdr,
+			   char **image, size_t *image_size);
 int LUKS2_hdr_restore(struct crypt_device *cd,
 		      struct luks2_hdr *hdr,
 		      const char *backup_file);
@@ -222,6 +239,14 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 	const struct volume_key *vk,
 	const struct luks2_keyslot_params *params);
 
+int LUKS2_keyslots_rewrap(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	const char * const *passwords,
+	const size_t *password_lens,
+	unsigned count,
+	const struct luks2_keyslot_params *params);
+
 int LUKS2_keyslot_wipe(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -302,6 +327,13 @@ int LUKS2_token_keyring_get(struct luks2_hdr *hdr,
 int LUKS2_token_keyring_json(char *buffer, size_t buffer_size,
 	const struct crypt_token_params_luks2_keyring *keyring_params);
 
+int LUKS2_token_usbkey_get(struct luks2_hdr *hdr,
+	int token,
+	struct crypt_token_params_luks2_usbkey *params);
+
+int LUKS2_token_usbkey_json(char *buffer, size_t buffer_size,
+	const struct crypt_token_params_luks2_usbkey *params);
+
 int LUKS2_token_unlock_passphrase(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
@@ -312,6 +344,14 @@ int LUKS2_token_unlock_passphrase(struct crypt_device *cd,
 	char **passphrase,
 	size_t *passphrase_size);
 
+int LUKS2_token_prefetch(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	const char *type,
+	void *usrptr);
+
+void LUKS2_token_prefetch_free(struct luks2_hdr *hdr);
+
 void crypt_token_unload_external_all(struct crypt_device *cd);
 
 /*
@@ -442,10 +482,14 @@ int LUKS2_volume_key_load_in_keyring_by_digest(struct crypt_device *cd,
 
 int LUKS2_luks1_to_luks2(struct crypt_device *cd,
 			 struct luks_phdr *hdr1,
-			 struct luks2_hdr *hdr2);
+			 struct luks2_hdr *hdr2,
+			 int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+			 void *usrptr);
 int LUKS2_luks2_to_luks1(struct crypt_device *cd,
 			 struct luks2_hdr *hdr2,
-			 struct luks_phdr *hdr1);
+			 struct luks_phdr *hdr1,
+			 int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+			 void *usrptr);
 
 /*
  * LUKS2 reencryption
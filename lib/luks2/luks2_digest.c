@@ -95,6 +95,11 @@ int LUKS2_digest_by_keyslot(struct luks2_hdr *hdr, int keyslot)
 {
 	char keyslot_name[16];
 	json_object *jobj_digests, *jobj_digest_keyslots;
+	int r;
+
+	r = LUKS2_hdr_index_keyslot_digest(hdr, keyslot);
+	if (r != -EAGAIN)
+		return r;
 
 	if (snprintf(keyslot_name, sizeof(keyslot_name), "%u", keyslot) < 1)
 		return -ENOMEM;
@@ -115,13 +120,15 @@ int LUKS2_digest_verify_by_digest(struct crypt_device *cd,
 	const struct volume_key *vk)
 {
 	const digest_handler *h;
-	int r;
+	int r, span;
 
 	h = LUKS2_digest_handler(cd, digest);
 	if (!h)
 		return -EINVAL;
 
+	span = crypt_span_begin(cd, "digest_verify");
 	r = h->verify(cd, digest, vk->key, vk->keylength);
+	crypt_span_end(cd, span);
 	if (r < 0) {
 		log_dbg(cd, "Digest %d (%s) verify failed with %d.", digest, h->name, r);
 		return r;
@@ -182,10 +189,15 @@ int LUKS2_digest_by_segment(struct luks2_hdr *hdr, int segment)
 {
 	char segment_name[16];
 	json_object *jobj_digests, *jobj_digest_segments;
+	int r;
 
 	if (segment == CRYPT_DEFAULT_SEGMENT)
 		segment = LUKS2_get_default_segment(hdr);
 
+	r = LUKS2_hdr_index_segment_digest(hdr, segment);
+	if (r != -EAGAIN)
+		return r;
+
 	json_object_object_get_ex(hdr->jobj, "digests", &jobj_digests);
 
 	if (snprintf(segment_name, sizeof(segment_name), "%u", segment) < 1)
@@ -230,6 +242,7 @@ static int assign_one_digest(struct crypt_device *cd, struct luks2_hdr *hdr,
 		if (jobj1)
 			json_object_object_add(jobj_digest, "keyslots", jobj1);
 	}
+	LUKS2_hdr_index_invalidate(hdr);
 
 	return 0;
 }
@@ -283,6 +296,7 @@ static int assign_all_segments(struct luks2_hdr *hdr, int digest, int assign)
 			return -ENOMEM;
 		json_object_object_add(jobj_digest, "segments", jobj1);
 	}
+	LUKS2_hdr_index_invalidate(hdr);
 
 	return 0;
 }
@@ -315,6 +329,7 @@ static int assign_one_segment(struct crypt_device *cd, struct luks2_hdr *hdr,
 		if (jobj1)
 			json_object_object_add(jobj_digest, "segments", jobj1);
 	}
+	LUKS2_hdr_index_invalidate(hdr);
 
 	return 0;
 }
@@ -381,6 +396,7 @@ void LUKS2_digests_erase_unused(struct crypt_device *cd,
 		if (digest_unused(val)) {
 			log_dbg(cd, "Erasing unused digest %d.", atoi(key));
 			json_object_object_del(jobj_digests, key);
+			LUKS2_hdr_index_invalidate(hdr);
 		}
 	}
 }
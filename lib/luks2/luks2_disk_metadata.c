@@ -20,9 +20,15 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "luks2_internal.h"
 
+/* smaller tokens section is parsed with the rest of JSON metadata */
+#define LUKS2_TOKENS_DEFER_MIN	4096
+
 /*
  * Helper functions
  */
@@ -79,6 +85,17 @@ static int hdr_checksum_calculate(const char *alg, struct luks2_hdr_disk *hdr_di
 	struct crypt_hash *hd = NULL;
 	int hash_size, r;
 
+	/*
+	 * Default checksum is computed in process, without backend hash context
+	 * (with kernel backend it is a socket per header), binary header is block aligned.
+	 */
+	if (!strcmp(alg, "sha256")) {
+		r = crypt_sha256_native_prefix((char*)hdr_disk, LUKS2_HDR_BIN_LEN, json_area,
+					       json_len, (char*)hdr_disk->csum);
+		if (r != -ENOTSUP)
+			return r;
+	}
+
 	hash_size = crypt_hash_size(alg);
 	if (hash_size <= 0 || crypt_hash_init(&hd, alg))
 		return -EINVAL;
@@ -234,14 +251,78 @@ static int hdr_disk_sanity_check_pre(struct crypt_device *cd,
 	return 0;
 }
 
+/*
+ * Calculate and validate checksum and zero it afterwards.
+ */
+static int hdr_json_checksum_check(struct crypt_device *cd, struct luks2_hdr_disk *hdr_disk,
+				   char **json_area, size_t hdr_json_size, uint64_t offset)
+{
+	int r = 0;
+
+	if (hdr_checksum_check(cd, hdr_disk->checksum_alg, hdr_disk,
+				*json_area, hdr_json_size)) {
+		log_dbg(cd, "LUKS2 header checksum error (offset %" PRIu64 ").", offset);
+		free(*json_area);
+		*json_area = NULL;
+		r = -EINVAL;
+	}
+	memset(hdr_disk->csum, 0, LUKS2_CHECKSUM_L);
+
+	return r;
+}
+
 /*
  * Read LUKS2 header from disk at specific offset.
  */
+/*
+ * Split already read LUKS2 header at specific device offset, the buffer
+ * starts at device offset buf_offset.
+ * Returns -EAGAIN if the buffer does not cover whole JSON area.
+ */
+static int hdr_read_buffer(struct crypt_device *cd,
+			   const char *buf, size_t buf_len, uint64_t buf_offset,
+			   struct luks2_hdr_disk *hdr_disk, char **json_area,
+			   uint64_t offset, int secondary)
+{
+	size_t hdr_json_size = 0;
+	uint64_t pos = offset - buf_offset;
+	int r;
+
+	log_dbg(cd, "Checking %s LUKS2 header at offset 0x%" PRIx64 ".",
+		secondary ? "secondary" : "primary", offset);
+
+	if (pos + LUKS2_HDR_BIN_LEN > buf_len)
+		return -EAGAIN;
+
+	memcpy(hdr_disk, &buf[pos], LUKS2_HDR_BIN_LEN);
+
+	r = hdr_disk_sanity_check_pre(cd, hdr_disk, &hdr_json_size, secondary, offset);
+	if (r < 0)
+		return r;
+
+	if (pos + LUKS2_HDR_BIN_LEN + hdr_json_size > buf_len)
+		return -EAGAIN;
+
+	*json_area = malloc(hdr_json_size);
+	if (!*json_area)
+		return -ENOMEM;
+	memcpy(*json_area, &buf[pos + LUKS2_HDR_BIN_LEN], hdr_json_size);
+
+	return hdr_json_checksum_check(cd, hdr_disk, json_area, hdr_json_size, offset);
+}
+
+/*
+ * Read LUKS2 header at specific offset with one speculative read. The size
+ * guess is the default header size for primary header, secondary header
+ * is always located at offset equal to header size. A larger header
+ * reuses the first part and reads only the rest of JSON area.
+ */
 static int hdr_read_disk(struct crypt_device *cd,
 			 struct device *device, struct luks2_hdr_disk *hdr_disk,
 			 char **json_area, uint64_t offset, int secondary)
 {
-	size_t hdr_json_size = 0;
+	size_t len, hdr_size, alignment = device_alignment(device);
+	void *buf = NULL, *buf_new;
 	int devfd, r;
 
 	log_dbg(cd, "Trying to read %s LUKS2 header at offset 0x%" PRIx64 ".",
@@ -251,64 +332,150 @@ static int hdr_read_disk(struct crypt_device *cd,
 	if (devfd < 0)
 		return devfd == -1 ? -EIO : devfd;
 
-	/*
-	 * Read binary header and run sanity check before reading
-	 * JSON area and validating checksum.
-	 */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), hdr_disk,
-				 LUKS2_HDR_BIN_LEN, offset) != LUKS2_HDR_BIN_LEN) {
-		return -EIO;
+	len = secondary && offset <= LUKS2_HDR_OFFSET_MAX ? offset : LUKS2_HDR_16K_LEN;
+	if (len < LUKS2_HDR_16K_LEN)
+		len = LUKS2_HDR_16K_LEN;
+
+	if (posix_memalign(&buf, alignment, len))
+		return -ENOMEM;
+
+	if (device_read_at(cd, device, devfd, buf, len, offset) != (ssize_t)len) {
+		r = -EIO;
+		goto out;
 	}
 
 	/*
-	 * hdr_json_size is validated if this call succeeds
+	 * Binary header sanity check is done before JSON area checksum,
+	 * -EAGAIN means valid hdr_size larger than the guess.
 	 */
-	r = hdr_disk_sanity_check_pre(cd, hdr_disk, &hdr_json_size, secondary, offset);
-	if (r < 0)
-		return r;
+	r = hdr_read_buffer(cd, buf, len, offset, hdr_disk, json_area, offset, secondary);
+	if (r != -EAGAIN)
+		goto out;
+
+	/* hdr_size is validated, it cannot overflow */
+	hdr_size = be64_to_cpu(hdr_disk->hdr_size);
+	log_dbg(cd, "LUKS2 header size 0x%zx is larger than read 0x%zx, reading the rest.",
+		hdr_size, len);
+
+	if (posix_memalign(&buf_new, alignment, hdr_size)) {
+		r = -ENOMEM;
+		goto out;
+	}
+	memcpy(buf_new, buf, len);
+	free(buf);
+	buf = buf_new;
 
-	/*
-	 * Allocate and read JSON area. Always the whole area must be read.
-	 */
-	*json_area = malloc(hdr_json_size);
-	if (!*json_area)
+	if (device_read_at(cd, device, devfd, (char *)buf + len, hdr_size - len,
+			   offset + len) != (ssize_t)(hdr_size - len)) {
+		r = -EIO;
+		goto out;
+	}
+
+	r = hdr_read_buffer(cd, buf, hdr_size, offset, hdr_disk, json_area, offset, secondary);
+out:
+	free(buf);
+	return r;
+}
+
+/*
+ * Read both LUKS2 headers with one read, the secondary header follows
+ * the primary one. The first read covers the default metadata size,
+ * only larger headers need to read the rest of the secondary header.
+ * Returns negative errno if the combined read failed and headers
+ * must be read separately, otherwise *r2 is set only if *r1 is 0.
+ */
+static int hdr_read_disk_both(struct crypt_device *cd, struct device *device,
+			      struct luks2_hdr_disk *hdr_disk1, char **json_area1,
+			      struct luks2_hdr_disk *hdr_disk2, char **json_area2,
+			      int *r1, int *r2)
+{
+	size_t len = 2 * LUKS2_HDR_16K_LEN, hdr_size, alignment = device_alignment(device);
+	void *buf = NULL, *buf_new;
+	int devfd, r;
+
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd < 0)
+		return devfd == -1 ? -EIO : devfd;
+
+	if (posix_memalign(&buf, alignment, len))
 		return -ENOMEM;
 
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), *json_area, hdr_json_size,
-				 offset + LUKS2_HDR_BIN_LEN) != (ssize_t)hdr_json_size) {
-		free(*json_area);
-		*json_area = NULL;
-		return -EIO;
+	if (device_read_at(cd, device, devfd, buf, len, 0) != (ssize_t)len) {
+		r = -EIO;
+		goto out;
 	}
 
-	/*
-	 * Calculate and validate checksum and zero it afterwards.
-	 */
-	if (hdr_checksum_check(cd, hdr_disk->checksum_alg, hdr_disk,
-				*json_area, hdr_json_size)) {
-		log_dbg(cd, "LUKS2 header checksum error (offset %" PRIu64 ").", offset);
-		free(*json_area);
-		*json_area = NULL;
-		r = -EINVAL;
+	*r1 = hdr_read_buffer(cd, buf, len, 0, hdr_disk1, json_area1, 0, 0);
+	if (*r1 == -EAGAIN || (!*r1 && 2 * be64_to_cpu(hdr_disk1->hdr_size) > len)) {
+		/* hdr_size is validated, it cannot overflow */
+		hdr_size = be64_to_cpu(hdr_disk1->hdr_size);
+		if (posix_memalign(&buf_new, alignment, 2 * hdr_size)) {
+			r = -ENOMEM;
+			goto out;
+		}
+		memcpy(buf_new, buf, len);
+		free(buf);
+		buf = buf_new;
+
+		if (device_read_at(cd, device, devfd, (char *)buf + len, 2 * hdr_size - len,
+				   len) != (ssize_t)(2 * hdr_size - len)) {
+			r = -EIO;
+			goto out;
+		}
+		if (*r1 == -EAGAIN)
+			*r1 = hdr_read_buffer(cd, buf, 2 * hdr_size, 0, hdr_disk1, json_area1, 0, 0);
+		len = 2 * hdr_size;
 	}
-	memset(hdr_disk->csum, 0, LUKS2_CHECKSUM_L);
 
+	if (!*r1)
+		*r2 = hdr_read_buffer(cd, buf, len, 0, hdr_disk2, json_area2,
+				      be64_to_cpu(hdr_disk1->hdr_size), 1);
+	r = 0;
+out:
+	if (r < 0) {
+		log_dbg(cd, "Combined read of LUKS2 headers failed, reading headers separately.");
+		free(*json_area1);
+		*json_area1 = NULL;
+	}
+	free(buf);
 	return r;
 }
 
 /*
  * Write LUKS2 header to disk at specific offset.
+ * The buffer contains binary header space followed by JSON area (shared by both
+ * header copies), binary header with checksum is generated and the whole header
+ * is written at once. A torn write is detected by checksum mismatch, the other
+ * header copy is not touched until this one is synced.
  */
-static int hdr_write_disk(struct crypt_device *cd,
+/* Fill binary header of one copy and checksum it, no device access */
+static int hdr_prepare_disk(struct crypt_device *cd, struct luks2_hdr *hdr,
+			    char *hdr_area, int secondary)
+{
+	struct luks2_hdr_disk *hdr_disk = (struct luks2_hdr_disk *)hdr_area;
+	uint64_t offset = secondary ? hdr->hdr_size : 0;
+	int r;
+
+	hdr_to_disk(hdr, hdr_disk, secondary, offset);
+
+	/*
+	 * Calculate checksum over binary header (csum zeroed) and JSON area in one pass.
+	 */
+	r = hdr_checksum_calculate(hdr_disk->checksum_alg, hdr_disk,
+				   hdr_area + LUKS2_HDR_BIN_LEN, hdr->hdr_size - LUKS2_HDR_BIN_LEN);
+	if (r < 0)
+		return r;
+	log_dbg_checksum(cd, hdr_disk->csum, hdr_disk->checksum_alg, "in-memory");
+
+	return 0;
+}
+
+static int hdr_write_disk_prepared(struct crypt_device *cd,
 			  struct device *device, struct luks2_hdr *hdr,
-			  const char *json_area, int secondary)
+			  const char *hdr_area, int secondary)
 {
-	struct luks2_hdr_disk hdr_disk;
 	uint64_t offset = secondary ? hdr->hdr_size : 0;
-	size_t hdr_json_len;
-	int devfd, r;
+	int devfd, r = 0;
 
 	log_dbg(cd, "Trying to write LUKS2 header (%zu bytes) at offset %" PRIu64 ".",
 		hdr->hdr_size, offset);
@@ -317,45 +484,39 @@ static int hdr_write_disk(struct crypt_device *cd,
 	if (devfd < 0)
 		return devfd == -1 ? -EINVAL : devfd;
 
-	hdr_json_len = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
+	if (device_write_at(cd, device, devfd, hdr_area, hdr->hdr_size,
+			    offset) < (ssize_t)hdr->hdr_size)
+		r = -EIO;
 
-	hdr_to_disk(hdr, &hdr_disk, secondary, offset);
+	device_sync(cd, device);
+	return r;
+}
 
-	/*
-	 * Write header without checksum but with proper seqid.
-	 */
-	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
-				  device_alignment(device), (char *)&hdr_disk,
-				  LUKS2_HDR_BIN_LEN, offset) < (ssize_t)LUKS2_HDR_BIN_LEN) {
-		return -EIO;
-	}
+static int hdr_write_disk(struct crypt_device *cd,
+			  struct device *device, struct luks2_hdr *hdr,
+			  char *hdr_area, int secondary)
+{
+	int r = hdr_prepare_disk(cd, hdr, hdr_area, secondary);
 
-	/*
-	 * Write json area.
-	 */
-	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
-				  device_alignment(device),
-				  CONST_CAST(char*)json_area, hdr_json_len,
-				  LUKS2_HDR_BIN_LEN + offset) < (ssize_t)hdr_json_len) {
-		return -EIO;
-	}
+	return r ?: hdr_write_disk_prepared(cd, device, hdr, hdr_area, secondary);
+}
 
-	/*
-	 * Calculate checksum and write header with checksum.
-	 */
-	r = hdr_checksum_calculate(hdr_disk.checksum_alg, &hdr_disk,
-				   json_area, hdr_json_len);
-	if (r < 0) {
-		return r;
-	}
-	log_dbg_checksum(cd, hdr_disk.csum, hdr_disk.checksum_alg, "in-memory");
+/* Write header copy from JSON area read from disk (recovery) */
+static int hdr_write_disk_json(struct crypt_device *cd,
+			       struct device *device, struct luks2_hdr *hdr,
+			       const char *json_area, int secondary)
+{
+	void *hdr_area = NULL;
+	int r;
 
-	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
-				  device_alignment(device), (char *)&hdr_disk,
-				  LUKS2_HDR_BIN_LEN, offset) < (ssize_t)LUKS2_HDR_BIN_LEN)
-		r = -EIO;
+	if (posix_memalign(&hdr_area, device_alignment(device), hdr->hdr_size))
+		return -ENOMEM;
 
-	device_sync(cd, device);
+	memcpy((char *)hdr_area + LUKS2_HDR_BIN_LEN, json_area, hdr->hdr_size - LUKS2_HDR_BIN_LEN);
+
+	r = hdr_write_disk(cd, device, hdr, hdr_area, secondary);
+
+	free(hdr_area);
 	return r;
 }
 
@@ -372,8 +533,7 @@ static int LUKS2_check_sequence_id(struct crypt_device *cd, struct luks2_hdr *hd
 		return devfd == -1 ? -EINVAL : devfd;
 
 	/* we need only first 512 bytes, see luks2_hdr_disk structure */
-	if ((read_lseek_blockwise(devfd, device_block_size(cd, device),
-	     device_alignment(device), &dhdr, 512, 0) != 512))
+	if (device_read_at(cd, device, devfd, &dhdr, 512, 0) != 512)
 		return -EIO;
 
 	/* there's nothing to check if there's no LUKS2 header */
@@ -394,14 +554,19 @@ int LUKS2_device_write_lock(struct crypt_device *cd, struct luks2_hdr *hdr, stru
 		return r;
 	}
 
-	/* run sequence id check only on first write lock (r == 1) and w/o LUKS2 reencryption in-progress */
-	if (r == 1 && !crypt_get_luks2_reencrypt(cd)) {
+	/*
+	 * Run sequence id check w/o LUKS2 reencryption in-progress and only if the seqid
+	 * was not already verified (or written) since the write lock was taken.
+	 */
+	if (r > 0 && !crypt_get_luks2_reencrypt(cd) &&
+	    !device_write_lock_seqid_valid(device, hdr->seqid)) {
 		log_dbg(cd, "Checking context sequence id matches value stored on disk.");
 		if (LUKS2_check_sequence_id(cd, hdr, device)) {
 			device_write_unlock(cd, device);
 			log_err(cd, _("Detected attempt for concurrent LUKS2 metadata update. Aborting operation."));
 			return -EINVAL;
 		}
+		device_write_lock_seqid_set(device, hdr->seqid);
 	}
 
 	return 0;
@@ -413,9 +578,10 @@ int LUKS2_device_write_lock(struct crypt_device *cd, struct luks2_hdr *hdr, stru
  */
 int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device, bool seqid_check)
 {
+	void *hdr_area = NULL, *hdr_area2 = NULL;
 	char *json_area;
 	const char *json_text;
-	size_t json_area_len;
+	size_t json_area_len, json_len;
 	int r;
 
 	if (hdr->version != 2) {
@@ -423,60 +589,96 @@ int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct
 		return -EINVAL;
 	}
 
+	/* deferred tokens must be written back */
+	r = LUKS2_hdr_tokens_load(cd, hdr);
+	if (r)
+		return r;
+
 	r = device_check_size(cd, crypt_metadata_device(cd), LUKS2_hdr_and_areas_size(hdr), 1);
 	if (r)
 		return r;
 
 	/*
-	 * Allocate and zero JSON area (of proper header size).
+	 * Allocate whole aligned header (of proper header size), JSON area
+	 * is zero padded and shared by both header copies.
 	 */
 	json_area_len = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
-	json_area = crypt_zalloc(json_area_len);
-	if (!json_area)
+	if (posix_memalign(&hdr_area, device_alignment(device), hdr->hdr_size))
 		return -ENOMEM;
+	json_area = (char *)hdr_area + LUKS2_HDR_BIN_LEN;
 
 	/*
-	 * Generate text space-efficient JSON representation to json area.
+	 * Generate text space-efficient JSON representation directly to json area.
 	 */
-	json_text = json_object_to_json_string_ext(hdr->jobj,
-			JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
-	if (!json_text || !*json_text) {
-		log_dbg(cd, "Cannot parse JSON object to text representation.");
-		free(json_area);
-		return -ENOMEM;
+	r = LUKS2_json_serialize(hdr->jobj, json_area, json_area_len, &json_len);
+	if (r == -ENOTSUP) {
+		json_text = json_object_to_json_string_ext(hdr->jobj,
+				JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
+		if (!json_text || !*json_text) {
+			log_dbg(cd, "Cannot parse JSON object to text representation.");
+			free(hdr_area);
+			return -ENOMEM;
+		}
+		json_len = strlen(json_text);
+		r = json_len > (json_area_len - 1) ? -ENOSPC : 0;
+		if (!r)
+			memcpy(json_area, json_text, json_len);
 	}
-	if (strlen(json_text) > (json_area_len - 1)) {
-		log_dbg(cd, "JSON is too large (%zu > %zu).", strlen(json_text), json_area_len);
-		free(json_area);
+	if (r == -ENOSPC)
+		log_dbg(cd, "JSON is too large (> %zu).", json_area_len - 1);
+	if (r) {
+		free(hdr_area);
 		return -EINVAL;
 	}
-	strncpy(json_area, json_text, json_area_len);
+	memset(json_area + json_len, 0, json_area_len - json_len);
+
+	/*
+	 * Both copies (with the next sequence id) are checksummed before the write lock
+	 * is taken, so concurrent readers wait only for the writes. If the seqid check
+	 * under the lock fails, the prepared copies are discarded.
+	 */
+	if (posix_memalign(&hdr_area2, device_alignment(device), hdr->hdr_size)) {
+		free(hdr_area);
+		return -ENOMEM;
+	}
+	memcpy((char *)hdr_area2 + LUKS2_HDR_BIN_LEN, json_area, json_area_len);
+
+	hdr->seqid++;
+	r = hdr_prepare_disk(cd, hdr, hdr_area, 0);
+	if (!r)
+		r = hdr_prepare_disk(cd, hdr, hdr_area2, 1);
+	hdr->seqid--;
+	if (r)
+		goto out;
 
 	if (seqid_check)
 		r = LUKS2_device_write_lock(cd, hdr, device);
 	else
 		r = device_write_lock(cd, device);
-	if (r < 0) {
-		free(json_area);
-		return r;
-	}
+	if (r < 0)
+		goto out;
 
 	/* Increase sequence id before writing it to disk. */
 	hdr->seqid++;
 
 	/* Write primary and secondary header */
-	r = hdr_write_disk(cd, device, hdr, json_area, 0);
+	r = hdr_write_disk_prepared(cd, device, hdr, hdr_area, 0);
 	if (!r)
-		r = hdr_write_disk(cd, device, hdr, json_area, 1);
+		r = hdr_write_disk_prepared(cd, device, hdr, hdr_area2, 1);
 
-	if (r)
+	if (r) {
 		log_dbg(cd, "LUKS2 header write failed (%d).", r);
+		device_write_lock_seqid_invalidate(device);
+	} else
+		device_write_lock_seqid_set(device, hdr->seqid);
 
 	device_write_unlock(cd, device);
-
-	free(json_area);
+out:
+	free(hdr_area2);
+	free(hdr_area);
 	return r;
 }
+
 static int validate_json_area(struct crypt_device *cd, const char *json_area,
 			      uint64_t json_len, uint64_t max_length)
 {
@@ -538,14 +740,99 @@ static int validate_luks2_json_object(struct crypt_device *cd, json_object *jobj
 	return r;
 }
 
+/*
+ * Find the top level "tokens" object in JSON text. Only a single plain
+ * (not escaped) "tokens" key is accepted, anything else is parsed as usual.
+ */
+static bool json_find_tokens(const char *json, size_t max_length, size_t *start, size_t *length)
+{
+	bool in_string = false, escape = false, is_key = false, found = false;
+	size_t i, str_start = 0, obj_start = 0;
+	int depth = 0, tokens_depth = 0;
+
+	for (i = 0; i < max_length && json[i]; i++) {
+		if (in_string) {
+			if (escape)
+				escape = false;
+			else if (json[i] == '\\')
+				escape = true;
+			else if (json[i] == '"') {
+				in_string = false;
+				is_key = depth == 1 && i - str_start == 7 &&
+					 !strncmp(&json[str_start], "\"tokens", 7);
+			}
+			continue;
+		}
+
+		switch (json[i]) {
+		case '"':
+			in_string = true;
+			str_start = i;
+			break;
+		case ':':
+			if (!is_key)
+				break;
+			is_key = false;
+			if (found || tokens_depth)
+				return false;
+			while (++i < max_length && isspace((unsigned char)json[i]))
+				;
+			if (i == max_length || json[i] != '{')
+				return false;
+			obj_start = i;
+			tokens_depth = ++depth;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			if (depth == tokens_depth && json[i] == '}') {
+				*start = obj_start;
+				*length = i - obj_start + 1;
+				tokens_depth = 0;
+				found = true;
+			}
+			if (--depth == 0)
+				return found;
+			break;
+		default:
+			if (!isspace((unsigned char)json[i]))
+				is_key = false;
+			break;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Large tokens section (tokens may carry big blobs) is replaced by an empty
+ * object for parsing and validation, its text is returned in tokens_json
+ * and it is parsed and validated later on first access to tokens
+ * (see LUKS2_hdr_tokens_load). JSON area is left unchanged.
+ */
 static json_object *parse_and_validate_json(struct crypt_device *cd,
-					    const char *json_area, uint64_t max_length)
+					    char *json_area, uint64_t max_length,
+					    char **tokens_json)
 {
 	int json_len, r;
-	json_object *jobj = parse_json_len(cd, json_area, max_length, &json_len);
+	size_t tokens_start = 0, tokens_len = 0;
+	char *tokens = NULL;
+	json_object *jobj;
+
+	if (tokens_json && json_area &&
+	    json_find_tokens(json_area, max_length, &tokens_start, &tokens_len) &&
+	    tokens_len >= LUKS2_TOKENS_DEFER_MIN && (tokens = strndup(&json_area[tokens_start], tokens_len))) {
+		memset(&json_area[tokens_start], ' ', tokens_len);
+		json_area[tokens_start] = '{';
+		json_area[tokens_start + 1] = '}';
+	}
 
+	jobj = parse_json_len(cd, json_area, max_length, &json_len);
 	if (!jobj)
-		return NULL;
+		goto out;
 
 	/* successful parse_json_len must not return offset <= 0 */
 	assert(json_len > 0);
@@ -558,10 +845,72 @@ static json_object *parse_and_validate_json(struct crypt_device *cd,
 		json_object_put(jobj);
 		jobj = NULL;
 	}
+out:
+	if (tokens) {
+		/* the area can be used for header recovery */
+		memcpy(&json_area[tokens_start], tokens, tokens_len);
+		if (jobj) {
+			log_dbg(cd, "Deferring load of tokens (%zu bytes).", tokens_len);
+			*tokens_json = tokens;
+		} else
+			free(tokens);
+	}
 
 	return jobj;
 }
 
+struct json_parse_job {
+	struct crypt_device *cd;
+	char *json_area;
+	uint64_t max_length;
+	json_object *jobj;
+	char *tokens_json;
+};
+
+static void *parse_and_validate_json_thread(void *arg)
+{
+	struct json_parse_job *job = arg;
+
+	job->jobj = parse_and_validate_json(job->cd, job->json_area, job->max_length, &job->tokens_json);
+	return NULL;
+}
+
+/*
+ * Parse and validate both JSON areas (NULL area is skipped), secondary area
+ * is processed in another thread if both areas are larger than default
+ * (for the default size thread setup costs more than the parsing itself).
+ */
+static void parse_and_validate_json_both(struct crypt_device *cd,
+					 char *json_area1, uint64_t max_length1,
+					 json_object **jobj1, char **tokens_json1,
+					 char *json_area2, uint64_t max_length2,
+					 json_object **jobj2, char **tokens_json2)
+{
+	struct json_parse_job job = {
+		.cd = cd,
+		.json_area = json_area2,
+		.max_length = max_length2,
+	};
+	struct crypt_thread thread;
+	bool threaded = false;
+
+	if (json_area1 && json_area2 &&
+	    max_length1 > LUKS2_HDR_16K_LEN - LUKS2_HDR_BIN_LEN &&
+	    max_length2 > LUKS2_HDR_16K_LEN - LUKS2_HDR_BIN_LEN)
+		threaded = !crypt_thread_start(&thread, parse_and_validate_json_thread, &job, 0);
+
+	if (json_area1)
+		*jobj1 = parse_and_validate_json(cd, json_area1, max_length1, tokens_json1);
+
+	if (threaded)
+		crypt_thread_join(&thread);
+	else if (json_area2)
+		parse_and_validate_json_thread(&job);
+
+	*jobj2 = job.jobj;
+	*tokens_json2 = job.tokens_json;
+}
+
 static int detect_device_signatures(struct crypt_device *cd, const char *path)
 {
 	blk_probe_status prb_state;
@@ -610,18 +959,210 @@ static int detect_device_signatures(struct crypt_device *cd, const char *path)
 }
 
 /*
- * Read and convert on-disk LUKS2 header to in-memory representation..
- * Try to do recovery if on-disk state is not consistent.
+ * Process-wide cache of parsed metadata for repeated loads of the same device.
+ * Entry is keyed by device (devno, or inode for files) and it is used only if
+ * both binary headers (including seqid and checksum over JSON area) are the
+ * same as when the entry was stored, only the binary headers are read then.
  */
+#define LUKS2_HDR_CACHE_ENTRIES	16
+
+struct hdr_cache_entry {
+	dev_t dev;
+	ino_t ino;
+	unsigned long used;
+	struct luks2_hdr_disk hdr_disk1;
+	struct luks2_hdr_disk hdr_disk2;
+	json_object *jobj;
+	char *tokens_json;
+};
+
+static struct hdr_cache_entry *hdr_cache[LUKS2_HDR_CACHE_ENTRIES];
+static unsigned long hdr_cache_used;
+static bool hdr_cache_enabled;
+static pthread_mutex_t hdr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void hdr_cache_entry_free(struct hdr_cache_entry *e)
+{
+	if (!e)
+		return;
+
+	json_object_put(e->jobj);
+	free(e->tokens_json);
+	free(e);
+}
+
+void LUKS2_hdr_cache_enable(int enable)
+{
+	int i;
+
+	pthread_mutex_lock(&hdr_cache_lock);
+	hdr_cache_enabled = enable ? true : false;
+	if (!hdr_cache_enabled)
+		for (i = 0; i < LUKS2_HDR_CACHE_ENTRIES; i++) {
+			hdr_cache_entry_free(hdr_cache[i]);
+			hdr_cache[i] = NULL;
+		}
+	pthread_mutex_unlock(&hdr_cache_lock);
+}
+
+static bool hdr_cache_key(struct crypt_device *cd, struct device *device, dev_t *dev, ino_t *ino)
+{
+	struct stat st;
+	int devfd;
+
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd < 0 || fstat(devfd, &st) < 0)
+		return false;
+
+	if (S_ISBLK(st.st_mode)) {
+		*dev = st.st_rdev;
+		*ino = 0;
+	} else {
+		*dev = st.st_dev;
+		*ino = st.st_ino;
+	}
+
+	return true;
+}
+
+/* requires hdr_cache_lock */
+static int hdr_cache_find(dev_t dev, ino_t ino)
+{
+	int i;
+
+	for (i = 0; i < LUKS2_HDR_CACHE_ENTRIES; i++)
+		if (hdr_cache[i] && hdr_cache[i]->dev == dev && hdr_cache[i]->ino == ino)
+			return i;
+
+	return -ENOENT;
+}
+
+static bool hdr_cache_is_enabled(void)
+{
+	bool enabled;
+
+	pthread_mutex_lock(&hdr_cache_lock);
+	enabled = hdr_cache_enabled;
+	pthread_mutex_unlock(&hdr_cache_lock);
+
+	return enabled;
+}
+
+static int hdr_cache_get(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device)
+{
+	struct luks2_hdr_disk hdr_disk1, hdr_disk2;
+	json_object *jobj = NULL;
+	char *tokens_json = NULL;
+	dev_t dev;
+	ino_t ino;
+	int devfd, i, r = -ENOENT;
+
+	if (!hdr_cache_is_enabled() || !hdr_cache_key(cd, device, &dev, &ino))
+		return -ENOENT;
+
+	pthread_mutex_lock(&hdr_cache_lock);
+	i = hdr_cache_find(dev, ino);
+	pthread_mutex_unlock(&hdr_cache_lock);
+	if (i < 0)
+		return -ENOENT;
+
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd < 0 ||
+	    device_read_at(cd, device, devfd, &hdr_disk1, LUKS2_HDR_BIN_LEN, 0) != LUKS2_HDR_BIN_LEN ||
+	    memcmp(hdr_disk1.magic, LUKS2_MAGIC_1ST, LUKS2_MAGIC_L) ||
+	    be64_to_cpu(hdr_disk1.hdr_size) < LUKS2_HDR_16K_LEN ||
+	    be64_to_cpu(hdr_disk1.hdr_size) > LUKS2_HDR_OFFSET_MAX ||
+	    device_read_at(cd, device, devfd, &hdr_disk2, LUKS2_HDR_BIN_LEN,
+			   be64_to_cpu(hdr_disk1.hdr_size)) != LUKS2_HDR_BIN_LEN)
+		return -ENOENT;
+
+	pthread_mutex_lock(&hdr_cache_lock);
+	i = hdr_cache_find(dev, ino);
+	if (i >= 0 &&
+	    !memcmp(&hdr_cache[i]->hdr_disk1, &hdr_disk1, LUKS2_HDR_BIN_LEN) &&
+	    !memcmp(&hdr_cache[i]->hdr_disk2, &hdr_disk2, LUKS2_HDR_BIN_LEN) &&
+	    !json_object_copy(hdr_cache[i]->jobj, &jobj) &&
+	    (!hdr_cache[i]->tokens_json || (tokens_json = strdup(hdr_cache[i]->tokens_json)))) {
+		hdr_cache[i]->used = ++hdr_cache_used;
+		r = 0;
+	}
+	pthread_mutex_unlock(&hdr_cache_lock);
+
+	if (!r)
+		r = device_check_size(cd, device, LUKS2_hdr_and_areas_size_jobj(jobj), 0);
+
+	if (r) {
+		json_object_put(jobj);
+		free(tokens_json);
+		return r;
+	}
+
+	log_dbg(cd, "Using cached LUKS2 metadata (seqid %" PRIu64 ").", be64_to_cpu(hdr_disk1.seqid));
+
+	hdr_from_disk(&hdr_disk1, &hdr_disk2, hdr, 0);
+	hdr->jobj = jobj;
+	free(hdr->tokens_json);
+	hdr->tokens_json = tokens_json;
+
+	return 0;
+}
+
+static void hdr_cache_put(struct crypt_device *cd, struct device *device,
+			  struct luks2_hdr_disk *hdr_disk1, struct luks2_hdr_disk *hdr_disk2,
+			  json_object *jobj, const char *tokens_json)
+{
+	struct hdr_cache_entry *e;
+	int i, lru = 0;
+
+	if (!hdr_cache_is_enabled())
+		return;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return;
+
+	if (!hdr_cache_key(cd, device, &e->dev, &e->ino) ||
+	    json_object_copy(jobj, &e->jobj) ||
+	    (tokens_json && !(e->tokens_json = strdup(tokens_json)))) {
+		hdr_cache_entry_free(e);
+		return;
+	}
+
+	memcpy(&e->hdr_disk1, hdr_disk1, LUKS2_HDR_BIN_LEN);
+	memcpy(&e->hdr_disk2, hdr_disk2, LUKS2_HDR_BIN_LEN);
+
+	pthread_mutex_lock(&hdr_cache_lock);
+	if (hdr_cache_enabled) {
+		i = hdr_cache_find(e->dev, e->ino);
+		if (i < 0)
+			for (i = 0; i < LUKS2_HDR_CACHE_ENTRIES; i++) {
+				if (!hdr_cache[i])
+					break;
+				if (hdr_cache[i]->used < hdr_cache[lru]->used)
+					lru = i;
+			}
+		if (i == LUKS2_HDR_CACHE_ENTRIES)
+			i = lru;
+		hdr_cache_entry_free(hdr_cache[i]);
+		e->used = ++hdr_cache_used;
+		hdr_cache[i] = e;
+		e = NULL;
+	}
+	pthread_mutex_unlock(&hdr_cache_lock);
+
+	hdr_cache_entry_free(e);
+}
+
 int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 			struct device *device, int do_recovery, int do_blkprobe)
 {
 	enum { HDR_OK, HDR_OBSOLETE, HDR_FAIL, HDR_FAIL_IO } state_hdr1, state_hdr2;
 	struct luks2_hdr_disk hdr_disk1, hdr_disk2;
 	char *json_area1 = NULL, *json_area2 = NULL;
+	char *tokens_json1 = NULL, *tokens_json2 = NULL;
 	json_object *jobj_hdr1 = NULL, *jobj_hdr2 = NULL;
 	unsigned int i;
-	int r;
+	int r, r1, r2;
 	uint64_t hdr_size;
 	uint64_t hdr2_offsets[] = LUKS2_HDR2_OFFSETS;
 
@@ -631,41 +1172,42 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		log_dbg(cd, "Disabling header auto-recovery due to locking being disabled.");
 	}
 
+	if (!hdr_cache_get(cd, hdr, device))
+		return 0;
+
 	/*
-	 * Read primary LUKS2 header (offset 0).
+	 * Read primary LUKS2 header (offset 0) and secondary header (follows primary).
 	 */
-	state_hdr1 = HDR_FAIL;
-	r = hdr_read_disk(cd, device, &hdr_disk1, &json_area1, 0, 0);
-	if (r == 0) {
-		jobj_hdr1 = parse_and_validate_json(cd, json_area1, be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN);
-		state_hdr1 = jobj_hdr1 ? HDR_OK : HDR_OBSOLETE;
-	} else if (r == -EIO)
-		state_hdr1 = HDR_FAIL_IO;
+	r1 = r2 = -EINVAL;
+	if (hdr_read_disk_both(cd, device, &hdr_disk1, &json_area1, &hdr_disk2, &json_area2, &r1, &r2) < 0) {
+		r1 = hdr_read_disk(cd, device, &hdr_disk1, &json_area1, 0, 0);
+		if (r1 == 0)
+			r2 = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, be64_to_cpu(hdr_disk1.hdr_size), 1);
+	}
 
 	/*
-	 * Read secondary LUKS2 header (follows primary).
+	 * No header size, check all known offsets.
 	 */
-	state_hdr2 = HDR_FAIL;
-	if (state_hdr1 != HDR_FAIL && state_hdr1 != HDR_FAIL_IO) {
-		r = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, be64_to_cpu(hdr_disk1.hdr_size), 1);
-		if (r == 0) {
-			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
-			state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
-		} else if (r == -EIO)
-			state_hdr2 = HDR_FAIL_IO;
-	} else {
-		/*
-		 * No header size, check all known offsets.
-		 */
-		for (r = -EINVAL,i = 0; r < 0 && i < ARRAY_SIZE(hdr2_offsets); i++)
-			r = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, hdr2_offsets[i], 1);
+	if (r1 != 0)
+		for (r2 = -EINVAL, i = 0; r2 < 0 && i < ARRAY_SIZE(hdr2_offsets); i++)
+			r2 = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, hdr2_offsets[i], 1);
+
+	parse_and_validate_json_both(cd, r1 ? NULL : json_area1,
+				     r1 ? 0 : be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN,
+				     &jobj_hdr1, &tokens_json1,
+				     r2 ? NULL : json_area2,
+				     r2 ? 0 : be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN,
+				     &jobj_hdr2, &tokens_json2);
+
+	if (r1 == 0)
+		state_hdr1 = jobj_hdr1 ? HDR_OK : HDR_OBSOLETE;
+	else
+		state_hdr1 = r1 == -EIO ? HDR_FAIL_IO : HDR_FAIL;
 
-		if (r == 0) {
-			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
-			state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
-		} else if (r == -EIO)
-			state_hdr2 = HDR_FAIL_IO;
-	}
+	if (r2 == 0)
+		state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
+	else
+		state_hdr2 = r2 == -EIO ? HDR_FAIL_IO : HDR_FAIL;
 
 	/*
 	 * Check sequence id if both headers are read correctly.
@@ -710,7 +1252,7 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 				log_dbg(cd, "Cannot generate header salt.");
 			else {
 				hdr_from_disk(&hdr_disk1, &hdr_disk2, hdr, 0);
-				r = hdr_write_disk(cd, device, hdr, json_area1, 1);
+				r = hdr_write_disk_json(cd, device, hdr, json_area1, 1);
 			}
 			if (r)
 				log_dbg(cd, "Secondary LUKS2 header recovery failed.");
@@ -731,7 +1273,7 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 				log_dbg(cd, "Cannot generate header salt.");
 			else {
 				hdr_from_disk(&hdr_disk2, &hdr_disk1, hdr, 1);
-				r = hdr_write_disk(cd, device, hdr, json_area2, 0);
+				r = hdr_write_disk_json(cd, device, hdr, json_area2, 0);
 			}
 			if (r)
 				log_dbg(cd, "Primary LUKS2 header recovery failed.");
@@ -750,14 +1292,23 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 	/*
 	 * Even if status is failed, the second header includes salt.
 	 */
+	/* only both valid headers in sync can be validated for the cache later */
+	if (state_hdr1 == HDR_OK && state_hdr2 == HDR_OK)
+		hdr_cache_put(cd, device, &hdr_disk1, &hdr_disk2, jobj_hdr1, tokens_json1);
+
+	free(hdr->tokens_json);
 	if (state_hdr1 == HDR_OK) {
 		hdr_from_disk(&hdr_disk1, &hdr_disk2, hdr, 0);
 		hdr->jobj = jobj_hdr1;
+		hdr->tokens_json = tokens_json1;
 		json_object_put(jobj_hdr2);
+		free(tokens_json2);
 	} else if (state_hdr2 == HDR_OK) {
 		hdr_from_disk(&hdr_disk2, &hdr_disk1, hdr, 1);
 		hdr->jobj = jobj_hdr2;
+		hdr->tokens_json = tokens_json2;
 		json_object_put(jobj_hdr1);
+		free(tokens_json1);
 	}
 
 	/*
@@ -770,6 +1321,8 @@ err:
 
 	free(json_area1);
 	free(json_area2);
+	free(tokens_json1);
+	free(tokens_json2);
 	json_object_put(jobj_hdr1);
 	json_object_put(jobj_hdr2);
 	hdr->jobj = NULL;
@@ -798,8 +1351,7 @@ int LUKS2_hdr_version_unlocked(struct crypt_device *cd, const char *backup_file)
 		flags |= O_DIRECT;
 
 	devfd = open(device_path(device), flags);
-	if (devfd != -1 && (read_lseek_blockwise(devfd, device_block_size(cd, device),
-	     device_alignment(device), &hdr, sizeof(hdr), 0) == sizeof(hdr)) &&
+	if (devfd != -1 && (device_read_at(cd, device, devfd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) &&
 	    !memcmp(hdr.magic, LUKS2_MAGIC_1ST, LUKS2_MAGIC_L))
 		r = (int)be16_to_cpu(hdr.version);
 
@@ -54,6 +54,19 @@ json_object *LUKS2_get_segment_jobj(struct luks2_hdr *hdr, int segment);
 json_object *LUKS2_get_tokens_jobj(struct luks2_hdr *hdr);
 json_object *LUKS2_get_segments_jobj(struct luks2_hdr *hdr);
 
+struct interval {
+	uint64_t offset;
+	uint64_t length;
+};
+
+void LUKS2_hdr_index_invalidate(struct luks2_hdr *hdr);
+int LUKS2_hdr_tokens_load(struct crypt_device *cd, struct luks2_hdr *hdr);
+int LUKS2_hdr_index_keyslot_digest(struct luks2_hdr *hdr, int keyslot);
+int LUKS2_hdr_index_segment_digest(struct luks2_hdr *hdr, int segment);
+int LUKS2_hdr_index_token_keyslots(struct luks2_hdr *hdr, int token, const int8_t **keyslots,
+				   crypt_keyslot_priority *priority);
+int LUKS2_keyslot_areas_sorted(struct luks2_hdr *hdr, struct interval *areas);
+
 void hexprint_base64(struct crypt_device *cd, json_object *jobj,
 		     const char *sep, const char *line_sep);
 
@@ -64,6 +77,7 @@ json_object *crypt_jobj_new_uint64(uint64_t value);
 int json_object_object_add_by_uint(json_object *jobj, unsigned key, json_object *jobj_val);
 void json_object_object_del_by_uint(json_object *jobj, unsigned key);
 int json_object_copy(json_object *jobj_src, json_object **jobj_dst);
+int LUKS2_json_serialize(json_object *jobj, char *buf, size_t buf_size, size_t *json_len);
 
 void JSON_DBG(struct crypt_device *cd, json_object *jobj, const char *desc);
 
@@ -79,6 +93,7 @@ json_object *json_contains_string(struct crypt_device *cd, json_object *jobj,
 				  const char *name, const char *section, const char *key);
 
 int LUKS2_hdr_validate(struct crypt_device *cd, json_object *hdr_jobj, uint64_t json_size);
+int LUKS2_hdr_validate_changed(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_check_json_size(struct crypt_device *cd, const struct luks2_hdr *hdr);
 int LUKS2_token_validate(struct crypt_device *cd, json_object *hdr_jobj,
 			 json_object *jobj_token, const char *key);
@@ -118,6 +133,15 @@ typedef int (*keyslot_wipe_func) (struct crypt_device *cd, int keyslot);
 typedef int (*keyslot_dump_func) (struct crypt_device *cd, int keyslot);
 typedef int (*keyslot_validate_func) (struct crypt_device *cd, json_object *jobj_keyslot);
 typedef void(*keyslot_repair_func) (json_object *jobj_keyslot);
+/* optional, for parallel keyslot trial (see crypt_kdf_parallel_trial) */
+typedef int (*keyslot_kdf_func) (struct crypt_device *cd, int keyslot,
+				  struct crypt_kdf_job *job);
+typedef int (*keyslot_open_derived_func) (struct crypt_device *cd, int keyslot,
+				  struct volume_key *derived_key,
+				  char *volume_key, size_t volume_key_len);
+typedef int (*keyslot_store_derived_func) (struct crypt_device *cd, int keyslot,
+				  struct volume_key *derived_key,
+				  const char *volume_key, size_t volume_key_len);
 
 /* see LUKS2_luks2_to_luks1 */
 int placeholder_keyslot_alloc(struct crypt_device *cd,
@@ -138,6 +162,9 @@ typedef struct  {
 	keyslot_dump_func  dump;
 	keyslot_validate_func validate;
 	keyslot_repair_func repair;
+	keyslot_kdf_func kdf;
+	keyslot_open_derived_func open_derived;
+	keyslot_store_derived_func store_derived;
 } keyslot_handler;
 
 struct reenc_protection {
@@ -160,6 +187,10 @@ struct reenc_protection {
 	struct {
 		uint64_t data_shift;
 	} ds;
+	struct {
+		/* two journal slots in area instead of single hotzone copy */
+		bool ring;
+	} journal;
 	} p;
 };
 
@@ -189,6 +220,16 @@ void keyring_dump(struct crypt_device *cd, const char *json);
 
 int keyring_validate(struct crypt_device *cd, const char *json);
 
+int usbkey_open(struct crypt_device *cd,
+	int token,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr);
+
+void usbkey_dump(struct crypt_device *cd, const char *json);
+
+int usbkey_validate(struct crypt_device *cd, const char *json);
+
 struct crypt_token_handler_v2 {
 	const char *name;
 	crypt_token_open_func open;
@@ -201,6 +242,11 @@ struct crypt_token_handler_v2 {
 	crypt_token_open_pin_func open_pin;
 	crypt_token_version_func version;
 
+	/* asynchronous open, all or none set */
+	crypt_token_open_async_func open_async;
+	crypt_token_open_finish_func open_finish;
+	crypt_token_cancel_func cancel;
+
 	void *dlhandle;
 };
 
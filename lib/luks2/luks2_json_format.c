@@ -23,11 +23,6 @@
 #include <uuid/uuid.h>
 #include <assert.h>
 
-struct area {
-	uint64_t offset;
-	uint64_t length;
-};
-
 static size_t get_area_size(size_t keylength)
 {
 	/* for now it is AF_split_sectors */
@@ -47,58 +42,26 @@ static size_t get_max_offset(struct luks2_hdr *hdr)
 int LUKS2_find_area_max_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			uint64_t *area_offset, uint64_t *area_length)
 {
-	struct area areas[LUKS2_KEYSLOTS_MAX], sorted_areas[LUKS2_KEYSLOTS_MAX+1] = {};
-	int i, j, k, area_i;
-	size_t valid_offset, offset, length;
-
-	/* fill area offset + length table */
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		if (!LUKS2_keyslot_area(hdr, i, &areas[i].offset, &areas[i].length))
-			continue;
-		areas[i].length = 0;
-		areas[i].offset = 0;
-	}
+	struct interval areas[LUKS2_KEYSLOTS_MAX];
+	uint64_t end, offset, valid_offset = 0, length = 0;
+	int i, count;
 
-	/* sort table */
-	k = 0; /* index in sorted table */
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		offset = get_max_offset(hdr) ?: UINT64_MAX;
-		area_i = -1;
-		/* search for the smallest offset in table */
-		for (j = 0; j < LUKS2_KEYSLOTS_MAX; j++)
-			if (areas[j].offset && areas[j].offset <= offset) {
-				area_i = j;
-				offset = areas[j].offset;
-			}
-
-		if (area_i >= 0) {
-			sorted_areas[k].length = areas[area_i].length;
-			sorted_areas[k].offset = areas[area_i].offset;
-			areas[area_i].length = 0;
-			areas[area_i].offset = 0;
-			k++;
-		}
-	}
+	count = LUKS2_keyslot_areas_sorted(hdr, areas);
 
-	sorted_areas[LUKS2_KEYSLOTS_MAX].offset = get_max_offset(hdr);
-	sorted_areas[LUKS2_KEYSLOTS_MAX].length = 1;
-
-	/* search for the gap we can use */
-	length = valid_offset = 0;
+	/* search for the biggest gap, the last one ends at keyslots area end */
 	offset = get_min_offset(hdr);
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX+1; i++) {
-		/* skip empty */
-		if (sorted_areas[i].offset == 0 || sorted_areas[i].length == 0)
-			continue;
+	for (i = 0; i <= count; i++) {
+		end = i < count ? areas[i].offset : get_max_offset(hdr);
 
 		/* found bigger gap than the last one */
-		if ((offset < sorted_areas[i].offset) && (sorted_areas[i].offset - offset) > length) {
-			length = sorted_areas[i].offset - offset;
+		if (offset < end && (end - offset) > length) {
+			length = end - offset;
 			valid_offset = offset;
 		}
 
 		/* move beyond allocated area */
-		offset = sorted_areas[i].offset + sorted_areas[i].length;
+		if (i < count && areas[i].offset + areas[i].length > offset)
+			offset = areas[i].offset + areas[i].length;
 	}
 
 	/* this search 'algorithm' does not work with unaligned areas */
@@ -110,7 +73,7 @@ int LUKS2_find_area_max_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 		return -EINVAL;
 	}
 
-	log_dbg(cd, "Found largest free area %zu -> %zu", valid_offset, length + valid_offset);
+	log_dbg(cd, "Found largest free area %" PRIu64 " -> %" PRIu64, valid_offset, length + valid_offset);
 
 	*area_offset = valid_offset;
 	*area_length = length;
@@ -118,67 +81,43 @@ int LUKS2_find_area_max_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 	return 0;
 }
 
+/*
+ * Best fit: the smallest gap the area fits in (the lowest offset of equal gaps),
+ * so a gap left by a wiped keyslot is reused before the free space is split.
+ */
 int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			size_t keylength, uint64_t *area_offset, uint64_t *area_length)
 {
-	struct area areas[LUKS2_KEYSLOTS_MAX], sorted_areas[LUKS2_KEYSLOTS_MAX] = {};
-	int i, j, k, area_i;
-	size_t offset, length;
-
-	/* fill area offset + length table */
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		if (!LUKS2_keyslot_area(hdr, i, &areas[i].offset, &areas[i].length))
-			continue;
-		areas[i].length = 0;
-		areas[i].offset = 0;
-	}
+	struct interval areas[LUKS2_KEYSLOTS_MAX];
+	uint64_t end, offset, length, best_offset = 0, best_gap = UINT64_MAX;
+	int i, count;
 
-	/* sort table */
-	k = 0; /* index in sorted table */
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		offset = get_max_offset(hdr) ?: UINT64_MAX;
-		area_i = -1;
-		/* search for the smallest offset in table */
-		for (j = 0; j < LUKS2_KEYSLOTS_MAX; j++)
-			if (areas[j].offset && areas[j].offset <= offset) {
-				area_i = j;
-				offset = areas[j].offset;
-			}
-
-		if (area_i >= 0) {
-			sorted_areas[k].length = areas[area_i].length;
-			sorted_areas[k].offset = areas[area_i].offset;
-			areas[area_i].length = 0;
-			areas[area_i].offset = 0;
-			k++;
-		}
-	}
+	count = LUKS2_keyslot_areas_sorted(hdr, areas);
 
-	/* search for the gap we can use */
 	offset = get_min_offset(hdr);
 	length = get_area_size(keylength);
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		/* skip empty */
-		if (sorted_areas[i].offset == 0 || sorted_areas[i].length == 0)
-			continue;
-
-		/* enough space before the used area */
-		if ((offset < sorted_areas[i].offset) && ((offset + length) <= sorted_areas[i].offset))
-			break;
+	for (i = 0; i <= count; i++) {
+		end = i < count ? areas[i].offset : get_max_offset(hdr);
 
 		/* both offset and length are already aligned to 4096 bytes */
-		offset = sorted_areas[i].offset + sorted_areas[i].length;
+		if (offset < end && (end - offset) >= length && (end - offset) < best_gap) {
+			best_gap = end - offset;
+			best_offset = offset;
+		}
+
+		if (i < count && areas[i].offset + areas[i].length > offset)
+			offset = areas[i].offset + areas[i].length;
 	}
 
-	if ((offset + length) > get_max_offset(hdr)) {
+	if (best_gap == UINT64_MAX) {
 		log_dbg(cd, "Not enough space in header keyslot area.");
 		return -EINVAL;
 	}
 
-	log_dbg(cd, "Found area %zu -> %zu", offset, length + offset);
+	log_dbg(cd, "Found area %" PRIu64 " -> %" PRIu64, best_offset, length + best_offset);
 
 	if (area_offset)
-		*area_offset = offset;
+		*area_offset = best_offset;
 	if (area_length)
 		*area_length = length;
 
@@ -299,6 +238,7 @@ int LUKS2_generate_hdr(
 	if (r < 0 || (size_t)r >= sizeof(cipher))
 		return -EINVAL;
 
+	LUKS2_hdr_index_invalidate(hdr);
 	hdr->jobj = json_object_new_object();
 
 	jobj_keyslots = json_object_new_object();
@@ -330,6 +270,7 @@ int LUKS2_generate_hdr(
 	}
 
 	json_object_object_add_by_uint(jobj_segments, 0, jobj_segment);
+	LUKS2_hdr_index_invalidate(hdr);
 
 	json_object_object_add(jobj_config, "json_size", crypt_jobj_new_uint64(metadata_size - LUKS2_HDR_BIN_LEN));
 	json_object_object_add(jobj_config, "keyslots_size", crypt_jobj_new_uint64(keyslots_size));
@@ -337,6 +278,7 @@ int LUKS2_generate_hdr(
 	JSON_DBG(cd, hdr->jobj, "Header JSON:");
 	return 0;
 err:
+	LUKS2_hdr_index_invalidate(hdr);
 	json_object_put(hdr->jobj);
 	hdr->jobj = NULL;
 	return -EINVAL;
@@ -354,7 +296,7 @@ int LUKS2_wipe_header_areas(struct crypt_device *cd,
 	length = LUKS2_get_data_offset(hdr) * SECTOR_SIZE;
 	wipe_block = 1024 * 1024;
 
-	if (LUKS2_hdr_validate(cd, hdr->jobj, hdr->hdr_size - LUKS2_HDR_BIN_LEN))
+	if (LUKS2_hdr_validate_changed(cd, hdr))
 		return -EINVAL;
 
 	/* On detached header wipe at least the first 4k */
@@ -28,28 +28,39 @@
 
 #define LUKS_STRIPES 4000
 
-struct interval {
-	uint64_t offset;
-	uint64_t length;
-};
-
 void hexprint_base64(struct crypt_device *cd, json_object *jobj,
 		     const char *sep, const char *line_sep)
 {
-	char *buf = NULL;
-	size_t buf_len;
+	static const char hex[] = "0123456789abcdef";
+	char *buf = NULL, *line, *p;
+	size_t buf_len, sep_len = strlen(sep);
 	unsigned int i;
 
 	if (crypt_base64_decode(&buf, &buf_len, json_object_get_string(jobj),
 				json_object_get_string_len(jobj)))
 		return;
 
-	for (i = 0; i < buf_len; i++) {
-		if (i && !(i % 16))
-			log_std(cd, "\n\t%s", line_sep);
-		log_std(cd, "%02hhx%s", buf[i], sep);
+	/* Print one line (16 bytes) per log call */
+	line = malloc(16 * (2 + sep_len) + 1);
+	if (!line) {
+		free(buf);
+		return;
 	}
-	log_std(cd, "\n");
+
+	for (i = 0, p = line; i < buf_len; i++) {
+		if (i && !(i % 16)) {
+			*p = '\0';
+			log_std(cd, "%s\n\t%s", line, line_sep);
+			p = line;
+		}
+		*p++ = hex[(unsigned char)buf[i] >> 4];
+		*p++ = hex[(unsigned char)buf[i] & 15];
+		memcpy(p, sep, sep_len);
+		p += sep_len;
+	}
+	*p = '\0';
+	log_std(cd, "%s\n", line);
+	free(line);
 	free(buf);
 }
 
@@ -98,17 +109,334 @@ struct json_object *LUKS2_array_remove(struct json_object *array, const char *nu
 	return array_new;
 }
 
+/*
+ * In-memory index of header objects by id, with keyslot and segment
+ * to digest references resolved. It is built on first lookup and must be
+ * invalidated (LUKS2_hdr_index_invalidate) whenever any keyslot, token,
+ * digest or segment is added or removed, digest or token assignment
+ * or keyslot priority changes.
+ * Indexed objects are referenced, so stale index cannot point to freed memory.
+ */
+struct luks2_hdr_index {
+	json_object *jobj_hdr;
+	bool usable;	/* all ids fit, otherwise lookups use json directly */
+	json_object *keyslots[LUKS2_KEYSLOTS_MAX];
+	json_object *tokens[LUKS2_TOKENS_MAX];
+	json_object *digests[LUKS2_DIGEST_MAX];
+	json_object *segments[LUKS2_SEGMENT_MAX];
+	int8_t keyslot_digest[LUKS2_KEYSLOTS_MAX];
+	int8_t segment_digest[LUKS2_SEGMENT_MAX];
+	struct interval areas[LUKS2_KEYSLOTS_MAX];	/* sorted by offset */
+	int areas_count;				/* -1 until first use */
+	/* token keyslots resolved on first token unlock, count -1 if unusable */
+	bool tokens_resolved;
+	int8_t token_keyslots[LUKS2_TOKENS_MAX][LUKS2_KEYSLOTS_MAX];
+	int8_t token_keyslots_count[LUKS2_TOKENS_MAX];
+	int8_t token_priority[LUKS2_TOKENS_MAX];	/* highest keyslot priority */
+};
+
+/* id must be the same string as snprintf("%u") produces */
+static int hdr_index_id(const char *key, int max)
+{
+	int id = 0;
+
+	if (!key || !*key || (key[0] == '0' && key[1]))
+		return -1;
+
+	for (; *key; key++) {
+		if (!isdigit((unsigned char)*key))
+			return -1;
+		id = id * 10 + (*key - '0');
+		if (id >= max)
+			return -1;
+	}
+
+	return id;
+}
+
+static bool hdr_index_fill(json_object *jobj_hdr, const char *section,
+			   json_object **table, int max)
+{
+	json_object *jobj_section;
+	int id;
+
+	if (!json_object_object_get_ex(jobj_hdr, section, &jobj_section))
+		return true;
+
+	if (!json_object_is_type(jobj_section, json_type_object))
+		return false;
+
+	json_object_object_foreach(jobj_section, key, val) {
+		id = hdr_index_id(key, max);
+		if (id < 0 || table[id])
+			return false;
+		table[id] = json_object_get(val);
+	}
+
+	return true;
+}
+
+/* first digest in json order wins, as in the json lookup */
+static bool hdr_index_refs(json_object *jobj_digest, const char *array, int digest,
+			   int8_t *table, int max)
+{
+	json_object *jobj_array;
+	int i, id, len;
+
+	if (!json_object_object_get_ex(jobj_digest, array, &jobj_array))
+		return true;
+
+	if (!json_object_is_type(jobj_array, json_type_array))
+		return false;
+
+	len = (int) json_object_array_length(jobj_array);
+	for (i = 0; i < len; i++) {
+		id = hdr_index_id(json_object_get_string(json_object_array_get_idx(jobj_array, i)), max);
+		if (id < 0)
+			return false;
+		if (table[id] < 0)
+			table[id] = digest;
+	}
+
+	return true;
+}
+
+static void hdr_index_free(struct luks2_hdr_index *idx)
+{
+	int i;
+
+	if (!idx)
+		return;
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+		json_object_put(idx->keyslots[i]);
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++)
+		json_object_put(idx->tokens[i]);
+	for (i = 0; i < LUKS2_DIGEST_MAX; i++)
+		json_object_put(idx->digests[i]);
+	for (i = 0; i < LUKS2_SEGMENT_MAX; i++)
+		json_object_put(idx->segments[i]);
+	free(idx);
+}
+
+void LUKS2_hdr_index_invalidate(struct luks2_hdr *hdr)
+{
+	if (!hdr)
+		return;
+
+	hdr_index_free(hdr->index);
+	hdr->index = NULL;
+}
+
+static struct luks2_hdr_index *hdr_index_build(json_object *jobj_hdr)
+{
+	struct luks2_hdr_index *idx;
+	json_object *jobj_digests;
+	int digest;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		return NULL;
+
+	idx->jobj_hdr = jobj_hdr;
+	idx->areas_count = -1;
+	memset(idx->keyslot_digest, -1, sizeof(idx->keyslot_digest));
+	memset(idx->segment_digest, -1, sizeof(idx->segment_digest));
+
+	if (!hdr_index_fill(jobj_hdr, "keyslots", idx->keyslots, LUKS2_KEYSLOTS_MAX) ||
+	    !hdr_index_fill(jobj_hdr, "tokens", idx->tokens, LUKS2_TOKENS_MAX) ||
+	    !hdr_index_fill(jobj_hdr, "digests", idx->digests, LUKS2_DIGEST_MAX) ||
+	    !hdr_index_fill(jobj_hdr, "segments", idx->segments, LUKS2_SEGMENT_MAX))
+		return idx;
+
+	if (json_object_object_get_ex(jobj_hdr, "digests", &jobj_digests)) {
+		json_object_object_foreach(jobj_digests, key, val) {
+			digest = hdr_index_id(key, LUKS2_DIGEST_MAX);
+			if (!hdr_index_refs(val, "keyslots", digest, idx->keyslot_digest, LUKS2_KEYSLOTS_MAX) ||
+			    !hdr_index_refs(val, "segments", digest, idx->segment_digest, LUKS2_SEGMENT_MAX))
+				return idx;
+		}
+	}
+
+	idx->usable = true;
+	return idx;
+}
+
+/* NULL means the index cannot be used and json must be searched */
+static struct luks2_hdr_index *hdr_index(struct luks2_hdr *hdr)
+{
+	struct luks2_hdr_index *idx = hdr->index;
+
+	if (!hdr->jobj)
+		return NULL;
+
+	if (!idx || idx->jobj_hdr != hdr->jobj) {
+		LUKS2_hdr_index_invalidate(hdr);
+		idx = hdr->index = hdr_index_build(hdr->jobj);
+	}
+
+	return idx && idx->usable ? idx : NULL;
+}
+
+/* Returns -ENOENT if not assigned, -EAGAIN if index cannot be used */
+int LUKS2_hdr_index_keyslot_digest(struct luks2_hdr *hdr, int keyslot)
+{
+	struct luks2_hdr_index *idx = hdr ? hdr_index(hdr) : NULL;
+
+	if (!idx)
+		return -EAGAIN;
+
+	if (keyslot < 0 || keyslot >= LUKS2_KEYSLOTS_MAX || idx->keyslot_digest[keyslot] < 0)
+		return -ENOENT;
+
+	return idx->keyslot_digest[keyslot];
+}
+
+int LUKS2_hdr_index_segment_digest(struct luks2_hdr *hdr, int segment)
+{
+	struct luks2_hdr_index *idx = hdr ? hdr_index(hdr) : NULL;
+
+	if (!idx)
+		return -EAGAIN;
+
+	if (segment < 0 || segment >= LUKS2_SEGMENT_MAX || idx->segment_digest[segment] < 0)
+		return -ENOENT;
+
+	return idx->segment_digest[segment];
+}
+
+static void hdr_index_tokens_resolve(struct luks2_hdr *hdr, struct luks2_hdr_index *idx)
+{
+	crypt_keyslot_priority priority;
+	json_object *jobj_array;
+	int i, j, id, len;
+
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		idx->token_keyslots_count[i] = -1;
+		idx->token_priority[i] = CRYPT_SLOT_PRIORITY_INVALID;
+
+		if (!idx->tokens[i] ||
+		    !json_object_object_get_ex(idx->tokens[i], "keyslots", &jobj_array) ||
+		    !json_object_is_type(jobj_array, json_type_array))
+			continue;
+
+		len = (int) json_object_array_length(jobj_array);
+		if (len > LUKS2_KEYSLOTS_MAX)
+			continue;
+
+		for (j = 0; j < len; j++) {
+			id = hdr_index_id(json_object_get_string(json_object_array_get_idx(jobj_array, j)),
+					  LUKS2_KEYSLOTS_MAX);
+			if (id < 0)
+				break;
+			idx->token_keyslots[i][j] = id;
+		}
+		if (j < len)
+			continue;
+		idx->token_keyslots_count[i] = len;
+
+		/* any missing keyslot keeps priority invalid, lookup must report it */
+		for (j = 0; j < len; j++) {
+			priority = LUKS2_keyslot_priority_get(hdr, idx->token_keyslots[i][j]);
+			if (priority == CRYPT_SLOT_PRIORITY_INVALID) {
+				idx->token_priority[i] = CRYPT_SLOT_PRIORITY_INVALID;
+				break;
+			}
+			if (priority > idx->token_priority[i])
+				idx->token_priority[i] = priority;
+		}
+	}
+
+	idx->tokens_resolved = true;
+}
+
+/*
+ * Keyslots assigned to token (in json order) and the highest priority
+ * of them (CRYPT_SLOT_PRIORITY_INVALID if some keyslot does not exist).
+ * Returns count, -ENOENT if token does not exist, -EAGAIN if index cannot be used.
+ */
+int LUKS2_hdr_index_token_keyslots(struct luks2_hdr *hdr, int token, const int8_t **keyslots,
+				   crypt_keyslot_priority *priority)
+{
+	struct luks2_hdr_index *idx;
+
+	if (!hdr || LUKS2_hdr_tokens_load(NULL, hdr) || !(idx = hdr_index(hdr)))
+		return -EAGAIN;
+
+	if (token < 0 || token >= LUKS2_TOKENS_MAX || !idx->tokens[token])
+		return -ENOENT;
+
+	if (!idx->tokens_resolved)
+		hdr_index_tokens_resolve(hdr, idx);
+
+	if (idx->token_keyslots_count[token] < 0)
+		return -EAGAIN;
+
+	*keyslots = idx->token_keyslots[token];
+	*priority = idx->token_priority[token];
+
+	return idx->token_keyslots_count[token];
+}
+
+static int interval_cmp(const void *a, const void *b)
+{
+	const struct interval *ia = a, *ib = b;
+
+	if (ia->offset != ib->offset)
+		return ia->offset < ib->offset ? -1 : 1;
+	if (ia->length != ib->length)
+		return ia->length < ib->length ? -1 : 1;
+	return 0;
+}
+
+static int keyslot_areas_sorted(struct luks2_hdr *hdr, struct interval *areas)
+{
+	int i, count = 0;
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+		if (!LUKS2_keyslot_area(hdr, i, &areas[count].offset, &areas[count].length) &&
+		    areas[count].offset && areas[count].length)
+			count++;
+
+	qsort(areas, count, sizeof(*areas), interval_cmp);
+
+	return count;
+}
+
+/*
+ * Fill areas with used keyslot areas sorted by offset, returns count.
+ * The sorted list is kept in index until keyslots change.
+ */
+int LUKS2_keyslot_areas_sorted(struct luks2_hdr *hdr, struct interval *areas)
+{
+	struct luks2_hdr_index *idx = hdr_index(hdr);
+
+	if (!idx)
+		return keyslot_areas_sorted(hdr, areas);
+
+	if (idx->areas_count < 0)
+		idx->areas_count = keyslot_areas_sorted(hdr, idx->areas);
+
+	memcpy(areas, idx->areas, idx->areas_count * sizeof(*areas));
+
+	return idx->areas_count;
+}
+
 /*
  * JSON struct access helpers
  */
 json_object *LUKS2_get_keyslot_jobj(struct luks2_hdr *hdr, int keyslot)
 {
+	struct luks2_hdr_index *idx;
 	json_object *jobj1, *jobj2;
 	char keyslot_name[16];
 
 	if (!hdr || keyslot < 0)
 		return NULL;
 
+	if ((idx = hdr_index(hdr)))
+		return keyslot < LUKS2_KEYSLOTS_MAX ? idx->keyslots[keyslot] : NULL;
+
 	if (snprintf(keyslot_name, sizeof(keyslot_name), "%u", keyslot) < 1)
 		return NULL;
 
@@ -125,7 +453,8 @@ json_object *LUKS2_get_tokens_jobj(struct luks2_hdr *hdr)
 {
 	json_object *jobj_tokens;
 
-	if (!hdr || !json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens))
+	if (!hdr || LUKS2_hdr_tokens_load(NULL, hdr) ||
+	    !json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens))
 		return NULL;
 
 	return jobj_tokens;
@@ -133,12 +462,16 @@ json_object *LUKS2_get_tokens_jobj(struct luks2_hdr *hdr)
 
 json_object *LUKS2_get_token_jobj(struct luks2_hdr *hdr, int token)
 {
+	struct luks2_hdr_index *idx;
 	json_object *jobj1, *jobj2;
 	char token_name[16];
 
-	if (!hdr || token < 0)
+	if (!hdr || token < 0 || LUKS2_hdr_tokens_load(NULL, hdr))
 		return NULL;
 
+	if ((idx = hdr_index(hdr)))
+		return token < LUKS2_TOKENS_MAX ? idx->tokens[token] : NULL;
+
 	jobj1 = LUKS2_get_tokens_jobj(hdr);
 	if (!jobj1)
 		return NULL;
@@ -152,12 +485,16 @@ json_object *LUKS2_get_token_jobj(struct luks2_hdr *hdr, int token)
 
 json_object *LUKS2_get_digest_jobj(struct luks2_hdr *hdr, int digest)
 {
+	struct luks2_hdr_index *idx;
 	json_object *jobj1, *jobj2;
 	char digest_name[16];
 
 	if (!hdr || digest < 0)
 		return NULL;
 
+	if ((idx = hdr_index(hdr)))
+		return digest < LUKS2_DIGEST_MAX ? idx->digests[digest] : NULL;
+
 	if (snprintf(digest_name, sizeof(digest_name), "%u", digest) < 1)
 		return NULL;
 
@@ -180,12 +517,17 @@ static json_object *json_get_segments_jobj(json_object *hdr_jobj)
 
 json_object *LUKS2_get_segment_jobj(struct luks2_hdr *hdr, int segment)
 {
+	struct luks2_hdr_index *idx;
+
 	if (!hdr)
 		return NULL;
 
 	if (segment == CRYPT_DEFAULT_SEGMENT)
 		segment = LUKS2_get_default_segment(hdr);
 
+	if (segment >= 0 && (idx = hdr_index(hdr)))
+		return segment < LUKS2_SEGMENT_MAX ? idx->segments[segment] : NULL;
+
 	return json_segments_get_segment(json_get_segments_jobj(hdr->jobj), segment);
 }
 
@@ -376,12 +718,12 @@ static bool segment_has_digest(const char *segment_name, json_object *jobj_diges
 
 
 static bool validate_intervals(struct crypt_device *cd,
-			       int length, const struct interval *ix,
+			       int length, struct interval *ix,
 			       uint64_t metadata_size, uint64_t keyslots_area_end)
 {
-	int j, i = 0;
+	int i;
 
-	while (i < length) {
+	for (i = 0; i < length; i++) {
 		/* Offset cannot be inside primary or secondary JSON area */
 		if (ix[i].offset < 2 * metadata_size) {
 			log_dbg(cd, "Illegal area offset: %" PRIu64 ".", ix[i].offset);
@@ -403,25 +745,18 @@ static bool validate_intervals(struct crypt_device *cd,
 				ix[i].offset, ix[i].offset + ix[i].length, keyslots_area_end);
 			return false;
 		}
+	}
 
-		for (j = 0; j < length; j++) {
-			if (i == j)
-				continue;
-
-			if (ix[j].offset > (UINT64_MAX - ix[j].length)) {
-				log_dbg(cd, "Interval offset+length overflow.");
-				return false;
-			}
+	/* sorted by offset, any overlap shows up between neighbours */
+	qsort(ix, length, sizeof(*ix), interval_cmp);
 
-			if ((ix[i].offset >= ix[j].offset) && (ix[i].offset < (ix[j].offset + ix[j].length))) {
-				log_dbg(cd, "Overlapping areas [%" PRIu64 ",%" PRIu64 "] and [%" PRIu64 ",%" PRIu64 "].",
-					ix[i].offset, ix[i].offset + ix[i].length,
-					ix[j].offset, ix[j].offset + ix[j].length);
-				return false;
-			}
+	for (i = 1; i < length; i++) {
+		if (ix[i].offset < (ix[i - 1].offset + ix[i - 1].length)) {
+			log_dbg(cd, "Overlapping areas [%" PRIu64 ",%" PRIu64 "] and [%" PRIu64 ",%" PRIu64 "].",
+				ix[i].offset, ix[i].offset + ix[i].length,
+				ix[i - 1].offset, ix[i - 1].offset + ix[i - 1].length);
+			return false;
 		}
-
-		i++;
 	}
 
 	return true;
@@ -1077,39 +1412,133 @@ static int hdr_validate_requirements(struct crypt_device *cd, json_object *hdr_j
 	return 0;
 }
 
-int LUKS2_hdr_validate(struct crypt_device *cd, json_object *hdr_jobj, uint64_t json_size)
+/* sections every check depends on, unchanged sections need not be validated again */
+enum { HDR_SECTION_CONFIG = 0, HDR_SECTION_KEYSLOTS, HDR_SECTION_TOKENS,
+       HDR_SECTION_DIGESTS, HDR_SECTION_SEGMENTS, HDR_SECTIONS };
+
+#define HDR_S(x) (1U << HDR_SECTION_##x)
+
+static const char *const hdr_section_names[HDR_SECTIONS] = {
+	"config", "keyslots", "tokens", "digests", "segments"
+};
+
+static const struct {
+	int (*validate)(struct crypt_device *, json_object *);
+	unsigned sections;
+} hdr_checks[] = {
+	{ hdr_validate_requirements, HDR_S(CONFIG) },
+	{ hdr_validate_tokens,       HDR_S(TOKENS) | HDR_S(KEYSLOTS) },
+	{ hdr_validate_digests,      HDR_S(DIGESTS) | HDR_S(KEYSLOTS) | HDR_S(SEGMENTS) },
+	{ hdr_validate_segments,     HDR_S(SEGMENTS) | HDR_S(DIGESTS) | HDR_S(CONFIG) },
+	{ hdr_validate_keyslots,     HDR_S(KEYSLOTS) },
+	{ hdr_validate_config,       HDR_S(CONFIG) | HDR_S(SEGMENTS) },
+	{ hdr_validate_areas,        HDR_S(KEYSLOTS) | HDR_S(SEGMENTS) | HDR_S(CONFIG) },
+	{ NULL, 0 }
+};
+
+/* keyslot implementations (LUKS2_keyslots_validate) */
+#define HDR_KEYSLOTS_IMPL_SECTIONS (HDR_S(KEYSLOTS) | HDR_S(DIGESTS) | HDR_S(CONFIG))
+
+static int hdr_validate_sections(struct crypt_device *cd, json_object *hdr_jobj,
+				 uint64_t json_size, unsigned sections)
 {
-	struct {
-		int (*validate)(struct crypt_device *, json_object *);
-	} checks[] = {
-		{ hdr_validate_requirements },
-		{ hdr_validate_tokens   },
-		{ hdr_validate_digests  },
-		{ hdr_validate_segments },
-		{ hdr_validate_keyslots },
-		{ hdr_validate_config   },
-		{ hdr_validate_areas    },
-		{ NULL }
-	};
 	int i;
 
 	if (!hdr_jobj)
 		return 1;
 
-	for (i = 0; checks[i].validate; i++)
-		if (checks[i].validate && checks[i].validate(cd, hdr_jobj))
+	for (i = 0; hdr_checks[i].validate; i++)
+		if ((hdr_checks[i].sections & sections) && hdr_checks[i].validate(cd, hdr_jobj))
 			return 1;
 
+	/* json size always depends on everything */
 	if (hdr_validate_json_size(cd, hdr_jobj, json_size))
 		return 1;
 
 	/* validate keyslot implementations */
-	if (LUKS2_keyslots_validate(cd, hdr_jobj))
+	if ((sections & HDR_KEYSLOTS_IMPL_SECTIONS) && LUKS2_keyslots_validate(cd, hdr_jobj))
 		return 1;
 
 	return 0;
 }
 
+int LUKS2_hdr_validate(struct crypt_device *cd, json_object *hdr_jobj, uint64_t json_size)
+{
+	return hdr_validate_sections(cd, hdr_jobj, json_size, ~0U);
+}
+
+/* serialized sections of the last successfully validated header */
+struct luks2_hdr_validated {
+	uint64_t json_size;
+	char *section[HDR_SECTIONS];
+};
+
+static void hdr_validated_free(struct luks2_hdr_validated *v)
+{
+	int i;
+
+	if (!v)
+		return;
+
+	for (i = 0; i < HDR_SECTIONS; i++)
+		free(v->section[i]);
+	free(v);
+}
+
+static bool str_equal(const char *s1, const char *s2)
+{
+	if (!s1 || !s2)
+		return s1 == s2;
+
+	return !strcmp(s1, s2);
+}
+
+/*
+ * Validate in-memory header, checks depending only on sections
+ * unchanged since the last successful validation are skipped.
+ * Sections are compared by content, so no dirty flags need
+ * to be maintained by code modifying the header.
+ */
+int LUKS2_hdr_validate_changed(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	struct luks2_hdr_validated *v = hdr->validated, *v_new;
+	uint64_t json_size = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
+	json_object *jobj;
+	unsigned dirty = 0;
+	int i, r;
+
+	v_new = calloc(1, sizeof(*v_new));
+	if (!v_new)
+		return LUKS2_hdr_validate(cd, hdr->jobj, json_size);
+	v_new->json_size = json_size;
+
+	for (i = 0; i < HDR_SECTIONS; i++) {
+		if (json_object_object_get_ex(hdr->jobj, hdr_section_names[i], &jobj) &&
+		    !(v_new->section[i] = strdup(json_object_to_json_string_ext(jobj,
+				JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE)))) {
+			hdr_validated_free(v_new);
+			return LUKS2_hdr_validate(cd, hdr->jobj, json_size);
+		}
+
+		if (!v || v->json_size != json_size || !str_equal(v->section[i], v_new->section[i]))
+			dirty |= 1U << i;
+	}
+
+	if (dirty != (1U << HDR_SECTIONS) - 1)
+		log_dbg(cd, "Validating changed LUKS2 metadata sections (0x%x).", dirty);
+
+	r = hdr_validate_sections(cd, hdr->jobj, json_size, dirty);
+
+	hdr_validated_free(v);
+	if (r) {
+		hdr_validated_free(v_new);
+		v_new = NULL;
+	}
+	hdr->validated = v_new;
+
+	return r;
+}
+
 static bool hdr_json_free(json_object **jobj)
 {
 	assert(jobj);
@@ -1140,7 +1569,7 @@ static int hdr_update_copy_for_rollback(struct crypt_device *cd, struct luks2_hd
 /* FIXME: should we expose do_recovery parameter explicitly? */
 int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair)
 {
-	int r;
+	int r, span;
 
 	r = device_read_lock(cd, crypt_metadata_device(cd));
 	if (r) {
@@ -1149,6 +1578,7 @@ int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair)
 		return r;
 	}
 
+	span = crypt_span_begin(cd, "header_read");
 	r = LUKS2_disk_hdr_read(cd, hdr, crypt_metadata_device(cd), 1, !repair);
 	if (r == -EAGAIN) {
 		/* unlikely: auto-recovery is required and failed due to read lock being held */
@@ -1159,6 +1589,7 @@ int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair)
 		if (r < 0) {
 			log_err(cd, _("Failed to acquire write lock on device %s."),
 				device_path(crypt_metadata_device(cd)));
+			crypt_span_end(cd, span);
 			return r;
 		}
 
@@ -1168,6 +1599,10 @@ int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair)
 	} else
 		device_read_unlock(cd, crypt_metadata_device(cd));
 
+	crypt_span_end(cd, span);
+	trace_metadata_read(CRYPT_LUKS2, device_path(crypt_metadata_device(cd)), r);
+	crypt_perf_add(cd, header_reads, 1);
+
 	if (!r && (r = hdr_update_copy_for_rollback(cd, hdr)))
 		log_dbg(cd, "Failed to update rollback LUKS2 metadata.");
 
@@ -1176,9 +1611,12 @@ int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair)
 
 static int hdr_cleanup_and_validate(struct crypt_device *cd, struct luks2_hdr *hdr)
 {
+	if (LUKS2_hdr_tokens_load(cd, hdr))
+		return -EINVAL;
+
 	LUKS2_digests_erase_unused(cd, hdr);
 
-	return LUKS2_hdr_validate(cd, hdr->jobj, hdr->hdr_size - LUKS2_HDR_BIN_LEN);
+	return LUKS2_hdr_validate_changed(cd, hdr);
 }
 
 int LUKS2_hdr_write_force(struct crypt_device *cd, struct luks2_hdr *hdr)
@@ -1189,6 +1627,8 @@ int LUKS2_hdr_write_force(struct crypt_device *cd, struct luks2_hdr *hdr)
 		return -EINVAL;
 
 	r = LUKS2_disk_hdr_write(cd, hdr, crypt_metadata_device(cd), false);
+	trace_metadata_write(CRYPT_LUKS2, device_path(crypt_metadata_device(cd)), r);
+	crypt_perf_add(cd, header_writes, 1);
 
 	if (!r && (r = hdr_update_copy_for_rollback(cd, hdr)))
 		log_dbg(cd, "Failed to update rollback LUKS2 metadata.");
@@ -1203,7 +1643,16 @@ int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr)
 	if (hdr_cleanup_and_validate(cd, hdr))
 		return -EINVAL;
 
-	r = LUKS2_disk_hdr_write(cd, hdr, crypt_metadata_device(cd), true);
+	/* inside batch only in-memory state is updated (rollback point moves as well) */
+	if (hdr->batch) {
+		log_dbg(cd, "Deferring LUKS2 header write to batch commit.");
+		hdr->batch_dirty = 1;
+		r = 0;
+	} else {
+		r = LUKS2_disk_hdr_write(cd, hdr, crypt_metadata_device(cd), true);
+		trace_metadata_write(CRYPT_LUKS2, device_path(crypt_metadata_device(cd)), r);
+		crypt_perf_add(cd, header_writes, 1);
+	}
 
 	if (!r && (r = hdr_update_copy_for_rollback(cd, hdr)))
 		log_dbg(cd, "Failed to update rollback LUKS2 metadata.");
@@ -1211,6 +1660,46 @@ int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr)
 	return r;
 }
 
+/*
+ * Metadata batch: all LUKS2_hdr_write() calls are validated but only the final
+ * state is written (with one seqid increment) in LUKS2_hdr_batch_commit().
+ * Keyslot areas are still written immediately, before the header referencing them.
+ */
+int LUKS2_hdr_batch_begin(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	if (hdr->batch) {
+		log_dbg(cd, "LUKS2 metadata batch already started.");
+		return -EBUSY;
+	}
+
+	hdr->batch = 1;
+	hdr->batch_dirty = 0;
+
+	return 0;
+}
+
+int LUKS2_hdr_batch_commit(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	int r;
+
+	if (!hdr->batch)
+		return -EINVAL;
+
+	hdr->batch = 0;
+	if (!hdr->batch_dirty)
+		return 0;
+
+	r = LUKS2_hdr_write(cd, hdr);
+	if (r) {
+		/* keep batch open, commit can be retried or the header reloaded */
+		hdr->batch = 1;
+		return r;
+	}
+
+	hdr->batch_dirty = 0;
+	return 0;
+}
+
 int LUKS2_hdr_rollback(struct crypt_device *cd, struct luks2_hdr *hdr)
 {
 	json_object **jobj_copy;
@@ -1219,6 +1708,7 @@ int LUKS2_hdr_rollback(struct crypt_device *cd, struct luks2_hdr *hdr)
 
 	log_dbg(cd, "Rolling back in-memory LUKS2 json metadata.");
 
+	LUKS2_hdr_index_invalidate(hdr);
 	jobj_copy = (json_object **)&hdr->jobj;
 
 	if (!hdr_json_free(jobj_copy)) {
@@ -1267,6 +1757,15 @@ void LUKS2_hdr_free(struct crypt_device *cd, struct luks2_hdr *hdr)
 
 	assert(hdr);
 
+	/* prefetch threads may still read metadata */
+	LUKS2_token_prefetch_free(hdr);
+
+	LUKS2_hdr_index_invalidate(hdr);
+	hdr_validated_free(hdr->validated);
+	hdr->validated = NULL;
+	free(hdr->tokens_json);
+	hdr->tokens_json = NULL;
+	hdr->batch = hdr->batch_dirty = 0;
 	jobj = (json_object **)&hdr->jobj;
 
 	if (!hdr_json_free(jobj))
@@ -1278,6 +1777,67 @@ void LUKS2_hdr_free(struct crypt_device *cd, struct luks2_hdr *hdr)
 		log_dbg(cd, "LUKS2 rollback metadata copy still in use");
 }
 
+/*
+ * Parse and validate tokens section deferred on header load (if any).
+ * Rollback copy was made without tokens as well, it gets its own copy.
+ */
+int LUKS2_hdr_tokens_load(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	json_object *jobj_tokens, *jobj_copy = NULL;
+	struct json_tokener *jtok;
+	size_t len;
+	int r = -EINVAL;
+
+	if (!hdr || !hdr->tokens_json)
+		return 0;
+
+	if (!hdr->jobj)
+		return -EINVAL;
+
+	len = strlen(hdr->tokens_json);
+	if (len > INT32_MAX)
+		return -EINVAL;
+
+	jtok = json_tokener_new();
+	if (!jtok)
+		return -ENOMEM;
+
+	jobj_tokens = json_tokener_parse_ex(jtok, hdr->tokens_json, len);
+	if (!jobj_tokens || jtok->char_offset != (int)len ||
+	    !json_object_is_type(jobj_tokens, json_type_object)) {
+		log_dbg(cd, "ERROR: Failed to parse tokens JSON data.");
+		json_object_put(jobj_tokens);
+		json_tokener_free(jtok);
+		return -EINVAL;
+	}
+	json_tokener_free(jtok);
+
+	json_object_object_add(hdr->jobj, "tokens", jobj_tokens);
+	LUKS2_hdr_index_invalidate(hdr);
+
+	if (hdr_validate_tokens(cd, hdr->jobj)) {
+		log_dbg(cd, "ERROR: LUKS2 tokens validation failed.");
+		goto out;
+	}
+
+	if (hdr->jobj_rollback) {
+		if (json_object_copy(jobj_tokens, &jobj_copy)) {
+			r = -ENOMEM;
+			goto out;
+		}
+		json_object_object_add(hdr->jobj_rollback, "tokens", jobj_copy);
+	}
+
+	free(hdr->tokens_json);
+	hdr->tokens_json = NULL;
+	return 0;
+out:
+	/* keep text for next attempt, header with empty tokens must not be written */
+	json_object_object_add(hdr->jobj, "tokens", json_object_new_object());
+	LUKS2_hdr_index_invalidate(hdr);
+	return r;
+}
+
 static uint64_t LUKS2_keyslots_size_jobj(json_object *jobj)
 {
 	json_object *jobj1, *jobj2;
@@ -1305,48 +1865,158 @@ uint64_t LUKS2_hdr_and_areas_size(struct luks2_hdr *hdr)
 	return LUKS2_hdr_and_areas_size_jobj(hdr->jobj);
 }
 
-int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
-		     const char *backup_file)
+struct hdr_area {
+	uint64_t offset;
+	uint64_t length;
+};
+
+static int hdr_area_cmp(const void *a, const void *b)
 {
-	struct device *device = crypt_metadata_device(cd);
-	int fd, devfd, r = 0;
-	ssize_t hdr_size;
-	ssize_t ret, buffer_size;
-	char *buffer = NULL;
+	const struct hdr_area *a1 = a, *a2 = b;
 
-	hdr_size = LUKS2_hdr_and_areas_size(hdr);
-	buffer_size = size_round_up(hdr_size, crypt_getpagesize());
+	return a1->offset < a2->offset ? -1 : a1->offset > a2->offset;
+}
 
-	buffer = malloc(buffer_size);
-	if (!buffer)
-		return -ENOMEM;
+static bool buffer_is_zero(const char *buf, size_t size)
+{
+	while (size--)
+		if (*buf++)
+			return false;
+	return true;
+}
 
-	log_dbg(cd, "Storing backup of header (%zu bytes).", hdr_size);
-	log_dbg(cd, "Output backup file size: %zu bytes.", buffer_size);
+/*
+ * Both binary headers with JSON and all allocated keyslot areas, sorted.
+ * The rest of the keyslots area is unused and not needed in backup.
+ */
+static int hdr_used_areas(struct luks2_hdr *hdr, struct hdr_area *areas, int *count)
+{
+	uint64_t size = LUKS2_hdr_and_areas_size(hdr);
+	int i, n = 0;
+
+	areas[n].offset = 0;
+	areas[n++].length = 2 * LUKS2_metadata_size(hdr);
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
+		if (LUKS2_keyslot_area(hdr, i, &areas[n].offset, &areas[n].length))
+			continue;
+		if (areas[n].offset > size || areas[n].length > size - areas[n].offset)
+			return -EINVAL;
+		n++;
+	}
+
+	qsort(areas, n, sizeof(*areas), hdr_area_cmp);
+
+	for (i = 1; i < n; i++)
+		if (areas[i].offset < areas[i - 1].offset + areas[i - 1].length)
+			return -EINVAL;
+
+	*count = n;
+
+	return 0;
+}
+
+/*
+ * Only used areas are read from device and written to the backup file,
+ * unused keyslots area is left as holes (sparse file) that read as zeroes,
+ * so the backup is still a plain header image of the full size.
+ */
+/* Reads used header areas to zeroed buffer of LUKS2_hdr_and_areas_size() bytes */
+static int hdr_backup_read(struct crypt_device *cd, ssize_t hdr_size, char *buffer,
+			   struct hdr_area *areas, int *areas_count)
+{
+	struct device *device = crypt_metadata_device(cd);
+	struct luks2_hdr hdr_disk = {};
+	int devfd, i, r;
 
 	r = device_read_lock(cd, device);
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."),
 			device_path(crypt_metadata_device(cd)));
-		goto out;
+		return r;
 	}
 
 	devfd = device_open_locked(cd, device, O_RDONLY);
 	if (devfd < 0) {
 		device_read_unlock(cd, device);
 		log_err(cd, _("Device %s is not a valid LUKS device."), device_path(device));
-		r = (devfd == -1) ? -EINVAL : devfd;
-		goto out;
+		return (devfd == -1) ? -EINVAL : devfd;
+	}
+
+	/* areas are taken from on-disk metadata under the lock, copy everything otherwise */
+	if (LUKS2_disk_hdr_read(cd, &hdr_disk, device, 0, 0) ||
+	    (ssize_t)LUKS2_hdr_and_areas_size(&hdr_disk) != hdr_size ||
+	    hdr_used_areas(&hdr_disk, areas, areas_count)) {
+		log_dbg(cd, "Cannot get used header areas, storing whole areas.");
+		areas[0].offset = 0;
+		areas[0].length = hdr_size;
+		*areas_count = 1;
+	}
+	LUKS2_hdr_free(cd, &hdr_disk);
+	crypt_safe_memzero(&hdr_disk, sizeof(hdr_disk));
+
+	for (i = 0; i < *areas_count; i++) {
+		log_dbg(cd, "Reading header area [%" PRIu64 ", %" PRIu64 "].",
+			areas[i].offset, areas[i].length);
+		if (device_read_at(cd, device, devfd, buffer + areas[i].offset,
+				   areas[i].length, areas[i].offset) < (ssize_t)areas[i].length) {
+			r = -EIO;
+			break;
+		}
 	}
 
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-			   device_alignment(device), buffer, hdr_size, 0) < hdr_size) {
-		device_read_unlock(cd, device);
-		r = -EIO;
-		goto out;
+	device_read_unlock(cd, device);
+	return r;
+}
+
+/* Backup file content in memory, see crypt_backup_archive_add() */
+int LUKS2_hdr_backup_image(struct crypt_device *cd, struct luks2_hdr *hdr,
+			   char **image, size_t *image_size)
+{
+	struct hdr_area areas[LUKS2_KEYSLOTS_MAX + 1];
+	ssize_t hdr_size = LUKS2_hdr_and_areas_size(hdr);
+	size_t buffer_size = size_round_up(hdr_size, crypt_getpagesize());
+	int r, areas_count = 0;
+	char *buffer;
+
+	buffer = calloc(1, buffer_size);
+	if (!buffer)
+		return -ENOMEM;
+
+	r = hdr_backup_read(cd, hdr_size, buffer, areas, &areas_count);
+	if (r < 0) {
+		crypt_safe_memzero(buffer, buffer_size);
+		free(buffer);
+		return r;
 	}
 
-	device_read_unlock(cd, device);
+	*image = buffer;
+	*image_size = buffer_size;
+	return 0;
+}
+
+int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
+		     const char *backup_file)
+{
+	struct hdr_area areas[LUKS2_KEYSLOTS_MAX + 1];
+	int fd, i, r = 0, areas_count = 0;
+	ssize_t hdr_size;
+	ssize_t buffer_size;
+	char *buffer = NULL;
+
+	hdr_size = LUKS2_hdr_and_areas_size(hdr);
+	buffer_size = size_round_up(hdr_size, crypt_getpagesize());
+
+	buffer = calloc(1, buffer_size);
+	if (!buffer)
+		return -ENOMEM;
+
+	log_dbg(cd, "Storing backup of header (%zu bytes).", hdr_size);
+	log_dbg(cd, "Output backup file size: %zu bytes.", buffer_size);
+
+	r = hdr_backup_read(cd, hdr_size, buffer, areas, &areas_count);
+	if (r < 0)
+		goto out;
 
 	fd = open(backup_file, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR);
 	if (fd == -1) {
@@ -1357,13 +2027,20 @@ int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 		r = -EINVAL;
 		goto out;
 	}
-	ret = write_buffer(fd, buffer, buffer_size);
+
+	for (i = 0, r = 0; !r && i < areas_count; i++) {
+		if (lseek(fd, areas[i].offset, SEEK_SET) != (off_t)areas[i].offset)
+			r = -EIO;
+		else if (write_buffer(fd, buffer + areas[i].offset, areas[i].length) < (ssize_t)areas[i].length)
+			r = -EIO;
+	}
+
+	if (!r && ftruncate(fd, buffer_size))
+		r = -EIO;
 	close(fd);
-	if (ret < buffer_size) {
+
+	if (r)
 		log_err(cd, _("Cannot write header backup file %s."), backup_file);
-		r = -EIO;
-	} else
-		r = 0;
 out:
 	crypt_safe_memzero(buffer, buffer_size);
 	free(buffer);
@@ -1374,7 +2051,9 @@ int LUKS2_hdr_restore(struct crypt_device *cd, struct luks2_hdr *hdr,
 		     const char *backup_file)
 {
 	struct device *backup_device, *device = crypt_metadata_device(cd);
-	int r, fd, devfd = -1, diff_uuid = 0;
+	struct hdr_area areas[LUKS2_KEYSLOTS_MAX + 1];
+	int i, r, fd, devfd = -1, diff_uuid = 0, areas_count = 0;
+	uint64_t offset, length;
 	ssize_t ret, buffer_size = 0;
 	char *buffer = NULL, msg[1024];
 	struct luks2_hdr hdr_file = {}, tmp_hdr = {};
@@ -1410,12 +2089,17 @@ int LUKS2_hdr_restore(struct crypt_device *cd, struct luks2_hdr *hdr,
 	}
 
 	buffer_size = LUKS2_hdr_and_areas_size(&hdr_file);
-	buffer = malloc(buffer_size);
+	buffer = calloc(1, buffer_size);
 	if (!buffer) {
 		r = -ENOMEM;
 		goto out;
 	}
 
+	if (hdr_used_areas(&hdr_file, areas, &areas_count)) {
+		r = -EINVAL;
+		goto out;
+	}
+
 	fd = open(backup_file, O_RDONLY);
 	if (fd == -1) {
 		log_err(cd, _("Cannot open header backup file %s."), backup_file);
@@ -1423,9 +2107,20 @@ int LUKS2_hdr_restore(struct crypt_device *cd, struct luks2_hdr *hdr,
 		goto out;
 	}
 
-	ret = read_buffer(fd, buffer, buffer_size);
+	/* holes in sparse backup are already zeroed in buffer */
+	for (i = 0, offset = 0, ret = 0; ret >= 0 && offset < (uint64_t)buffer_size; offset += length) {
+		length = (i < areas_count ? areas[i].offset : (uint64_t)buffer_size) - offset;
+		if (!length)
+			length = areas[i++].length;
+		else if (range_is_hole(fd, offset, length))
+			continue;
+
+		if (lseek(fd, offset, SEEK_SET) != (off_t)offset ||
+		    read_buffer(fd, buffer + offset, length) < (ssize_t)length)
+			ret = -1;
+	}
 	close(fd);
-	if (ret < buffer_size) {
+	if (ret < 0) {
 		log_err(cd, _("Cannot read header backup file %s."), backup_file);
 		r = -EIO;
 		goto out;
@@ -1497,11 +2192,17 @@ int LUKS2_hdr_restore(struct crypt_device *cd, struct luks2_hdr *hdr,
 		goto out;
 	}
 
-	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
-			    device_alignment(device), buffer, buffer_size, 0) < buffer_size)
-		r = -EIO;
-	else
-		r = 0;
+	/* zeroed unused areas are deallocated on header file instead of written */
+	for (i = 0, offset = 0, r = 0; !r && offset < (uint64_t)buffer_size; offset += length) {
+		length = (i < areas_count ? areas[i].offset : (uint64_t)buffer_size) - offset;
+		if (!length)
+			length = areas[i++].length;
+		else if (buffer_is_zero(buffer + offset, length) && !punch_hole(devfd, offset, length))
+			continue;
+
+		if (device_write_at(cd, device, devfd, buffer + offset, length, offset) < (ssize_t)length)
+			r = -EIO;
+	}
 
 	device_write_unlock(cd, device);
 out:
@@ -1529,6 +2230,7 @@ static const struct  {
 	{ CRYPT_ACTIVATE_NO_JOURNAL,             "no-journal" },
 	{ CRYPT_ACTIVATE_NO_READ_WORKQUEUE,      "no-read-workqueue" },
 	{ CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE,     "no-write-workqueue" },
+	{ CRYPT_ACTIVATE_INLINE_CRYPT,           "inline-crypt" },
 	{ 0, NULL }
 };
 
@@ -2141,7 +2843,7 @@ static void hdr_dump_digests(struct crypt_device *cd, json_object *hdr_jobj)
 
 int LUKS2_hdr_dump(struct crypt_device *cd, struct luks2_hdr *hdr)
 {
-	if (!hdr->jobj)
+	if (!hdr->jobj || LUKS2_hdr_tokens_load(cd, hdr))
 		return -EINVAL;
 
 	JSON_DBG(cd, hdr->jobj, NULL);
@@ -2164,12 +2866,17 @@ int LUKS2_hdr_dump(struct crypt_device *cd, struct luks2_hdr *hdr)
 	return 0;
 }
 
-int LUKS2_hdr_dump_json(struct crypt_device *cd, struct luks2_hdr *hdr, const char **json)
+int LUKS2_hdr_dump_json(struct crypt_device *cd, struct luks2_hdr *hdr, const char **json,
+	uint32_t flags)
 {
 	const char *json_buf;
 
+	if (LUKS2_hdr_tokens_load(cd, hdr))
+		return -EINVAL;
+
 	json_buf = json_object_to_json_string_ext(hdr->jobj,
-		JSON_C_TO_STRING_PRETTY | JSON_C_TO_STRING_NOSLASHESCAPE);
+		(flags & CRYPT_DUMP_JSON_COMPACT ? JSON_C_TO_STRING_PLAIN : JSON_C_TO_STRING_PRETTY) |
+		JSON_C_TO_STRING_NOSLASHESCAPE);
 
 	if (!json_buf)
 		return -EINVAL;
@@ -2414,6 +3121,53 @@ uint32_t LUKS2_get_sector_size(struct luks2_hdr *hdr)
 	return json_segment_get_sector_size(LUKS2_get_segment_jobj(hdr, CRYPT_DEFAULT_SEGMENT));
 }
 
+/*
+ * Segment s + 1 directly continues segment s with the same type, key
+ * and encryption parameters, so both can be mapped by one dm target.
+ */
+static bool segments_adjacent_compatible(struct luks2_hdr *hdr, json_object *jobj_segments, unsigned s)
+{
+	json_object *jobj1, *jobj2;
+	const char *type1, *type2, *cipher1, *cipher2;
+	uint64_t size;
+	int digest;
+
+	jobj1 = json_segments_get_segment(jobj_segments, s);
+	jobj2 = json_segments_get_segment(jobj_segments, s + 1);
+	if (!jobj1 || !jobj2)
+		return false;
+
+	type1 = json_segment_type(jobj1);
+	type2 = json_segment_type(jobj2);
+	if (!type1 || !type2 || strcmp(type1, type2))
+		return false;
+
+	/* 'dynamic' length segment cannot be followed */
+	size = json_segment_get_size(jobj1, 0);
+	if (!size || json_segment_get_offset(jobj1, 0) + size != json_segment_get_offset(jobj2, 0))
+		return false;
+
+	if (!strcmp(type1, "linear"))
+		return true;
+
+	if (strcmp(type1, "crypt"))
+		return false;
+
+	digest = LUKS2_digest_by_segment(hdr, s);
+	if (digest < 0 || digest != LUKS2_digest_by_segment(hdr, s + 1))
+		return false;
+
+	cipher1 = json_segment_get_cipher(jobj1);
+	cipher2 = json_segment_get_cipher(jobj2);
+	if (!cipher1 || !cipher2 || strcmp(cipher1, cipher2))
+		return false;
+
+	if (json_segment_get_sector_size(jobj1) != json_segment_get_sector_size(jobj2))
+		return false;
+
+	return json_segment_get_iv_offset(jobj1) + (size >> SECTOR_SHIFT) == json_segment_get_iv_offset(jobj2);
+}
+
 int LUKS2_assembly_multisegment_dmd(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	struct volume_key *vks,
@@ -2424,8 +3178,8 @@ int LUKS2_assembly_multisegment_dmd(struct crypt_device *cd,
 	json_object *jobj;
 	enum devcheck device_check;
 	int r;
-	unsigned s = 0;
-	uint64_t data_offset, segment_size, segment_offset, segment_start = 0;
+	unsigned s = 0, first, count, targets;
+	uint64_t data_offset, size, segment_size, segment_offset, segment_start = 0;
 	struct dm_target *t = &dmd->segment;
 
 	if (dmd->flags & CRYPT_ACTIVATE_SHARED)
@@ -2440,11 +3194,21 @@ int LUKS2_assembly_multisegment_dmd(struct crypt_device *cd,
 	if (r)
 		return r;
 
-	r = dm_targets_allocate(&dmd->segment, json_segments_count(jobj_segments));
+	/* Coalesce adjacent compatible segments to one dm target */
+	count = json_segments_count(jobj_segments);
+	for (targets = count ? 1 : 0, s = 1; s < count; s++)
+		if (!segments_adjacent_compatible(hdr, jobj_segments, s - 1))
+			targets++;
+
+	if (targets < count)
+		log_dbg(cd, "Mapping %u segments by %u dm targets.", count, targets);
+
+	r = dm_targets_allocate(&dmd->segment, targets);
 	if (r)
 		goto err;
 
 	r = -EINVAL;
+	s = 0;
 
 	while (t) {
 		jobj = json_segments_get_segment(jobj_segments, s);
@@ -2454,8 +3218,13 @@ int LUKS2_assembly_multisegment_dmd(struct crypt_device *cd,
 			goto err;
 		}
 
+		first = s;
 		segment_offset = json_segment_get_offset(jobj, 1);
 		segment_size = json_segment_get_size(jobj, 1);
+		while (segments_adjacent_compatible(hdr, jobj_segments, s)) {
+			size = json_segment_get_size(json_segments_get_segment(jobj_segments, ++s), 1);
+			segment_size = size ? segment_size + size : 0;
+		}
 		/* 'dynamic' length allowed in last segment only */
 		if (!segment_size && !t->next)
 			segment_size = dmd->size - segment_start;
@@ -2466,9 +3235,9 @@ int LUKS2_assembly_multisegment_dmd(struct crypt_device *cd,
 		}
 
 		if (!strcmp(json_segment_type(jobj), "crypt")) {
-			vk = crypt_volume_key_by_id(vks, LUKS2_digest_by_segment(hdr, s));
+			vk = crypt_volume_key_by_id(vks, LUKS2_digest_by_segment(hdr, first));
 			if (!vk) {
-				log_err(cd, _("Missing key for dm-crypt segment %u"), s);
+				log_err(cd, _("Missing key for dm-crypt segment %u"), first);
 				r = -EINVAL;
 				goto err;
 			}
@@ -2873,3 +3642,152 @@ int json_object_copy(json_object *jobj_src, json_object **jobj_dst)
 	return *jobj_dst ? 0 : -1;
 #endif
 }
+
+/*
+ * Serializer writing JSON directly to a preallocated buffer (no intermediate
+ * print buffers). Output is the same as from json_object_to_json_string_ext()
+ * with JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE flags.
+ */
+struct json_writer {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static int json_writer_put(struct json_writer *w, const char *s, size_t len)
+{
+	if (len > w->size - w->len)
+		return -ENOSPC;
+
+	memcpy(&w->buf[w->len], s, len);
+	w->len += len;
+	return 0;
+}
+
+static int json_writer_putc(struct json_writer *w, char c)
+{
+	return json_writer_put(w, &c, 1);
+}
+
+/* the same escaping as json-c json_escape_str() */
+static int json_writer_string(struct json_writer *w, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *esc;
+	char u[6] = { '\\', 'u', '0', '0' };
+	size_t i, start = 0;
+	unsigned char c;
+	int r;
+
+	if ((r = json_writer_putc(w, '"')))
+		return r;
+
+	for (i = 0; i < len; i++) {
+		c = str[i];
+		switch (c) {
+		case '\b': esc = "\\b";  break;
+		case '\n': esc = "\\n";  break;
+		case '\r': esc = "\\r";  break;
+		case '\t': esc = "\\t";  break;
+		case '\f': esc = "\\f";  break;
+		case '"':  esc = "\\\""; break;
+		case '\\': esc = "\\\\"; break;
+		default:
+			if (c >= ' ')
+				continue;
+			u[4] = hex[c >> 4];
+			u[5] = hex[c & 0xf];
+			esc = NULL;
+		}
+
+		if ((r = json_writer_put(w, &str[start], i - start)))
+			return r;
+		if ((r = esc ? json_writer_put(w, esc, strlen(esc)) : json_writer_put(w, u, sizeof(u))))
+			return r;
+		start = i + 1;
+	}
+
+	if ((r = json_writer_put(w, &str[start], len - start)))
+		return r;
+
+	return json_writer_putc(w, '"');
+}
+
+static int json_writer_value(struct json_writer *w, json_object *jobj)
+{
+	char num[24];
+	int64_t i64;
+	size_t i, len;
+	bool first = true;
+	int r;
+
+	switch (json_object_get_type(jobj)) {
+	case json_type_null:
+		return json_writer_put(w, "null", 4);
+	case json_type_boolean:
+		return json_object_get_boolean(jobj) ? json_writer_put(w, "true", 4) :
+						       json_writer_put(w, "false", 5);
+	case json_type_int:
+		/* clamped value (possibly unsigned type in new json-c) */
+		i64 = json_object_get_int64(jobj);
+		if (i64 == INT64_MAX || i64 == INT64_MIN)
+			return -ENOTSUP;
+		r = snprintf(num, sizeof(num), "%" PRId64, i64);
+		if (r < 1 || (size_t)r >= sizeof(num))
+			return -EINVAL;
+		return json_writer_put(w, num, r);
+	case json_type_string:
+		return json_writer_string(w, json_object_get_string(jobj),
+					  json_object_get_string_len(jobj));
+	case json_type_object:
+		if ((r = json_writer_putc(w, '{')))
+			return r;
+		json_object_object_foreach(jobj, key, val) {
+			if ((!first && (r = json_writer_putc(w, ','))) ||
+			    (r = json_writer_string(w, key, strlen(key))) ||
+			    (r = json_writer_putc(w, ':')) ||
+			    (r = json_writer_value(w, val)))
+				return r;
+			first = false;
+		}
+		return json_writer_putc(w, '}');
+	case json_type_array:
+		if ((r = json_writer_putc(w, '[')))
+			return r;
+		len = json_object_array_length(jobj);
+		for (i = 0; i < len; i++) {
+			if ((i && (r = json_writer_putc(w, ','))) ||
+			    (r = json_writer_value(w, json_object_array_get_idx(jobj, i))))
+				return r;
+		}
+		return json_writer_putc(w, ']');
+	default:
+		/* double is never used in LUKS2 metadata */
+		return -ENOTSUP;
+	}
+}
+
+/*
+ * Serialize JSON to buf including trailing zero, *json_len is string length.
+ * Returns -ENOSPC if it does not fit, -ENOTSUP if json-c serialization
+ * must be used instead.
+ */
+int LUKS2_json_serialize(json_object *jobj, char *buf, size_t buf_size, size_t *json_len)
+{
+	struct json_writer w = {
+		.buf = buf,
+		.size = buf_size ? buf_size - 1 : 0,
+	};
+	int r;
+
+	if (!buf || !buf_size)
+		return -EINVAL;
+
+	r = json_writer_value(&w, jobj);
+	if (r)
+		return r;
+
+	buf[w.len] = '\0';
+	*json_len = w.len;
+	return 0;
+}
@@ -418,6 +418,136 @@ static int LUKS2_open_and_verify(struct crypt_device *cd,
 	return _open_and_verify(cd, hdr, h, keyslot, password, password_len, vk);
 }
 
+struct luks2_trial {
+	struct luks2_hdr *hdr;
+	struct volume_key **vk;
+};
+
+static int _verify_derived(struct crypt_device *cd, struct crypt_kdf_job *job, void *usrptr)
+{
+	struct luks2_trial *t = usrptr;
+	const keyslot_handler *h;
+	int r, key_size;
+
+	if (job->r < 0) {
+		log_dbg(cd, "Keyslot %d key derivation failed with %d.", job->keyslot, job->r);
+		return job->r;
+	}
+
+	if (!(h = LUKS2_keyslot_handler(cd, job->keyslot)))
+		return -ENOENT;
+
+	key_size = LUKS2_get_keyslot_stored_key_size(t->hdr, job->keyslot);
+	if (key_size < 0)
+		return -EINVAL;
+
+	*t->vk = crypt_alloc_volume_key(key_size, NULL);
+	if (!*t->vk)
+		return -ENOMEM;
+
+	r = h->open_derived(cd, job->keyslot, job->derived_key, (*t->vk)->key, (*t->vk)->keylength);
+	if (r < 0)
+		log_dbg(cd, "Keyslot %d (%s) open failed with %d.", job->keyslot, h->name, r);
+	else
+		r = LUKS2_digest_verify(cd, t->hdr, *t->vk, job->keyslot);
+
+	if (r < 0) {
+		crypt_free_volume_key(*t->vk);
+		*t->vk = NULL;
+	}
+
+	crypt_volume_key_set_id(*t->vk, r);
+
+	return r < 0 ? r : job->keyslot;
+}
+
+/*
+ * Parallel variant of LUKS2_keyslot_open_priority{_digest}.
+ * Returns -EAGAIN if sequential trial should be used instead
+ * (less than two candidates or keyslot handler without KDF support).
+ */
+static int LUKS2_keyslot_open_priority_parallel(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	crypt_keyslot_priority priority,
+	const char *password,
+	size_t password_len,
+	int segment,
+	int digest,
+	struct volume_key **vk)
+{
+	struct luks2_trial t = { .hdr = hdr, .vk = vk };
+	struct crypt_kdf_job *jobs;
+	json_object *jobj_keyslots, *jobj;
+	crypt_keyslot_priority slot_priority;
+	const keyslot_handler *h;
+	unsigned count = 0;
+	int keyslot, r, r_stop = 0;
+
+	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
+
+	jobs = calloc(LUKS2_KEYSLOTS_MAX, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	json_object_object_foreach(jobj_keyslots, slot, val) {
+		if (!json_object_object_get_ex(val, "priority", &jobj))
+			slot_priority = CRYPT_SLOT_PRIORITY_NORMAL;
+		else
+			slot_priority = json_object_get_int(jobj);
+
+		keyslot = atoi(slot);
+		if (slot_priority != priority)
+			continue;
+
+		if (!(h = LUKS2_keyslot_handler(cd, keyslot)))
+			continue;
+
+		if (!h->kdf || !h->open_derived) {
+			r = -EAGAIN;
+			goto out;
+		}
+
+		/* errors other than -ENOENT end the sequential trial too */
+		r = h->validate(cd, val);
+		if (r) {
+			log_dbg(cd, "Keyslot %d validation failed.", keyslot);
+			r_stop = r;
+			break;
+		}
+
+		r = digest >= 0 ? _keyslot_for_digest(hdr, keyslot, digest) :
+				  LUKS2_keyslot_for_segment(hdr, keyslot, segment);
+		if (r == -ENOENT)
+			continue;
+		if (r) {
+			r_stop = r;
+			break;
+		}
+
+		r = h->kdf(cd, keyslot, &jobs[count++]);
+		if (r < 0)
+			goto out;
+	}
+
+	if (count < 2 && !r_stop) {
+		r = -EAGAIN;
+		goto out;
+	}
+
+	r = -ENOENT;
+	if (count) {
+		log_dbg(cd, "Trying to open %u keyslots with priority %d in parallel.", count, priority);
+		r = crypt_kdf_parallel_trial(cd, jobs, count, password, password_len,
+					     _verify_derived, &t);
+	}
+
+	if (r_stop && (r == -EPERM || r == -ENOENT))
+		r = r_stop;
+out:
+	crypt_kdf_jobs_free(jobs, count);
+	return r;
+}
+
 static int LUKS2_keyslot_open_priority_digest(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	crypt_keyslot_priority priority,
@@ -430,6 +560,14 @@ static int LUKS2_keyslot_open_priority_digest(struct crypt_device *cd,
 	crypt_keyslot_priority slot_priority;
 	int keyslot, r = -ENOENT;
 
+	if (crypt_keyslot_parallel_trial(cd)) {
+		r = LUKS2_keyslot_open_priority_parallel(cd, hdr, priority, password, password_len,
+							 CRYPT_ANY_SEGMENT, digest, vk);
+		if (r != -EAGAIN)
+			return r;
+		r = -ENOENT;
+	}
+
 	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
 
 	json_object_object_foreach(jobj_keyslots, slot, val) {
@@ -468,6 +606,14 @@ static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
 	crypt_keyslot_priority slot_priority;
 	int keyslot, r = -ENOENT;
 
+	if (crypt_keyslot_parallel_trial(cd)) {
+		r = LUKS2_keyslot_open_priority_parallel(cd, hdr, priority, password, password_len,
+							 segment, -1, vk);
+		if (r != -EAGAIN)
+			return r;
+		r = -ENOENT;
+	}
+
 	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
 
 	json_object_object_foreach(jobj_keyslots, slot, val) {
@@ -567,6 +713,31 @@ out:
 	return r;
 }
 
+/*
+ * Try keyslot hinted for current credential first, on any failure the usual
+ * priority walk follows (and stale hinted keyslot is tried once more there).
+ */
+static int LUKS2_keyslot_open_hint(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int segment,
+	const char *password,
+	size_t password_len,
+	struct volume_key **vk)
+{
+	int keyslot;
+
+	keyslot = crypt_keyslot_hint_get(cd, crypt_keyslot_hint_credential(cd));
+	if (keyslot < 0)
+		return -ENOENT;
+
+	if (LUKS2_keyslot_priority_get(hdr, keyslot) < CRYPT_SLOT_PRIORITY_NORMAL)
+		return -ENOENT;
+
+	log_dbg(cd, "Trying hinted keyslot %d first.", keyslot);
+
+	return LUKS2_open_and_verify(cd, hdr, keyslot, segment, password, password_len, vk);
+}
+
 int LUKS2_keyslot_open(struct crypt_device *cd,
 	int keyslot,
 	int segment,
@@ -580,6 +751,10 @@ int LUKS2_keyslot_open(struct crypt_device *cd,
 	hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
 
 	if (keyslot == CRYPT_ANY_SLOT) {
+		r = LUKS2_keyslot_open_hint(cd, hdr, segment, password, password_len, vk);
+		if (r >= 0 || r == -ENOMEM)
+			return r;
+
 		r_prio = LUKS2_keyslot_open_priority(cd, hdr, CRYPT_SLOT_PRIORITY_PREFER,
 			password, password_len, segment, vk);
 		if (r_prio >= 0)
@@ -667,13 +842,240 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 		return r;
 	}
 
-	if (LUKS2_hdr_validate(cd, hdr->jobj, hdr->hdr_size - LUKS2_HDR_BIN_LEN))
+	if (LUKS2_hdr_validate_changed(cd, hdr))
 		return -EINVAL;
 
 	return h->store(cd, keyslot, password, password_len,
 			vk->key, vk->keylength);
 }
 
+struct luks2_rewrap {
+	struct luks2_hdr *hdr;
+	struct volume_key *vk;
+	int r;
+};
+
+/*
+ * Trial callbacks return -ENOENT to continue with the next keyslot;
+ * any failure is kept in rewrap context and stops the trial.
+ */
+static int _rewrap_verify(struct crypt_device *cd, struct crypt_kdf_job *job, void *usrptr)
+{
+	struct luks2_rewrap *rw = usrptr;
+	struct volume_key *vk = NULL;
+	const keyslot_handler *h;
+	int r, key_size;
+
+	r = job->r;
+	if (r < 0)
+		goto out;
+
+	if (!(h = LUKS2_keyslot_handler(cd, job->keyslot))) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	key_size = LUKS2_get_keyslot_stored_key_size(rw->hdr, job->keyslot);
+	if (key_size < 0) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	vk = crypt_alloc_volume_key(key_size, NULL);
+	if (!vk) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = h->open_derived(cd, job->keyslot, job->derived_key, vk->key, vk->keylength);
+	if (r < 0)
+		goto out;
+
+	/* the first keyslot is verified by digest, the others must match it */
+	if (!rw->vk) {
+		r = LUKS2_digest_verify(cd, rw->hdr, vk, job->keyslot);
+		if (r >= 0) {
+			rw->vk = vk;
+			vk = NULL;
+			r = 0;
+		}
+	} else if (vk->keylength != rw->vk->keylength ||
+		   crypt_backend_memeq(vk->key, rw->vk->key, vk->keylength))
+		r = -EPERM;
+out:
+	crypt_free_volume_key(vk);
+	if (r < 0) {
+		log_dbg(cd, "Keyslot %d cannot be opened by supplied credential (%d).", job->keyslot, r);
+		rw->r = r;
+		return -EINVAL;
+	}
+	return -ENOENT;
+}
+
+static int _rewrap_derived(struct crypt_device *cd, struct crypt_kdf_job *job, void *usrptr)
+{
+	struct luks2_rewrap *rw = usrptr;
+
+	if (job->r < 0) {
+		log_dbg(cd, "Keyslot %d key derivation failed with %d.", job->keyslot, job->r);
+		rw->r = job->r;
+		return -EINVAL;
+	}
+	return -ENOENT;
+}
+
+static int _rewrap_jobs(struct crypt_device *cd,
+	const int *keyslots,
+	const char * const *passwords,
+	const size_t *password_lens,
+	unsigned count,
+	struct crypt_kdf_job **r_jobs)
+{
+	struct crypt_kdf_job *jobs;
+	const keyslot_handler *h;
+	unsigned i;
+	int r = 0;
+
+	jobs = calloc(count, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	for (i = 0; i < count && !r; i++) {
+		if (!(h = LUKS2_keyslot_handler(cd, keyslots[i])))
+			r = -EINVAL;
+		else
+			r = h->kdf(cd, keyslots[i], &jobs[i]);
+		jobs[i].password = passwords[i];
+		jobs[i].password_len = password_lens[i];
+	}
+
+	if (r < 0) {
+		crypt_kdf_jobs_free(jobs, count);
+		return r;
+	}
+
+	*r_jobs = jobs;
+	return 0;
+}
+
+/*
+ * Re-wrap several keyslots with new keyslot parameters (PBKDF costs).
+ * Each keyslot is opened by its own credential (must unlock the same
+ * volume key), old and new key derivations run in parallel
+ * and header is written only once, after all keyslot areas are updated.
+ * Keyslots are overwritten in place (as luksConvertKey does without free keyslot).
+ */
+int LUKS2_keyslots_rewrap(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	const char * const *passwords,
+	const size_t *password_lens,
+	unsigned count,
+	const struct luks2_keyslot_params *params)
+{
+	struct luks2_rewrap rw = { .hdr = hdr };
+	struct crypt_kdf_job *jobs = NULL;
+	const keyslot_handler *h;
+	int digest = -1, r;
+	unsigned i, j;
+
+	if (!keyslots || !passwords || !password_lens || !count ||
+	    count > LUKS2_KEYSLOTS_MAX || !params)
+		return -EINVAL;
+
+	r = LUKS2_device_write_lock(cd, hdr, crypt_metadata_device(cd));
+	if (r)
+		return r;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < i; j++)
+			if (keyslots[j] == keyslots[i]) {
+				r = -EINVAL;
+				goto out;
+			}
+
+		if (!(h = LUKS2_keyslot_handler(cd, keyslots[i]))) {
+			r = -ENOENT;
+			goto out;
+		}
+
+		if (!h->kdf || !h->open_derived || !h->store_derived || !h->update) {
+			log_dbg(cd, "Keyslot %d (%s) cannot be re-wrapped.", keyslots[i], h->name);
+			r = -ENOTSUP;
+			goto out;
+		}
+
+		r = h->validate(cd, LUKS2_get_keyslot_jobj(hdr, keyslots[i]));
+		if (r) {
+			log_dbg(cd, "Keyslot %d validation failed.", keyslots[i]);
+			goto out;
+		}
+
+		r = LUKS2_digest_by_keyslot(hdr, keyslots[i]);
+		if (r < 0 || (digest >= 0 && r != digest)) {
+			log_dbg(cd, "Keyslot %d is not assigned to the same digest.", keyslots[i]);
+			r = -EINVAL;
+			goto out;
+		}
+		digest = r;
+	}
+
+	/* 1. Verify all credentials with current keyslot parameters */
+	r = _rewrap_jobs(cd, keyslots, passwords, password_lens, count, &jobs);
+	if (r < 0)
+		goto out;
+
+	(void)crypt_kdf_parallel_trial(cd, jobs, count, NULL, 0, _rewrap_verify, &rw);
+	crypt_kdf_jobs_free(jobs, count);
+	jobs = NULL;
+
+	r = rw.r ?: (rw.vk ? 0 : -EPERM);
+	if (r < 0)
+		goto out;
+
+	/* 2. Update keyslot json (generates new salt) */
+	for (i = 0; i < count; i++) {
+		h = LUKS2_keyslot_handler(cd, keyslots[i]);
+		r = h->update(cd, keyslots[i], params);
+		if (!r)
+			r = h->validate(cd, LUKS2_get_keyslot_jobj(hdr, keyslots[i]));
+		if (r) {
+			log_dbg(cd, "Failed to update keyslot %d json.", keyslots[i]);
+			goto out;
+		}
+	}
+
+	if (LUKS2_hdr_validate_changed(cd, hdr)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	/* 3. New key derivations, nothing is written yet */
+	r = _rewrap_jobs(cd, keyslots, passwords, password_lens, count, &jobs);
+	if (r < 0)
+		goto out;
+
+	(void)crypt_kdf_parallel_trial(cd, jobs, count, NULL, 0, _rewrap_derived, &rw);
+	r = rw.r;
+	if (r < 0)
+		goto out;
+
+	/* 4. Keyslot areas and single header commit */
+	for (i = 0; i < count && !r; i++) {
+		h = LUKS2_keyslot_handler(cd, keyslots[i]);
+		r = h->store_derived(cd, keyslots[i], jobs[i].derived_key,
+				     rw.vk->key, rw.vk->keylength);
+	}
+
+	if (!r)
+		r = LUKS2_hdr_write(cd, hdr);
+out:
+	device_write_unlock(cd, crypt_metadata_device(cd));
+	crypt_kdf_jobs_free(jobs, count);
+	crypt_free_volume_key(rw.vk);
+	return r;
+}
+
 int LUKS2_keyslot_wipe(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -732,6 +1134,7 @@ int LUKS2_keyslot_wipe(struct crypt_device *cd,
 		log_dbg(cd, "Wiping keyslot %d without specific-slot handler loaded.", keyslot);
 
 	json_object_object_del_by_uint(jobj_keyslots, keyslot);
+	LUKS2_hdr_index_invalidate(hdr);
 
 	r = LUKS2_hdr_write(cd, hdr);
 out:
@@ -776,6 +1179,7 @@ int LUKS2_keyslot_priority_set(struct crypt_device *cd, struct luks2_hdr *hdr,
 		json_object_object_del(jobj_keyslot, "priority");
 	else
 		json_object_object_add(jobj_keyslot, "priority", json_object_new_int(priority));
+	LUKS2_hdr_index_invalidate(hdr);
 
 	return commit ? LUKS2_hdr_write(cd, hdr) : 0;
 }
@@ -818,6 +1222,7 @@ int placeholder_keyslot_alloc(struct crypt_device *cd,
 	json_object_object_add(jobj_keyslot, "area", jobj_area);
 
 	json_object_object_add_by_uint(jobj_keyslots, keyslot, jobj_keyslot);
+	LUKS2_hdr_index_invalidate(hdr);
 
 	return 0;
 }
@@ -961,6 +1366,7 @@ int LUKS2_keyslot_swap(struct crypt_device *cd, struct luks2_hdr *hdr,
 	json_object_get(jobj_keyslot);
 	json_object_get(jobj_keyslot2);
 
+	LUKS2_hdr_index_invalidate(hdr);
 	json_object_object_del_by_uint(jobj_keyslots, keyslot);
 	r = json_object_object_add_by_uint(jobj_keyslots, keyslot, jobj_keyslot2);
 	if (r < 0) {
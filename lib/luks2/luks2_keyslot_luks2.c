@@ -20,6 +20,7 @@
  */
 
 #include "luks2_internal.h"
+#include "utils_device_locking.h"
 
 /* FIXME: move keyslot encryption to crypto backend */
 #include "../luks1/af.h"
@@ -63,9 +64,8 @@ static int luks2_encrypt_to_storage(char *src, size_t srcLength,
 
 	devfd = device_open_locked(cd, device, O_RDWR);
 	if (devfd >= 0) {
-		if (write_lseek_blockwise(devfd, device_block_size(cd, device),
-					  device_alignment(device), src,
-					  srcLength, sector * SECTOR_SIZE) < 0)
+		if (device_write_at(cd, device, devfd, src,
+				    srcLength, sector * SECTOR_SIZE) < 0)
 			r = -EIO;
 		else
 			r = 0;
@@ -81,12 +81,102 @@ static int luks2_encrypt_to_storage(char *src, size_t srcLength,
 #endif
 }
 
+/* Read keyslot area (still encrypted) under metadata read lock */
+static int luks2_read_area(struct crypt_device *cd, char *dst, size_t dstLength, uint64_t offset)
+{
+	struct device *device = crypt_metadata_device(cd);
+	int devfd, r;
+
+	r = device_read_lock(cd, device);
+	if (r) {
+		log_err(cd, _("Failed to acquire read lock on device %s."),
+			device_path(device));
+		return r;
+	}
+
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd >= 0) {
+		if (device_read_at(cd, device, devfd, dst, dstLength, offset) < 0)
+			r = -EIO;
+		else
+			r = 0;
+	} else
+		r = -EIO;
+
+	device_read_unlock(cd, device);
+	return r;
+}
+
+/*
+ * Keyslot area prefetch, the area is read in background while the KDF of
+ * the keyslot runs. The calling thread runs only the KDF meanwhile, so the
+ * reader can use the metadata device (and its lock) of the context.
+ */
+struct luks2_area_prefetch {
+	struct crypt_device *cd;
+	struct crypt_thread thread;
+	char *buf;
+	size_t len;
+	uint64_t offset;
+	int r;
+	bool threaded;
+};
+
+static void *luks2_area_prefetch_thread(void *arg)
+{
+	struct luks2_area_prefetch *p = arg;
+
+	p->r = luks2_read_area(p->cd, p->buf, p->len, p->offset);
+	return NULL;
+}
+
+static void luks2_area_prefetch_start(struct crypt_device *cd, struct luks2_area_prefetch *p,
+	uint64_t offset, size_t len)
+{
+	p->cd = cd;
+	p->offset = offset;
+	p->len = len;
+	p->r = -EAGAIN;
+	p->threaded = false;
+
+	p->buf = malloc(len);
+	if (!p->buf)
+		return;
+
+	if (crypt_thread_start(&p->thread, luks2_area_prefetch_thread, p, 0)) {
+		/* reading it now would not overlap with anything */
+		free(p->buf);
+		p->buf = NULL;
+		return;
+	}
+	p->threaded = true;
+}
+
+static void luks2_area_prefetch_wait(struct luks2_area_prefetch *p)
+{
+	if (!p->threaded)
+		return;
+
+	crypt_thread_join(&p->thread);
+	p->threaded = false;
+	if (p->r)
+		log_dbg(p->cd, "Keyslot area prefetch failed (%d).", p->r);
+}
+
+static void luks2_area_prefetch_free(struct luks2_area_prefetch *p)
+{
+	luks2_area_prefetch_wait(p);
+	free(p->buf);
+	p->buf = NULL;
+}
+
 static int luks2_decrypt_from_storage(char *dst, size_t dstLength,
 	const char *cipher, const char *cipher_mode, struct volume_key *vk,
-	unsigned int sector, struct crypt_device *cd)
+	unsigned int sector, const struct luks2_area_prefetch *p,
+	struct crypt_device *cd)
 {
-	struct device *device = crypt_metadata_device(cd);
 #ifndef ENABLE_AF_ALG /* Support for old kernel without Crypto API */
+	struct device *device = crypt_metadata_device(cd);
 	int r = device_read_lock(cd, device);
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."), device_path(device));
@@ -97,7 +187,7 @@ static int luks2_decrypt_from_storage(char *dst, size_t dstLength,
 	return r;
 #else
 	struct crypt_storage *s;
-	int devfd, r;
+	int r;
 
 	/* Only whole sector writes supported */
 	if (MISALIGNED_512(dstLength))
@@ -109,32 +199,23 @@ static int luks2_decrypt_from_storage(char *dst, size_t dstLength,
 		return r;
 	}
 
-	r = device_read_lock(cd, device);
-	if (r) {
-		log_err(cd, _("Failed to acquire read lock on device %s."),
-			device_path(device));
-		crypt_storage_destroy(s);
-		return r;
+	if (p && p->buf && !p->r && p->len == dstLength &&
+	    p->offset == (uint64_t)sector * SECTOR_SIZE) {
+		log_dbg(cd, "Using prefetched keyslot area.");
+		memcpy(dst, p->buf, dstLength);
+		r = 0;
+	} else {
+		r = luks2_read_area(cd, dst, dstLength, (uint64_t)sector * SECTOR_SIZE);
+		if (r == -EBUSY)
+			goto out;
 	}
 
-	devfd = device_open_locked(cd, device, O_RDONLY);
-	if (devfd >= 0) {
-		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-					 device_alignment(device), dst,
-					 dstLength, sector * SECTOR_SIZE) < 0)
-			r = -EIO;
-		else
-			r = 0;
-	} else
-		r = -EIO;
-
-	device_read_unlock(cd, device);
-
 	/* Decrypt buffer */
 	if (!r)
 		r = crypt_storage_decrypt(s, 0, dstLength, dst);
 	else
 		log_err(cd, _("IO error while decrypting keyslot."));
+out:
 
 	crypt_storage_destroy(s);
 	return r;
@@ -196,49 +277,112 @@ static int luks2_keyslot_get_pbkdf_params(json_object *jobj_keyslot,
 	return 0;
 }
 
-static int luks2_keyslot_set_key(struct crypt_device *cd,
+static int luks2_keyslot_get_area(json_object *jobj_keyslot,
+	const char **af_hash, char *cipher, char *cipher_mode,
+	uint64_t *area_offset, size_t *keyslot_key_len)
+{
+	json_object *jobj2, *jobj_af, *jobj_area;
+	int r;
+
+	if (!json_object_object_get_ex(jobj_keyslot, "af", &jobj_af) ||
+	    !json_object_object_get_ex(jobj_keyslot, "area", &jobj_area))
+		return -EINVAL;
+
+	if (!json_object_object_get_ex(jobj_af, "hash", &jobj2))
+		return -EINVAL;
+	*af_hash = json_object_get_string(jobj2);
+
+	if (!json_object_object_get_ex(jobj_area, "offset", &jobj2))
+		return -EINVAL;
+	*area_offset = crypt_jobj_get_uint64(jobj2);
+
+	if (!json_object_object_get_ex(jobj_area, "encryption", &jobj2))
+		return -EINVAL;
+	r = crypt_parse_name_and_mode(json_object_get_string(jobj2), cipher, NULL, cipher_mode);
+	if (r < 0)
+		return r;
+
+	if (!json_object_object_get_ex(jobj_area, "key_size", &jobj2))
+		return -EINVAL;
+	*keyslot_key_len = json_object_get_int(jobj2);
+
+	return 0;
+}
+
+static int luks2_keyslot_set_key_derived(struct crypt_device *cd,
 	json_object *jobj_keyslot,
-	const char *password, size_t passwordLen,
+	struct volume_key *derived_key,
 	const char *volume_key, size_t volume_key_len)
 {
-	struct volume_key *derived_key;
-	char *salt = NULL, cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
 	char *AfKey = NULL;
 	const char *af_hash = NULL;
 	size_t AFEKSize, keyslot_key_len;
-	json_object *jobj2, *jobj_kdf, *jobj_af, *jobj_area;
+	json_object *jobj2;
 	uint64_t area_offset;
-	struct crypt_pbkdf_type pbkdf;
 	int r;
 
-	if (!json_object_object_get_ex(jobj_keyslot, "kdf", &jobj_kdf) ||
-	    !json_object_object_get_ex(jobj_keyslot, "af", &jobj_af) ||
-	    !json_object_object_get_ex(jobj_keyslot, "area", &jobj_area))
-		return -EINVAL;
-
 	/* prevent accidental volume key size change after allocation */
 	if (!json_object_object_get_ex(jobj_keyslot, "key_size", &jobj2))
 		return -EINVAL;
 	if (json_object_get_int(jobj2) != (int)volume_key_len)
 		return -EINVAL;
 
-	if (!json_object_object_get_ex(jobj_area, "offset", &jobj2))
-		return -EINVAL;
-	area_offset = crypt_jobj_get_uint64(jobj2);
+	r = luks2_keyslot_get_area(jobj_keyslot, &af_hash, cipher, cipher_mode,
+				   &area_offset, &keyslot_key_len);
+	if (r < 0)
+		return r;
 
-	if (!json_object_object_get_ex(jobj_area, "encryption", &jobj2))
+	if (derived_key->keylength != keyslot_key_len)
 		return -EINVAL;
-	r = crypt_parse_name_and_mode(json_object_get_string(jobj2), cipher, NULL, cipher_mode);
+
+	// FIXME: verity key_size to AFEKSize
+	AFEKSize = AF_split_sectors(volume_key_len, LUKS_STRIPES) * SECTOR_SIZE;
+	AfKey = crypt_safe_alloc(AFEKSize);
+	if (!AfKey)
+		return -ENOMEM;
+
+	r = crypt_hash_size(af_hash);
+	if (r < 0)
+		log_err(cd, _("Hash algorithm %s is not available."), af_hash);
+	else
+		r = AF_split(cd, volume_key, AfKey, volume_key_len, LUKS_STRIPES, af_hash);
+
+	if (r == 0) {
+		log_dbg(cd, "Updating keyslot area [0x%04" PRIx64 "].", area_offset);
+		/* FIXME: sector_offset should be size_t, fix LUKS_encrypt... accordingly */
+		r = luks2_encrypt_to_storage(AfKey, AFEKSize, cipher, cipher_mode,
+				    derived_key, (unsigned)(area_offset / SECTOR_SIZE), cd);
+	}
+
+	crypt_safe_free(AfKey);
 	if (r < 0)
 		return r;
 
-	if (!json_object_object_get_ex(jobj_area, "key_size", &jobj2))
-		return -EINVAL;
-	keyslot_key_len = json_object_get_int(jobj2);
+	return 0;
+}
 
-	if (!json_object_object_get_ex(jobj_af, "hash", &jobj2))
+static int luks2_keyslot_set_key(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	const char *password, size_t passwordLen,
+	const char *volume_key, size_t volume_key_len)
+{
+	struct volume_key *derived_key;
+	char *salt = NULL, cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	const char *af_hash = NULL;
+	size_t keyslot_key_len;
+	uint64_t area_offset;
+	struct crypt_pbkdf_type pbkdf;
+	struct crypt_perf_kdf perf;
+	int r;
+
+	if (!json_object_object_get_ex(jobj_keyslot, "kdf", NULL))
 		return -EINVAL;
-	af_hash = json_object_get_string(jobj2);
+
+	r = luks2_keyslot_get_area(jobj_keyslot, &af_hash, cipher, cipher_mode,
+				   &area_offset, &keyslot_key_len);
+	if (r < 0)
+		return r;
 
 	r = luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, &salt);
 	if (r < 0)
@@ -256,44 +400,69 @@ static int luks2_keyslot_set_key(struct crypt_device *cd,
 	 * Calculate keyslot content, split and store it to keyslot area.
 	 */
 	log_dbg(cd, "Running keyslot key derivation.");
+	trace_kdf_start(pbkdf.type, pbkdf.iterations, pbkdf.max_memory_kb, pbkdf.parallel_threads);
+	crypt_perf_kdf_begin(cd, &perf);
 	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
 			salt, LUKS_SALTSIZE,
 			derived_key->key, derived_key->keylength,
 			pbkdf.iterations, pbkdf.max_memory_kb,
 			pbkdf.parallel_threads);
+	crypt_perf_kdf_end(cd, &perf);
+	trace_kdf_end(pbkdf.type, r);
 	free(salt);
-	if (r < 0) {
-		crypt_free_volume_key(derived_key);
+
+	if (r == 0)
+		r = luks2_keyslot_set_key_derived(cd, jobj_keyslot, derived_key,
+						  volume_key, volume_key_len);
+
+	crypt_free_volume_key(derived_key);
+	return r;
+}
+
+/*
+ * Decrypt keyslot content with already derived key and merge it.
+ */
+static int luks2_keyslot_get_key_derived(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	struct volume_key *derived_key,
+	const struct luks2_area_prefetch *prefetch,
+	char *volume_key, size_t volume_key_len)
+{
+	char *AfKey, cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	const char *af_hash = NULL;
+	uint64_t area_offset;
+	size_t AFEKSize, keyslot_key_len;
+	int r;
+
+	r = luks2_keyslot_get_area(jobj_keyslot, &af_hash, cipher, cipher_mode,
+				   &area_offset, &keyslot_key_len);
+	if (r < 0)
 		return r;
-	}
 
-	// FIXME: verity key_size to AFEKSize
+	if (derived_key->keylength != keyslot_key_len)
+		return -EINVAL;
+
 	AFEKSize = AF_split_sectors(volume_key_len, LUKS_STRIPES) * SECTOR_SIZE;
 	AfKey = crypt_safe_alloc(AFEKSize);
-	if (!AfKey) {
-		crypt_free_volume_key(derived_key);
+	if (!AfKey)
 		return -ENOMEM;
-	}
 
-	r = crypt_hash_size(af_hash);
-	if (r < 0)
-		log_err(cd, _("Hash algorithm %s is not available."), af_hash);
-	else
-		r = AF_split(cd, volume_key, AfKey, volume_key_len, LUKS_STRIPES, af_hash);
+	log_dbg(cd, "Reading keyslot area [0x%04" PRIx64 "].", area_offset);
+	/* FIXME: sector_offset should be size_t, fix LUKS_decrypt... accordingly */
+	r = luks2_decrypt_from_storage(AfKey, AFEKSize, cipher, cipher_mode,
+			      derived_key, (unsigned)(area_offset / SECTOR_SIZE), prefetch, cd);
 
 	if (r == 0) {
-		log_dbg(cd, "Updating keyslot area [0x%04" PRIx64 "].", area_offset);
-		/* FIXME: sector_offset should be size_t, fix LUKS_encrypt... accordingly */
-		r = luks2_encrypt_to_storage(AfKey, AFEKSize, cipher, cipher_mode,
-				    derived_key, (unsigned)(area_offset / SECTOR_SIZE), cd);
+		r = crypt_hash_size(af_hash);
+		if (r < 0)
+			log_err(cd, _("Hash algorithm %s is not available."), af_hash);
+		else
+			r = AF_merge(AfKey, volume_key, volume_key_len, LUKS_STRIPES, af_hash);
 	}
 
 	crypt_safe_free(AfKey);
-	crypt_free_volume_key(derived_key);
-	if (r < 0)
-		return r;
 
-	return 0;
+	return r;
 }
 
 static int luks2_keyslot_get_key(struct crypt_device *cd,
@@ -301,40 +470,23 @@ static int luks2_keyslot_get_key(struct crypt_device *cd,
 	const char *password, size_t passwordLen,
 	char *volume_key, size_t volume_key_len)
 {
+	struct crypt_kdf_memory_handle *kdf_memory = NULL;
+	struct luks2_area_prefetch prefetch = {};
 	struct volume_key *derived_key = NULL;
 	struct crypt_pbkdf_type pbkdf;
-	char *AfKey = NULL;
-	size_t AFEKSize;
 	const char *af_hash = NULL;
 	char *salt = NULL, cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
-	json_object *jobj2, *jobj_af, *jobj_area;
 	uint64_t area_offset;
 	size_t keyslot_key_len;
 	bool try_serialize_lock = false;
+	struct crypt_perf_kdf perf;
 	int r;
 
-	if (!json_object_object_get_ex(jobj_keyslot, "af", &jobj_af) ||
-	    !json_object_object_get_ex(jobj_keyslot, "area", &jobj_area))
-		return -EINVAL;
-
-	if (!json_object_object_get_ex(jobj_af, "hash", &jobj2))
-		return -EINVAL;
-	af_hash = json_object_get_string(jobj2);
-
-	if (!json_object_object_get_ex(jobj_area, "offset", &jobj2))
-		return -EINVAL;
-	area_offset = crypt_jobj_get_uint64(jobj2);
-
-	if (!json_object_object_get_ex(jobj_area, "encryption", &jobj2))
-		return -EINVAL;
-	r = crypt_parse_name_and_mode(json_object_get_string(jobj2), cipher, NULL, cipher_mode);
+	r = luks2_keyslot_get_area(jobj_keyslot, &af_hash, cipher, cipher_mode,
+				   &area_offset, &keyslot_key_len);
 	if (r < 0)
 		return r;
 
-	if (!json_object_object_get_ex(jobj_area, "key_size", &jobj2))
-		return -EINVAL;
-	keyslot_key_len = json_object_get_int(jobj2);
-
 	r = luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, &salt);
 	if (r < 0)
 		return r;
@@ -348,13 +500,6 @@ static int luks2_keyslot_get_key(struct crypt_device *cd,
 		goto out;
 	}
 
-	AFEKSize = AF_split_sectors(volume_key_len, LUKS_STRIPES) * SECTOR_SIZE;
-	AfKey = crypt_safe_alloc(AFEKSize);
-	if (!AfKey) {
-		r = -ENOMEM;
-		goto out;
-	}
-
 	/*
 	 * If requested, serialize unlocking for memory-hard KDF. Usually NOOP.
 	 */
@@ -363,37 +508,44 @@ static int luks2_keyslot_get_key(struct crypt_device *cd,
 	if (try_serialize_lock && (r = crypt_serialize_lock(cd)))
 		goto out;
 
+	/* Queue if concurrent unlocks would exceed memory */
+	if ((r = crypt_kdf_memory_acquire(cd, pbkdf.max_memory_kb, &kdf_memory))) {
+		if (try_serialize_lock)
+			crypt_serialize_unlock(cd);
+		goto out;
+	}
+
+	/* Keyslot area read overlaps with KDF, it is not needed before */
+	luks2_area_prefetch_start(cd, &prefetch, area_offset,
+				  AF_split_sectors(volume_key_len, LUKS_STRIPES) * SECTOR_SIZE);
+
 	/*
 	 * Calculate derived key, decrypt keyslot content and merge it.
 	 */
 	log_dbg(cd, "Running keyslot key derivation.");
+	trace_kdf_start(pbkdf.type, pbkdf.iterations, pbkdf.max_memory_kb, pbkdf.parallel_threads);
+	crypt_perf_kdf_begin(cd, &perf);
 	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
 			salt, LUKS_SALTSIZE,
 			derived_key->key, derived_key->keylength,
 			pbkdf.iterations, pbkdf.max_memory_kb,
 			pbkdf.parallel_threads);
+	crypt_perf_kdf_end(cd, &perf);
+	trace_kdf_end(pbkdf.type, r);
+
+	luks2_area_prefetch_wait(&prefetch);
 
+	crypt_kdf_memory_release(cd, kdf_memory);
 	if (try_serialize_lock)
 		crypt_serialize_unlock(cd);
 
-	if (r == 0) {
-		log_dbg(cd, "Reading keyslot area [0x%04" PRIx64 "].", area_offset);
-		/* FIXME: sector_offset should be size_t, fix LUKS_decrypt... accordingly */
-		r = luks2_decrypt_from_storage(AfKey, AFEKSize, cipher, cipher_mode,
-				      derived_key, (unsigned)(area_offset / SECTOR_SIZE), cd);
-	}
-
-	if (r == 0) {
-		r = crypt_hash_size(af_hash);
-		if (r < 0)
-			log_err(cd, _("Hash algorithm %s is not available."), af_hash);
-		else
-			r = AF_merge(AfKey, volume_key, volume_key_len, LUKS_STRIPES, af_hash);
-	}
+	if (r == 0)
+		r = luks2_keyslot_get_key_derived(cd, jobj_keyslot, derived_key, &prefetch,
+						  volume_key, volume_key_len);
 out:
+	luks2_area_prefetch_free(&prefetch);
 	free(salt);
 	crypt_free_volume_key(derived_key);
-	crypt_safe_free(AfKey);
 
 	return r;
 }
@@ -524,6 +676,7 @@ static int luks2_keyslot_alloc(struct crypt_device *cd,
 	json_object_object_add(jobj_keyslot, "area", jobj_area);
 
 	json_object_object_add_by_uint(jobj_keyslots, keyslot, jobj_keyslot);
+	LUKS2_hdr_index_invalidate(hdr);
 
 	r = luks2_keyslot_update_json(cd, jobj_keyslot, params);
 
@@ -532,8 +685,10 @@ static int luks2_keyslot_alloc(struct crypt_device *cd,
 		r = -ENOSPC;
 	}
 
-	if (r)
+	if (r) {
 		json_object_object_del_by_uint(jobj_keyslots, keyslot);
+		LUKS2_hdr_index_invalidate(hdr);
+	}
 
 	return r;
 }
@@ -562,6 +717,93 @@ static int luks2_keyslot_open(struct crypt_device *cd,
 				     volume_key, volume_key_len);
 }
 
+static int luks2_keyslot_kdf(struct crypt_device *cd,
+	int keyslot,
+	struct crypt_kdf_job *job)
+{
+	struct luks2_hdr *hdr;
+	json_object *jobj_keyslot;
+	const char *af_hash;
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	uint64_t area_offset;
+	size_t keyslot_key_len;
+	int r;
+
+	if (!(hdr = crypt_get_hdr(cd, CRYPT_LUKS2)))
+		return -EINVAL;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	r = luks2_keyslot_get_area(jobj_keyslot, &af_hash, cipher, cipher_mode,
+				   &area_offset, &keyslot_key_len);
+	if (r < 0)
+		return r;
+
+	/* pbkdf strings point to json, it must stay unchanged until job is done */
+	r = luks2_keyslot_get_pbkdf_params(jobj_keyslot, &job->pbkdf, &job->salt);
+	if (r < 0)
+		return r;
+	job->salt_len = LUKS_SALTSIZE;
+
+	job->derived_key = crypt_alloc_volume_key(keyslot_key_len, NULL);
+	if (!job->derived_key)
+		return -ENOMEM;
+
+	job->keyslot = keyslot;
+
+	return 0;
+}
+
+static int luks2_keyslot_open_derived(struct crypt_device *cd,
+	int keyslot,
+	struct volume_key *derived_key,
+	char *volume_key,
+	size_t volume_key_len)
+{
+	struct luks2_hdr *hdr;
+	json_object *jobj_keyslot;
+
+	log_dbg(cd, "Trying to open LUKS2 keyslot %d with derived key.", keyslot);
+
+	if (!(hdr = crypt_get_hdr(cd, CRYPT_LUKS2)))
+		return -EINVAL;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	return luks2_keyslot_get_key_derived(cd, jobj_keyslot, derived_key, NULL,
+					     volume_key, volume_key_len);
+}
+
+/*
+ * Writes keyslot area only, header (with kdf parameters matching
+ * the derived key) must be written by caller.
+ */
+static int luks2_keyslot_store_derived(struct crypt_device *cd,
+	int keyslot,
+	struct volume_key *derived_key,
+	const char *volume_key,
+	size_t volume_key_len)
+{
+	struct luks2_hdr *hdr;
+	json_object *jobj_keyslot;
+
+	log_dbg(cd, "Storing LUKS2 keyslot %d with derived key.", keyslot);
+
+	if (!(hdr = crypt_get_hdr(cd, CRYPT_LUKS2)))
+		return -EINVAL;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	return luks2_keyslot_set_key_derived(cd, jobj_keyslot, derived_key,
+					     volume_key, volume_key_len);
+}
+
 /*
  * This function must not modify json.
  * It's called after luks2 keyslot validation.
@@ -812,5 +1054,8 @@ const keyslot_handler luks2_keyslot = {
 	.wipe  = luks2_keyslot_wipe,
 	.dump  = luks2_keyslot_dump,
 	.validate = luks2_keyslot_validate,
-	.repair = luks2_keyslot_repair
+	.repair = luks2_keyslot_repair,
+	.kdf   = luks2_keyslot_kdf,
+	.open_derived = luks2_keyslot_open_derived,
+	.store_derived = luks2_keyslot_store_derived
 };
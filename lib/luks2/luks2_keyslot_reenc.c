@@ -52,6 +52,8 @@ static json_object *reencrypt_keyslot_area_jobj(struct crypt_device *cd,
 		json_object_object_add(jobj_area, "sector_size", json_object_new_int64(alignment));
 	} else if (!strcmp(params->resilience, "journal")) {
 		log_dbg(cd, "Setting reencrypt keyslot for journal protection.");
+	} else if (!strcmp(params->resilience, "journal-ring")) {
+		log_dbg(cd, "Setting reencrypt keyslot for journal ring protection.");
 	} else if (!strcmp(params->resilience, "none")) {
 		log_dbg(cd, "Setting reencrypt keyslot for none protection.");
 	} else if (!strcmp(params->resilience, "datashift")) {
@@ -146,9 +148,11 @@ static int reenc_keyslot_alloc(struct crypt_device *cd,
 		json_object_object_add(jobj_keyslot, "direction", json_object_new_string("backward"));
 
 	json_object_object_add_by_uint(jobj_keyslots, keyslot, jobj_keyslot);
+	LUKS2_hdr_index_invalidate(hdr);
 	if (LUKS2_check_json_size(cd, hdr)) {
 		log_dbg(cd, "New keyslot too large to fit in free metadata space.");
 		json_object_object_del_by_uint(jobj_keyslots, keyslot);
+		LUKS2_hdr_index_invalidate(hdr);
 		return -ENOSPC;
 	}
 
@@ -297,7 +301,7 @@ static int reenc_keyslot_validate(struct crypt_device *cd, json_object *jobj_key
 	/* mode (string: encrypt,reencrypt,decrypt)
 	 * direction (string:)
 	 * area {
-	 *   type: (string: datashift, journal, checksum, none, datashift-journal, datashift-checksum)
+	 *   type: (string: datashift, journal, journal-ring, checksum, none, datashift-journal, datashift-checksum)
 	 *   	hash: (string: checksum and datashift-checksum types)
 	 *   	sector_size (uint32:  checksum and datashift-checksum types)
 	 *   	shift_size (uint64: all datashift based types)
@@ -474,6 +478,10 @@ static int reenc_keyslot_load_resilience_primary(struct crypt_device *cd,
 	} else if (!strcmp(type, "journal")) {
 		log_dbg(cd, "Initializing journal resilience mode.");
 		rp->type = REENC_PROTECTION_JOURNAL;
+	} else if (!strcmp(type, "journal-ring")) {
+		log_dbg(cd, "Initializing journal ring resilience mode.");
+		rp->type = REENC_PROTECTION_JOURNAL;
+		rp->p.journal.ring = true;
 	} else if (!strcmp(type, "none")) {
 		log_dbg(cd, "Initializing none resilience mode.");
 		rp->type = REENC_PROTECTION_NONE;
@@ -455,17 +455,39 @@ static void move_keyslot_offset(json_object *jobj, int offset_add)
 	}
 }
 
+/* Keyslot areas are moved in chunks, only one chunk is kept in memory */
+#define MOVE_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Areas can overlap, so chunks are moved from the end if moving forward
+ * and from the start if moving backward (as memmove does).
+ */
+static size_t move_chunk(size_t buf_size, size_t done, size_t chunk_size,
+			 bool from_end, off_t *pos)
+{
+	size_t len = buf_size - done < chunk_size ? buf_size - done : chunk_size;
+
+	*pos = from_end ? (off_t)(buf_size - done - len) : (off_t)done;
+	return len;
+}
+
 static int move_keyslot_areas(struct crypt_device *cd, off_t offset_from,
-			      off_t offset_to, size_t buf_size)
+			      off_t offset_to, size_t buf_size,
+			      int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+			      void *usrptr)
 {
 	int devfd, r = -EIO;
 	struct device *device = crypt_metadata_device(cd);
+	size_t chunk_size, len, next_len, done = 0;
+	bool from_end = offset_to > offset_from, offload = true;
+	off_t pos, next_pos;
 	void *buf = NULL;
 
 	log_dbg(cd, "Moving keyslot areas of size %zu from %jd to %jd.",
 		buf_size, (intmax_t)offset_from, (intmax_t)offset_to);
 
-	if (posix_memalign(&buf, crypt_getpagesize(), buf_size))
+	chunk_size = buf_size < MOVE_CHUNK_SIZE ? buf_size : MOVE_CHUNK_SIZE;
+	if (posix_memalign(&buf, crypt_getpagesize(), chunk_size))
 		return -ENOMEM;
 
 	devfd = device_open(cd, device, O_RDWR);
@@ -478,26 +500,52 @@ static int move_keyslot_areas(struct crypt_device *cd, off_t offset_from,
 	if (posix_fallocate(devfd, offset_to, buf_size))
 		log_dbg(cd, "Preallocation (fallocate) of new keyslot area not available.");
 
-	/* Try to read *new* area to check that area is there (trimmed backup). */
+	/* Try to read end of *new* area to check that area is there (trimmed backup). */
 	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), buf, buf_size,
-				 offset_to)!= (ssize_t)buf_size)
+				 device_alignment(device), buf, chunk_size,
+				 offset_to + buf_size - chunk_size) != (ssize_t)chunk_size)
 		goto out;
 
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), buf, buf_size,
-				 offset_from)!= (ssize_t)buf_size)
-		goto out;
+	while (done < buf_size) {
+		len = move_chunk(buf_size, done, chunk_size, from_end, &pos);
 
-	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
-				  device_alignment(device), buf, buf_size,
-				  offset_to) != (ssize_t)buf_size)
-		goto out;
+		/* in-kernel copy, the first failure switches to read/write for good */
+		if (offload && copy_range(devfd, offset_from + pos, offset_to + pos, len) == (ssize_t)len) {
+			done += len;
+			if (progress)
+				(void)progress(buf_size, done, usrptr);
+			continue;
+		} else if (offload) {
+			log_dbg(cd, "Copy offload not available (errno %d), moving keyslot areas through buffer.", errno);
+			offload = false;
+		}
+
+		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
+					 device_alignment(device), buf, len,
+					 offset_from + pos) != (ssize_t)len)
+			goto out;
+
+		/* Let kernel read the next chunk while this one is written. */
+		if (done + len < buf_size) {
+			next_len = move_chunk(buf_size, done + len, chunk_size, from_end, &next_pos);
+			(void)posix_fadvise(devfd, offset_from + next_pos, next_len, POSIX_FADV_WILLNEED);
+		}
+
+		if (write_lseek_blockwise(devfd, device_block_size(cd, device),
+					  device_alignment(device), buf, len,
+					  offset_to + pos) != (ssize_t)len)
+			goto out;
+
+		done += len;
+		/* Move cannot be interrupted, return value is ignored. */
+		if (progress)
+			(void)progress(buf_size, done, usrptr);
+	}
 
 	r = 0;
 out:
 	device_sync(cd, device);
-	crypt_safe_memzero(buf, buf_size);
+	crypt_safe_memzero(buf, chunk_size);
 	free(buf);
 
 	return r;
@@ -544,7 +592,8 @@ static int luksmeta_header_present(struct crypt_device *cd, off_t luks1_size)
 }
 
 /* Convert LUKS1 -> LUKS2 */
-int LUKS2_luks1_to_luks2(struct crypt_device *cd, struct luks_phdr *hdr1, struct luks2_hdr *hdr2)
+int LUKS2_luks1_to_luks2(struct crypt_device *cd, struct luks_phdr *hdr1, struct luks2_hdr *hdr2,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr), void *usrptr)
 {
 	int r;
 	json_object *jobj = NULL;
@@ -638,7 +687,8 @@ int LUKS2_luks1_to_luks2(struct crypt_device *cd, struct luks_phdr *hdr1, struct
 		goto out;
 	}
 
-	if ((r = move_keyslot_areas(cd, 8 * SECTOR_SIZE, buf_offset, buf_size)) < 0) {
+	if ((r = move_keyslot_areas(cd, 8 * SECTOR_SIZE, buf_offset, buf_size,
+				      progress, usrptr)) < 0) {
 		log_err(cd, _("Unable to move keyslot area."));
 		goto out;
 	}
@@ -707,7 +757,8 @@ static int keyslot_LUKS1_compatible(struct crypt_device *cd, struct luks2_hdr *h
 }
 
 /* Convert LUKS2 -> LUKS1 */
-int LUKS2_luks2_to_luks1(struct crypt_device *cd, struct luks2_hdr *hdr2, struct luks_phdr *hdr1)
+int LUKS2_luks2_to_luks1(struct crypt_device *cd, struct luks2_hdr *hdr2, struct luks_phdr *hdr1,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr), void *usrptr)
 {
 	size_t buf_size, buf_offset;
 	char cipher[LUKS_CIPHERNAME_L], cipher_mode[LUKS_CIPHERMODE_L];
@@ -931,7 +982,8 @@ int LUKS2_luks2_to_luks1(struct crypt_device *cd, struct luks2_hdr *hdr2, struct
 	/* move keyslots 32k -> 4k offset */
 	buf_offset = 2 * LUKS2_HDR_16K_LEN;
 	buf_size   = LUKS2_keyslots_size(hdr2);
-	r = move_keyslot_areas(cd, buf_offset, 8 * SECTOR_SIZE, buf_size);
+	r = move_keyslot_areas(cd, buf_offset, 8 * SECTOR_SIZE, buf_size,
+			       progress, usrptr);
 	if (r < 0) {
 		log_err(cd, _("Unable to move keyslot area."));
 		return r;
@@ -20,10 +20,84 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "luks2_internal.h"
 #include "utils_device_locking.h"
 
+/* minimal number of checksum blocks processed by single thread */
+#define REENC_CSUM_THREAD_MIN_BLOCKS 64
+
+/* adaptive resilience retries the other protection type after this many steps */
+#define REENC_RESILIENCE_PROBE_STEPS 64
+
+/*
+ * Journal ring splits the reencryption keyslot area into two slots. Each slot
+ * starts with a header block identifying the journaled hotzone, so the next
+ * hotzone can be journaled while the current one is being written.
+ */
+#define REENC_JOURNAL_SLOTS 2
+#define REENC_JOURNAL_SLOT_HDR 4096
+#define REENC_JOURNAL_SLOT_MAGIC "LUKSJRNL"
+
+struct reencrypt_journal_slot {
+	char magic[8];
+	uint64_t sequence;
+	uint64_t offset;
+	uint64_t length;
+} __attribute__((packed));
+
+/*
+ * Batched checksum hotzone progress. Block at the end of the reencryption
+ * keyslot area records which chunks of the batch were already written, so
+ * recovery verifies checksums only in chunks that were in flight. The digest
+ * of hotzone checksums binds the record to the committed batch.
+ */
+#define REENC_PROGRESS_BLOCK 4096
+#define REENC_PROGRESS_MAGIC "LUKSPRGS"
+#define REENC_PROGRESS_DIGEST 64
+#define REENC_PROGRESS_BITMAP 416
+
+struct reencrypt_batch_progress {
+	char magic[8];
+	uint64_t offset;
+	uint64_t length;
+	uint64_t chunk_length;
+	uint8_t digest[REENC_PROGRESS_DIGEST];
+	/* record fits in a single 512-byte sector */
+	uint8_t bitmap[REENC_PROGRESS_BITMAP];
+} __attribute__((packed));
+
+/*
+ * Offline read-ahead of the next hotzone. The worker uses its own
+ * file descriptor and buffer so it can run while the current hotzone
+ * is being processed. It must not touch crypt_device context.
+ */
+struct reencrypt_prefetch {
+	struct crypt_thread thread;
+	bool running;
+
+	int devfd;
+	size_t bsize;
+	size_t alignment;
+	uint64_t data_offset;
+
+	uint64_t offset;
+	size_t length;
+	size_t buffer_length;
+	void *buffer;
+	ssize_t read;
+
+	/* journal ring, read hotzone is also stored in next ring slot */
+	int journal_fd;
+	size_t journal_bsize;
+	size_t journal_alignment;
+	uint64_t journal_offset;
+	uint64_t journal_seq;
+	bool journaled;
+};
+
 struct luks2_reencrypt {
 	/* reencryption window attributes */
 	uint64_t offset;
@@ -62,13 +136,66 @@ struct luks2_reencrypt {
 	void *reenc_buffer;
 	ssize_t read;
 
+	struct reencrypt_prefetch *prefetch;
+
 	struct crypt_storage_wrapper *cw1;
 	struct crypt_storage_wrapper *cw2;
 
 	uint32_t wflags1;
 	uint32_t wflags2;
+	unsigned threads;
+	bool numa;
+
+	/* adaptive hotzone length */
+	uint64_t length_max;
+	size_t alignment;
+	uint32_t step_latency_ms;
+
+	/* batched checksum hotzone processed in chunks of reenc_buffer size */
+	uint64_t chunk_length;
+	uint64_t progress_offset;
+
+	/* skip unallocated hotzones during encryption */
+	bool skip_holes;
+	bool discard_unused;	/* clear freed datashift area by discard or zeroes */
+	bool no_read_ahead;
+
+	/* zoned data device, hotzone zones are reset and written sequentially */
+	bool zone_reset;
+
+	/* journal ring, slot and sequence of the last journaled hotzone */
+	uint64_t journal_area_offset;
+	uint64_t journal_slot_length;
+	unsigned journal_slot;
+	uint64_t journal_seq;
+	bool journal_prewritten;
+
+	/* adaptive resilience, protection cost in us per MiB ([0] journal, [1] checksum) */
+	bool rp_adaptive;
+	char rp_hash[LUKS2_CHECKSUM_ALG_L];
+	uint64_t rp_cost[2];
+	unsigned rp_steps;
+
+	/* throttling */
+	uint64_t max_throughput;
+	uint32_t max_io_latency_ms;
+	uint64_t throttle_start_us;
+	uint64_t throttle_bytes;
+	uint64_t pause_us;
+	uint64_t dev_ios;
+	uint64_t dev_ticks;
+
+	/* per step statistics */
+	void (*stats_cb)(const struct crypt_reencrypt_step_stats *stats, void *usrptr);
+	void *stats_usrptr;
+	struct crypt_reencrypt_step_stats stats;
+	uint64_t stats_t;
 
 	struct crypt_lock_handle *reenc_lock;
+
+	/* online overlay table, targets are reused between hotzone steps */
+	struct crypt_dm_active_device overlay_dmd;
+	struct device *hz_dev;
 };
 #if USE_LUKS2_REENCRYPTION
 static uint64_t data_shift_value(struct reenc_protection *rp)
@@ -813,11 +940,29 @@ void LUKS2_reencrypt_protection_erase(struct reenc_protection *rp)
 	}
 }
 
+static void reencrypt_prefetch_destroy(struct reencrypt_prefetch *p)
+{
+	if (!p)
+		return;
+
+	if (p->running)
+		crypt_thread_join(&p->thread);
+	if (p->devfd >= 0)
+		close(p->devfd);
+	if (p->journal_fd >= 0)
+		close(p->journal_fd);
+	free(p->buffer);
+	free(p);
+}
+
 void LUKS2_reencrypt_free(struct crypt_device *cd, struct luks2_reencrypt *rh)
 {
 	if (!rh)
 		return;
 
+	reencrypt_prefetch_destroy(rh->prefetch);
+	rh->prefetch = NULL;
+
 	LUKS2_reencrypt_protection_erase(&rh->rp);
 	LUKS2_reencrypt_protection_erase(&rh->rp_moved_segment);
 
@@ -839,6 +984,9 @@ void LUKS2_reencrypt_free(struct crypt_device *cd, struct luks2_reencrypt *rh)
 	crypt_storage_wrapper_destroy(rh->cw2);
 	rh->cw2 = NULL;
 
+	dm_targets_free(cd, &rh->overlay_dmd);
+	device_free(cd, rh->hz_dev);
+
 	free(rh->device_name);
 	free(rh->overlay_name);
 	free(rh->hotzone_name);
@@ -1023,6 +1171,138 @@ static int reencrypt_offset(struct luks2_hdr *hdr,
 	return -EINVAL;
 }
 
+static uint64_t reencrypt_journal_slot_length(uint64_t area_length)
+{
+	uint64_t length = area_length / REENC_JOURNAL_SLOTS;
+
+	return length - (length % REENC_JOURNAL_SLOT_HDR);
+}
+
+/* the largest hotzone journal can hold */
+static uint64_t reencrypt_journal_capacity(const struct reenc_protection *rp, uint64_t area_length)
+{
+	uint64_t length;
+
+	if (!rp->p.journal.ring)
+		return area_length;
+
+	length = reencrypt_journal_slot_length(area_length);
+
+	return length > REENC_JOURNAL_SLOT_HDR ? length - REENC_JOURNAL_SLOT_HDR : 0;
+}
+
+/*
+ * Header and hotzone data are synced together before metadata commit.
+ * Header of a slot does not match the hotzone in metadata unless the commit
+ * happened, so a torn slot write is never used for recovery.
+ * Must not touch crypt_device context (used from read-ahead thread).
+ */
+static int reencrypt_journal_slot_write(int devfd, size_t bsize, size_t alignment,
+		uint64_t slot_offset, uint64_t sequence, uint64_t offset,
+		const void *buffer, size_t length)
+{
+	struct reencrypt_journal_slot *js;
+	void *block;
+	int r = 0;
+
+	if (posix_memalign(&block, alignment, REENC_JOURNAL_SLOT_HDR))
+		return -ENOMEM;
+
+	memset(block, 0, REENC_JOURNAL_SLOT_HDR);
+	js = block;
+	memcpy(js->magic, REENC_JOURNAL_SLOT_MAGIC, sizeof(js->magic));
+	js->sequence = cpu_to_le64(sequence);
+	js->offset = cpu_to_le64(offset);
+	js->length = cpu_to_le64(length);
+
+	if (pwrite_blockwise(devfd, bsize, alignment, NULL, block,
+			     REENC_JOURNAL_SLOT_HDR, slot_offset) != REENC_JOURNAL_SLOT_HDR ||
+	    pwrite_blockwise(devfd, bsize, alignment, NULL, buffer, length,
+			     slot_offset + REENC_JOURNAL_SLOT_HDR) != (ssize_t)length ||
+	    fdatasync(devfd))
+		r = -EIO;
+
+	free(block);
+	return r;
+}
+
+static int reencrypt_journal_slot_read(struct crypt_device *cd, unsigned slot,
+		uint64_t slot_offset, struct reencrypt_journal_slot *js)
+{
+	struct device *device = crypt_metadata_device(cd);
+	void *block;
+	int devfd, r = -EINVAL;
+
+	devfd = device_open(cd, device, O_RDONLY);
+	if (devfd < 0)
+		return -EINVAL;
+
+	if (posix_memalign(&block, device_alignment(device), REENC_JOURNAL_SLOT_HDR))
+		return -ENOMEM;
+
+	if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				 block, REENC_JOURNAL_SLOT_HDR, slot_offset) == REENC_JOURNAL_SLOT_HDR &&
+	    !memcmp(block, REENC_JOURNAL_SLOT_MAGIC, sizeof(js->magic))) {
+		memcpy(js, block, sizeof(*js));
+		js->sequence = le64_to_cpu(js->sequence);
+		js->offset = le64_to_cpu(js->offset);
+		js->length = le64_to_cpu(js->length);
+		log_dbg(cd, "Journal slot %u: sequence %" PRIu64 ", hotzone offset %" PRIu64
+			", length %" PRIu64 ".", slot, js->sequence, js->offset, js->length);
+		r = 0;
+	}
+
+	free(block);
+	return r;
+}
+
+/* Find the newest slot journaling hotzone at offset, returns offset of its data */
+static int reencrypt_journal_ring_find(struct crypt_device *cd,
+		uint64_t area_offset, uint64_t area_length,
+		uint64_t offset, uint64_t length, uint64_t *data_offset)
+{
+	struct reencrypt_journal_slot js;
+	uint64_t slot_length = reencrypt_journal_slot_length(area_length), sequence = 0;
+	unsigned i;
+	int r = -ENOENT;
+
+	for (i = 0; i < REENC_JOURNAL_SLOTS; i++) {
+		if (reencrypt_journal_slot_read(cd, i, area_offset + i * slot_length, &js) ||
+		    js.offset != offset || js.length != length || (!r && js.sequence < sequence))
+			continue;
+		sequence = js.sequence;
+		*data_offset = area_offset + i * slot_length + REENC_JOURNAL_SLOT_HDR;
+		r = 0;
+	}
+
+	return r;
+}
+
+static int reencrypt_journal_ring_init(struct crypt_device *cd,
+		struct luks2_hdr *hdr, struct luks2_reencrypt *rh)
+{
+	struct reencrypt_journal_slot js;
+	uint64_t area_length;
+	unsigned i;
+
+	if (LUKS2_keyslot_area(hdr, rh->reenc_keyslot, &rh->journal_area_offset, &area_length) < 0)
+		return -EINVAL;
+
+	rh->journal_slot_length = reencrypt_journal_slot_length(area_length);
+	rh->journal_slot = REENC_JOURNAL_SLOTS - 1;
+	rh->journal_seq = 0;
+
+	/* continue after the newest slot of previous run */
+	for (i = 0; i < REENC_JOURNAL_SLOTS; i++)
+		if (!reencrypt_journal_slot_read(cd, i, rh->journal_area_offset + i * rh->journal_slot_length, &js) &&
+		    js.sequence >= rh->journal_seq) {
+			rh->journal_seq = js.sequence;
+			rh->journal_slot = i;
+		}
+
+	return 0;
+}
+
 static uint64_t reencrypt_length(struct crypt_device *cd,
 		struct reenc_protection *rp,
 		uint64_t keyslot_area_length,
@@ -1039,7 +1319,7 @@ static uint64_t reencrypt_length(struct crypt_device *cd,
 	else if (rp->type == REENC_PROTECTION_DATASHIFT)
 		return rp->p.ds.data_shift;
 	else
-		length = keyslot_area_length;
+		length = reencrypt_journal_capacity(rp, keyslot_area_length);
 
 	/* hard limit */
 	if (length > LUKS2_REENCRYPT_MAX_HOTZONE_LENGTH)
@@ -1073,6 +1353,47 @@ static uint64_t reencrypt_length(struct crypt_device *cd,
 	return length;
 }
 
+/*
+ * Zoned devices are efficient (host-managed ones only usable) if every
+ * hotzone covers whole zones, which are reset and written sequentially.
+ * Reset destroys old data, the hotzone must be recoverable from journal
+ * (or not protected at all).
+ */
+static int reencrypt_zones_init(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	uint64_t zone_size, data_offset = crypt_get_data_offset(cd) << SECTOR_SHIFT;
+	int zoned;
+
+	zoned = device_zoned(crypt_data_device(cd), &zone_size);
+	if (zoned <= 0 || !zone_size)
+		return 0;
+
+	log_dbg(cd, "Zoned data device, zone size %" PRIu64 " bytes.", zone_size);
+
+	if ((rh->rp.type == REENC_PROTECTION_JOURNAL || rh->rp.type == REENC_PROTECTION_NONE) &&
+	    !(data_offset % zone_size) && !(zone_size % rh->alignment) &&
+	    rh->length >= zone_size) {
+		rh->length -= rh->length % zone_size;
+		rh->length_max = rh->length;
+		rh->alignment = zone_size;
+		rh->zone_reset = true;
+		log_dbg(cd, "Hotzone aligned to %" PRIu64 " bytes, zones are reset before write.", rh->length);
+		return 0;
+	}
+
+	if (zoned != ZONED_HOST_MANAGED)
+		return 0;
+
+	if (rh->rp.type != REENC_PROTECTION_JOURNAL && rh->rp.type != REENC_PROTECTION_NONE)
+		log_err(cd, _("Only journal or none resilience is supported on host-managed zoned device."));
+	else if (data_offset % zone_size)
+		log_err(cd, _("Data offset is not aligned to zone size (%" PRIu64 " bytes) of zoned device."), zone_size);
+	else
+		log_err(cd, _("Hotzone cannot cover whole zone (%" PRIu64 " bytes) of zoned device."), zone_size);
+
+	return -ENOTSUP;
+}
+
 static int reencrypt_context_init(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	struct luks2_reencrypt *rh,
@@ -1128,6 +1449,12 @@ static int reencrypt_context_init(struct crypt_device *cd,
 		log_dbg(cd, "Invalid reencryption length.");
 		return -EINVAL;
 	}
+	rh->length_max = rh->length;
+	rh->alignment = alignment;
+
+	r = reencrypt_zones_init(cd, rh);
+	if (r)
+		return r;
 
 	if (reencrypt_offset(hdr, rh->direction, device_size, &rh->length, &rh->offset)) {
 		log_dbg(cd, "Failed to get reencryption offset.");
@@ -1178,7 +1505,9 @@ static size_t reencrypt_buffer_length(struct luks2_reencrypt *rh)
 {
 	if (rh->rp.type == REENC_PROTECTION_DATASHIFT)
 		return data_shift_value(&rh->rp);
-	return rh->length;
+	if (rh->chunk_length)
+		return rh->chunk_length;
+	return rh->length_max > rh->length ? rh->length_max : rh->length;
 }
 
 static int reencrypt_load_clean(struct crypt_device *cd,
@@ -1311,13 +1640,16 @@ static int reencrypt_init_storage_wrappers(struct crypt_device *cd,
 	struct volume_key *vk;
 	uint32_t wrapper_flags = (getuid() || geteuid()) ? 0 : DISABLE_KCAPI;
 
+	if (rh->numa)
+		wrapper_flags |= NUMA_LOCAL;
+
 	vk = crypt_volume_key_by_id(vks, rh->digest_old);
-	r = crypt_storage_wrapper_init(cd, &rh->cw1, crypt_data_device(cd),
+	r = crypt_storage_wrapper_init_threads(cd, &rh->cw1, crypt_data_device(cd),
 			reencrypt_get_data_offset_old(hdr),
 			crypt_get_iv_offset(cd),
 			reencrypt_get_sector_size_old(hdr),
 			reencrypt_segment_cipher_old(hdr),
-			vk, wrapper_flags | OPEN_READONLY);
+			vk, wrapper_flags | OPEN_READONLY, rh->threads);
 	if (r) {
 		log_err(cd, _("Failed to initialize old segment storage wrapper."));
 		return r;
@@ -1326,12 +1658,12 @@ static int reencrypt_init_storage_wrappers(struct crypt_device *cd,
 	log_dbg(cd, "Old cipher storage wrapper type: %d.", crypt_storage_wrapper_get_type(rh->cw1));
 
 	vk = crypt_volume_key_by_id(vks, rh->digest_new);
-	r = crypt_storage_wrapper_init(cd, &rh->cw2, crypt_data_device(cd),
+	r = crypt_storage_wrapper_init_threads(cd, &rh->cw2, crypt_data_device(cd),
 			reencrypt_get_data_offset_new(hdr),
 			crypt_get_iv_offset(cd),
 			reencrypt_get_sector_size_new(hdr),
 			reencrypt_segment_cipher_new(hdr),
-			vk, wrapper_flags);
+			vk, wrapper_flags, rh->threads);
 	if (r) {
 		log_err(cd, _("Failed to initialize new segment storage wrapper."));
 		return r;
@@ -1429,19 +1761,173 @@ static int reencrypt_hotzone_protect_ready(struct crypt_device *cd,
 	return 0;
 }
 
+struct reencrypt_csum_job {
+	struct crypt_thread thread;
+	bool started;
+	struct crypt_hash *ch;
+	const char *buffer;
+	size_t blocks;
+	size_t block_size;
+	size_t hash_size;
+	char *checksums;
+	int r;
+};
+
+static void *reencrypt_csum_job_run(void *arg)
+{
+	struct reencrypt_csum_job *job = arg;
+	size_t i;
+
+	for (i = 0; i < job->blocks && !job->r; i++)
+		if (crypt_hash_write(job->ch, job->buffer + i * job->block_size, job->block_size) ||
+		    crypt_hash_final(job->ch, job->checksums + i * job->hash_size, job->hash_size))
+			job->r = -EINVAL;
+
+	return NULL;
+}
+
+/*
+ * Compute digest of each block in buffer. Blocks are split among up to
+ * threads workers, each with its own hash context (the calling thread
+ * processes the first part with rp->p.csum.ch).
+ */
+static int reencrypt_checksums_compute(struct crypt_device *cd,
+	const struct reenc_protection *rp,
+	const void *buffer, size_t buffer_len,
+	void *checksums, unsigned threads)
+{
+	struct reencrypt_csum_job *jobs, job = {
+		.ch = rp->p.csum.ch,
+		.buffer = buffer,
+		.blocks = buffer_len / rp->p.csum.block_size,
+		.block_size = rp->p.csum.block_size,
+		.hash_size = rp->p.csum.hash_size,
+		.checksums = checksums
+	};
+	size_t chunk, done;
+	unsigned i;
+	int r = 0;
+
+	if (threads > job.blocks / REENC_CSUM_THREAD_MIN_BLOCKS)
+		threads = job.blocks / REENC_CSUM_THREAD_MIN_BLOCKS;
+
+	if (threads < 2 || !(jobs = calloc(threads, sizeof(*jobs)))) {
+		reencrypt_csum_job_run(&job);
+		return job.r;
+	}
+
+	chunk = job.blocks / threads;
+
+	for (i = 0, done = 0; i < threads; i++, done += chunk) {
+		jobs[i] = job;
+		jobs[i].buffer += done * job.block_size;
+		jobs[i].blocks = (i == threads - 1) ? job.blocks - done : chunk;
+		jobs[i].checksums += done * job.hash_size;
+		if (i && crypt_hash_init(&jobs[i].ch, rp->p.csum.hash)) {
+			log_dbg(cd, "Failed to initialize hash context for checksum thread.");
+			jobs[i].ch = NULL;
+			threads = i;
+			jobs[i - 1].blocks = job.blocks - (done - chunk);
+			break;
+		}
+	}
+
+	for (i = 1; i < threads; i++) {
+		jobs[i].started = !crypt_thread_start(&jobs[i].thread, reencrypt_csum_job_run, &jobs[i], 0);
+		if (!jobs[i].started)
+			reencrypt_csum_job_run(&jobs[i]);
+	}
+
+	reencrypt_csum_job_run(&jobs[0]);
+
+	for (i = 0; i < threads; i++) {
+		if (jobs[i].started)
+			crypt_thread_join(&jobs[i].thread);
+		if (i)
+			crypt_hash_destroy(jobs[i].ch);
+		if (jobs[i].r && !r)
+			r = jobs[i].r;
+	}
+
+	free(jobs);
+	return r;
+}
+
+static int reencrypt_checksums_digest(const struct reenc_protection *rp,
+		size_t len, uint8_t *digest)
+{
+	struct crypt_hash *ch;
+	int r;
+
+	if (rp->p.csum.hash_size > REENC_PROGRESS_DIGEST || crypt_hash_init(&ch, rp->p.csum.hash))
+		return -EINVAL;
+
+	memset(digest, 0, REENC_PROGRESS_DIGEST);
+	r = crypt_hash_write(ch, rp->p.csum.checksums, len);
+	if (!r)
+		r = crypt_hash_final(ch, (char *)digest, rp->p.csum.hash_size);
+	crypt_hash_destroy(ch);
+
+	return r;
+}
+
+/* Returns bitmap of already written chunks in pg if record matches the hotzone */
+static int reencrypt_batch_progress_read(struct crypt_device *cd,
+		const struct reenc_protection *rp, uint64_t progress_offset,
+		uint64_t offset, uint64_t length, size_t checksums_len,
+		struct reencrypt_batch_progress *pg)
+{
+	struct device *device = crypt_metadata_device(cd);
+	uint8_t digest[REENC_PROGRESS_DIGEST];
+	void *block;
+	int devfd, r = -ENOENT;
+
+	devfd = device_open(cd, device, O_RDONLY);
+	if (devfd < 0)
+		return -EINVAL;
+
+	if (posix_memalign(&block, device_alignment(device), REENC_PROGRESS_BLOCK))
+		return -ENOMEM;
+
+	if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				 block, REENC_PROGRESS_BLOCK, progress_offset) == REENC_PROGRESS_BLOCK &&
+	    !memcmp(block, REENC_PROGRESS_MAGIC, sizeof(pg->magic))) {
+		memcpy(pg, block, sizeof(*pg));
+		if (le64_to_cpu(pg->offset) == offset && le64_to_cpu(pg->length) == length &&
+		    !reencrypt_checksums_digest(rp, checksums_len, digest) &&
+		    !memcmp(digest, pg->digest, REENC_PROGRESS_DIGEST)) {
+			pg->chunk_length = le64_to_cpu(pg->chunk_length);
+			if (pg->chunk_length && !(pg->chunk_length % rp->p.csum.block_size) &&
+			    length / pg->chunk_length < REENC_PROGRESS_BITMAP * 8)
+				r = 0;
+		}
+	}
+
+	free(block);
+	return r;
+}
+
+static bool reencrypt_batch_chunk_done(const struct reencrypt_batch_progress *pg, uint64_t chunk)
+{
+	return pg->bitmap[chunk / 8] & (1 << (chunk % 8));
+}
+
 static int reencrypt_recover_segment(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	struct luks2_reencrypt *rh,
 	struct volume_key *vks)
 {
 	struct volume_key *vk_old, *vk_new;
-	size_t count, s;
+	struct reencrypt_batch_progress pg;
+	size_t count, s, buffer_len, chunk_blocks, buffer_start, buffer_blocks = 0;
+	bool progress = false;
+	unsigned threads;
 	ssize_t read, w;
 	struct reenc_protection *rp;
 	int devfd, r, new_sector_size, old_sector_size, rseg;
 	uint64_t area_offset, area_length, area_length_read, crash_iv_offset,
 		 data_offset = crypt_get_data_offset(cd) << SECTOR_SHIFT;
-	char *checksum_tmp = NULL, *data_buffer = NULL;
+	char *checksum_tmp = NULL, *data_buffer = NULL, *block;
 	struct crypt_storage_wrapper *cw1 = NULL, *cw2 = NULL;
 
 	assert(hdr);
@@ -1493,7 +1979,13 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 		goto out;
 	}
 
-	if (posix_memalign((void**)&data_buffer, device_alignment(crypt_data_device(cd)), rh->length)) {
+	/* checksums recovery reads (possibly batched) hotzone in chunks */
+	buffer_len = rh->length;
+	if (rp->type == REENC_PROTECTION_CHECKSUM && buffer_len > LUKS2_DEFAULT_NONE_REENCRYPTION_LENGTH)
+		buffer_len = LUKS2_DEFAULT_NONE_REENCRYPTION_LENGTH -
+			     (LUKS2_DEFAULT_NONE_REENCRYPTION_LENGTH % rp->p.csum.block_size);
+
+	if (!buffer_len || posix_memalign((void**)&data_buffer, device_alignment(crypt_data_device(cd)), buffer_len)) {
 		r = -ENOMEM;
 		goto out;
 	}
@@ -1518,7 +2010,8 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 			goto out;
 		}
 
-		checksum_tmp = malloc(rp->p.csum.hash_size);
+		chunk_blocks = buffer_len / rp->p.csum.block_size;
+		checksum_tmp = malloc(chunk_blocks * rp->p.csum.hash_size);
 		if (!checksum_tmp) {
 			r = -ENOMEM;
 			goto out;
@@ -1538,32 +2031,54 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 			goto out;
 		}
 
-		read = crypt_storage_wrapper_read(cw2, 0, data_buffer, rh->length);
-		if (read < 0 || (size_t)read != rh->length) {
-			log_err(cd, _("Failed to read hotzone area starting at %" PRIu64 "."), rh->offset + data_offset);
-			r = -EINVAL;
-			goto out;
+		threads = rh->threads ?: (unsigned)crypt_cpusonline();
+
+		/* batched hotzone: already written chunks are skipped */
+		if (area_length_read + REENC_PROGRESS_BLOCK <= area_length &&
+		    !reencrypt_batch_progress_read(cd, rp, area_offset + area_length - REENC_PROGRESS_BLOCK,
+						   rh->offset, rh->length, area_length_read, &pg)) {
+			log_dbg(cd, "Using batch progress record, chunk size %" PRIu64 ".", pg.chunk_length);
+			progress = true;
 		}
 
+		buffer_start = 0;
 		for (s = 0; s < count; s++) {
-			if (crypt_hash_write(rp->p.csum.ch, data_buffer + (s * rp->p.csum.block_size), rp->p.csum.block_size)) {
-				log_dbg(cd, "Failed to write hash.");
-				r = EINVAL;
-				goto out;
+			if (progress && reencrypt_batch_chunk_done(&pg, s * rp->p.csum.block_size / pg.chunk_length)) {
+				/* last block of the chunk */
+				s = ((s * rp->p.csum.block_size / pg.chunk_length + 1) * pg.chunk_length) /
+				    rp->p.csum.block_size - 1;
+				continue;
 			}
-			if (crypt_hash_final(rp->p.csum.ch, checksum_tmp, rp->p.csum.hash_size)) {
-				log_dbg(cd, "Failed to finalize hash.");
-				r = EINVAL;
-				goto out;
+			if (s >= buffer_start + buffer_blocks) {
+				w = rh->length - s * rp->p.csum.block_size;
+				if ((size_t)w > buffer_len)
+					w = buffer_len;
+				read = crypt_storage_wrapper_read(cw2, s * rp->p.csum.block_size, data_buffer, w);
+				if (read < 0 || read != w) {
+					log_err(cd, _("Failed to read hotzone area starting at %" PRIu64 "."),
+						rh->offset + data_offset + s * rp->p.csum.block_size);
+					r = -EINVAL;
+					goto out;
+				}
+				if (reencrypt_checksums_compute(cd, rp, data_buffer, w, checksum_tmp, threads)) {
+					log_dbg(cd, "Failed to compute checksums.");
+					r = -EINVAL;
+					goto out;
+				}
+				buffer_start = s;
+				buffer_blocks = w / rp->p.csum.block_size;
 			}
-			if (!memcmp(checksum_tmp, (char *)rp->p.csum.checksums + (s * rp->p.csum.hash_size), rp->p.csum.hash_size)) {
+			block = data_buffer + (s - buffer_start) * rp->p.csum.block_size;
+
+			if (!memcmp(checksum_tmp + (s - buffer_start) * rp->p.csum.hash_size,
+				    (char *)rp->p.csum.checksums + (s * rp->p.csum.hash_size), rp->p.csum.hash_size)) {
 				log_dbg(cd, "Sector %zu (size %zu, offset %zu) needs recovery", s, rp->p.csum.block_size, s * rp->p.csum.block_size);
-				if (crypt_storage_wrapper_decrypt(cw1, s * rp->p.csum.block_size, data_buffer + (s * rp->p.csum.block_size), rp->p.csum.block_size)) {
+				if (crypt_storage_wrapper_decrypt(cw1, s * rp->p.csum.block_size, block, rp->p.csum.block_size)) {
 					log_err(cd, _("Failed to decrypt sector %zu."), s);
 					r = -EINVAL;
 					goto out;
 				}
-				w = crypt_storage_wrapper_encrypt_write(cw2, s * rp->p.csum.block_size, data_buffer + (s * rp->p.csum.block_size), rp->p.csum.block_size);
+				w = crypt_storage_wrapper_encrypt_write(cw2, s * rp->p.csum.block_size, block, rp->p.csum.block_size);
 				if (w < 0 || (size_t)w != rp->p.csum.block_size) {
 					log_err(cd, _("Failed to recover sector %zu."), s);
 					r = -EINVAL;
@@ -1578,12 +2093,24 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 		log_dbg(cd, "Journal based recovery.");
 
 		/* FIXME: validation candidate */
-		if (rh->length > area_length) {
+		if (rh->length > reencrypt_journal_capacity(rp, area_length)) {
 			r = -EINVAL;
 			log_dbg(cd, "Invalid journal size.");
 			goto out;
 		}
 
+		if (rp->p.journal.ring) {
+			r = reencrypt_journal_ring_find(cd, area_offset, area_length,
+							rh->offset, rh->length, &area_offset);
+			if (r) {
+				log_err(cd, _("No journal ring slot found for hotzone at offset %" PRIu64 "."),
+					rh->offset);
+				r = -EINVAL;
+				goto out;
+			}
+			log_dbg(cd, "Journal ring recovery from offset %" PRIu64 ".", area_offset);
+		}
+
 		/* TODO locking */
 		r = crypt_storage_wrapper_init(cd, &cw1, crypt_metadata_device(cd),
 				area_offset, crash_iv_offset, old_sector_size,
@@ -1708,6 +2235,7 @@ static int reencrypt_add_backup_segment(struct crypt_device *cd,
 		json_object_put(jobj);
 		return -EINVAL;
 	}
+	LUKS2_hdr_index_invalidate(hdr);
 
 	if (strcmp(json_segment_type(jobj), "crypt"))
 		return 0;
@@ -1977,6 +2505,30 @@ static int reencrypt_set_decrypt_shift_segments(struct crypt_device *cd,
 	return r ?: LUKS2_digest_segment_assign(cd, hdr, CRYPT_ANY_SEGMENT, 0, 1, 0);
 }
 
+static uint64_t reencrypt_time_us(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Account time since last lap to counter (only if stats are requested) */
+static void reencrypt_stats_lap(struct luks2_reencrypt *rh, uint64_t *counter)
+{
+	uint64_t now;
+
+	if (!rh->stats_cb)
+		return;
+
+	now = reencrypt_time_us();
+	if (counter)
+		*counter += now - rh->stats_t;
+	rh->stats_t = now;
+}
+
 static int reencrypt_make_targets(struct crypt_device *cd,
 				struct luks2_hdr *hdr,
 				struct device *hz_device,
@@ -2057,43 +2609,53 @@ static int reencrypt_make_targets(struct crypt_device *cd,
  * 	2) can't we derive hotzone device name from crypt context? (unlocked name, device uuid, etc?)
  */
 static int reencrypt_load_overlay_device(struct crypt_device *cd, struct luks2_hdr *hdr,
-	const char *overlay, const char *hotzone, struct volume_key *vks, uint64_t size,
-	uint32_t flags)
+	struct luks2_reencrypt *rh)
 {
 	char hz_path[PATH_MAX];
-	int r;
+	struct crypt_dm_active_device *dmd = &rh->overlay_dmd;
+	struct dm_target *tgt;
+	int r, count = 0;
 
-	struct device *hz_dev = NULL;
-	struct crypt_dm_active_device dmd = {
-		.flags = flags,
-	};
+	log_dbg(cd, "Loading new table for overlay device %s.", rh->overlay_name);
 
-	log_dbg(cd, "Loading new table for overlay device %s.", overlay);
+	if (!rh->hz_dev) {
+		r = snprintf(hz_path, PATH_MAX, "%s/%s", dm_get_dir(), rh->hotzone_name);
+		if (r < 0 || r >= PATH_MAX)
+			return -EINVAL;
 
-	r = snprintf(hz_path, PATH_MAX, "%s/%s", dm_get_dir(), hotzone);
-	if (r < 0 || r >= PATH_MAX) {
-		r = -EINVAL;
-		goto out;
+		r = device_alloc(cd, &rh->hz_dev, hz_path);
+		if (r)
+			return r;
 	}
 
-	r = device_alloc(cd, &hz_dev, hz_path);
-	if (r)
-		goto out;
+	/*
+	 * Keep targets from previous step if segment count is the same,
+	 * only segments that changed are serialized again on reload.
+	 */
+	if (dmd->segment.direction != TARGET_EMPTY)
+		for (tgt = &dmd->segment; tgt; tgt = tgt->next)
+			count++;
 
-	r = dm_targets_allocate(&dmd.segment, LUKS2_segments_count(hdr));
-	if (r)
-		goto out;
+	if (count != LUKS2_segments_count(hdr)) {
+		dm_targets_free(cd, dmd);
+		r = dm_targets_allocate(&dmd->segment, LUKS2_segments_count(hdr));
+		if (r)
+			goto out;
+	}
 
-	r = reencrypt_make_targets(cd, hdr, hz_dev, vks, &dmd.segment, size);
+	dmd->flags = rh->flags;
+	dmd->keep_params = 1;
+
+	r = reencrypt_make_targets(cd, hdr, rh->hz_dev, rh->vks, &dmd->segment, rh->device_size);
 	if (r < 0)
 		goto out;
 
-	r = dm_reload_device(cd, overlay, &dmd, 0, 0);
+	r = dm_reload_device(cd, rh->overlay_name, dmd, 0, 0);
 
 	/* what else on error here ? */
 out:
-	dm_targets_free(cd, &dmd);
-	device_free(cd, hz_dev);
+	if (r < 0)
+		dm_targets_free(cd, dmd);
 
 	return r;
 }
@@ -2269,58 +2831,24 @@ err:
 	return r;
 }
 
-/* TODO:
- * 	1) audit error path. any error in this routine is fatal and should be unlikely.
- * 	   usually it would hint some collision with another userspace process touching
- * 	   dm devices directly.
- */
-static int reenc_refresh_helper_devices(struct crypt_device *cd, const char *overlay, const char *hotzone)
-{
-	int r;
-
-	/*
-	 * we have to explicitly suspend the overlay device before suspending
-	 * the hotzone one. Resuming overlay device (aka switching tables) only
-	 * after suspending the hotzone may lead to deadlock.
-	 *
-	 * In other words: always suspend the stack from top to bottom!
-	 */
-	r = dm_suspend_device(cd, overlay, DM_SUSPEND_SKIP_LOCKFS | DM_SUSPEND_NOFLUSH);
-	if (r) {
-		log_err(cd, _("Failed to suspend device %s."), overlay);
-		return r;
-	}
-
-	/* suspend HZ device */
-	r = dm_suspend_device(cd, hotzone, DM_SUSPEND_SKIP_LOCKFS | DM_SUSPEND_NOFLUSH);
-	if (r) {
-		log_err(cd, _("Failed to suspend device %s."), hotzone);
-		return r;
-	}
-
-	/* resume overlay device: inactive table (with hotozne) -> live */
-	r = dm_resume_device(cd, overlay, DM_RESUME_PRIVATE);
-	if (r)
-		log_err(cd, _("Failed to resume device %s."), overlay);
-
-	return r;
-}
-
 static int reencrypt_refresh_overlay_devices(struct crypt_device *cd,
 		struct luks2_hdr *hdr,
-		const char *overlay,
-		const char *hotzone,
-		struct volume_key *vks,
-		uint64_t device_size,
-		uint32_t flags)
+		struct luks2_reencrypt *rh)
 {
-	int r = reencrypt_load_overlay_device(cd, hdr, overlay, hotzone, vks, device_size, flags);
+	int r = reencrypt_load_overlay_device(cd, hdr, rh);
 	if (r) {
-		log_err(cd, _("Failed to reload device %s."), overlay);
+		log_err(cd, _("Failed to reload device %s."), rh->overlay_name);
 		return REENC_ERR;
 	}
 
-	r = reenc_refresh_helper_devices(cd, overlay, hotzone);
+	reencrypt_stats_lap(rh, NULL);
+
+	/*
+	 * Overlay table is already loaded (inactive), only the switch itself
+	 * stalls application I/O. Hotzone stays suspended until step finishes.
+	 */
+	r = dm_suspend_lower_and_switch(cd, rh->overlay_name, rh->hotzone_name);
+	reencrypt_stats_lap(rh, &rh->stats.switch_us);
 	if (r) {
 		log_err(cd, _("Failed to refresh reencryption devices stack."));
 		return REENC_ROLLBACK;
@@ -2329,15 +2857,69 @@ static int reencrypt_refresh_overlay_devices(struct crypt_device *cd,
 	return REENC_OK;
 }
 
-static int reencrypt_move_data(struct crypt_device *cd,
-	int devfd,
-	uint64_t data_shift,
+/* data moved by datashift in chunks of at most this size (two buffers in flight) */
+#define REENC_MOVE_CHUNK (4 * 1024 * 1024)
+
+struct reencrypt_move_write {
+	struct crypt_thread thread;
+	bool running;
+
+	int devfd;
+	size_t bsize;
+	size_t alignment;
+	struct io_scratch scratch;
+
+	const void *buffer;
+	size_t length;
+	uint64_t offset;
+	ssize_t written;
+};
+
+static void *reencrypt_move_write_worker(void *arg)
+{
+	struct reencrypt_move_write *w = arg;
+
+	w->written = pwrite_blockwise(w->devfd, w->bsize, w->alignment, &w->scratch,
+				      w->buffer, w->length, w->offset);
+
+	return NULL;
+}
+
+static int reencrypt_move_write_wait(struct crypt_device *cd, struct reencrypt_move_write *w)
+{
+	if (w->running) {
+		crypt_thread_join(&w->thread);
+		w->running = false;
+	}
+
+	if (w->length && (w->written < 0 || (size_t)w->written != w->length)) {
+		log_dbg(cd, "Failed to write data at offset %" PRIu64 " (size: %zu)",
+			w->offset, w->length);
+		return -EIO;
+	}
+
+	w->length = 0;
+	return 0;
+}
+
+/*
+ * Move the first segment in chunks. Next chunk is read while previous one
+ * is being written. Chunks are processed from the end when data move to higher
+ * offset, so an overlapping source area is never overwritten before it is read.
+ */
+static int reencrypt_move_data(struct crypt_device *cd,
+	int devfd,
+	uint64_t data_shift,
 	crypt_reencrypt_mode_info mode)
 {
-	void *buffer;
-	int r;
+	struct reencrypt_move_write w = { .devfd = devfd };
+	struct io_scratch scratch = {};
+	void *buffers[2] = {};
+	int i = 0, r;
 	ssize_t ret;
-	uint64_t buffer_len, offset,
+	bool backward, offload = true;
+	size_t chunk_len, buffers_len;
+	uint64_t buffer_len, offset, done, pos,
 		 read_offset = (mode == CRYPT_REENCRYPT_ENCRYPT ? 0 : data_shift);
 	struct luks2_hdr *hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
 
@@ -2346,37 +2928,75 @@ static int reencrypt_move_data(struct crypt_device *cd,
 	if (!buffer_len || buffer_len > data_shift)
 		return -EINVAL;
 
-	if (posix_memalign(&buffer, device_alignment(crypt_data_device(cd)), buffer_len))
-		return -ENOMEM;
+	w.bsize = device_block_size(cd, crypt_data_device(cd));
+	w.alignment = device_alignment(crypt_data_device(cd));
+	chunk_len = buffers_len = buffer_len < REENC_MOVE_CHUNK ? buffer_len : REENC_MOVE_CHUNK;
+	backward = offset > read_offset;
 
-	ret = read_lseek_blockwise(devfd,
-			device_block_size(cd, crypt_data_device(cd)),
-			device_alignment(crypt_data_device(cd)),
-			buffer, buffer_len, read_offset);
-	if (ret < 0 || (uint64_t)ret != buffer_len) {
-		log_dbg(cd, "Failed to read data at offset %" PRIu64 " (size: %zu)",
-			read_offset, buffer_len);
-		r = -EIO;
+	if (posix_memalign(&buffers[0], w.alignment, buffers_len) ||
+	    posix_memalign(&buffers[1], w.alignment, buffers_len)) {
+		r = -ENOMEM;
 		goto out;
 	}
 
-	log_dbg(cd, "Going to write %" PRIu64 " bytes read at offset %" PRIu64 " to new offset %" PRIu64,
-		buffer_len, read_offset, offset);
-	ret = write_lseek_blockwise(devfd,
-			device_block_size(cd, crypt_data_device(cd)),
-			device_alignment(crypt_data_device(cd)),
-			buffer, buffer_len, offset);
-	if (ret < 0 || (uint64_t)ret != buffer_len) {
-		log_dbg(cd, "Failed to write data at offset %" PRIu64 " (size: %zu)",
-			offset, buffer_len);
-		r = -EIO;
-		goto out;
+	log_dbg(cd, "Going to move %" PRIu64 " bytes from offset %" PRIu64 " to new offset %" PRIu64
+		" in %zu bytes chunks.", buffer_len, read_offset, offset, chunk_len);
+
+	for (done = 0; done < buffer_len; done += chunk_len, i ^= 1) {
+		if (chunk_len > buffer_len - done)
+			chunk_len = buffer_len - done;
+		pos = backward ? buffer_len - done - chunk_len : done;
+
+		/* in-kernel copy, the first failure switches to the userspace loop for good */
+		if (offload) {
+			if (copy_range(devfd, read_offset + pos, offset + pos, chunk_len) == (ssize_t)chunk_len) {
+				log_dbg(cd, "Moved (offloaded) %" PRIu64 " of %" PRIu64 " bytes.",
+					done + chunk_len, buffer_len);
+				continue;
+			}
+			log_dbg(cd, "Copy offload not available (errno %d), moving data through buffers.", errno);
+			offload = false;
+		}
+
+		/* write from this buffer finished before the previous chunk was submitted */
+		ret = pread_blockwise(devfd, w.bsize, w.alignment, &scratch,
+				      buffers[i], chunk_len, read_offset + pos);
+		if (ret < 0 || (size_t)ret != chunk_len) {
+			log_dbg(cd, "Failed to read data at offset %" PRIu64 " (size: %zu)",
+				read_offset + pos, chunk_len);
+			r = -EIO;
+			goto out;
+		}
+
+		r = reencrypt_move_write_wait(cd, &w);
+		if (r)
+			goto out;
+
+		w.buffer = buffers[i];
+		w.length = chunk_len;
+		w.offset = offset + pos;
+		w.running = !crypt_thread_start(&w.thread, reencrypt_move_write_worker, &w, 0);
+		if (!w.running)
+			reencrypt_move_write_worker(&w);
+
+		log_dbg(cd, "Moved %" PRIu64 " of %" PRIu64 " bytes.", done + chunk_len, buffer_len);
 	}
 
-	r = 0;
+	r = reencrypt_move_write_wait(cd, &w);
+	if (!r && fsync(devfd) < 0 && errno != EINVAL) {
+		log_dbg(cd, "Failed to sync moved data.");
+		r = -EIO;
+	}
 out:
-	crypt_safe_memzero(buffer, buffer_len);
-	free(buffer);
+	if (reencrypt_move_write_wait(cd, &w) && !r)
+		r = -EIO;
+	for (i = 0; i < 2; i++) {
+		if (buffers[i])
+			crypt_safe_memzero(buffers[i], buffers_len);
+		free(buffers[i]);
+	}
+	io_scratch_free(&scratch);
+	io_scratch_free(&w.scratch);
 	return r;
 }
 
@@ -2650,7 +3270,7 @@ static int reencrypt_verify_resilience_params(struct crypt_device *cd,
 	if (!params || !params->resilience)
 		return 0;
 
-	if (!strcmp(params->resilience, "journal"))
+	if (!strcmp(params->resilience, "journal") || !strcmp(params->resilience, "journal-ring"))
 		return (params->data_shift || move_first_segment) ? -EINVAL : 0;
 	else if (!strcmp(params->resilience, "none"))
 		return (params->data_shift || move_first_segment) ? -EINVAL : 0;
@@ -2703,7 +3323,7 @@ int LUKS2_reencrypt_max_hotzone_size(struct crypt_device *cd,
 		return -EINVAL;
 
 	if (rp->type == REENC_PROTECTION_JOURNAL) {
-		*r_length = area_length;
+		*r_length = reencrypt_journal_capacity(rp, area_length);
 		return 0;
 	}
 
@@ -3118,13 +3738,27 @@ out:
 	return r;
 }
 
+static int reencrypt_hotzone_checksums(struct crypt_device *cd,
+	const struct reenc_protection *rp,
+	const void *buffer, size_t buffer_len, size_t checksums_offset,
+	unsigned threads)
+{
+	if (reencrypt_checksums_compute(cd, rp, buffer, buffer_len,
+					(char *)rp->p.csum.checksums + checksums_offset, threads)) {
+		log_dbg(cd, "Failed to compute hotzone checksums.");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static int reencrypt_hotzone_protect_final(struct crypt_device *cd,
 	struct luks2_hdr *hdr, int reencrypt_keyslot,
 	const struct reenc_protection *rp,
-	const void *buffer, size_t buffer_len)
+	const void *buffer, size_t buffer_len, unsigned threads)
 {
 	const void *pbuffer;
-	size_t data_offset, len;
+	size_t len;
 	int r;
 
 	assert(hdr);
@@ -3136,16 +3770,9 @@ static int reencrypt_hotzone_protect_final(struct crypt_device *cd,
 	if (rp->type == REENC_PROTECTION_CHECKSUM) {
 		log_dbg(cd, "Checksums hotzone resilience.");
 
-		for (data_offset = 0, len = 0; data_offset < buffer_len; data_offset += rp->p.csum.block_size, len += rp->p.csum.hash_size) {
-			if (crypt_hash_write(rp->p.csum.ch, (const char *)buffer + data_offset, rp->p.csum.block_size)) {
-				log_dbg(cd, "Failed to hash sector at offset %zu.", data_offset);
-				return -EINVAL;
-			}
-			if (crypt_hash_final(rp->p.csum.ch, (char *)rp->p.csum.checksums + len, rp->p.csum.hash_size)) {
-				log_dbg(cd, "Failed to finalize hash.");
-				return -EINVAL;
-			}
-		}
+		if (reencrypt_hotzone_checksums(cd, rp, buffer, buffer_len, 0, threads))
+			return -EINVAL;
+		len = (buffer_len / rp->p.csum.block_size) * rp->p.csum.hash_size;
 		pbuffer = rp->p.csum.checksums;
 	} else if (rp->type == REENC_PROTECTION_JOURNAL) {
 		log_dbg(cd, "Journal hotzone resilience.");
@@ -3164,6 +3791,41 @@ static int reencrypt_hotzone_protect_final(struct crypt_device *cd,
 	return r > 0 ? 0 : r;
 }
 
+/* journal ring variant of reencrypt_hotzone_protect_final() */
+static int reencrypt_hotzone_journal_ring(struct crypt_device *cd,
+	struct luks2_hdr *hdr, struct luks2_reencrypt *rh)
+{
+	struct device *device = crypt_metadata_device(cd);
+	unsigned slot = rh->journal_slot ^ 1;
+	int devfd, r;
+
+	if (rh->journal_prewritten)
+		log_dbg(cd, "Hotzone already journaled in ring slot %u.", slot);
+	else {
+		log_dbg(cd, "Journal ring hotzone resilience, slot %u.", slot);
+
+		if ((uint64_t)rh->read > rh->journal_slot_length - REENC_JOURNAL_SLOT_HDR)
+			return -EINVAL;
+
+		devfd = device_open(cd, device, O_RDWR);
+		if (devfd < 0)
+			return -EINVAL;
+
+		r = reencrypt_journal_slot_write(devfd, device_block_size(cd, device),
+				device_alignment(device),
+				rh->journal_area_offset + slot * rh->journal_slot_length,
+				rh->journal_seq + 1, rh->offset, rh->reenc_buffer, rh->read);
+		if (r)
+			return r;
+	}
+
+	rh->journal_prewritten = false;
+	rh->journal_slot = slot;
+	rh->journal_seq++;
+
+	return LUKS2_hdr_write(cd, hdr);
+}
+
 static int reencrypt_context_update(struct crypt_device *cd,
 	struct luks2_reencrypt *rh)
 {
@@ -3354,6 +4016,153 @@ static int reencrypt_lock_and_verify(struct crypt_device *cd, struct luks2_hdr *
 	return -EINVAL;
 }
 
+/*
+ * Adaptive resilience switches between journal and checksum protection
+ * whichever was cheaper in previous hotzones. Both types must be able
+ * to protect the largest hotzone so the hotzone size is not affected.
+ */
+static void reencrypt_setup_adaptive_resilience(struct crypt_device *cd,
+		struct luks2_hdr *hdr, struct luks2_reencrypt *rh, const char *hash)
+{
+	uint64_t dummy, area_length;
+	int hash_size;
+
+	if ((rh->rp.type != REENC_PROTECTION_CHECKSUM && rh->rp.type != REENC_PROTECTION_JOURNAL) ||
+	    (rh->rp.type == REENC_PROTECTION_JOURNAL && rh->rp.p.journal.ring) ||
+	    rh->jobj_segment_moved || rh->chunk_length || rh->zone_reset) {
+		log_dbg(cd, "Adaptive resilience is supported only with checksum or journal resilience.");
+		return;
+	}
+
+	if (rh->rp.type == REENC_PROTECTION_CHECKSUM)
+		hash = rh->rp.p.csum.hash;
+	else if (!hash)
+		hash = "sha256";
+
+	hash_size = crypt_hash_size(hash);
+	if (hash_size <= 0 || strlen(hash) >= sizeof(rh->rp_hash) ||
+	    LUKS2_keyslot_area(hdr, rh->reenc_keyslot, &dummy, &area_length) < 0)
+		return;
+
+	if (rh->length_max > area_length ||
+	    (rh->length_max / rh->alignment) * hash_size > area_length) {
+		log_dbg(cd, "Reencryption keyslot area too small for adaptive resilience.");
+		return;
+	}
+
+	strcpy(rh->rp_hash, hash);
+	rh->rp_adaptive = true;
+	log_dbg(cd, "Adaptive resilience between journal and checksum (%s) enabled.", hash);
+}
+
+/*
+ * Called before hotzone segments are set, so a switch is committed with
+ * clean metadata. The new type is stored in reencryption keyslot and
+ * covered by reencryption digest, recovery uses exactly the type that
+ * protected the interrupted hotzone.
+ */
+static int reencrypt_adapt_resilience(struct crypt_device *cd,
+		struct luks2_hdr *hdr, struct luks2_reencrypt *rh)
+{
+	struct crypt_params_reencrypt params = { .hash = rh->rp_hash };
+	unsigned cur, other;
+	int r;
+
+	if (!rh->rp_adaptive)
+		return 0;
+
+	cur = rh->rp.type == REENC_PROTECTION_CHECKSUM;
+	other = !cur;
+
+	if (!rh->rp_cost[cur])
+		return 0;
+
+	/* retry the other type from time to time, cost of the device may vary */
+	if (rh->rp_cost[other] && ++rh->rp_steps < REENC_RESILIENCE_PROBE_STEPS &&
+	    rh->rp_cost[other] * 5 >= rh->rp_cost[cur] * 4)
+		return 0;
+
+	rh->rp_steps = 0;
+	params.resilience = other ? "checksum" : "journal";
+	log_dbg(cd, "Switching to %s resilience (cost %" PRIu64 " us/MiB, current %" PRIu64 " us/MiB).",
+		params.resilience, rh->rp_cost[other], rh->rp_cost[cur]);
+
+	r = LUKS2_keyslot_reencrypt_update(cd, hdr, rh->reenc_keyslot, &params, rh->alignment, rh->vks);
+	if (r < 0)
+		return r;
+
+	LUKS2_reencrypt_protection_erase(&rh->rp);
+	memset(&rh->rp, 0, sizeof(rh->rp));
+
+	return LUKS2_keyslot_reencrypt_load(cd, hdr, rh->reenc_keyslot, &rh->rp, true);
+}
+
+static void reencrypt_resilience_cost(struct luks2_reencrypt *rh, uint64_t us)
+{
+	unsigned cur = rh->rp.type == REENC_PROTECTION_CHECKSUM;
+	uint64_t cost;
+
+	if (rh->read <= 0)
+		return;
+
+	cost = (us * 1024 * 1024) / rh->read ?: 1;
+	rh->rp_cost[cur] = rh->rp_cost[cur] ? (3 * rh->rp_cost[cur] + cost) / 4 : cost;
+}
+
+/*
+ * Group several buffer sized chunks into single checksum protected hotzone
+ * so there is only one resilience and one segments commit per batch.
+ * Hotzone size is limited by checksums area size (without progress block).
+ */
+static void reencrypt_setup_batch(struct crypt_device *cd,
+		struct luks2_hdr *hdr, struct luks2_reencrypt *rh, uint32_t batch)
+{
+	uint64_t chunk, length, end, area_offset, area_length;
+
+	if (rh->rp.type != REENC_PROTECTION_CHECKSUM || rh->jobj_segment_moved) {
+		log_dbg(cd, "Batched hotzones are supported only with checksum resilience.");
+		return;
+	}
+
+	if (rh->rp.p.csum.checksums_len <= REENC_PROGRESS_BLOCK ||
+	    LUKS2_keyslot_area(hdr, rh->reenc_keyslot, &area_offset, &area_length) < 0) {
+		log_dbg(cd, "Checksums area too small for batched hotzones.");
+		return;
+	}
+
+	chunk = reencrypt_buffer_length(rh);
+	length = ((rh->rp.p.csum.checksums_len - REENC_PROGRESS_BLOCK) / rh->rp.p.csum.hash_size) *
+		 rh->rp.p.csum.block_size;
+	if (length > LUKS2_REENCRYPT_MAX_HOTZONE_LENGTH)
+		length = LUKS2_REENCRYPT_MAX_HOTZONE_LENGTH;
+	if (length / batch > chunk)
+		length = chunk * batch;
+	if (length / chunk >= REENC_PROGRESS_BITMAP * 8)
+		length = chunk * (REENC_PROGRESS_BITMAP * 8 - 1);
+	length -= (length % rh->alignment);
+
+	if (length <= chunk) {
+		log_dbg(cd, "Checksums area too small for batched hotzones.");
+		return;
+	}
+
+	rh->chunk_length = chunk;
+	rh->length_max = length;
+	rh->progress_offset = area_offset + area_length - REENC_PROGRESS_BLOCK;
+
+	if (rh->direction == CRYPT_REENCRYPT_FORWARD) {
+		rh->length = length;
+		if (rh->length > rh->device_size - rh->offset)
+			rh->length = rh->device_size - rh->offset;
+	} else {
+		end = rh->offset + rh->length;
+		rh->length = length > end ? end : length;
+		rh->offset = end - rh->length;
+	}
+
+	log_dbg(cd, "Batched hotzone length %" PRIu64 " (chunk %" PRIu64 ").", rh->length, chunk);
+}
+
 static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 		const char *name,
 		const char *passphrase,
@@ -3368,6 +4177,7 @@ static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 	struct crypt_lock_handle *reencrypt_lock;
 	struct luks2_reencrypt *rh;
 	const struct volume_key *vk;
+	const struct crypt_reencrypt_tuning *tuning = crypt_get_reencrypt_tuning(cd);
 	size_t alignment;
 	uint32_t old_sector_size, new_sector_size, sector_size;
 	struct crypt_dm_active_device dmd_target, dmd_source = {
@@ -3527,6 +4337,60 @@ static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 	}
 	device_release_excl(cd, crypt_data_device(cd));
 
+	if (tuning->threads > 1 && rh->zone_reset)
+		log_dbg(cd, "Zoned device is written sequentially by a single thread.");
+	else if (tuning->threads > 1) {
+		rh->threads = tuning->threads;
+		if (rh->threads > crypt_cpusonline())
+			rh->threads = crypt_cpusonline();
+		log_dbg(cd, "Requested %u threads for userspace reencryption.", rh->threads);
+		rh->numa = params && (params->flags & CRYPT_REENCRYPT_NUMA_LOCAL);
+	}
+
+	if (params && (params->flags & CRYPT_REENCRYPT_DISCARD_UNUSED))
+		rh->discard_unused = true;
+
+	if (params && (params->flags & CRYPT_REENCRYPT_NO_READ_AHEAD))
+		rh->no_read_ahead = true;
+
+	if (params && (params->flags & CRYPT_REENCRYPT_SKIP_HOLES)) {
+		if (rh->mode != CRYPT_REENCRYPT_ENCRYPT || rh->rp.type == REENC_PROTECTION_DATASHIFT)
+			log_dbg(cd, "Skipping unallocated areas is supported only for encryption without data shift.");
+		else {
+			rh->skip_holes = true;
+			log_dbg(cd, "Unallocated hotzones will not be encrypted.");
+		}
+	}
+
+	if (tuning->max_throughput) {
+		rh->max_throughput = tuning->max_throughput;
+		log_dbg(cd, "Reencryption throughput limited to %" PRIu64 " bytes/s.", rh->max_throughput);
+	}
+
+	if (tuning->max_io_latency_ms) {
+		if (!name)
+			log_dbg(cd, "I/O latency based backoff is available only for online reencryption.");
+		else {
+			rh->max_io_latency_ms = tuning->max_io_latency_ms;
+			log_dbg(cd, "Reencryption backs off if I/O latency exceeds %" PRIu32 " ms.", rh->max_io_latency_ms);
+		}
+	}
+
+	if (tuning->hotzone_batch > 1)
+		reencrypt_setup_batch(cd, hdr, rh, tuning->hotzone_batch);
+
+	if (params && (params->flags & CRYPT_REENCRYPT_ADAPTIVE_RESILIENCE))
+		reencrypt_setup_adaptive_resilience(cd, hdr, rh, params->hash);
+
+	if (tuning->step_latency_ms) {
+		if (rh->rp.type == REENC_PROTECTION_DATASHIFT)
+			log_dbg(cd, "Adaptive hotzone size not supported with datashift resilience.");
+		else {
+			rh->step_latency_ms = tuning->step_latency_ms;
+			log_dbg(cd, "Adaptive hotzone size targeting %" PRIu32 " ms per step.", rh->step_latency_ms);
+		}
+	}
+
 	/* There's a race for dm device activation not managed by cryptsetup.
 	 *
 	 * 1) excl close
@@ -3714,6 +4578,11 @@ static int reencrypt_init_by_passphrase(struct crypt_device *cd,
 	uint32_t flags = params ? params->flags : 0;
 	struct luks2_hdr *hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
 
+	if (hdr && hdr->batch) {
+		log_err(cd, _("Reencryption cannot be used inside metadata batch."));
+		return -EBUSY;
+	}
+
 	/* short-circuit in reencryption metadata update and finish immediately. */
 	if (flags & CRYPT_REENCRYPT_REPAIR_NEEDED)
 		return reencrypt_repair_by_passphrase(cd, hdr, keyslot_old, keyslot_new, passphrase, passphrase_size);
@@ -3826,6 +4695,423 @@ int crypt_reencrypt_init_by_passphrase(struct crypt_device *cd,
 }
 
 #if USE_LUKS2_REENCRYPTION
+static void *reencrypt_prefetch_worker(void *arg)
+{
+	struct reencrypt_prefetch *p = arg;
+
+	p->read = read_lseek_blockwise(p->devfd, p->bsize, p->alignment,
+			p->buffer, p->length, p->data_offset + p->offset);
+
+	if (p->journal_fd >= 0 && p->read == (ssize_t)p->length)
+		p->journaled = !reencrypt_journal_slot_write(p->journal_fd, p->journal_bsize,
+				p->journal_alignment, p->journal_offset, p->journal_seq,
+				p->offset, p->buffer, p->length);
+
+	return NULL;
+}
+
+/*
+ * Read-ahead is possible only if nobody else may write to the next hotzone
+ * before we process it (offline) and hotzones never overlap (no data shift).
+ */
+static int reencrypt_prefetch_init(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	struct luks2_reencrypt *rh)
+{
+	struct reencrypt_prefetch *p;
+	struct device *device = crypt_data_device(cd);
+
+	if (rh->online || rh->rp.type == REENC_PROTECTION_DATASHIFT || rh->jobj_segment_moved ||
+	    rh->chunk_length || rh->no_read_ahead)
+		return -ENOTSUP;
+
+	p = crypt_zalloc(sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+
+	p->journal_fd = -1;
+	p->bsize = device_block_size(cd, device);
+	p->alignment = device_alignment(device);
+	p->data_offset = reencrypt_get_data_offset_old(hdr);
+	p->buffer_length = reencrypt_buffer_length(rh);
+
+	if (!p->bsize || !p->alignment ||
+	    posix_memalign(&p->buffer, p->alignment, p->buffer_length)) {
+		free(p);
+		return -ENOMEM;
+	}
+
+	p->devfd = open(device_path(device), O_RDONLY | O_CLOEXEC |
+			(device_direct_io(device) ? O_DIRECT : 0));
+	if (p->devfd < 0) {
+		reencrypt_prefetch_destroy(p);
+		return -EINVAL;
+	}
+
+	/* journal of the next hotzone is written while current one is processed */
+	if (rh->rp.type == REENC_PROTECTION_JOURNAL && rh->rp.p.journal.ring) {
+		device = crypt_metadata_device(cd);
+		p->journal_bsize = device_block_size(cd, device);
+		p->journal_alignment = device_alignment(device);
+		p->journal_fd = open(device_path(device), O_RDWR | O_CLOEXEC |
+				     (device_direct_io(device) ? O_DIRECT : 0));
+		if (!p->journal_bsize || !p->journal_alignment || p->journal_fd < 0) {
+			reencrypt_prefetch_destroy(p);
+			return -EINVAL;
+		}
+	}
+
+	rh->prefetch = p;
+
+	return 0;
+}
+
+/* Pin hotzone buffers in kernel for io_uring, optional optimization only */
+static int reencrypt_register_buffers(struct luks2_reencrypt *rh)
+{
+	struct iovec iov[2];
+	unsigned count = 0;
+	int r;
+
+	iov[count].iov_base = rh->reenc_buffer;
+	iov[count++].iov_len = reencrypt_buffer_length(rh);
+
+	if (rh->prefetch) {
+		iov[count].iov_base = rh->prefetch->buffer;
+		iov[count++].iov_len = rh->prefetch->buffer_length;
+	}
+
+	r = crypt_storage_wrapper_register_buffers(rh->cw1, iov, count);
+	if (!r && rh->cw2)
+		r = crypt_storage_wrapper_register_buffers(rh->cw2, iov, count);
+
+	return r;
+}
+
+/*
+ * Window of the hotzone that follows the one just read, as computed later
+ * by reencrypt_context_update(). Read-ahead is not used with data shift
+ * or moved segment, so only the plain forward and backward cases are needed.
+ */
+static int reencrypt_next_hotzone(const struct luks2_reencrypt *rh,
+	uint64_t *offset, uint64_t *length)
+{
+	uint64_t next_offset, next_length = rh->length;
+
+	if (rh->read < 0 || rh->progress + (uint64_t)rh->read >= rh->device_size)
+		return -EINVAL;
+
+	if (rh->direction == CRYPT_REENCRYPT_BACKWARD) {
+		if (rh->offset < next_length)
+			next_length = rh->offset;
+		next_offset = rh->offset - next_length;
+	} else if (rh->direction == CRYPT_REENCRYPT_FORWARD) {
+		next_offset = rh->offset + (uint64_t)rh->read;
+		if (next_offset > rh->device_size)
+			return -EINVAL;
+		if (rh->device_size - next_offset < next_length)
+			next_length = rh->device_size - next_offset;
+	} else
+		return -EINVAL;
+
+	if (!next_length)
+		return -EINVAL;
+
+	*offset = next_offset;
+	*length = next_length;
+	return 0;
+}
+
+/* Start reading hotzone that follows the one just read into reenc_buffer */
+static void reencrypt_prefetch_next(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	struct reencrypt_prefetch *p = rh->prefetch;
+	uint64_t offset, length;
+
+	if (!p || p->running)
+		return;
+
+	if (reencrypt_next_hotzone(rh, &offset, &length) || length > p->buffer_length)
+		return;
+
+	p->offset = offset;
+	p->length = length;
+	p->read = -1;
+	p->journaled = false;
+	/*
+	 * Current hotzone goes to the other slot, the next one reuses the slot
+	 * of already finished previous hotzone.
+	 */
+	p->journal_offset = rh->journal_area_offset + rh->journal_slot * rh->journal_slot_length;
+	p->journal_seq = rh->journal_seq + 2;
+
+	if (crypt_thread_start(&p->thread, reencrypt_prefetch_worker, p, 0)) {
+		log_dbg(cd, "Failed to start hotzone read-ahead thread.");
+		return;
+	}
+
+	p->running = true;
+}
+
+static ssize_t reencrypt_hotzone_read(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	struct reencrypt_prefetch *p = rh->prefetch;
+	void *tmp;
+
+	rh->journal_prewritten = false;
+
+	if (p && p->running) {
+		crypt_thread_join(&p->thread);
+		p->running = false;
+
+		if (p->offset == rh->offset && p->length == rh->length &&
+		    p->read == (ssize_t)rh->length) {
+			log_dbg(cd, "Using hotzone data read ahead at offset %" PRIu64 ".", rh->offset);
+			rh->journal_prewritten = p->journaled;
+			tmp = rh->reenc_buffer;
+			rh->reenc_buffer = p->buffer;
+			p->buffer = tmp;
+			return p->read;
+		}
+
+		log_dbg(cd, "Discarding hotzone read-ahead at offset %" PRIu64 ".", p->offset);
+	}
+
+	return crypt_storage_wrapper_read(rh->cw1, rh->offset, rh->reenc_buffer, rh->length);
+}
+
+/* Written after chunk data is synced, a lost update only makes recovery slower */
+static int reencrypt_batch_progress_write(struct crypt_device *cd,
+		struct luks2_reencrypt *rh, struct reencrypt_batch_progress *pg, uint64_t chunk)
+{
+	struct device *device = crypt_metadata_device(cd);
+	int devfd;
+
+	pg->bitmap[chunk / 8] |= 1 << (chunk % 8);
+
+	devfd = device_open(cd, device, O_RDWR);
+	if (devfd < 0)
+		return -EINVAL;
+
+	if (write_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				  pg, REENC_PROGRESS_BLOCK, rh->progress_offset) != REENC_PROGRESS_BLOCK)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Batched checksum hotzone is larger than reenc_buffer. Checksums of the whole
+ * hotzone are stored first (single metadata commit), then the data is read
+ * again and reencrypted chunk by chunk.
+ */
+static reenc_status_t reencrypt_hotzone_batch(struct crypt_device *cd,
+		struct luks2_hdr *hdr,
+		struct luks2_reencrypt *rh,
+		struct reenc_protection *rp)
+{
+	struct reencrypt_batch_progress *pg = NULL;
+	reenc_status_t rs;
+	uint64_t pos;
+	size_t len;
+	ssize_t read;
+	int r;
+
+	for (pos = 0; pos < rh->length; pos += len) {
+		len = rh->length - pos > rh->chunk_length ? rh->chunk_length : rh->length - pos;
+		read = crypt_storage_wrapper_read(rh->cw1, rh->offset + pos, rh->reenc_buffer, len);
+		if (read < 0 || (size_t)read != len) {
+			/* severity normal */
+			log_err(cd, _("Failed to read hotzone area starting at %" PRIu64 "."), rh->offset + pos);
+			return REENC_ROLLBACK;
+		}
+		reencrypt_stats_lap(rh, &rh->stats.read_us);
+
+		if (reencrypt_hotzone_checksums(cd, rp, rh->reenc_buffer, len,
+						(pos / rp->p.csum.block_size) * rp->p.csum.hash_size, rh->threads)) {
+			log_err(cd, _("Failed to write reencryption resilience metadata."));
+			return REENC_ROLLBACK;
+		}
+		reencrypt_stats_lap(rh, &rh->stats.protect_us);
+	}
+
+	/* metadata commit point */
+	len = (rh->length / rp->p.csum.block_size) * rp->p.csum.hash_size;
+	log_dbg(cd, "Going to store %zu bytes in reencrypt keyslot.", len);
+	r = LUKS2_keyslot_reencrypt_store(cd, hdr, rh->reenc_keyslot, rp->p.csum.checksums, len);
+	if (r < 0) {
+		/* severity normal */
+		log_err(cd, _("Failed to write reencryption resilience metadata."));
+		return REENC_ROLLBACK;
+	}
+
+	/* progress record is optional, batch continues without it */
+	if (rh->progress_offset &&
+	    !posix_memalign((void **)&pg, device_alignment(crypt_metadata_device(cd)), REENC_PROGRESS_BLOCK)) {
+		memset(pg, 0, REENC_PROGRESS_BLOCK);
+		memcpy(pg->magic, REENC_PROGRESS_MAGIC, sizeof(pg->magic));
+		pg->offset = cpu_to_le64(rh->offset);
+		pg->length = cpu_to_le64(rh->length);
+		pg->chunk_length = cpu_to_le64(rh->chunk_length);
+		if (reencrypt_checksums_digest(rp, len, pg->digest)) {
+			free(pg);
+			pg = NULL;
+		}
+	}
+	reencrypt_stats_lap(rh, &rh->stats.protect_us);
+
+	for (pos = 0; pos < rh->length; pos += len) {
+		len = rh->length - pos > rh->chunk_length ? rh->chunk_length : rh->length - pos;
+		read = crypt_storage_wrapper_read(rh->cw1, rh->offset + pos, rh->reenc_buffer, len);
+		if (read < 0 || (size_t)read != len) {
+			/* data already written partially, needs recovery */
+			log_err(cd, _("Failed to read hotzone area starting at %" PRIu64 "."), rh->offset + pos);
+			rs = pos ? REENC_FATAL : REENC_ROLLBACK;
+			goto out;
+		}
+		reencrypt_stats_lap(rh, &rh->stats.read_us);
+
+		if (crypt_storage_wrapper_decrypt(rh->cw1, rh->offset + pos, rh->reenc_buffer, len)) {
+			log_err(cd, _("Decryption failed."));
+			rs = pos ? REENC_FATAL : REENC_ROLLBACK;
+			goto out;
+		}
+		reencrypt_stats_lap(rh, &rh->stats.decrypt_us);
+
+		if (read != crypt_storage_wrapper_encrypt_write(rh->cw2, rh->offset + pos, rh->reenc_buffer, len)) {
+			/* severity fatal */
+			log_err(cd, _("Failed to write hotzone area starting at %" PRIu64 "."), rh->offset + pos);
+			rs = REENC_FATAL;
+			goto out;
+		}
+		reencrypt_stats_lap(rh, &rh->stats.encrypt_write_us);
+
+		/* last chunk is covered by following segments commit */
+		if (pg && pos + len < rh->length &&
+		    (crypt_storage_wrapper_datasync(rh->cw2) ||
+		     reencrypt_batch_progress_write(cd, rh, pg, pos / rh->chunk_length))) {
+			log_dbg(cd, "Failed to record batch progress, recovery checks whole hotzone.");
+			free(pg);
+			pg = NULL;
+		}
+	}
+
+	rh->read = rh->length;
+	rs = REENC_OK;
+out:
+	free(pg);
+	return rs;
+}
+
+/*
+ * Scale hotzone length so that a single step takes about step_latency_ms.
+ * Length changes at most by factor of 2 per step and only if off by more
+ * than 25% (to keep read-ahead useful). It stays within the resilience area
+ * and buffer size computed at context init (length_max).
+ */
+static void reencrypt_adapt_length(struct crypt_device *cd,
+		struct luks2_reencrypt *rh, uint64_t step_us)
+{
+	uint64_t target_us, length, length_min;
+
+	if (!rh->step_latency_ms || !step_us || rh->read != (ssize_t)rh->length)
+		return;
+
+	target_us = (uint64_t)rh->step_latency_ms * 1000;
+
+	if (step_us * 4 > target_us * 5)
+		length = rh->length * target_us / step_us;
+	else if (step_us * 4 < target_us * 3)
+		length = step_us * 2 < target_us ? rh->length * 2 : rh->length * target_us / step_us;
+	else
+		return;
+
+	if (length < rh->length / 2)
+		length = rh->length / 2;
+
+	length_min = LUKS2_REENCRYPT_MIN_HOTZONE_LENGTH;
+	if (length_min < rh->alignment)
+		length_min = rh->alignment;
+	if (length_min > rh->length_max)
+		length_min = rh->length_max;
+
+	if (length > rh->length_max)
+		length = rh->length_max;
+	length -= length % rh->alignment;
+	if (length < length_min)
+		length = length_min;
+
+	if (length == rh->length)
+		return;
+
+	log_dbg(cd, "Step took %" PRIu64 " us, adjusting hotzone length %" PRIu64 " -> %" PRIu64 ".",
+		step_us, rh->length, length);
+	rh->length = length;
+}
+
+static void reencrypt_sleep_us(uint64_t us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/*
+ * Pause between hotzones so that average throughput stays below
+ * max_throughput, and back off exponentially (up to 1 second) while average
+ * latency of I/O on active device exceeds max_io_latency_ms.
+ */
+static void reencrypt_throttle(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	uint64_t now, expected_us, ios, ticks, latency_ms;
+	char *path;
+
+	if (rh->max_throughput && rh->read > 0) {
+		now = reencrypt_time_us();
+		if (!rh->throttle_start_us)
+			rh->throttle_start_us = now;
+		rh->throttle_bytes += rh->read;
+
+		expected_us = rh->throttle_bytes * 1000000 / rh->max_throughput;
+		if (now && expected_us > now - rh->throttle_start_us) {
+			log_dbg(cd, "Throughput limit, sleeping %" PRIu64 " us.",
+				expected_us - (now - rh->throttle_start_us));
+			reencrypt_sleep_us(expected_us - (now - rh->throttle_start_us));
+		}
+	}
+
+	if (!rh->max_io_latency_ms || !rh->device_name)
+		return;
+
+	if (asprintf(&path, "%s/%s", dm_get_dir(), rh->device_name) < 0)
+		return;
+
+	if (!crypt_dev_io_stats(path, &ios, &ticks)) {
+		if (rh->dev_ios && ios > rh->dev_ios) {
+			latency_ms = (ticks - rh->dev_ticks) / (ios - rh->dev_ios);
+			if (latency_ms > rh->max_io_latency_ms)
+				rh->pause_us = rh->pause_us ? rh->pause_us * 2 : 10000;
+			else
+				rh->pause_us /= 2;
+			if (rh->pause_us > 1000000)
+				rh->pause_us = 1000000;
+			log_dbg(cd, "Active device I/O latency %" PRIu64 " ms, pause %" PRIu64 " us.",
+				latency_ms, rh->pause_us);
+		} else
+			rh->pause_us /= 2;
+
+		rh->dev_ios = ios;
+		rh->dev_ticks = ticks;
+	}
+	free(path);
+
+	if (rh->pause_us)
+		reencrypt_sleep_us(rh->pause_us);
+}
+
 static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		struct luks2_hdr *hdr,
 		struct luks2_reencrypt *rh,
@@ -3833,13 +5119,27 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		bool online)
 {
 	int r;
+	reenc_status_t rs;
 	struct reenc_protection *rp;
+	uint64_t step_start, protect_start;
 
 	assert(hdr);
 	assert(rh);
 
+	r = reencrypt_adapt_resilience(cd, hdr, rh);
+	if (r < 0) {
+		log_err(cd, _("Failed to switch reencryption resilience type."));
+		return REENC_ERR;
+	}
+
 	rp = &rh->rp;
 
+	memset(&rh->stats, 0, sizeof(rh->stats));
+	rh->stats.offset = rh->offset;
+	rh->stats.length = rh->length;
+	reencrypt_stats_lap(rh, NULL);
+	step_start = rh->stats_t;
+
 	/* in memory only */
 	r = reencrypt_make_segments(cd, hdr, rh, device_size);
 	if (r)
@@ -3850,23 +5150,29 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		log_err(cd, _("Failed to set device segments for next reencryption hotzone."));
 		return REENC_ERR;
 	}
+	reencrypt_stats_lap(rh, &rh->stats.commit_us);
 
 	log_dbg(cd, "Reencrypting chunk starting at offset: %" PRIu64 ", size :%" PRIu64 ".", rh->offset, rh->length);
 	log_dbg(cd, "data_offset: %" PRIu64, crypt_get_data_offset(cd) << SECTOR_SHIFT);
 
 	if (!rh->offset && rp->type == REENC_PROTECTION_DATASHIFT && rh->jobj_segment_moved) {
-		crypt_storage_wrapper_destroy(rh->cw1);
-		log_dbg(cd, "Reinitializing old segment storage wrapper for moved segment.");
-		r = crypt_storage_wrapper_init(cd, &rh->cw1, crypt_data_device(cd),
-				LUKS2_reencrypt_get_data_offset_moved(hdr),
-				crypt_get_iv_offset(cd),
-				reencrypt_get_sector_size_old(hdr),
-				reencrypt_segment_cipher_old(hdr),
-				crypt_volume_key_by_id(rh->vks, rh->digest_old),
-				rh->wflags1);
-		if (r) {
-			log_err(cd, _("Failed to initialize old segment storage wrapper."));
-			return REENC_ROLLBACK;
+		/* only data offset differs, try to keep old segment cipher contexts */
+		if (!crypt_storage_wrapper_set_data_offset(rh->cw1, LUKS2_reencrypt_get_data_offset_moved(hdr)))
+			log_dbg(cd, "Old segment storage wrapper moved to moved segment offset.");
+		else {
+			crypt_storage_wrapper_destroy(rh->cw1);
+			log_dbg(cd, "Reinitializing old segment storage wrapper for moved segment.");
+			r = crypt_storage_wrapper_init_threads(cd, &rh->cw1, crypt_data_device(cd),
+					LUKS2_reencrypt_get_data_offset_moved(hdr),
+					crypt_get_iv_offset(cd),
+					reencrypt_get_sector_size_old(hdr),
+					reencrypt_segment_cipher_old(hdr),
+					crypt_volume_key_by_id(rh->vks, rh->digest_old),
+					rh->wflags1, rh->threads);
+			if (r) {
+				log_err(cd, _("Failed to initialize old segment storage wrapper."));
+				return REENC_ROLLBACK;
+			}
 		}
 
 		if (rh->rp_moved_segment.type != REENC_PROTECTION_NOT_SET) {
@@ -3882,43 +5188,78 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 	}
 
 	if (online) {
-		r = reencrypt_refresh_overlay_devices(cd, hdr, rh->overlay_name, rh->hotzone_name, rh->vks, rh->device_size, rh->flags);
+		r = reencrypt_refresh_overlay_devices(cd, hdr, rh);
 		/* Teardown overlay devices with dm-error. None bio shall pass! */
 		if (r != REENC_OK)
 			return r;
 	}
+	reencrypt_stats_lap(rh, NULL);
 
-	rh->read = crypt_storage_wrapper_read(rh->cw1, rh->offset, rh->reenc_buffer, rh->length);
-	if (rh->read < 0) {
-		/* severity normal */
-		log_err(cd, _("Failed to read hotzone area starting at %" PRIu64 "."), rh->offset);
-		return REENC_ROLLBACK;
-	}
+	if (rh->skip_holes && crypt_storage_wrapper_is_hole(rh->cw1, rh->offset, rh->length)) {
+		/* nothing to read, protect or write, only segments move forward */
+		log_dbg(cd, "Hotzone at offset %" PRIu64 " is not allocated, skipping.", rh->offset);
+		rh->read = rh->length;
+	} else if (rh->chunk_length && rp == &rh->rp) {
+		rs = reencrypt_hotzone_batch(cd, hdr, rh, rp);
+		if (rs != REENC_OK)
+			return rs;
+	} else {
+		rh->read = reencrypt_hotzone_read(cd, rh);
+		if (rh->read < 0) {
+			/* severity normal */
+			log_err(cd, _("Failed to read hotzone area starting at %" PRIu64 "."), rh->offset);
+			return REENC_ROLLBACK;
+		}
+		reencrypt_stats_lap(rh, &rh->stats.read_us);
 
-	/* metadata commit point */
-	r = reencrypt_hotzone_protect_final(cd, hdr, rh->reenc_keyslot, rp, rh->reenc_buffer, rh->read);
-	if (r < 0) {
-		/* severity normal */
-		log_err(cd, _("Failed to write reencryption resilience metadata."));
-		return REENC_ROLLBACK;
-	}
+		/* overlap reading of next hotzone with processing of the current one */
+		reencrypt_prefetch_next(cd, rh);
 
-	r = crypt_storage_wrapper_decrypt(rh->cw1, rh->offset, rh->reenc_buffer, rh->read);
-	if (r) {
-		/* severity normal */
-		log_err(cd, _("Decryption failed."));
-		return REENC_ROLLBACK;
-	}
-	if (rh->read != crypt_storage_wrapper_encrypt_write(rh->cw2, rh->offset, rh->reenc_buffer, rh->read)) {
-		/* severity fatal */
-		log_err(cd, _("Failed to write hotzone area starting at %" PRIu64 "."), rh->offset);
-		return REENC_FATAL;
+		/* metadata commit point */
+		protect_start = rh->rp_adaptive ? reencrypt_time_us() : 0;
+		if (rp->type == REENC_PROTECTION_JOURNAL && rp->p.journal.ring)
+			r = reencrypt_hotzone_journal_ring(cd, hdr, rh);
+		else
+			r = reencrypt_hotzone_protect_final(cd, hdr, rh->reenc_keyslot, rp, rh->reenc_buffer, rh->read, rh->threads);
+		if (r < 0) {
+			/* severity normal */
+			log_err(cd, _("Failed to write reencryption resilience metadata."));
+			return REENC_ROLLBACK;
+		}
+		if (protect_start)
+			reencrypt_resilience_cost(rh, reencrypt_time_us() - protect_start);
+		reencrypt_stats_lap(rh, &rh->stats.protect_us);
+
+		r = crypt_storage_wrapper_decrypt(rh->cw1, rh->offset, rh->reenc_buffer, rh->read);
+		if (r) {
+			/* severity normal */
+			log_err(cd, _("Decryption failed."));
+			return REENC_ROLLBACK;
+		}
+		reencrypt_stats_lap(rh, &rh->stats.decrypt_us);
+
+		/* conventional zones (-ENOTSUP) accept in-place writes */
+		r = rh->zone_reset ? device_zone_reset(cd, crypt_data_device(cd),
+				(crypt_get_data_offset(cd) << SECTOR_SHIFT) + rh->offset, rh->read) : 0;
+		if (r && r != -ENOTSUP) {
+			log_err(cd, _("Failed to reset zones of hotzone area starting at %" PRIu64 "."), rh->offset);
+			/* severity fatal only if some zone was reset */
+			return r == -EIO ? REENC_FATAL : REENC_ROLLBACK;
+		}
+
+		if (rh->read != crypt_storage_wrapper_encrypt_write(rh->cw2, rh->offset, rh->reenc_buffer, rh->read)) {
+			/* severity fatal */
+			log_err(cd, _("Failed to write hotzone area starting at %" PRIu64 "."), rh->offset);
+			return REENC_FATAL;
+		}
+		reencrypt_stats_lap(rh, &rh->stats.encrypt_write_us);
 	}
 
 	if (rp->type != REENC_PROTECTION_NONE && crypt_storage_wrapper_datasync(rh->cw2)) {
 		log_err(cd, _("Failed to sync data."));
 		return REENC_FATAL;
 	}
+	reencrypt_stats_lap(rh, &rh->stats.sync_us);
 
 	/* metadata commit safe point */
 	r = reencrypt_assign_segments(cd, hdr, rh, 0, rp->type != REENC_PROTECTION_NONE);
@@ -3927,6 +5268,7 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		log_err(cd, _("Failed to update metadata after current reencryption hotzone completed."));
 		return REENC_FATAL;
 	}
+	reencrypt_stats_lap(rh, &rh->stats.commit_us);
 
 	if (online) {
 		/* severity normal */
@@ -3938,6 +5280,12 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		}
 	}
 
+	if (rh->stats_cb) {
+		reencrypt_stats_lap(rh, NULL);
+		rh->stats.total_us = rh->stats_t - step_start;
+		rh->stats_cb(&rh->stats, rh->stats_usrptr);
+	}
+
 	return REENC_OK;
 }
 
@@ -3949,23 +5297,44 @@ static int reencrypt_erase_backup_segments(struct crypt_device *cd,
 		if (LUKS2_digest_segment_assign(cd, hdr, segment, CRYPT_ANY_DIGEST, 0, 0))
 			return -EINVAL;
 		json_object_object_del_by_uint(LUKS2_get_segments_jobj(hdr), segment);
+		LUKS2_hdr_index_invalidate(hdr);
 	}
 	segment = LUKS2_get_segment_id_by_flag(hdr, "backup-final");
 	if (segment >= 0) {
 		if (LUKS2_digest_segment_assign(cd, hdr, segment, CRYPT_ANY_DIGEST, 0, 0))
 			return -EINVAL;
 		json_object_object_del_by_uint(LUKS2_get_segments_jobj(hdr), segment);
+		LUKS2_hdr_index_invalidate(hdr);
 	}
 	segment = LUKS2_get_segment_id_by_flag(hdr, "backup-moved-segment");
 	if (segment >= 0) {
 		if (LUKS2_digest_segment_assign(cd, hdr, segment, CRYPT_ANY_DIGEST, 0, 0))
 			return -EINVAL;
 		json_object_object_del_by_uint(LUKS2_get_segments_jobj(hdr), segment);
+		LUKS2_hdr_index_invalidate(hdr);
 	}
 
 	return 0;
 }
 
+static int reencrypt_wipe_area(struct crypt_device *cd, struct luks2_reencrypt *rh,
+			       uint64_t offset, uint64_t length)
+{
+	const char *method;
+	int r;
+
+	if (!rh->discard_unused)
+		return crypt_wipe_device(cd, crypt_data_device(cd), CRYPT_WIPE_RANDOM,
+					 offset, length, 1024 * 1024, NULL, NULL);
+
+	r = crypt_wipe_device_discard(cd, crypt_data_device(cd), offset, length,
+				      1024 * 1024, &method);
+	if (!r)
+		log_verbose(cd, _("Unused data device area cleared (%s)."), method);
+
+	return r;
+}
+
 static int reencrypt_wipe_unused_device_area(struct crypt_device *cd, struct luks2_reencrypt *rh)
 {
 	uint64_t offset, length, dev_size;
@@ -3979,8 +5348,7 @@ static int reencrypt_wipe_unused_device_area(struct crypt_device *cd, struct luk
 		length = json_segment_get_size(rh->jobj_segment_moved, 0);
 		log_dbg(cd, "Wiping %" PRIu64 " bytes of backup segment data at offset %" PRIu64,
 			length, offset);
-		r = crypt_wipe_device(cd, crypt_data_device(cd), CRYPT_WIPE_RANDOM,
-				offset, length, 1024 * 1024, NULL, NULL);
+		r = reencrypt_wipe_area(cd, rh, offset, length);
 	}
 
 	if (r < 0)
@@ -3998,8 +5366,7 @@ static int reencrypt_wipe_unused_device_area(struct crypt_device *cd, struct luk
 		length = data_shift_value(&rh->rp);
 		log_dbg(cd, "Wiping %" PRIu64 " bytes of data at offset %" PRIu64,
 			length, offset);
-		r = crypt_wipe_device(cd, crypt_data_device(cd), CRYPT_WIPE_RANDOM,
-				offset, length, 1024 * 1024, NULL, NULL);
+		r = reencrypt_wipe_area(cd, rh, offset, length);
 	}
 
 	return r;
@@ -4117,11 +5484,16 @@ int crypt_reencrypt_run(
 	struct luks2_reencrypt *rh;
 	reenc_status_t rs;
 	bool quit = false;
+	uint64_t step_start;
 
 	if (onlyLUKS2mask(cd, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
 		return -EINVAL;
 
 	hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
+	if (hdr->batch) {
+		log_err(cd, _("Reencryption cannot be used inside metadata batch."));
+		return -EBUSY;
+	}
 
 	ri = LUKS2_reencrypt_status(hdr);
 	if (ri > CRYPT_REENCRYPT_CLEAN) {
@@ -4144,16 +5516,34 @@ int crypt_reencrypt_run(
 
 	log_dbg(cd, "Progress %" PRIu64 ", device_size %" PRIu64, rh->progress, rh->device_size);
 
+	if (rh->rp.type == REENC_PROTECTION_JOURNAL && rh->rp.p.journal.ring &&
+	    reencrypt_journal_ring_init(cd, hdr, rh)) {
+		log_err(cd, _("Failed to initialize reencryption journal ring."));
+		return -EINVAL;
+	}
+
+	if (!rh->prefetch && !reencrypt_prefetch_init(cd, hdr, rh))
+		log_dbg(cd, "Hotzone read-ahead enabled.");
+
+	if (!reencrypt_register_buffers(rh))
+		log_dbg(cd, "Hotzone buffers registered for fixed I/O.");
+
 	rs = REENC_OK;
 
 	if (progress && progress(rh->device_size, rh->progress, usrptr))
 		quit = true;
 
 	while (!quit && (rh->device_size > rh->progress)) {
+		step_start = reencrypt_time_us();
 		rs = reencrypt_step(cd, hdr, rh, rh->device_size, rh->online);
 		if (rs != REENC_OK)
 			break;
 
+		if (step_start)
+			reencrypt_adapt_length(cd, rh, reencrypt_time_us() - step_start);
+
+		reencrypt_throttle(cd, rh);
+
 		log_dbg(cd, "Progress %" PRIu64 ", device_size %" PRIu64, rh->progress, rh->device_size);
 		if (progress && progress(rh->device_size, rh->progress, usrptr))
 			quit = true;
@@ -4183,6 +5573,31 @@ int crypt_reencrypt(
 {
 	return crypt_reencrypt_run(cd, progress, NULL);
 }
+
+int crypt_reencrypt_set_stats_callback(struct crypt_device *cd,
+	void (*stats)(const struct crypt_reencrypt_step_stats *stats, void *usrptr),
+	void *usrptr)
+{
+#if USE_LUKS2_REENCRYPTION
+	struct luks2_reencrypt *rh;
+
+	if (onlyLUKS2mask(cd, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
+		return -EINVAL;
+
+	rh = crypt_get_luks2_reencrypt(cd);
+	if (!rh) {
+		log_err(cd, _("Missing or invalid reencrypt context."));
+		return -EINVAL;
+	}
+
+	rh->stats_cb = stats;
+	rh->stats_usrptr = stats ? usrptr : NULL;
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
 #if USE_LUKS2_REENCRYPTION
 static int reencrypt_recovery(struct crypt_device *cd,
 		struct luks2_hdr *hdr,
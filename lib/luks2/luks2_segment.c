@@ -379,6 +379,7 @@ int LUKS2_segments_set(struct crypt_device *cd, struct luks2_hdr *hdr,
 		       json_object *jobj_segments, int commit)
 {
 	json_object_object_add(hdr->jobj, "segments", jobj_segments);
+	LUKS2_hdr_index_invalidate(hdr);
 
 	return commit ? LUKS2_hdr_write(cd, hdr) : 0;
 }
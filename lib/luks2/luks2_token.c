@@ -22,6 +22,11 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <assert.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "luks2_internal.h"
 
@@ -41,9 +46,74 @@ static struct crypt_token_handler_internal token_handlers[LUKS2_TOKENS_MAX] = {
 			  .validate = keyring_validate,
 			  .dump = keyring_dump }
 	       }
+	},
+	/* USB key builtin token */
+	{
+	  .version = 1,
+	  .u = {
+		  .v1 = { .name = LUKS2_TOKEN_USBKEY,
+			  .open = usbkey_open,
+			  .validate = usbkey_validate,
+			  .dump = usbkey_dump }
+	       }
 	}
 };
 
+/*
+ * Handler table is process-wide, external plugins stay loaded until library
+ * unload (see libcryptsetup_exit), so every context after the first one
+ * gets already resolved handler. Table lock protects lookup and load
+ * from concurrent contexts; entries are never removed, returned handler
+ * can be used without the lock.
+ *
+ * Token types that failed to load are remembered together with plugin
+ * directory mtime, so unknown tokens do not cause repeated dlopen() path
+ * lookup; installing new plugin (directory change) drops this list.
+ */
+static pthread_mutex_t token_handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if USE_EXTERNAL_TOKENS
+#define TOKEN_UNKNOWN_MAX 16
+
+static struct {
+	char names[TOKEN_UNKNOWN_MAX][LUKS2_TOKEN_NAME_MAX + 1];
+	unsigned count;
+	struct timespec mtime;
+} token_unknown;
+
+/* Must be called with token_handlers_lock held */
+static bool token_unknown_check(const char *name)
+{
+	struct stat st;
+	unsigned i;
+
+	if (stat(EXTERNAL_LUKS2_TOKENS_PATH, &st))
+		st.st_mtim = (struct timespec){};
+
+	if (st.st_mtim.tv_sec != token_unknown.mtime.tv_sec ||
+	    st.st_mtim.tv_nsec != token_unknown.mtime.tv_nsec) {
+		token_unknown.count = 0;
+		token_unknown.mtime = st.st_mtim;
+		return false;
+	}
+
+	for (i = 0; i < token_unknown.count && i < TOKEN_UNKNOWN_MAX; i++)
+		if (!strcmp(token_unknown.names[i], name))
+			return true;
+
+	return false;
+}
+
+static void token_unknown_add(const char *name)
+{
+	if (strlen(name) > LUKS2_TOKEN_NAME_MAX)
+		return;
+
+	/* overwrite the oldest one if full */
+	strcpy(token_unknown.names[token_unknown.count++ % TOKEN_UNKNOWN_MAX], name);
+}
+#endif
+
 void crypt_token_external_disable(void)
 {
 	external_tokens_enabled = false;
@@ -111,6 +181,12 @@ static bool token_validate_v2(struct crypt_device *cd, const struct crypt_token_
 		return false;
 	}
 
+	if ((h->u.v2.open_async || h->u.v2.open_finish || h->u.v2.cancel) &&
+	    (!h->u.v2.open_async || !h->u.v2.open_finish || !h->u.v2.cancel)) {
+		log_dbg(cd, "Error: token handler provides incomplete asynchronous open functions.");
+		return false;
+	}
+
 	return true;
 }
 
@@ -173,6 +249,9 @@ crypt_token_load_external(struct crypt_device *cd, const char *name, struct cryp
 	token->dump = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_DUMP, CRYPT_TOKEN_ABI_VERSION1);
 	token->open_pin = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_PIN, CRYPT_TOKEN_ABI_VERSION1);
 	token->version = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_VERSION, CRYPT_TOKEN_ABI_VERSION1);
+	token->open_async = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_ASYNC, CRYPT_TOKEN_ABI_VERSION2);
+	token->open_finish = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_FINISH, CRYPT_TOKEN_ABI_VERSION2);
+	token->cancel = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_CANCEL, CRYPT_TOKEN_ABI_VERSION2);
 
 	if (!token_validate_v2(cd, ret)) {
 		free(CONST_CAST(void *)token->name);
@@ -234,13 +313,15 @@ int crypt_token_register(const crypt_token_handler *handler)
 	if (!token_validate_v1(NULL, handler))
 		return -EINVAL;
 
+	pthread_mutex_lock(&token_handlers_lock);
 	r = crypt_token_find_free(NULL, handler->name, &i);
-	if (r < 0)
-		return r;
+	if (!r) {
+		token_handlers[i].version = 1;
+		token_handlers[i].u.v1 = *handler;
+	}
+	pthread_mutex_unlock(&token_handlers_lock);
 
-	token_handlers[i].version = 1;
-	token_handlers[i].u.v1 = *handler;
-	return 0;
+	return r;
 }
 
 void crypt_token_unload_external_all(struct crypt_device *cd)
@@ -265,22 +346,35 @@ void crypt_token_unload_external_all(struct crypt_device *cd)
 static const void
 *LUKS2_token_handler_type(struct crypt_device *cd, const char *type)
 {
-	int i;
-
-	for (i = 0; i < LUKS2_TOKENS_MAX && token_handlers[i].u.v1.name; i++)
-		if (!strcmp(token_handlers[i].u.v1.name, type))
-			return &token_handlers[i].u;
-
-	if (i >= LUKS2_TOKENS_MAX)
-		return NULL;
+	const void *h = NULL;
+	int i, r;
 
-	if (is_builtin_candidate(type))
-		return NULL;
+	pthread_mutex_lock(&token_handlers_lock);
 
-	if (crypt_token_load_external(cd, type, &token_handlers[i]))
-		return NULL;
+	for (i = 0; i < LUKS2_TOKENS_MAX && token_handlers[i].u.v1.name; i++)
+		if (!strcmp(token_handlers[i].u.v1.name, type)) {
+			h = &token_handlers[i].u;
+			goto out;
+		}
 
-	return &token_handlers[i].u;
+	if (i >= LUKS2_TOKENS_MAX || is_builtin_candidate(type))
+		goto out;
+#if USE_EXTERNAL_TOKENS
+	if (external_tokens_enabled && token_unknown_check(type)) {
+		log_dbg(cd, "Token handler %s not available (cached).", type);
+		goto out;
+	}
+#endif
+	r = crypt_token_load_external(cd, type, &token_handlers[i]);
+	if (!r)
+		h = &token_handlers[i].u;
+#if USE_EXTERNAL_TOKENS
+	else if (r != -ENOTSUP)
+		token_unknown_add(type);
+#endif
+out:
+	pthread_mutex_unlock(&token_handlers_lock);
+	return h;
 }
 
 static const void
@@ -335,16 +429,17 @@ int LUKS2_token_create(struct crypt_device *cd,
 	if (token < 0 || token >= LUKS2_TOKENS_MAX)
 		return -EINVAL;
 
-	if (!json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens))
+	if (!(jobj_tokens = LUKS2_get_tokens_jobj(hdr)))
 		return -EINVAL;
 
 	if (snprintf(num, sizeof(num), "%d", token) < 0)
 		return -EINVAL;
 
 	/* Remove token */
-	if (!json)
+	if (!json) {
 		json_object_object_del(jobj_tokens, num);
-	else {
+		LUKS2_hdr_index_invalidate(hdr);
+	} else {
 
 		jobj = json_tokener_parse_verbose(json, &jerr);
 		if (!jobj) {
@@ -374,9 +469,11 @@ int LUKS2_token_create(struct crypt_device *cd,
 		}
 
 		json_object_object_add(jobj_tokens, num, jobj);
+		LUKS2_hdr_index_invalidate(hdr);
 		if (LUKS2_check_json_size(cd, hdr)) {
 			log_dbg(cd, "Not enough space in header json area for new token.");
 			json_object_object_del(jobj_tokens, num);
+			LUKS2_hdr_index_invalidate(hdr);
 			return -ENOSPC;
 		}
 	}
@@ -423,10 +520,38 @@ static const char *token_json_to_string(json_object *jobj_token)
 		JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
 }
 
-static int token_is_usable(struct luks2_hdr *hdr, json_object *jobj_token, int segment,
+/* Same checks as token_is_usable() with keyslots resolved in header index */
+static int token_is_usable_indexed(struct luks2_hdr *hdr, const int8_t *keyslots, int len,
+				   crypt_keyslot_priority priority, int segment,
+				   crypt_keyslot_priority minimal_priority)
+{
+	crypt_keyslot_priority keyslot_priority;
+	int i, r = -ENOENT;
+
+	if (!len || (priority != CRYPT_SLOT_PRIORITY_INVALID && priority < minimal_priority))
+		return -ENOENT;
+
+	for (i = 0; i < len; i++) {
+		keyslot_priority = LUKS2_keyslot_priority_get(hdr, keyslots[i]);
+		if (keyslot_priority == CRYPT_SLOT_PRIORITY_INVALID)
+			return -EINVAL;
+
+		if (keyslot_priority < minimal_priority)
+			continue;
+
+		r = LUKS2_keyslot_for_segment(hdr, keyslots[i], segment);
+		if (r != -ENOENT)
+			return r;
+	}
+
+	return r;
+}
+
+static int token_is_usable(struct luks2_hdr *hdr, int token, json_object *jobj_token, int segment,
 			   crypt_keyslot_priority minimal_priority, bool requires_keyslot)
 {
 	crypt_keyslot_priority keyslot_priority;
+	const int8_t *keyslots;
 	json_object *jobj_array;
 	int i, keyslot, len, r = -ENOENT;
 
@@ -450,6 +575,11 @@ static int token_is_usable(struct luks2_hdr *hdr, json_object *jobj_token, int s
 	if (!len)
 		return -ENOENT;
 
+	r = LUKS2_hdr_index_token_keyslots(hdr, token, &keyslots, &keyslot_priority);
+	if (r >= 0)
+		return token_is_usable_indexed(hdr, keyslots, r, keyslot_priority, segment, minimal_priority);
+	r = -ENOENT;
+
 	for (i = 0; i < len; i++) {
 		keyslot = atoi(json_object_get_string(json_object_array_get_idx(jobj_array, i)));
 
@@ -468,6 +598,33 @@ static int token_is_usable(struct luks2_hdr *hdr, json_object *jobj_token, int s
 	return r;
 }
 
+static uint64_t token_time_us(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Token statistics (crypt_token_open_stats) are updated in the caller
+ * thread only. Times accumulate over all tries of a token in one unlock.
+ */
+static void token_stats_open(struct crypt_device *cd, int token, uint64_t open_us, int r)
+{
+	struct crypt_token_open_stats *st = crypt_token_stats(cd, token);
+
+	trace_token_open(token, open_us, r);
+
+	if (!st)
+		return;
+
+	st->open_us += open_us;
+	st->result = r;
+}
+
 static int translate_errno(struct crypt_device *cd, int ret_val, const char *type)
 {
 	if ((ret_val > 0 || ret_val == -EINVAL || ret_val == -EPERM) && !is_builtin_candidate(type)) {
@@ -478,23 +635,22 @@ static int translate_errno(struct crypt_device *cd, int ret_val, const char *typ
 	return ret_val;
 }
 
-static int token_open(struct crypt_device *cd,
+/* Token checks and handler lookup, everything except the handler open itself */
+static int token_handler_prepare(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
 	json_object *jobj_token,
 	const char *type,
 	int segment,
 	crypt_keyslot_priority priority,
-	const char *pin,
-	size_t pin_size,
-	char **buffer,
-	size_t *buffer_len,
-	void *usrptr,
-	bool requires_keyslot)
+	bool requires_keyslot,
+	const struct crypt_token_handler_v2 **handler)
 {
 	const struct crypt_token_handler_v2 *h;
+	struct crypt_token_open_stats *st;
 	json_object *jobj_type;
-	int r;
+	uint64_t start;
+	int r, span;
 
 	assert(token >= 0);
 	assert(jobj_token);
@@ -507,7 +663,7 @@ static int token_open(struct crypt_device *cd,
 			return -ENOENT;
 	}
 
-	r = token_is_usable(hdr, jobj_token, segment, priority, requires_keyslot);
+	r = token_is_usable(hdr, token, jobj_token, segment, priority, requires_keyslot);
 	if (r < 0) {
 		if (r == -ENOENT)
 			log_dbg(cd, "Token %d unusable for segment %d with desired keyslot priority %d.",
@@ -515,7 +671,17 @@ static int token_open(struct crypt_device *cd,
 		return r;
 	}
 
-	if (!(h = LUKS2_token_handler(cd, token)))
+	span = crypt_span_begin(cd, "token_load");
+	start = token_time_us();
+	h = LUKS2_token_handler(cd, token);
+	crypt_span_end(cd, span);
+	if ((st = crypt_token_stats(cd, token))) {
+		st->load_us += token_time_us() - start;
+		st->type = h ? h->name : NULL;
+		st->result = -ENOENT;
+	}
+
+	if (!h)
 		return -ENOENT;
 
 	if (h->validate && h->validate(cd, token_json_to_string(jobj_token))) {
@@ -523,12 +689,388 @@ static int token_open(struct crypt_device *cd,
 		return -ENOENT;
 	}
 
+	*handler = h;
+	return 0;
+}
+
+/*
+ * Token prefetch (crypt_token_prefetch), handler open without PIN runs
+ * in background threads as soon as header is loaded, one thread per token.
+ * Returned secrets are copied to locked memory and the handler buffer
+ * is released. First token open without PIN of the same token waits for
+ * all prefetch threads (handlers may read any token metadata) and takes
+ * the secret instead of calling the handler; failed prefetch falls back
+ * to normal handler open. Every secret is used at most once.
+ */
+struct token_prefetch_job {
+	struct crypt_device *cd;
+	const struct crypt_token_handler_v2 *h;
+	void *usrptr;
+	char *secret;
+	size_t secret_len;
+	struct crypt_thread thread;
+	int token;
+	int r;
+	bool threaded;
+	bool taken;
+	bool from_keyring;
+};
+
+struct luks2_token_prefetch {
+	struct token_prefetch_job jobs[LUKS2_TOKENS_MAX];
+	int count;
+};
+
+static void token_prefetch_run(struct token_prefetch_job *job)
+{
+	char *buffer = NULL;
+	size_t buffer_len = 0;
+
+	job->r = job->h->open(job->cd, job->token, &buffer, &buffer_len, job->usrptr);
+	if (job->r)
+		return;
+
+	job->secret = crypt_safe_alloc(buffer_len ?: 1);
+	if (job->secret) {
+		memcpy(job->secret, buffer, buffer_len);
+		job->secret_len = buffer_len;
+	} else
+		job->r = -ENOMEM;
+
+	if (job->h->buffer_free)
+		job->h->buffer_free(buffer, buffer_len);
+	else {
+		crypt_safe_memzero(buffer, buffer_len);
+		free(buffer);
+	}
+}
+
+static void *token_prefetch_thread(void *arg)
+{
+	token_prefetch_run(arg);
+	return NULL;
+}
+
+static void token_prefetch_wait(struct luks2_token_prefetch *tp)
+{
+	int i;
+
+	for (i = 0; i < tp->count; i++)
+		if (tp->jobs[i].threaded) {
+			crypt_thread_join(&tp->jobs[i].thread);
+			tp->jobs[i].threaded = false;
+		}
+}
+
+int LUKS2_token_prefetch(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	const char *type,
+	void *usrptr)
+{
+	const struct crypt_token_handler_v2 *h;
+	struct luks2_token_prefetch *tp;
+	struct token_prefetch_job *job;
+	json_object *jobj_tokens;
+	int i, segment, r = -ENOENT;
+
+	if (hdr->prefetch) {
+		tp = hdr->prefetch;
+		for (i = 0; i < tp->count; i++)
+			if (!tp->jobs[i].taken)
+				return -EBUSY;
+		LUKS2_token_prefetch_free(hdr);
+	}
+
+	if (token != CRYPT_ANY_TOKEN && (token < 0 || token >= LUKS2_TOKENS_MAX))
+		return -EINVAL;
+
+	if (!(jobj_tokens = LUKS2_get_tokens_jobj(hdr)))
+		return -EINVAL;
+
+	segment = LUKS2_get_default_segment(hdr);
+	if (segment < 0)
+		return -EINVAL;
+
+	/* passing usrptr for CRYPT_ANY_TOKEN does not make sense without specific type */
+	if (token == CRYPT_ANY_TOKEN && !type)
+		usrptr = NULL;
+
+	tp = calloc(1, sizeof(*tp));
+	if (!tp)
+		return -ENOMEM;
+
+	/* handler lookup may load a plugin, keep it in caller thread */
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		i = atoi(slot);
+		if (token != CRYPT_ANY_TOKEN && i != token)
+			continue;
+		if (token_handler_prepare(cd, hdr, i, val, type, segment, CRYPT_SLOT_PRIORITY_NORMAL, true, &h))
+			continue;
+		job = &tp->jobs[tp->count++];
+		job->cd = cd;
+		job->h = h;
+		job->usrptr = usrptr;
+		job->token = i;
+	}
+
+	if (!tp->count) {
+		free(tp);
+		return r;
+	}
+
+	for (i = 0; i < tp->count; i++) {
+		job = &tp->jobs[i];
+		log_dbg(cd, "Prefetching secret of token %d (%s).", job->token, job->h->name);
+		job->threaded = !crypt_thread_start(&job->thread, token_prefetch_thread, job, 0);
+		if (!job->threaded) {
+			log_dbg(cd, "Cannot start prefetch thread for token %d.", job->token);
+			token_prefetch_run(job);
+		}
+	}
+
+	hdr->prefetch = tp;
+	return 0;
+}
+
+/* Prefetched secret of token, it must be released by LUKS2_token_buffer_free */
+static bool token_prefetch_take(struct crypt_device *cd, struct luks2_hdr *hdr, int token,
+	char **buffer, size_t *buffer_len)
+{
+	struct luks2_token_prefetch *tp = hdr->prefetch;
+	struct token_prefetch_job *job;
+	int i;
+
+	if (!tp)
+		return false;
+
+	token_prefetch_wait(tp);
+
+	for (i = 0; i < tp->count; i++) {
+		job = &tp->jobs[i];
+		if (job->token != token || job->taken)
+			continue;
+		job->taken = true;
+		if (job->r) {
+			log_dbg(cd, "Prefetch of token %d failed with %d.", token, job->r);
+			return false;
+		}
+		log_dbg(cd, "Using prefetched secret of token %d.", token);
+		*buffer = job->secret;
+		*buffer_len = job->secret_len;
+		return true;
+	}
+
+	return false;
+}
+
+static bool token_prefetch_release(struct luks2_hdr *hdr, void *buffer)
+{
+	struct luks2_token_prefetch *tp = hdr ? hdr->prefetch : NULL;
+	int i;
+
+	for (i = 0; tp && buffer && i < tp->count; i++)
+		if (tp->jobs[i].secret == buffer) {
+			crypt_safe_free(tp->jobs[i].secret);
+			tp->jobs[i].secret = NULL;
+			tp->jobs[i].secret_len = 0;
+			return true;
+		}
+
+	return false;
+}
+
+/* Keep external secret (wiped and freed here) with prefetched ones, so it is released the same way */
+static char *token_prefetch_adopt(struct luks2_hdr *hdr, int token, char *buffer, size_t buffer_len)
+{
+	struct luks2_token_prefetch *tp = hdr->prefetch;
+	struct token_prefetch_job *job = NULL;
+	char *secret = NULL;
+	int i;
+
+	if (!tp && !(tp = hdr->prefetch = calloc(1, sizeof(*tp))))
+		goto out;
+
+	for (i = 0; i < tp->count && !job; i++)
+		if (tp->jobs[i].taken && !tp->jobs[i].secret && !tp->jobs[i].threaded)
+			job = &tp->jobs[i];
+	if (!job && tp->count < LUKS2_TOKENS_MAX)
+		job = &tp->jobs[tp->count++];
+	if (!job || !(secret = crypt_safe_alloc(buffer_len ?: 1)))
+		goto out;
+
+	memcpy(secret, buffer, buffer_len);
+	memset(job, 0, sizeof(*job));
+	job->token = token;
+	job->taken = true;
+	job->from_keyring = true;
+	job->secret = secret;
+	job->secret_len = buffer_len;
+out:
+	crypt_safe_memzero(buffer, buffer_len);
+	free(buffer);
+	return secret;
+}
+
+/*
+ * Token secret cache in user keyring (crypt_token_keyring_cache). Secret that
+ * unlocked a keyslot is stored with a timeout under description derived from
+ * token metadata without keyslot assignment, so the same token (like the same
+ * USB key or ssh server file) on other devices finds it without handler open.
+ */
+static int token_cache_description(struct luks2_hdr *hdr, int token, char *desc, size_t desc_len)
+{
+	json_object *jobj_token;
+	struct crypt_hash *hd = NULL;
+	char digest[32], *hex = NULL;
+	const char *str;
+	int r;
+
+	if (!(jobj_token = LUKS2_get_token_jobj(hdr, token)))
+		return -EINVAL;
+
+	if (crypt_hash_init(&hd, "sha256"))
+		return -EINVAL;
+
+	r = 0;
+	json_object_object_foreach(jobj_token, key, val) {
+		if (!strcmp(key, "keyslots"))
+			continue;
+		str = json_object_to_json_string_ext(val, JSON_C_TO_STRING_PLAIN);
+		if (crypt_hash_write(hd, key, strlen(key) + 1) ||
+		    crypt_hash_write(hd, str, strlen(str) + 1))
+			r = -EINVAL;
+	}
+
+	if (!r && !crypt_hash_final(hd, digest, sizeof(digest)) &&
+	    (hex = crypt_bytes_to_hex(sizeof(digest), digest)))
+		r = snprintf(desc, desc_len, "cryptsetup:token-%s", hex) < (int)desc_len ? 0 : -EINVAL;
+	else
+		r = -EINVAL;
+
+	crypt_safe_free(hex);
+	crypt_hash_destroy(hd);
+	return r;
+}
+
+static bool token_cache_get(struct crypt_device *cd, struct luks2_hdr *hdr, int token,
+	char **buffer, size_t *buffer_len)
+{
+	char desc[128], *secret;
+	size_t secret_len;
+
+	if (!crypt_token_keyring_cache_timeout(cd) ||
+	    token_cache_description(hdr, token, desc, sizeof(desc)) ||
+	    keyring_get_passphrase(desc, &secret, &secret_len))
+		return false;
+
+	log_dbg(cd, "Using secret of token %d cached in keyring (%s).", token, desc);
+
+	*buffer = token_prefetch_adopt(hdr, token, secret, secret_len);
+	*buffer_len = secret_len;
+
+	return *buffer != NULL;
+}
+
+static bool token_cache_owned(struct luks2_hdr *hdr, const char *buffer)
+{
+	struct luks2_token_prefetch *tp = hdr->prefetch;
+	int i;
+
+	for (i = 0; tp && i < tp->count; i++)
+		if (tp->jobs[i].secret == buffer && tp->jobs[i].from_keyring)
+			return true;
+
+	return false;
+}
+
+static void token_cache_put(struct crypt_device *cd, struct luks2_hdr *hdr, int token,
+	const char *buffer, size_t buffer_len, bool unlocked)
+{
+	unsigned timeout = crypt_token_keyring_cache_timeout(cd);
+	char desc[128];
+	int r;
+
+	if (!timeout)
+		return;
+
+	/* stale cached secret (token changed), next attempt uses token again */
+	if (!unlocked) {
+		if (token_cache_owned(hdr, buffer) && !token_cache_description(hdr, token, desc, sizeof(desc))) {
+			log_dbg(cd, "Dropping cached secret of token %d (%s).", token, desc);
+			keyring_revoke_and_unlink_key(USER_KEY, desc);
+		}
+		return;
+	}
+
+	/* do not extend timeout of already cached secret */
+	if (token_cache_owned(hdr, buffer))
+		return;
+
+	r = token_cache_description(hdr, token, desc, sizeof(desc));
+	if (!r)
+		r = keyring_add_key_in_user_keyring_timeout(USER_KEY, desc, buffer, buffer_len, timeout);
+	if (r)
+		log_dbg(cd, "Cannot cache secret of token %d in keyring (%d).", token, r);
+	else
+		log_dbg(cd, "Secret of token %d cached in keyring (%s) for %u seconds.", token, desc, timeout);
+}
+
+void LUKS2_token_prefetch_free(struct luks2_hdr *hdr)
+{
+	struct luks2_token_prefetch *tp = hdr->prefetch;
+	int i;
+
+	if (!tp)
+		return;
+
+	token_prefetch_wait(tp);
+
+	for (i = 0; i < tp->count; i++)
+		crypt_safe_free(tp->jobs[i].secret);
+
+	free(tp);
+	hdr->prefetch = NULL;
+}
+
+static int token_open(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	json_object *jobj_token,
+	const char *type,
+	int segment,
+	crypt_keyslot_priority priority,
+	const char *pin,
+	size_t pin_size,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr,
+	bool requires_keyslot)
+{
+	const struct crypt_token_handler_v2 *h;
+	uint64_t start;
+	int r, span;
+
+	r = token_handler_prepare(cd, hdr, token, jobj_token, type, segment, priority, requires_keyslot, &h);
+	if (r < 0)
+		return r;
+
+	if ((!pin && token_prefetch_take(cd, hdr, token, buffer, buffer_len)) ||
+	    token_cache_get(cd, hdr, token, buffer, buffer_len)) {
+		token_stats_open(cd, token, 0, 0);
+		return 0;
+	}
+
+	span = crypt_span_begin(cd, "token_open");
+	start = token_time_us();
 	if (pin && !h->open_pin)
 		r = -ENOENT;
 	else if (pin)
 		r = translate_errno(cd, h->open_pin(cd, token, pin, pin_size, buffer, buffer_len, usrptr), h->name);
 	else
 		r = translate_errno(cd, h->open(cd, token, buffer, buffer_len, usrptr), h->name);
+	token_stats_open(cd, token, token_time_us() - start, r);
+	crypt_span_end(cd, span);
 	if (r < 0)
 		log_dbg(cd, "Token %d (%s) open failed with %d.", token, h->name, r);
 
@@ -540,8 +1082,12 @@ static void LUKS2_token_buffer_free(struct crypt_device *cd,
 		void *buffer,
 		size_t buffer_len)
 {
-	const crypt_token_handler *h = LUKS2_token_handler(cd, token);
+	const crypt_token_handler *h;
+
+	if (token_prefetch_release(crypt_get_hdr(cd, CRYPT_LUKS2), buffer))
+		return;
 
+	h = LUKS2_token_handler(cd, token);
 	if (h && h->buffer_free)
 		h->buffer_free(buffer, buffer_len);
 	else {
@@ -569,7 +1115,7 @@ static void update_return_errno(int r, int *stored)
 		*stored = r;
 }
 
-static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
+static int keyslot_open_by_token(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
 	int segment,
@@ -578,10 +1124,13 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	size_t buffer_len,
 	struct volume_key **vk)
 {
-	crypt_keyslot_priority keyslot_priority;
+	crypt_keyslot_priority keyslot_priority, max_priority;
 	json_object *jobj_token, *jobj_token_keyslots, *jobj_type, *jobj;
+	const int8_t *keyslots;
+	int8_t keyslots_copy[LUKS2_KEYSLOTS_MAX];
 	unsigned int num = 0;
-	int i, r = -ENOENT, stored_retval = -ENOENT;
+	int i, len, hint = -1, r = -ENOENT, stored_retval = -ENOENT;
+	char credential[32];
 
 	jobj_token = LUKS2_get_token_jobj(hdr, token);
 	if (!jobj_token)
@@ -594,10 +1143,38 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	if (!jobj_token_keyslots)
 		return -EINVAL;
 
-	/* Try to open keyslot referenced in token */
-	for (i = 0; i < (int) json_object_array_length(jobj_token_keyslots) && r < 0; i++) {
-		jobj = json_object_array_get_idx(jobj_token_keyslots, i);
-		num = atoi(json_object_get_string(jobj));
+	/* keyslot ids already resolved in header index, copied as keyslot open may invalidate it */
+	len = LUKS2_hdr_index_token_keyslots(hdr, token, &keyslots, &max_priority);
+	if (len < 0) {
+		keyslots = NULL;
+		len = (int) json_object_array_length(jobj_token_keyslots);
+	} else if (max_priority != CRYPT_SLOT_PRIORITY_INVALID && max_priority < priority)
+		return -ENOENT;
+	else
+		keyslots = memcpy(keyslots_copy, keyslots, len);
+
+	/* Only tokens with more keyslots can benefit from keyslot hint */
+	snprintf(credential, sizeof(credential), "token %d", token);
+	if (crypt_keyslot_hint_enabled(cd) && len > 1) {
+		hint = crypt_keyslot_hint_get(cd, credential);
+		if (hint >= 0 && LUKS2_token_is_assigned(hdr, hint, token))
+			hint = -1;
+	}
+
+	/* Try to open keyslot referenced in token, hinted one first */
+	for (i = hint < 0 ? 0 : -1; i < len && r < 0; i++) {
+		if (i < 0)
+			num = hint;
+		else {
+			if (keyslots)
+				num = keyslots[i];
+			else {
+				jobj = json_object_array_get_idx(jobj_token_keyslots, i);
+				num = atoi(json_object_get_string(jobj));
+			}
+			if (hint >= 0 && num == (unsigned)hint)
+				continue;
+		}
 		keyslot_priority = LUKS2_keyslot_priority_get(hdr, num);
 		if (keyslot_priority == CRYPT_SLOT_PRIORITY_INVALID)
 			return -EINVAL;
@@ -614,12 +1191,41 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 			stored_retval = r;
 	}
 
+	if (r >= 0 || stored_retval == -EPERM)
+		token_cache_put(cd, hdr, token, buffer, buffer_len, r >= 0);
+
 	if (r < 0)
 		return stored_retval;
 
+	if (crypt_keyslot_hint_enabled(cd) && len > 1)
+		crypt_keyslot_hint_set(cd, credential, num);
+
 	return num;
 }
 
+static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	int segment,
+	crypt_keyslot_priority priority,
+	const char *buffer,
+	size_t buffer_len,
+	struct volume_key **vk)
+{
+	struct crypt_token_open_stats *st;
+	uint64_t start = token_time_us();
+	int r;
+
+	r = keyslot_open_by_token(cd, hdr, token, segment, priority, buffer, buffer_len, vk);
+
+	if ((st = crypt_token_stats(cd, token))) {
+		st->keyslot_us += token_time_us() - start;
+		st->result = r;
+	}
+
+	return r;
+}
+
 static bool token_is_blocked(int token, uint32_t *block_list)
 {
 	/* it is safe now, but have assert in case LUKS2_TOKENS_MAX grows */
@@ -636,6 +1242,421 @@ static void token_block(int token, uint32_t *block_list)
 	*block_list |= (1 << token);
 }
 
+/*
+ * Parallel token open (CRYPT_ACTIVATE_PARALLEL_TOKENS, without PIN only)
+ *
+ * Token checks and handler lookup (that may load external plugin) run
+ * in the caller thread, only the handler open runs in worker threads.
+ * Returned buffers are processed in the caller thread as they arrive,
+ * if more handlers finished meanwhile, the first one in token order wins.
+ * Once a keyslot is opened or the token timeout expires, still running
+ * handlers are cancelled (deferred cancellation, so the handler should
+ * not block outside of cancellation points and cannot return buffer anymore).
+ */
+struct token_thread {
+	struct crypt_device *cd;
+	const struct crypt_token_handler_v2 *h;
+	struct token_threads *tt;
+	void *usrptr;
+	char *buffer;
+	size_t buffer_len;
+	struct crypt_thread thread;
+	uint64_t start_us;
+	uint64_t open_us;
+	int token;
+	int r;
+	bool threaded;
+	bool done;
+	bool checked;
+};
+
+struct token_threads {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *token_thread_fn(void *arg)
+{
+	struct token_thread *t = arg;
+	int r, old;
+
+	r = t->h->open(t->cd, t->token, &t->buffer, &t->buffer_len, t->usrptr);
+
+	/* no cancellation point in between */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+
+	pthread_mutex_lock(&t->tt->lock);
+	t->open_us = token_time_us() - t->start_us;
+	t->r = r;
+	t->done = true;
+	pthread_cond_signal(&t->tt->cond);
+	pthread_mutex_unlock(&t->tt->lock);
+
+	return NULL;
+}
+
+/* Absolute CLOCK_MONOTONIC deadline of token open, false if there is no time limit */
+static bool token_deadline(struct crypt_device *cd, struct timespec *deadline)
+{
+	uint32_t timeout_ms = crypt_token_timeout(cd);
+
+	if (!timeout_ms || clock_gettime(CLOCK_MONOTONIC, deadline))
+		return false;
+
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+
+	return true;
+}
+
+/* Remaining time for poll() in ms (rounded up), -1 if there is no deadline */
+static int token_deadline_ms(const struct timespec *deadline)
+{
+	struct timespec now;
+	long long ms;
+
+	if (!deadline)
+		return -1;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return 0;
+
+	ms = (deadline->tv_sec - now.tv_sec) * 1000LL +
+	     (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+	if (ms < 0)
+		return 0;
+
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/*
+ * First finished and not yet checked open in token order,
+ * NULL if all were checked or the deadline expired.
+ */
+static struct token_thread *token_thread_next(struct token_threads *tt, struct token_thread *t,
+					      int count, const struct timespec *deadline,
+					      bool *timed_out)
+{
+	struct token_thread *next = NULL;
+	bool pending;
+	int i;
+
+	pthread_mutex_lock(&tt->lock);
+	do {
+		pending = false;
+		for (i = 0; i < count && !next; i++) {
+			if (t[i].checked)
+				continue;
+			if (t[i].done)
+				next = &t[i];
+			pending = true;
+		}
+		if (next || !pending)
+			break;
+		if (!deadline)
+			pthread_cond_wait(&tt->cond, &tt->lock);
+		else if (pthread_cond_timedwait(&tt->cond, &tt->lock, deadline) == ETIMEDOUT) {
+			*timed_out = true;
+			break;
+		}
+	} while (true);
+	pthread_mutex_unlock(&tt->lock);
+
+	if (next)
+		next->checked = true;
+
+	return next;
+}
+
+static int token_open_priority_parallel(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	json_object *jobj_tokens,
+	const char *type,
+	int segment,
+	crypt_keyslot_priority priority,
+	void *usrptr,
+	int *stored_retval,
+	uint32_t *block_list,
+	uint32_t *handled,
+	struct volume_key **vk)
+{
+	struct token_threads tt = {
+		.lock = PTHREAD_MUTEX_INITIALIZER
+	};
+	struct token_thread t[LUKS2_TOKENS_MAX] = {}, *p;
+	const struct crypt_token_handler_v2 *h;
+	pthread_condattr_t attr;
+	struct timespec deadline;
+	int i, count = 0, token, r = 0;
+	bool limit, found = false, timed_out = false;
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		token = atoi(slot);
+		if (token_is_blocked(token, block_list) || token_is_blocked(token, handled) ||
+		    count >= LUKS2_TOKENS_MAX)
+			continue;
+		r = token_handler_prepare(cd, hdr, token, val, type, segment, priority, true, &h);
+		if (r < 0) {
+			if (break_loop_retval(r))
+				return r;
+			update_return_errno(r, stored_retval);
+			continue;
+		}
+		t[count].cd = cd;
+		t[count].h = h;
+		t[count].tt = &tt;
+		t[count].usrptr = usrptr;
+		t[count].token = token;
+		t[count].done = token_prefetch_take(cd, hdr, token, &t[count].buffer, &t[count].buffer_len) ||
+				token_cache_get(cd, hdr, token, &t[count].buffer, &t[count].buffer_len);
+		count++;
+	}
+
+	if (!count)
+		return *stored_retval;
+
+	/* deadline is in CLOCK_MONOTONIC, not affected by system time change */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&tt.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	limit = token_deadline(cd, &deadline);
+
+	log_dbg(cd, "Trying to open %d tokens with priority %d in parallel.", count, priority);
+	for (i = 0; i < count; i++) {
+		if (t[i].done)
+			continue;
+		t[i].start_us = token_time_us();
+		t[i].threaded = !crypt_thread_start(&t[i].thread, token_thread_fn, &t[i],
+						    CRYPT_THREAD_CANCEL);
+		if (!t[i].threaded) {
+			log_dbg(cd, "Cannot start thread for token %d.", t[i].token);
+			t[i].r = t[i].h->open(cd, t[i].token, &t[i].buffer, &t[i].buffer_len, usrptr);
+			t[i].open_us = token_time_us() - t[i].start_us;
+			t[i].done = true;
+		}
+	}
+
+	while ((p = token_thread_next(&tt, t, count, limit ? &deadline : NULL, &timed_out))) {
+		r = translate_errno(cd, p->r, p->h->name);
+		token_stats_open(cd, p->token, p->open_us, r);
+		if (r < 0)
+			log_dbg(cd, "Token %d (%s) open failed with %d.", p->token, p->h->name, r);
+		else {
+			r = LUKS2_keyslot_open_by_token(cd, hdr, p->token, segment, priority,
+							p->buffer, p->buffer_len, vk);
+			LUKS2_token_buffer_free(cd, p->token, p->buffer, p->buffer_len);
+		}
+
+		if (r == -ENOANO)
+			token_block(p->token, block_list);
+
+		if (break_loop_retval(r)) {
+			found = true;
+			break;
+		}
+
+		update_return_errno(r, stored_retval);
+	}
+
+	/* slow peers are not needed anymore */
+	pthread_mutex_lock(&tt.lock);
+	for (i = 0; i < count; i++)
+		if (t[i].threaded && !t[i].done) {
+			log_dbg(cd, "Cancelling open of token %d%s.", t[i].token, timed_out ? " (timeout)" : "");
+			crypt_thread_cancel(&t[i].thread);
+			token_stats_open(cd, t[i].token, token_time_us() - t[i].start_us,
+					 timed_out ? -EAGAIN : -ECANCELED);
+			/* as if token was not available */
+			if (timed_out)
+				update_return_errno(-EAGAIN, stored_retval);
+		}
+	pthread_mutex_unlock(&tt.lock);
+
+	for (i = 0; i < count; i++) {
+		if (t[i].threaded)
+			crypt_thread_join(&t[i].thread);
+		/* finished after the winner, buffer is valid only on success */
+		if (t[i].done && !t[i].checked) {
+			token_stats_open(cd, t[i].token, t[i].open_us, -ECANCELED);
+			if (!t[i].r)
+				LUKS2_token_buffer_free(cd, t[i].token, t[i].buffer, t[i].buffer_len);
+		}
+	}
+
+	pthread_cond_destroy(&tt.cond);
+	pthread_mutex_destroy(&tt.lock);
+
+	return found ? r : *stored_retval;
+}
+
+/*
+ * Asynchronous token open (handlers with CRYPT_TOKEN_ABI_VERSION2 symbols,
+ * without PIN only). All async opens of a priority pass are started at once
+ * and returned file descriptors are multiplexed with poll(). Finished opens
+ * are processed in token order, as in parallel open. Opens still running
+ * when a keyslot is unlocked or the token timeout expires are cancelled.
+ * Tokens processed here are marked in handled list and skipped later
+ * by the blocking open.
+ */
+struct token_async {
+	const struct crypt_token_handler_v2 *h;
+	void *ctx;
+	char *buffer;
+	size_t buffer_len;
+	uint64_t start_us;
+	uint64_t open_us;
+	int token;
+	int fd;
+	int r;
+	bool done;
+	bool checked;
+};
+
+static int token_open_priority_async(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	json_object *jobj_tokens,
+	const char *type,
+	int segment,
+	crypt_keyslot_priority priority,
+	void *usrptr,
+	int *stored_retval,
+	uint32_t *block_list,
+	uint32_t *handled,
+	struct volume_key **vk)
+{
+	struct token_async a[LUKS2_TOKENS_MAX] = {}, *p, *q;
+	struct pollfd fds[LUKS2_TOKENS_MAX];
+	int idx[LUKS2_TOKENS_MAX];
+	const struct crypt_token_handler_v2 *h;
+	struct timespec deadline;
+	int i, n, count = 0, token, r = 0;
+	bool limit, found = false, timed_out = false;
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		token = atoi(slot);
+		if (token_is_blocked(token, block_list) || count >= LUKS2_TOKENS_MAX)
+			continue;
+		/* failures are reported later by the blocking open in token order */
+		if (token_handler_prepare(cd, hdr, token, val, type, segment, priority, true, &h) < 0 ||
+		    !h->open_async)
+			continue;
+
+		token_block(token, handled);
+		p = &a[count++];
+		p->h = h;
+		p->token = token;
+		p->fd = -1;
+		if (token_prefetch_take(cd, hdr, token, &p->buffer, &p->buffer_len) ||
+		    token_cache_get(cd, hdr, token, &p->buffer, &p->buffer_len)) {
+			p->done = true;
+			continue;
+		}
+
+		p->start_us = token_time_us();
+		r = h->open_async(cd, token, usrptr, &p->ctx);
+		if (r < 0) {
+			p->r = translate_errno(cd, r, h->name);
+			p->open_us = token_time_us() - p->start_us;
+			p->done = true;
+		} else
+			p->fd = r;
+	}
+
+	if (!count)
+		return *stored_retval;
+
+	limit = token_deadline(cd, &deadline);
+	log_dbg(cd, "Waiting for %d asynchronous tokens with priority %d.", count, priority);
+
+	while (true) {
+		/* first finished open in token order, or poll list of the running ones */
+		for (p = NULL, n = 0, i = 0; i < count && !p; i++) {
+			if (a[i].checked)
+				continue;
+			if (a[i].done) {
+				p = &a[i];
+				continue;
+			}
+			fds[n].fd = a[i].fd;
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			idx[n++] = i;
+		}
+
+		if (p) {
+			p->checked = true;
+			r = p->r;
+			token_stats_open(cd, p->token, p->open_us, r);
+			if (r < 0)
+				log_dbg(cd, "Token %d (%s) open failed with %d.", p->token, p->h->name, r);
+			else {
+				r = LUKS2_keyslot_open_by_token(cd, hdr, p->token, segment, priority,
+								p->buffer, p->buffer_len, vk);
+				LUKS2_token_buffer_free(cd, p->token, p->buffer, p->buffer_len);
+			}
+
+			if (r == -ENOANO)
+				token_block(p->token, block_list);
+
+			if (break_loop_retval(r)) {
+				found = true;
+				break;
+			}
+
+			update_return_errno(r, stored_retval);
+			continue;
+		}
+
+		if (!n)
+			break;
+
+		r = poll(fds, n, token_deadline_ms(limit ? &deadline : NULL));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (r < 0)
+				log_dbg(cd, "Poll of token descriptors failed (%d).", -errno);
+			timed_out = true;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!fds[i].revents)
+				continue;
+			q = &a[idx[i]];
+			r = q->h->open_finish(cd, q->token, q->ctx, &q->buffer, &q->buffer_len);
+			if (r == -EINPROGRESS)
+				continue;
+			q->r = translate_errno(cd, r, q->h->name);
+			q->open_us = token_time_us() - q->start_us;
+			q->done = true;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!a[i].done) {
+			log_dbg(cd, "Cancelling open of token %d%s.", a[i].token, timed_out ? " (timeout)" : "");
+			a[i].h->cancel(cd, a[i].token, a[i].ctx);
+			token_stats_open(cd, a[i].token, token_time_us() - a[i].start_us,
+					 timed_out ? -EAGAIN : -ECANCELED);
+			/* as if token was not available */
+			if (timed_out)
+				update_return_errno(-EAGAIN, stored_retval);
+		} else if (!a[i].checked) {
+			token_stats_open(cd, a[i].token, a[i].open_us, -ECANCELED);
+			if (!a[i].r)
+				LUKS2_token_buffer_free(cd, a[i].token, a[i].buffer, a[i].buffer_len);
+		}
+	}
+
+	return found ? r : *stored_retval;
+}
+
 static int token_open_priority(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	json_object *jobj_tokens,
@@ -649,6 +1670,7 @@ static int token_open_priority(struct crypt_device *cd,
 	uint32_t *block_list,
 	struct volume_key **vk)
 {
+	uint32_t handled = 0;
 	char *buffer;
 	size_t buffer_size;
 	int token, r;
@@ -656,9 +1678,21 @@ static int token_open_priority(struct crypt_device *cd,
 	assert(stored_retval);
 	assert(block_list);
 
+	/* asynchronous handlers first, they can be waited for all at once */
+	if (!pin) {
+		r = token_open_priority_async(cd, hdr, jobj_tokens, type, segment, priority,
+					      usrptr, stored_retval, block_list, &handled, vk);
+		if (break_loop_retval(r))
+			return r;
+	}
+
+	if (!pin && crypt_token_parallel_open(cd))
+		return token_open_priority_parallel(cd, hdr, jobj_tokens, type, segment, priority,
+						    usrptr, stored_retval, block_list, &handled, vk);
+
 	json_object_object_foreach(jobj_tokens, slot, val) {
 		token = atoi(slot);
-		if (token_is_blocked(token, block_list))
+		if (token_is_blocked(token, block_list) || token_is_blocked(token, &handled))
 			continue;
 		r = token_open(cd, hdr, token, val, type, segment, priority, pin, pin_size, &buffer, &buffer_size, usrptr, true);
 		if (!r) {
@@ -679,6 +1713,23 @@ static int token_open_priority(struct crypt_device *cd,
 	return *stored_retval;
 }
 
+/* False only if header index proves no token has keyslot with the priority */
+static bool tokens_with_priority(struct luks2_hdr *hdr, json_object *jobj_tokens,
+				 crypt_keyslot_priority priority)
+{
+	crypt_keyslot_priority max_priority;
+	const int8_t *keyslots;
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		UNUSED(val);
+		if (LUKS2_hdr_index_token_keyslots(hdr, atoi(slot), &keyslots, &max_priority) < 0 ||
+		    max_priority == CRYPT_SLOT_PRIORITY_INVALID || max_priority >= priority)
+			return true;
+	}
+
+	return false;
+}
+
 static int token_open_any(struct crypt_device *cd, struct luks2_hdr *hdr, const char *type, int segment,
 			  const char *pin, size_t pin_size, void *usrptr, struct volume_key **vk)
 {
@@ -686,16 +1737,19 @@ static int token_open_any(struct crypt_device *cd, struct luks2_hdr *hdr, const
 	int r, retval = -ENOENT;
 	uint32_t blocked = 0; /* bitmap with tokens blocked from loop by returning -ENOANO (wrong/missing pin) */
 
-	json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens);
+	if (!(jobj_tokens = LUKS2_get_tokens_jobj(hdr)))
+		return -EINVAL;
 
 	/* passing usrptr for CRYPT_ANY_TOKEN does not make sense without specific type */
 	if (!type)
 		usrptr = NULL;
 
-	r = token_open_priority(cd, hdr, jobj_tokens, type, segment, CRYPT_SLOT_PRIORITY_PREFER,
-				pin, pin_size, usrptr, &retval, &blocked, vk);
-	if (break_loop_retval(r))
-		return r;
+	if (tokens_with_priority(hdr, jobj_tokens, CRYPT_SLOT_PRIORITY_PREFER)) {
+		r = token_open_priority(cd, hdr, jobj_tokens, type, segment, CRYPT_SLOT_PRIORITY_PREFER,
+					pin, pin_size, usrptr, &retval, &blocked, vk);
+		if (break_loop_retval(r))
+			return r;
+	}
 
 	return token_open_priority(cd, hdr, jobj_tokens, type, segment, CRYPT_SLOT_PRIORITY_NORMAL,
 				   pin, pin_size, usrptr, &retval, &blocked, vk);
@@ -718,6 +1772,8 @@ int LUKS2_token_unlock_key(struct crypt_device *cd,
 
 	assert(vk);
 
+	crypt_token_stats_reset(cd);
+
 	if (segment == CRYPT_DEFAULT_SEGMENT)
 		segment = LUKS2_get_default_segment(hdr);
 
@@ -893,7 +1949,8 @@ int LUKS2_token_assign(struct crypt_device *cd, struct luks2_hdr *hdr,
 		return -EINVAL;
 
 	if (token == CRYPT_ANY_TOKEN) {
-		json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens);
+		if (!(jobj_tokens = LUKS2_get_tokens_jobj(hdr)))
+			return -EINVAL;
 
 		json_object_object_foreach(jobj_tokens, key, val) {
 			UNUSED(val);
@@ -904,6 +1961,8 @@ int LUKS2_token_assign(struct crypt_device *cd, struct luks2_hdr *hdr,
 	} else
 		r = assign_one_token(cd, hdr, keyslot, token, assign);
 
+	LUKS2_hdr_index_invalidate(hdr);
+
 	if (r < 0)
 		return r;
 
@@ -993,12 +2052,15 @@ int LUKS2_token_unlock_passphrase(struct crypt_device *cd,
 	if (!hdr)
 		return -EINVAL;
 
+	crypt_token_stats_reset(cd);
+
 	if (token >= 0 && token < LUKS2_TOKENS_MAX) {
 		if ((jobj_token = LUKS2_get_token_jobj(hdr, token)))
 			r = token_open(cd, hdr, token, jobj_token, type, CRYPT_ANY_SEGMENT, CRYPT_SLOT_PRIORITY_IGNORE,
 				       pin, pin_size, &buffer, &buffer_size, usrptr, false);
 	} else if (token == CRYPT_ANY_TOKEN) {
-		json_object_object_get_ex(hdr->jobj, "tokens", &jobj_tokens);
+		if (!(jobj_tokens = LUKS2_get_tokens_jobj(hdr)))
+			return -EINVAL;
 
 		if (!type)
 			usrptr = NULL;
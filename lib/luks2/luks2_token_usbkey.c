@@ -0,0 +1,348 @@
+/*
+ * LUKS - Linux Unified Key Setup v2, USB key token
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "luks2_internal.h"
+
+/*
+ * Key is stored directly on a dedicated USB stick (raw device or partition,
+ * no filesystem mount needed) at given offset. The stick is referenced
+ * by filesystem UUID or partition UUID through udev /dev/disk links.
+ */
+#define USBKEY_DISK_DIR		"/dev/disk"
+#define USBKEY_UUID_DIR		USBKEY_DISK_DIR "/by-uuid"
+#define USBKEY_PARTUUID_DIR	USBKEY_DISK_DIR "/by-partuuid"
+#define USBKEY_SIZE_MAX		(DEFAULT_KEYFILE_SIZE_MAXKB * 1024)
+/* maximal wait for USB key to appear (in seconds) */
+#define USBKEY_TIMEOUT_MAX	3600
+
+/* UUID is used in path, allow only characters udev keeps in link names */
+static bool usbkey_uuid_valid(const char *uuid)
+{
+	if (!uuid || !*uuid || strlen(uuid) > 64)
+		return false;
+
+	for (; *uuid; uuid++)
+		if (!isalnum((unsigned char)*uuid) && *uuid != '-' && *uuid != '_')
+			return false;
+
+	return true;
+}
+
+static int usbkey_path(json_object *jobj_token, char *path, size_t path_len, const char **dir)
+{
+	json_object *jobj;
+	int r;
+
+	if (json_object_object_get_ex(jobj_token, "uuid", &jobj))
+		*dir = USBKEY_UUID_DIR;
+	else if (json_object_object_get_ex(jobj_token, "partuuid", &jobj))
+		*dir = USBKEY_PARTUUID_DIR;
+	else
+		return -EINVAL;
+
+	if (!usbkey_uuid_valid(json_object_get_string(jobj)))
+		return -EINVAL;
+
+	r = snprintf(path, path_len, "%s/%s", *dir, json_object_get_string(jobj));
+	if (r < 0 || (size_t)r >= path_len)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int usbkey_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return INT_MAX;
+
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Wait until udev creates the device link. Link directory (and its parent
+ * until link directory exists) is watched with inotify, so the wait ends
+ * as soon as the link appears. The link is checked again after every event.
+ */
+static int usbkey_wait(struct crypt_device *cd, const char *path, const char *dir, unsigned timeout)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct timespec start;
+	struct pollfd pfd;
+	int fd, wd = -1, ms, r = -EAGAIN;
+
+	if (!access(path, F_OK))
+		return 0;
+
+	if (!timeout || clock_gettime(CLOCK_MONOTONIC, &start))
+		return -EAGAIN;
+
+	fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd < 0) {
+		log_dbg(cd, "Cannot initialize inotify (%d).", -errno);
+		return -EAGAIN;
+	}
+
+	log_dbg(cd, "Waiting up to %u seconds for USB key %s.", timeout, path);
+
+	/* link directory is created with the first link of its type */
+	(void)inotify_add_watch(fd, USBKEY_DISK_DIR, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+
+	while (true) {
+		if (wd < 0)
+			wd = inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+
+		/* check after watch is set, link could appear in between */
+		if (!access(path, F_OK)) {
+			r = 0;
+			break;
+		}
+
+		ms = (int)timeout * 1000 - usbkey_elapsed_ms(&start);
+		if (ms <= 0)
+			break;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, ms) < 0 && errno != EINTR)
+			break;
+
+		while (read(fd, buf, sizeof(buf)) > 0)
+			;
+	}
+
+	close(fd);
+	return r;
+}
+
+int usbkey_open(struct crypt_device *cd,
+	int token,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr __attribute__((unused)))
+{
+	json_object *jobj_token, *jobj;
+	struct luks2_hdr *hdr;
+	char path[PATH_MAX], *key;
+	const char *dir;
+	uint64_t offset;
+	uint32_t size, timeout = 0;
+	ssize_t len;
+	int devfd;
+
+	if (!(hdr = crypt_get_hdr(cd, CRYPT_LUKS2)))
+		return -EINVAL;
+
+	jobj_token = LUKS2_get_token_jobj(hdr, token);
+	if (!jobj_token)
+		return -EINVAL;
+
+	if (usbkey_path(jobj_token, path, sizeof(path), &dir))
+		return -EINVAL;
+
+	json_object_object_get_ex(jobj_token, "key_offset", &jobj);
+	offset = crypt_jobj_get_uint64(jobj);
+	json_object_object_get_ex(jobj_token, "key_size", &jobj);
+	size = crypt_jobj_get_uint32(jobj);
+	if (json_object_object_get_ex(jobj_token, "timeout", &jobj))
+		timeout = crypt_jobj_get_uint32(jobj);
+
+	if (usbkey_wait(cd, path, dir, timeout)) {
+		log_dbg(cd, "USB key %s is not available.", path);
+		return -EAGAIN;
+	}
+
+	devfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (devfd < 0) {
+		log_dbg(cd, "Cannot open USB key %s (%d).", path, -errno);
+		return -ENOENT;
+	}
+
+	key = malloc(size);
+	if (!key) {
+		close(devfd);
+		return -ENOMEM;
+	}
+
+	/* whole key in one read, device is not accessed otherwise */
+	len = pread(devfd, key, size, offset);
+	close(devfd);
+
+	if (len < 0 || (size_t)len != size) {
+		log_dbg(cd, "Cannot read %" PRIu32 " bytes of key at offset %" PRIu64 " from USB key %s.",
+			size, offset, path);
+		crypt_safe_memzero(key, size);
+		free(key);
+		return -ENOENT;
+	}
+
+	*buffer = key;
+	*buffer_len = size;
+
+	return 0;
+}
+
+int usbkey_validate(struct crypt_device *cd, const char *json)
+{
+	enum json_tokener_error jerr;
+	json_object *jobj_token, *jobj, *jobj_uuid, *jobj_partuuid;
+	const char *str;
+	int fields = 4, r = 1;
+
+	log_dbg(cd, "Validating USB key token json");
+
+	jobj_token = json_tokener_parse_verbose(json, &jerr);
+	if (!jobj_token) {
+		log_dbg(cd, "USB key token JSON parse failed.");
+		return r;
+	}
+
+	if (json_object_object_get_ex(jobj_token, "uuid", &jobj_uuid) ==
+	    json_object_object_get_ex(jobj_token, "partuuid", &jobj_partuuid)) {
+		log_dbg(cd, "USB key token requires exactly one of uuid or partuuid fields.");
+		goto out;
+	}
+
+	jobj = jobj_uuid ?: jobj_partuuid;
+	if (!json_object_is_type(jobj, json_type_string) ||
+	    !usbkey_uuid_valid(json_object_get_string(jobj))) {
+		log_dbg(cd, "USB key token has invalid UUID.");
+		goto out;
+	}
+	fields++;
+
+	/* offset is string as other LUKS2 offsets, must fit off_t */
+	if (!(jobj = json_contains_string(cd, jobj_token, LUKS2_TOKEN_USBKEY, "Token", "key_offset")))
+		goto out;
+	str = json_object_get_string(jobj);
+	if (strspn(str, "0123456789") != strlen(str) || strlen(str) > 19 ||
+	    crypt_jobj_get_uint64(jobj) > INT64_MAX) {
+		log_dbg(cd, "USB key token has invalid key_offset.");
+		goto out;
+	}
+
+	if (!(jobj = json_contains(cd, jobj_token, LUKS2_TOKEN_USBKEY, "Token", "key_size", json_type_int)) ||
+	    !validate_json_uint32(jobj) || !crypt_jobj_get_uint32(jobj) ||
+	    crypt_jobj_get_uint32(jobj) > USBKEY_SIZE_MAX) {
+		log_dbg(cd, "USB key token has invalid key_size.");
+		goto out;
+	}
+
+	if (json_object_object_get_ex(jobj_token, "timeout", &jobj)) {
+		if (!json_object_is_type(jobj, json_type_int) || !validate_json_uint32(jobj) ||
+		    crypt_jobj_get_uint32(jobj) > USBKEY_TIMEOUT_MAX) {
+			log_dbg(cd, "USB key token has invalid timeout.");
+			goto out;
+		}
+		fields++;
+	}
+
+	if (json_object_object_length(jobj_token) != fields) {
+		log_dbg(cd, "USB key token contains unexpected fields.");
+		goto out;
+	}
+
+	r = 0;
+out:
+	json_object_put(jobj_token);
+	return r;
+}
+
+void usbkey_dump(struct crypt_device *cd, const char *json)
+{
+	enum json_tokener_error jerr;
+	json_object *jobj_token, *jobj;
+
+	jobj_token = json_tokener_parse_verbose(json, &jerr);
+	if (!jobj_token)
+		return;
+
+	if (json_object_object_get_ex(jobj_token, "uuid", &jobj))
+		log_std(cd, "\tUUID:       %s\n", json_object_get_string(jobj));
+	if (json_object_object_get_ex(jobj_token, "partuuid", &jobj))
+		log_std(cd, "\tPART UUID:  %s\n", json_object_get_string(jobj));
+	if (json_object_object_get_ex(jobj_token, "key_offset", &jobj))
+		log_std(cd, "\tKey offset: %s [bytes]\n", json_object_get_string(jobj));
+	if (json_object_object_get_ex(jobj_token, "key_size", &jobj))
+		log_std(cd, "\tKey size:   %" PRIu32 " [bytes]\n", crypt_jobj_get_uint32(jobj));
+	if (json_object_object_get_ex(jobj_token, "timeout", &jobj))
+		log_std(cd, "\tTimeout:    %" PRIu32 " [s]\n", crypt_jobj_get_uint32(jobj));
+
+	json_object_put(jobj_token);
+}
+
+int LUKS2_token_usbkey_json(char *buffer, size_t buffer_size,
+	const struct crypt_token_params_luks2_usbkey *params)
+{
+	int r;
+
+	if (!params->uuid == !params->partuuid)
+		return -EINVAL;
+
+	if (!usbkey_uuid_valid(params->uuid ?: params->partuuid) ||
+	    !params->key_size || params->key_size > USBKEY_SIZE_MAX ||
+	    params->key_offset > INT64_MAX || params->timeout > USBKEY_TIMEOUT_MAX)
+		return -EINVAL;
+
+	r = snprintf(buffer, buffer_size, "{ \"type\": \"%s\", \"keyslots\":[],\"%s\":\"%s\","
+		     "\"key_offset\":\"%" PRIu64 "\",\"key_size\":%" PRIu32 ",\"timeout\":%" PRIu32 "}",
+		     LUKS2_TOKEN_USBKEY, params->uuid ? "uuid" : "partuuid",
+		     params->uuid ?: params->partuuid, params->key_offset,
+		     params->key_size, params->timeout);
+	if (r < 0 || (size_t)r >= buffer_size)
+		return -EINVAL;
+
+	return 0;
+}
+
+int LUKS2_token_usbkey_get(struct luks2_hdr *hdr,
+	int token, struct crypt_token_params_luks2_usbkey *params)
+{
+	json_object *jobj_token, *jobj;
+
+	jobj_token = LUKS2_get_token_jobj(hdr, token);
+	json_object_object_get_ex(jobj_token, "type", &jobj);
+	assert(!strcmp(json_object_get_string(jobj), LUKS2_TOKEN_USBKEY));
+
+	memset(params, 0, sizeof(*params));
+
+	if (json_object_object_get_ex(jobj_token, "uuid", &jobj))
+		params->uuid = json_object_get_string(jobj);
+	if (json_object_object_get_ex(jobj_token, "partuuid", &jobj))
+		params->partuuid = json_object_get_string(jobj);
+	json_object_object_get_ex(jobj_token, "key_offset", &jobj);
+	params->key_offset = crypt_jobj_get_uint64(jobj);
+	json_object_object_get_ex(jobj_token, "key_size", &jobj);
+	params->key_size = crypt_jobj_get_uint32(jobj);
+	if (json_object_object_get_ex(jobj_token, "timeout", &jobj))
+		params->timeout = crypt_jobj_get_uint32(jobj);
+
+	return token;
+}
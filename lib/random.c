@@ -22,12 +22,17 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/select.h>
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
 
 #include "libcryptsetup.h"
 #include "internal.h"
 
 static int random_initialised = 0;
+static pthread_mutex_t random_init_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define URANDOM_DEVICE	"/dev/urandom"
 static int urandom_fd = -1;
@@ -48,6 +53,20 @@ static int _get_urandom(char *buf, size_t len)
 	size_t old_len = len;
 	char *old_buf = buf;
 
+#ifdef HAVE_GETRANDOM
+	/* No file descriptor read, blocks only until kernel pool is initialized. */
+	while (len) {
+		r = getrandom(buf, len, 0);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		len -= r;
+		buf += r;
+	}
+	if (!len)
+		return 0;
+#endif
 	assert(urandom_fd != -1);
 
 	while (len) {
@@ -88,6 +107,18 @@ static int _get_random(struct crypt_device *ctx, char *buf, size_t len)
 	fd_set fds;
 	struct timeval tv;
 
+#ifdef HAVE_GETRANDOM
+	/* Fast path without select() if blocking pool has enough entropy. */
+	while (len) {
+		r = getrandom(buf, len, GRND_RANDOM | GRND_NONBLOCK);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		len -= r;
+		buf += r;
+	}
+#endif
 	assert(random_fd != -1);
 
 	while (len) {
@@ -142,12 +173,133 @@ static int _get_random(struct crypt_device *ctx, char *buf, size_t len)
 
 	return 0;
 }
-/* Initialisation of both RNG file descriptors is mandatory */
-int crypt_random_init(struct crypt_device *ctx)
+/*
+ * In-process generator for CRYPT_RND_NORMAL and CRYPT_RND_SALT (not in FIPS mode).
+ * ChaCha20 keystream with fast key erasure: the first bytes of every generated
+ * block rekey the generator, so already returned output cannot be recovered
+ * from the state. Seeded from kernel, reseeded after DRBG_RESEED_BYTES and
+ * after fork.
+ */
+#define DRBG_SEED_LEN		40 /* ChaCha20 key and nonce */
+#define DRBG_BLOCK_LEN		1024
+#define DRBG_RESEED_BYTES	(1024 * 1024)
+
+static struct {
+	struct crypt_chacha20 *ctx;
+	char block[DRBG_BLOCK_LEN];
+	size_t avail;
+	size_t generated;
+	bool atfork;
+} drbg;
+static pthread_mutex_t drbg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* requires drbg_lock */
+static void _drbg_drop(void)
 {
-	if (random_initialised)
-		return 0;
+	crypt_chacha20_destroy(drbg.ctx);
+	drbg.ctx = NULL;
+	crypt_safe_memzero(drbg.block, sizeof(drbg.block));
+	drbg.avail = 0;
+}
+
+/* Do not fork while other thread holds the generator state */
+static void _drbg_atfork_prepare(void)
+{
+	pthread_mutex_lock(&drbg_lock);
+}
+
+static void _drbg_atfork_parent(void)
+{
+	pthread_mutex_unlock(&drbg_lock);
+}
+
+/* Child must not continue parent stream */
+static void _drbg_atfork_child(void)
+{
+	pthread_mutex_unlock(&drbg_lock);
+	_drbg_drop();
+}
+
+/* requires drbg_lock */
+static int _drbg_rekey(const char *seed)
+{
+	struct crypt_chacha20 *ctx;
+	int r;
+
+	r = crypt_chacha20_init(&ctx, seed, 32, seed + 32, DRBG_SEED_LEN - 32);
+	if (r < 0)
+		return r;
+
+	crypt_chacha20_destroy(drbg.ctx);
+	drbg.ctx = ctx;
+	return 0;
+}
+
+/* requires drbg_lock */
+static int _drbg_refill(void)
+{
+	char seed[DRBG_SEED_LEN];
+	int r;
 
+	if (!drbg.ctx || drbg.generated >= DRBG_RESEED_BYTES) {
+		r = _get_urandom(seed, sizeof(seed));
+		if (!r)
+			r = _drbg_rekey(seed);
+		crypt_safe_memzero(seed, sizeof(seed));
+		if (r < 0)
+			return r;
+		drbg.generated = 0;
+	}
+
+	crypt_chacha20_keystream(drbg.ctx, drbg.block, sizeof(drbg.block));
+	r = _drbg_rekey(drbg.block);
+	crypt_safe_memzero(drbg.block, DRBG_SEED_LEN);
+	if (r < 0)
+		return r;
+
+	drbg.avail = sizeof(drbg.block) - DRBG_SEED_LEN;
+	return 0;
+}
+
+static int _get_drbg(char *buf, size_t len)
+{
+	char *p;
+	size_t n;
+	int r = 0;
+
+	pthread_mutex_lock(&drbg_lock);
+
+	if (!drbg.atfork && !pthread_atfork(_drbg_atfork_prepare, _drbg_atfork_parent,
+					    _drbg_atfork_child))
+		drbg.atfork = true;
+
+	/* Without fork handler child could repeat parent output, use kernel */
+	if (!drbg.atfork) {
+		pthread_mutex_unlock(&drbg_lock);
+		return _get_urandom(buf, len);
+	}
+
+	while (len) {
+		if (!drbg.avail && (r = _drbg_refill()))
+			break;
+
+		n = len < drbg.avail ? len : drbg.avail;
+		p = drbg.block + sizeof(drbg.block) - drbg.avail;
+		memcpy(buf, p, n);
+		crypt_safe_memzero(p, n);
+		drbg.avail -= n;
+		drbg.generated += n;
+		buf += n;
+		len -= n;
+	}
+
+	pthread_mutex_unlock(&drbg_lock);
+	return r;
+}
+
+/* Initialisation of both RNG file descriptors is mandatory, requires random_init_lock */
+static int _random_init(struct crypt_device *ctx)
+{
 	/* Used for CRYPT_RND_NORMAL */
 	if(urandom_fd == -1)
 		urandom_fd = open(URANDOM_DEVICE, O_RDONLY | O_CLOEXEC);
@@ -171,19 +323,38 @@ err:
 	return -ENOSYS;
 }
 
+int crypt_random_init(struct crypt_device *ctx)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&random_init_lock);
+	if (!random_initialised)
+		r = _random_init(ctx);
+	pthread_mutex_unlock(&random_init_lock);
+
+	return r;
+}
+
 int crypt_random_get(struct crypt_device *ctx, char *buf, size_t len, int quality)
 {
 	int status, rng_type;
 
+	/* RNG devices are opened on the first request, metadata-only commands never need them */
+	if (!random_initialised && crypt_random_init(ctx))
+		return -ENOSYS;
+
 	switch(quality) {
 	case CRYPT_RND_NORMAL:
-		status = _get_urandom(buf, len);
+		if (crypt_fips_mode())
+			status = _get_urandom(buf, len);
+		else
+			status = _get_drbg(buf, len);
 		break;
 	case CRYPT_RND_SALT:
 		if (crypt_fips_mode())
 			status = crypt_backend_rng(buf, len, quality, 1);
 		else
-			status = _get_urandom(buf, len);
+			status = _get_drbg(buf, len);
 		break;
 	case CRYPT_RND_KEY:
 		if (crypt_fips_mode()) {
@@ -218,6 +389,10 @@ void crypt_random_exit(void)
 {
 	random_initialised = 0;
 
+	pthread_mutex_lock(&drbg_lock);
+	_drbg_drop();
+	pthread_mutex_unlock(&drbg_lock);
+
 	if(random_fd != -1) {
 		(void)close(random_fd);
 		random_fd = -1;
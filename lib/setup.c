@@ -26,8 +26,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/utsname.h>
 #include <errno.h>
+#include <linux/limits.h>
 
 #include "libcryptsetup.h"
 #include "luks1/luks.h"
@@ -61,11 +65,63 @@ struct crypt_device {
 	uint64_t data_offset;
 	uint64_t metadata_size; /* Used in LUKS2 format */
 	uint64_t keyslots_size; /* Used in LUKS2 format */
+	bool layout_optimize;	/* Used in LUKS2 format */
 
 	/* Workaround for OOM during parallel activation (like in systemd) */
 	bool memory_hard_pbkdf_lock_enabled;
 	struct crypt_lock_handle *pbkdf_memory_hard_lock;
 
+	/* Run KDF of candidate keyslots concurrently on CRYPT_ANY_SLOT unlock */
+	bool keyslot_parallel_trial;
+
+	/* Run token handlers concurrently on CRYPT_ANY_TOKEN unlock without PIN */
+	bool token_parallel_open;
+
+	/* Timeout of token secrets cached in user keyring, 0 means no caching */
+	unsigned token_keyring_cache_timeout;
+
+	/* Time limit of async and parallel token open in ms, 0 means no limit */
+	uint32_t token_timeout_ms;
+
+	/* Time limit of forced deactivation of busy device in ms, 0 means default */
+	uint32_t deactivate_timeout_ms;
+
+	/* Number of dm-crypt targets a new mapping is split to, 0 or 1 means one */
+	unsigned dm_crypt_shards;
+
+	/* Last token unlock statistics, bit set for every tried token */
+	struct crypt_token_open_stats token_stats[LUKS2_TOKENS_MAX];
+	uint32_t token_stats_valid;
+
+	/* Keyslot hint store use (and credential of running passphrase unlock) */
+	bool keyslot_hint;
+	const char *keyslot_hint_credential;
+
+	/* Staging buffers limit for userspace VERITY FEC, 0 means default */
+	uint64_t verity_fec_memory_kb;
+	unsigned verity_threads;
+
+	/* Reencryption tuning applied on next reencryption init */
+	struct crypt_reencrypt_tuning reencrypt_tuning;
+
+	/* Per device counters and process counters snapshot from crypt_init */
+	struct crypt_perf_stats perf;
+	struct crypt_perf_stats perf_base;
+
+	/* Unlocked volume key session for keyslot context operations */
+	struct crypt_vk_session vk_session;
+
+	/* Reusable dm-crypt keystore for kernel only LUKS1 keyslot cipher */
+	char *keystore_name;
+
+	/* Running asynchronous activation, see utils_async.c */
+	struct crypt_async *async;
+
+	/* Latency spans of the running operation (CRYPT_DEBUG_JSON only) */
+	struct crypt_span *spans;
+	unsigned spans_count;
+	unsigned spans_depth;
+
 	union {
 	struct { /* used in CRYPT_LUKS1 */
 		struct luks_phdr hdr;
@@ -148,6 +204,18 @@ static int _kernel_keyring_supported;
 /* Library allowed to use kernel keyring for loading VK in kernel crypto layer */
 static int _vk_via_keyring = 1;
 
+/* Performance counters of the whole process */
+static struct crypt_perf_stats _perf_total;
+
+#define CRYPT_SPANS_MAX 64
+
+struct crypt_span {
+	const char *name;
+	uint64_t start_us;
+	uint64_t end_us;
+	pid_t tid;
+};
+
 void crypt_set_debug_level(int level)
 {
 	_debug_level = level;
@@ -182,6 +250,9 @@ void crypt_logf(struct crypt_device *cd, int level, const char *format, ...)
 	char target[LOG_MAX_LEN + 2];
 	int len;
 
+	if (level < _debug_level)
+		return;
+
 	va_start(argp, format);
 
 	len = vsnprintf(&target[0], LOG_MAX_LEN, format, argp);
@@ -223,15 +294,12 @@ int init_crypto(struct crypt_device *ctx)
 	struct utsname uts;
 	int r;
 
-	r = crypt_random_init(ctx);
-	if (r < 0) {
-		log_err(ctx, _("Cannot initialize crypto RNG backend."));
-		return r;
-	}
-
+	/* RNG is initialized on first use in crypt_random_get() */
 	r = crypt_backend_init(crypt_fips_mode());
 	if (r < 0)
 		log_err(ctx, _("Cannot initialize crypto backend."));
+	else
+		crypt_executor_init();
 
 	if (!r && !_crypto_logged) {
 		log_dbg(ctx, "Crypto backend (%s) initialized in cryptsetup library version %s.",
@@ -591,6 +659,7 @@ int crypt_init(struct crypt_device **cd, const char *device)
 		return -ENOMEM;
 
 	memset(h, 0, sizeof(*h));
+	(void)crypt_get_perf_stats(NULL, &h->perf_base);
 
 	r = device_alloc(NULL, &h->device, device);
 	if (r < 0) {
@@ -606,6 +675,41 @@ int crypt_init(struct crypt_device **cd, const char *device)
 	return 0;
 }
 
+int crypt_init_memory(struct crypt_device **cd,
+		      const char *buffer, size_t buffer_size,
+		      uint64_t device_size, int *fd)
+{
+	struct crypt_device *h = NULL;
+	int r;
+
+	if (!cd || (buffer_size && !buffer) || (!buffer_size && !device_size))
+		return -EINVAL;
+
+	log_dbg(NULL, "Allocating context for memory device (%zu bytes image).", buffer_size);
+
+	if (!(h = malloc(sizeof(struct crypt_device))))
+		return -ENOMEM;
+
+	memset(h, 0, sizeof(*h));
+	(void)crypt_get_perf_stats(NULL, &h->perf_base);
+
+	r = device_alloc_memory(NULL, &h->device, buffer, buffer_size, device_size);
+	if (r < 0) {
+		free(h);
+		return r;
+	}
+
+	dm_backend_init(NULL);
+
+	h->rng_type = crypt_random_default_key_rng();
+
+	if (fd)
+		*fd = device_memory_fd(h->device);
+
+	*cd = h;
+	return 0;
+}
+
 static int crypt_check_data_device_size(struct crypt_device *cd)
 {
 	int r;
@@ -711,6 +815,11 @@ static int _crypt_load_luks2(struct crypt_device *cd, int reload, int repair)
 
 	log_dbg(cd, "%soading LUKS2 header (repair %sabled).", reload ? "Rel" : "L", repair ? "en" : "dis");
 
+	if (reload && cd->u.luks2.hdr.batch) {
+		log_err(cd, _("Cannot reload LUKS2 metadata with uncommitted batch."));
+		return -EBUSY;
+	}
+
 	r = LUKS2_hdr_read(cd, &hdr2, repair);
 	if (r)
 		return r;
@@ -1008,15 +1117,12 @@ static int _crypt_load_bitlk(struct crypt_device *cd)
 	return 0;
 }
 
-int crypt_load(struct crypt_device *cd,
+static int _crypt_load(struct crypt_device *cd,
 	       const char *requested_type,
 	       void *params)
 {
 	int r;
 
-	if (!cd)
-		return -EINVAL;
-
 	log_dbg(cd, "Trying to load %s crypt type from device %s.",
 		requested_type ?: "any", mdata_device_path(cd) ?: "(none)");
 
@@ -1065,6 +1171,22 @@ int crypt_load(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_load(struct crypt_device *cd,
+	       const char *requested_type,
+	       void *params)
+{
+	int r, span;
+
+	if (!cd)
+		return -EINVAL;
+
+	span = crypt_spans_start(cd, "crypt_load");
+	r = _crypt_load(cd, requested_type, params);
+	crypt_spans_finish(cd, span);
+
+	return r;
+}
+
 /*
  * crypt_init() helpers
  */
@@ -1715,6 +1837,118 @@ static int _crypt_format_luks1(struct crypt_device *cd,
 	return r;
 }
 
+/* largest data alignment the optimizer uses for stripe or erase block hints */
+#define LAYOUT_ALIGN_MAX	(64 * 1024 * 1024)
+/* minimal throughput gain for 4096-byte sectors over 512-byte sectors */
+#define LAYOUT_SECTOR_GAIN	1.1
+
+static uint64_t layout_lcm(uint64_t a, uint64_t b)
+{
+	uint64_t x = a, y = b, t;
+
+	while (y) {
+		t = x % y;
+		x = y;
+		y = t;
+	}
+
+	return a / x * b;
+}
+
+static void layout_align(struct crypt_device *cd, uint64_t *alignment,
+			 uint64_t value, uint64_t max, const char *what)
+{
+	uint64_t a;
+
+	if (!value || MISALIGNED_512(value))
+		return;
+
+	a = layout_lcm(*alignment, value);
+	if (max && a > max) {
+		log_verbose(cd, _("Ignoring %s of %" PRIu64 " bytes, data alignment would exceed %" PRIu64 " MiB."),
+			    what, value, max >> 20);
+		return;
+	}
+
+	if (a != *alignment)
+		log_verbose(cd, _("Data offset aligned to %" PRIu64 " bytes (%s of %" PRIu64 " bytes)."),
+			    a, what, value);
+	*alignment = a;
+}
+
+/*
+ * Format layout optimizer (see crypt_set_layout_optimize()). Only layout
+ * parameters not requested by the caller are changed, every decision
+ * is reported in verbose output.
+ */
+static void luks2_layout_optimize(struct crypt_device *cd,
+				  const char *cipher, const char *cipher_mode,
+				  size_t volume_key_size, const char *integrity,
+				  bool sector_auto, unsigned int *sector_size,
+				  bool alignment_auto, unsigned long *required_alignment,
+				  uint64_t *keyslots_size)
+{
+	struct device *device = crypt_data_device(cd);
+	uint64_t stripe, erase_block, zone_size = 0, alignment = *required_alignment;
+	uint64_t metadata_size, data_offset;
+	double enc_512, enc_4096, dec;
+	uint32_t dmc_flags;
+	size_t block_size;
+
+	if (alignment_auto) {
+		/* data must start on zone boundary, no size limit here */
+		if (device_zoned(device, &zone_size) > 0)
+			layout_align(cd, &alignment, zone_size, 0, "zone size");
+
+		if (!device_layout_hints(device, &stripe, &erase_block)) {
+			layout_align(cd, &alignment, stripe, LAYOUT_ALIGN_MAX, "RAID full stripe");
+			layout_align(cd, &alignment, erase_block, LAYOUT_ALIGN_MAX, "erase block");
+		}
+
+		if (alignment != *required_alignment && alignment <= ULONG_MAX)
+			*required_alignment = (unsigned long)alignment;
+
+		/* use the gap before aligned data offset for keyslots */
+		metadata_size = cd->metadata_size ?: LUKS2_HDR_16K_LEN;
+		data_offset = size_round_up(LUKS2_DEFAULT_HDR_SIZE, *required_alignment);
+		if (!cd->keyslots_size && data_offset > LUKS2_DEFAULT_HDR_SIZE &&
+		    data_offset - 2 * metadata_size <= LUKS2_MAX_KEYSLOTS_SIZE) {
+			*keyslots_size = data_offset - 2 * metadata_size;
+			log_verbose(cd, _("Keyslots area extended to %" PRIu64 " bytes (up to aligned data offset)."),
+				    *keyslots_size);
+		}
+	}
+
+	if (!sector_auto || *sector_size >= MAX_SECTOR_SIZE)
+		return;
+
+	block_size = device_block_size(cd, device);
+	if (!block_size || block_size > MAX_SECTOR_SIZE ||
+	    dm_flags(cd, DM_CRYPT, &dmc_flags) || !(dmc_flags & DM_SECTOR_SIZE_SUPPORTED))
+		return;
+
+	if (integrity) {
+		*sector_size = MAX_SECTOR_SIZE;
+		log_verbose(cd, _("Using %u-byte encryption sectors, integrity tag is stored per sector."),
+			    *sector_size);
+		return;
+	}
+
+	if (crypt_benchmark_parallel(cd, cipher, cipher_mode, volume_key_size, SECTOR_SIZE,
+				     1024 * 1024, 1, &enc_512, &dec) ||
+	    crypt_benchmark_parallel(cd, cipher, cipher_mode, volume_key_size, MAX_SECTOR_SIZE,
+				     1024 * 1024, 1, &enc_4096, &dec))
+		return;
+
+	log_verbose(cd, _("Cipher %s-%s encrypts %.1f MiB/s with 512-byte and %.1f MiB/s with 4096-byte sectors."),
+		    cipher, cipher_mode, enc_512, enc_4096);
+
+	if (enc_4096 > enc_512 * LAYOUT_SECTOR_GAIN) {
+		*sector_size = MAX_SECTOR_SIZE;
+		log_verbose(cd, _("Using %u-byte encryption sectors."), *sector_size);
+	}
+}
+
 static int _crypt_format_luks2(struct crypt_device *cd,
 			       const char *cipher,
 			       const char *cipher_mode,
@@ -1729,8 +1963,9 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 	unsigned long alignment_offset = 0;
 	unsigned int sector_size;
 	const char *integrity = params ? params->integrity : NULL;
-	uint64_t dev_size;
+	uint64_t dev_size, keyslots_size = cd->keyslots_size;
 	uint32_t dmc_flags;
+	bool alignment_autodetect = false;
 
 	cd->u.luks2.hdr.jobj = NULL;
 	cd->u.luks2.keyslot_cipher = NULL;
@@ -1839,10 +2074,17 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 		required_alignment = params->data_alignment * SECTOR_SIZE;
 	} else if (params && params->data_alignment) {
 		required_alignment = params->data_alignment * SECTOR_SIZE;
-	} else
+	} else {
 		device_topology_alignment(cd, cd->device,
 				       &required_alignment,
 				       &alignment_offset, DEFAULT_DISK_ALIGNMENT);
+		alignment_autodetect = !cd->data_offset;
+	}
+
+	if (cd->layout_optimize)
+		luks2_layout_optimize(cd, cipher, cipher_mode, volume_key_size - integrity_key_size,
+				      integrity, sector_size_autodetect, &sector_size,
+				      alignment_autodetect, &required_alignment, &keyslots_size);
 
 	r = device_size(crypt_data_device(cd), &dev_size);
 	if (r < 0)
@@ -1861,7 +2103,12 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 
 	/* FIXME: allow this later also for normal ciphers (check AF_ALG availability. */
 	if (integrity && !integrity_key_size) {
-		r = crypt_cipher_check_kernel(cipher, cipher_mode, integrity, volume_key_size);
+		r = crypt_cipher_cache_check(cd, cipher, cipher_mode, integrity, volume_key_size);
+		if (r < 0) {
+			r = crypt_cipher_check_kernel(cipher, cipher_mode, integrity, volume_key_size);
+			if (!r)
+				crypt_cipher_cache_add(cd, cipher, cipher_mode, integrity, volume_key_size);
+		}
 		if (r < 0) {
 			log_err(cd, _("Cipher %s-%s (key size %zd bits) is not available."),
 				cipher, cipher_mode, volume_key_size * 8);
@@ -1884,7 +2131,7 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 			       cd->data_offset * SECTOR_SIZE,
 			       alignment_offset,
 			       required_alignment,
-			       cd->metadata_size, cd->keyslots_size);
+			       cd->metadata_size, keyslots_size);
 	if (r < 0)
 		goto out;
 
@@ -2298,6 +2545,10 @@ static int _crypt_format(struct crypt_device *cd,
 	if (!cd || !type)
 		return -EINVAL;
 
+#if CRYPTSETUP_UNLOCK_ONLY
+	log_err(cd, _("Format operation is not supported by unlock-only library."));
+	return -ENOTSUP;
+#endif
 	if (cd->type) {
 		log_dbg(cd, "Context already formatted as %s.", cd->type);
 		return -EINVAL;
@@ -2369,6 +2620,154 @@ CRYPT_SYMBOL_EXPORT_OLD(int, crypt_format, 2, 0,
 	return _crypt_format(cd, type, cipher, cipher_mode, uuid, volume_key, volume_key_size, params, false);
 }
 
+/*
+ * Batch format: the first device runs alone and calibrates PBKDF, the rest
+ * reuse its values and are formatted concurrently. Number of concurrent
+ * jobs is limited by online CPUs and by PBKDF memory cost.
+ */
+struct format_batch_job {
+	struct crypt_format_batch_entry *entry;
+	struct crypt_thread thread;
+	bool threaded;
+	const char *type;
+	const char *cipher;
+	const char *cipher_mode;
+	const char *volume_key;
+	size_t volume_key_size;
+	const struct crypt_pbkdf_type *pbkdf;
+	const char *passphrase;
+	size_t passphrase_size;
+};
+
+static void *format_batch_run(void *arg)
+{
+	struct format_batch_job *job = arg;
+	struct crypt_device *cd = job->entry->cd;
+	int r;
+
+	r = _crypt_format(cd, job->type, job->cipher, job->cipher_mode, NULL,
+			  job->volume_key, job->volume_key_size, job->entry->params, true);
+	if (!r && job->pbkdf)
+		r = crypt_set_pbkdf_type(cd, job->pbkdf);
+	if (!r && job->passphrase)
+		r = crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, job->volume_key,
+				job->volume_key_size, job->passphrase, job->passphrase_size);
+
+	job->entry->result = r < 0 ? r : 0;
+	return NULL;
+}
+
+static size_t format_batch_jobs(const struct crypt_pbkdf_type *pbkdf, size_t count)
+{
+	const char *source;
+	uint32_t memory_kb;
+	size_t jobs = crypt_cpusonline();
+
+	if (pbkdf && pbkdf->parallel_threads > 1)
+		jobs /= pbkdf->parallel_threads;
+
+	if (pbkdf && pbkdf->max_memory_kb &&
+	    strcmp(pbkdf->type, CRYPT_KDF_PBKDF2)) {
+		memory_kb = crypt_pbkdf_memory_limit_kb(&source);
+		if (jobs > memory_kb / pbkdf->max_memory_kb)
+			jobs = memory_kb / pbkdf->max_memory_kb;
+	}
+
+	if (jobs > count)
+		jobs = count;
+
+	return jobs ?: 1;
+}
+
+int crypt_format_batch(struct crypt_format_batch_entry *entries, size_t count,
+	const char *type,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	const char *passphrase,
+	size_t passphrase_size)
+{
+	struct format_batch_job *jobs = NULL;
+	struct crypt_pbkdf_type pbkdf;
+	const struct crypt_pbkdf_type *pbkdf_cd;
+	char *vks = NULL;
+	size_t i, j, n;
+	int r;
+
+	if (!entries || !count || !type || !isLUKS(type) || !volume_key_size ||
+	    count > SIZE_MAX / volume_key_size)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!entries[i].cd)
+			return -EINVAL;
+		entries[i].result = -EINVAL;
+	}
+
+	r = init_crypto(entries[0].cd);
+	if (r < 0)
+		return r;
+
+	log_dbg(entries[0].cd, "Formatting batch of %zu devices as type %s.", count, type);
+
+	/* all volume keys in one draw */
+	vks = crypt_safe_alloc(count * volume_key_size);
+	jobs = calloc(count, sizeof(*jobs));
+	if (!vks || !jobs) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_random_get(entries[0].cd, vks, count * volume_key_size, CRYPT_RND_KEY);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		jobs[i].entry = &entries[i];
+		jobs[i].type = type;
+		jobs[i].cipher = cipher;
+		jobs[i].cipher_mode = cipher_mode;
+		jobs[i].volume_key = vks + i * volume_key_size;
+		jobs[i].volume_key_size = volume_key_size;
+		jobs[i].passphrase = passphrase;
+		jobs[i].passphrase_size = passphrase_size;
+	}
+
+	format_batch_run(&jobs[0]);
+	r = entries[0].result;
+	if (r < 0)
+		goto out;
+
+	/* calibrated values of the first keyslot, without benchmark */
+	pbkdf_cd = crypt_get_pbkdf_type(entries[0].cd);
+	if (passphrase && pbkdf_cd) {
+		pbkdf = *pbkdf_cd;
+		pbkdf.flags |= CRYPT_PBKDF_NO_BENCHMARK;
+		for (i = 1; i < count; i++)
+			jobs[i].pbkdf = &pbkdf;
+	}
+
+	n = format_batch_jobs(jobs[0].pbkdf, count - 1);
+	log_dbg(entries[0].cd, "Using %zu concurrent format jobs.", n);
+
+	for (i = 1; i < count; i += n) {
+		for (j = i; j < i + n && j < count; j++)
+			jobs[j].threaded = !crypt_thread_start(&jobs[j].thread, format_batch_run, &jobs[j], 0);
+		for (j = i; j < i + n && j < count; j++)
+			if (!jobs[j].threaded)
+				format_batch_run(&jobs[j]);
+		for (j = i; j < i + n && j < count; j++)
+			crypt_thread_join(&jobs[j].thread);
+	}
+
+	for (i = 0; i < count && !r; i++)
+		r = entries[i].result;
+out:
+	crypt_safe_free(vks);
+	free(jobs);
+	return r;
+}
+
 int crypt_repair(struct crypt_device *cd,
 		 const char *requested_type,
 		 void *params __attribute__((unused)))
@@ -2842,6 +3241,108 @@ out:
 	return r;
 }
 
+/*
+ * Reload only the length of active dm-crypt table, all other parameters
+ * (including the key or its keyring description) are taken from the active device.
+ */
+static int _resize_active_device(struct crypt_device *cd, const char *name,
+				 struct crypt_dm_active_device *dmd, uint64_t new_size)
+{
+	dmd->size = dmd->segment.size = new_size;
+	dmd->flags |= CRYPT_ACTIVATE_REFRESH;
+
+	return dm_reload_device(cd, name, dmd, 0, 1);
+}
+
+/*
+ * LUKS2 with authenticated encryption: dm-crypt is stacked over dm-integrity
+ * device (<name>_dif). Both tables are reloaded with the new length only;
+ * the integrity device is resized first when growing and last when shrinking.
+ */
+static int _resize_device_with_integrity(struct crypt_device *cd, const char *name,
+					 struct crypt_dm_active_device *dmd, uint64_t new_size)
+{
+	struct crypt_dm_active_device dmdi = {};
+	struct dm_target *tgti = &dmdi.segment;
+	uint32_t supported_flags = 0;
+	uint64_t max_size;
+	char iname[PATH_MAX];
+	int r;
+
+	if (snprintf(iname, sizeof(iname), "%s_dif", name) < 0)
+		return -EINVAL;
+
+	r = dm_query_device(cd, iname, DM_ACTIVE_DEVICE | DM_ACTIVE_UUID |
+			    DM_ACTIVE_CRYPT_KEYSIZE | DM_ACTIVE_CRYPT_KEY |
+			    DM_ACTIVE_INTEGRITY_PARAMS | DM_ACTIVE_JOURNAL_CRYPT_KEY |
+			    DM_ACTIVE_JOURNAL_MAC_KEY, &dmdi);
+	if (r < 0) {
+		log_err(cd, _("Device %s is not active."), iname);
+		return -EINVAL;
+	}
+
+	if (!single_segment(&dmdi) || tgti->type != DM_INTEGRITY || tgti->u.integrity.meta_device) {
+		log_err(cd, _("Unsupported parameters on device %s."), iname);
+		r = -ENOTSUP;
+		goto out;
+	}
+
+	/* Kernel recalculates provided data sectors on table load */
+	if (!new_size || new_size > dmdi.size) {
+		r = dm_reload_device(cd, iname, &dmdi, 0, 1);
+		if (r)
+			goto out;
+	}
+
+	r = INTEGRITY_data_sectors(cd, crypt_data_device(cd),
+				   crypt_get_data_offset(cd) * SECTOR_SIZE, &max_size);
+	if (r < 0)
+		goto out;
+	log_dbg(cd, "Maximum integrity device size from kernel %" PRIu64, max_size);
+
+	if (!new_size)
+		new_size = max_size;
+	else if (new_size > max_size) {
+		if (!dm_flags(cd, DM_INTEGRITY, &supported_flags) &&
+		    !(supported_flags & DM_INTEGRITY_RESIZE_SUPPORTED))
+			log_err(cd, _("Resize failed, the kernel doesn't support it."));
+		else
+			log_err(cd, _("Device %s is too small."), iname);
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (MISALIGNED(new_size, dmd->segment.u.crypt.sector_size >> SECTOR_SHIFT)) {
+		log_err(cd, _("Device size is not aligned to requested sector size."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (new_size == dmd->size) {
+		log_dbg(cd, "Device has already requested size %" PRIu64
+			" sectors.", dmd->size);
+		r = 0;
+		goto out;
+	}
+
+	dmdi.size = tgti->size = new_size;
+	dmdi.flags |= CRYPT_ACTIVATE_REFRESH;
+
+	if (new_size > dmd->size) {
+		r = dm_reload_device(cd, iname, &dmdi, 0, 1);
+		if (!r)
+			r = _resize_active_device(cd, name, dmd, new_size);
+	} else {
+		r = _resize_active_device(cd, name, dmd, new_size);
+		if (!r)
+			r = dm_reload_device(cd, iname, &dmdi, 0, 1);
+	}
+out:
+	dm_targets_free(cd, &dmdi);
+	free(CONST_CAST(void*)dmdi.uuid);
+	return r;
+}
+
 int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 {
 	struct crypt_dm_active_device dmdq, dmd = {};
@@ -2867,7 +3368,8 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 
 	log_dbg(cd, "Resizing device %s to %" PRIu64 " sectors.", name, new_size);
 
-	r = dm_query_device(cd, name, DM_ACTIVE_CRYPT_KEYSIZE | DM_ACTIVE_CRYPT_KEY |
+	r = dm_query_device(cd, name, DM_ACTIVE_DEVICE | DM_ACTIVE_CRYPT_CIPHER | DM_ACTIVE_UUID |
+			    DM_ACTIVE_CRYPT_KEYSIZE | DM_ACTIVE_CRYPT_KEY |
 			    DM_ACTIVE_INTEGRITY_PARAMS | DM_ACTIVE_JOURNAL_CRYPT_KEY |
 			    DM_ACTIVE_JOURNAL_MAC_KEY, &dmdq);
 	if (r < 0) {
@@ -2906,6 +3408,12 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 			log_err(cd, _("Cannot resize loop device."));
 	}
 
+	if (tgt->type == DM_CRYPT && tgt->u.crypt.tag_size) {
+		r = isLUKS2(cd->type) ? LUKS2_unmet_requirements(cd, &cd->u.luks2.hdr, 0, 0) : -ENOTSUP;
+		if (!r)
+			r = _resize_device_with_integrity(cd, name, &dmdq, new_size);
+		goto out;
+	}
 
 	/*
 	 * Integrity device metadata are maintained by the kernel. We need to
@@ -2966,11 +3474,35 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 		goto out;
 	}
 
-	dmd.uuid = crypt_get_uuid(cd);
-	dmd.size = new_size;
-	dmd.flags = dmdq.flags | CRYPT_ACTIVATE_REFRESH;
+	if (new_size == dmdq.size) {
+		log_dbg(cd, "Device has already requested size %" PRIu64
+			" sectors.", dmdq.size);
+		r = 0;
+		goto out;
+	}
 
-	if (tgt->type == DM_CRYPT) {
+	if (isLUKS2(cd->type)) {
+		r = LUKS2_unmet_requirements(cd, &cd->u.luks2.hdr, 0, 0);
+		if (r)
+			goto out;
+	}
+
+	/*
+	 * The active table matches the context, only its length changes
+	 * (no table rebuild from metadata and no second query in _reload_device).
+	 */
+	if (tgt->type == DM_CRYPT && tgt->u.crypt.offset == crypt_get_data_offset(cd) &&
+	    device_is_identical(tgt->data_device, crypt_data_device(cd)) > 0) {
+		log_dbg(cd, "Resizing active device table length only.");
+		r = _resize_active_device(cd, name, &dmdq, new_size);
+		goto out;
+	}
+
+	dmd.uuid = crypt_get_uuid(cd);
+	dmd.size = new_size;
+	dmd.flags = dmdq.flags | CRYPT_ACTIVATE_REFRESH;
+
+	if (tgt->type == DM_CRYPT) {
 		r = dm_crypt_target_set(&dmd.segment, 0, new_size, crypt_data_device(cd),
 				tgt->u.crypt.vk, crypt_get_cipher_spec(cd),
 				crypt_get_iv_offset(cd), crypt_get_data_offset(cd),
@@ -2992,26 +3524,16 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 			goto out;
 	}
 
-	if (new_size == dmdq.size) {
-		log_dbg(cd, "Device has already requested size %" PRIu64
-			" sectors.", dmdq.size);
-		r = 0;
-	} else {
-		if (isTCRYPT(cd->type))
-			r = -ENOTSUP;
-		else if (isLUKS2(cd->type))
-			r = LUKS2_unmet_requirements(cd, &cd->u.luks2.hdr, 0, 0);
-		if (!r)
-			r = _reload_device(cd, name, &dmd);
+	r = _reload_device(cd, name, &dmd);
 
-		if (r && tgt->type == DM_INTEGRITY &&
-		    !dm_flags(cd, tgt->type, &supported_flags) &&
-		    !(supported_flags & DM_INTEGRITY_RESIZE_SUPPORTED))
-			log_err(cd, _("Resize failed, the kernel doesn't support it."));
-	}
+	if (r && tgt->type == DM_INTEGRITY &&
+	    !dm_flags(cd, tgt->type, &supported_flags) &&
+	    !(supported_flags & DM_INTEGRITY_RESIZE_SUPPORTED))
+		log_err(cd, _("Resize failed, the kernel doesn't support it."));
 out:
 	dm_targets_free(cd, &dmd);
 	dm_targets_free(cd, &dmdq);
+	free(CONST_CAST(void*)dmdq.uuid);
 
 	return r;
 }
@@ -3106,6 +3628,39 @@ int crypt_header_backup(struct crypt_device *cd,
 	return r;
 }
 
+/* Header backup archive, see utils_backup_archive.c */
+int crypt_header_backup_load(struct crypt_device *cd, const char *requested_type,
+			     uint64_t *seqid)
+{
+	int r;
+
+	if (requested_type && !isLUKS(requested_type))
+		return -EINVAL;
+
+	r = _crypt_load_luks(cd, requested_type, false, false);
+	if (r < 0)
+		return r;
+
+	if (isLUKS1(cd->type) && (!requested_type || isLUKS1(requested_type)))
+		*seqid = 0;
+	else if (isLUKS2(cd->type) && (!requested_type || isLUKS2(requested_type)))
+		*seqid = cd->u.luks2.hdr.seqid;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+int crypt_header_backup_image(struct crypt_device *cd, char **image, size_t *image_size)
+{
+	if (isLUKS1(cd->type))
+		return LUKS_hdr_backup_image(cd, image, image_size);
+	if (isLUKS2(cd->type))
+		return LUKS2_hdr_backup_image(cd, &cd->u.luks2.hdr, image, image_size);
+
+	return -EINVAL;
+}
+
 int crypt_header_restore(struct crypt_device *cd,
 			 const char *requested_type,
 			 const char *backup_file)
@@ -3183,8 +3738,10 @@ void crypt_free(struct crypt_device *cd)
 
 	log_dbg(cd, "Releasing crypt device %s context.", mdata_device_path(cd) ?: "empty");
 
+	LUKS_keystore_drop(cd);
 	dm_backend_exit(cd);
 	crypt_free_volume_key(cd->volume_key);
+	crypt_vk_session_drop(cd, &cd->vk_session, false);
 
 	crypt_free_type(cd);
 
@@ -3193,6 +3750,7 @@ void crypt_free(struct crypt_device *cd)
 
 	free(CONST_CAST(void*)cd->pbkdf.type);
 	free(CONST_CAST(void*)cd->pbkdf.hash);
+	free(cd->spans);
 
 	/* Some structures can contain keys (TCRYPT), wipe it */
 	crypt_safe_memzero(cd, sizeof(*cd));
@@ -3522,6 +4080,350 @@ int crypt_resume_by_token_pin(struct crypt_device *cd, const char *name,
 	return r < 0 ? r : keyslot;
 }
 
+/*
+ * Wrapped resume key: volume key encrypted by AES-XTS and authenticated by
+ * HMAC-SHA256 (encrypt-then-MAC), both keys derived from the caller-provided
+ * wrapping secret by the context PBKDF (benchmarked as for a keyslot). Salt is
+ * random for every wrap, so the derived keys are never reused and zero IV
+ * is safe. Blob format is header (PBKDF parameters, salt) || encrypted
+ * volume key || MAC of both, stored as user key with timeout.
+ */
+#define RESUME_KEY_MAGIC "CRRESUME"
+#define RESUME_KEY_SALT_SIZE 32
+#define RESUME_KEY_ENC_SIZE 64
+#define RESUME_KEY_MAC_SIZE 32
+#define RESUME_KEY_KEK_SIZE (RESUME_KEY_ENC_SIZE + RESUME_KEY_MAC_SIZE)
+
+enum { RESUME_KDF_PBKDF2_SHA256 = 1, RESUME_KDF_ARGON2I, RESUME_KDF_ARGON2ID };
+
+struct resume_key_hdr {
+	char magic[8];
+	uint32_t kdf;
+	uint32_t iterations;
+	uint32_t memory_kb;
+	uint32_t parallel;
+	char salt[RESUME_KEY_SALT_SIZE];
+} __attribute__((packed));
+
+static int resume_key_kdf_id(const char *type)
+{
+	if (!strcmp(type, CRYPT_KDF_PBKDF2))
+		return RESUME_KDF_PBKDF2_SHA256;
+	if (!strcmp(type, CRYPT_KDF_ARGON2I))
+		return RESUME_KDF_ARGON2I;
+	if (!strcmp(type, CRYPT_KDF_ARGON2ID))
+		return RESUME_KDF_ARGON2ID;
+	return -EINVAL;
+}
+
+static const char *resume_key_kdf_type(uint32_t id)
+{
+	switch (id) {
+	case RESUME_KDF_PBKDF2_SHA256: return CRYPT_KDF_PBKDF2;
+	case RESUME_KDF_ARGON2I:       return CRYPT_KDF_ARGON2I;
+	case RESUME_KDF_ARGON2ID:      return CRYPT_KDF_ARGON2ID;
+	}
+	return NULL;
+}
+
+/* Same cost as a new keyslot of this context would get */
+static int resume_key_hdr_init(struct crypt_device *cd, struct resume_key_hdr *hdr)
+{
+	const struct crypt_pbkdf_type *cd_pbkdf = crypt_get_pbkdf_type(cd);
+	struct crypt_pbkdf_type pbkdf;
+	int r, kdf;
+
+	if (!cd_pbkdf || !cd_pbkdf->type)
+		return -EINVAL;
+
+	pbkdf = *cd_pbkdf;
+	if (!strcmp(pbkdf.type, CRYPT_KDF_PBKDF2))
+		pbkdf.hash = "sha256";
+
+	kdf = resume_key_kdf_id(pbkdf.type);
+	if (kdf < 0)
+		return kdf;
+
+	r = crypt_benchmark_pbkdf_internal(cd, &pbkdf, RESUME_KEY_KEK_SIZE);
+	if (r < 0)
+		return r;
+
+	memcpy(hdr->magic, RESUME_KEY_MAGIC, sizeof(hdr->magic));
+	hdr->kdf = cpu_to_le32(kdf);
+	hdr->iterations = cpu_to_le32(pbkdf.iterations);
+	hdr->memory_kb = cpu_to_le32(pbkdf.max_memory_kb);
+	hdr->parallel = cpu_to_le32(pbkdf.parallel_threads);
+
+	return crypt_random_get(cd, hdr->salt, sizeof(hdr->salt), CRYPT_RND_SALT);
+}
+
+static int resume_key_description(struct crypt_device *cd, char *desc, size_t desc_len)
+{
+	const char *uuid = crypt_get_uuid(cd);
+	int r;
+
+	if (!uuid)
+		return -EINVAL;
+
+	r = snprintf(desc, desc_len, "cryptsetup:resume:%s", uuid);
+	return (r < 0 || (size_t)r >= desc_len) ? -EINVAL : 0;
+}
+
+/*
+ * Blob is header || encrypted key || MAC. Encrypt fills the MAC, decrypt
+ * returns -EPERM if it does not match (wrong wrapping key or tampered blob).
+ */
+static int resume_key_crypt(struct crypt_device *cd, const char *wrapping_key, size_t wrapping_key_size,
+			    char *blob, char *key, size_t length, bool encrypt)
+{
+	const struct resume_key_hdr *hdr = (const struct resume_key_hdr *)blob;
+	char *enc = blob + sizeof(*hdr), *mac = enc + length;
+	struct crypt_cipher *cipher = NULL;
+	struct crypt_hmac *hmac = NULL;
+	char kek[RESUME_KEY_KEK_SIZE], mac_calc[RESUME_KEY_MAC_SIZE], iv[16] = {0};
+	const char *kdf;
+	int r;
+
+	if (!length || length % 16)
+		return -ENOTSUP;
+
+	kdf = resume_key_kdf_type(le32_to_cpu(hdr->kdf));
+	if (memcmp(hdr->magic, RESUME_KEY_MAGIC, sizeof(hdr->magic)) || !kdf)
+		return -EINVAL;
+
+	r = crypt_pbkdf(kdf, "sha256", wrapping_key, wrapping_key_size,
+			hdr->salt, sizeof(hdr->salt), kek, sizeof(kek),
+			le32_to_cpu(hdr->iterations), le32_to_cpu(hdr->memory_kb),
+			le32_to_cpu(hdr->parallel));
+	if (!r)
+		r = crypt_hmac_init(&hmac, "sha256", kek + RESUME_KEY_ENC_SIZE, RESUME_KEY_MAC_SIZE);
+	if (!r)
+		r = crypt_cipher_init(&cipher, "aes", "xts", kek, RESUME_KEY_ENC_SIZE);
+	crypt_safe_memzero(kek, sizeof(kek));
+	if (r) {
+		log_dbg(cd, "Cannot initialize resume key cipher (%d).", r);
+		goto out;
+	}
+
+	if (encrypt)
+		r = crypt_cipher_encrypt(cipher, key, enc, length, iv, sizeof(iv));
+	if (!r)
+		r = crypt_hmac_write(hmac, blob, sizeof(*hdr) + length);
+	if (!r)
+		r = crypt_hmac_final(hmac, mac_calc, sizeof(mac_calc));
+	if (r)
+		goto out;
+
+	if (encrypt)
+		memcpy(mac, mac_calc, sizeof(mac_calc));
+	else if (crypt_backend_memeq(mac, mac_calc, sizeof(mac_calc)))
+		r = -EPERM;
+	else
+		r = crypt_cipher_decrypt(cipher, enc, key, length, iv, sizeof(iv));
+out:
+	crypt_safe_memzero(mac_calc, sizeof(mac_calc));
+	crypt_cipher_destroy(cipher);
+	crypt_hmac_destroy(hmac);
+	return r;
+}
+
+static int resume_key_verify(struct crypt_device *cd, struct volume_key *vk)
+{
+	int r;
+
+	if (isLUKS1(cd->type))
+		r = LUKS_verify_volume_key(&cd->u.luks1.hdr, vk);
+	else
+		r = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, vk);
+
+	return r < 0 ? r : 0;
+}
+
+static int resume_key_read_active(struct crypt_device *cd, const char *name, struct volume_key **vk)
+{
+	struct crypt_dm_active_device dmd;
+	struct dm_target *tgt = &dmd.segment;
+	int r;
+
+	r = dm_query_device(cd, name, DM_ACTIVE_CRYPT_KEYSIZE | DM_ACTIVE_CRYPT_KEY, &dmd);
+	if (r < 0)
+		return r;
+
+	if (!single_segment(&dmd) || tgt->type != DM_CRYPT || !tgt->u.crypt.vk) {
+		r = -ENOTSUP;
+		goto out;
+	}
+
+	/* key is in kernel keyring, not readable */
+	if (tgt->u.crypt.vk->key_description) {
+		log_dbg(cd, "Volume key of %s is not readable from active device.", name);
+		r = -ENOKEY;
+		goto out;
+	}
+
+	*vk = crypt_alloc_volume_key(tgt->u.crypt.vk->keylength, tgt->u.crypt.vk->key);
+	r = *vk ? 0 : -ENOMEM;
+out:
+	dm_targets_free(cd, &dmd);
+	return r;
+}
+
+int crypt_suspend_wrapped_key(struct crypt_device *cd,
+	const char *name,
+	const char *volume_key,
+	size_t volume_key_size,
+	const char *wrapping_key,
+	size_t wrapping_key_size,
+	unsigned timeout)
+{
+	struct volume_key *vk = NULL;
+	char desc[128], *blob = NULL;
+	size_t blob_size;
+	int r;
+
+	if (!cd || !name || !wrapping_key || !wrapping_key_size || !timeout)
+		return -EINVAL;
+
+	log_dbg(cd, "Suspending volume %s with wrapped resume key (timeout %u s).", name, timeout);
+
+	if ((r = onlyLUKS(cd)))
+		return r;
+
+	if (crypt_is_cipher_null(crypt_get_cipher_spec(cd)) ||
+	    crypt_cipher_wrapped_key(crypt_get_cipher(cd), crypt_get_cipher_mode(cd)))
+		return -ENOTSUP;
+
+	if (crypt_status(NULL, name) < CRYPT_ACTIVE) {
+		log_err(cd, _("Volume %s is not active."), name);
+		return -EINVAL;
+	}
+
+	r = resume_key_description(cd, desc, sizeof(desc));
+	if (r < 0)
+		return r;
+
+	if (volume_key) {
+		vk = crypt_alloc_volume_key(volume_key_size, volume_key);
+		if (!vk)
+			return -ENOMEM;
+	} else {
+		r = resume_key_read_active(cd, name, &vk);
+		if (r < 0)
+			return r;
+	}
+
+	r = resume_key_verify(cd, vk);
+	if (r < 0) {
+		log_err(cd, _("Volume key does not match the volume."));
+		goto out;
+	}
+
+	blob_size = sizeof(struct resume_key_hdr) + vk->keylength + RESUME_KEY_MAC_SIZE;
+	blob = crypt_safe_alloc(blob_size);
+	if (!blob) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = resume_key_hdr_init(cd, (struct resume_key_hdr *)blob);
+	if (!r)
+		r = resume_key_crypt(cd, wrapping_key, wrapping_key_size, blob, vk->key,
+				     vk->keylength, true);
+	if (r < 0)
+		goto out;
+
+	r = keyring_add_key_in_user_keyring_timeout(USER_KEY, desc, blob, blob_size, timeout);
+	if (r < 0) {
+		log_dbg(cd, "Cannot store wrapped resume key in keyring (%d).", r);
+		goto out;
+	}
+
+	r = crypt_suspend(cd, name);
+	if (r < 0)
+		keyring_revoke_and_unlink_key(USER_KEY, desc);
+	else
+		log_dbg(cd, "Wrapped resume key stored in keyring (%s).", desc);
+out:
+	crypt_safe_free(blob);
+	crypt_free_volume_key(vk);
+	return r;
+}
+
+int crypt_resume_by_wrapped_key(struct crypt_device *cd,
+	const char *name,
+	const char *wrapping_key,
+	size_t wrapping_key_size)
+{
+	struct volume_key *vk = NULL;
+	char desc[128], *blob = NULL;
+	size_t blob_size = 0;
+	int r;
+
+	if (!name || !wrapping_key || !wrapping_key_size)
+		return -EINVAL;
+
+	log_dbg(cd, "Resuming volume %s by wrapped resume key.", name);
+
+	if ((r = onlyLUKS(cd)))
+		return r;
+
+	r = dm_status_suspended(cd, name);
+	if (r < 0)
+		return r;
+
+	if (!r) {
+		log_err(cd, _("Volume %s is not suspended."), name);
+		return -EINVAL;
+	}
+
+	r = resume_key_description(cd, desc, sizeof(desc));
+	if (r < 0)
+		return r;
+
+	/* missing, expired or revoked */
+	if (keyring_get_key(desc, &blob, &blob_size) < 0) {
+		log_dbg(cd, "No wrapped resume key in keyring (%s).", desc);
+		return -ENOKEY;
+	}
+
+	if (blob_size <= sizeof(struct resume_key_hdr) + RESUME_KEY_MAC_SIZE) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	vk = crypt_alloc_volume_key(blob_size - sizeof(struct resume_key_hdr) - RESUME_KEY_MAC_SIZE, NULL);
+	if (!vk) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* wrong wrapping key or tampered blob */
+	r = resume_key_crypt(cd, wrapping_key, wrapping_key_size, blob, vk->key, vk->keylength, false);
+	if (r == -EPERM)
+		log_dbg(cd, "Wrapped resume key authentication failed.");
+	if (r < 0)
+		goto out;
+
+	/* stale blob (volume key changed meanwhile) */
+	r = resume_key_verify(cd, vk);
+	if (r < 0) {
+		log_dbg(cd, "Unwrapped resume key does not match the volume.");
+		r = -EPERM;
+		goto out;
+	}
+
+	r = resume_by_volume_key(cd, vk, name);
+	if (!r)
+		keyring_revoke_and_unlink_key(USER_KEY, desc);
+out:
+	if (blob) {
+		crypt_safe_memzero(blob, blob_size);
+		free(blob);
+	}
+	crypt_free_volume_key(vk);
+	return r;
+}
+
 /*
  * Keyslot manipulation
  */
@@ -3876,6 +4778,42 @@ static int dmcrypt_keyring_bug(void)
 	return kversion < compact_version(4,15,0,0);
 }
 
+/*
+ * Map the device through dm-default-key (blk-crypto inline encryption) only
+ * if the data device hardware supports the cipher and IV is compatible,
+ * otherwise the flag is dropped and dm-crypt is used.
+ */
+static void inline_crypt_check(struct crypt_device *cd, struct crypt_dm_active_device *dmd)
+{
+	struct dm_target *tgt = &dmd->segment;
+	const char *reason = NULL;
+	uint32_t dmt_flags;
+
+	if (!tgt->u.crypt.cipher || strcmp(tgt->u.crypt.cipher, "aes-xts-plain64") ||
+	    !tgt->u.crypt.vk || tgt->u.crypt.vk->keylength != 64 || tgt->u.crypt.tag_size)
+		reason = "only aes-xts-plain64 with 512 bits key is supported";
+	else if (tgt->u.crypt.sector_size != SECTOR_SIZE && !(dmd->flags & CRYPT_ACTIVATE_IV_LARGE_SECTORS))
+		reason = "IV must be counted in encryption sectors";
+	else if (dm_flags(cd, DM_CRYPT, &dmt_flags) || !(dmt_flags & DM_CRYPT_INLINE_SUPPORTED))
+		reason = "dm-default-key target is not available";
+	else if (device_inline_crypto(tgt->data_device, "AES-256-XTS", tgt->u.crypt.sector_size) != 1)
+		reason = "data device has no AES-256-XTS inline encryption";
+
+	if (reason) {
+		log_dbg(cd, "Inline encryption not used, %s.", reason);
+		dmd->flags &= ~CRYPT_ACTIVATE_INLINE_CRYPT;
+		return;
+	}
+
+	log_dbg(cd, "Using inline encryption of device %s.", device_path(tgt->data_device));
+
+	/* inline encryption key is loaded from the table only */
+	if (dmd->flags & CRYPT_ACTIVATE_KEYRING_KEY) {
+		crypt_drop_keyring_key(cd, tgt->u.crypt.vk);
+		dmd->flags &= ~CRYPT_ACTIVATE_KEYRING_KEY;
+	}
+}
+
 int create_or_reload_device(struct crypt_device *cd, const char *name,
 		     const char *type, struct crypt_dm_active_device *dmd)
 {
@@ -3905,8 +4843,14 @@ int create_or_reload_device(struct crypt_device *cd, const char *name,
 					tgt->u.crypt.offset, &dmd->size, &dmd->flags);
 			if (!r) {
 				tgt->size = dmd->size;
-				r = dm_create_device(cd, name, type, dmd);
+				if (dmd->flags & CRYPT_ACTIVATE_INLINE_CRYPT)
+					inline_crypt_check(cd, dmd);
+				if (cd && cd->dm_crypt_shards > 1 && !tgt->u.crypt.tag_size &&
+				    !(dmd->flags & CRYPT_ACTIVATE_INLINE_CRYPT))
+					r = dm_crypt_target_shard(tgt, cd->dm_crypt_shards);
 			}
+			if (!r)
+				r = dm_create_device(cd, name, type, dmd);
 		} else if (tgt->type == DM_INTEGRITY) {
 			r = device_block_adjust(cd, tgt->data_device, DEV_EXCL,
 					tgt->u.integrity.offset, NULL, &dmd->flags);
@@ -4222,6 +5166,7 @@ static int _activate_by_passphrase(struct crypt_device *cd,
 	uint32_t flags)
 {
 	int r;
+	bool any_slot = keyslot == CRYPT_ANY_SLOT;
 	struct volume_key *vk = NULL;
 
 	if ((flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_use_keyring_for_vk(cd))
@@ -4234,9 +5179,17 @@ static int _activate_by_passphrase(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
+	if (flags & CRYPT_ACTIVATE_KEYSLOT_HINT)
+		cd->keyslot_hint = true;
+
 	if (flags & CRYPT_ACTIVATE_SERIALIZE_MEMORY_HARD_PBKDF)
 		cd->memory_hard_pbkdf_lock_enabled = true;
 
+	/* serialization lock defeats running keyslots in parallel */
+	if ((flags & CRYPT_ACTIVATE_PARALLEL_KEYSLOTS) &&
+	    !(flags & CRYPT_ACTIVATE_SERIALIZE_MEMORY_HARD_PBKDF))
+		cd->keyslot_parallel_trial = true;
+
 	/* plain, use hashed passphrase */
 	if (isPLAIN(cd->type)) {
 		r = -EINVAL;
@@ -4275,7 +5228,13 @@ out:
 		crypt_drop_keyring_key(cd, vk);
 	crypt_free_volume_key(vk);
 
+	if (r >= 0 && any_slot && crypt_keyslot_hint_credential(cd) &&
+	    (isLUKS1(cd->type) || isLUKS2(cd->type)))
+		crypt_keyslot_hint_set(cd, crypt_keyslot_hint_credential(cd), keyslot);
+
 	cd->memory_hard_pbkdf_lock_enabled = false;
+	cd->keyslot_parallel_trial = false;
+	cd->keyslot_hint = false;
 
 	return r < 0 ? r : keyslot;
 }
@@ -4334,7 +5293,7 @@ int crypt_activate_by_passphrase(struct crypt_device *cd,
 	size_t passphrase_size,
 	uint32_t flags)
 {
-	int r;
+	int r, span;
 
 	if (!cd || !passphrase || (!name && (flags & CRYPT_ACTIVATE_REFRESH)))
 		return -EINVAL;
@@ -4347,7 +5306,11 @@ int crypt_activate_by_passphrase(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
-	return _activate_by_passphrase(cd, name, keyslot, passphrase, passphrase_size, flags);
+	span = crypt_spans_start(cd, "activate_by_passphrase");
+	r = _activate_by_passphrase(cd, name, keyslot, passphrase, passphrase_size, flags);
+	crypt_spans_finish(cd, span);
+
+	return r;
 }
 
 int crypt_activate_by_keyfile_device_offset(struct crypt_device *cd,
@@ -4358,9 +5321,9 @@ int crypt_activate_by_keyfile_device_offset(struct crypt_device *cd,
 	uint64_t keyfile_offset,
 	uint32_t flags)
 {
-	char *passphrase_read = NULL;
+	char *passphrase_read = NULL, credential[PATH_MAX + 16];
 	size_t passphrase_size_read;
-	int r;
+	int r, span;
 
 	if (!cd || !keyfile ||
 	    ((flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_use_keyring_for_vk(cd)))
@@ -4379,11 +5342,20 @@ int crypt_activate_by_keyfile_device_offset(struct crypt_device *cd,
 	if (r < 0)
 		goto out;
 
+	/* only keyfile path is used for hint, never its content */
+	if ((flags & CRYPT_ACTIVATE_KEYSLOT_HINT) &&
+	    snprintf(credential, sizeof(credential), "keyfile %s %" PRIu64 " %zu",
+		     keyfile, keyfile_offset, keyfile_size) < (int)sizeof(credential))
+		cd->keyslot_hint_credential = credential;
+
+	span = crypt_spans_start(cd, "activate_by_keyfile");
 	if (isLOOPAES(cd->type))
 		r = _activate_loopaes(cd, name, passphrase_read, passphrase_size_read, flags);
 	else
 		r = _activate_by_passphrase(cd, name, keyslot, passphrase_read, passphrase_size_read, flags);
+	crypt_spans_finish(cd, span);
 
+	cd->keyslot_hint_credential = NULL;
 out:
 	crypt_safe_free(passphrase_read);
 	return r;
@@ -4411,7 +5383,7 @@ int crypt_activate_by_keyfile_offset(struct crypt_device *cd,
 	return crypt_activate_by_keyfile_device_offset(cd, name, keyslot, keyfile,
 					keyfile_size, keyfile_offset, flags);
 }
-int crypt_activate_by_volume_key(struct crypt_device *cd,
+static int _activate_by_volume_key(struct crypt_device *cd,
 	const char *name,
 	const char *volume_key,
 	size_t volume_key_size,
@@ -4544,6 +5516,66 @@ int crypt_activate_by_volume_key(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_activate_by_volume_key(struct crypt_device *cd,
+	const char *name,
+	const char *volume_key,
+	size_t volume_key_size,
+	uint32_t flags)
+{
+	int r, span;
+
+	span = crypt_spans_start(cd, "activate_by_volume_key");
+	r = _activate_by_volume_key(cd, name, volume_key, volume_key_size, flags);
+	crypt_spans_finish(cd, span);
+
+	return r;
+}
+
+/* cached root hash signature expires after an hour */
+#define VERITY_SIGNATURE_CACHE_TIMEOUT 3600
+
+/*
+ * Cached root hash signature is stored in user keyring under description
+ * derived from root hash, the kernel still verifies it on every table load.
+ * Returns 1 if the same (or with NULL signature any) cached key is present.
+ */
+static int verity_signature_cache(struct crypt_device *cd,
+	const char *root_hash, size_t root_hash_size,
+	const char *signature, size_t signature_size,
+	char *description, size_t description_size)
+{
+	char *blob = NULL;
+	size_t blob_size = 0;
+	int r;
+
+	if (root_hash_size * 2 + 24 > description_size)
+		return -EINVAL;
+
+	strcpy(description, "cryptsetup:verity-sig:");
+	crypt_bytes_to_hex_buffer(description + strlen(description), root_hash_size, root_hash);
+	description[strlen("cryptsetup:verity-sig:") + root_hash_size * 2] = '\0';
+
+	if (keyring_get_key(description, &blob, &blob_size) < 0)
+		r = 0;
+	else
+		r = !signature || (blob_size == signature_size &&
+				   !crypt_backend_memeq(blob, signature, signature_size));
+	crypt_safe_free(blob);
+
+	if (r) {
+		log_dbg(cd, "Using cached root hash signature %s.", description);
+		return 1;
+	}
+
+	if (!signature)
+		return -ENOKEY;
+
+	log_dbg(cd, "Caching root hash signature in keyring %s.", description);
+	r = keyring_add_key_in_user_keyring_timeout(USER_KEY, description, signature,
+						    signature_size, VERITY_SIGNATURE_CACHE_TIMEOUT);
+	return r < 0 ? r : 0;
+}
+
 int crypt_activate_by_signed_key(struct crypt_device *cd,
 	const char *name,
 	const char *volume_key,
@@ -4553,6 +5585,7 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 	uint32_t flags)
 {
 	char description[512];
+	bool cache, cached = false;
 	int r;
 
 	if (!cd || !isVERITY(cd->type))
@@ -4568,7 +5601,23 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 	else
 		log_dbg(cd, "Checking volume by key.");
 
-	if (cd->u.verity.hdr.flags & CRYPT_VERITY_ROOT_HASH_SIGNATURE && !signature) {
+	cache = name && (cd->u.verity.hdr.flags & CRYPT_VERITY_ROOT_HASH_SIGNATURE_CACHE) &&
+		kernel_keyring_support();
+	if (cache) {
+		r = verity_signature_cache(cd, volume_key, volume_key_size, signature,
+					   signature_size, description, sizeof(description));
+		if (r == -ENOKEY && !signature) {
+			log_dbg(cd, "No cached root hash signature.");
+			return r;
+		}
+		if (r < 0) {
+			log_dbg(cd, "Root hash signature cache not available (%d).", r);
+			cache = false;
+		} else
+			cached = r > 0;
+	}
+
+	if (cd->u.verity.hdr.flags & CRYPT_VERITY_ROOT_HASH_SIGNATURE && !signature && !cached) {
 		log_err(cd, _("Root hash signature required."));
 		return -EINVAL;
 	}
@@ -4586,7 +5635,7 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 	free(CONST_CAST(void*)cd->u.verity.root_hash);
 	cd->u.verity.root_hash = NULL;
 
-	if (signature) {
+	if (signature && !cache) {
 		r = snprintf(description, sizeof(description)-1, "cryptsetup:%s%s%s",
 			     crypt_get_uuid(cd) ?: "", crypt_get_uuid(cd) ? "-" : "", name);
 		if (r < 0)
@@ -4601,7 +5650,7 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 	}
 
 	r = VERITY_activate(cd, name, volume_key, volume_key_size,
-			    signature ? description : NULL,
+			    (signature || cached) ? description : NULL,
 			    cd->u.verity.fec_device,
 			    &cd->u.verity.hdr, flags | CRYPT_ACTIVATE_READONLY);
 
@@ -4612,12 +5661,121 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 			memcpy(CONST_CAST(void*)cd->u.verity.root_hash, volume_key, volume_key_size);
 	}
 
-	if (signature)
+	/* rejected signature is not kept for next activation */
+	if ((signature && !cache) || (cache && r < 0))
 		crypt_drop_keyring_key_by_description(cd, description, USER_KEY);
 
 	return r;
 }
 
+int crypt_activate_batch(struct crypt_activate_batch_entry *entries, size_t count)
+{
+	struct crypt_activate_batch_entry *e;
+	size_t i;
+	int r = 0;
+
+	if (!entries || !count)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		if (!entries[i].cd || !entries[i].name)
+			return -EINVAL;
+
+	log_dbg(entries[0].cd, "Activating batch of %zu devices.", count);
+
+	dm_udev_batch_begin();
+
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		if (e->passphrase)
+			e->result = crypt_activate_by_passphrase(e->cd, e->name, e->keyslot,
+						e->passphrase, e->passphrase_size, e->flags);
+		else
+			e->result = crypt_activate_by_volume_key(e->cd, e->name,
+						e->volume_key, e->volume_key_size, e->flags);
+		if (e->result < 0 && !r)
+			r = e->result;
+	}
+
+	dm_udev_batch_end(entries[0].cd);
+
+	return r;
+}
+
+int crypt_activate_loopaes_batch(struct crypt_activate_batch_entry *entries, size_t count,
+	const char *keyfile, size_t keyfile_size, uint64_t keyfile_offset)
+{
+	struct crypt_activate_batch_entry *e;
+	struct loopaes_keys keys;
+	struct volume_key **vks = NULL, *vk;
+	char *buffer = NULL;
+	size_t buffer_size, i, j;
+	int r;
+
+	if (!entries || !count || !keyfile)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		if (!entries[i].cd || !entries[i].name || !isLOOPAES(entries[i].cd->type))
+			return -EINVAL;
+
+	log_dbg(entries[0].cd, "Activating batch of %zu loop-AES devices using keyfile %s.",
+		count, keyfile);
+
+	/* keyfile is read and parsed only once for all devices */
+	r = crypt_keyfile_device_read(entries[0].cd, keyfile, &buffer, &buffer_size,
+				      keyfile_offset, keyfile_size, 0);
+	if (r < 0)
+		return r;
+
+	r = LOOPAES_split_keyfile(entries[0].cd, &keys, buffer, buffer_size);
+	if (r < 0)
+		goto out;
+
+	vks = calloc(count, sizeof(*vks));
+	if (!vks) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	dm_udev_batch_begin();
+
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		e->result = _activate_check_status(e->cd, e->name, e->flags & CRYPT_ACTIVATE_REFRESH);
+		if (e->result < 0)
+			goto next;
+
+		/* hashed keys are shared by devices with the same hash and key size */
+		for (j = 0, vk = NULL; j < i && !vk; j++)
+			if (vks[j] && !strcmp(entries[j].cd->u.loopaes.hdr.hash ?: "",
+					      e->cd->u.loopaes.hdr.hash ?: "") &&
+			    crypt_get_volume_key_size(entries[j].cd) == crypt_get_volume_key_size(e->cd))
+				vk = vks[j];
+
+		if (!vk) {
+			e->result = LOOPAES_hash_keys(e->cd, &vks[i], e->cd->u.loopaes.hdr.hash, &keys);
+			if (e->result < 0)
+				goto next;
+			vk = vks[i];
+		}
+
+		e->result = LOOPAES_activate(e->cd, e->name, e->cd->u.loopaes.cipher,
+					     keys.count, vk, e->flags);
+next:
+		if (e->result < 0 && !r)
+			r = e->result;
+	}
+
+	dm_udev_batch_end(entries[0].cd);
+out:
+	for (i = 0; vks && i < count; i++)
+		crypt_free_volume_key(vks[i]);
+	free(vks);
+	crypt_safe_free(buffer);
+	return r;
+}
+
 int crypt_deactivate_by_name(struct crypt_device *cd, const char *name, uint32_t flags)
 {
 	struct crypt_device *fake_cd = NULL;
@@ -4774,6 +5932,108 @@ uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd, const char
 	return failures;
 }
 
+/* backing device of the first segment, DM name is set for DM devices only */
+static int io_stats_backing(struct crypt_device *cd, const char *name,
+			    char **path, char **dm_name)
+{
+	struct crypt_dm_active_device dmd;
+	const char *tmp;
+	int r;
+
+	*path = *dm_name = NULL;
+
+	r = dm_query_device(cd, name, DM_ACTIVE_DEVICE, &dmd);
+	if (r < 0)
+		return r;
+
+	r = -ENODEV;
+	if (dmd.segment.data_device && device_path(dmd.segment.data_device)) {
+		*path = strdup(device_path(dmd.segment.data_device));
+		tmp = device_dm_name(dmd.segment.data_device);
+		if (tmp)
+			*dm_name = strdup(tmp);
+		r = *path ? 0 : -ENOMEM;
+	}
+
+	dm_targets_free(cd, &dmd);
+	return r;
+}
+
+int crypt_io_stats_enable(struct crypt_device *cd, const char *name)
+{
+	char *path, *dm_name;
+	int r;
+
+	if (!cd || !name)
+		return -EINVAL;
+
+	r = dm_io_stats_create(cd, name);
+	if (r < 0)
+		return r;
+
+	/* not DM backing device has block layer counters only */
+	if (!io_stats_backing(cd, name, &path, &dm_name) && dm_name &&
+	    dm_io_stats_create(cd, dm_name) < 0)
+		log_dbg(cd, "Cannot create I/O statistics for backing device %s.", path);
+
+	free(path);
+	free(dm_name);
+	return 0;
+}
+
+int crypt_get_io_stats(struct crypt_device *cd, const char *name,
+		       struct crypt_io_stats *stats, struct crypt_io_stats *backing)
+{
+	char *path, *dm_name;
+	int r;
+
+	if (!cd || !name || !stats)
+		return -EINVAL;
+
+	r = dm_io_stats_query(cd, name, stats);
+	if (r < 0)
+		return r;
+
+	if (!backing)
+		return 0;
+
+	r = io_stats_backing(cd, name, &path, &dm_name);
+	if (r < 0)
+		return r;
+
+	if (!dm_name || dm_io_stats_query(cd, dm_name, backing) < 0)
+		r = crypt_dev_block_stats(path, backing);
+
+	free(path);
+	free(dm_name);
+	return r;
+}
+
+int crypt_get_active_integrity_recalculation(struct crypt_device *cd,
+	const char *name,
+	uint64_t *position,
+	uint64_t *size)
+{
+	struct crypt_dm_active_device dmd;
+	int r;
+
+	if (!name)
+		return -EINVAL;
+
+	r = dm_query_device(cd, name, 0, &dmd);
+	if (r < 0)
+		return r;
+
+	if (single_segment(&dmd) && dmd.segment.type == DM_INTEGRITY)
+		r = dm_status_integrity_recalc(cd, name, position, size);
+	else
+		r = -ENOTSUP;
+
+	dm_targets_free(cd, &dmd);
+
+	return r;
+}
+
 /*
  * Volume key handling
  */
@@ -4911,6 +6171,22 @@ uint32_t crypt_get_compatibility(struct crypt_device *cd)
 /*
  * Reporting
  */
+int crypt_active_devices_list(struct crypt_active_device_summary **devices, size_t *count)
+{
+	int r;
+
+	dm_backend_init(NULL);
+	r = dm_list_devices(NULL, DM_UUID_PREFIX, devices, count);
+	dm_backend_exit(NULL);
+
+	return r;
+}
+
+void crypt_active_devices_free(struct crypt_active_device_summary *devices, size_t count)
+{
+	dm_list_devices_free(devices, count);
+}
+
 crypt_status_info crypt_status(struct crypt_device *cd, const char *name)
 {
 	int r;
@@ -4987,6 +6263,10 @@ int crypt_dump(struct crypt_device *cd)
 {
 	if (!cd)
 		return -EINVAL;
+#if CRYPTSETUP_UNLOCK_ONLY
+	log_err(cd, _("Dump operation is not supported by unlock-only library."));
+	return -ENOTSUP;
+#endif
 	if (isLUKS1(cd->type))
 		return _luks_dump(cd);
 	else if (isLUKS2(cd->type))
@@ -5008,10 +6288,14 @@ int crypt_dump(struct crypt_device *cd)
 
 int crypt_dump_json(struct crypt_device *cd, const char **json, uint32_t flags)
 {
-	if (!cd || flags)
+	if (!cd || (flags & ~CRYPT_DUMP_JSON_COMPACT))
 		return -EINVAL;
+#if CRYPTSETUP_UNLOCK_ONLY
+	log_err(cd, _("Dump operation is not supported by unlock-only library."));
+	return -ENOTSUP;
+#endif
 	if (isLUKS2(cd->type))
-		return LUKS2_hdr_dump_json(cd, &cd->u.luks2.hdr, json);
+		return LUKS2_hdr_dump_json(cd, &cd->u.luks2.hdr, json, flags);
 
 	log_err(cd, _("Dump operation is not supported for this device type."));
 	return -EINVAL;
@@ -5353,6 +6637,17 @@ int crypt_set_data_offset(struct crypt_device *cd, uint64_t data_offset)
 	return 0;
 }
 
+int crypt_set_layout_optimize(struct crypt_device *cd, int enable)
+{
+	if (!cd)
+		return -EINVAL;
+
+	cd->layout_optimize = enable ? true : false;
+	log_dbg(cd, "Format layout optimizer %s.", enable ? "enabled" : "disabled");
+
+	return 0;
+}
+
 int crypt_set_metadata_size(struct crypt_device *cd,
 	uint64_t metadata_size,
 	uint64_t keyslots_size)
@@ -5550,141 +6845,679 @@ int crypt_get_verity_info(struct crypt_device *cd,
 	return 0;
 }
 
-int crypt_get_integrity_info(struct crypt_device *cd,
-	struct crypt_params_integrity *ip)
+int crypt_verity_update(struct crypt_device *cd,
+	const char *old_data_device,
+	const struct crypt_verity_range *ranges,
+	unsigned int ranges_count)
 {
-	if (!cd || !ip)
-		return -EINVAL;
+	struct device *old_device = NULL;
+	char *root_hash;
+	int r;
 
-	if (isINTEGRITY(cd->type)) {
-		ip->journal_size = cd->u.integrity.params.journal_size;
-		ip->journal_watermark = cd->u.integrity.params.journal_watermark;
-		ip->journal_commit_time = cd->u.integrity.params.journal_commit_time;
-		ip->interleave_sectors = cd->u.integrity.params.interleave_sectors;
-		ip->tag_size = cd->u.integrity.params.tag_size;
-		ip->sector_size = cd->u.integrity.params.sector_size;
-		ip->buffer_sectors = cd->u.integrity.params.buffer_sectors;
+	if (!cd || !isVERITY(cd->type) || (!old_data_device && !ranges_count) ||
+	    (ranges_count && !ranges))
+		return -EINVAL;
 
-		ip->integrity = cd->u.integrity.params.integrity;
-		ip->integrity_key_size = crypt_get_integrity_key_size(cd);
+	if (!crypt_data_device(cd)) {
+		log_err(cd, _("Data device is not set for verity device."));
+		return -EINVAL;
+	}
 
-		ip->journal_integrity = cd->u.integrity.params.journal_integrity;
-		ip->journal_integrity_key_size = cd->u.integrity.params.journal_integrity_key_size;
-		ip->journal_integrity_key = NULL;
+	log_dbg(cd, "Updating verity hash tree on %s.", mdata_device_path(cd));
 
-		ip->journal_crypt = cd->u.integrity.params.journal_crypt;
-		ip->journal_crypt_key_size = cd->u.integrity.params.journal_crypt_key_size;
-		ip->journal_crypt_key = NULL;
-		return 0;
-	} else if (isLUKS2(cd->type)) {
-		ip->journal_size = 0; // FIXME
-		ip->journal_watermark = 0; // FIXME
-		ip->journal_commit_time = 0; // FIXME
-		ip->interleave_sectors = 0; // FIXME
-		ip->sector_size = crypt_get_sector_size(cd);
-		ip->buffer_sectors = 0; // FIXME
+	root_hash = malloc(cd->u.verity.root_hash_size);
+	if (!root_hash)
+		return -ENOMEM;
 
-		ip->integrity = LUKS2_get_integrity(&cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT);
-		ip->integrity_key_size = crypt_get_integrity_key_size(cd);
-		ip->tag_size = INTEGRITY_tag_size(ip->integrity, crypt_get_cipher(cd), crypt_get_cipher_mode(cd));
+	if (old_data_device) {
+		r = device_alloc(cd, &old_device, old_data_device);
+		if (r < 0)
+			goto out;
+	}
 
-		ip->journal_integrity = NULL;
-		ip->journal_integrity_key_size = 0;
-		ip->journal_integrity_key = NULL;
+	r = VERITY_update(cd, &cd->u.verity.hdr, old_device, ranges, ranges_count,
+			  root_hash, cd->u.verity.root_hash_size);
+	if (r)
+		goto out;
 
-		ip->journal_crypt = NULL;
-		ip->journal_crypt_key_size = 0;
-		ip->journal_crypt_key = NULL;
-		return 0;
+	if (cd->u.verity.fec_device) {
+		log_dbg(cd, "Recalculating whole FEC area.");
+		r = VERITY_FEC_process(cd, &cd->u.verity.hdr, cd->u.verity.fec_device, 0, NULL);
+		if (r)
+			goto out;
 	}
 
-	return -ENOTSUP;
+	free(CONST_CAST(void*)cd->u.verity.root_hash);
+	cd->u.verity.root_hash = root_hash;
+	root_hash = NULL;
+out:
+	device_free(cd, old_device);
+	free(root_hash);
+	return r;
 }
 
-int crypt_convert(struct crypt_device *cd,
-		  const char *type,
-		  void *params)
+int crypt_verity_verify_sample(struct crypt_device *cd,
+	const char *root_hash,
+	size_t root_hash_size,
+	uint64_t samples,
+	uint32_t flags,
+	uint64_t *verified_blocks)
 {
-	struct luks_phdr hdr1;
-	struct luks2_hdr hdr2;
-	int r;
+	if (verified_blocks)
+		*verified_blocks = 0;
 
-	if (!type)
+	if (!cd || !isVERITY(cd->type) || !root_hash || !samples)
 		return -EINVAL;
 
-	log_dbg(cd, "Converting LUKS device to type %s", type);
-
-	if ((r = onlyLUKS(cd)))
-		return r;
+	if (root_hash_size != cd->u.verity.root_hash_size) {
+		log_err(cd, _("Invalid root hash string specified."));
+		return -EINVAL;
+	}
 
-	if (isLUKS1(cd->type) && isLUKS2(type))
-		r = LUKS2_luks1_to_luks2(cd, &cd->u.luks1.hdr, &hdr2);
-	else if (isLUKS2(cd->type) && isLUKS1(type))
-		r = LUKS2_luks2_to_luks1(cd, &cd->u.luks2.hdr, &hdr1);
-	else
+	if (!crypt_data_device(cd)) {
+		log_err(cd, _("Data device is not set for verity device."));
 		return -EINVAL;
+	}
 
-	if (r < 0) {
-		/* in-memory header may be invalid after failed conversion */
-		_luks2_rollback(cd);
+	return VERITY_verify_sample(cd, &cd->u.verity.hdr, root_hash, root_hash_size,
+				    samples, flags, verified_blocks);
+}
+
+int crypt_verity_hash_stream_init(struct crypt_device *cd,
+	uint32_t flags,
+	struct crypt_verity_hash_stream **stream)
+{
+	if (!cd || !isVERITY(cd->type) || !stream)
+		return -EINVAL;
+
+	if (!crypt_data_device(cd)) {
+		log_err(cd, _("Data device is not set for verity device."));
+		return -EINVAL;
+	}
+
+	if (!cd->u.verity.hdr.data_size) {
+		log_err(cd, _("Data size is not set for verity hash stream."));
+		return -EINVAL;
+	}
+
+	log_dbg(cd, "Starting verity hash stream on %s.", mdata_device_path(cd));
+
+	return VERITY_stream_init(cd, &cd->u.verity.hdr, cd->u.verity.fec_device,
+				  flags & CRYPT_VERITY_STREAM_WRITE_DATA,
+				  cd->u.verity.root_hash_size, stream);
+}
+
+int crypt_verity_hash_stream_write(struct crypt_device *cd,
+	struct crypt_verity_hash_stream *stream,
+	const char *data,
+	size_t length)
+{
+	if (!cd || !isVERITY(cd->type) || !stream || (length && !data))
+		return -EINVAL;
+
+	return VERITY_stream_write(cd, stream, data, length);
+}
+
+int crypt_verity_hash_stream_final(struct crypt_device *cd,
+	struct crypt_verity_hash_stream *stream,
+	char *root_hash,
+	size_t *root_hash_size)
+{
+	char *hash;
+	int r;
+
+	if (!cd || !isVERITY(cd->type) || !stream)
+		return -EINVAL;
+
+	if (root_hash && (!root_hash_size || *root_hash_size < cd->u.verity.root_hash_size))
+		return -EINVAL;
+
+	hash = malloc(cd->u.verity.root_hash_size);
+	if (!hash)
+		return -ENOMEM;
+
+	r = VERITY_stream_final(cd, stream, hash, cd->u.verity.root_hash_size);
+	if (r) {
+		free(hash);
+		return r;
+	}
+
+	if (root_hash) {
+		memcpy(root_hash, hash, cd->u.verity.root_hash_size);
+		*root_hash_size = cd->u.verity.root_hash_size;
+	}
+
+	free(CONST_CAST(void*)cd->u.verity.root_hash);
+	cd->u.verity.root_hash = hash;
+
+	return 0;
+}
+
+void crypt_verity_hash_stream_free(struct crypt_verity_hash_stream *stream)
+{
+	VERITY_stream_free(stream);
+}
+
+int crypt_set_verity_fec_memory(struct crypt_device *cd, uint64_t memory_kb)
+{
+	if (!cd)
+		return -EINVAL;
+
+	if (cd->type && !isVERITY(cd->type))
+		return -EINVAL;
+
+	cd->verity_fec_memory_kb = memory_kb;
+
+	return 0;
+}
+
+int crypt_set_verity_threads(struct crypt_device *cd, unsigned threads)
+{
+	if (!cd)
+		return -EINVAL;
+
+	if (cd->type && !isVERITY(cd->type))
+		return -EINVAL;
+
+	cd->verity_threads = threads;
+
+	return 0;
+}
+
+int crypt_reencrypt_set_threads(struct crypt_device *cd, uint32_t threads)
+{
+	if (!cd || (cd->type && !isLUKS2(cd->type)))
+		return -EINVAL;
+
+	cd->reencrypt_tuning.threads = threads;
+
+	return 0;
+}
+
+int crypt_reencrypt_set_step_latency(struct crypt_device *cd, uint32_t step_latency_ms)
+{
+	if (!cd || (cd->type && !isLUKS2(cd->type)))
+		return -EINVAL;
+
+	cd->reencrypt_tuning.step_latency_ms = step_latency_ms;
+
+	return 0;
+}
+
+int crypt_reencrypt_set_hotzone_batch(struct crypt_device *cd, uint32_t hotzone_batch)
+{
+	if (!cd || (cd->type && !isLUKS2(cd->type)))
+		return -EINVAL;
+
+	cd->reencrypt_tuning.hotzone_batch = hotzone_batch;
+
+	return 0;
+}
+
+int crypt_reencrypt_set_throttle(struct crypt_device *cd, uint64_t max_throughput,
+	uint32_t max_io_latency_ms)
+{
+	if (!cd || (cd->type && !isLUKS2(cd->type)))
+		return -EINVAL;
+
+	cd->reencrypt_tuning.max_throughput = max_throughput;
+	cd->reencrypt_tuning.max_io_latency_ms = max_io_latency_ms;
+
+	return 0;
+}
+
+int crypt_verity_hash_area_size(struct crypt_device *cd,
+	const struct crypt_params_verity *params,
+	uint64_t *size)
+{
+	struct crypt_params_verity vp;
+	uint64_t data_device_size;
+	int hash_size, r;
+
+	if (!cd || !params || !size || !params->hash_name ||
+	    !params->data_block_size || !params->hash_block_size)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	vp = *params;
+
+	if (!vp.data_size) {
+		if (!cd->device)
+			return -EINVAL;
+		r = device_size(cd->device, &data_device_size);
+		if (r < 0)
+			return r;
+		vp.data_size = data_device_size / vp.data_block_size;
+	}
+
+	hash_size = crypt_hash_size(vp.hash_name);
+	if (hash_size <= 0) {
+		log_err(cd, _("Hash algorithm %s not supported."),
+			vp.hash_name);
+		return -EINVAL;
+	}
+
+	r = VERITY_hash_area_size(&vp, hash_size, size);
+	if (r < 0)
+		log_err(cd, _("Hash area overflow."));
+
+	return r;
+}
+
+int crypt_get_integrity_info(struct crypt_device *cd,
+	struct crypt_params_integrity *ip)
+{
+	if (!cd || !ip)
+		return -EINVAL;
+
+	if (isINTEGRITY(cd->type)) {
+		ip->journal_size = cd->u.integrity.params.journal_size;
+		ip->journal_watermark = cd->u.integrity.params.journal_watermark;
+		ip->journal_commit_time = cd->u.integrity.params.journal_commit_time;
+		ip->interleave_sectors = cd->u.integrity.params.interleave_sectors;
+		ip->tag_size = cd->u.integrity.params.tag_size;
+		ip->sector_size = cd->u.integrity.params.sector_size;
+		ip->buffer_sectors = cd->u.integrity.params.buffer_sectors;
+
+		ip->integrity = cd->u.integrity.params.integrity;
+		ip->integrity_key_size = crypt_get_integrity_key_size(cd);
+
+		ip->journal_integrity = cd->u.integrity.params.journal_integrity;
+		ip->journal_integrity_key_size = cd->u.integrity.params.journal_integrity_key_size;
+		ip->journal_integrity_key = NULL;
+
+		ip->journal_crypt = cd->u.integrity.params.journal_crypt;
+		ip->journal_crypt_key_size = cd->u.integrity.params.journal_crypt_key_size;
+		ip->journal_crypt_key = NULL;
+		return 0;
+	} else if (isLUKS2(cd->type)) {
+		ip->journal_size = 0; // FIXME
+		ip->journal_watermark = 0; // FIXME
+		ip->journal_commit_time = 0; // FIXME
+		ip->interleave_sectors = 0; // FIXME
+		ip->sector_size = crypt_get_sector_size(cd);
+		ip->buffer_sectors = 0; // FIXME
+
+		ip->integrity = LUKS2_get_integrity(&cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT);
+		ip->integrity_key_size = crypt_get_integrity_key_size(cd);
+		ip->tag_size = INTEGRITY_tag_size(ip->integrity, crypt_get_cipher(cd), crypt_get_cipher_mode(cd));
+
+		ip->journal_integrity = NULL;
+		ip->journal_integrity_key_size = 0;
+		ip->journal_integrity_key = NULL;
+
+		ip->journal_crypt = NULL;
+		ip->journal_crypt_key_size = 0;
+		ip->journal_crypt_key = NULL;
+		return 0;
+	}
+
+	return -ENOTSUP;
+}
+
+static int _crypt_convert(struct crypt_device *cd,
+		  const char *type,
+		  void *params,
+		  int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+		  void *usrptr)
+{
+	struct luks_phdr hdr1;
+	struct luks2_hdr hdr2;
+	int r;
+
+	if (!type)
+		return -EINVAL;
+
+#if CRYPTSETUP_UNLOCK_ONLY
+	log_err(cd, _("Convert operation is not supported by unlock-only library."));
+	return -ENOTSUP;
+#endif
+	log_dbg(cd, "Converting LUKS device to type %s", type);
+
+	if ((r = onlyLUKS(cd)))
+		return r;
+
+	if (isLUKS1(cd->type) && isLUKS2(type))
+		r = LUKS2_luks1_to_luks2(cd, &cd->u.luks1.hdr, &hdr2, progress, usrptr);
+	else if (isLUKS2(cd->type) && isLUKS1(type))
+		r = LUKS2_luks2_to_luks1(cd, &cd->u.luks2.hdr, &hdr1, progress, usrptr);
+	else
+		return -EINVAL;
+
+	if (r < 0) {
+		/* in-memory header may be invalid after failed conversion */
+		_luks2_rollback(cd);
 		if (r == -EBUSY)
 			log_err(cd, _("Cannot convert device %s which is still in use."), mdata_device_path(cd));
 		return r;
 	}
 
-	crypt_free_type(cd);
+	crypt_free_type(cd);
+
+	return crypt_load(cd, type, params);
+}
+
+int crypt_convert(struct crypt_device *cd,
+		  const char *type,
+		  void *params)
+{
+	return _crypt_convert(cd, type, params, NULL, NULL);
+}
+
+int crypt_convert_batch(struct crypt_convert_batch_entry *entries, size_t count,
+	const char *type,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	size_t i;
+	int r = 0;
+
+	if (!entries || !count || !type)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		if (!entries[i].cd)
+			return -EINVAL;
+
+	log_dbg(entries[0].cd, "Converting batch of %zu devices to type %s.", count, type);
+
+	for (i = 0; i < count; i++) {
+		entries[i].result = _crypt_convert(entries[i].cd, type, entries[i].params,
+						   progress, usrptr);
+		if (entries[i].result < 0 && !r)
+			r = entries[i].result;
+	}
+
+	return r;
+}
+
+/* Internal access function to header pointer */
+void *crypt_get_hdr(struct crypt_device *cd, const char *type)
+{
+	/* If requested type differs, ignore it */
+	if (strcmp(cd->type, type))
+		return NULL;
+
+	if (isPLAIN(cd->type))
+		return &cd->u.plain;
+
+	if (isLUKS1(cd->type))
+		return &cd->u.luks1.hdr;
+
+	if (isLUKS2(cd->type))
+		return &cd->u.luks2.hdr;
+
+	if (isLOOPAES(cd->type))
+		return &cd->u.loopaes;
+
+	if (isVERITY(cd->type))
+		return &cd->u.verity;
+
+	if (isTCRYPT(cd->type))
+		return &cd->u.tcrypt;
+
+	return NULL;
+}
+
+/* internal only */
+struct luks2_reencrypt *crypt_get_luks2_reencrypt(struct crypt_device *cd)
+{
+	return cd->u.luks2.rh;
+}
+
+/* internal only */
+void crypt_set_luks2_reencrypt(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	cd->u.luks2.rh = rh;
+}
+
+/*
+ * Token handling
+ */
+int crypt_token_keyring_cache(struct crypt_device *cd, unsigned int timeout)
+{
+	if (!cd)
+		return -EINVAL;
+
+	if (timeout && !kernel_keyring_support())
+		return -ENOTSUP;
+
+	log_dbg(cd, "Token secrets keyring cache %s (timeout %u).", timeout ? "enabled" : "disabled", timeout);
+	cd->token_keyring_cache_timeout = timeout;
+
+	return 0;
+}
+
+int crypt_token_set_timeout(struct crypt_device *cd, uint32_t timeout_ms)
+{
+	if (!cd)
+		return -EINVAL;
+
+	log_dbg(cd, "Token open timeout set to %" PRIu32 " ms.", timeout_ms);
+	cd->token_timeout_ms = timeout_ms;
+
+	return 0;
+}
+
+int crypt_set_deactivate_timeout(struct crypt_device *cd, uint32_t timeout_ms)
+{
+	if (!cd)
+		return -EINVAL;
+
+	log_dbg(cd, "Forced deactivation timeout set to %" PRIu32 " ms.", timeout_ms);
+	cd->deactivate_timeout_ms = timeout_ms;
+
+	return 0;
+}
+
+int crypt_set_dm_crypt_shards(struct crypt_device *cd, unsigned shards)
+{
+	if (!cd || shards > DM_CRYPT_SHARDS_MAX)
+		return -EINVAL;
+
+	log_dbg(cd, "New dm-crypt mappings split to %u targets.", shards ?: 1);
+	cd->dm_crypt_shards = shards;
+
+	return 0;
+}
+
+int crypt_token_open_stats(struct crypt_device *cd, int token, struct crypt_token_open_stats *stats)
+{
+	if (!cd || !stats || token < 0 || token >= LUKS2_TOKENS_MAX)
+		return -EINVAL;
+
+	if (!(cd->token_stats_valid & (UINT32_C(1) << token)))
+		return -ENOENT;
+
+	*stats = cd->token_stats[token];
+	return 0;
+}
+
+static uint64_t perf_load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+int crypt_get_perf_stats(struct crypt_device *cd, struct crypt_perf_stats *stats)
+{
+	const struct crypt_perf_stats *src = cd ? &cd->perf : &_perf_total;
+
+	if (!stats)
+		return -EINVAL;
+
+	stats->header_reads = perf_load(&src->header_reads);
+	stats->header_writes = perf_load(&src->header_writes);
+	stats->fsyncs = perf_load(&src->fsyncs);
+	stats->kdf_runs = perf_load(&src->kdf_runs);
+	stats->kdf_wall_us = perf_load(&src->kdf_wall_us);
+	stats->kdf_cpu_us = perf_load(&src->kdf_cpu_us);
+
+	/* process wide counters */
+	io_stats(&stats->metadata_read_bytes, &stats->metadata_write_bytes);
+	stats->kernel_crypto_calls = crypt_cipher_kernel_calls();
+	stats->dm_ioctls = perf_load(&_perf_total.dm_ioctls);
+	stats->udev_wait_us = perf_load(&_perf_total.udev_wait_us);
+
+	if (cd) {
+		stats->metadata_read_bytes -= cd->perf_base.metadata_read_bytes;
+		stats->metadata_write_bytes -= cd->perf_base.metadata_write_bytes;
+		stats->kernel_crypto_calls -= cd->perf_base.kernel_crypto_calls;
+		stats->dm_ioctls -= cd->perf_base.dm_ioctls;
+		stats->udev_wait_us -= cd->perf_base.udev_wait_us;
+	}
+
+	return 0;
+}
+
+void crypt_perf_add_offset(struct crypt_device *cd, size_t offset, uint64_t value)
+{
+	__atomic_fetch_add((uint64_t *)((char *)&_perf_total + offset), value, __ATOMIC_RELAXED);
+	if (cd)
+		__atomic_fetch_add((uint64_t *)((char *)&cd->perf + offset), value, __ATOMIC_RELAXED);
+}
+
+static uint64_t perf_clock_us(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t crypt_perf_time_us(void)
+{
+	return perf_clock_us(CLOCK_MONOTONIC);
+}
+
+void crypt_perf_kdf_begin(struct crypt_device *cd, struct crypt_perf_kdf *k)
+{
+	k->span = crypt_span_begin(cd, "keyslot_kdf");
+	(void)crypt_async_stage(cd, CRYPT_ASYNC_KDF);
+	crypt_pbkdf_numa_interleave(cd && (cd->pbkdf.flags & CRYPT_PBKDF_NUMA_INTERLEAVE));
+	k->wall_us = perf_clock_us(CLOCK_MONOTONIC);
+	k->cpu_us = perf_clock_us(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void crypt_perf_kdf_end(struct crypt_device *cd, const struct crypt_perf_kdf *k)
+{
+	crypt_span_end(cd, k->span);
+	crypt_perf_add(cd, kdf_runs, 1);
+	crypt_perf_add(cd, kdf_wall_us, perf_clock_us(CLOCK_MONOTONIC) - k->wall_us);
+	crypt_perf_add(cd, kdf_cpu_us, perf_clock_us(CLOCK_PROCESS_CPUTIME_ID) - k->cpu_us);
+}
+
+int crypt_span_begin(struct crypt_device *cd, const char *name)
+{
+	unsigned i;
+
+	if (!cd || !cd->spans)
+		return -1;
+
+	i = __atomic_fetch_add(&cd->spans_count, 1, __ATOMIC_RELAXED);
+	if (i >= CRYPT_SPANS_MAX)
+		return -1;
+
+	cd->spans[i].name = name;
+	cd->spans[i].tid = (pid_t)syscall(SYS_gettid);
+	cd->spans[i].start_us = perf_clock_us(CLOCK_MONOTONIC);
+	cd->spans[i].end_us = cd->spans[i].start_us;
+
+	return (int)i;
+}
+
+void crypt_span_end(struct crypt_device *cd, int span)
+{
+	if (cd && cd->spans && span >= 0)
+		cd->spans[span].end_us = perf_clock_us(CLOCK_MONOTONIC);
+}
+
+int crypt_spans_start(struct crypt_device *cd, const char *name)
+{
+	if (!cd || (!cd->spans && crypt_get_debug_level() != CRYPT_DEBUG_JSON))
+		return -1;
+
+	if (!cd->spans) {
+		cd->spans = calloc(CRYPT_SPANS_MAX, sizeof(*cd->spans));
+		if (!cd->spans)
+			return -1;
+		cd->spans_count = 0;
+	}
 
-	return crypt_load(cd, type, params);
+	cd->spans_depth++;
+	return crypt_span_begin(cd, name);
 }
 
-/* Internal access function to header pointer */
-void *crypt_get_hdr(struct crypt_device *cd, const char *type)
+/* Chrome trace event format, complete ("X") events */
+static void spans_print(struct crypt_device *cd)
 {
-	/* If requested type differs, ignore it */
-	if (strcmp(cd->type, type))
-		return NULL;
+	unsigned i, count = cd->spans_count;
+	size_t len = 0, size;
+	char *json;
+	int n;
 
-	if (isPLAIN(cd->type))
-		return &cd->u.plain;
+	if (count > CRYPT_SPANS_MAX)
+		count = CRYPT_SPANS_MAX;
 
-	if (isLUKS1(cd->type))
-		return &cd->u.luks1.hdr;
+	size = 32 + count * 160;
+	json = malloc(size);
+	if (!json)
+		return;
 
-	if (isLUKS2(cd->type))
-		return &cd->u.luks2.hdr;
+	len = snprintf(json, size, "{\"traceEvents\":[");
+	for (i = 0; i < count; i++) {
+		n = snprintf(json + len, size - len, "%s{\"name\":\"%s\",\"cat\":\"libcryptsetup\","
+			     "\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":%d,\"tid\":%d}",
+			     i ? "," : "", cd->spans[i].name, cd->spans[i].start_us,
+			     cd->spans[i].end_us - cd->spans[i].start_us,
+			     (int)getpid(), (int)cd->spans[i].tid);
+		if (n < 0 || (size_t)n >= size - len)
+			goto out;
+		len += n;
+	}
+	snprintf(json + len, size - len, "]}");
+	crypt_log(cd, CRYPT_LOG_DEBUG_JSON, json);
+out:
+	free(json);
+}
 
-	if (isLOOPAES(cd->type))
-		return &cd->u.loopaes;
+void crypt_spans_finish(struct crypt_device *cd, int span)
+{
+	if (!cd || !cd->spans)
+		return;
 
-	if (isVERITY(cd->type))
-		return &cd->u.verity;
+	crypt_span_end(cd, span);
 
-	if (isTCRYPT(cd->type))
-		return &cd->u.tcrypt;
+	if (--cd->spans_depth)
+		return;
 
-	return NULL;
+	spans_print(cd);
+	free(cd->spans);
+	cd->spans = NULL;
+	cd->spans_count = 0;
 }
 
-/* internal only */
-struct luks2_reencrypt *crypt_get_luks2_reencrypt(struct crypt_device *cd)
+int crypt_token_prefetch(struct crypt_device *cd, int token, const char *type, void *usrptr)
 {
-	return cd->u.luks2.rh;
-}
+	int r;
 
-/* internal only */
-void crypt_set_luks2_reencrypt(struct crypt_device *cd, struct luks2_reencrypt *rh)
-{
-	cd->u.luks2.rh = rh;
+	log_dbg(cd, "Prefetching secret of token (%s type) %d.", type ?: "any", token);
+
+	if ((r = _onlyLUKS2(cd, CRYPT_CD_QUIET | CRYPT_CD_UNRESTRICTED, 0)))
+		return r;
+
+	return LUKS2_token_prefetch(cd, &cd->u.luks2.hdr, token, type, usrptr);
 }
 
-/*
- * Token handling
- */
 int crypt_activate_by_token_pin(struct crypt_device *cd, const char *name,
 	const char *type, int token, const char *pin, size_t pin_size,
 	void *usrptr, uint32_t flags)
 {
-	int r;
+	int r, span;
 
 	log_dbg(cd, "%s volume %s using token (%s type) %d.",
 		name ? "Activating" : "Checking", name ?: "passphrase",
@@ -5703,8 +7536,25 @@ int crypt_activate_by_token_pin(struct crypt_device *cd, const char *name,
 	if (r < 0)
 		return r;
 
-	return LUKS2_token_open_and_activate(cd, &cd->u.luks2.hdr, token, name, type,
-					     pin, pin_size, flags, usrptr);
+	r = crypt_async_stage(cd, CRYPT_ASYNC_TOKEN);
+	if (r < 0)
+		return r;
+
+	if (flags & CRYPT_ACTIVATE_KEYSLOT_HINT)
+		cd->keyslot_hint = true;
+
+	if ((flags & CRYPT_ACTIVATE_PARALLEL_TOKENS) && token == CRYPT_ANY_TOKEN && !pin)
+		cd->token_parallel_open = true;
+
+	span = crypt_spans_start(cd, "activate_by_token");
+	r = LUKS2_token_open_and_activate(cd, &cd->u.luks2.hdr, token, name, type,
+					  pin, pin_size, flags, usrptr);
+	crypt_spans_finish(cd, span);
+
+	cd->keyslot_hint = false;
+	cd->token_parallel_open = false;
+
+	return r;
 }
 
 int crypt_activate_by_token(struct crypt_device *cd,
@@ -5816,6 +7666,53 @@ int crypt_token_luks2_keyring_set(struct crypt_device *cd,
 	return LUKS2_token_create(cd, &cd->u.luks2.hdr, token, json, 1);
 }
 
+int crypt_token_luks2_usbkey_get(struct crypt_device *cd,
+	int token,
+	struct crypt_token_params_luks2_usbkey *params)
+{
+	crypt_token_info token_info;
+	const char *type;
+	int r;
+
+	if (!params)
+		return -EINVAL;
+
+	log_dbg(cd, "Requesting LUKS2 USB key token %d.", token);
+
+	if ((r = _onlyLUKS2(cd, CRYPT_CD_UNRESTRICTED, 0)))
+		return r;
+
+	token_info = LUKS2_token_status(cd, &cd->u.luks2.hdr, token, &type);
+	if (token_info != CRYPT_TOKEN_INTERNAL || strcmp(type, LUKS2_TOKEN_USBKEY)) {
+		log_dbg(cd, "Token %d is not LUKS2 USB key token.", token);
+		return -EINVAL;
+	}
+
+	return LUKS2_token_usbkey_get(&cd->u.luks2.hdr, token, params);
+}
+
+int crypt_token_luks2_usbkey_set(struct crypt_device *cd,
+	int token,
+	const struct crypt_token_params_luks2_usbkey *params)
+{
+	int r;
+	char json[4096];
+
+	if (!params)
+		return -EINVAL;
+
+	log_dbg(cd, "Creating new LUKS2 USB key token (%d).", token);
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	r = LUKS2_token_usbkey_json(json, sizeof(json), params);
+	if (r < 0)
+		return r;
+
+	return LUKS2_token_create(cd, &cd->u.luks2.hdr, token, json, 1);
+}
+
 int crypt_token_assign_keyslot(struct crypt_device *cd, int token, int keyslot)
 {
 	int r;
@@ -5861,6 +7758,40 @@ int crypt_metadata_locking(struct crypt_device *cd __attribute__((unused)), int
 	return 0;
 }
 
+int crypt_metadata_cache(struct crypt_device *cd __attribute__((unused)), int enable)
+{
+	LUKS2_hdr_cache_enable(enable);
+	return 0;
+}
+
+int crypt_metadata_begin(struct crypt_device *cd)
+{
+	int r;
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	log_dbg(cd, "Starting LUKS2 metadata batch.");
+
+	return LUKS2_hdr_batch_begin(cd, &cd->u.luks2.hdr);
+}
+
+int crypt_metadata_commit(struct crypt_device *cd)
+{
+	int r;
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	log_dbg(cd, "Committing LUKS2 metadata batch.");
+
+	r = LUKS2_hdr_batch_commit(cd, &cd->u.luks2.hdr);
+	if (r == -EINVAL)
+		log_err(cd, _("No metadata batch started."));
+
+	return r;
+}
+
 int crypt_persistent_flags_set(struct crypt_device *cd, crypt_flags_type type, uint32_t flags)
 {
 	int r;
@@ -5896,6 +7827,93 @@ int crypt_persistent_flags_get(struct crypt_device *cd, crypt_flags_type type, u
 	return -EINVAL;
 }
 
+static int activation_flags_probe(struct crypt_device *cd, uint32_t candidate, uint32_t *flags)
+{
+	char cipher[MAX_CIPHER_LEN * 2 + 1];
+	double rd_def, wr_def, rd, wr;
+	unsigned qd = crypt_cpusonline();
+	int r;
+
+	if (!crypt_get_cipher(cd) || !crypt_get_cipher_mode(cd) || !crypt_get_volume_key_size(cd))
+		return -EINVAL;
+
+	if (snprintf(cipher, sizeof(cipher), "%s-%s", crypt_get_cipher(cd), crypt_get_cipher_mode(cd)) < 0)
+		return -EINVAL;
+
+	if (qd > 32)
+		qd = 32;
+
+	/* small random I/O is where workqueue bouncing costs most */
+	r = crypt_benchmark_dm(cd, cipher, crypt_get_volume_key_size(cd), crypt_get_sector_size(cd),
+			       0, 4096, qd, 1, &rd_def, &wr_def);
+	if (!r)
+		r = crypt_benchmark_dm(cd, cipher, crypt_get_volume_key_size(cd), crypt_get_sector_size(cd),
+				       candidate, 4096, qd, 1, &rd, &wr);
+	if (r)
+		return r;
+
+	log_dbg(cd, "Tuning probe: default %.1f/%.1f MiB/s, flags 0x%x %.1f/%.1f MiB/s.",
+		rd_def, wr_def, candidate, rd, wr);
+
+	*flags = (rd + wr) > (rd_def + wr_def) ? candidate : 0;
+
+	return 0;
+}
+
+int crypt_activation_flags_tune(struct crypt_device *cd, uint32_t tune_flags, uint32_t *flags)
+{
+	struct device *device;
+	uint64_t nr_requests;
+	uint32_t dmc_flags, candidate = 0;
+	unsigned cpus = crypt_cpusonline();
+	int r, rotational, nvme;
+
+	if (!cd || !flags || (tune_flags & ~CRYPT_TUNE_PROBE))
+		return -EINVAL;
+
+	*flags = 0;
+
+	device = crypt_data_device(cd);
+	if (!device)
+		return -EINVAL;
+
+	r = device_queue_info(device, &rotational, &nvme, &nr_requests);
+	if (r < 0) {
+		log_dbg(cd, "Cannot get queue info for %s, using default flags.", device_path(device));
+		return 0;
+	}
+
+	if (dm_flags(cd, DM_CRYPT, &dmc_flags))
+		dmc_flags = 0;
+
+	log_dbg(cd, "Tuning flags for %s: rotational %d, NVMe %d, nr_requests %" PRIu64 ", %u CPUs.",
+		device_path(device), rotational, nvme, nr_requests, cpus);
+
+	/*
+	 * Rotational disks benefit from workqueue offload and write sorting.
+	 * For fast devices queueing latency dominates, process data inline.
+	 */
+	if (rotational)
+		candidate = 0;
+	else if (dmc_flags & DM_CRYPT_NO_WORKQUEUE_SUPPORTED) {
+		candidate = CRYPT_ACTIVATE_NO_READ_WORKQUEUE;
+		if (nvme || nr_requests >= 256 || cpus == 1)
+			candidate |= CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+	} else if ((dmc_flags & DM_SAME_CPU_CRYPT_SUPPORTED) && (nvme || cpus == 1))
+		candidate = CRYPT_ACTIVATE_SAME_CPU_CRYPT;
+
+	if (candidate && (tune_flags & CRYPT_TUNE_PROBE)) {
+		r = activation_flags_probe(cd, candidate, flags);
+		if (!r)
+			return 0;
+		log_dbg(cd, "Tuning probe failed (%d), using device heuristic only.", r);
+	}
+
+	*flags = candidate;
+
+	return 0;
+}
+
 static int update_volume_key_segment_digest(struct crypt_device *cd, struct luks2_hdr *hdr, int digest, int commit)
 {
 	int r;
@@ -6217,6 +8235,61 @@ int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
 	return keyslot_new;
 }
 
+int crypt_keyslot_rewrap_by_keyslot_context(struct crypt_device *cd,
+	const int *keyslots,
+	struct crypt_keyslot_context **kcs,
+	unsigned int count)
+{
+	struct luks2_keyslot_params params;
+	const char **passphrases = NULL;
+	size_t *passphrase_sizes = NULL;
+	unsigned int i;
+	int r;
+
+	if (!keyslots || !kcs || !count || count > LUKS2_KEYSLOTS_MAX)
+		return -EINVAL;
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	log_dbg(cd, "Re-wrapping %u keyslots.", count);
+
+	passphrases = calloc(count, sizeof(*passphrases));
+	passphrase_sizes = calloc(count, sizeof(*passphrase_sizes));
+	if (!passphrases || !passphrase_sizes) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!kcs[i] || !kcs[i]->get_passphrase ||
+		    crypt_keyslot_status(cd, keyslots[i]) < CRYPT_SLOT_ACTIVE) {
+			r = -EINVAL;
+			goto out;
+		}
+
+		r = kcs[i]->get_passphrase(cd, kcs[i], &passphrases[i], &passphrase_sizes[i]);
+		if (r < 0)
+			goto out;
+	}
+
+	r = LUKS2_keyslot_params_default(cd, &cd->u.luks2.hdr, &params);
+	if (r)
+		goto out;
+
+	r = LUKS2_keyslots_rewrap(cd, &cd->u.luks2.hdr, keyslots,
+				  (const char * const *)passphrases, passphrase_sizes,
+				  count, &params);
+out:
+	free(passphrases);
+	free(passphrase_sizes);
+
+	if (r < 0)
+		_luks2_rollback(cd);
+
+	return r < 0 ? r : 0;
+}
+
 /*
  * Keyring handling
  */
@@ -6246,7 +8319,7 @@ int crypt_volume_key_keyring(struct crypt_device *cd __attribute__((unused)), in
 /* internal only */
 int crypt_volume_key_load_in_keyring(struct crypt_device *cd, struct volume_key *vk)
 {
-	int r;
+	int r, span;
 	const char *type_name = key_type_name(LOGON_KEY);
 
 	if (!vk || !cd || !type_name)
@@ -6259,7 +8332,9 @@ int crypt_volume_key_load_in_keyring(struct crypt_device *cd, struct volume_key
 
 	log_dbg(cd, "Loading key (%zu bytes, type %s) in thread keyring.", vk->keylength, type_name);
 
+	span = crypt_span_begin(cd, "keyring_upload");
 	r = keyring_add_key_in_thread_keyring(LOGON_KEY, vk->key_description, vk->key, vk->keylength);
+	crypt_span_end(cd, span);
 	if (r) {
 		log_dbg(cd, "keyring_add_key_in_thread_keyring failed (error %d)", r);
 		log_err(cd, _("Failed to load key in kernel keyring."));
@@ -6320,7 +8395,7 @@ int crypt_activate_by_keyring(struct crypt_device *cd,
 {
 	char *passphrase;
 	size_t passphrase_size;
-	int r;
+	int r, span;
 
 	if (!cd || !key_description)
 		return -EINVAL;
@@ -6343,7 +8418,9 @@ int crypt_activate_by_keyring(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
+	span = crypt_spans_start(cd, "activate_by_keyring");
 	r = _activate_by_passphrase(cd, name, keyslot, passphrase, passphrase_size, flags);
+	crypt_spans_finish(cd, span);
 
 	crypt_safe_memzero(passphrase, passphrase_size);
 	free(passphrase);
@@ -6380,6 +8457,115 @@ void crypt_serialize_unlock(struct crypt_device *cd)
 	cd->pbkdf_memory_hard_lock = NULL;
 }
 
+bool crypt_keyslot_parallel_trial(struct crypt_device *cd)
+{
+	return cd && cd->keyslot_parallel_trial;
+}
+
+bool crypt_token_parallel_open(struct crypt_device *cd)
+{
+	return cd && cd->token_parallel_open;
+}
+
+int crypt_volume_key_session(struct crypt_device *cd, unsigned int timeout, uint32_t flags)
+{
+	if (!cd || (flags & ~CRYPT_VOLUME_KEY_SESSION_KEYRING))
+		return -EINVAL;
+
+	if (!isLUKS1(cd->type) && !isLUKS2(cd->type)) {
+		log_err(cd, _("This operation is supported only for LUKS device."));
+		return -EINVAL;
+	}
+
+	if (timeout && (flags & CRYPT_VOLUME_KEY_SESSION_KEYRING) && !kernel_keyring_support())
+		return -ENOTSUP;
+
+	crypt_vk_session_drop(cd, &cd->vk_session, true);
+
+	log_dbg(cd, "Volume key session %s (timeout %u%s).", timeout ? "started" : "ended",
+		timeout, flags & CRYPT_VOLUME_KEY_SESSION_KEYRING ? ", keyring" : "");
+	cd->vk_session.timeout = timeout;
+	cd->vk_session.flags = timeout ? flags : 0;
+
+	return 0;
+}
+
+struct crypt_vk_session *crypt_vk_session(struct crypt_device *cd)
+{
+	return cd && cd->vk_session.timeout ? &cd->vk_session : NULL;
+}
+
+char **crypt_keystore_name(struct crypt_device *cd)
+{
+	return &cd->keystore_name;
+}
+
+struct crypt_async **crypt_async_handle(struct crypt_device *cd)
+{
+	return &cd->async;
+}
+
+unsigned crypt_token_keyring_cache_timeout(struct crypt_device *cd)
+{
+	return cd ? cd->token_keyring_cache_timeout : 0;
+}
+
+uint32_t crypt_token_timeout(struct crypt_device *cd)
+{
+	return cd ? cd->token_timeout_ms : 0;
+}
+
+uint32_t crypt_deactivate_timeout(struct crypt_device *cd)
+{
+	return (cd && cd->deactivate_timeout_ms) ? cd->deactivate_timeout_ms : DEFAULT_DEACTIVATE_TIMEOUT_MS;
+}
+
+void crypt_token_stats_reset(struct crypt_device *cd)
+{
+	if (cd)
+		cd->token_stats_valid = 0;
+}
+
+/* Statistics of token in the current unlock, cleared on first use */
+struct crypt_token_open_stats *crypt_token_stats(struct crypt_device *cd, int token)
+{
+	if (!cd || token < 0 || token >= LUKS2_TOKENS_MAX)
+		return NULL;
+
+	if (!(cd->token_stats_valid & (UINT32_C(1) << token))) {
+		memset(&cd->token_stats[token], 0, sizeof(cd->token_stats[token]));
+		cd->token_stats[token].result = -ENOENT;
+		cd->token_stats_valid |= UINT32_C(1) << token;
+	}
+
+	return &cd->token_stats[token];
+}
+
+uint64_t crypt_verity_fec_memory_kb(struct crypt_device *cd)
+{
+	return cd ? cd->verity_fec_memory_kb : 0;
+}
+
+unsigned crypt_verity_threads(struct crypt_device *cd)
+{
+	return cd ? cd->verity_threads : 0;
+}
+
+const struct crypt_reencrypt_tuning *crypt_get_reencrypt_tuning(struct crypt_device *cd)
+{
+	return &cd->reencrypt_tuning;
+}
+
+bool crypt_keyslot_hint_enabled(struct crypt_device *cd)
+{
+	return cd && cd->keyslot_hint;
+}
+
+const char *crypt_keyslot_hint_credential(struct crypt_device *cd)
+{
+	return crypt_keyslot_hint_enabled(cd) ? cd->keyslot_hint_credential : NULL;
+}
+
 crypt_reencrypt_info crypt_reencrypt_status(struct crypt_device *cd,
 		struct crypt_params_reencrypt *params)
 {
@@ -6401,6 +8587,9 @@ crypt_reencrypt_info crypt_reencrypt_status(struct crypt_device *cd,
 static void __attribute__((destructor)) libcryptsetup_exit(void)
 {
 	crypt_token_unload_external_all(NULL);
+	TCRYPT_key_cache_drop();
+	crypt_devpath_index_drop();
+	crypt_executor_exit();
 
 	crypt_backend_destroy();
 	crypt_random_exit();
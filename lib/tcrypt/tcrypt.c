@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "libcryptsetup.h"
 #include "tcrypt.h"
@@ -270,23 +271,18 @@ static void TCRYPT_swab_le(char *buf)
 	*r = swab32(*r);
 }
 
-static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg,
-				   const char *key, char *buf)
+static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg, struct crypt_cipher *cipher,
+				   const char *key, char *buf, size_t len)
 {
 	int bs = alg->iv_size;
 	char iv[8], iv_old[8];
-	struct crypt_cipher *cipher = NULL;
-	int i, j, r;
+	size_t i;
+	int j, r = 0;
 
 	assert(bs == 8);
 
-	r = crypt_cipher_init(&cipher, "blowfish", "ecb",
-			      &key[alg->key_offset], alg->key_size);
-	if (r < 0)
-		return r;
-
 	memcpy(iv, &key[alg->iv_offset], alg->iv_size);
-	for (i = 0; i < TCRYPT_HDR_LEN; i += bs) {
+	for (i = 0; i < len; i += bs) {
 		memcpy(iv_old, &buf[i], bs);
 		TCRYPT_swab_le(&buf[i]);
 		r = crypt_cipher_decrypt(cipher, &buf[i], &buf[i],
@@ -299,17 +295,16 @@ static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg,
 		memcpy(iv, iv_old, bs);
 	}
 
-	crypt_cipher_destroy(cipher);
 	crypt_safe_memzero(iv, bs);
 	crypt_safe_memzero(iv_old, bs);
 	return r;
 }
 
-static void TCRYPT_remove_whitening(char *buf, const char *key)
+static void TCRYPT_remove_whitening(char *buf, const char *key, size_t len)
 {
-	int j;
+	size_t j;
 
-	for (j = 0; j < TCRYPT_HDR_LEN; j++)
+	for (j = 0; j < len; j++)
 		buf[j] ^= key[j % 8];
 }
 
@@ -333,42 +328,88 @@ static void TCRYPT_copy_key(struct tcrypt_alg *alg, const char *mode,
 	}
 }
 
-static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
-				   const char *key,struct tcrypt_phdr *hdr)
+/*
+ * Cipher transforms of one chain, allocated once per derived key and used
+ * both for magic probe and for full header decryption.
+ */
+struct tcrypt_chain {
+	struct crypt_cipher *cipher[3];
+};
+
+static void TCRYPT_chain_destroy(struct tcrypt_chain *chain)
+{
+	unsigned int j;
+
+	for (j = 0; j < ARRAY_SIZE(chain->cipher); j++) {
+		if (chain->cipher[j])
+			crypt_cipher_destroy(chain->cipher[j]);
+		chain->cipher[j] = NULL;
+	}
+}
+
+static int TCRYPT_chain_init(struct tcrypt_algs *ciphers, const char *key,
+			     struct tcrypt_chain *chain)
 {
 	char backend_key[TCRYPT_HDR_KEY_LEN];
-	char iv[TCRYPT_HDR_IV_LEN] = {};
 	char mode_name[MAX_CIPHER_LEN + 1];
-	struct crypt_cipher *cipher;
-	char *c, *buf = (char*)&hdr->e;
-	int r;
+	struct tcrypt_alg *alg;
+	unsigned int j;
+	char *c;
+	int r = 0;
+
+	assert(ciphers->chain_count <= ARRAY_SIZE(chain->cipher));
 
 	/* Remove IV if present */
 	mode_name[MAX_CIPHER_LEN] = '\0';
-	strncpy(mode_name, mode, MAX_CIPHER_LEN);
+	strncpy(mode_name, ciphers->mode, MAX_CIPHER_LEN);
 	c = strchr(mode_name, '-');
 	if (c)
 		*c = '\0';
 
+	memset(chain, 0, sizeof(*chain));
+	for (j = 0; j < ciphers->chain_count && !r; j++) {
+		alg = &ciphers->cipher[j];
+		if (!alg->name)
+			continue;
+
+		/* For chained CBC (cbci) and blowfish_le, CBC is implemented here over ECB */
+		if (!strncmp(ciphers->mode, "cbci", 4))
+			r = crypt_cipher_init(&chain->cipher[j], alg->name, "ecb",
+					      &key[alg->key_offset], alg->key_size);
+		else if (!strcmp(alg->name, "blowfish_le"))
+			r = crypt_cipher_init(&chain->cipher[j], "blowfish", "ecb",
+					      &key[alg->key_offset], alg->key_size);
+		else {
+			TCRYPT_copy_key(alg, ciphers->mode, backend_key, key);
+			r = crypt_cipher_init(&chain->cipher[j], alg->name, mode_name,
+					      backend_key, alg->key_size);
+		}
+	}
+
+	crypt_safe_memzero(backend_key, sizeof(backend_key));
+	if (r < 0)
+		TCRYPT_chain_destroy(chain);
+	return r;
+}
+
+static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
+				  struct crypt_cipher *cipher, const char *key,
+				  char *buf, size_t len)
+{
+	char iv[TCRYPT_HDR_IV_LEN] = {};
+	int r;
+
 	if (!strncmp(mode, "lrw", 3))
 		iv[alg->iv_size - 1] = 1;
 	else if (!strncmp(mode, "cbc", 3)) {
-		TCRYPT_remove_whitening(buf, &key[8]);
+		TCRYPT_remove_whitening(buf, &key[8], len);
 		if (!strcmp(alg->name, "blowfish_le"))
-			return decrypt_blowfish_le_cbc(alg, key, buf);
+			return decrypt_blowfish_le_cbc(alg, cipher, key, buf, len);
 		memcpy(iv, &key[alg->iv_offset], alg->iv_size);
 	}
 
-	TCRYPT_copy_key(alg, mode, backend_key, key);
-	r = crypt_cipher_init(&cipher, alg->name, mode_name,
-			      backend_key, alg->key_size);
-	if (!r) {
-		r = crypt_cipher_decrypt(cipher, buf, buf, TCRYPT_HDR_LEN,
-					 iv, alg->iv_size);
-		crypt_cipher_destroy(cipher);
-	}
+	r = crypt_cipher_decrypt(cipher, buf, buf, len, iv, alg->iv_size);
 
-	crypt_safe_memzero(backend_key, sizeof(backend_key));
 	crypt_safe_memzero(iv, TCRYPT_HDR_IV_LEN);
 	return r;
 }
@@ -377,38 +418,26 @@ static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
  * For chained ciphers and CBC mode we need "outer" decryption.
  * Backend doesn't provide this, so implement it here directly using ECB.
  */
-static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers,
-				const char *key, struct tcrypt_phdr *hdr)
+static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers, struct tcrypt_chain *chain,
+				const char *key, char *buf, size_t len)
 {
-	struct crypt_cipher *cipher[3];
 	unsigned int bs = ciphers->cipher[0].iv_size;
-	char *buf = (char*)&hdr->e, iv[16], iv_old[16];
-	unsigned int i, j;
+	char iv[16], iv_old[16];
+	unsigned int j;
+	size_t i;
 	int r = -EINVAL;
 
-	assert(ciphers->chain_count <= 3);
 	assert(bs <= 16);
 
-	TCRYPT_remove_whitening(buf, &key[8]);
+	TCRYPT_remove_whitening(buf, &key[8], len);
 
 	memcpy(iv, &key[ciphers->cipher[0].iv_offset], bs);
 
-	/* Initialize all ciphers in chain in ECB mode */
-	for (j = 0; j < ciphers->chain_count; j++)
-		cipher[j] = NULL;
-	for (j = 0; j < ciphers->chain_count; j++) {
-		r = crypt_cipher_init(&cipher[j], ciphers->cipher[j].name, "ecb",
-				      &key[ciphers->cipher[j].key_offset],
-				      ciphers->cipher[j].key_size);
-		if (r < 0)
-			goto out;
-	}
-
 	/* Implements CBC with chained ciphers in loop inside */
-	for (i = 0; i < TCRYPT_HDR_LEN; i += bs) {
+	for (i = 0; i < len; i += bs) {
 		memcpy(iv_old, &buf[i], bs);
 		for (j = ciphers->chain_count; j > 0; j--) {
-			r = crypt_cipher_decrypt(cipher[j - 1], &buf[i], &buf[i],
+			r = crypt_cipher_decrypt(chain->cipher[j - 1], &buf[i], &buf[i],
 						  bs, NULL, 0);
 			if (r < 0)
 				goto out;
@@ -418,20 +447,49 @@ static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers,
 		memcpy(iv, iv_old, bs);
 	}
 out:
-	for (j = 0; j < ciphers->chain_count; j++)
-		if (cipher[j])
-			crypt_cipher_destroy(cipher[j]);
-
 	crypt_safe_memzero(iv, bs);
 	crypt_safe_memzero(iv_old, bs);
 	return r;
 }
 
+/*
+ * Decrypt first len bytes of header. XTS and LRW blocks are independent
+ * and CBC block depends only on the previous one, so any whole-block prefix
+ * decrypts to the same plaintext as in the full header.
+ */
+static int TCRYPT_chain_decrypt(struct tcrypt_algs *ciphers, struct tcrypt_chain *chain,
+				const char *key, char *buf, size_t len)
+{
+	int j, r = -EINVAL;
+
+	if (!strncmp(ciphers->mode, "cbci", 4))
+		return TCRYPT_decrypt_cbci(ciphers, chain, key, buf, len);
+
+	for (j = ciphers->chain_count - 1; j >= 0 ; j--) {
+		if (!ciphers->cipher[j].name)
+			continue;
+		r = TCRYPT_decrypt_hdr_one(&ciphers->cipher[j], ciphers->mode,
+					   chain->cipher[j], key, buf, len);
+		if (r < 0)
+			break;
+	}
+
+	return r;
+}
+
+static bool TCRYPT_hdr_magic(struct tcrypt_phdr *hdr, struct crypt_params_tcrypt *params)
+{
+	return !strncmp(hdr->d.magic, TCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN) ||
+	       ((params->flags & CRYPT_TCRYPT_VERA_MODES) &&
+		!strncmp(hdr->d.magic, VCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN));
+}
+
 static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
 			       const char *key, struct crypt_params_tcrypt *params)
 {
+	struct tcrypt_chain chain;
 	struct tcrypt_phdr hdr2;
-	int i, j, r = -EINVAL;
+	int i, r = -EINVAL;
 
 	for (i = 0; tcrypt_cipher[i].chain_count; i++) {
 		if (params->cipher && !strstr(tcrypt_cipher[i].long_name, params->cipher))
@@ -441,20 +499,17 @@ static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
 		log_dbg(cd, "TCRYPT:  trying cipher %s-%s",
 			tcrypt_cipher[i].long_name, tcrypt_cipher[i].mode);
 
-		memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_LEN);
+		r = TCRYPT_chain_init(&tcrypt_cipher[i], key, &chain);
 
-		if (!strncmp(tcrypt_cipher[i].mode, "cbci", 4))
-			r = TCRYPT_decrypt_cbci(&tcrypt_cipher[i], key, &hdr2);
-		else for (j = tcrypt_cipher[i].chain_count - 1; j >= 0 ; j--) {
-			if (!tcrypt_cipher[i].cipher[j].name)
-				continue;
-			r = TCRYPT_decrypt_hdr_one(&tcrypt_cipher[i].cipher[j],
-					    tcrypt_cipher[i].mode, key, &hdr2);
-			if (r < 0)
-				break;
+		/* Reject candidate by the first block (with magic) only */
+		if (!r) {
+			memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_PROBE_LEN);
+			r = TCRYPT_chain_decrypt(&tcrypt_cipher[i], &chain, key,
+						 (char *)&hdr2.e, TCRYPT_HDR_PROBE_LEN);
 		}
 
 		if (r < 0) {
+			TCRYPT_chain_destroy(&chain);
 			log_dbg(cd, "TCRYPT:   returned error %d, skipped.", r);
 			if (r == -ENOTSUP)
 				break;
@@ -462,40 +517,58 @@ static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
 			continue;
 		}
 
-		if (!strncmp(hdr2.d.magic, TCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN)) {
-			log_dbg(cd, "TCRYPT: Signature magic detected.");
-			memcpy(&hdr->e, &hdr2.e, TCRYPT_HDR_LEN);
-			r = i;
-			break;
+		if (!TCRYPT_hdr_magic(&hdr2, params)) {
+			TCRYPT_chain_destroy(&chain);
+			r = -EPERM;
+			continue;
 		}
-		if ((params->flags & CRYPT_TCRYPT_VERA_MODES) &&
-		     !strncmp(hdr2.d.magic, VCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN)) {
-			log_dbg(cd, "TCRYPT: Signature magic detected (Veracrypt).");
-			memcpy(&hdr->e, &hdr2.e, TCRYPT_HDR_LEN);
-			r = i;
-			break;
+
+		memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_LEN);
+		r = TCRYPT_chain_decrypt(&tcrypt_cipher[i], &chain, key,
+					 (char *)&hdr2.e, TCRYPT_HDR_LEN);
+		TCRYPT_chain_destroy(&chain);
+		if (r < 0) {
+			log_dbg(cd, "TCRYPT:   returned error %d, skipped.", r);
+			if (r == -ENOTSUP)
+				break;
+			r = -ENOENT;
+			continue;
 		}
-		r = -EPERM;
+
+		log_dbg(cd, "TCRYPT: Signature magic detected%s.",
+			strncmp(hdr2.d.magic, TCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN) ?
+			" (Veracrypt)" : "");
+		memcpy(&hdr->e, &hdr2.e, TCRYPT_HDR_LEN);
+		r = i;
+		break;
 	}
 
 	crypt_safe_memzero(&hdr2, sizeof(hdr2));
 	return r;
 }
 
+/* Keyfile is mixed into pool in blocks, CRC state after every byte is used */
+#define TCRYPT_KEYFILE_BLOCK 65536
+
 static int TCRYPT_pool_keyfile(struct crypt_device *cd,
 				unsigned char pool[VCRYPT_KEY_POOL_LEN],
 				const char *keyfile, int keyfiles_pool_length)
 {
 	unsigned char *data;
-	int i, j, fd, data_size, r = -EIO;
-	uint32_t crc;
+	uint32_t *crcs;
+	ssize_t data_size;
+	size_t i, total = 0;
+	int j = 0, fd = -1, r = -EIO;
+	uint32_t crc = ~0U;
 
 	log_dbg(cd, "TCRYPT: using keyfile %s.", keyfile);
 
-	data = malloc(TCRYPT_KEYFILE_LEN);
-	if (!data)
-		return -ENOMEM;
-	memset(data, 0, TCRYPT_KEYFILE_LEN);
+	data = malloc(TCRYPT_KEYFILE_BLOCK);
+	crcs = malloc(TCRYPT_KEYFILE_BLOCK * sizeof(*crcs));
+	if (!data || !crcs) {
+		r = -ENOMEM;
+		goto out;
+	}
 
 	fd = open(keyfile, O_RDONLY);
 	if (fd < 0) {
@@ -503,42 +576,183 @@ static int TCRYPT_pool_keyfile(struct crypt_device *cd,
 		goto out;
 	}
 
-	data_size = read_buffer(fd, data, TCRYPT_KEYFILE_LEN);
-	close(fd);
-	if (data_size < 0) {
-		log_err(cd, _("Error reading keyfile %s."), keyfile);
-		goto out;
-	}
+	/* Only first TCRYPT_KEYFILE_LEN bytes of keyfile are used */
+	while (total < TCRYPT_KEYFILE_LEN) {
+		data_size = read_buffer(fd, data, TCRYPT_KEYFILE_BLOCK);
+		if (data_size < 0) {
+			log_err(cd, _("Error reading keyfile %s."), keyfile);
+			goto out;
+		}
+		if (!data_size)
+			break;
 
-	for (i = 0, j = 0, crc = ~0U; i < data_size; i++) {
-		crc = crypt_crc32(crc, &data[i], 1);
-		pool[j++] += (unsigned char)(crc >> 24);
-		pool[j++] += (unsigned char)(crc >> 16);
-		pool[j++] += (unsigned char)(crc >>  8);
-		pool[j++] += (unsigned char)(crc);
-		j %= keyfiles_pool_length;
+		crypt_crc32_trace(crc, data, data_size, crcs);
+		crc = crcs[data_size - 1];
+
+		for (i = 0; i < (size_t)data_size; i++) {
+			pool[j++] += (unsigned char)(crcs[i] >> 24);
+			pool[j++] += (unsigned char)(crcs[i] >> 16);
+			pool[j++] += (unsigned char)(crcs[i] >>  8);
+			pool[j++] += (unsigned char)(crcs[i]);
+			j %= keyfiles_pool_length;
+		}
+
+		total += data_size;
+		if (data_size < TCRYPT_KEYFILE_BLOCK)
+			break;
 	}
 	r = 0;
 out:
+	if (fd >= 0)
+		close(fd);
 	crypt_safe_memzero(&crc, sizeof(crc));
-	crypt_safe_memzero(data, TCRYPT_KEYFILE_LEN);
-	free(data);
+	if (crcs) {
+		crypt_safe_memzero(crcs, TCRYPT_KEYFILE_BLOCK * sizeof(*crcs));
+		free(crcs);
+	}
+	if (data) {
+		crypt_safe_memzero(data, TCRYPT_KEYFILE_BLOCK);
+		free(data);
+	}
+
+	return r;
+}
+
+struct tcrypt_trial {
+	struct tcrypt_phdr *hdr;
+	struct crypt_params_tcrypt *params;
+	unsigned int skipped;
+	int kdf;
+};
+
+/* Runs in caller thread in KDF table order, the first decrypted header wins */
+static int TCRYPT_trial_verify(struct crypt_device *cd, struct crypt_kdf_job *job, void *usrptr)
+{
+	struct tcrypt_trial *t = usrptr;
+	int r;
+
+	if (job->r < 0) {
+		log_verbose(cd, _("PBKDF2 hash algorithm %s not available, skipping."),
+			    job->pbkdf.hash);
+		t->skipped++;
+		return -ENOENT;
+	}
+
+	/* Decrypt header */
+	r = TCRYPT_decrypt_hdr(cd, t->hdr, job->derived_key->key, t->params);
+	if (r == -ENOENT) {
+		t->skipped++;
+		return -ENOENT;
+	}
+
+	if (r >= 0)
+		t->kdf = job->keyslot;
+
+	return r;
+}
+
+/*
+ * Header key of the last unlocked system drive. Partitions of the same drive
+ * read the same system header, so with the same passphrase and keyfiles
+ * their KDF would produce the same header key.
+ */
+struct tcrypt_key_cache {
+	struct tcrypt_phdr hdr; /* still encrypted */
+	unsigned char pwd[VCRYPT_KEY_POOL_LEN];
+	size_t passphrase_size;
+	uint32_t flags;
+	uint32_t pim;
+	int kdf;
+	char key[TCRYPT_HDR_KEY_LEN];
+};
+
+#define TCRYPT_KEY_CACHE_FLAGS (CRYPT_TCRYPT_LEGACY_MODES | CRYPT_TCRYPT_VERA_MODES)
+
+static struct tcrypt_key_cache *key_cache;
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool TCRYPT_key_cache_use(const struct crypt_params_tcrypt *params)
+{
+	return (params->flags & CRYPT_TCRYPT_SYSTEM_HEADER) &&
+	       (params->flags & CRYPT_TCRYPT_CACHE_SYSTEM_KEY);
+}
+
+/* requires key_cache_lock */
+static bool TCRYPT_key_cache_match(const struct tcrypt_phdr *hdr,
+				   const unsigned char *pwd, size_t passphrase_size,
+				   const struct crypt_params_tcrypt *params)
+{
+	return key_cache &&
+	       key_cache->passphrase_size == passphrase_size &&
+	       key_cache->flags == (params->flags & TCRYPT_KEY_CACHE_FLAGS) &&
+	       key_cache->pim == params->veracrypt_pim &&
+	       (!params->hash_name || !strcmp(params->hash_name, tcrypt_kdf[key_cache->kdf].hash)) &&
+	       !memcmp(&key_cache->hdr, hdr, sizeof(*hdr)) &&
+	       !crypt_backend_memeq(key_cache->pwd, pwd, sizeof(key_cache->pwd));
+}
+
+static int TCRYPT_key_cache_get(const struct tcrypt_phdr *hdr,
+				const unsigned char *pwd, size_t passphrase_size,
+				const struct crypt_params_tcrypt *params, char *key)
+{
+	int r = -ENOENT;
+
+	pthread_mutex_lock(&key_cache_lock);
+	if (TCRYPT_key_cache_match(hdr, pwd, passphrase_size, params)) {
+		memcpy(key, key_cache->key, TCRYPT_HDR_KEY_LEN);
+		r = key_cache->kdf;
+	}
+	pthread_mutex_unlock(&key_cache_lock);
 
 	return r;
 }
 
+static void TCRYPT_key_cache_set(const struct tcrypt_phdr *hdr,
+				 const unsigned char *pwd, size_t passphrase_size,
+				 const struct crypt_params_tcrypt *params,
+				 int kdf, const char *key)
+{
+	pthread_mutex_lock(&key_cache_lock);
+	if (!key_cache)
+		key_cache = crypt_safe_alloc(sizeof(*key_cache));
+	if (key_cache) {
+		memcpy(&key_cache->hdr, hdr, sizeof(*hdr));
+		memcpy(key_cache->pwd, pwd, sizeof(key_cache->pwd));
+		key_cache->passphrase_size = passphrase_size;
+		key_cache->flags = params->flags & TCRYPT_KEY_CACHE_FLAGS;
+		key_cache->pim = params->veracrypt_pim;
+		key_cache->kdf = kdf;
+		memcpy(key_cache->key, key, TCRYPT_HDR_KEY_LEN);
+	}
+	pthread_mutex_unlock(&key_cache_lock);
+}
+
+void TCRYPT_key_cache_drop(void)
+{
+	pthread_mutex_lock(&key_cache_lock);
+	crypt_safe_free(key_cache);
+	key_cache = NULL;
+	pthread_mutex_unlock(&key_cache_lock);
+}
+
+/*
+ * Header key of every KDF candidate is derived concurrently (up to number
+ * of online CPUs), so the header without known hash opens in about the time
+ * of the slowest KDF instead of sum of all of them.
+ */
 static int TCRYPT_init_hdr(struct crypt_device *cd,
 			   struct tcrypt_phdr *hdr,
 			   struct crypt_params_tcrypt *params)
 {
 	unsigned char pwd[VCRYPT_KEY_POOL_LEN] = {};
 	size_t passphrase_size, max_passphrase_size;
-	char *key;
-	unsigned int i, skipped = 0, iterations;
+	struct tcrypt_trial t = { .hdr = hdr, .params = params, .kdf = -1 };
+	struct crypt_kdf_job *jobs = NULL;
+	struct tcrypt_phdr hdr_enc;
+	char cached_key[TCRYPT_HDR_KEY_LEN];
+	unsigned int i, count = 0, iterations;
 	int r = -EPERM, keyfiles_pool_length;
-
-	if (posix_memalign((void*)&key, crypt_getpagesize(), TCRYPT_HDR_KEY_LEN))
-		return -ENOMEM;
+	bool cache = TCRYPT_key_cache_use(params);
 
 	if (params->flags & CRYPT_TCRYPT_VERA_MODES &&
 	    params->passphrase_size > TCRYPT_KEY_POOL_LEN) {
@@ -572,6 +786,24 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	for (i = 0; i < params->passphrase_size; i++)
 		pwd[i] += params->passphrase[i];
 
+	if (cache) {
+		memcpy(&hdr_enc, hdr, sizeof(hdr_enc));
+		t.kdf = TCRYPT_key_cache_get(hdr, pwd, passphrase_size, params, cached_key);
+		if (t.kdf >= 0) {
+			log_dbg(cd, "TCRYPT: using cached system header key.");
+			r = TCRYPT_decrypt_hdr(cd, hdr, cached_key, params);
+			if (r >= 0)
+				goto decrypted;
+			t.kdf = -1;
+		}
+	}
+
+	jobs = calloc(ARRAY_SIZE(tcrypt_kdf), sizeof(*jobs));
+	if (!jobs) {
+		r = -ENOMEM;
+		goto out;
+	}
+
 	for (i = 0; tcrypt_kdf[i].name; i++) {
 		if (params->hash_name && strcmp(params->hash_name, tcrypt_kdf[i].hash))
 			continue;
@@ -588,35 +820,32 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 				    (tcrypt_kdf[i].veracrypt_pim_mult * params->veracrypt_pim);
 		} else
 			iterations = tcrypt_kdf[i].iterations;
-		/* Derive header key */
+
 		log_dbg(cd, "TCRYPT: trying KDF: %s-%s-%d%s.",
 			tcrypt_kdf[i].name, tcrypt_kdf[i].hash, tcrypt_kdf[i].iterations,
 			params->veracrypt_pim && tcrypt_kdf[i].veracrypt ? "-PIM" : "");
-		r = crypt_pbkdf(tcrypt_kdf[i].name, tcrypt_kdf[i].hash,
-				(char*)pwd, passphrase_size,
-				hdr->salt, TCRYPT_HDR_SALT_LEN,
-				key, TCRYPT_HDR_KEY_LEN,
-				iterations, 0, 0);
-		if (r < 0) {
-			log_verbose(cd, _("PBKDF2 hash algorithm %s not available, skipping."),
-				      tcrypt_kdf[i].hash);
-			skipped++;
-			r = -EPERM;
-			continue;
-		}
 
-		/* Decrypt header */
-		r = TCRYPT_decrypt_hdr(cd, hdr, key, params);
-		if (r == -ENOENT) {
-			skipped++;
-			r = -EPERM;
-			continue;
+		jobs[count].keyslot = i;
+		jobs[count].pbkdf.type = tcrypt_kdf[i].name;
+		jobs[count].pbkdf.hash = tcrypt_kdf[i].hash;
+		jobs[count].pbkdf.iterations = iterations;
+		jobs[count].salt_len = TCRYPT_HDR_SALT_LEN;
+		jobs[count].salt = malloc(TCRYPT_HDR_SALT_LEN);
+		jobs[count].derived_key = crypt_alloc_volume_key(TCRYPT_HDR_KEY_LEN, NULL);
+		count++;
+		if (!jobs[count - 1].salt || !jobs[count - 1].derived_key) {
+			r = -ENOMEM;
+			goto out;
 		}
-		if (r != -EPERM)
-			break;
+		memcpy(jobs[count - 1].salt, hdr->salt, TCRYPT_HDR_SALT_LEN);
 	}
 
-	if ((r < 0 && skipped && skipped == i) || r == -ENOTSUP) {
+	r = count ? crypt_kdf_parallel_trial(cd, jobs, count, (const char *)pwd, passphrase_size,
+					     TCRYPT_trial_verify, &t) : -EPERM;
+	if (r == -ENOENT)
+		r = -EPERM;
+
+	if ((r < 0 && t.skipped && t.skipped == count) || r == -ENOTSUP) {
 		log_err(cd, _("Required kernel crypto interface not available."));
 #ifdef ENABLE_AF_ALG
 		log_err(cd, _("Ensure you have algif_skcipher kernel module loaded."));
@@ -626,6 +855,13 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	if (r < 0)
 		goto out;
 
+	if (cache)
+		for (i = 0; i < count; i++)
+			if (jobs[i].keyslot == t.kdf)
+				TCRYPT_key_cache_set(&hdr_enc, pwd, passphrase_size, params,
+						     t.kdf, jobs[i].derived_key->key);
+decrypted:
+	i = t.kdf;
 	r = TCRYPT_hdr_from_disk(cd, hdr, params, i, r);
 	if (!r) {
 		log_dbg(cd, "TCRYPT: Magic: %s, Header version: %d, req. %d, sector %d"
@@ -639,9 +875,8 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	}
 out:
 	crypt_safe_memzero(pwd, TCRYPT_KEY_POOL_LEN);
-	if (key)
-		crypt_safe_memzero(key, TCRYPT_HDR_KEY_LEN);
-	free(key);
+	crypt_safe_memzero(cached_key, sizeof(cached_key));
+	crypt_kdf_jobs_free(jobs, count);
 	return r;
 }
 
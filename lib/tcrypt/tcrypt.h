@@ -28,6 +28,7 @@
 #define TCRYPT_HDR_IV_LEN   16
 #define TCRYPT_HDR_LEN     448
 #define TCRYPT_HDR_KEY_LEN 192
+#define TCRYPT_HDR_PROBE_LEN 16 /* first block with magic, multiple of all block sizes */
 #define TCRYPT_HDR_MAGIC "TRUE"
 #define VCRYPT_HDR_MAGIC "VERA"
 #define TCRYPT_HDR_MAGIC_LEN 4
@@ -79,6 +80,8 @@ struct dm_target;
 struct volume_key;
 struct device;
 
+void TCRYPT_key_cache_drop(void);
+
 int TCRYPT_read_phdr(struct crypt_device *cd,
 		     struct tcrypt_phdr *hdr,
 		     struct crypt_params_tcrypt *params);
@@ -23,10 +23,15 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <linux/limits.h>
+#include <linux/mempolicy.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/utsname.h>
+#include <linux/fs.h>
 
 #include "internal.h"
 
@@ -59,6 +64,184 @@ uint64_t crypt_getphysmemory_kb(void)
 	return phys_memory_kb;
 }
 
+#define CGROUP2_MOUNT "/sys/fs/cgroup"
+
+/* Returns limit in kB, 0 for "max" or unreadable file */
+static uint64_t cgroup2_read_limit_kb(const char *dir, const char *file)
+{
+	char path[PATH_MAX], buf[32];
+	unsigned long long value;
+	FILE *f;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path))
+		return 0;
+
+	f = fopen(path, "re");
+	if (!f)
+		return 0;
+
+	if (!fgets(buf, sizeof(buf), f) || sscanf(buf, "%llu", &value) != 1)
+		value = 0;
+
+	fclose(f);
+	return value / 1024;
+}
+
+/*
+ * Memory limit of own cgroup v2 (lower of memory.max and memory.high),
+ * parent cgroups limits apply as well. Returns 0 if there is no limit.
+ */
+uint64_t crypt_getcgroupmemory_kb(void)
+{
+	char line[PATH_MAX], dir[PATH_MAX + sizeof(CGROUP2_MOUNT)], *p;
+	uint64_t limit_kb = 0, kb;
+	bool found = false;
+	FILE *f;
+
+	f = fopen("/proc/self/cgroup", "re");
+	if (!f)
+		return 0;
+
+	/* unified hierarchy entry is "0::/path" */
+	while (!found && fgets(line, sizeof(line), f))
+		found = !strncmp(line, "0::/", 4);
+	fclose(f);
+
+	if (!found)
+		return 0;
+
+	line[strcspn(line, "\n")] = '\0';
+	if (snprintf(dir, sizeof(dir), CGROUP2_MOUNT "%s", &line[3]) >= (int)sizeof(dir))
+		return 0;
+
+	while (strlen(dir) > sizeof(CGROUP2_MOUNT) - 1) {
+		kb = cgroup2_read_limit_kb(dir, "memory.max");
+		if (kb && (!limit_kb || kb < limit_kb))
+			limit_kb = kb;
+		kb = cgroup2_read_limit_kb(dir, "memory.high");
+		if (kb && (!limit_kb || kb < limit_kb))
+			limit_kb = kb;
+
+		if (!(p = strrchr(dir, '/')))
+			break;
+		*p = '\0';
+	}
+
+	return limit_kb;
+}
+
+/*
+ * NUMA nodes and policies use raw syscalls (no libnuma dependency).
+ * Kernel node mask is read and written with the maximal supported size.
+ */
+#define NUMA_MASK_BITS 1024
+#define NUMA_LONG_BITS (8 * sizeof(unsigned long))
+
+/* Returns count of NUMA nodes process memory can use, 0 if not a NUMA system */
+int crypt_numa_nodes(unsigned *nodes, unsigned max_nodes)
+{
+#ifdef SYS_get_mempolicy
+	unsigned long mask[NUMA_MASK_BITS / NUMA_LONG_BITS] = { 0 };
+	unsigned i, count = 0;
+
+	if (syscall(SYS_get_mempolicy, NULL, mask, NUMA_MASK_BITS, NULL, MPOL_F_MEMS_ALLOWED))
+		return 0;
+
+	for (i = 0; i < NUMA_MASK_BITS && count < max_nodes; i++)
+		if (mask[i / NUMA_LONG_BITS] & (1UL << (i % NUMA_LONG_BITS)))
+			nodes[count++] = i;
+
+	return count > 1 ? (int)count : 0;
+#else
+	return 0;
+#endif
+}
+
+/* CPUs of NUMA node from sysfs cpulist ("0-7,16-23") */
+int crypt_numa_node_cpus(unsigned node, cpu_set_t *cpus)
+{
+	char path[64], buf[1024], *p;
+	unsigned long first, last;
+	FILE *f;
+	int r = -EINVAL;
+
+	CPU_ZERO(cpus);
+
+	if (snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node) >= (int)sizeof(path))
+		return -EINVAL;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -errno;
+
+	if (!fgets(buf, sizeof(buf), f))
+		goto out;
+
+	for (p = buf; *p && *p != '\n';) {
+		first = strtoul(p, &p, 10);
+		last = first;
+		if (*p == '-')
+			last = strtoul(p + 1, &p, 10);
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, cpus);
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			goto out;
+	}
+
+	r = CPU_COUNT(cpus) ? 0 : -ENOENT;
+out:
+	fclose(f);
+	return r;
+}
+
+/* Prefer node for (page aligned part of) memory range, already faulted pages are moved */
+int crypt_numa_memory_bind(void *addr, size_t len, unsigned node)
+{
+#ifdef SYS_mbind
+	unsigned long mask[NUMA_MASK_BITS / NUMA_LONG_BITS] = { 0 };
+	uintptr_t page = crypt_getpagesize(), start, end;
+
+	if (node >= NUMA_MASK_BITS)
+		return -EINVAL;
+
+	start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+	end = ((uintptr_t)addr + len) & ~(page - 1);
+	if (end <= start)
+		return 0;
+
+	mask[node / NUMA_LONG_BITS] = 1UL << (node % NUMA_LONG_BITS);
+
+	return syscall(SYS_mbind, (void *)start, end - start, MPOL_PREFERRED, mask,
+		       NUMA_MASK_BITS, MPOL_MF_MOVE) ? -errno : 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* MemAvailable from /proc/meminfo, 0 if not available */
+uint64_t crypt_getavailmemory_kb(void)
+{
+	unsigned long long value;
+	uint64_t avail_kb = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "re");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "MemAvailable: %llu kB", &value) == 1) {
+			avail_kb = value;
+			break;
+		}
+
+	fclose(f);
+	return avail_kb;
+}
+
 void crypt_process_priority(struct crypt_device *cd, int *priority, bool raise)
 {
 	int _priority, new_priority;
@@ -135,6 +318,89 @@ static int keyfile_seek(int fd, uint64_t bytes)
 	return bytes == 0 ? 0 : -1;
 }
 
+static ssize_t keyfile_pread(int fd, char *buf, size_t length, uint64_t offset)
+{
+	size_t read_size = 0;
+	ssize_t r;
+
+	while (read_size < length) {
+		r = pread(fd, buf + read_size, length - read_size, offset + read_size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return r;
+		if (!r)
+			break;
+		read_size += r;
+	}
+
+	return (ssize_t)read_size;
+}
+
+/*
+ * Read exactly key_size bytes at keyfile_offset with one positioned read
+ * into the returned buffer (no seek, no reallocation). For block devices
+ * the read is aligned to logical block size, so it can be repeated with
+ * O_DIRECT if the device refuses buffered reads.
+ */
+static int keyfile_read_direct(struct crypt_device *cd, const char *keyfile,
+			       int fd, const struct stat *st, uint64_t keyfile_offset,
+			       size_t key_size, char **key)
+{
+	size_t align = 1, pagesize = crypt_getpagesize(), head, length;
+	uint64_t start;
+	ssize_t read_size;
+	char *pass, *buf;
+	int bsize, direct_fd;
+
+	if (S_ISBLK(st->st_mode)) {
+		if (ioctl(fd, BLKSSZGET, &bsize) < 0 || bsize <= 0)
+			bsize = SECTOR_SIZE;
+		align = bsize;
+	}
+
+	start = keyfile_offset - keyfile_offset % align;
+	head = keyfile_offset - start;
+	if (key_size > SIZE_MAX - head - align - pagesize)
+		return -EINVAL;
+	length = (head + key_size + align - 1) / align * align;
+
+	pass = crypt_safe_alloc(length + pagesize);
+	if (!pass) {
+		log_err(cd, _("Out of memory while reading passphrase."));
+		return -ENOMEM;
+	}
+	buf = pass + (pagesize - (uintptr_t)pass % pagesize) % pagesize;
+
+	read_size = keyfile_pread(fd, buf, length, start);
+	if (read_size < 0 && errno == EINVAL && S_ISBLK(st->st_mode)) {
+		log_dbg(cd, "Retrying keyfile read with direct-io.");
+		direct_fd = open(keyfile, O_RDONLY | O_DIRECT);
+		if (direct_fd >= 0) {
+			read_size = keyfile_pread(direct_fd, buf, length, start);
+			close(direct_fd);
+		}
+	}
+
+	if (read_size < 0) {
+		log_err(cd, _("Error reading passphrase."));
+		crypt_safe_free(pass);
+		return -EPIPE;
+	}
+
+	if ((size_t)read_size < head + key_size) {
+		log_err(cd, _("Cannot read requested amount of data."));
+		crypt_safe_free(pass);
+		return -EINVAL;
+	}
+
+	memmove(pass, buf + head, key_size);
+	crypt_safe_memzero(pass + key_size, length + pagesize - key_size);
+
+	*key = pass;
+	return 0;
+}
+
 int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 			      char **key, size_t *key_size_read,
 			      uint64_t keyfile_offset, size_t key_size,
@@ -195,6 +461,18 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 			else if (file_read_size)
 				buflen = file_read_size;
 		}
+
+		/* Exact size without newline handling, read it at once */
+		if (!unlimited_read && !(flags & CRYPT_KEYFILE_STOP_EOL) &&
+		    (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+			r = keyfile_read_direct(cd, keyfile, fd, &st, keyfile_offset, key_size, &pass);
+			if (!r) {
+				*key = pass;
+				*key_size_read = key_size;
+			}
+			pass = NULL;
+			goto out;
+		}
 	}
 
 	pass = crypt_safe_alloc(buflen);
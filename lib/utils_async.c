@@ -0,0 +1,248 @@
+/*
+ * Asynchronous device activation
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "internal.h"
+
+/*
+ * The activation runs as one executor task. The crypt_device context is
+ * owned by the task until completion is signalled on the eventfd.
+ * Cancellation is checked on stage changes only; a running KDF or token
+ * plugin is not interrupted, but no device is created after cancel.
+ */
+enum async_method { ASYNC_PASSPHRASE, ASYNC_TOKEN };
+
+struct crypt_async {
+	struct crypt_device *cd;
+	struct crypt_thread thread;
+	int efd;
+
+	enum async_method method;
+	char *name;
+	char *type;
+	int keyslot;	/* or token */
+	char *secret;
+	size_t secret_size;
+	void *token_usrptr;
+	uint32_t flags;
+
+	void (*done)(struct crypt_async *async, int r, void *usrptr);
+	void *usrptr;
+
+	int stage;
+	bool cancel;
+	bool finished;
+	int r;
+};
+
+int crypt_async_stage(struct crypt_device *cd, int stage)
+{
+	struct crypt_async *a = cd ? *crypt_async_handle(cd) : NULL;
+
+	if (!a)
+		return 0;
+
+	__atomic_store_n(&a->stage, stage, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&a->cancel, __ATOMIC_ACQUIRE)) {
+		log_dbg(cd, "Asynchronous activation cancelled.");
+		return -ECANCELED;
+	}
+
+	return 0;
+}
+
+static void *async_activate_run(void *arg)
+{
+	struct crypt_async *a = arg;
+	uint64_t one = 1;
+	int r;
+
+	r = crypt_async_stage(a->cd, CRYPT_ASYNC_STARTED);
+	if (!r && a->method == ASYNC_PASSPHRASE)
+		r = crypt_activate_by_passphrase(a->cd, a->name, a->keyslot,
+						 a->secret, a->secret_size, a->flags);
+	else if (!r)
+		r = crypt_activate_by_token_pin(a->cd, a->name, a->type, a->keyslot,
+						a->secret, a->secret_size, a->token_usrptr, a->flags);
+
+	*crypt_async_handle(a->cd) = NULL;
+
+	crypt_safe_free(a->secret);
+	a->secret = NULL;
+
+	a->r = r;
+	__atomic_store_n(&a->stage, CRYPT_ASYNC_DONE, __ATOMIC_RELAXED);
+	__atomic_store_n(&a->finished, true, __ATOMIC_RELEASE);
+
+	if (a->done)
+		a->done(a, r, a->usrptr);
+
+	if (write(a->efd, &one, sizeof(one)) != sizeof(one))
+		log_dbg(a->cd, "Cannot signal asynchronous activation completion.");
+
+	return NULL;
+}
+
+static int async_activate(struct crypt_device *cd, enum async_method method,
+	const char *name, const char *type, int keyslot,
+	const char *secret, size_t secret_size, void *token_usrptr, uint32_t flags,
+	void (*done)(struct crypt_async *async, int r, void *usrptr), void *usrptr,
+	struct crypt_async **async)
+{
+	struct crypt_async *a;
+	int r = -ENOMEM;
+
+	if (!cd || !async || *crypt_async_handle(cd))
+		return -EINVAL;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return -ENOMEM;
+
+	a->cd = cd;
+	a->method = method;
+	a->keyslot = keyslot;
+	a->token_usrptr = token_usrptr;
+	a->flags = flags;
+	a->done = done;
+	a->usrptr = usrptr;
+	a->stage = CRYPT_ASYNC_QUEUED;
+
+	a->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (a->efd < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if (name && !(a->name = strdup(name)))
+		goto out;
+	if (type && !(a->type = strdup(type)))
+		goto out;
+	if (secret) {
+		a->secret = crypt_safe_alloc(secret_size ?: 1);
+		if (!a->secret)
+			goto out;
+		memcpy(a->secret, secret, secret_size);
+		a->secret_size = secret_size;
+	}
+
+	*crypt_async_handle(cd) = a;
+
+	/* without executor capacity it completes before return */
+	if (crypt_thread_start(&a->thread, async_activate_run, a, 0)) {
+		log_dbg(cd, "Running asynchronous activation in caller thread.");
+		async_activate_run(a);
+	}
+
+	*async = a;
+	return 0;
+out:
+	crypt_async_free(a);
+	return r;
+}
+
+int crypt_activate_by_passphrase_async(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags,
+	void (*done)(struct crypt_async *async, int r, void *usrptr),
+	void *usrptr,
+	struct crypt_async **async)
+{
+	if (!passphrase)
+		return -EINVAL;
+
+	return async_activate(cd, ASYNC_PASSPHRASE, name, NULL, keyslot,
+			      passphrase, passphrase_size, NULL, flags, done, usrptr, async);
+}
+
+int crypt_activate_by_token_pin_async(struct crypt_device *cd,
+	const char *name,
+	const char *type,
+	int token,
+	const char *pin,
+	size_t pin_size,
+	void *token_usrptr,
+	uint32_t flags,
+	void (*done)(struct crypt_async *async, int r, void *usrptr),
+	void *usrptr,
+	struct crypt_async **async)
+{
+	return async_activate(cd, ASYNC_TOKEN, name, type, token,
+			      pin, pin_size, token_usrptr, flags, done, usrptr, async);
+}
+
+int crypt_async_fd(struct crypt_async *async)
+{
+	return async ? async->efd : -EINVAL;
+}
+
+int crypt_async_result(struct crypt_async *async)
+{
+	if (!async)
+		return -EINVAL;
+
+	if (!__atomic_load_n(&async->finished, __ATOMIC_ACQUIRE))
+		return -EINPROGRESS;
+
+	return async->r;
+}
+
+int crypt_async_progress(struct crypt_async *async)
+{
+	if (!async)
+		return -EINVAL;
+
+	return __atomic_load_n(&async->stage, __ATOMIC_RELAXED);
+}
+
+int crypt_async_cancel(struct crypt_async *async)
+{
+	if (!async)
+		return -EINVAL;
+
+	if (__atomic_load_n(&async->finished, __ATOMIC_ACQUIRE))
+		return -EALREADY;
+
+	__atomic_store_n(&async->cancel, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void crypt_async_free(struct crypt_async *async)
+{
+	if (!async)
+		return;
+
+	__atomic_store_n(&async->cancel, true, __ATOMIC_RELEASE);
+	crypt_thread_join(&async->thread);
+
+	if (async->efd >= 0)
+		close(async->efd);
+	crypt_safe_free(async->secret);
+	free(async->name);
+	free(async->type);
+	free(async);
+}
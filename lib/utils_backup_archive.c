@@ -0,0 +1,613 @@
+/*
+ * Deduplicating header backup archive
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+#include "luks1/luks.h"
+#include "luks2/luks2.h"
+
+/*
+ * The archive is an append-only file of records. A backup image (the same
+ * content crypt_header_backup() writes) is split into content-defined chunks
+ * (gear rolling hash), every chunk is stored once (CHUNK record) and a backup
+ * is an ENTRY record referencing the chunks, keyed by device UUID.
+ * The latest entry for an UUID wins.
+ *
+ * Open scans record headers only; a record cut by a crash is ignored and
+ * truncated when the archive is writable. Chunks are synced before the entry
+ * is written, so an entry never references missing data.
+ *
+ * An unchanged header (same seqid and same binary header digest as the latest
+ * entry) is detected before the keyslot areas are read.
+ */
+
+#define ARC_MAGIC		"CRYPTARC"
+#define ARC_MAGIC_L		8
+#define ARC_VERSION		1
+
+#define ARC_RECORD_CHUNK	1
+#define ARC_RECORD_ENTRY	2
+
+#define ARC_DIGEST		"sha256"
+#define ARC_DIGEST_L		32
+
+#define ARC_CHUNK_MIN		(4 * 1024)
+#define ARC_CHUNK_MAX		(64 * 1024)
+#define ARC_CHUNK_MASK		((((uint64_t)1 << 14) - 1) << 50)
+
+struct arc_file_hdr {
+	char		magic[ARC_MAGIC_L];
+	uint32_t	version;
+	uint32_t	reserved;
+} __attribute__ ((packed));
+
+struct arc_record_hdr {
+	uint32_t	type;
+	uint32_t	reserved;
+	uint64_t	length;			/* payload */
+	uint8_t		digest[ARC_DIGEST_L];	/* chunk data or whole image */
+} __attribute__ ((packed));
+
+struct arc_entry_hdr {
+	char		uuid[UUID_STRING_L];
+	uint32_t	version;		/* LUKS version */
+	uint32_t	chunks;
+	uint64_t	seqid;
+	uint64_t	image_size;
+	uint8_t		hdr_digest[ARC_DIGEST_L];	/* binary header only */
+} __attribute__ ((packed));
+
+struct arc_chunk_ref {
+	uint64_t	offset;			/* chunk payload in archive */
+	uint64_t	length;
+} __attribute__ ((packed));
+
+struct arc_chunk {
+	uint8_t		digest[ARC_DIGEST_L];
+	uint64_t	offset;
+	uint64_t	length;
+};
+
+struct arc_entry {
+	char		uuid[UUID_STRING_L];
+	uint32_t	version;
+	uint32_t	chunks;
+	uint64_t	seqid;
+	uint64_t	image_size;
+	uint8_t		hdr_digest[ARC_DIGEST_L];
+	uint8_t		digest[ARC_DIGEST_L];
+	uint64_t	offset;			/* entry payload in archive */
+};
+
+struct crypt_backup_archive {
+	int fd;
+	bool readonly;
+	uint64_t size;				/* end of last complete record */
+
+	struct arc_chunk *chunks;		/* sorted by digest */
+	size_t chunks_count, chunks_alloc;
+
+	struct arc_entry *entries;		/* in archive order */
+	size_t entries_count, entries_alloc;
+
+	uint64_t gear[256];
+};
+
+static void gear_init(uint64_t *gear)
+{
+	uint64_t z, x = 0x63727970746172ULL;
+	int i;
+
+	/* splitmix64, table must be stable across versions */
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+static size_t chunk_length(const uint64_t *gear, const uint8_t *buf, size_t length)
+{
+	uint64_t h = 0;
+	size_t i;
+
+	if (length <= ARC_CHUNK_MIN)
+		return length;
+	if (length > ARC_CHUNK_MAX)
+		length = ARC_CHUNK_MAX;
+
+	for (i = ARC_CHUNK_MIN; i < length; i++) {
+		h = (h << 1) + gear[buf[i]];
+		if (!(h & ARC_CHUNK_MASK))
+			return i + 1;
+	}
+
+	return length;
+}
+
+static int digest(const void *buf, size_t length, uint8_t *out)
+{
+	struct crypt_hash *h;
+	int r;
+
+	r = crypt_hash_init(&h, ARC_DIGEST);
+	if (r < 0)
+		return r;
+
+	r = crypt_hash_write(h, buf, length);
+	if (!r)
+		r = crypt_hash_final(h, (char *)out, ARC_DIGEST_L);
+
+	crypt_hash_destroy(h);
+	return r;
+}
+
+static int arc_read_at(struct crypt_backup_archive *a, void *buf, size_t length, uint64_t offset)
+{
+	if (lseek(a->fd, offset, SEEK_SET) < 0)
+		return -EIO;
+
+	return read_buffer(a->fd, buf, length) == (ssize_t)length ? 0 : -EIO;
+}
+
+static int arc_append(struct crypt_backup_archive *a, uint32_t type, const uint8_t *rdigest,
+		      const void *buf1, size_t length1, const void *buf2, size_t length2)
+{
+	struct arc_record_hdr rhdr = {
+		.type = cpu_to_be32(type),
+		.length = cpu_to_be64(length1 + length2),
+	};
+
+	memcpy(rhdr.digest, rdigest, ARC_DIGEST_L);
+
+	if (lseek(a->fd, a->size, SEEK_SET) < 0 ||
+	    write_buffer(a->fd, &rhdr, sizeof(rhdr)) != (ssize_t)sizeof(rhdr) ||
+	    write_buffer(a->fd, buf1, length1) != (ssize_t)length1 ||
+	    (length2 && write_buffer(a->fd, buf2, length2) != (ssize_t)length2))
+		return -EIO;
+
+	a->size += sizeof(rhdr) + length1 + length2;
+	return 0;
+}
+
+static struct arc_chunk *chunk_find(struct crypt_backup_archive *a, const uint8_t *d, size_t *pos)
+{
+	size_t lo = 0, hi = a->chunks_count, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = memcmp(a->chunks[mid].digest, d, ARC_DIGEST_L);
+		if (!c)
+			return &a->chunks[mid];
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (pos)
+		*pos = lo;
+	return NULL;
+}
+
+static int chunk_add(struct crypt_backup_archive *a, const uint8_t *d, uint64_t offset, uint64_t length)
+{
+	struct arc_chunk *c;
+	size_t pos;
+
+	if (chunk_find(a, d, &pos))
+		return 0;
+
+	if (a->chunks_count == a->chunks_alloc) {
+		c = realloc(a->chunks, (a->chunks_alloc + 256) * sizeof(*c));
+		if (!c)
+			return -ENOMEM;
+		a->chunks = c;
+		a->chunks_alloc += 256;
+	}
+
+	memmove(&a->chunks[pos + 1], &a->chunks[pos], (a->chunks_count - pos) * sizeof(*c));
+	memcpy(a->chunks[pos].digest, d, ARC_DIGEST_L);
+	a->chunks[pos].offset = offset;
+	a->chunks[pos].length = length;
+	a->chunks_count++;
+
+	return 0;
+}
+
+static int entry_add(struct crypt_backup_archive *a, const struct arc_entry_hdr *ehdr,
+		     const uint8_t *d, uint64_t offset)
+{
+	struct arc_entry *e;
+
+	if (a->entries_count == a->entries_alloc) {
+		e = realloc(a->entries, (a->entries_alloc + 64) * sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+		a->entries = e;
+		a->entries_alloc += 64;
+	}
+
+	e = &a->entries[a->entries_count++];
+	memcpy(e->uuid, ehdr->uuid, UUID_STRING_L);
+	e->uuid[UUID_STRING_L - 1] = '\0';
+	e->version = be32_to_cpu(ehdr->version);
+	e->chunks = be32_to_cpu(ehdr->chunks);
+	e->seqid = be64_to_cpu(ehdr->seqid);
+	e->image_size = be64_to_cpu(ehdr->image_size);
+	memcpy(e->hdr_digest, ehdr->hdr_digest, ARC_DIGEST_L);
+	memcpy(e->digest, d, ARC_DIGEST_L);
+	e->offset = offset;
+
+	return 0;
+}
+
+static const struct arc_entry *entry_latest(struct crypt_backup_archive *a, const char *uuid)
+{
+	size_t i;
+
+	for (i = a->entries_count; i > 0; i--)
+		if (!strncmp(a->entries[i - 1].uuid, uuid, UUID_STRING_L))
+			return &a->entries[i - 1];
+
+	return NULL;
+}
+
+static int arc_scan(struct crypt_backup_archive *a, uint64_t file_size)
+{
+	struct arc_record_hdr rhdr;
+	struct arc_entry_hdr ehdr;
+	uint64_t offset = sizeof(struct arc_file_hdr), length;
+	int r;
+
+	while (offset + sizeof(rhdr) <= file_size) {
+		if (arc_read_at(a, &rhdr, sizeof(rhdr), offset))
+			return -EIO;
+
+		length = be64_to_cpu(rhdr.length);
+		if (length > file_size - offset - sizeof(rhdr))
+			break;
+
+		if (be32_to_cpu(rhdr.type) == ARC_RECORD_CHUNK) {
+			if (!length || length > ARC_CHUNK_MAX)
+				break;
+			r = chunk_add(a, rhdr.digest, offset + sizeof(rhdr), length);
+		} else if (be32_to_cpu(rhdr.type) == ARC_RECORD_ENTRY) {
+			if (length < sizeof(ehdr) ||
+			    arc_read_at(a, &ehdr, sizeof(ehdr), offset + sizeof(rhdr)))
+				break;
+			if (length != sizeof(ehdr) + (uint64_t)be32_to_cpu(ehdr.chunks) *
+				      sizeof(struct arc_chunk_ref))
+				break;
+			r = entry_add(a, &ehdr, rhdr.digest, offset + sizeof(rhdr));
+		} else
+			break;
+
+		if (r < 0)
+			return r;
+
+		offset += sizeof(rhdr) + length;
+	}
+
+	a->size = offset;
+	if (offset == file_size)
+		return 0;
+
+	log_dbg(NULL, "Backup archive has incomplete record at offset %" PRIu64 ", ignoring "
+		"%" PRIu64 " bytes.", offset, file_size - offset);
+
+	if (!a->readonly && ftruncate(a->fd, offset))
+		return -EIO;
+
+	return 0;
+}
+
+int crypt_backup_archive_open(struct crypt_backup_archive **archive, const char *path,
+			      uint32_t flags)
+{
+	struct crypt_backup_archive *a;
+	struct arc_file_hdr fhdr;
+	struct stat st;
+	int r;
+
+	if (!archive || !path)
+		return -EINVAL;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return -ENOMEM;
+
+	gear_init(a->gear);
+	a->readonly = flags & CRYPT_BACKUP_ARCHIVE_READONLY;
+	a->fd = open(path, a->readonly ? O_RDONLY : (O_RDWR | O_CREAT), S_IRUSR | S_IWUSR);
+	if (a->fd < 0) {
+		r = errno == ENOENT ? -ENOENT : -EINVAL;
+		goto out;
+	}
+
+	if (flock(a->fd, a->readonly ? LOCK_SH : LOCK_EX) || fstat(a->fd, &st)) {
+		r = -EIO;
+		goto out;
+	}
+
+	if (!st.st_size && !a->readonly) {
+		memset(&fhdr, 0, sizeof(fhdr));
+		memcpy(fhdr.magic, ARC_MAGIC, ARC_MAGIC_L);
+		fhdr.version = cpu_to_be32(ARC_VERSION);
+		if (write_buffer(a->fd, &fhdr, sizeof(fhdr)) != (ssize_t)sizeof(fhdr) ||
+		    fsync(a->fd)) {
+			r = -EIO;
+			goto out;
+		}
+		a->size = sizeof(fhdr);
+		*archive = a;
+		return 0;
+	}
+
+	if (arc_read_at(a, &fhdr, sizeof(fhdr), 0) ||
+	    memcmp(fhdr.magic, ARC_MAGIC, ARC_MAGIC_L) ||
+	    be32_to_cpu(fhdr.version) != ARC_VERSION) {
+		log_dbg(NULL, "File %s is not a header backup archive.", path);
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = arc_scan(a, st.st_size);
+	if (r < 0)
+		goto out;
+
+	log_dbg(NULL, "Backup archive %s: %zu entries, %zu chunks.", path,
+		a->entries_count, a->chunks_count);
+	*archive = a;
+	return 0;
+out:
+	crypt_backup_archive_free(a);
+	return r;
+}
+
+void crypt_backup_archive_free(struct crypt_backup_archive *archive)
+{
+	if (!archive)
+		return;
+
+	if (archive->fd >= 0)
+		close(archive->fd);
+	free(archive->chunks);
+	free(archive->entries);
+	free(archive);
+}
+
+/* LUKS1 digest covers phdr only, the rest of the first sector is wiped in backup */
+static size_t hdr_digest_length(struct crypt_device *cd)
+{
+	return !strcmp(crypt_get_type(cd), CRYPT_LUKS1) ? sizeof(struct luks_phdr) : LUKS2_HDR_BIN_LEN;
+}
+
+static int hdr_disk_digest(struct crypt_device *cd, uint8_t *d)
+{
+	struct device *device = crypt_metadata_device(cd);
+	size_t length = hdr_digest_length(cd);
+	char buf[LUKS2_HDR_BIN_LEN];
+	int devfd, r;
+
+	devfd = device_open(cd, device, O_RDONLY);
+	if (devfd < 0)
+		return devfd;
+
+	if (read_lseek_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				 buf, length, 0) != (ssize_t)length)
+		r = -EIO;
+	else
+		r = digest(buf, length, d);
+
+	crypt_safe_memzero(buf, sizeof(buf));
+	return r;
+}
+
+int crypt_backup_archive_add(struct crypt_backup_archive *archive,
+			     struct crypt_device *cd, const char *requested_type)
+{
+	struct arc_entry_hdr ehdr = {};
+	struct arc_chunk_ref *refs = NULL;
+	const struct arc_entry *e;
+	struct arc_chunk *c;
+	uint8_t d[ARC_DIGEST_L], hdr_d[ARC_DIGEST_L];
+	const char *uuid;
+	char *image = NULL;
+	size_t image_size = 0, pos, length, count = 0, stored = 0;
+	uint64_t seqid;
+	int r;
+
+	if (!archive || !cd || archive->readonly)
+		return -EINVAL;
+
+	r = crypt_header_backup_load(cd, requested_type, &seqid);
+	if (r < 0)
+		return r;
+
+	uuid = crypt_get_uuid(cd);
+	if (!uuid || strlen(uuid) >= UUID_STRING_L)
+		return -EINVAL;
+
+	e = entry_latest(archive, uuid);
+	if (e && e->seqid == seqid && !hdr_disk_digest(cd, hdr_d) &&
+	    !memcmp(e->hdr_digest, hdr_d, ARC_DIGEST_L)) {
+		log_dbg(cd, "Header of %s (seqid %" PRIu64 ") is already in backup archive.",
+			uuid, seqid);
+		return 1;
+	}
+
+	r = crypt_header_backup_image(cd, &image, &image_size);
+	if (r < 0)
+		return r;
+
+	refs = malloc((image_size / ARC_CHUNK_MIN + 1) * sizeof(*refs));
+	if (!refs) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (pos = 0; pos < image_size; pos += length) {
+		length = chunk_length(archive->gear, (const uint8_t *)image + pos, image_size - pos);
+		r = digest(image + pos, length, d);
+		if (r < 0)
+			goto out;
+
+		c = chunk_find(archive, d, NULL);
+		if (c) {
+			refs[count].offset = cpu_to_be64(c->offset);
+		} else {
+			refs[count].offset = cpu_to_be64(archive->size + sizeof(struct arc_record_hdr));
+			if (arc_append(archive, ARC_RECORD_CHUNK, d, image + pos, length, NULL, 0))
+				goto out_write;
+			r = chunk_add(archive, d, be64_to_cpu(refs[count].offset), length);
+			if (r < 0)
+				goto out;
+			stored += length;
+		}
+		refs[count++].length = cpu_to_be64(length);
+	}
+
+	/* chunks must be on disk before any entry references them */
+	if (stored && fdatasync(archive->fd))
+		goto out_write;
+
+	r = digest(image, image_size, d);
+	if (!r)
+		r = digest(image, hdr_digest_length(cd), hdr_d);
+	if (r < 0)
+		goto out;
+
+	memcpy(ehdr.uuid, uuid, strlen(uuid));
+	ehdr.version = cpu_to_be32(!strcmp(crypt_get_type(cd), CRYPT_LUKS1) ? 1 : 2);
+	ehdr.chunks = cpu_to_be32(count);
+	ehdr.seqid = cpu_to_be64(seqid);
+	ehdr.image_size = cpu_to_be64(image_size);
+	memcpy(ehdr.hdr_digest, hdr_d, ARC_DIGEST_L);
+
+	pos = archive->size + sizeof(struct arc_record_hdr);
+	if (arc_append(archive, ARC_RECORD_ENTRY, d, &ehdr, sizeof(ehdr),
+		       refs, count * sizeof(*refs)) || fdatasync(archive->fd))
+		goto out_write;
+
+	r = entry_add(archive, &ehdr, d, pos);
+	if (!r)
+		log_dbg(cd, "Stored header of %s (seqid %" PRIu64 ", %zu bytes) in backup archive, "
+			"%zu chunks, %zu new bytes.", uuid, seqid, image_size, count, stored);
+	goto out;
+out_write:
+	log_err(cd, _("Cannot write header backup archive."));
+	r = -EIO;
+out:
+	free(refs);
+	crypt_safe_memzero(image, image_size);
+	free(image);
+	return r;
+}
+
+static int arc_image(struct crypt_backup_archive *a, const struct arc_entry *e,
+		     char *image)
+{
+	struct arc_chunk_ref *refs;
+	uint64_t offset, length, pos = 0;
+	uint8_t d[ARC_DIGEST_L];
+	uint32_t i;
+	int r;
+
+	refs = malloc(e->chunks * sizeof(*refs));
+	if (!refs)
+		return -ENOMEM;
+
+	r = arc_read_at(a, refs, e->chunks * sizeof(*refs), e->offset + sizeof(struct arc_entry_hdr));
+	for (i = 0; !r && i < e->chunks; i++) {
+		offset = be64_to_cpu(refs[i].offset);
+		length = be64_to_cpu(refs[i].length);
+		if (length > ARC_CHUNK_MAX || length > e->image_size - pos ||
+		    offset > a->size || length > a->size - offset)
+			r = -EINVAL;
+		else
+			r = arc_read_at(a, image + pos, length, offset);
+		pos += length;
+	}
+
+	if (!r && pos != e->image_size)
+		r = -EINVAL;
+	if (!r)
+		r = digest(image, e->image_size, d);
+	if (!r && memcmp(d, e->digest, ARC_DIGEST_L))
+		r = -EINVAL;
+
+	free(refs);
+	return r;
+}
+
+int crypt_backup_archive_restore(struct crypt_backup_archive *archive,
+				 struct crypt_device *cd, const char *requested_type,
+				 const char *uuid)
+{
+	const struct arc_entry *e;
+	struct device *backup = NULL;
+	char *image;
+	int r;
+
+	if (!archive || !cd || !uuid)
+		return -EINVAL;
+
+	e = entry_latest(archive, uuid);
+	if (!e) {
+		log_err(cd, _("No header backup of %s in backup archive."), uuid);
+		return -ENOENT;
+	}
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	image = malloc(e->image_size);
+	if (!image)
+		return -ENOMEM;
+
+	r = arc_image(archive, e, image);
+	if (r < 0) {
+		log_err(cd, _("Header backup of %s in backup archive is corrupted."), uuid);
+		goto out;
+	}
+
+	log_dbg(cd, "Restoring header of %s (LUKS%u, seqid %" PRIu64 ") from backup archive.",
+		uuid, e->version, e->seqid);
+
+	r = device_alloc_memory(cd, &backup, image, e->image_size, e->image_size);
+	if (!r)
+		r = crypt_header_restore(cd, requested_type, device_path(backup));
+out:
+	device_free(cd, backup);
+	crypt_safe_memzero(image, e->image_size);
+	free(image);
+	return r;
+}
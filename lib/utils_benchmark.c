@@ -19,8 +19,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "internal.h"
 
@@ -40,6 +44,13 @@ int crypt_benchmark(struct crypt_device *cd,
 	if (!cipher || !cipher_mode || !volume_key_size || !encryption_mbs || !decryption_mbs)
 		return -EINVAL;
 
+	/* repeated runs in one process measure the same thing */
+	if (!crypt_cipher_cache_speed(cipher, cipher_mode, volume_key_size, buffer_size,
+				      encryption_mbs, decryption_mbs)) {
+		log_dbg(cd, "Using cached speed for cipher %s, mode %s.", cipher, cipher_mode);
+		return 0;
+	}
+
 	r = init_crypto(cd);
 	if (r < 0)
 		return r;
@@ -75,7 +86,10 @@ int crypt_benchmark(struct crypt_device *cd,
 	r = crypt_cipher_perf_kernel(cipher, cipher_mode, buffer, buffer_size, key, volume_key_size,
 				     iv, iv_size, encryption_mbs, decryption_mbs);
 
-	if (r == -ERANGE)
+	if (!r)
+		crypt_cipher_cache_speed_add(cipher, cipher_mode, volume_key_size, buffer_size,
+					     *encryption_mbs, *decryption_mbs);
+	else if (r == -ERANGE)
 		log_dbg(cd, "Measured cipher runtime is too low.");
 	else if (r)
 		log_dbg(cd, "Cannot initialize cipher %s, mode %s, key size %zu, IV size %zu.",
@@ -88,16 +102,329 @@ out:
 	return r;
 }
 
-int crypt_benchmark_pbkdf(struct crypt_device *cd,
+int crypt_benchmark_parallel(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t sector_size,
+	size_t buffer_size,
+	unsigned int threads,
+	double *encryption_mbs,
+	double *decryption_mbs)
+{
+	char *iv = NULL, *key = NULL, mode[MAX_CIPHER_LEN], *c;
+	int r, iv_size;
+
+	if (!cipher || !cipher_mode || !volume_key_size || !sector_size ||
+	    !threads || !encryption_mbs || !decryption_mbs)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	strncpy(mode, cipher_mode, sizeof(mode)-1);
+	mode[sizeof(mode)-1] = '\0';
+	/* Ignore IV generator */
+	if ((c  = strchr(mode, '-')))
+		*c = '\0';
+
+	r = -ENOMEM;
+	iv_size = crypt_cipher_ivsize(cipher, mode);
+	if (iv_size > 0) {
+		iv = malloc(iv_size);
+		if (!iv)
+			goto out;
+		crypt_random_get(cd, iv, iv_size, CRYPT_RND_NORMAL);
+	} else
+		iv_size = 0;
+
+	key = malloc(volume_key_size);
+	if (!key)
+		goto out;
+
+	crypt_random_get(cd, key, volume_key_size, CRYPT_RND_NORMAL);
+
+	r = crypt_cipher_perf_kernel_parallel(cipher, mode, buffer_size, sector_size, threads,
+					      key, volume_key_size, iv, iv_size,
+					      encryption_mbs, decryption_mbs);
+	if (r)
+		log_dbg(cd, "Cannot benchmark cipher %s, mode %s, key size %zu, sector size %zu, %u threads.",
+			cipher, mode, volume_key_size, sector_size, threads);
+out:
+	free(key);
+	free(iv);
+
+	return r;
+}
+
+/* dm-crypt data path benchmark */
+#define BENCH_DM_SIZE		(UINT64_C(1) << 30)	/* virtual, backed by dm-zero */
+#define BENCH_DM_TIME_MS	1000
+
+struct bench_dm_thread {
+	pthread_t thread;
+	int fd;
+	bool write;
+	bool random;
+	size_t block_size;
+	uint64_t *next_offset;
+	volatile bool *stop;
+	unsigned int seed;
+	uint64_t bytes;
+	int r;
+};
+
+static void *bench_dm_worker(void *arg)
+{
+	struct bench_dm_thread *t = arg;
+	uint64_t blocks = BENCH_DM_SIZE / t->block_size, offset;
+	void *buf = NULL;
+	ssize_t len;
+
+	if (posix_memalign(&buf, crypt_getpagesize(), t->block_size)) {
+		t->r = -ENOMEM;
+		return NULL;
+	}
+	memset(buf, 0, t->block_size);
+
+	while (!__atomic_load_n(t->stop, __ATOMIC_RELAXED)) {
+		if (t->random)
+			offset = ((((uint64_t)rand_r(&t->seed)) << 31) ^ rand_r(&t->seed)) % blocks;
+		else
+			offset = __atomic_fetch_add(t->next_offset, 1, __ATOMIC_RELAXED) % blocks;
+		offset *= t->block_size;
+
+		if (t->write)
+			len = pwrite(t->fd, buf, t->block_size, offset);
+		else
+			len = pread(t->fd, buf, t->block_size, offset);
+		if (len != (ssize_t)t->block_size) {
+			t->r = len < 0 ? -errno : -EIO;
+			break;
+		}
+		t->bytes += t->block_size;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int bench_dm_run(const char *path, bool write, bool random, size_t block_size,
+			unsigned int queue_depth, double *mbs)
+{
+	struct bench_dm_thread *t;
+	struct timespec start, end, wait = {
+		.tv_sec = BENCH_DM_TIME_MS / 1000,
+		.tv_nsec = (BENCH_DM_TIME_MS % 1000) * 1000000,
+	};
+	volatile bool stop = false;
+	uint64_t next_offset = 0, bytes = 0;
+	unsigned int i, started = 0;
+	double ms;
+	int fd, r = 0;
+
+	fd = open(path, (write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+	if (fd < 0)
+		return -errno;
+
+	t = calloc(queue_depth, sizeof(*t));
+	if (!t) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < queue_depth; i++) {
+		t[i].fd = fd;
+		t[i].write = write;
+		t[i].random = random;
+		t[i].block_size = block_size;
+		t[i].next_offset = &next_offset;
+		t[i].stop = &stop;
+		t[i].seed = (unsigned int)(start.tv_nsec ^ (i * 2654435761U));
+		if (pthread_create(&t[i].thread, NULL, bench_dm_worker, &t[i])) {
+			r = -ENOMEM;
+			break;
+		}
+		started++;
+	}
+
+	if (!r)
+		while (nanosleep(&wait, &wait) && errno == EINTR);
+
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	for (i = 0; i < started; i++) {
+		pthread_join(t[i].thread, NULL);
+		bytes += t[i].bytes;
+		if (!r && t[i].r)
+			r = t[i].r;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	free(t);
+	close(fd);
+
+	if (r)
+		return r;
+
+	ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+	if (ms <= 0.0)
+		return -ERANGE;
+
+	*mbs = ((double)bytes / (1024 * 1024)) / (ms / 1000.0);
+
+	return 0;
+}
+
+int crypt_benchmark_dm(struct crypt_device *cd,
+	const char *cipher,
+	size_t volume_key_size,
+	size_t sector_size,
+	uint32_t flags,
+	size_t block_size,
+	unsigned int queue_depth,
+	int random_io,
+	double *read_mbs,
+	double *write_mbs)
+{
+	static const uint32_t perf_flags = CRYPT_ACTIVATE_SAME_CPU_CRYPT |
+		CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS |
+		CRYPT_ACTIVATE_NO_READ_WORKQUEUE |
+		CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+	struct crypt_device *tmp_cd = NULL;
+	struct crypt_dm_active_device dmd_zero = {
+		.size = BENCH_DM_SIZE >> SECTOR_SHIFT,
+		.flags = CRYPT_ACTIVATE_PRIVATE,
+	}, dmd_crypt = {
+		.size = BENCH_DM_SIZE >> SECTOR_SHIFT,
+		.flags = CRYPT_ACTIVATE_PRIVATE | flags,
+	};
+	struct volume_key *vk = NULL;
+	struct device *zero_device = NULL;
+	char zero_name[64], crypt_name[64], path[PATH_MAX];
+	uint32_t dmt_flags;
+	bool zero_active = false, crypt_active = false;
+	int r;
+
+	if (!cipher || !volume_key_size || !block_size || !queue_depth ||
+	    (flags & ~perf_flags) || !read_mbs || !write_mbs)
+		return -EINVAL;
+
+	if (!sector_size)
+		sector_size = SECTOR_SIZE;
+
+	if (!cd) {
+		r = crypt_init(&tmp_cd, NULL);
+		if (r < 0)
+			return r;
+		cd = tmp_cd;
+	}
+
+	if (MISALIGNED(block_size, sector_size) || BENCH_DM_SIZE % block_size) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (getuid() || geteuid()) {
+		r = -EPERM;
+		goto out;
+	}
+
+	r = init_crypto(cd);
+	if (r < 0)
+		goto out;
+
+	if (snprintf(zero_name, sizeof(zero_name), "temporary-cryptsetup-bench-%d-zero", getpid()) < 0 ||
+	    snprintf(crypt_name, sizeof(crypt_name), "temporary-cryptsetup-bench-%d", getpid()) < 0 ||
+	    snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), zero_name) < 0) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = dm_zero_target_set(&dmd_zero.segment, 0, dmd_zero.size);
+	if (r < 0)
+		goto out;
+
+	r = dm_create_device(cd, zero_name, "TEMP", &dmd_zero);
+	if (r < 0) {
+		log_dbg(cd, "Cannot create dm-zero backing device for benchmark.");
+		goto out;
+	}
+	zero_active = true;
+
+	/* Do not let dm_create_device silently drop flags we measure. */
+	if (dm_flags(cd, DM_CRYPT, &dmt_flags) ||
+	    (flags & (CRYPT_ACTIVATE_SAME_CPU_CRYPT|CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS) &&
+	     !(dmt_flags & (DM_SAME_CPU_CRYPT_SUPPORTED|DM_SUBMIT_FROM_CRYPT_CPUS_SUPPORTED))) ||
+	    (flags & (CRYPT_ACTIVATE_NO_READ_WORKQUEUE|CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) &&
+	     !(dmt_flags & DM_CRYPT_NO_WORKQUEUE_SUPPORTED)) ||
+	    (sector_size != SECTOR_SIZE && !(dmt_flags & DM_SECTOR_SIZE_SUPPORTED))) {
+		r = -ENOTSUP;
+		goto out;
+	}
+
+	r = device_alloc(cd, &zero_device, path);
+	if (r < 0)
+		goto out;
+
+	vk = crypt_generate_volume_key(cd, volume_key_size);
+	if (!vk) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = dm_crypt_target_set(&dmd_crypt.segment, 0, dmd_crypt.size, zero_device, vk,
+				cipher, 0, 0, NULL, 0, sector_size);
+	if (r < 0)
+		goto out;
+
+	r = dm_create_device(cd, crypt_name, "TEMP", &dmd_crypt);
+	if (r < 0) {
+		log_dbg(cd, "Cannot create dm-crypt device %s for benchmark.", cipher);
+		goto out;
+	}
+	crypt_active = true;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), crypt_name) < 0) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = bench_dm_run(path, false, random_io, block_size, queue_depth, read_mbs);
+	if (!r)
+		r = bench_dm_run(path, true, random_io, block_size, queue_depth, write_mbs);
+	if (r)
+		log_dbg(cd, "Benchmark I/O on %s failed (%d).", path, r);
+out:
+	if (crypt_active)
+		dm_remove_device(cd, crypt_name, CRYPT_DEACTIVATE_FORCE);
+	if (zero_active)
+		dm_remove_device(cd, zero_name, CRYPT_DEACTIVATE_FORCE);
+	dm_targets_free(cd, &dmd_crypt);
+	dm_targets_free(cd, &dmd_zero);
+	device_free(cd, zero_device);
+	crypt_free_volume_key(vk);
+	crypt_free(tmp_cd);
+
+	return r;
+}
+
+static int benchmark_pbkdf(struct crypt_device *cd,
 	struct crypt_pbkdf_type *pbkdf,
 	const char *password,
 	size_t password_size,
 	const char *salt,
 	size_t salt_size,
 	size_t volume_key_size,
+	uint32_t hint_iterations,
+	uint32_t hint_memory,
+	unsigned int *samples,
+	double *deviation,
 	int (*progress)(uint32_t time_ms, void *usrptr),
 	void *usrptr)
 {
+	struct crypt_pbkdf_bench bench = {};
 	int r, priority;
 	const char *kdf_opt;
 
@@ -110,22 +437,81 @@ int crypt_benchmark_pbkdf(struct crypt_device *cd,
 
 	kdf_opt = !strcmp(pbkdf->type, CRYPT_KDF_PBKDF2) ? pbkdf->hash : "";
 
-	log_dbg(cd, "Running %s(%s) benchmark.", pbkdf->type, kdf_opt);
+	if (pbkdf->flags & CRYPT_PBKDF_BENCH_ROBUST) {
+		bench.samples = CRYPT_PBKDF_BENCH_SAMPLES_GET(pbkdf->flags) ?: 5;
+		bench.pin_cpu = true;
+	}
+	if (pbkdf->flags & CRYPT_PBKDF_BENCH_CPU_TIME)
+		bench.clock = CRYPT_PBKDF_BENCH_CLOCK_CPU;
+	else if (pbkdf->flags & CRYPT_PBKDF_BENCH_WALL_TIME)
+		bench.clock = CRYPT_PBKDF_BENCH_CLOCK_WALL;
+
+	log_dbg(cd, "Running %s(%s) benchmark%s.", pbkdf->type, kdf_opt,
+		bench.samples > 1 ? " (robust)" : "");
 
 	crypt_process_priority(cd, &priority, true);
-	r = crypt_pbkdf_perf(pbkdf->type, pbkdf->hash, password, password_size,
+	crypt_pbkdf_numa_interleave(pbkdf->flags & CRYPT_PBKDF_NUMA_INTERLEAVE);
+	r = crypt_pbkdf_perf_hint(pbkdf->type, pbkdf->hash, password, password_size,
 			     salt, salt_size, volume_key_size, pbkdf->time_ms,
 			     pbkdf->max_memory_kb, pbkdf->parallel_threads,
-			     &pbkdf->iterations, &pbkdf->max_memory_kb, progress, usrptr);
+			     hint_iterations, hint_memory,
+			     &pbkdf->iterations, &pbkdf->max_memory_kb, &bench,
+			     progress, usrptr);
+	crypt_pbkdf_numa_interleave(false);
 	crypt_process_priority(cd, &priority, false);
 
-	if (!r)
+	if (!r) {
 		log_dbg(cd, "Benchmark returns %s(%s) %u iterations, %u memory, %u threads (for %zu-bits key).",
 			pbkdf->type, kdf_opt, pbkdf->iterations, pbkdf->max_memory_kb,
 			pbkdf->parallel_threads, volume_key_size * 8);
+		log_dbg(cd, "Final measurement from %u samples, deviation %.1f %%.",
+			bench.samples_used, bench.deviation);
+		if (samples)
+			*samples = bench.samples_used;
+		if (deviation)
+			*deviation = bench.deviation;
+	}
 	return r;
 }
 
+int crypt_benchmark_pbkdf(struct crypt_device *cd,
+	struct crypt_pbkdf_type *pbkdf,
+	const char *password,
+	size_t password_size,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	int (*progress)(uint32_t time_ms, void *usrptr),
+	void *usrptr)
+{
+	return benchmark_pbkdf(cd, pbkdf, password, password_size, salt, salt_size,
+			       volume_key_size, 0, 0, NULL, NULL, progress, usrptr);
+}
+
+int crypt_benchmark_pbkdf_stats(struct crypt_device *cd,
+	struct crypt_pbkdf_type *pbkdf,
+	const char *password,
+	size_t password_size,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	unsigned int *samples,
+	double *deviation,
+	int (*progress)(uint32_t time_ms, void *usrptr),
+	void *usrptr)
+{
+	return benchmark_pbkdf(cd, pbkdf, password, password_size, salt, salt_size,
+			       volume_key_size, 0, 0, samples, deviation, progress, usrptr);
+}
+
+const char *crypt_get_crypto_backend_version(void)
+{
+	if (init_crypto(NULL) < 0)
+		return NULL;
+
+	return crypt_backend_version();
+}
+
 struct benchmark_usrptr {
 	struct crypt_device *cd;
 	struct crypt_pbkdf_type *pbkdf;
@@ -154,8 +540,10 @@ int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 				   size_t volume_key_size)
 {
 	struct crypt_pbkdf_limits pbkdf_limits;
+	struct crypt_pbkdf_type requested;
 	double PBKDF2_tmp;
-	uint32_t ms_tmp;
+	uint32_t ms_tmp, hint_iterations = 0, hint_memory = 0, memory_kb;
+	const char *source;
 	int r = -EINVAL;
 	struct benchmark_usrptr u = {
 		.cd = cd,
@@ -206,11 +594,30 @@ int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 			return 0;
 		}
 
-		r = crypt_benchmark_pbkdf(cd, pbkdf, "foo", 3,
+		/* Memory limit can be lower now than when PBKDF type was set */
+		memory_kb = crypt_pbkdf_memory_limit_kb(&source);
+		if (pbkdf->max_memory_kb > memory_kb) {
+			log_verbose(cd, _("PBKDF max memory decreased from %ukB to %ukB (limited by %s)."),
+				    pbkdf->max_memory_kb, memory_kb, source);
+			pbkdf->max_memory_kb = memory_kb;
+		}
+
+		/* Cached calibration needs only confirmation run */
+		requested = *pbkdf;
+		if (!crypt_pbkdf_cache_get(cd, &requested, volume_key_size,
+					   &hint_iterations, &hint_memory))
+			log_dbg(cd, "Starting PBKDF benchmark from cached %u iterations, %u memory.",
+				hint_iterations, hint_memory);
+
+		r = benchmark_pbkdf(cd, pbkdf, "foo", 3,
 			"0123456789abcdef0123456789abcdef", 32,
-			volume_key_size, &benchmark_callback, &u);
+			volume_key_size, hint_iterations, hint_memory,
+			NULL, NULL, &benchmark_callback, &u);
 		if (r < 0)
 			log_err(cd, _("Not compatible PBKDF options."));
+		else
+			crypt_pbkdf_cache_add(cd, &requested, volume_key_size,
+					      pbkdf->iterations, pbkdf->max_memory_kb);
 	}
 
 	return r;
@@ -0,0 +1,877 @@
+/*
+ * Cipher and device-mapper capability and PBKDF calibration cache
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/*
+ * Only positive results (cipher is usable) are cached, failed probes are
+ * always repeated (kernel module can be loaded later).
+ *
+ * Availability is shared between processes through a file in the locking
+ * directory (tmpfs, root only). The file is valid only for the kernel that
+ * wrote it. Measured speed is kept per process only.
+ */
+#define CIPHER_CACHE_FILE	"cipher-cache"
+#define CIPHER_CACHE_ENTRIES	64
+#define CIPHER_CACHE_LINE	(3 * MAX_CIPHER_LEN + 32)
+#define CIPHER_CACHE_KERNEL_ID	256
+
+/*
+ * PBKDF calibration (Argon2 costs found for requested time) is only a starting
+ * point for next benchmark, it is always confirmed by one measurement.
+ * Entries are keyed by CPU model and online CPU count, so one exported file
+ * can be shared between machines of different types.
+ */
+#define PBKDF_CACHE_FILE	"pbkdf-cache"
+#define PBKDF_CACHE_ENTRIES	32
+#define PBKDF_CACHE_CPU_ID	128
+#define PBKDF_CACHE_LINE	(2 * MAX_CIPHER_LEN + PBKDF_CACHE_CPU_ID + 128)
+
+/*
+ * Keyslot hints map a non-secret credential identifier (keyfile path, token id)
+ * of a device to the keyslot it opened last time. Only a hash of device UUID
+ * and credential is stored, wrong or stale hint costs one more keyslot trial.
+ */
+#define HINT_CACHE_FILE		"keyslot-hints"
+#define HINT_CACHE_ENTRIES	64
+#define HINT_CACHE_ID		65
+#define HINT_CACHE_LINE		(HINT_CACHE_ID + 32)
+
+/*
+ * Device-mapper capabilities (flags derived from dm-ioctl and target versions)
+ * are valid only until reboot and only for the same builds of loaded dm modules,
+ * a module can be unloaded and a different one loaded when no device uses it.
+ * Only targets that were found are stored.
+ */
+#define DM_CACHE_FILE		"dm-capabilities"
+#define DM_CACHE_BOOT_ID	64
+#define DM_CACHE_MODULES_ID	256
+
+struct cipher_cache_entry {
+	char cipher[MAX_CIPHER_LEN];
+	char mode[MAX_CIPHER_LEN];
+	char integrity[MAX_CIPHER_LEN];
+	size_t key_size;
+	size_t buffer_size;
+	double encryption_mbs;
+	double decryption_mbs;
+};
+
+struct pbkdf_cache_entry {
+	char cpu[PBKDF_CACHE_CPU_ID];
+	long cpus;
+	char kdf[MAX_CIPHER_LEN];
+	char hash[MAX_CIPHER_LEN];
+	uint32_t time_ms;
+	uint32_t max_memory_kb;
+	uint32_t parallel_threads;
+	size_t key_size;
+	uint32_t iterations;
+	uint32_t memory_kb;
+};
+
+struct hint_cache_entry {
+	char id[HINT_CACHE_ID];
+	int keyslot;
+};
+
+static struct cipher_cache_entry avail_cache[CIPHER_CACHE_ENTRIES];
+static struct cipher_cache_entry speed_cache[CIPHER_CACHE_ENTRIES];
+static unsigned avail_count, speed_count;
+static bool disk_loaded;
+static struct pbkdf_cache_entry pbkdf_cache[PBKDF_CACHE_ENTRIES];
+static unsigned pbkdf_count;
+static bool pbkdf_loaded;
+static struct hint_cache_entry hint_cache[HINT_CACHE_ENTRIES];
+static unsigned hint_count;
+static uint32_t dm_cache_flags, dm_cache_checked;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cache_key(struct cipher_cache_entry *e, const char *cipher, const char *mode,
+		     const char *integrity, size_t key_size, size_t buffer_size)
+{
+	memset(e, 0, sizeof(*e));
+
+	if (!cipher || !mode || strchr(cipher, ' ') || strchr(mode, ' ') ||
+	    (integrity && strchr(integrity, ' ')))
+		return -EINVAL;
+
+	if (snprintf(e->cipher, sizeof(e->cipher), "%s", cipher) >= (int)sizeof(e->cipher) ||
+	    snprintf(e->mode, sizeof(e->mode), "%s", mode) >= (int)sizeof(e->mode) ||
+	    snprintf(e->integrity, sizeof(e->integrity), "%s",
+		     integrity && *integrity ? integrity : "-") >= (int)sizeof(e->integrity))
+		return -EINVAL;
+
+	e->key_size = key_size;
+	e->buffer_size = buffer_size;
+
+	return 0;
+}
+
+static struct cipher_cache_entry *cache_find(struct cipher_cache_entry *table, unsigned count,
+					     const struct cipher_cache_entry *key)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		if (!strcmp(table[i].cipher, key->cipher) &&
+		    !strcmp(table[i].mode, key->mode) &&
+		    !strcmp(table[i].integrity, key->integrity) &&
+		    table[i].key_size == key->key_size &&
+		    table[i].buffer_size == key->buffer_size)
+			return &table[i];
+
+	return NULL;
+}
+
+static void cache_insert(struct cipher_cache_entry *table, unsigned *count,
+			 const struct cipher_cache_entry *e)
+{
+	struct cipher_cache_entry *old = cache_find(table, *count, e);
+
+	if (old)
+		*old = *e;
+	else if (*count < CIPHER_CACHE_ENTRIES)
+		table[(*count)++] = *e;
+}
+
+static bool cache_kernel_id(char *buf, size_t len)
+{
+	struct utsname un;
+
+	if (uname(&un) < 0)
+		return false;
+
+	return snprintf(buf, len, "kernel %s %s %s\n", un.release, un.version, un.machine) < (int)len;
+}
+
+static bool cache_dir_usable(void)
+{
+	struct stat st;
+
+	if (!crypt_metadata_locking_enabled())
+		return false;
+
+	/* never create the directory here, locking code owns it */
+	return !lstat(DEFAULT_LUKS2_LOCK_PATH, &st) && S_ISDIR(st.st_mode) && !st.st_uid &&
+		!(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/* do not trust file anybody else could have written */
+static FILE *cache_open(const char *name)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	if (!cache_dir_usable() ||
+	    snprintf(path, sizeof(path), "%s/%s", DEFAULT_LUKS2_LOCK_PATH, name) < 0)
+		return NULL;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		close(fd);
+		return NULL;
+	}
+
+	f = fdopen(fd, "r");
+	if (!f)
+		close(fd);
+
+	return f;
+}
+
+/* readers see either old or new complete file */
+static void cache_write(struct crypt_device *cd, const char *name, void (*write_fn)(FILE *f))
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *f;
+	int fd;
+
+	if (geteuid() || !cache_dir_usable())
+		return;
+
+	if (snprintf(path, sizeof(path), "%s/%s", DEFAULT_LUKS2_LOCK_PATH, name) < 0 ||
+	    snprintf(tmp, sizeof(tmp), "%s/.%s.%d", DEFAULT_LUKS2_LOCK_PATH, name, getpid()) < 0)
+		return;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	write_fn(f);
+
+	if (fclose(f) || rename(tmp, path)) {
+		log_dbg(cd, "Cannot update %s.", name);
+		unlink(tmp);
+	}
+}
+
+static void cache_load_disk(struct crypt_device *cd)
+{
+	char line[CIPHER_CACHE_LINE], kernel_id[CIPHER_CACHE_KERNEL_ID], file_id[CIPHER_CACHE_KERNEL_ID];
+	struct cipher_cache_entry e;
+	FILE *f;
+
+	disk_loaded = true;
+
+	if (!cache_kernel_id(kernel_id, sizeof(kernel_id)) || !(f = cache_open(CIPHER_CACHE_FILE)))
+		return;
+
+	if (!fgets(file_id, sizeof(file_id), f) || strcmp(kernel_id, file_id)) {
+		log_dbg(cd, "Ignoring cipher cache written by different kernel.");
+		fclose(f);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		memset(&e, 0, sizeof(e));
+		if (sscanf(line, "avail %" MAX_CIPHER_LEN_STR "s %" MAX_CIPHER_LEN_STR "s %"
+			   MAX_CIPHER_LEN_STR "s %zu", e.cipher, e.mode, e.integrity, &e.key_size) != 4)
+			continue;
+		cache_insert(avail_cache, &avail_count, &e);
+	}
+
+	log_dbg(cd, "Loaded %u cipher cache entries.", avail_count);
+	fclose(f);
+}
+
+static void cache_write_avail(FILE *f)
+{
+	char kernel_id[CIPHER_CACHE_KERNEL_ID];
+	unsigned i;
+
+	if (!cache_kernel_id(kernel_id, sizeof(kernel_id)))
+		return;
+
+	fputs(kernel_id, f);
+	for (i = 0; i < avail_count; i++)
+		fprintf(f, "avail %s %s %s %zu\n", avail_cache[i].cipher, avail_cache[i].mode,
+			avail_cache[i].integrity, avail_cache[i].key_size);
+}
+
+int crypt_cipher_cache_check(struct crypt_device *cd, const char *cipher, const char *mode,
+			     const char *integrity, size_t key_size)
+{
+	struct cipher_cache_entry e;
+	int r;
+
+	if (cache_key(&e, cipher, mode, integrity, key_size, 0))
+		return -ENOENT;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!disk_loaded)
+		cache_load_disk(cd);
+	r = cache_find(avail_cache, avail_count, &e) ? 0 : -ENOENT;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (!r)
+		log_dbg(cd, "Cipher %s-%s (%s, %zu bytes key) is usable (cached).",
+			cipher, mode, e.integrity, key_size);
+
+	return r;
+}
+
+void crypt_cipher_cache_add(struct crypt_device *cd, const char *cipher, const char *mode,
+			    const char *integrity, size_t key_size)
+{
+	struct cipher_cache_entry e;
+
+	if (cache_key(&e, cipher, mode, integrity, key_size, 0))
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!disk_loaded)
+		cache_load_disk(cd);
+	if (!cache_find(avail_cache, avail_count, &e)) {
+		cache_insert(avail_cache, &avail_count, &e);
+		cache_write(cd, CIPHER_CACHE_FILE, cache_write_avail);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+int crypt_cipher_cache_speed(const char *cipher, const char *mode, size_t key_size,
+			     size_t buffer_size, double *encryption_mbs, double *decryption_mbs)
+{
+	struct cipher_cache_entry e, *hit;
+	int r = -ENOENT;
+
+	if (cache_key(&e, cipher, mode, NULL, key_size, buffer_size))
+		return -ENOENT;
+
+	pthread_mutex_lock(&cache_lock);
+	hit = cache_find(speed_cache, speed_count, &e);
+	if (hit) {
+		*encryption_mbs = hit->encryption_mbs;
+		*decryption_mbs = hit->decryption_mbs;
+		r = 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return r;
+}
+
+void crypt_cipher_cache_speed_add(const char *cipher, const char *mode, size_t key_size,
+				  size_t buffer_size, double encryption_mbs, double decryption_mbs)
+{
+	struct cipher_cache_entry e;
+
+	if (cache_key(&e, cipher, mode, NULL, key_size, buffer_size))
+		return;
+
+	e.encryption_mbs = encryption_mbs;
+	e.decryption_mbs = decryption_mbs;
+
+	pthread_mutex_lock(&cache_lock);
+	cache_insert(speed_cache, &speed_count, &e);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * PBKDF calibration cache
+ */
+static void pbkdf_cpu_id(char *buf, size_t len)
+{
+	static const char *const keys[] = { "model name", "CPU part", "cpu model", "cpu" };
+	char line[256], *p;
+	struct utsname un;
+	unsigned i;
+	FILE *f;
+
+	*buf = '\0';
+
+	f = fopen("/proc/cpuinfo", "re");
+	for (i = 0; f && !*buf && i < ARRAY_SIZE(keys); i++) {
+		rewind(f);
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, keys[i], strlen(keys[i])) ||
+			    !(p = strchr(line, ':')))
+				continue;
+			p += strspn(p + 1, " \t") + 1;
+			p[strcspn(p, "\n")] = '\0';
+			if (*p)
+				snprintf(buf, len, "%s", p);
+			break;
+		}
+	}
+	if (f)
+		fclose(f);
+
+	if (!*buf && !uname(&un))
+		snprintf(buf, len, "%s", un.machine);
+
+	/* cache lines are space separated */
+	for (p = buf; *p; p++)
+		if (*p == ' ' || *p == '\t')
+			*p = '_';
+}
+
+static int pbkdf_cache_key(struct pbkdf_cache_entry *e, const struct crypt_pbkdf_type *pbkdf,
+			   size_t key_size)
+{
+	static char cpu[PBKDF_CACHE_CPU_ID];
+	const char *hash = pbkdf->hash && *pbkdf->hash ? pbkdf->hash : "-";
+
+	memset(e, 0, sizeof(*e));
+
+	if (!pbkdf->type || strchr(pbkdf->type, ' ') || strchr(hash, ' '))
+		return -EINVAL;
+
+	/* called with cache_lock held */
+	if (!*cpu)
+		pbkdf_cpu_id(cpu, sizeof(cpu));
+
+	if (snprintf(e->kdf, sizeof(e->kdf), "%s", pbkdf->type) >= (int)sizeof(e->kdf) ||
+	    snprintf(e->hash, sizeof(e->hash), "%s", hash) >= (int)sizeof(e->hash))
+		return -EINVAL;
+
+	memcpy(e->cpu, cpu, sizeof(e->cpu));
+	e->cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	e->time_ms = pbkdf->time_ms;
+	e->max_memory_kb = pbkdf->max_memory_kb;
+	e->parallel_threads = pbkdf->parallel_threads;
+	e->key_size = key_size;
+
+	return 0;
+}
+
+static struct pbkdf_cache_entry *pbkdf_cache_find(const struct pbkdf_cache_entry *key)
+{
+	unsigned i;
+
+	for (i = 0; i < pbkdf_count; i++)
+		if (!strcmp(pbkdf_cache[i].cpu, key->cpu) &&
+		    pbkdf_cache[i].cpus == key->cpus &&
+		    !strcmp(pbkdf_cache[i].kdf, key->kdf) &&
+		    !strcmp(pbkdf_cache[i].hash, key->hash) &&
+		    pbkdf_cache[i].time_ms == key->time_ms &&
+		    pbkdf_cache[i].max_memory_kb == key->max_memory_kb &&
+		    pbkdf_cache[i].parallel_threads == key->parallel_threads &&
+		    pbkdf_cache[i].key_size == key->key_size)
+			return &pbkdf_cache[i];
+
+	return NULL;
+}
+
+static bool pbkdf_cache_insert(const struct pbkdf_cache_entry *e)
+{
+	struct pbkdf_cache_entry *old = pbkdf_cache_find(e);
+
+	if (old)
+		*old = *e;
+	else if (pbkdf_count < PBKDF_CACHE_ENTRIES)
+		pbkdf_cache[pbkdf_count++] = *e;
+	else
+		return false;
+
+	return true;
+}
+
+static int pbkdf_cache_read(FILE *f)
+{
+	char line[PBKDF_CACHE_LINE];
+	struct pbkdf_cache_entry e;
+	int count = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		memset(&e, 0, sizeof(e));
+		if (sscanf(line, "pbkdf %127s %ld %" MAX_CIPHER_LEN_STR "s %" MAX_CIPHER_LEN_STR "s %"
+			   SCNu32 " %" SCNu32 " %" SCNu32 " %zu %" SCNu32 " %" SCNu32,
+			   e.cpu, &e.cpus, e.kdf, e.hash, &e.time_ms, &e.max_memory_kb,
+			   &e.parallel_threads, &e.key_size, &e.iterations, &e.memory_kb) != 10 ||
+		    !e.iterations)
+			continue;
+		if (pbkdf_cache_insert(&e))
+			count++;
+	}
+
+	return count;
+}
+
+static void pbkdf_cache_write(FILE *f)
+{
+	unsigned i;
+
+	for (i = 0; i < pbkdf_count; i++)
+		fprintf(f, "pbkdf %s %ld %s %s %" PRIu32 " %" PRIu32 " %" PRIu32 " %zu %" PRIu32 " %" PRIu32 "\n",
+			pbkdf_cache[i].cpu, pbkdf_cache[i].cpus, pbkdf_cache[i].kdf,
+			pbkdf_cache[i].hash, pbkdf_cache[i].time_ms, pbkdf_cache[i].max_memory_kb,
+			pbkdf_cache[i].parallel_threads, pbkdf_cache[i].key_size,
+			pbkdf_cache[i].iterations, pbkdf_cache[i].memory_kb);
+}
+
+static void pbkdf_cache_load_disk(struct crypt_device *cd)
+{
+	FILE *f;
+
+	pbkdf_loaded = true;
+
+	f = cache_open(PBKDF_CACHE_FILE);
+	if (!f)
+		return;
+
+	log_dbg(cd, "Loaded %d PBKDF calibration cache entries.", pbkdf_cache_read(f));
+	fclose(f);
+}
+
+int crypt_pbkdf_cache_get(struct crypt_device *cd, const struct crypt_pbkdf_type *pbkdf,
+			  size_t volume_key_size, uint32_t *iterations, uint32_t *memory_kb)
+{
+	struct pbkdf_cache_entry e, *hit;
+	int r = -ENOENT;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!pbkdf_loaded)
+		pbkdf_cache_load_disk(cd);
+
+	if (!pbkdf_cache_key(&e, pbkdf, volume_key_size) && (hit = pbkdf_cache_find(&e))) {
+		*iterations = hit->iterations;
+		*memory_kb = hit->memory_kb;
+		r = 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return r;
+}
+
+void crypt_pbkdf_cache_add(struct crypt_device *cd, const struct crypt_pbkdf_type *pbkdf,
+			   size_t volume_key_size, uint32_t iterations, uint32_t memory_kb)
+{
+	struct pbkdf_cache_entry e, *old;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!pbkdf_loaded)
+		pbkdf_cache_load_disk(cd);
+
+	if (!pbkdf_cache_key(&e, pbkdf, volume_key_size)) {
+		e.iterations = iterations;
+		e.memory_kb = memory_kb;
+		old = pbkdf_cache_find(&e);
+		if ((!old || old->iterations != iterations || old->memory_kb != memory_kb) &&
+		    pbkdf_cache_insert(&e))
+			cache_write(cd, PBKDF_CACHE_FILE, pbkdf_cache_write);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static int hint_cache_key(char *id, const char *uuid, const char *credential)
+{
+	struct crypt_hash *h;
+	char hash[32], *hex;
+	int r;
+
+	if (!uuid || !credential || crypt_hash_init(&h, "sha256"))
+		return -EINVAL;
+
+	r = crypt_hash_write(h, uuid, strlen(uuid) + 1);
+	if (!r)
+		r = crypt_hash_write(h, credential, strlen(credential));
+	if (!r)
+		r = crypt_hash_final(h, hash, sizeof(hash));
+	crypt_hash_destroy(h);
+	if (r)
+		return r;
+
+	hex = crypt_bytes_to_hex(sizeof(hash), hash);
+	if (!hex)
+		return -ENOMEM;
+
+	strcpy(id, hex);
+	free(hex);
+
+	return 0;
+}
+
+/* other processes update the file, always start from stored content */
+static void hint_cache_load_disk(void)
+{
+	char line[HINT_CACHE_LINE];
+	struct hint_cache_entry e;
+	FILE *f;
+
+	hint_count = 0;
+
+	f = cache_open(HINT_CACHE_FILE);
+	if (!f)
+		return;
+
+	while (hint_count < HINT_CACHE_ENTRIES && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "hint %64s %d", e.id, &e.keyslot) != 2 ||
+		    strlen(e.id) != HINT_CACHE_ID - 1 || e.keyslot < 0)
+			continue;
+		hint_cache[hint_count++] = e;
+	}
+
+	fclose(f);
+}
+
+static void hint_cache_write(FILE *f)
+{
+	unsigned i;
+
+	for (i = 0; i < hint_count; i++)
+		fprintf(f, "hint %s %d\n", hint_cache[i].id, hint_cache[i].keyslot);
+}
+
+static struct hint_cache_entry *hint_cache_find(const char *id)
+{
+	unsigned i;
+
+	for (i = 0; i < hint_count; i++)
+		if (!strcmp(hint_cache[i].id, id))
+			return &hint_cache[i];
+
+	return NULL;
+}
+
+int crypt_keyslot_hint_get(struct crypt_device *cd, const char *credential)
+{
+	struct hint_cache_entry *hit;
+	char id[HINT_CACHE_ID];
+	int r = -ENOENT;
+
+	if (hint_cache_key(id, crypt_get_uuid(cd), credential))
+		return -ENOENT;
+
+	pthread_mutex_lock(&cache_lock);
+	hint_cache_load_disk();
+	if ((hit = hint_cache_find(id)))
+		r = hit->keyslot;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (r >= 0)
+		log_dbg(cd, "Keyslot hint %d found.", r);
+
+	return r;
+}
+
+void crypt_keyslot_hint_set(struct crypt_device *cd, const char *credential, int keyslot)
+{
+	struct hint_cache_entry *hit;
+	char id[HINT_CACHE_ID];
+
+	if (keyslot < 0 || hint_cache_key(id, crypt_get_uuid(cd), credential))
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	hint_cache_load_disk();
+	hit = hint_cache_find(id);
+	if (!hit || hit->keyslot != keyslot) {
+		if (!hit) {
+			/* drop the oldest entry */
+			if (hint_count == HINT_CACHE_ENTRIES)
+				memmove(&hint_cache[0], &hint_cache[1], --hint_count * sizeof(*hint_cache));
+			hit = &hint_cache[hint_count++];
+			strcpy(hit->id, id);
+		}
+		hit->keyslot = keyslot;
+		log_dbg(cd, "Updating keyslot hint to %d.", keyslot);
+		cache_write(cd, HINT_CACHE_FILE, hint_cache_write);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* Libcryptsetup API */
+
+static bool dm_cache_boot_id(char *buf, size_t len)
+{
+	FILE *f;
+	bool r;
+
+	f = fopen("/proc/sys/kernel/random/boot_id", "re");
+	if (!f)
+		return false;
+
+	r = fgets(buf, len, f) && strlen(buf) > 1;
+	fclose(f);
+
+	return r;
+}
+
+static bool dm_module_attr(const char *module, const char *attr, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	bool r;
+
+	if (snprintf(path, sizeof(path), "/sys/module/%s/%s", module, attr) < 0)
+		return false;
+
+	f = fopen(path, "re");
+	if (!f)
+		return false;
+
+	r = fgets(buf, len, f) != NULL;
+	fclose(f);
+	if (r)
+		buf[strcspn(buf, "\n")] = '\0';
+
+	return r && *buf && !strchr(buf, ' ');
+}
+
+/*
+ * Build of a loadable module is identified by srcversion (if compiled in)
+ * or its size, "-" for not loaded or built-in module (changes only on reboot).
+ */
+static bool dm_cache_modules_id(char *buf, size_t len)
+{
+	static const char *const modules[] = { "dm_mod", "dm_crypt", "dm_verity", "dm_integrity" };
+	char id[64];
+	size_t pos;
+	unsigned i;
+	int n;
+
+	n = snprintf(buf, len, "modules");
+	if (n < 0 || (size_t)n >= len)
+		return false;
+	pos = n;
+
+	for (i = 0; i < ARRAY_SIZE(modules); i++) {
+		if (!dm_module_attr(modules[i], "srcversion", id, sizeof(id)) &&
+		    !dm_module_attr(modules[i], "coresize", id, sizeof(id)))
+			strcpy(id, "-");
+
+		n = snprintf(buf + pos, len - pos, " %s:%s", modules[i], id);
+		if (n < 0 || (size_t)n >= len - pos)
+			return false;
+		pos += n;
+	}
+
+	n = snprintf(buf + pos, len - pos, "\n");
+
+	return n > 0 && (size_t)n < len - pos;
+}
+
+static void dm_cache_write(FILE *f)
+{
+	char kernel_id[CIPHER_CACHE_KERNEL_ID], boot_id[DM_CACHE_BOOT_ID],
+	     modules_id[DM_CACHE_MODULES_ID];
+
+	if (!cache_kernel_id(kernel_id, sizeof(kernel_id)) ||
+	    !dm_cache_boot_id(boot_id, sizeof(boot_id)) ||
+	    !dm_cache_modules_id(modules_id, sizeof(modules_id)))
+		return;
+
+	fputs(kernel_id, f);
+	fprintf(f, "boot %s", boot_id);
+	fputs(modules_id, f);
+	fprintf(f, "dm %" PRIx32 " %" PRIx32 "\n", dm_cache_flags, dm_cache_checked);
+}
+
+int crypt_dm_cache_get(struct crypt_device *cd, uint32_t *dm_flags, uint32_t *checked)
+{
+	char kernel_id[CIPHER_CACHE_KERNEL_ID], boot_id[DM_CACHE_BOOT_ID],
+	     modules_id[DM_CACHE_MODULES_ID], file_kernel_id[CIPHER_CACHE_KERNEL_ID],
+	     file_boot_id[DM_CACHE_BOOT_ID + 8], file_modules_id[DM_CACHE_MODULES_ID];
+	FILE *f;
+	int r = -ENOENT;
+
+	if (!cache_kernel_id(kernel_id, sizeof(kernel_id)) ||
+	    !dm_cache_boot_id(boot_id, sizeof(boot_id)) ||
+	    !dm_cache_modules_id(modules_id, sizeof(modules_id)) ||
+	    !(f = cache_open(DM_CACHE_FILE)))
+		return -ENOENT;
+
+	if (!fgets(file_kernel_id, sizeof(file_kernel_id), f) || strcmp(kernel_id, file_kernel_id) ||
+	    !fgets(file_boot_id, sizeof(file_boot_id), f) || strncmp(file_boot_id, "boot ", 5) ||
+	    strcmp(boot_id, file_boot_id + 5))
+		log_dbg(cd, "Ignoring device-mapper capabilities cached before reboot.");
+	else if (!fgets(file_modules_id, sizeof(file_modules_id), f) ||
+		 strcmp(modules_id, file_modules_id))
+		log_dbg(cd, "Ignoring device-mapper capabilities cached before module reload.");
+	else if (fscanf(f, "dm %" SCNx32 " %" SCNx32, dm_flags, checked) == 2 && *checked)
+		r = 0;
+
+	fclose(f);
+
+	if (!r) {
+		pthread_mutex_lock(&cache_lock);
+		dm_cache_flags = *dm_flags;
+		dm_cache_checked = *checked;
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	return r;
+}
+
+void crypt_dm_cache_set(struct crypt_device *cd, uint32_t dm_flags, uint32_t checked)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (dm_cache_flags != dm_flags || dm_cache_checked != checked) {
+		dm_cache_flags = dm_flags;
+		dm_cache_checked = checked;
+		cache_write(cd, DM_CACHE_FILE, dm_cache_write);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+int crypt_pbkdf_cache_export(struct crypt_device *cd, const char *path)
+{
+	FILE *f;
+	int fd, r = 0;
+
+	if (!path)
+		return -EINVAL;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if (!pbkdf_loaded)
+		pbkdf_cache_load_disk(cd);
+	pbkdf_cache_write(f);
+	log_dbg(cd, "Exported %u PBKDF calibration cache entries to %s.", pbkdf_count, path);
+	pthread_mutex_unlock(&cache_lock);
+
+	if (fclose(f))
+		r = -EIO;
+
+	return r;
+}
+
+int crypt_pbkdf_cache_import(struct crypt_device *cd, const char *path)
+{
+	FILE *f;
+	int r;
+
+	if (!path)
+		return -EINVAL;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -errno;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!pbkdf_loaded)
+		pbkdf_cache_load_disk(cd);
+	r = pbkdf_cache_read(f);
+	if (r > 0)
+		cache_write(cd, PBKDF_CACHE_FILE, pbkdf_cache_write);
+	pthread_mutex_unlock(&cache_lock);
+
+	fclose(f);
+	log_dbg(cd, "Imported %d PBKDF calibration cache entries from %s.", r, path);
+
+	return r;
+}
+
+void crypt_pbkdf_cache_invalidate(struct crypt_device *cd)
+{
+	pthread_mutex_lock(&cache_lock);
+	memset(pbkdf_cache, 0, sizeof(pbkdf_cache));
+	pbkdf_count = 0;
+	pbkdf_loaded = true;
+	if (!geteuid() && cache_dir_usable())
+		(void)unlink(DEFAULT_LUKS2_LOCK_PATH "/" PBKDF_CACHE_FILE);
+	pthread_mutex_unlock(&cache_lock);
+
+	log_dbg(cd, "PBKDF calibration cache invalidated.");
+}
@@ -219,28 +219,32 @@ ssize_t crypt_hex_to_bytes(const char *hex, char **result, int safe_alloc)
 	return i;
 }
 
+/* Writes CRYPT_HEX_LEN(size) characters (no trailing \0), "-" for empty key */
+void crypt_bytes_to_hex_buffer(char *hex, size_t size, const char *bytes)
+{
+	size_t i;
+
+	if (size == 0)
+		hex[0] = '-';
+	else for (i = 0; i < size; i++) {
+		hex[i * 2]     = hex2asc((const unsigned char)bytes[i] >> 4);
+		hex[i * 2 + 1] = hex2asc((const unsigned char)bytes[i] & 0xf);
+	}
+}
+
 char *crypt_bytes_to_hex(size_t size, const char *bytes)
 {
-	unsigned i;
 	char *hex;
 
 	if (size && !bytes)
 		return NULL;
 
 	/* Alloc adds trailing \0 */
-	if (size == 0)
-		hex = crypt_safe_alloc(2);
-	else
-		hex = crypt_safe_alloc(size * 2 + 1);
+	hex = crypt_safe_alloc(CRYPT_HEX_LEN(size) + 1);
 	if (!hex)
 		return NULL;
 
-	if (size == 0)
-		hex[0] = '-';
-	else for (i = 0; i < size; i++) {
-		hex[i * 2]     = hex2asc((const unsigned char)bytes[i] >> 4);
-		hex[i * 2 + 1] = hex2asc((const unsigned char)bytes[i] & 0xf);
-	}
+	crypt_bytes_to_hex_buffer(hex, size, bytes);
 
 	return hex;
 }
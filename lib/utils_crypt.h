@@ -40,6 +40,8 @@ int crypt_parse_pbkdf(const char *s, const char **pbkdf);
 
 ssize_t crypt_hex_to_bytes(const char *hex, char **result, int safe_alloc);
 char *crypt_bytes_to_hex(size_t size, const char *bytes);
+#define CRYPT_HEX_LEN(size) ((size) ? 2 * (size) : 1)
+void crypt_bytes_to_hex_buffer(char *hex, size_t size, const char *bytes);
 void crypt_log_hex(struct crypt_device *cd,
 		   const char *bytes, size_t size,
 		   const char *sep, int numwrap, const char *wrapsep);
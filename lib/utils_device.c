@@ -22,13 +22,18 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
+#ifdef HAVE_LINUX_BLKZONED_H
+# include <linux/blkzoned.h>
+#endif
 #include <unistd.h>
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>     /* for major, minor */
@@ -44,6 +49,7 @@ struct device {
 
 	char *file_path;
 	int loop_fd;
+	int mem_fd;	/* anonymous memory backing, see device_alloc_memory() */
 
 	int ro_dev_fd;
 	int dev_fd;
@@ -53,11 +59,34 @@ struct device {
 
 	unsigned int o_direct:1;
 	unsigned int init_done:1; /* path is bdev or loop already initialized */
+	unsigned int zeroout_disabled:1; /* BLKZEROOUT failed on this device */
 
 	/* cached values */
 	size_t alignment;
 	size_t block_size;
 	size_t loop_block_size;
+
+	/* bounce buffer for not aligned I/O, kept until device is closed */
+	struct io_scratch scratch;
+
+	/* topology and queue capabilities, probed once until device is closed */
+	struct {
+		unsigned int valid:1;
+		unsigned int blk:1;
+		unsigned int topology:1;	/* BLKIOMIN supported */
+		unsigned int read_ahead_ok:1;
+		unsigned int size_ok:1;
+		dev_t rdev;
+		unsigned int min_io_size;
+		unsigned int opt_io_size;
+		int alignment_offset;
+		long read_ahead;
+		uint64_t size;
+		int rotational;
+		int discard_zeroes;
+		int zoned;		/* enum zoned_model */
+		uint64_t zone_size;	/* bytes */
+	} probe;
 };
 
 static size_t device_fs_block_size_fd(int fd)
@@ -166,6 +195,92 @@ static int device_read_test(int devfd)
 	return r;
 }
 
+/* block device topology ioctls, introduced in 2.6.32 */
+#ifndef BLKIOMIN
+#define BLKIOMIN    _IO(0x12,120)
+#define BLKIOOPT    _IO(0x12,121)
+#define BLKALIGNOFF _IO(0x12,122)
+#endif
+
+/*
+ * Query everything later needed about the device with one open fd
+ * (already opened for the direct-io read test) instead of reopening
+ * the device for every single value.
+ */
+static void device_probe_fd(struct device *device, int devfd)
+{
+	struct stat st;
+	int arg;
+#ifdef BLKGETZONESZ
+	uint32_t zone_sectors = 0;
+#endif
+
+	memset(&device->probe, 0, sizeof(device->probe));
+
+	if (fstat(devfd, &st) < 0)
+		return;
+
+	if (!device->block_size)
+		device->block_size = device_block_size_fd(devfd, NULL);
+	if (!device->alignment)
+		device->alignment = device_alignment_fd(devfd);
+
+	device->probe.valid = 1;
+
+	if (!S_ISBLK(st.st_mode))
+		return;
+
+	device->probe.blk = 1;
+	device->probe.rdev = st.st_rdev;
+
+	if (ioctl(devfd, BLKIOMIN, &device->probe.min_io_size) != -1) {
+		device->probe.topology = 1;
+		if (ioctl(devfd, BLKIOOPT, &device->probe.opt_io_size) == -1)
+			device->probe.opt_io_size = device->probe.min_io_size;
+		if (ioctl(devfd, BLKALIGNOFF, &arg) != -1)
+			device->probe.alignment_offset = arg;
+	}
+
+	if (!ioctl(devfd, BLKRAGET, &device->probe.read_ahead))
+		device->probe.read_ahead_ok = 1;
+
+	if (ioctl(devfd, BLKGETSIZE64, &device->probe.size) >= 0)
+		device->probe.size_ok = 1;
+
+	device->probe.rotational = crypt_dev_is_rotational(major(st.st_rdev), minor(st.st_rdev));
+	device->probe.discard_zeroes = crypt_dev_discard_zeroes(major(st.st_rdev), minor(st.st_rdev));
+#ifdef BLKGETZONESZ
+	if (!ioctl(devfd, BLKGETZONESZ, &zone_sectors) && zone_sectors) {
+		device->probe.zone_size = (uint64_t)zone_sectors << SECTOR_SHIFT;
+		device->probe.zoned = crypt_dev_zoned(major(st.st_rdev), minor(st.st_rdev));
+		if (device->probe.zoned == ZONED_NONE)
+			device->probe.zoned = ZONED_HOST_MANAGED;
+	}
+#endif
+}
+
+static int device_probe(struct device *device)
+{
+	int devfd;
+
+	if (device->probe.valid)
+		return 0;
+
+	devfd = open(device->path, O_RDONLY);
+	if (devfd < 0)
+		return -EINVAL;
+
+	device_probe_fd(device, devfd);
+	close(devfd);
+
+	return device->probe.valid ? 0 : -EINVAL;
+}
+
+static void device_probe_invalidate(struct device *device)
+{
+	device->probe.valid = 0;
+}
+
 /*
  * The direct-io is always preferred. The header is usually mapped to the same
  * device and can be accessed when the rest of device is mapped to data device.
@@ -174,7 +289,7 @@ static int device_read_test(int devfd)
  * The read test is needed to detect broken configurations (seen with remote
  * block devices) that allow open with direct-io but then fails on read.
  */
-static int device_ready(struct crypt_device *cd, struct device *device)
+static int device_ready(struct crypt_device *cd, struct device *device, int *ro_fd)
 {
 	int devfd = -1, r = 0;
 	struct stat st;
@@ -230,7 +345,14 @@ static int device_ready(struct crypt_device *cd, struct device *device)
 	if (tmp_size > device->block_size)
 		device->block_size = tmp_size;
 
-	close(devfd);
+	device_probe_fd(device, devfd);
+
+	/* the fd is opened exactly as device_open() would do, keep it for later reads */
+	if (ro_fd && *ro_fd < 0) {
+		log_dbg(cd, "Keeping read only fd for %s.", device_path(device));
+		*ro_fd = devfd;
+	} else
+		close(devfd);
 	return r;
 }
 
@@ -270,6 +392,7 @@ void device_sync(struct crypt_device *cd, struct device *device)
 	if (!device || device->dev_fd < 0)
 		return;
 
+	crypt_perf_add(cd, fsyncs, 1);
 	if (fsync(device->dev_fd) == -1)
 		log_dbg(cd, "Cannot sync device %s.", device_path(device));
 }
@@ -409,6 +532,7 @@ int device_alloc_no_check(struct device **device, const char *path)
 		return -ENOMEM;
 	}
 	dev->loop_fd = -1;
+	dev->mem_fd = -1;
 	dev->ro_dev_fd = -1;
 	dev->dev_fd = -1;
 	dev->dev_fd_excl = -1;
@@ -428,7 +552,7 @@ int device_alloc(struct crypt_device *cd, struct device **device, const char *pa
 		return r;
 
 	if (dev) {
-		r = device_ready(cd, dev);
+		r = device_ready(cd, dev, &dev->ro_dev_fd);
 		if (!r) {
 			dev->init_done = 1;
 		} else if (r == -ENOTBLK) {
@@ -444,6 +568,74 @@ int device_alloc(struct crypt_device *cd, struct device **device, const char *pa
 	return 0;
 }
 
+/*
+ * Memory device is a memfd opened through its /proc/self/fd path, so all
+ * path based code works unchanged. It has no page cache bypass (direct-io
+ * probe is skipped) and it is released with the device.
+ */
+int device_alloc_memory(struct crypt_device *cd, struct device **device,
+			const char *buffer, size_t buffer_size, uint64_t size)
+{
+	struct device *dev;
+	char path[64];
+	int fd, r;
+
+	if (size < buffer_size)
+		size = buffer_size;
+
+	if (MISALIGNED_512(size)) {
+		log_dbg(cd, "Memory device size %" PRIu64 " is not aligned to sector.", size);
+		return -EINVAL;
+	}
+
+#ifdef __NR_memfd_create
+	fd = syscall(__NR_memfd_create, "cryptsetup", 3U /* MFD_CLOEXEC | MFD_ALLOW_SEALING */);
+#else
+	fd = -1;
+	errno = ENOSYS;
+#endif
+	if (fd < 0) {
+		log_dbg(cd, "Cannot create memory device (%d).", -errno);
+		return -ENOTSUP;
+	}
+
+	if (ftruncate(fd, size) ||
+	    (buffer_size && write_buffer(fd, buffer, buffer_size) != (ssize_t)buffer_size)) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+#ifdef F_ADD_SEALS
+	/* write beyond the end must fail as on a block device */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_SHRINK))
+		log_dbg(cd, "Cannot seal memory device size.");
+#endif
+
+	if (snprintf(path, sizeof(path), "/proc/self/fd/%d", fd) < 0) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	r = device_alloc_no_check(&dev, path);
+	if (r < 0) {
+		close(fd);
+		return r;
+	}
+
+	dev->mem_fd = fd;
+	dev->o_direct = 0;
+
+	log_dbg(cd, "Allocated memory device %s, size %" PRIu64 ".", path, size);
+
+	*device = dev;
+	return 0;
+}
+
+int device_memory_fd(struct device *device)
+{
+	return device ? device->mem_fd : -1;
+}
+
 void device_free(struct crypt_device *cd, struct device *device)
 {
 	if (!device)
@@ -463,6 +655,9 @@ void device_free(struct crypt_device *cd, struct device *device)
 
 	assert(!device_locked(device->lh));
 
+	if (device->mem_fd != -1)
+		close(device->mem_fd);
+
 	free(device->file_path);
 	free(device->path);
 	free(device);
@@ -504,23 +699,15 @@ const char *device_path(const struct device *device)
 	return device->path;
 }
 
-/* block device topology ioctls, introduced in 2.6.32 */
-#ifndef BLKIOMIN
-#define BLKIOMIN    _IO(0x12,120)
-#define BLKIOOPT    _IO(0x12,121)
-#define BLKALIGNOFF _IO(0x12,122)
-#endif
-
 void device_topology_alignment(struct crypt_device *cd,
 			       struct device *device,
 			       unsigned long *required_alignment, /* bytes */
 			       unsigned long *alignment_offset,   /* bytes */
 			       unsigned long default_alignment)
 {
-	int dev_alignment_offset = 0;
+	int dev_alignment_offset;
 	unsigned int min_io_size = 0, opt_io_size = 0;
 	unsigned long temp_alignment = 0;
-	int fd;
 
 	*required_alignment = default_alignment;
 	*alignment_offset = 0;
@@ -528,23 +715,23 @@ void device_topology_alignment(struct crypt_device *cd,
 	if (!device || !device->path) //FIXME
 		return;
 
-	fd = open(device->path, O_RDONLY);
-	if (fd == -1)
+	if (device_probe(device))
 		return;
 
 	/* minimum io size */
-	if (ioctl(fd, BLKIOMIN, &min_io_size) == -1) {
+	if (!device->probe.topology) {
 		log_dbg(cd, "Topology info for %s not supported, using default offset %lu bytes.",
 			device->path, default_alignment);
-		goto out;
+		return;
 	}
+	min_io_size = device->probe.min_io_size;
 
 	/* optimal io size */
-	if (ioctl(fd, BLKIOOPT, &opt_io_size) == -1)
-		opt_io_size = min_io_size;
+	opt_io_size = device->probe.opt_io_size;
 
 	/* alignment offset, bogus -1 means misaligned/unknown */
-	if (ioctl(fd, BLKALIGNOFF, &dev_alignment_offset) == -1 || dev_alignment_offset < 0)
+	dev_alignment_offset = device->probe.alignment_offset;
+	if (dev_alignment_offset < 0)
 		dev_alignment_offset = 0;
 	*alignment_offset = (unsigned long)dev_alignment_offset;
 
@@ -567,8 +754,6 @@ void device_topology_alignment(struct crypt_device *cd,
 
 	log_dbg(cd, "Topology: IO (%u/%u), offset = %lu; Required alignment is %lu bytes.",
 		min_io_size, opt_io_size, *alignment_offset, *required_alignment);
-out:
-	(void)close(fd);
 }
 
 size_t device_block_size(struct crypt_device *cd, struct device *device)
@@ -634,22 +819,12 @@ size_t device_optimal_encryption_sector_size(struct crypt_device *cd, struct dev
 
 int device_read_ahead(struct device *device, uint32_t *read_ahead)
 {
-	int fd, r = 0;
-	long read_ahead_long;
-
-	if (!device)
-		return 0;
-
-	if ((fd = open(device->path, O_RDONLY)) < 0)
+	if (!device || device_probe(device) || !device->probe.read_ahead_ok)
 		return 0;
 
-	r = ioctl(fd, BLKRAGET, &read_ahead_long) ? 0 : 1;
-	close(fd);
-
-	if (r)
-		*read_ahead = (uint32_t) read_ahead_long;
+	*read_ahead = (uint32_t) device->probe.read_ahead;
 
-	return r;
+	return 1;
 }
 
 /* Get data size in bytes */
@@ -661,6 +836,12 @@ int device_size(struct device *device, uint64_t *size)
 	if (!device)
 		return -EINVAL;
 
+	/* file size can change with every write, only block device size is cached */
+	if (!device_probe(device) && device->probe.size_ok) {
+		*size = device->probe.size;
+		return 0;
+	}
+
 	devfd = open(device->path, O_RDONLY);
 	if (devfd == -1)
 		return -EINVAL;
@@ -696,6 +877,7 @@ int device_fallocate(struct device *device, uint64_t size)
 		r = 0;
 		if (device->file_path && crypt_loop_resize(device->path))
 			r = -EINVAL;
+		device_probe_invalidate(device);
 	}
 
 	close(devfd);
@@ -770,6 +952,9 @@ static int device_info(struct crypt_device *cd,
 		goto out;
 	}
 
+	if (!device->probe.valid)
+		device_probe_fd(device, fd);
+
 	r = 0;
 	if (S_ISREG(st.st_mode)) {
 		//FIXME: add readonly check
@@ -825,7 +1010,7 @@ int device_check_access(struct crypt_device *cd,
 static int device_internal_prepare(struct crypt_device *cd, struct device *device)
 {
 	char *loop_device = NULL, *file_path = NULL;
-	int r, loop_fd, readonly = 0;
+	int r, loop_fd, readonly = 0, direct_io = 1;
 
 	if (device->init_done)
 		return 0;
@@ -840,7 +1025,8 @@ static int device_internal_prepare(struct crypt_device *cd, struct device *devic
 		device->loop_block_size ?: SECTOR_SIZE);
 
 	/* Keep the loop open, detached on last close. */
-	loop_fd = crypt_loop_attach(&loop_device, device->path, 0, 1, &readonly, device->loop_block_size);
+	loop_fd = crypt_loop_attach(&loop_device, device->path, 0, 1, &readonly,
+				    device->loop_block_size, &direct_io);
 	if (loop_fd == -1) {
 		log_err(cd, _("Attaching loopback device failed "
 			"(loop device with autoclear flag is required)."));
@@ -851,15 +1037,17 @@ static int device_internal_prepare(struct crypt_device *cd, struct device *devic
 	file_path = device->path;
 	device->path = loop_device;
 
-	r = device_ready(cd, device);
+	r = device_ready(cd, device, NULL);
 	if (r < 0) {
+		device_probe_invalidate(device);
 		device->path = file_path;
 		crypt_loop_detach(loop_device);
 		free(loop_device);
 		return r;
 	}
 
-	log_dbg(cd, "Attached loop device block size is %zu bytes.", device_block_size_fd(loop_fd, NULL));
+	log_dbg(cd, "Attached loop device block size is %zu bytes, direct I/O %s.",
+		device_block_size_fd(loop_fd, NULL), direct_io ? "enabled" : "disabled");
 
 	device->loop_fd = loop_fd;
 	device->file_path = file_path;
@@ -934,6 +1122,17 @@ void device_disable_direct_io(struct device *device)
 		device->o_direct = 0;
 }
 
+void device_disable_zeroout(struct device *device)
+{
+	if (device)
+		device->zeroout_disabled = 1;
+}
+
+int device_zeroout_disabled(const struct device *device)
+{
+	return device ? device->zeroout_disabled : 1;
+}
+
 int device_direct_io(const struct device *device)
 {
 	return device ? device->o_direct : 0;
@@ -972,18 +1171,203 @@ int device_is_identical(struct device *device1, struct device *device2)
 
 int device_is_rotational(struct device *device)
 {
-	struct stat st;
+	if (!device || device_probe(device))
+		return -EINVAL;
 
-	if (!device)
+	/* file backed (loop) device */
+	if (device->file_path || !device->probe.blk)
+		return 0;
+
+	return device->probe.rotational;
+}
+
+int device_discard_zeroes(struct device *device)
+{
+	if (!device || device_probe(device))
+		return -EINVAL;
+
+	/* file backed (loop) device */
+	if (device->file_path || !device->probe.blk)
+		return 0;
+
+	return device->probe.discard_zeroes;
+}
+
+/*
+ * Returns zoned model of block device (enum zoned_model) and zone size
+ * in bytes, or negative errno.
+ */
+int device_zoned(struct device *device, uint64_t *zone_size)
+{
+	if (!device || device_probe(device))
 		return -EINVAL;
 
-	if (stat(device_path(device), &st) < 0)
+	if (zone_size)
+		*zone_size = device->probe.zone_size;
+
+	/* file backed (loop) device */
+	if (device->file_path || !device->probe.blk)
+		return ZONED_NONE;
+
+	return device->probe.zoned;
+}
+
+/* Returns 1 if device hardware can encrypt @mode inline with @data_unit_size */
+int device_inline_crypto(struct device *device, const char *mode, uint32_t data_unit_size)
+{
+	if (!device || !mode || device_probe(device))
 		return -EINVAL;
 
-	if (!S_ISBLK(st.st_mode))
+	/* file backed (loop) device */
+	if (device->file_path || !device->probe.blk)
 		return 0;
 
-	return crypt_dev_is_rotational(major(st.st_rdev), minor(st.st_rdev));
+	return crypt_dev_inline_crypto(major(device->probe.rdev), minor(device->probe.rdev),
+				       mode, data_unit_size);
+}
+
+/* RAID full stripe and flash erase block size hints (0 if unknown) */
+int device_layout_hints(struct device *device, uint64_t *stripe, uint64_t *erase_block)
+{
+	*stripe = *erase_block = 0;
+
+	if (!device || device_probe(device))
+		return -EINVAL;
+
+	/* file backed (loop) device */
+	if (device->file_path || !device->probe.blk)
+		return -ENOTBLK;
+
+	*stripe = crypt_dev_md_stripe(major(device->probe.rdev), minor(device->probe.rdev));
+	if (!device->probe.rotational)
+		*erase_block = crypt_dev_discard_granularity(major(device->probe.rdev),
+							     minor(device->probe.rdev));
+
+	return 0;
+}
+
+static int device_zone_fd(struct crypt_device *cd, struct device *device, int flags)
+{
+	if (device_is_locked(device))
+		return device_open_locked(cd, device, flags);
+	return device_open(cd, device, flags);
+}
+
+/* Report zone containing device offset (all values in bytes) */
+int device_zone_report(struct crypt_device *cd, struct device *device, uint64_t offset,
+		       uint64_t *zone_start, uint64_t *zone_length, uint64_t *write_pointer,
+		       bool *conventional)
+{
+#ifdef BLKREPORTZONE
+	struct {
+		struct blk_zone_report rep;
+		struct blk_zone zone;
+	} report = {
+		.rep.sector = offset >> SECTOR_SHIFT,
+		.rep.nr_zones = 1,
+	};
+	int devfd;
+
+	if (device_zoned(device, NULL) <= 0)
+		return -ENOTSUP;
+
+	devfd = device_zone_fd(cd, device, O_RDONLY);
+	if (devfd < 0)
+		return devfd;
+
+	if (ioctl(devfd, BLKREPORTZONE, &report) < 0) {
+		log_dbg(cd, "BLKREPORTZONE ioctl failed (error %i) on %s.", -errno, device_path(device));
+		return -EINVAL;
+	}
+
+	if (!report.rep.nr_zones)
+		return -EINVAL;
+
+	if (zone_start)
+		*zone_start = report.zone.start << SECTOR_SHIFT;
+	if (zone_length)
+		*zone_length = report.zone.len << SECTOR_SHIFT;
+	if (write_pointer)
+		*write_pointer = report.zone.wp << SECTOR_SHIFT;
+	if (conventional)
+		*conventional = report.zone.type == BLK_ZONE_TYPE_CONVENTIONAL;
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/*
+ * Reset write pointer of all zones in area (zones read as empty afterwards).
+ * Area must start on zone boundary and end on zone boundary or device end
+ * (-EINVAL), conventional zones cannot be reset (-ENOTSUP). Only -EIO means
+ * that some zones could be reset.
+ */
+int device_zone_reset(struct crypt_device *cd, struct device *device,
+		      uint64_t offset, uint64_t length)
+{
+#ifdef BLKRESETZONE
+	struct blk_zone_range range;
+	uint64_t zone_size, zone_start, zone_length, end, size;
+	bool conventional;
+	int devfd, r;
+
+	if (device_zoned(device, &zone_size) <= 0 || !zone_size)
+		return -ENOTSUP;
+
+	r = device_size(device, &size);
+	if (r)
+		return r;
+
+	end = offset + length;
+	if (!length || end > size || offset % zone_size || (end % zone_size && end != size))
+		return -EINVAL;
+
+	for (zone_start = offset; zone_start < end; zone_start += zone_length) {
+		r = device_zone_report(cd, device, zone_start, NULL, &zone_length, NULL, &conventional);
+		if (r)
+			return r;
+		if (conventional || !zone_length) {
+			log_dbg(cd, "Zone at offset %" PRIu64 " on %s cannot be reset.", zone_start, device_path(device));
+			return -ENOTSUP;
+		}
+	}
+
+	devfd = device_zone_fd(cd, device, O_RDWR);
+	if (devfd < 0)
+		return devfd;
+
+	range.sector = offset >> SECTOR_SHIFT;
+	range.nr_sectors = length >> SECTOR_SHIFT;
+
+	if (ioctl(devfd, BLKRESETZONE, &range) < 0) {
+		log_dbg(cd, "BLKRESETZONE ioctl failed (error %i) on %s.", -errno, device_path(device));
+		return -EIO;
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int device_queue_info(struct device *device, int *rotational, int *nvme, uint64_t *nr_requests)
+{
+	if (!device || !rotational || !nvme || !nr_requests)
+		return -EINVAL;
+
+	if (device_probe(device))
+		return -EINVAL;
+
+	if (device->file_path || !device->probe.blk)
+		return -ENOTBLK;
+
+	*rotational = device->probe.rotational;
+	*nvme = crypt_dev_is_nvme(major(device->probe.rdev), minor(device->probe.rdev));
+	*nr_requests = crypt_dev_nr_requests(major(device->probe.rdev), minor(device->probe.rdev));
+
+	return 0;
 }
 
 size_t device_alignment(struct device *device)
@@ -1015,25 +1399,58 @@ struct crypt_lock_handle *device_get_lock_handle(struct device *device)
 	return device ? device->lh : NULL;
 }
 
+/*
+ * Cached fds may have been opened before the lock was taken (and the path
+ * could point to another device or file since), so they are verified
+ * against the new lock and dropped (reopened later) if they do not match.
+ */
+static void device_verify_cached_fds(struct crypt_device *cd, struct device *device)
+{
+	if (device->ro_dev_fd >= 0 && device_locked_verify(cd, device->ro_dev_fd, device->lh)) {
+		log_dbg(cd, "Cached read only fd for %s does not match the lock.", device_path(device));
+		close(device->ro_dev_fd);
+		device->ro_dev_fd = -1;
+	}
+
+	if (device->dev_fd >= 0 && device_locked_verify(cd, device->dev_fd, device->lh)) {
+		log_dbg(cd, "Cached read write fd for %s does not match the lock.", device_path(device));
+		close(device->dev_fd);
+		device->dev_fd = -1;
+	}
+}
+
 int device_read_lock(struct crypt_device *cd, struct device *device)
 {
+	bool locked;
+
 	if (!device || !crypt_metadata_locking_enabled())
 		return 0;
 
+	locked = device_locked(device->lh);
+
 	if (device_read_lock_internal(cd, device))
 		return -EBUSY;
 
+	if (!locked)
+		device_verify_cached_fds(cd, device);
+
 	return 0;
 }
 
 int device_write_lock(struct crypt_device *cd, struct device *device)
 {
+	int r;
+
 	if (!device || !crypt_metadata_locking_enabled())
 		return 0;
 
 	assert(!device_locked(device->lh) || !device_locked_readonly(device->lh));
 
-	return device_write_lock_internal(cd, device);
+	r = device_write_lock_internal(cd, device);
+	if (r == 1)
+		device_verify_cached_fds(cd, device);
+
+	return r;
 }
 
 void device_read_unlock(struct crypt_device *cd, struct device *device)
@@ -1079,6 +1496,30 @@ void device_close(struct crypt_device *cd, struct device *device)
 			log_dbg(cd, "Failed to close read write fd for %s.", device_path(device));
 		device->dev_fd = -1;
 	}
+
+	io_scratch_free(&device->scratch);
+	device_probe_invalidate(device);
+}
+
+/* Blockwise I/O at absolute offset, partial blocks use per-device scratch buffer */
+ssize_t device_write_at(struct crypt_device *cd, struct device *device, int devfd,
+			const void *buf, size_t length, off_t offset)
+{
+	if (!device)
+		return -1;
+
+	return pwrite_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+				&device->scratch, buf, length, offset);
+}
+
+ssize_t device_read_at(struct crypt_device *cd, struct device *device, int devfd,
+		       void *buf, size_t length, off_t offset)
+{
+	if (!device)
+		return -1;
+
+	return pread_blockwise(devfd, device_block_size(cd, device), device_alignment(device),
+			       &device->scratch, buf, length, offset);
 }
 
 void device_set_block_size(struct device *device, size_t size)
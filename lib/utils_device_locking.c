@@ -20,6 +20,8 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <linux/limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +35,7 @@
 #endif
 #include <libgen.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "internal.h"
 #include "utils_device_locking.h"
@@ -52,6 +55,21 @@ enum lock_mode {
 	DEV_LOCK_NAME
 };
 
+/*
+ * Read lock of a block device shared by all contexts in the process,
+ * the flock is held (and the resource file kept open) until the last
+ * context holding it unlocks.
+ */
+struct shared_lock {
+	struct shared_lock *next;
+	dev_t devno;
+	int flock_fd;
+	unsigned users;
+};
+
+static pthread_mutex_t shared_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct shared_lock *shared_locks = NULL;
+
 struct crypt_lock_handle {
 	unsigned refcnt;
 	int flock_fd;
@@ -65,6 +83,10 @@ struct crypt_lock_handle {
 		char *name;
 	} name;
 	} u;
+	struct shared_lock *shared;
+	/* LUKS2 seqid known to be on disk since this write lock was taken */
+	bool seqid_valid;
+	uint64_t seqid;
 };
 
 static int resource_by_name(char *res, size_t res_size, const char *name, bool fullpath)
@@ -305,7 +327,7 @@ static int acquire_and_verify(struct crypt_device *cd, struct device *device, co
 	if (device && resource)
 		return -EINVAL;
 
-	if (!(h = malloc(sizeof(*h))))
+	if (!(h = calloc(1, sizeof(*h))))
 		return -ENOMEM;
 
 	do {
@@ -345,6 +367,89 @@ static int acquire_and_verify(struct crypt_device *cd, struct device *device, co
 	return 0;
 }
 
+/* Reuse read lock already held by another context (no lock file open or flock) */
+static struct crypt_lock_handle *shared_lock_get(struct crypt_device *cd, struct device *device)
+{
+	struct crypt_lock_handle *h = NULL;
+	struct shared_lock *sl;
+	struct stat st;
+
+	if (stat(device_path(device), &st) || !S_ISBLK(st.st_mode))
+		return NULL;
+
+	if (pthread_mutex_lock(&shared_locks_mutex))
+		return NULL;
+
+	for (sl = shared_locks; sl; sl = sl->next)
+		if (sl->devno == st.st_rdev)
+			break;
+
+	if (sl && (h = calloc(1, sizeof(*h)))) {
+		sl->users++;
+		h->flock_fd = sl->flock_fd;
+		h->mode = DEV_LOCK_BDEV;
+		h->u.bdev.devno = sl->devno;
+		h->shared = sl;
+		log_dbg(cd, "Sharing READ lock for device %s (%u users).", device_path(device), sl->users);
+	}
+
+	pthread_mutex_unlock(&shared_locks_mutex);
+	return h;
+}
+
+static void shared_lock_add(struct crypt_lock_handle *h)
+{
+	struct shared_lock *sl;
+
+	if (h->mode != DEV_LOCK_BDEV || !(sl = malloc(sizeof(*sl))))
+		return;
+
+	if (pthread_mutex_lock(&shared_locks_mutex)) {
+		free(sl);
+		return;
+	}
+
+	/* another context acquired its own lock meanwhile, keep this one private */
+	for (sl->next = shared_locks; sl->next; sl->next = sl->next->next)
+		if (sl->next->devno == h->u.bdev.devno)
+			break;
+
+	if (sl->next)
+		free(sl);
+	else {
+		sl->devno = h->u.bdev.devno;
+		sl->flock_fd = h->flock_fd;
+		sl->users = 1;
+		sl->next = shared_locks;
+		shared_locks = sl;
+		h->shared = sl;
+	}
+
+	pthread_mutex_unlock(&shared_locks_mutex);
+}
+
+/* Returns true if the shared lock is still held by another context */
+static bool shared_lock_put(struct shared_lock *sl)
+{
+	struct shared_lock **p;
+	bool used;
+
+	if (pthread_mutex_lock(&shared_locks_mutex))
+		return true; /* leak rather than release lock in use */
+
+	used = --sl->users > 0;
+	if (!used) {
+		for (p = &shared_locks; *p && *p != sl; p = &(*p)->next)
+			;
+		if (*p)
+			*p = sl->next;
+		free(sl);
+	}
+
+	pthread_mutex_unlock(&shared_locks_mutex);
+	return used;
+}
+
 int device_read_lock_internal(struct crypt_device *cd, struct device *device)
 {
 	int r;
@@ -363,9 +468,13 @@ int device_read_lock_internal(struct crypt_device *cd, struct device *device)
 
 	log_dbg(cd, "Acquiring read lock for device %s.", device_path(device));
 
-	r = acquire_and_verify(cd, device, NULL, LOCK_SH, &h);
-	if (r < 0)
-		return r;
+	h = shared_lock_get(cd, device);
+	if (!h) {
+		r = acquire_and_verify(cd, device, NULL, LOCK_SH, &h);
+		if (r < 0)
+			return r;
+		shared_lock_add(h);
+	}
 
 	h->type = DEV_LOCK_READ;
 	h->refcnt = 1;
@@ -406,6 +515,33 @@ int device_write_lock_internal(struct crypt_device *cd, struct device *device)
 	return 1;
 }
 
+void device_write_lock_seqid_set(struct device *device, uint64_t seqid)
+{
+	struct crypt_lock_handle *h = device_get_lock_handle(device);
+
+	if (!device_locked(h) || device_locked_readonly(h))
+		return;
+
+	h->seqid = seqid;
+	h->seqid_valid = true;
+}
+
+void device_write_lock_seqid_invalidate(struct device *device)
+{
+	struct crypt_lock_handle *h = device_get_lock_handle(device);
+
+	if (h)
+		h->seqid_valid = false;
+}
+
+bool device_write_lock_seqid_valid(struct device *device, uint64_t seqid)
+{
+	struct crypt_lock_handle *h = device_get_lock_handle(device);
+
+	return device_locked(h) && !device_locked_readonly(h) &&
+	       h->seqid_valid && h->seqid == seqid;
+}
+
 int crypt_read_lock(struct crypt_device *cd, const char *resource, bool blocking, struct crypt_lock_handle **lock)
 {
 	int r;
@@ -456,6 +592,12 @@ int crypt_write_lock(struct crypt_device *cd, const char *resource, bool blockin
 
 static void unlock_internal(struct crypt_device *cd, struct crypt_lock_handle *h)
 {
+	if (h->shared && shared_lock_put(h->shared)) {
+		log_dbg(cd, "Shared READ lock still used by another context.");
+		free(h);
+		return;
+	}
+
 	if (flock(h->flock_fd, LOCK_UN))
 		log_dbg(cd, "flock on fd %d failed.", h->flock_fd);
 	release_lock_handle(cd, h);
@@ -495,6 +637,161 @@ void device_unlock_internal(struct crypt_device *cd, struct device *device)
 	device_set_lock_handle(device, NULL);
 }
 
+/*
+ * KDF memory admission control.
+ *
+ * Resource file has a table of records with memory cost of running KDF.
+ * Admitted KDF keeps OFD write lock on its record, so the record is released
+ * by kernel also if the process dies. Table scan and update are serialized
+ * by flock() on the whole file (independent of OFD locks).
+ * The sum of admitted memory costs is limited by half of physical memory
+ * (the same as for a single PBKDF), a KDF is always admitted if nothing runs.
+ */
+#define KDF_MEMORY_RESOURCE "kdf-memory"
+#define KDF_MEMORY_SLOTS    256
+#define KDF_MEMORY_MIN_KB   (32 * 1024)
+#define KDF_MEMORY_WAIT_US  (50 * 1000)
+
+struct crypt_kdf_memory_handle {
+	int fd;
+	unsigned slot;
+};
+
+static int kdf_memory_slot_lock(int fd, unsigned slot, int cmd, short *type)
+{
+	struct flock fl = {
+		.l_type = *type,
+		.l_whence = SEEK_SET,
+		.l_start = (off_t)slot * sizeof(uint64_t),
+		.l_len = sizeof(uint64_t),
+	};
+
+	if (fcntl(fd, cmd, &fl) < 0)
+		return -errno;
+
+	*type = fl.l_type;
+	return 0;
+}
+
+static int kdf_memory_scan(int fd, uint64_t *used_kb, int *free_slot)
+{
+	uint64_t kb;
+	unsigned i;
+	short type;
+	int r;
+
+	*used_kb = 0;
+	*free_slot = -1;
+
+	for (i = 0; i < KDF_MEMORY_SLOTS; i++) {
+		type = F_WRLCK;
+		r = kdf_memory_slot_lock(fd, i, F_OFD_GETLK, &type);
+		if (r < 0)
+			return r;
+
+		if (type == F_UNLCK) {
+			if (*free_slot < 0)
+				*free_slot = (int)i;
+			continue;
+		}
+
+		if (pread(fd, &kb, sizeof(kb), (off_t)i * sizeof(kb)) == (ssize_t)sizeof(kb))
+			*used_kb += kb;
+	}
+
+	return 0;
+}
+
+int crypt_kdf_memory_acquire(struct crypt_device *cd, uint32_t memory_kb,
+			     struct crypt_kdf_memory_handle **h)
+{
+	uint64_t budget_kb, used_kb, kb = memory_kb;
+	bool admitted = false, waiting = false;
+	int fd, free_slot, r;
+	short type;
+
+	*h = NULL;
+
+	if (memory_kb <= KDF_MEMORY_MIN_KB || !crypt_metadata_locking_enabled())
+		return 0;
+
+	/* Ignore bogus value */
+	budget_kb = crypt_getphysmemory_kb();
+	if (budget_kb < (128 * 1024))
+		return 0;
+	budget_kb /= 2;
+
+	/* Admission control is optional (needs locking directory access) */
+	fd = open_resource(cd, KDF_MEMORY_RESOURCE);
+	if (fd < 0) {
+		log_dbg(cd, "KDF memory admission control not available.");
+		return 0;
+	}
+
+	do {
+		if (flock(fd, LOCK_EX)) {
+			r = -errno;
+			break;
+		}
+
+		r = kdf_memory_scan(fd, &used_kb, &free_slot);
+		if (!r && free_slot >= 0 && (!used_kb || used_kb + kb <= budget_kb)) {
+			type = F_WRLCK;
+			if (pwrite(fd, &kb, sizeof(kb), (off_t)free_slot * sizeof(kb)) != (ssize_t)sizeof(kb))
+				r = -EIO;
+			else
+				r = kdf_memory_slot_lock(fd, (unsigned)free_slot, F_OFD_SETLK, &type);
+			admitted = !r;
+		}
+
+		if (flock(fd, LOCK_UN))
+			log_dbg(cd, "flock on fd %d failed.", fd);
+
+		if (r < 0 || admitted)
+			break;
+
+		if (!waiting) {
+			log_dbg(cd, "Waiting for KDF memory (%u kB needed, %" PRIu64 " of %" PRIu64 " kB in use).",
+				memory_kb, used_kb, budget_kb);
+			waiting = true;
+		}
+		usleep(KDF_MEMORY_WAIT_US);
+	} while (1);
+
+	if (!admitted) {
+		log_dbg(cd, "KDF memory admission control failed (%d).", r);
+		close(fd);
+		return 0;
+	}
+
+	*h = malloc(sizeof(**h));
+	if (!*h) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	(*h)->fd = fd;
+	(*h)->slot = (unsigned)free_slot;
+	log_dbg(cd, "KDF memory %u kB admitted (slot %d).", memory_kb, free_slot);
+
+	return 0;
+}
+
+void crypt_kdf_memory_release(struct crypt_device *cd, struct crypt_kdf_memory_handle *h)
+{
+	short type = F_UNLCK;
+
+	if (!h)
+		return;
+
+	/* closing the last fd of OFD releases it anyway */
+	if (kdf_memory_slot_lock(h->fd, h->slot, F_OFD_SETLK, &type))
+		log_dbg(cd, "Failed to release KDF memory slot %u.", h->slot);
+
+	close(h->fd);
+	free(h);
+}
+
 int device_locked_verify(struct crypt_device *cd, int dev_fd, struct crypt_lock_handle *h)
 {
 	char res[PATH_MAX];
@@ -23,6 +23,7 @@
 #define _CRYPTSETUP_UTILS_LOCKING_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct crypt_device;
 struct crypt_lock_handle;
@@ -41,6 +42,12 @@ int crypt_read_lock(struct crypt_device *cd, const char *name, bool blocking, st
 int crypt_write_lock(struct crypt_device *cd, const char *name, bool blocking, struct crypt_lock_handle **lock);
 void crypt_unlock_internal(struct crypt_device *cd, struct crypt_lock_handle *h);
 
+/* Cross-process admission of memory-hard KDF (waits until memory is available) */
+struct crypt_kdf_memory_handle;
+int crypt_kdf_memory_acquire(struct crypt_device *cd, uint32_t memory_kb,
+			     struct crypt_kdf_memory_handle **h);
+void crypt_kdf_memory_release(struct crypt_device *cd, struct crypt_kdf_memory_handle *h);
+
 
 /* Used only in device internal allocation */
 void device_set_lock_handle(struct device *device, struct crypt_lock_handle *h);
@@ -28,6 +28,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #ifdef HAVE_SYS_SYSMACROS_H
@@ -35,6 +36,152 @@
 #endif
 #include "internal.h"
 
+#define DEVPATH_NAME_LEN 128
+
+/*
+ * Index of block devices built from one pass over /sys/dev/block.
+ * Entries may be stale; every hit is verified and a miss rebuilds the index.
+ */
+struct devpath_entry {
+	dev_t devno;
+	char name[DEVPATH_NAME_LEN];	/* kernel name */
+	char dm_name[DEVPATH_NAME_LEN];	/* only DM devices */
+	char dm_uuid[DM_UUID_LEN];	/* only DM devices */
+};
+
+static struct {
+	struct devpath_entry *entries;
+	size_t count;
+	bool valid;
+} devpath_index;
+
+static pthread_mutex_t devpath_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void devpath_read_attr(int dirfd, const char *dev_id, const char *attr, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t r;
+	int fd;
+
+	buf[0] = '\0';
+
+	if (snprintf(path, sizeof(path), "%s/%s", dev_id, attr) < 0)
+		return;
+
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	r = read_buffer(fd, buf, len - 1);
+	close(fd);
+
+	if (r <= 0)
+		r = 0;
+	buf[r] = '\0';
+	if (r && buf[r - 1] == '\n')
+		buf[r - 1] = '\0';
+}
+
+static int devpath_entry_cmp(const void *a, const void *b)
+{
+	const struct devpath_entry *e1 = a, *e2 = b;
+
+	return e1->devno < e2->devno ? -1 : e1->devno > e2->devno ? 1 : 0;
+}
+
+/* Must be called with devpath_index_lock held */
+static int devpath_index_build(void)
+{
+	struct devpath_entry *entries = NULL, *tmp, *e;
+	size_t count = 0, alloc = 0;
+	char link[PATH_MAX], *name;
+	struct dirent *entry;
+	unsigned maj, min;
+	ssize_t len;
+	DIR *dir;
+
+	dir = opendir("/sys/dev/block");
+	if (!dir)
+		return -ENOENT;
+
+	while ((entry = readdir(dir))) {
+		if (sscanf(entry->d_name, "%u:%u", &maj, &min) != 2)
+			continue;
+
+		len = readlinkat(dirfd(dir), entry->d_name, link, sizeof(link) - 1);
+		if (len < 0)
+			continue;
+		link[len] = '\0';
+		name = strrchr(link, '/');
+		name = name ? name + 1 : link;
+		if (strlen(name) >= DEVPATH_NAME_LEN)
+			continue;
+
+		if (count == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			tmp = realloc(entries, alloc * sizeof(*entries));
+			if (!tmp) {
+				closedir(dir);
+				free(entries);
+				return -ENOMEM;
+			}
+			entries = tmp;
+		}
+
+		e = &entries[count++];
+		e->devno = makedev(maj, min);
+		strcpy(e->name, name);
+		if (dm_is_dm_kernel_name(name)) {
+			devpath_read_attr(dirfd(dir), entry->d_name, "dm/name", e->dm_name, sizeof(e->dm_name));
+			devpath_read_attr(dirfd(dir), entry->d_name, "dm/uuid", e->dm_uuid, sizeof(e->dm_uuid));
+		} else {
+			e->dm_name[0] = '\0';
+			e->dm_uuid[0] = '\0';
+		}
+	}
+	closedir(dir);
+
+	if (count)
+		qsort(entries, count, sizeof(*entries), devpath_entry_cmp);
+
+	free(devpath_index.entries);
+	devpath_index.entries = entries;
+	devpath_index.count = count;
+	devpath_index.valid = true;
+
+	return 0;
+}
+
+/* Must be called with devpath_index_lock held */
+static int devpath_index_get(bool refresh)
+{
+	if (refresh || !devpath_index.valid)
+		return devpath_index_build();
+
+	return 0;
+}
+
+static struct devpath_entry *devpath_index_find(dev_t devno)
+{
+	struct devpath_entry key = { .devno = devno };
+
+	if (!devpath_index.count)
+		return NULL;
+
+	return bsearch(&key, devpath_index.entries, devpath_index.count,
+		       sizeof(key), devpath_entry_cmp);
+}
+
+void crypt_devpath_index_drop(void)
+{
+	pthread_mutex_lock(&devpath_index_lock);
+	free(devpath_index.entries);
+	devpath_index.entries = NULL;
+	devpath_index.count = 0;
+	devpath_index.valid = false;
+	pthread_mutex_unlock(&devpath_index_lock);
+}
+
 static char *__lookup_dev(char *path, dev_t dev, int dir_level, const int max_level)
 {
 	struct dirent *entry;
@@ -99,9 +246,20 @@ static char *__lookup_dev(char *path, dev_t dev, int dir_level, const int max_le
 static char *lookup_dev_old(int major, int minor)
 {
 	dev_t dev;
+	struct stat st;
 	char *result = NULL, buf[PATH_MAX + 1];
 
 	dev = makedev(major, minor);
+
+	/* udev (and devtmpfs) maintained major:minor links */
+	if (snprintf(buf, sizeof(buf), "/dev/block/%d:%d", major, minor) > 0 &&
+	    (result = realpath(buf, NULL))) {
+		if (!stat(result, &st) && S_ISBLK(st.st_mode) && st.st_rdev == dev)
+			return result;
+		free(result);
+		result = NULL;
+	}
+
 	strncpy(buf, "/dev", PATH_MAX);
 	buf[PATH_MAX] = '\0';
 
@@ -120,53 +278,72 @@ static char *lookup_dev_old(int major, int minor)
 	return  __lookup_dev(buf, dev, 0, 4);
 }
 
+static char *devpath_entry_path(const struct devpath_entry *e)
+{
+	char path[PATH_MAX];
+
+	if (dm_is_dm_kernel_name(e->name)) {
+		if (!e->dm_name[0])
+			return dm_device_path("/dev/mapper/", major(e->devno), minor(e->devno));
+		if (snprintf(path, sizeof(path), "/dev/mapper/%s", e->dm_name) < 0)
+			return NULL;
+	} else if (snprintf(path, sizeof(path), "/dev/%s", e->name) < 0)
+		return NULL;
+
+	return strdup(path);
+}
+
 /*
  * Returns string pointing to device in /dev according to "major:minor" dev_id
  */
 char *crypt_lookup_dev(const char *dev_id)
 {
-	int major, minor;
-	char link[PATH_MAX], path[PATH_MAX], *devname, *devpath = NULL;
+	struct devpath_entry *e, tmp;
+	int major, minor, i, r;
+	bool fresh, found, mismatch = false;
+	char *devpath;
 	struct stat st;
-	ssize_t len;
+	dev_t devno;
 
 	if (sscanf(dev_id, "%d:%d", &major, &minor) != 2)
 		return NULL;
+	devno = makedev(major, minor);
+
+	for (i = 0; i < 2; i++) {
+		found = false;
+		pthread_mutex_lock(&devpath_index_lock);
+		fresh = i || !devpath_index.valid;
+		r = devpath_index_get(i > 0);
+		if (!r && (e = devpath_index_find(devno))) {
+			tmp = *e;
+			found = true;
+		}
+		pthread_mutex_unlock(&devpath_index_lock);
 
-	if (snprintf(path, sizeof(path), "/sys/dev/block/%s", dev_id) < 0)
-		return NULL;
-
-	len = readlink(path, link, sizeof(link) - 1);
-	if (len < 0) {
 		/* Without /sys use old scan */
-		if (stat("/sys/dev/block", &st) < 0)
+		if (r == -ENOENT)
 			return lookup_dev_old(major, minor);
-		return NULL;
-	}
-
-	link[len] = '\0';
-	devname = strrchr(link, '/');
-	if (!devname)
-		return NULL;
-	devname++;
+		if (r < 0)
+			return NULL;
+
+		/*
+		 * Check that path is correct.
+		 */
+		if (found) {
+			devpath = devpath_entry_path(&tmp);
+			if (devpath && !stat(devpath, &st) &&
+			    S_ISBLK(st.st_mode) && st.st_rdev == devno)
+				return devpath;
+			free(devpath);
+			mismatch = true;
+		}
 
-	if (dm_is_dm_kernel_name(devname))
-		devpath = dm_device_path("/dev/mapper/", major, minor);
-	else if (snprintf(path, sizeof(path), "/dev/%s", devname) > 0)
-		devpath = strdup(path);
-
-	/*
-	 * Check that path is correct.
-	 */
-	if (devpath && ((stat(devpath, &st) < 0) ||
-	    !S_ISBLK(st.st_mode) ||
-	    (st.st_rdev != makedev(major, minor)))) {
-		free(devpath);
-		/* Should never happen unless user mangles with dev nodes. */
-		return lookup_dev_old(major, minor);
+		if (fresh)
+			break;
 	}
 
-	return devpath;
+	/* Should never happen unless user mangles with dev nodes. */
+	return mismatch ? lookup_dev_old(major, minor) : NULL;
 }
 
 static int _read_uint64(const char *sysfs_path, uint64_t *value)
@@ -220,6 +397,176 @@ int crypt_dev_is_rotational(int major, int minor)
 	return val ? 1 : 0;
 }
 
+/* Queue attributes of partitions are only available on the parent disk */
+static int _sysfs_get_queue_uint64(int major, int minor, uint64_t *value, const char *attr)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "queue/%s", attr) < 0)
+		return 0;
+
+	if (_sysfs_get_uint64(major, minor, value, path))
+		return 1;
+
+	if (snprintf(path, sizeof(path), "../queue/%s", attr) < 0)
+		return 0;
+
+	return _sysfs_get_uint64(major, minor, value, path);
+}
+
+uint64_t crypt_dev_nr_requests(int major, int minor)
+{
+	uint64_t val;
+
+	if (!_sysfs_get_queue_uint64(major, minor, &val, "nr_requests"))
+		return 0;
+
+	return val;
+}
+
+/* Discard can replace zero wipe only if discarded blocks are guaranteed to read as zeroes */
+int crypt_dev_discard_zeroes(int major, int minor)
+{
+	uint64_t val;
+
+	if (!_sysfs_get_queue_uint64(major, minor, &val, "discard_max_bytes") || !val)
+		return 0;
+
+	if (!_sysfs_get_queue_uint64(major, minor, &val, "discard_zeroes_data"))
+		return 0;
+
+	return val ? 1 : 0;
+}
+
+/* Erase block hint of flash device, only for devices supporting discard */
+uint64_t crypt_dev_discard_granularity(int major, int minor)
+{
+	uint64_t val;
+
+	if (!_sysfs_get_queue_uint64(major, minor, &val, "discard_max_bytes") || !val)
+		return 0;
+
+	if (!_sysfs_get_queue_uint64(major, minor, &val, "discard_granularity"))
+		return 0;
+
+	return val;
+}
+
+/*
+ * Full stripe size (chunk size times data disks) of MD RAID device,
+ * partitions use the parent array. Returns 0 for non-striped layouts.
+ */
+uint64_t crypt_dev_md_stripe(int major, int minor)
+{
+	char path[PATH_MAX], level[16] = {0};
+	const char *dir = "md";
+	uint64_t chunk, disks, data;
+	int fd, r;
+
+	if (!_sysfs_get_uint64(major, minor, &chunk, "md/chunk_size")) {
+		dir = "../md";
+		if (!_sysfs_get_uint64(major, minor, &chunk, "../md/chunk_size"))
+			return 0;
+	}
+
+	if (snprintf(path, sizeof(path), "%s/raid_disks", dir) < 0 ||
+	    !_sysfs_get_uint64(major, minor, &disks, path) || !chunk || !disks)
+		return 0;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/%s/level", major, minor, dir) < 0)
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	r = read(fd, level, sizeof(level) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+
+	if (!strncmp(level, "raid0", 5))
+		data = disks;
+	else if (!strncmp(level, "raid10", 6))
+		data = disks / 2;
+	else if (!strncmp(level, "raid4", 5) || !strncmp(level, "raid5", 5))
+		data = disks - 1;
+	else if (!strncmp(level, "raid6", 5))
+		data = disks > 2 ? disks - 2 : 0;
+	else
+		data = 0;
+
+	return chunk * data;
+}
+
+/* Zoned model of the disk, partitions inherit it from the parent disk */
+int crypt_dev_zoned(int major, int minor)
+{
+	char path[PATH_MAX], tmp[32] = {0};
+	int fd = -1, r;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/queue/zoned", major, minor) > 0)
+		fd = open(path, O_RDONLY);
+	if (fd < 0 && snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/../queue/zoned", major, minor) > 0)
+		fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return ZONED_NONE;
+
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+
+	if (r > 0 && !strncmp(tmp, "host-managed", 12))
+		return ZONED_HOST_MANAGED;
+	if (r > 0 && !strncmp(tmp, "host-aware", 10))
+		return ZONED_HOST_AWARE;
+
+	return ZONED_NONE;
+}
+
+/*
+ * Inline encryption (blk-crypto) profile lists supported data unit sizes
+ * of every crypto mode as a bit mask (queue/crypto/modes/<mode>).
+ */
+int crypt_dev_inline_crypto(int major, int minor, const char *mode, uint32_t data_unit_size)
+{
+	char path[PATH_MAX], tmp[32] = {0};
+	unsigned long long mask;
+	int fd = -1, r;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/queue/crypto/modes/%s", major, minor, mode) > 0)
+		fd = open(path, O_RDONLY);
+	if (fd < 0 && snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/../queue/crypto/modes/%s",
+			       major, minor, mode) > 0)
+		fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+
+	mask = strtoull(tmp, NULL, 0);
+
+	return (mask & data_unit_size) ? 1 : 0;
+}
+
+/* NVMe namespaces (and their partitions) are children of nvme class device */
+int crypt_dev_is_nvme(int major, int minor)
+{
+	char path[PATH_MAX], link[PATH_MAX];
+	ssize_t len;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d", major, minor) < 0)
+		return 0;
+
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0)
+		return 0;
+	link[len] = '\0';
+
+	return strstr(link, "/nvme/") ? 1 : 0;
+}
+
 int crypt_dev_is_partition(const char *dev_path)
 {
 	uint64_t val;
@@ -256,6 +603,66 @@ uint64_t crypt_dev_partition_offset(const char *dev_path)
 	return val;
 }
 
+/* Block layer counters from sysfs stat, no histogram */
+int crypt_dev_block_stats(const char *dev_path, struct crypt_io_stats *stats)
+{
+	char path[PATH_MAX], tmp[256] = {0};
+	uint64_t rd_ios, rd_merges, rd_sectors, rd_ticks,
+		 wr_ios, wr_merges, wr_sectors, wr_ticks, in_flight, io_ticks;
+	struct stat st;
+	int fd, r;
+
+	if (stat(dev_path, &st) < 0 || !S_ISBLK(st.st_mode))
+		return -EINVAL;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/stat",
+		     major(st.st_rdev), minor(st.st_rdev)) < 0)
+		return -EINVAL;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -errno;
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+
+	if (r <= 0)
+		return -EIO;
+
+	if (sscanf(tmp, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		   " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		   " %" PRIu64 " %" PRIu64,
+		   &rd_ios, &rd_merges, &rd_sectors, &rd_ticks,
+		   &wr_ios, &wr_merges, &wr_sectors, &wr_ticks,
+		   &in_flight, &io_ticks) != 10)
+		return -EINVAL;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->reads = rd_ios;
+	stats->writes = wr_ios;
+	stats->read_bytes = rd_sectors << SECTOR_SHIFT;
+	stats->write_bytes = wr_sectors << SECTOR_SHIFT;
+	stats->read_us = rd_ticks * 1000;
+	stats->write_us = wr_ticks * 1000;
+	stats->io_us = io_ticks * 1000;
+
+	return 0;
+}
+
+/* Completed I/Os and time spent on them (read + write) from sysfs stat */
+int crypt_dev_io_stats(const char *dev_path, uint64_t *ios, uint64_t *ticks_ms)
+{
+	struct crypt_io_stats stats;
+	int r;
+
+	r = crypt_dev_block_stats(dev_path, &stats);
+	if (r < 0)
+		return r;
+
+	*ios = stats.reads + stats.writes;
+	*ticks_ms = (stats.read_us + stats.write_us) / 1000;
+
+	return 0;
+}
+
 /* Try to find partition which match offset and size on top level device */
 char *crypt_get_partition_device(const char *dev_path, uint64_t offset, uint64_t size)
 {
@@ -410,50 +817,41 @@ int lookup_by_disk_id(const char *dm_uuid)
 
 int lookup_by_sysfs_uuid_field(const char *dm_uuid)
 {
-	struct dirent *entry;
-	char subpath[PATH_MAX], uuid[DM_UUID_LEN];
-	ssize_t s;
-	struct stat st;
-	int fd, len, r = 0; /* not found */
-	DIR *dir = opendir("/sys/block/");
-
-	if (!dir)
-		/* map ENOTDIR to ENOENT we'll handle both errors same */
-		return errno == ENOTDIR ? -ENOENT : -errno;
-
-	while (r != 1 && (entry = readdir(dir))) {
-		if (entry->d_name[0] == '.' ||
-		    !strncmp(entry->d_name, "..", 2))
-			continue;
-
-		len = snprintf(subpath, PATH_MAX, "%s/%s", entry->d_name, "dm/uuid");
-		if (len < 0 || len >= PATH_MAX) {
-			r = -EINVAL;
-			break;
+	char dev_id[64], uuid[DM_UUID_LEN];
+	size_t i, len = strlen(dm_uuid);
+	bool fresh, found;
+	dev_t devno = 0;
+	int pass, r;
+
+	for (pass = 0; pass < 2; pass++) {
+		found = false;
+		pthread_mutex_lock(&devpath_index_lock);
+		fresh = pass || !devpath_index.valid;
+		r = devpath_index_get(pass > 0);
+		for (i = 0; !r && i < devpath_index.count; i++) {
+			if (devpath_index.entries[i].dm_uuid[0] &&
+			    !strncmp(devpath_index.entries[i].dm_uuid, dm_uuid, len)) {
+				devno = devpath_index.entries[i].devno;
+				found = true;
+				break;
+			}
 		}
+		pthread_mutex_unlock(&devpath_index_lock);
 
-		/* looking for dm-X/dm/uuid file, symlinks are fine */
-		fd = openat(dirfd(dir), subpath, O_RDONLY | O_CLOEXEC);
-		if (fd < 0)
-			continue;
+		if (r < 0)
+			return r;
 
-		if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
-			close(fd);
-			continue;
+		/* the entry can be stale, re-read dm-X/dm/uuid */
+		if (found && snprintf(dev_id, sizeof(dev_id), "/sys/dev/block/%u:%u",
+				      major(devno), minor(devno)) > 0) {
+			devpath_read_attr(AT_FDCWD, dev_id, "dm/uuid", uuid, sizeof(uuid));
+			if (!strncmp(uuid, dm_uuid, len))
+				return 1;
 		}
 
-		/* reads binary data */
-		s = read_buffer(fd, uuid, sizeof(uuid) - 1);
-		if (s > 0) {
-			uuid[s] = '\0';
-			if (!strncmp(uuid, dm_uuid, strlen(dm_uuid)))
-				r = 1;
-		}
-
-		close(fd);
+		if (fresh)
+			break;
 	}
 
-	closedir(dir);
-
-	return r;
+	return 0; /* not found */
 }
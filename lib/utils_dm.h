@@ -33,6 +33,8 @@ struct volume_key;
 struct crypt_params_verity;
 struct device;
 struct crypt_params_integrity;
+struct crypt_active_device_summary;
+struct crypt_io_stats;
 
 /* Device mapper internal flags */
 #define DM_RESUME_PRIVATE      (1 << 4) /* CRYPT_ACTIVATE_PRIVATE */
@@ -76,6 +78,7 @@ static inline uint32_t act2dmflags(uint32_t act_flags)
 #define DM_INTEGRITY_FIX_HMAC_SUPPORTED (1 << 26) /* hmac covers also superblock */
 #define DM_INTEGRITY_RESET_RECALC_SUPPORTED (1 << 27) /* dm-integrity automatic recalculation supported */
 #define DM_VERITY_TASKLETS_SUPPORTED (1 << 28) /* dm-verity tasklets supported */
+#define DM_CRYPT_INLINE_SUPPORTED (1 << 29) /* dm-default-key target (blk-crypto inline encryption) */
 
 typedef enum { DM_CRYPT = 0, DM_VERITY, DM_INTEGRITY, DM_LINEAR, DM_ERROR, DM_ZERO, DM_UNKNOWN } dm_target_type;
 enum tdirection { TARGET_EMPTY = 0, TARGET_SET, TARGET_QUERY };
@@ -168,7 +171,9 @@ struct dm_target {
 	} zero;
 	} u;
 
+	/* serialized target line, kept until target inputs or flags change */
 	char *params;
+	uint32_t params_flags;
 	struct dm_target *next;
 };
 
@@ -178,6 +183,7 @@ struct crypt_dm_active_device {
 	const char *uuid;
 
 	unsigned holders:1;	/* device holders detected (on query only) */
+	unsigned keep_params:1;	/* keep target params after load for next reload */
 
 	struct dm_target segment;
 };
@@ -190,6 +196,9 @@ static inline bool single_segment(const struct crypt_dm_active_device *dmd)
 void dm_backend_init(struct crypt_device *cd);
 void dm_backend_exit(struct crypt_device *cd);
 
+void dm_udev_batch_begin(void);
+void dm_udev_batch_end(struct crypt_device *cd);
+
 int dm_targets_allocate(struct dm_target *first, unsigned count);
 void dm_targets_free(struct crypt_device *cd, struct crypt_dm_active_device *dmd);
 
@@ -197,6 +206,7 @@ int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg
 	struct device *data_device, struct volume_key *vk, const char *cipher,
 	uint64_t iv_offset, uint64_t data_offset, const char *integrity,
 	uint32_t tag_size, uint32_t sector_size);
+int dm_crypt_target_shard(struct dm_target *tgt, unsigned shards);
 int dm_verity_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_size,
 	struct device *data_device, struct device *hash_device, struct device *fec_device,
 	const char *root_hash, uint32_t root_hash_size, const char* root_hash_sig_key_desc,
@@ -217,8 +227,13 @@ int dm_status_device(struct crypt_device *cd, const char *name);
 int dm_status_suspended(struct crypt_device *cd, const char *name);
 int dm_status_verity_ok(struct crypt_device *cd, const char *name);
 int dm_status_integrity_failures(struct crypt_device *cd, const char *name, uint64_t *count);
+int dm_status_integrity_recalc(struct crypt_device *cd, const char *name,
+			       uint64_t *recalc_sector, uint64_t *data_sectors);
 int dm_query_device(struct crypt_device *cd, const char *name,
 		    uint32_t get_flags, struct crypt_dm_active_device *dmd);
+int dm_list_devices(struct crypt_device *cd, const char *uuid_prefix,
+		    struct crypt_active_device_summary **devices, size_t *count);
+void dm_list_devices_free(struct crypt_active_device_summary *devices, size_t count);
 int dm_device_deps(struct crypt_device *cd, const char *name, const char *prefix,
 		   char **names, size_t names_length);
 int dm_create_device(struct crypt_device *cd, const char *name,
@@ -227,12 +242,16 @@ int dm_reload_device(struct crypt_device *cd, const char *name,
 		     struct crypt_dm_active_device *dmd, uint32_t dmflags, unsigned resume);
 int dm_suspend_device(struct crypt_device *cd, const char *name, uint32_t dmflags);
 int dm_resume_device(struct crypt_device *cd, const char *name, uint32_t dmflags);
+int dm_suspend_lower_and_switch(struct crypt_device *cd, const char *top, const char *lower);
 int dm_resume_and_reinstate_key(struct crypt_device *cd, const char *name,
 				const struct volume_key *vk);
 int dm_error_device(struct crypt_device *cd, const char *name);
 int dm_clear_device(struct crypt_device *cd, const char *name);
 int dm_cancel_deferred_removal(const char *name);
 
+int dm_io_stats_create(struct crypt_device *cd, const char *name);
+int dm_io_stats_query(struct crypt_device *cd, const char *name, struct crypt_io_stats *stats);
+
 const char *dm_get_dir(void);
 
 int lookup_dm_dev_by_uuid(struct crypt_device *cd, const char *uuid, const char *type);
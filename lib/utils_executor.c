@@ -0,0 +1,346 @@
+/*
+ * Executor for parallel library work (application hook or built-in pool)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+
+/*
+ * Every internal worker is started by crypt_thread_start() and waited for
+ * by crypt_thread_join(). Callers run the work in their own thread if the
+ * start fails, so a concurrency limit or single-threaded mode only
+ * serializes the work.
+ *
+ * Plain tasks go to the application executor if set. Tasks that must run
+ * concurrently with their siblings (barriers, pipelines) use the built-in
+ * pool, which never queues: an idle worker is reused or a new one started.
+ * Tasks that can be cancelled get their own thread.
+ *
+ * A task started from inside another task runs in the caller thread,
+ * so a small application pool cannot deadlock on nested parallelism.
+ *
+ * On library unload crypt_executor_exit() waits for running pool tasks,
+ * stops idle workers and joins all pool threads.
+ */
+struct crypt_exec_task {
+	void *(*fn)(void *arg);
+	void *arg;
+	bool done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct pool_worker {
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct crypt_exec_task *task;
+	struct pool_worker *next;
+};
+
+/* idle built-in pool worker exits after this time */
+#define POOL_IDLE_SEC	10
+
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static int (*exec_submit)(void (*task)(void *task_arg), void *task_arg, void *usrptr);
+static void *exec_usrptr;
+static unsigned int exec_concurrency;
+static unsigned int exec_running;
+static struct pool_worker *pool_idle;
+static struct pool_worker *pool_exited;
+static unsigned int pool_workers;
+static pthread_cond_t pool_exit_cond = PTHREAD_COND_INITIALIZER;
+static bool pool_shutdown;
+static __thread bool exec_in_task;
+
+int crypt_set_executor(int (*submit)(void (*task)(void *task_arg), void *task_arg, void *usrptr),
+		       unsigned int concurrency, void *usrptr)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&exec_lock);
+	if (exec_running)
+		r = -EBUSY;
+	else {
+		exec_submit = submit;
+		exec_usrptr = usrptr;
+		exec_concurrency = concurrency;
+	}
+	pthread_mutex_unlock(&exec_lock);
+
+	return r;
+}
+
+static void exec_task_run(void *arg)
+{
+	struct crypt_exec_task *task = arg;
+	bool in_task = exec_in_task;
+
+	exec_in_task = true;
+	task->fn(task->arg);
+	exec_in_task = in_task;
+
+	pthread_mutex_lock(&task->lock);
+	task->done = true;
+	pthread_cond_signal(&task->cond);
+	pthread_mutex_unlock(&task->lock);
+}
+
+static void *pool_worker_fn(void *arg)
+{
+	struct pool_worker *w = arg, **p;
+	struct crypt_exec_task *task;
+	struct timespec ts;
+
+	pthread_mutex_lock(&exec_lock);
+	while ((task = w->task)) {
+		w->task = NULL;
+		pthread_mutex_unlock(&exec_lock);
+
+		exec_task_run(task);
+
+		pthread_mutex_lock(&exec_lock);
+		w->next = pool_idle;
+		pool_idle = w;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += POOL_IDLE_SEC;
+		while (!w->task && !pool_shutdown)
+			if (pthread_cond_timedwait(&w->cond, &exec_lock, &ts) == ETIMEDOUT)
+				break;
+
+		/* timed out or shutdown, nobody took this worker in the meantime */
+		if (!w->task)
+			for (p = &pool_idle; *p; p = &(*p)->next)
+				if (*p == w) {
+					*p = w->next;
+					break;
+				}
+	}
+
+	/* joined and freed by pool_reap() */
+	w->next = pool_exited;
+	pool_exited = w;
+	pool_workers--;
+	pthread_cond_broadcast(&pool_exit_cond);
+	pthread_mutex_unlock(&exec_lock);
+
+	return NULL;
+}
+
+/* Called with exec_lock held, exited workers no longer touch the lock */
+static void pool_reap(void)
+{
+	struct pool_worker *w;
+
+	while ((w = pool_exited)) {
+		pool_exited = w->next;
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->cond);
+		free(w);
+	}
+}
+
+/* Called with exec_lock held */
+static int pool_submit(struct crypt_exec_task *task)
+{
+	struct pool_worker *w;
+
+	pool_reap();
+
+	if ((w = pool_idle)) {
+		pool_idle = w->next;
+		w->task = task;
+		pthread_cond_signal(&w->cond);
+		return 0;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	if (pthread_cond_init(&w->cond, NULL)) {
+		free(w);
+		return -ENOMEM;
+	}
+	w->task = task;
+
+	if (pthread_create(&w->thread, NULL, pool_worker_fn, w)) {
+		pthread_cond_destroy(&w->cond);
+		free(w);
+		return -EAGAIN;
+	}
+
+	pool_workers++;
+	return 0;
+}
+
+int crypt_thread_start(struct crypt_thread *t, void *(*fn)(void *arg), void *arg, uint32_t flags)
+{
+	struct crypt_exec_task *task = NULL;
+	int r;
+
+	memset(t, 0, sizeof(*t));
+
+	/* nested parallelism on application executor runs in the task thread */
+	if (exec_in_task && !(flags & (CRYPT_THREAD_CONCURRENT | CRYPT_THREAD_CANCEL)))
+		return -EDEADLK;
+
+	/* concurrency limit includes the caller thread */
+	pthread_mutex_lock(&exec_lock);
+	if (exec_concurrency && exec_running + 1 >= exec_concurrency) {
+		r = -EAGAIN;
+		goto out;
+	}
+
+	if (flags & CRYPT_THREAD_CANCEL) {
+		r = pthread_create(&t->thread, NULL, fn, arg) ? -EAGAIN : 0;
+		goto out;
+	}
+
+	r = -ENOMEM;
+	task = calloc(1, sizeof(*task));
+	if (!task)
+		goto out;
+
+	task->fn = fn;
+	task->arg = arg;
+	if (pthread_mutex_init(&task->lock, NULL))
+		goto out;
+	if (pthread_cond_init(&task->cond, NULL)) {
+		pthread_mutex_destroy(&task->lock);
+		goto out;
+	}
+
+	if (exec_submit && !(flags & CRYPT_THREAD_CONCURRENT)) {
+		/* submit may run the task synchronously, do not hold the lock */
+		exec_running++;
+		pthread_mutex_unlock(&exec_lock);
+		r = exec_submit(exec_task_run, task, exec_usrptr) ? -EAGAIN : 0;
+		pthread_mutex_lock(&exec_lock);
+		exec_running--;
+	} else
+		r = pool_submit(task);
+
+	if (r) {
+		pthread_cond_destroy(&task->cond);
+		pthread_mutex_destroy(&task->lock);
+	}
+out:
+	if (!r) {
+		t->task = task;
+		t->started = true;
+		exec_running++;
+	} else
+		free(task);
+	pthread_mutex_unlock(&exec_lock);
+
+	return r;
+}
+
+void crypt_thread_join(struct crypt_thread *t)
+{
+	struct crypt_exec_task *task = t->task;
+
+	if (!t->started)
+		return;
+
+	if (task) {
+		pthread_mutex_lock(&task->lock);
+		while (!task->done)
+			pthread_cond_wait(&task->cond, &task->lock);
+		pthread_mutex_unlock(&task->lock);
+
+		pthread_cond_destroy(&task->cond);
+		pthread_mutex_destroy(&task->lock);
+		free(task);
+	} else
+		pthread_join(t->thread, NULL);
+
+	pthread_mutex_lock(&exec_lock);
+	exec_running--;
+	pthread_mutex_unlock(&exec_lock);
+
+	t->task = NULL;
+	t->started = false;
+}
+
+int crypt_thread_cancel(struct crypt_thread *t)
+{
+	if (!t->started || t->task)
+		return -EINVAL;
+
+	return pthread_cancel(t->thread) ? -EINVAL : 0;
+}
+
+/* Argon2 lane workers synchronize on barriers, siblings must run concurrently */
+static int argon2_thread_start(void **handle, void *(*fn)(void *arg), void *arg)
+{
+	struct crypt_thread *t;
+
+	t = malloc(sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	if (crypt_thread_start(t, fn, arg, CRYPT_THREAD_CONCURRENT)) {
+		free(t);
+		return -EAGAIN;
+	}
+
+	*handle = t;
+	return 0;
+}
+
+static int argon2_thread_join(void *handle)
+{
+	crypt_thread_join(handle);
+	free(handle);
+	return 0;
+}
+
+void crypt_executor_init(void)
+{
+	crypt_backend_thread_hooks(argon2_thread_start, argon2_thread_join);
+}
+
+void crypt_executor_exit(void)
+{
+	struct pool_worker *w;
+
+	/* exit() from a task (e.g. completion callback) cannot wait for itself */
+	if (exec_in_task)
+		return;
+
+	pthread_mutex_lock(&exec_lock);
+	pool_shutdown = true;
+	for (w = pool_idle; w; w = w->next)
+		pthread_cond_signal(&w->cond);
+
+	/* busy workers finish their task first */
+	while (pool_workers)
+		pthread_cond_wait(&pool_exit_cond, &exec_lock);
+
+	pool_reap();
+	pool_shutdown = false;
+	pthread_mutex_unlock(&exec_lock);
+}
@@ -24,11 +24,34 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 #include "utils_io.h"
 
+/* Bytes transferred by blockwise (metadata) I/O in the process */
+static uint64_t io_read_bytes = 0;
+static uint64_t io_write_bytes = 0;
+
+static ssize_t io_account(uint64_t *counter, ssize_t r)
+{
+	if (r > 0)
+		__atomic_fetch_add(counter, (uint64_t)r, __ATOMIC_RELAXED);
+	return r;
+}
+
+void io_stats(uint64_t *read_bytes, uint64_t *write_bytes)
+{
+	*read_bytes = __atomic_load_n(&io_read_bytes, __ATOMIC_RELAXED);
+	*write_bytes = __atomic_load_n(&io_write_bytes, __ATOMIC_RELAXED);
+}
+
 static ssize_t _read_buffer(int fd, void *buf, size_t length, volatile int *quit)
 {
 	size_t read_size = 0;
@@ -247,7 +270,7 @@ ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 		ret += innerCount;
 out:
 	free(frontPadBuf);
-	return ret;
+	return io_account(&io_write_bytes, ret);
 }
 
 ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
@@ -294,5 +317,492 @@ ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 		ret += innerCount;
 out:
 	free(frontPadBuf);
+	return io_account(&io_read_bytes, ret);
+}
+
+void io_scratch_free(struct io_scratch *scratch)
+{
+	volatile char *p;
+	size_t i;
+
+	if (!scratch)
+		return;
+
+	/* scratch can contain keyslot material */
+	for (p = scratch->buf, i = 0; p && i < scratch->size; i++)
+		p[i] = 0;
+
+	free(scratch->buf);
+	scratch->buf = NULL;
+	scratch->size = 0;
+}
+
+static void *io_scratch_get(struct io_scratch *scratch, size_t alignment, size_t size)
+{
+	void *buf;
+
+	if (scratch->buf && scratch->size >= size && scratch->alignment >= alignment &&
+	    !(scratch->alignment % alignment))
+		return scratch->buf;
+
+	if (posix_memalign(&buf, alignment, size))
+		return NULL;
+
+	free(scratch->buf);
+	scratch->buf = buf;
+	scratch->size = size;
+	scratch->alignment = alignment;
+
+	return buf;
+}
+
+/* Positioned vector I/O with restart after short transfer */
+static ssize_t _rw_iov(int fd, bool write, struct iovec *iov, int iovcnt, off_t offset)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (iovcnt) {
+		r = write ? pwritev(fd, iov, iovcnt, offset) : preadv(fd, iov, iovcnt, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+
+		done += r;
+		offset += r;
+		while (iovcnt && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return done;
+}
+
+/*
+ * Blockwise I/O at absolute offset (the file offset is not used nor changed).
+ * Area is extended to whole blocks, partial first and last blocks go
+ * through the scratch buffer; whole blocks are transferred directly
+ * from/to caller buffer (if aligned). All is submitted in one preadv/pwritev.
+ * The scratch buffer is kept for the next call, if NULL, temporary is used.
+ */
+static ssize_t rw_pos_blockwise(int fd, bool write, size_t bsize, size_t alignment,
+				struct io_scratch *scratch, void *buf, size_t length,
+				off_t offset)
+{
+	struct io_scratch tmp_scratch = {};
+	struct iovec iov[3];
+	size_t head, tail, inner, total, need;
+	off_t start;
+	char *sb, *head_blk = NULL, *tail_blk = NULL;
+	int iovcnt = 0;
+	ssize_t r, ret = -1;
+
+	if (fd < 0 || !buf || !bsize || !alignment || offset < 0)
+		return -1;
+
+	if (!length)
+		return 0;
+
+	head = offset % bsize;
+	start = offset - head;
+	total = head + length;
+	tail = total % bsize;
+	if (tail)
+		total += bsize - tail;
+
+	/* fast path, everything is aligned */
+	if (!head && !tail && !((size_t)buf & (alignment - 1))) {
+		iov[0].iov_base = buf;
+		iov[0].iov_len = length;
+		r = _rw_iov(fd, write, iov, 1, offset);
+		return r == (ssize_t)length ? r : -1;
+	}
+
+	if (!scratch)
+		scratch = &tmp_scratch;
+
+	/* inner part is the caller buffer from the first whole block */
+	inner = !head ? 0 : length < bsize - head ? length : bsize - head;
+
+	if (total > 2 * bsize && !(((size_t)buf + inner) & (alignment - 1))) {
+		sb = io_scratch_get(scratch, alignment, 2 * bsize);
+		if (!sb)
+			goto out;
+
+		if (head) {
+			head_blk = sb;
+			iov[iovcnt].iov_base = head_blk;
+			iov[iovcnt++].iov_len = bsize;
+		}
+		iov[iovcnt].iov_base = (char *)buf + inner;
+		iov[iovcnt++].iov_len = total - (head ? bsize : 0) - (tail ? bsize : 0);
+		if (tail) {
+			tail_blk = sb + bsize;
+			iov[iovcnt].iov_base = tail_blk;
+			iov[iovcnt++].iov_len = bsize;
+		}
+	} else {
+		/* bounce the whole area */
+		sb = io_scratch_get(scratch, alignment, total);
+		if (!sb)
+			goto out;
+
+		head_blk = sb;
+		tail_blk = sb + total - bsize;
+		iov[iovcnt].iov_base = sb;
+		iov[iovcnt++].iov_len = total;
+	}
+
+	if (write) {
+		/* read-modify-write of partial blocks */
+		if (head) {
+			memset(head_blk, 0, bsize);
+			if (pread(fd, head_blk, bsize, start) < (ssize_t)head)
+				goto out;
+		}
+		if (tail && (!head || total > bsize)) {
+			memset(tail_blk, 0, bsize);
+			if (pread(fd, tail_blk, bsize, start + total - bsize) < 0)
+				goto out;
+		}
+
+		if (iovcnt == 1)
+			memcpy(sb + head, buf, length);
+		else {
+			if (head)
+				memcpy(head_blk + head, buf, inner);
+			if (tail)
+				memcpy(tail_blk, (char *)buf + length - tail, tail);
+		}
+
+		r = _rw_iov(fd, true, iov, iovcnt, start);
+		if (r < 0 || r < (ssize_t)(head + length))
+			goto out;
+	} else {
+		need = head + length;
+		r = _rw_iov(fd, false, iov, iovcnt, start);
+		if (r < 0 || r < (ssize_t)need)
+			goto out;
+
+		if (iovcnt == 1)
+			memcpy(buf, sb + head, length);
+		else {
+			if (head)
+				memcpy(buf, head_blk + head, inner);
+			if (tail)
+				memcpy((char *)buf + length - tail, tail_blk, tail);
+		}
+	}
+
+	ret = length;
+out:
+	io_scratch_free(&tmp_scratch);
 	return ret;
 }
+
+ssize_t pwrite_blockwise(int fd, size_t bsize, size_t alignment, struct io_scratch *scratch,
+			 const void *buf, size_t length, off_t offset)
+{
+	return io_account(&io_write_bytes,
+			  rw_pos_blockwise(fd, true, bsize, alignment, scratch, (void *)buf, length, offset));
+}
+
+ssize_t pread_blockwise(int fd, size_t bsize, size_t alignment, struct io_scratch *scratch,
+			void *buf, size_t length, off_t offset)
+{
+	return io_account(&io_read_bytes,
+			  rw_pos_blockwise(fd, false, bsize, alignment, scratch, buf, length, offset));
+}
+
+/*
+ * Copy inside one file without the data passing through userspace
+ * (copy_file_range: reflink, server-side or device copy offload). Ranges
+ * must not overlap. Returns length or -1 (errno set) if nothing or only
+ * part was copied; the caller then copies the whole range itself.
+ */
+ssize_t copy_range(int fd, off_t from, off_t to, size_t length)
+{
+#ifdef __NR_copy_file_range
+	loff_t off_in = from, off_out = to;
+	size_t done = 0;
+	ssize_t r;
+
+	if (fd < 0 || from < 0 || to < 0 ||
+	    (from < to ? (size_t)(to - from) : (size_t)(from - to)) < length) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (done < length) {
+		r = syscall(__NR_copy_file_range, fd, &off_in, fd, &off_out, length - done, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (!r)
+				errno = EIO;
+			return -1;
+		}
+		done += r;
+	}
+
+	return io_account(&io_write_bytes, length);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Returns 1 if the whole range is unallocated in a (sparse) regular file,
+ * 0 if it contains data or allocation cannot be queried.
+ */
+int range_is_hole(int fd, off_t offset, size_t length)
+{
+#ifdef SEEK_DATA
+	struct stat st;
+	off_t data;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    offset < 0 || (uint64_t)offset + length > (uint64_t)st.st_size)
+		return 0;
+
+	data = lseek(fd, offset, SEEK_DATA);
+	if (data < 0)
+		/* no data at or after offset */
+		return errno == ENXIO ? 1 : 0;
+
+	return (uint64_t)data >= (uint64_t)offset + length ? 1 : 0;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Deallocates the range in a regular file (reads back as zeroes),
+ * returns -ENOTSUP if not supported by the filesystem (or not a file).
+ */
+int punch_hole(int fd, off_t offset, size_t length)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return -ENOTSUP;
+
+	if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length))
+		return 0;
+
+	return errno == EOPNOTSUPP ? -ENOTSUP : -errno;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+struct bulk_reader {
+	int fd;
+	size_t bsize;
+	size_t alignment;
+	bool direct_io;
+	bool drop_behind;
+
+	char *buf[2];
+	size_t chunk;
+	uint64_t next;		/* offset of the next chunk to read */
+	uint64_t end;
+	uint64_t cur_offset;	/* chunk owned by the caller */
+	size_t cur_len;
+	int cur;
+	bool failed;
+
+	/* background read of the other buffer */
+	bool threaded;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool pending, done, quit;
+	int req_buf;
+	uint64_t req_offset;
+	size_t req_len;
+	ssize_t req_r;
+};
+
+static void *bulk_reader_thread(void *arg)
+{
+	struct bulk_reader *br = arg;
+	ssize_t r;
+
+	pthread_mutex_lock(&br->lock);
+	while (1) {
+		while (!br->pending && !br->quit)
+			pthread_cond_wait(&br->cond, &br->lock);
+		if (br->quit)
+			break;
+		pthread_mutex_unlock(&br->lock);
+
+		r = pread_blockwise(br->fd, br->bsize, br->alignment, NULL,
+				    br->buf[br->req_buf], br->req_len, br->req_offset);
+
+		pthread_mutex_lock(&br->lock);
+		br->req_r = r;
+		br->pending = false;
+		br->done = true;
+		pthread_cond_broadcast(&br->cond);
+	}
+	pthread_mutex_unlock(&br->lock);
+
+	return NULL;
+}
+
+static size_t bulk_reader_len(struct bulk_reader *br)
+{
+	return br->end - br->next < br->chunk ? br->end - br->next : br->chunk;
+}
+
+static void bulk_reader_submit(struct bulk_reader *br, int buf)
+{
+	pthread_mutex_lock(&br->lock);
+	br->req_buf = buf;
+	br->req_offset = br->next;
+	br->req_len = bulk_reader_len(br);
+	br->next += br->req_len;
+	br->done = false;
+	br->pending = true;
+	pthread_cond_broadcast(&br->cond);
+	pthread_mutex_unlock(&br->lock);
+}
+
+int bulk_reader_init(struct bulk_reader **br, int fd, size_t bsize, size_t alignment,
+		     uint64_t offset, uint64_t length, size_t chunk, uint32_t flags)
+{
+	struct bulk_reader *h;
+	int i, fl;
+
+	if (fd < 0 || !bsize || !alignment || !chunk)
+		return -EINVAL;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	h->fd = fd;
+	h->bsize = bsize;
+	h->alignment = alignment;
+	h->next = h->cur_offset = offset;
+	h->end = offset + length;
+	h->chunk = length && length < chunk ? length : chunk;
+	h->cur = -1;
+
+	fl = fcntl(fd, F_GETFL);
+	h->direct_io = fl != -1 && (fl & O_DIRECT);
+	h->drop_behind = !h->direct_io && (flags & BULK_READ_DROP_BEHIND);
+
+	for (i = 0; i < ((flags & BULK_READ_PREFETCH) ? 2 : 1); i++)
+		if (posix_memalign((void **)&h->buf[i], alignment, h->chunk)) {
+			h->buf[i] = NULL;
+			bulk_reader_destroy(h);
+			return -ENOMEM;
+		}
+
+	/* page cache readahead hint, meaningless with direct-io */
+	if (!h->direct_io)
+		(void)posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+	if (h->buf[1] && !pthread_mutex_init(&h->lock, NULL)) {
+		if (pthread_cond_init(&h->cond, NULL))
+			pthread_mutex_destroy(&h->lock);
+		else if (pthread_create(&h->thread, NULL, bulk_reader_thread, h)) {
+			pthread_cond_destroy(&h->cond);
+			pthread_mutex_destroy(&h->lock);
+		} else
+			h->threaded = true;
+	}
+
+	if (h->threaded && h->next < h->end)
+		bulk_reader_submit(h, 0);
+
+	*br = h;
+	return 0;
+}
+
+/* Returns length of the next chunk (valid until the next call), 0 at the end */
+ssize_t bulk_reader_next(struct bulk_reader *br, const char **data)
+{
+	size_t len;
+	ssize_t r;
+
+	if (br->failed)
+		return -EIO;
+
+	if (br->cur >= 0) {
+		if (br->drop_behind)
+			(void)posix_fadvise(br->fd, br->cur_offset, br->cur_len, POSIX_FADV_DONTNEED);
+		br->cur_offset += br->cur_len;
+		br->cur_len = 0;
+	}
+
+	if (br->cur_offset >= br->end)
+		return 0;
+
+	if (br->threaded) {
+		pthread_mutex_lock(&br->lock);
+		while (!br->done)
+			pthread_cond_wait(&br->cond, &br->lock);
+		br->cur = br->req_buf;
+		len = br->req_len;
+		r = br->req_r;
+		pthread_mutex_unlock(&br->lock);
+
+		if (r >= 0 && (size_t)r == len && br->next < br->end)
+			bulk_reader_submit(br, !br->cur);
+	} else {
+		br->cur = 0;
+		len = bulk_reader_len(br);
+		r = pread_blockwise(br->fd, br->bsize, br->alignment, NULL,
+				    br->buf[0], len, br->next);
+		br->next += len;
+
+		/* let the kernel read the next chunk while this one is processed */
+		if (!br->direct_io && br->next < br->end)
+			(void)posix_fadvise(br->fd, br->next, br->chunk, POSIX_FADV_WILLNEED);
+	}
+
+	/* short read is an error, the whole range must be readable */
+	if (r < 0 || (size_t)r != len) {
+		br->cur = -1;
+		br->failed = true;
+		return -EIO;
+	}
+
+	br->cur_len = r;
+	*data = br->buf[br->cur];
+	return r;
+}
+
+void bulk_reader_destroy(struct bulk_reader *br)
+{
+	if (!br)
+		return;
+
+	if (br->threaded) {
+		pthread_mutex_lock(&br->lock);
+		br->quit = true;
+		pthread_cond_broadcast(&br->cond);
+		pthread_mutex_unlock(&br->lock);
+		pthread_join(br->thread, NULL);
+		pthread_cond_destroy(&br->cond);
+		pthread_mutex_destroy(&br->lock);
+	}
+
+	free(br->buf[0]);
+	free(br->buf[1]);
+	free(br);
+}
@@ -25,6 +25,7 @@
 #define _CRYPTSETUP_UTILS_IO_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 ssize_t read_buffer(int fd, void *buf, size_t length);
@@ -40,4 +41,44 @@ ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 			     void *buf, size_t length, off_t offset);
 
+/* Aligned bounce buffer owned by caller, reused (and grown) between calls */
+struct io_scratch {
+	void *buf;
+	size_t size;
+	size_t alignment;
+};
+
+void io_scratch_free(struct io_scratch *scratch);
+
+/* Positioned blockwise I/O, file offset is not changed; scratch can be NULL */
+ssize_t pwrite_blockwise(int fd, size_t bsize, size_t alignment, struct io_scratch *scratch,
+			 const void *buf, size_t length, off_t offset);
+ssize_t pread_blockwise(int fd, size_t bsize, size_t alignment, struct io_scratch *scratch,
+			void *buf, size_t length, off_t offset);
+
+/* Bytes read and written by the blockwise functions above (process wide) */
+void io_stats(uint64_t *read_bytes, uint64_t *write_bytes);
+
+/* In-kernel copy of non-overlapping ranges of one file, -1 if not supported */
+ssize_t copy_range(int fd, off_t from, off_t to, size_t length);
+
+int range_is_hole(int fd, off_t offset, size_t length);
+int punch_hole(int fd, off_t offset, size_t length);
+
+/*
+ * Sequential reader of a large device range in chunks (bulk hash/verify passes).
+ * With BULK_READ_PREFETCH the next chunk is read in background while the caller
+ * processes the current one; BULK_READ_DROP_BEHIND drops consumed chunks from
+ * the page cache. Both hints are ignored for fd opened with O_DIRECT.
+ */
+#define BULK_READ_PREFETCH	(1 << 0)
+#define BULK_READ_DROP_BEHIND	(1 << 1)
+
+struct bulk_reader;
+
+int bulk_reader_init(struct bulk_reader **br, int fd, size_t bsize, size_t alignment,
+		     uint64_t offset, uint64_t length, size_t chunk, uint32_t flags);
+ssize_t bulk_reader_next(struct bulk_reader *br, const char **data);
+void bulk_reader_destroy(struct bulk_reader *br);
+
 #endif
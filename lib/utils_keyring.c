@@ -77,6 +77,12 @@ static long keyctl_revoke(key_serial_t key)
 	return syscall(__NR_keyctl, KEYCTL_REVOKE, key);
 }
 
+/* keyctl_set_timeout */
+static long keyctl_set_timeout(key_serial_t key, unsigned timeout)
+{
+	return syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, key, timeout);
+}
+
 /* keyctl_unlink */
 static long keyctl_unlink(key_serial_t key, key_serial_t keyring)
 {
@@ -115,10 +121,18 @@ int keyring_add_key_in_thread_keyring(key_type_t ktype, const char *key_desc, co
 
 /* currently used in client utilities only */
 int keyring_add_key_in_user_keyring(key_type_t ktype, const char *key_desc, const void *key, size_t key_size)
+{
+	return keyring_add_key_in_user_keyring_timeout(ktype, key_desc, key, key_size, 0);
+}
+
+/* key expires after timeout seconds, 0 means no expiration */
+int keyring_add_key_in_user_keyring_timeout(key_type_t ktype, const char *key_desc,
+	const void *key, size_t key_size, unsigned timeout)
 {
 #ifdef KERNEL_KEYRING
 	const char *type_name = key_type_name(ktype);
 	key_serial_t kid;
+	int r;
 
 	if (!type_name || !key_desc)
 		return -EINVAL;
@@ -127,6 +141,13 @@ int keyring_add_key_in_user_keyring(key_type_t ktype, const char *key_desc, cons
 	if (kid < 0)
 		return -errno;
 
+	if (timeout && keyctl_set_timeout(kid, timeout)) {
+		r = -errno;
+		keyctl_revoke(kid);
+		keyctl_unlink(kid, KEY_SPEC_USER_KEYRING);
+		return r;
+	}
+
 	return 0;
 #else
 	return -ENOTSUP;
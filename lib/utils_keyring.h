@@ -50,6 +50,13 @@ int keyring_add_key_in_user_keyring(
 	const void *key,
 	size_t key_size);
 
+int keyring_add_key_in_user_keyring_timeout(
+	key_type_t ktype,
+	const char *key_desc,
+	const void *key,
+	size_t key_size,
+	unsigned timeout);
+
 int keyring_revoke_and_unlink_key(key_type_t ktype, const char *key_desc);
 
 #endif
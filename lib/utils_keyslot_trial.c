@@ -0,0 +1,251 @@
+/*
+ * Parallel keyslot trial (concurrent KDF of candidate keyslots)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "utils_device_locking.h"
+
+/*
+ * Only key derivation runs in worker threads, it is a pure function
+ * of password and keyslot parameters. Reading keyslot area, AF merge and
+ * digest verification run in the caller thread, in keyslot order,
+ * so the first matching keyslot in priority order always wins.
+ *
+ * Running KDF cannot be interrupted; once a keyslot matches no other
+ * job is started and the caller only waits for already running ones.
+ *
+ * If there are not enough CPUs for all jobs and all of them are PBKDF2 with
+ * the same hash, they are derived at once in SIMD lanes instead (all jobs
+ * always finish then, but for about the price of the longest one).
+ */
+struct kdf_thread {
+	struct crypt_device *cd;
+	struct crypt_kdf_job *job;
+	const char *password;
+	size_t password_len;
+	struct crypt_thread thread;
+	bool threaded;
+	bool done;
+};
+
+static void kdf_job_run(struct kdf_thread *t)
+{
+	struct crypt_kdf_memory_handle *kdf_memory;
+	struct crypt_kdf_job *job = t->job;
+	struct crypt_perf_kdf perf;
+
+	/* Format specific KDF (no memory hard PBKDF) */
+	if (job->kdf) {
+		job->r = job->kdf(t->cd, job, t->password, t->password_len);
+		return;
+	}
+
+	/* Concurrent unlocks in other processes count too */
+	job->r = crypt_kdf_memory_acquire(t->cd, job->pbkdf.max_memory_kb, &kdf_memory);
+	if (job->r < 0)
+		return;
+
+	trace_kdf_start(job->pbkdf.type, job->pbkdf.iterations,
+			job->pbkdf.max_memory_kb, job->pbkdf.parallel_threads);
+	crypt_perf_kdf_begin(t->cd, &perf);
+	job->r = crypt_pbkdf(job->pbkdf.type, job->pbkdf.hash, t->password, t->password_len,
+			     job->salt, job->salt_len, job->derived_key->key,
+			     job->derived_key->keylength, job->pbkdf.iterations,
+			     job->pbkdf.max_memory_kb, job->pbkdf.parallel_threads);
+	crypt_perf_kdf_end(t->cd, &perf);
+	trace_kdf_end(job->pbkdf.type, job->r);
+
+	crypt_kdf_memory_release(t->cd, kdf_memory);
+}
+
+static void *kdf_thread_fn(void *arg)
+{
+	kdf_job_run(arg);
+	return NULL;
+}
+
+static uint64_t kdf_job_memory_kb(const struct crypt_kdf_job *job)
+{
+	/* PBKDF2 memory use is negligible */
+	return job->pbkdf.max_memory_kb ?: 1;
+}
+
+static unsigned kdf_job_threads(const struct crypt_kdf_job *job)
+{
+	return job->pbkdf.parallel_threads ?: 1;
+}
+
+static void kdf_job_start(struct crypt_device *cd, struct kdf_thread *t)
+{
+	t->threaded = !crypt_thread_start(&t->thread, kdf_thread_fn, t, 0);
+
+	/* run it later in caller thread */
+	if (!t->threaded)
+		log_dbg(cd, "Cannot start KDF thread for keyslot %d.", t->job->keyslot);
+}
+
+static void kdf_job_wait(struct kdf_thread *t)
+{
+	if (t->threaded) {
+		crypt_thread_join(&t->thread);
+		t->threaded = false;
+	} else if (!t->done)
+		kdf_job_run(t);
+	t->done = true;
+}
+
+static bool kdf_jobs_multi_lane(const struct crypt_kdf_job *jobs, unsigned count, unsigned cpus)
+{
+	unsigned i;
+
+	if (count <= cpus || jobs[0].kdf || !crypt_pbkdf2_multi_lanes(jobs[0].pbkdf.hash) || crypt_fips_mode())
+		return false;
+
+	for (i = 0; i < count; i++)
+		if (jobs[i].kdf || strcmp(jobs[i].pbkdf.type, CRYPT_KDF_PBKDF2) ||
+		    strcmp(jobs[i].pbkdf.hash, jobs[0].pbkdf.hash))
+			return false;
+
+	return true;
+}
+
+static int kdf_jobs_run_multi_lane(struct crypt_device *cd, struct kdf_thread *t, unsigned count)
+{
+	struct crypt_pbkdf2_job *mj;
+	unsigned i;
+	int r;
+
+	mj = calloc(count, sizeof(*mj));
+	if (!mj)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		mj[i].password = t[i].password;
+		mj[i].password_length = t[i].password_len;
+		mj[i].salt = t[i].job->salt;
+		mj[i].salt_length = t[i].job->salt_len;
+		mj[i].iterations = t[i].job->pbkdf.iterations;
+		mj[i].key = t[i].job->derived_key->key;
+		mj[i].key_length = t[i].job->derived_key->keylength;
+	}
+
+	log_dbg(cd, "Running key derivation of %u keyslots in SIMD lanes.", count);
+	r = crypt_pbkdf2_multi(t[0].job->pbkdf.hash, mj, count);
+	free(mj);
+
+	/* on failure jobs run one by one as usual */
+	for (i = 0; r == 0 && i < count; i++) {
+		t[i].job->r = 0;
+		t[i].done = true;
+	}
+
+	return r;
+}
+
+int crypt_kdf_parallel_trial(struct crypt_device *cd, struct crypt_kdf_job *jobs, unsigned count,
+	const char *password, size_t password_len,
+	int (*verify)(struct crypt_device *cd, struct crypt_kdf_job *job, void *usrptr),
+	void *usrptr)
+{
+	struct kdf_thread *t;
+	uint64_t budget_kb, used_kb = 0;
+	unsigned i, next = 0, cpus, used_cpus = 0, tried = 0;
+	int r = -ENOENT;
+
+	if (!jobs || !count || !verify)
+		return -EINVAL;
+
+	t = calloc(count, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	/* Same limit as for PBKDF memory cost */
+	budget_kb = crypt_pbkdf_memory_limit_kb(NULL);
+	cpus = crypt_cpusonline();
+
+	for (i = 0; i < count; i++) {
+		t[i].cd = cd;
+		t[i].job = &jobs[i];
+		t[i].password = jobs[i].password ?: password;
+		t[i].password_len = jobs[i].password ? jobs[i].password_len : password_len;
+	}
+
+	if (kdf_jobs_multi_lane(jobs, count, cpus) && !kdf_jobs_run_multi_lane(cd, t, count))
+		next = count;
+
+	for (i = 0; i < count; i++) {
+		/* Keep starting jobs in order while they fit, current one always */
+		while (next < count &&
+		       (next == i || (used_kb + kdf_job_memory_kb(&jobs[next]) <= budget_kb &&
+				      used_cpus + kdf_job_threads(&jobs[next]) <= cpus))) {
+			log_dbg(cd, "Starting key derivation for keyslot %d.", jobs[next].keyslot);
+			kdf_job_start(cd, &t[next]);
+			used_kb += kdf_job_memory_kb(&jobs[next]);
+			used_cpus += kdf_job_threads(&jobs[next]);
+			next++;
+		}
+
+		kdf_job_wait(&t[i]);
+		if (used_cpus) {
+			used_kb -= kdf_job_memory_kb(&jobs[i]);
+			used_cpus -= kdf_job_threads(&jobs[i]);
+		}
+
+		/* verify also handles KDF failure (in job->r) */
+		r = verify(cd, &jobs[i], usrptr);
+
+		/* Do not retry for errors that are no -EPERM or -ENOENT */
+		if (r != -EPERM && r != -ENOENT)
+			break;
+		if (r == -EPERM)
+			tried++;
+	}
+
+	/* Only wait for already running threads, never start new ones */
+	for (i = 0; i < next; i++)
+		if (t[i].threaded)
+			crypt_thread_join(&t[i].thread);
+
+	free(t);
+
+	if (r == -ENOENT && tried)
+		r = -EPERM;
+
+	return r;
+}
+
+void crypt_kdf_jobs_free(struct crypt_kdf_job *jobs, unsigned count)
+{
+	unsigned i;
+
+	if (!jobs)
+		return;
+
+	for (i = 0; i < count; i++) {
+		crypt_free_volume_key(jobs[i].derived_key);
+		free(jobs[i].salt);
+	}
+
+	free(jobs);
+}
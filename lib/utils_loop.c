@@ -51,6 +51,14 @@
 #define LOOP_SET_CAPACITY 0x4C07
 #endif
 
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
 #ifndef LOOP_SET_BLOCK_SIZE
 #define LOOP_SET_BLOCK_SIZE 0x4C09
 #endif
@@ -115,8 +123,27 @@ static char *crypt_loop_get_device(void)
 	return strdup(dev);
 }
 
+/*
+ * Direct I/O avoids caching data twice (backing file page cache and loop device).
+ * Kernel enables it only if the backing file system supports it and the loop
+ * block size and offset are aligned to its logical block size.
+ */
+static int crypt_loop_set_direct_io(int loop_fd)
+{
+	struct loop_info64 lo64 = {0};
+
+	if (ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1UL) < 0)
+		return 0;
+
+	if (ioctl(loop_fd, LOOP_GET_STATUS64, &lo64) < 0)
+		return 0;
+
+	return (lo64.lo_flags & LO_FLAGS_DIRECT_IO) ? 1 : 0;
+}
+
 int crypt_loop_attach(char **loop, const char *file, int offset,
-		      int autoclear, int *readonly, size_t blocksize)
+		      int autoclear, int *readonly, size_t blocksize,
+		      int *direct_io)
 {
 	struct loop_config config = {0};
 	char *lo_file_name;
@@ -213,6 +240,10 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 		}
 	}
 
+	/* Optional, fall back to buffered I/O if not possible */
+	if (direct_io && *direct_io)
+		*direct_io = crypt_loop_set_direct_io(loop_fd);
+
 	r = 0;
 out:
 	if (r && loop_fd >= 0)
@@ -27,7 +27,8 @@
 char *crypt_loop_backing_file(const char *loop);
 int crypt_loop_device(const char *loop);
 int crypt_loop_attach(char **loop, const char *file, int offset,
-		      int autoclear, int *readonly, size_t blocksize);
+		      int autoclear, int *readonly, size_t blocksize,
+		      int *direct_io);
 int crypt_loop_detach(const char *loop);
 int crypt_loop_resize(const char *loop);
 
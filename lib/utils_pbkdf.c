@@ -61,19 +61,47 @@ const struct crypt_pbkdf_type *crypt_get_pbkdf_type_params(const char *pbkdf_typ
 	return NULL;
 }
 
-static uint32_t adjusted_phys_memory(void)
+#define MIN_AVAIL_MEMORY_KB (128 * 1024)
+
+/*
+ * PBKDF memory limit, used for both PBKDF calibration and unlock.
+ * Returns the lowest of half of physical memory, half of cgroup v2
+ * memory limit (containers, systemd slices) and available memory.
+ * Optional source describes which limit applies.
+ */
+uint32_t crypt_pbkdf_memory_limit_kb(const char **source)
 {
-	uint64_t memory_kb = crypt_getphysmemory_kb();
+	uint64_t memory_kb = crypt_getphysmemory_kb(), limit_kb;
+	const char *src = "physical memory";
 
 	/* Ignore bogus value */
-	if (memory_kb < (128 * 1024) || memory_kb > UINT32_MAX)
-		return DEFAULT_LUKS2_MEMORY_KB;
+	if (memory_kb < (128 * 1024) || memory_kb > UINT32_MAX) {
+		memory_kb = DEFAULT_LUKS2_MEMORY_KB;
+		src = "default";
+	} else {
+		/*
+		 * Never use more than half of physical memory.
+		 * OOM killer is too clever...
+		 */
+		memory_kb /= 2;
+	}
+
+	/* The same rule applies inside cgroup */
+	limit_kb = crypt_getcgroupmemory_kb() / 2;
+	if (limit_kb && limit_kb < memory_kb) {
+		memory_kb = limit_kb;
+		src = "cgroup memory limit";
+	}
+
+	/* Do not push others to swap, but ignore extremely low values */
+	limit_kb = crypt_getavailmemory_kb();
+	if (limit_kb >= MIN_AVAIL_MEMORY_KB && limit_kb < memory_kb) {
+		memory_kb = limit_kb;
+		src = "available memory";
+	}
 
-	/*
-	 * Never use more than half of physical memory.
-	 * OOM killer is too clever...
-	 */
-	memory_kb /= 2;
+	if (source)
+		*source = src;
 
 	return memory_kb;
 }
@@ -85,7 +113,8 @@ int verify_pbkdf_params(struct crypt_device *cd,
 			const struct crypt_pbkdf_type *pbkdf)
 {
 	struct crypt_pbkdf_limits pbkdf_limits;
-	const char *pbkdf_type;
+	const char *pbkdf_type, *source;
+	uint32_t memory_kb;
 	int r;
 
 	r = init_crypto(cd);
@@ -156,6 +185,11 @@ int verify_pbkdf_params(struct crypt_device *cd,
 			pbkdf_limits.max_memory);
 		r = -EINVAL;
 	}
+	/* Forced memory cost is not decreased, warn only */
+	if (!r && (pbkdf->flags & CRYPT_PBKDF_NO_BENCHMARK) &&
+	    pbkdf->max_memory_kb > (memory_kb = crypt_pbkdf_memory_limit_kb(&source)))
+		log_verbose(cd, _("Forced PBKDF memory cost %ukB is over memory limit %ukB (limited by %s)."),
+			    pbkdf->max_memory_kb, memory_kb, source);
 	if (!pbkdf->max_memory_kb) {
 		log_err(cd, _("Requested maximum PBKDF memory cannot be zero."));
 		r = -EINVAL;
@@ -174,7 +208,7 @@ int init_pbkdf_type(struct crypt_device *cd,
 {
 	struct crypt_pbkdf_type *cd_pbkdf = crypt_get_pbkdf(cd);
 	struct crypt_pbkdf_limits pbkdf_limits;
-	const char *hash, *type;
+	const char *hash, *type, *source;
 	unsigned cpus;
 	uint32_t old_flags, memory_kb;
 	int r;
@@ -249,11 +283,10 @@ int init_pbkdf_type(struct crypt_device *cd,
 	}
 
 	if (cd_pbkdf->max_memory_kb) {
-		memory_kb = adjusted_phys_memory();
+		memory_kb = crypt_pbkdf_memory_limit_kb(&source);
 		if (cd_pbkdf->max_memory_kb > memory_kb) {
-			log_dbg(cd, "Not enough physical memory detected, "
-				"PBKDF max memory decreased from %dkB to %dkB.",
-				cd_pbkdf->max_memory_kb, memory_kb);
+			log_verbose(cd, _("PBKDF max memory decreased from %ukB to %ukB (limited by %s)."),
+				    cd_pbkdf->max_memory_kb, memory_kb, source);
 			cd_pbkdf->max_memory_kb = memory_kb;
 		}
 	}
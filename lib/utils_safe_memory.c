@@ -21,17 +21,167 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/mman.h>
-#include "libcryptsetup.h"
+#include "internal.h"
 
 struct safe_allocation {
 	size_t size;
 	bool locked;
+	bool arena;
 	char data[0] __attribute__((aligned(8)));
 };
 #define OVERHEAD offsetof(struct safe_allocation, data)
 
+/*
+ * Small secrets (keys, passphrases) are allocated from one locked arena
+ * mapped and mlocked only once, so allocation needs no syscalls and
+ * RLIMIT_MEMLOCK is not consumed by page per every small allocation.
+ * Arena is split to slabs, every slab serves one chunk size class.
+ * If arena is full (or it cannot be created) the per-allocation mlock is used.
+ * If arena cannot be locked (low RLIMIT_MEMLOCK), it is used unlocked, the same
+ * way the per-allocation path ignores mlock failure.
+ * Memory locks are not inherited over fork, child locks the arena again.
+ */
+#define ARENA_SIZE	(64 * 1024)
+#define ARENA_SLAB_SIZE	4096
+#define ARENA_SLABS	(ARENA_SIZE / ARENA_SLAB_SIZE)
+#define ARENA_MIN_CHUNK	32
+#define ARENA_CLASSES	7 /* 32 - 2048 bytes chunks */
+#define ARENA_UNUSED	0xff
+
+struct arena_chunk {
+	struct arena_chunk *next;
+};
+
+static struct {
+	char *base;
+	bool initialized;
+	bool locked;
+	unsigned slabs_used;
+	uint8_t slab_class[ARENA_SLABS];
+	struct arena_chunk *free[ARENA_CLASSES];
+} arena;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void arena_atfork_prepare(void)
+{
+	pthread_mutex_lock(&arena_lock);
+}
+
+static void arena_atfork_parent(void)
+{
+	pthread_mutex_unlock(&arena_lock);
+}
+
+static void arena_atfork_child(void)
+{
+	if (arena.locked && mlock(arena.base, ARENA_SIZE))
+		arena.locked = false;
+	pthread_mutex_unlock(&arena_lock);
+}
+
+/* requires arena_lock, returns false if arena was created but not locked */
+static bool arena_init(void)
+{
+	void *base;
+
+	arena.initialized = true;
+
+	/* Without fork handlers child could inherit held lock */
+	if (pthread_atfork(arena_atfork_prepare, arena_atfork_parent, arena_atfork_child))
+		return true;
+
+	base = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return true;
+
+	arena.locked = !mlock(base, ARENA_SIZE);
+#ifdef MADV_DONTDUMP
+	(void)madvise(base, ARENA_SIZE, MADV_DONTDUMP);
+#endif
+	memset(arena.slab_class, ARENA_UNUSED, sizeof(arena.slab_class));
+	arena.base = base;
+
+	return arena.locked;
+}
+
+static int arena_class(size_t size)
+{
+	size_t chunk = ARENA_MIN_CHUNK;
+	int c;
+
+	for (c = 0; c < ARENA_CLASSES; c++, chunk <<= 1)
+		if (size <= chunk)
+			return c;
+
+	return -1;
+}
+
+static void *arena_alloc(size_t size, bool *locked)
+{
+	struct arena_chunk *chunk = NULL;
+	bool lock_failed = false;
+	size_t chunk_size;
+	unsigned i;
+	char *slab;
+	int c;
+
+	c = arena_class(size);
+	if (c < 0)
+		return NULL;
+	chunk_size = (size_t)ARENA_MIN_CHUNK << c;
+
+	pthread_mutex_lock(&arena_lock);
+	if (!arena.initialized)
+		lock_failed = !arena_init();
+
+	if (arena.base && !arena.free[c] && arena.slabs_used < ARENA_SLABS) {
+		slab = arena.base + arena.slabs_used * ARENA_SLAB_SIZE;
+		arena.slab_class[arena.slabs_used++] = c;
+		for (i = ARENA_SLAB_SIZE / chunk_size; i > 0; i--) {
+			chunk = (struct arena_chunk *)(slab + (i - 1) * chunk_size);
+			chunk->next = arena.free[c];
+			arena.free[c] = chunk;
+		}
+	}
+
+	chunk = arena.free[c];
+	if (chunk)
+		arena.free[c] = chunk->next;
+	*locked = arena.locked;
+	pthread_mutex_unlock(&arena_lock);
+
+	if (lock_failed)
+		log_dbg(NULL, "Cannot lock safe memory arena, using it unlocked.");
+
+	if (chunk)
+		crypt_safe_memzero(chunk, chunk_size);
+
+	return chunk;
+}
+
+static bool arena_owns(const void *p)
+{
+	return arena.base && (const char *)p >= arena.base &&
+	       (const char *)p < arena.base + ARENA_SIZE;
+}
+
+/* chunk is already wiped */
+static void arena_free(void *p)
+{
+	struct arena_chunk *chunk = p;
+	int c;
+
+	pthread_mutex_lock(&arena_lock);
+	c = arena.slab_class[((char *)p - arena.base) / ARENA_SLAB_SIZE];
+	chunk->next = arena.free[c];
+	arena.free[c] = chunk;
+	pthread_mutex_unlock(&arena_lock);
+}
+
 /*
  * Replacement for memset(s, 0, n) on stack that can be optimized out
  * Also used in safe allocations for explicit memory wipe.
@@ -55,10 +205,19 @@ void crypt_safe_memzero(void *data, size_t size)
 void *crypt_safe_alloc(size_t size)
 {
 	struct safe_allocation *alloc;
+	bool locked;
 
 	if (!size || size > (SIZE_MAX - OVERHEAD))
 		return NULL;
 
+	alloc = arena_alloc(size + OVERHEAD, &locked);
+	if (alloc) {
+		alloc->size = size;
+		alloc->locked = locked;
+		alloc->arena = true;
+		return &alloc->data;
+	}
+
 	alloc = malloc(size + OVERHEAD);
 	if (!alloc)
 		return NULL;
@@ -88,6 +247,12 @@ void crypt_safe_free(void *data)
 
 	crypt_safe_memzero(data, alloc->size);
 
+	if (alloc->arena && arena_owns(alloc)) {
+		crypt_safe_memzero(alloc, OVERHEAD);
+		arena_free(alloc);
+		return;
+	}
+
 	if (alloc->locked) {
 		munlock(alloc, alloc->size + OVERHEAD);
 		alloc->locked = false;
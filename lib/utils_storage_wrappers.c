@@ -25,22 +25,34 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "utils_storage_wrappers.h"
+#include "utils_uring.h"
 #include "internal.h"
 
+/* io_uring queue depth and size of single request */
+#define STORAGE_URING_DEPTH	32
+#define STORAGE_URING_CHUNK	(1024 * 1024)
+
 struct crypt_storage_wrapper {
 	crypt_storage_wrapper_type type;
 	int dev_fd;
 	int block_size;
 	size_t mem_alignment;
 	uint64_t data_offset;
+	struct crypt_uring *ring;
 	union {
 	struct {
 		struct crypt_storage *s;
 		uint64_t iv_start;
+		size_t sector_size;
+		unsigned threads;
+		struct crypt_storage **ts; /* per-thread contexts, ts[0] == s */
+		unsigned *tnode;	   /* NUMA_LOCAL: node of thread (and its buffer part) */
+		cpu_set_t *tcpus;	   /* NUMA_LOCAL: CPUs of thread node */
 	} cb;
 	struct {
 		int dmcrypt_fd;
@@ -49,6 +61,167 @@ struct crypt_storage_wrapper {
 	} u;
 };
 
+/* thread work unit must not be smaller than this (in bytes) */
+#define STORAGE_THREAD_MIN_LENGTH (256 * 1024)
+#define STORAGE_THREADS_MAX 128
+
+struct storage_job {
+	struct crypt_thread thread;
+	const cpu_set_t *cpus;
+	struct crypt_storage *s;
+	uint64_t iv_offset;
+	uint64_t length;
+	char *buffer;
+	bool encrypt;
+	bool started;
+	int r;
+	/* write encrypted part directly, regions are written concurrently */
+	struct crypt_storage_wrapper *cw;
+	off_t write_offset;
+};
+
+static void *storage_job_run(void *arg)
+{
+	struct storage_job *job = arg;
+	cpu_set_t saved;
+	bool pinned = false;
+
+	/* worker may be a pooled thread, restore its affinity afterwards */
+	if (job->cpus && !pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved))
+		pinned = !pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), job->cpus);
+
+	if (job->encrypt)
+		job->r = crypt_storage_encrypt(job->s, job->iv_offset, job->length, job->buffer);
+	else
+		job->r = crypt_storage_decrypt(job->s, job->iv_offset, job->length, job->buffer);
+
+	if (!job->r && job->cw &&
+	    pwrite_blockwise(job->cw->dev_fd, job->cw->block_size, job->cw->mem_alignment, NULL,
+			     job->buffer, job->length, job->write_offset) != (ssize_t)job->length)
+		job->r = -EIO;
+
+	if (pinned)
+		(void)pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+
+	return NULL;
+}
+
+/*
+ * All IV generators supported by crypt_storage are derived from sector
+ * number only, so the buffer can be split in sector aligned parts
+ * processed in parallel, each with its own cipher context.
+ *
+ * With @written set, encryption may also write every part to the device
+ * from its thread, so writes of parts overlap with encryption of others.
+ * This is done only if parts are aligned to device blocks (no partial block
+ * read-modify-write can overlap), *written reports whether data was written.
+ */
+static int crypt_storage_backend_process(struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length, char *buffer, bool encrypt, bool *written)
+{
+	struct storage_job *jobs, job = {
+		.s = cw->u.cb.s,
+		.iv_offset = cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
+		.length = length,
+		.buffer = buffer,
+		.encrypt = encrypt
+	};
+	unsigned i, threads = cw->u.cb.threads;
+	size_t chunk, done;
+	int r = 0;
+
+	if (threads > length / STORAGE_THREAD_MIN_LENGTH)
+		threads = length / STORAGE_THREAD_MIN_LENGTH;
+
+	if (threads < 2 || (length % cw->u.cb.sector_size)) {
+		storage_job_run(&job);
+		return job.r;
+	}
+
+	jobs = calloc(threads, sizeof(*jobs));
+	if (!jobs) {
+		storage_job_run(&job);
+		return job.r;
+	}
+
+	chunk = length / threads;
+	chunk -= chunk % cw->u.cb.sector_size;
+
+	if (written)
+		*written = encrypt && !MISALIGNED(chunk, cw->block_size) &&
+			   !MISALIGNED(cw->data_offset + offset, cw->block_size);
+
+	for (i = 0, done = 0; i < threads; i++, done += chunk) {
+		jobs[i].s = cw->u.cb.ts[i];
+		jobs[i].iv_offset = cw->u.cb.iv_start + ((offset + done) >> SECTOR_SHIFT);
+		jobs[i].length = (i == threads - 1) ? length - done : chunk;
+		jobs[i].buffer = buffer + done;
+		jobs[i].encrypt = encrypt;
+		if (written && *written) {
+			jobs[i].cw = cw;
+			jobs[i].write_offset = cw->data_offset + offset + done;
+		}
+	}
+
+	/* first part is processed in the calling thread */
+	for (i = 1; i < threads; i++) {
+		if (cw->u.cb.tcpus) {
+			(void)crypt_numa_memory_bind(jobs[i].buffer, jobs[i].length, cw->u.cb.tnode[i]);
+			jobs[i].cpus = &cw->u.cb.tcpus[i];
+		}
+		jobs[i].started = !crypt_thread_start(&jobs[i].thread, storage_job_run, &jobs[i], 0);
+		if (!jobs[i].started)
+			storage_job_run(&jobs[i]);
+	}
+
+	storage_job_run(&jobs[0]);
+
+	for (i = 0; i < threads; i++) {
+		if (jobs[i].started)
+			crypt_thread_join(&jobs[i].thread);
+		if (jobs[i].r && !r)
+			r = jobs[i].r;
+	}
+
+	free(jobs);
+	return r;
+}
+
+/*
+ * Worker threads are spread over NUMA nodes (round robin, the calling
+ * thread keeps its own placement) and each worker part of the buffer
+ * is moved to the node of its worker.
+ */
+static void storage_numa_init(struct crypt_device *cd, struct crypt_storage_wrapper *w)
+{
+	unsigned nodes[CRYPT_NUMA_MAX_NODES], i;
+	int count;
+
+	count = crypt_numa_nodes(nodes, CRYPT_NUMA_MAX_NODES);
+	if (count < 2 || w->u.cb.threads < 2)
+		return;
+
+	w->u.cb.tnode = calloc(w->u.cb.threads, sizeof(*w->u.cb.tnode));
+	w->u.cb.tcpus = calloc(w->u.cb.threads, sizeof(*w->u.cb.tcpus));
+	if (!w->u.cb.tnode || !w->u.cb.tcpus)
+		goto fail;
+
+	for (i = 0; i < w->u.cb.threads; i++) {
+		w->u.cb.tnode[i] = nodes[i % count];
+		if (crypt_numa_node_cpus(w->u.cb.tnode[i], &w->u.cb.tcpus[i]))
+			goto fail;
+	}
+
+	log_dbg(cd, "Userspace block cipher threads spread over %d NUMA nodes.", count);
+	return;
+fail:
+	log_dbg(cd, "Cannot set NUMA placement for userspace block cipher threads.");
+	free(w->u.cb.tnode);
+	free(w->u.cb.tcpus);
+	w->u.cb.tnode = NULL;
+	w->u.cb.tcpus = NULL;
+}
+
 static int crypt_storage_backend_init(struct crypt_device *cd,
 		struct crypt_storage_wrapper *w,
 		uint64_t iv_start,
@@ -56,9 +229,11 @@ static int crypt_storage_backend_init(struct crypt_device *cd,
 		const char *cipher,
 		const char *cipher_mode,
 		const struct volume_key *vk,
-		uint32_t flags)
+		uint32_t flags,
+		unsigned threads)
 {
 	int r;
+	unsigned i;
 	struct crypt_storage *s;
 
 	/* iv_start, sector_size */
@@ -75,6 +250,31 @@ static int crypt_storage_backend_init(struct crypt_device *cd,
 	w->type = USPACE;
 	w->u.cb.s = s;
 	w->u.cb.iv_start = iv_start;
+	w->u.cb.sector_size = sector_size;
+	w->u.cb.threads = 1;
+
+	if (threads > STORAGE_THREADS_MAX)
+		threads = STORAGE_THREADS_MAX;
+
+	if (threads < 2)
+		return 0;
+
+	w->u.cb.ts = calloc(threads, sizeof(*w->u.cb.ts));
+	if (!w->u.cb.ts)
+		return 0;
+
+	w->u.cb.ts[0] = s;
+	for (i = 1; i < threads; i++) {
+		if (crypt_storage_init(&w->u.cb.ts[i], sector_size, cipher, cipher_mode,
+				       vk->key, vk->keylength, flags & LARGE_IV))
+			break;
+	}
+
+	w->u.cb.threads = i;
+	log_dbg(cd, "Using %u threads for userspace block cipher.", i);
+
+	if (flags & NUMA_LOCAL)
+		storage_numa_init(cd, w);
 
 	return 0;
 }
@@ -156,7 +356,7 @@ static int crypt_storage_dmcrypt_init(
 	return 0;
 }
 
-int crypt_storage_wrapper_init(struct crypt_device *cd,
+int crypt_storage_wrapper_init_threads(struct crypt_device *cd,
 	struct crypt_storage_wrapper **cw,
 	struct device *device,
 	uint64_t data_offset,
@@ -164,7 +364,8 @@ int crypt_storage_wrapper_init(struct crypt_device *cd,
 	int sector_size,
 	const char *cipher,
 	struct volume_key *vk,
-	uint32_t flags)
+	uint32_t flags,
+	unsigned threads)
 {
 	int open_flags, r;
 	char _cipher[MAX_CIPHER_LEN], mode[MAX_CIPHER_LEN];
@@ -199,6 +400,9 @@ int crypt_storage_wrapper_init(struct crypt_device *cd,
 		goto err;
 	}
 
+	if (!crypt_uring_init(&w->ring, w->dev_fd, STORAGE_URING_DEPTH))
+		log_dbg(cd, "Using io_uring for data device I/O.");
+
 	if (crypt_is_cipher_null(_cipher)) {
 		log_dbg(cd, "Requested cipher_null, switching to noop wrapper.");
 		w->type = NONE;
@@ -212,7 +416,7 @@ int crypt_storage_wrapper_init(struct crypt_device *cd,
 		goto err;
 	}
 
-	r = crypt_storage_backend_init(cd, w, iv_start, sector_size, _cipher, mode, vk, flags);
+	r = crypt_storage_backend_init(cd, w, iv_start, sector_size, _cipher, mode, vk, flags, threads);
 	if (!r) {
 		*cw = w;
 		return 0;
@@ -237,16 +441,60 @@ err:
 	return r;
 }
 
+/* Bulk aligned I/O goes through io_uring if available, otherwise (or on error) blockwise */
+static ssize_t storage_read(struct crypt_storage_wrapper *cw, void *buffer,
+		size_t length, off_t offset)
+{
+	ssize_t r;
+
+	if (cw->ring && !MISALIGNED(offset, cw->block_size) &&
+	    !MISALIGNED(length, cw->block_size) &&
+	    !MISALIGNED((uintptr_t)buffer, cw->mem_alignment)) {
+		r = crypt_uring_rw(cw->ring, false, buffer, length, offset, STORAGE_URING_CHUNK);
+		if (r == (ssize_t)length || r == -ENOTRECOVERABLE)
+			return r;
+	}
+
+	return read_lseek_blockwise(cw->dev_fd, cw->block_size, cw->mem_alignment,
+			buffer, length, offset);
+}
+
+static ssize_t storage_write(struct crypt_storage_wrapper *cw, void *buffer,
+		size_t length, off_t offset)
+{
+	ssize_t r;
+
+	if (cw->ring && !MISALIGNED(offset, cw->block_size) &&
+	    !MISALIGNED(length, cw->block_size) &&
+	    !MISALIGNED((uintptr_t)buffer, cw->mem_alignment)) {
+		r = crypt_uring_rw(cw->ring, true, buffer, length, offset, STORAGE_URING_CHUNK);
+		if (r == (ssize_t)length || r == -ENOTRECOVERABLE)
+			return r;
+	}
+
+	return write_lseek_blockwise(cw->dev_fd, cw->block_size, cw->mem_alignment,
+			buffer, length, offset);
+}
+
+int crypt_storage_wrapper_init(struct crypt_device *cd,
+	struct crypt_storage_wrapper **cw,
+	struct device *device,
+	uint64_t data_offset,
+	uint64_t iv_start,
+	int sector_size,
+	const char *cipher,
+	struct volume_key *vk,
+	uint32_t flags)
+{
+	return crypt_storage_wrapper_init_threads(cd, cw, device, data_offset,
+			iv_start, sector_size, cipher, vk, flags, 1);
+}
+
 /* offset is relative to sector_start */
 ssize_t crypt_storage_wrapper_read(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
-	return read_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
-			cw->data_offset + offset);
+	return storage_read(cw, buffer, buffer_length, cw->data_offset + offset);
 }
 
 ssize_t crypt_storage_wrapper_read_decrypt(struct crypt_storage_wrapper *cw,
@@ -263,19 +511,11 @@ ssize_t crypt_storage_wrapper_read_decrypt(struct crypt_storage_wrapper *cw,
 				buffer_length,
 				offset);
 
-	read = read_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
-			cw->data_offset + offset);
+	read = storage_read(cw, buffer, buffer_length, cw->data_offset + offset);
 	if (cw->type == NONE || read < 0)
 		return read;
 
-	r = crypt_storage_decrypt(cw->u.cb.s,
-			cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
-			read,
-			buffer);
+	r = crypt_storage_backend_process(cw, offset, read, buffer, false, NULL);
 	if (r)
 		return -EINVAL;
 
@@ -299,10 +539,7 @@ ssize_t crypt_storage_wrapper_decrypt(struct crypt_storage_wrapper *cw,
 		return 0;
 	}
 
-	r = crypt_storage_decrypt(cw->u.cb.s,
-			cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
-			buffer_length,
-			buffer);
+	r = crypt_storage_backend_process(cw, offset, buffer_length, buffer, false, NULL);
 	if (r)
 		return r;
 
@@ -312,12 +549,7 @@ ssize_t crypt_storage_wrapper_decrypt(struct crypt_storage_wrapper *cw,
 ssize_t crypt_storage_wrapper_write(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
-	return write_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
-			cw->data_offset + offset);
+	return storage_write(cw, buffer, buffer_length, cw->data_offset + offset);
 }
 
 ssize_t crypt_storage_wrapper_encrypt_write(struct crypt_storage_wrapper *cw,
@@ -331,18 +563,16 @@ ssize_t crypt_storage_wrapper_encrypt_write(struct crypt_storage_wrapper *cw,
 				buffer_length,
 				offset);
 
+	bool written = false;
+
 	if (cw->type == USPACE &&
-	    crypt_storage_encrypt(cw->u.cb.s,
-		    cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
-		    buffer_length, buffer))
+	    crypt_storage_backend_process(cw, offset, buffer_length, buffer, true, &written))
 		return -EINVAL;
 
-	return write_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
-			cw->data_offset + offset);
+	if (written)
+		return buffer_length;
+
+	return storage_write(cw, buffer, buffer_length, cw->data_offset + offset);
 }
 
 ssize_t crypt_storage_wrapper_encrypt(struct crypt_storage_wrapper *cw,
@@ -354,10 +584,7 @@ ssize_t crypt_storage_wrapper_encrypt(struct crypt_storage_wrapper *cw,
 	if (cw->type == DMCRYPT)
 		return -ENOTSUP;
 
-	if (crypt_storage_encrypt(cw->u.cb.s,
-			cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
-			buffer_length,
-			buffer))
+	if (crypt_storage_backend_process(cw, offset, buffer_length, buffer, true, NULL))
 		return -EINVAL;
 
 	return 0;
@@ -365,11 +592,21 @@ ssize_t crypt_storage_wrapper_encrypt(struct crypt_storage_wrapper *cw,
 
 void crypt_storage_wrapper_destroy(struct crypt_storage_wrapper *cw)
 {
+	unsigned i;
+
 	if (!cw)
 		return;
 
-	if (cw->type == USPACE)
+	if (cw->type == USPACE) {
+		for (i = 1; cw->u.cb.ts && i < cw->u.cb.threads; i++)
+			crypt_storage_destroy(cw->u.cb.ts[i]);
+		free(cw->u.cb.ts);
+		free(cw->u.cb.tnode);
+		free(cw->u.cb.tcpus);
 		crypt_storage_destroy(cw->u.cb.s);
+	}
+	crypt_uring_destroy(cw->ring);
+
 	if (cw->type == DMCRYPT) {
 		close(cw->u.dm.dmcrypt_fd);
 		dm_remove_device(NULL, cw->u.dm.name, CRYPT_DEACTIVATE_FORCE);
@@ -388,6 +625,38 @@ int crypt_storage_wrapper_datasync(const struct crypt_storage_wrapper *cw)
 		return fdatasync(cw->dev_fd);
 }
 
+int crypt_storage_wrapper_is_hole(struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length)
+{
+	if (!cw || cw->type != NONE)
+		return 0;
+
+	return range_is_hole(cw->dev_fd, cw->data_offset + offset, length);
+}
+
+int crypt_storage_wrapper_set_data_offset(struct crypt_storage_wrapper *cw,
+		uint64_t data_offset)
+{
+	if (!cw || (data_offset & ((1 << SECTOR_SHIFT) - 1)))
+		return -EINVAL;
+
+	/* dm-crypt table has the offset built in */
+	if (cw->type == DMCRYPT)
+		return -ENOTSUP;
+
+	cw->data_offset = data_offset;
+	return 0;
+}
+
+int crypt_storage_wrapper_register_buffers(struct crypt_storage_wrapper *cw,
+		const struct iovec *iov, unsigned count)
+{
+	if (!cw || !cw->ring)
+		return -ENOTSUP;
+
+	return crypt_uring_register_buffers(cw->ring, iov, count);
+}
+
 crypt_storage_wrapper_type crypt_storage_wrapper_get_type(const struct crypt_storage_wrapper *cw)
 {
 	return cw ? cw->type : NONE;
@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 struct crypt_storage_wrapper;
 struct device;
@@ -35,6 +36,7 @@ struct crypt_device;
 #define DISABLE_DMCRYPT	(1 << 2)
 #define OPEN_READONLY	(1 << 3)
 #define LARGE_IV	(1 << 4)
+#define NUMA_LOCAL	(1 << 5)
 
 typedef enum {
 	NONE = 0,
@@ -52,6 +54,17 @@ int crypt_storage_wrapper_init(struct crypt_device *cd,
 	struct volume_key *vk,
 	uint32_t flags);
 
+int crypt_storage_wrapper_init_threads(struct crypt_device *cd,
+	struct crypt_storage_wrapper **cw,
+	struct device *device,
+	uint64_t data_offset,
+	uint64_t iv_start,
+	int sector_size,
+	const char *cipher,
+	struct volume_key *vk,
+	uint32_t flags,
+	unsigned threads);
+
 void crypt_storage_wrapper_destroy(struct crypt_storage_wrapper *cw);
 
 /* !!! when doing 'read' or 'write' all offset values are RELATIVE to data_offset !!! */
@@ -71,5 +84,20 @@ ssize_t crypt_storage_wrapper_encrypt(struct crypt_storage_wrapper *cw,
 
 int crypt_storage_wrapper_datasync(const struct crypt_storage_wrapper *cw);
 
+/* plaintext (noop) wrapper only, 1 if whole range is not allocated */
+int crypt_storage_wrapper_is_hole(struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length);
+
+/*
+ * Move the wrapper to another data offset (same device, cipher, key and IVs),
+ * cipher contexts and registered buffers are kept. -ENOTSUP for dm-crypt type.
+ */
+int crypt_storage_wrapper_set_data_offset(struct crypt_storage_wrapper *cw,
+		uint64_t data_offset);
+
+/* optional, only with io_uring enabled */
+int crypt_storage_wrapper_register_buffers(struct crypt_storage_wrapper *cw,
+		const struct iovec *iov, unsigned count);
+
 crypt_storage_wrapper_type crypt_storage_wrapper_get_type(const struct crypt_storage_wrapper *cw);
 #endif
@@ -0,0 +1,60 @@
+/*
+ * Static trace points (USDT probes) of libcryptsetup
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UTILS_TRACE_H
+#define _UTILS_TRACE_H
+
+/*
+ * Probes are compiled in only with --enable-usdt (provider "libcryptsetup"),
+ * e.g. "bpftrace -e 'usdt:libcryptsetup.so:libcryptsetup:kdf_end { ... }'".
+ * A disabled probe is a nop instruction, arguments are evaluated only
+ * when a tracer is attached. Without USDT support the macros expand to nothing.
+ *
+ * metadata_read, metadata_write	(const char *type, const char *device, int r)
+ * kdf_start			(const char *kdf, uint32_t iterations, uint32_t memory_kb, uint32_t threads)
+ * kdf_end			(const char *kdf, int r)
+ * dm_ioctl			(int task, int r)
+ * token_open			(int token, uint64_t open_us, int r)
+ */
+#if USE_USDT
+#include <sys/sdt.h>
+
+#define trace_metadata_read(type, device, r) \
+	DTRACE_PROBE3(libcryptsetup, metadata_read, type, device, r)
+#define trace_metadata_write(type, device, r) \
+	DTRACE_PROBE3(libcryptsetup, metadata_write, type, device, r)
+#define trace_kdf_start(kdf, iterations, memory_kb, threads) \
+	DTRACE_PROBE4(libcryptsetup, kdf_start, kdf, iterations, memory_kb, threads)
+#define trace_kdf_end(kdf, r) \
+	DTRACE_PROBE2(libcryptsetup, kdf_end, kdf, r)
+#define trace_dm_ioctl(task, r) \
+	DTRACE_PROBE2(libcryptsetup, dm_ioctl, task, r)
+#define trace_token_open(token, open_us, r) \
+	DTRACE_PROBE3(libcryptsetup, token_open, token, open_us, r)
+#else
+#define trace_metadata_read(type, device, r)			do {} while (0)
+#define trace_metadata_write(type, device, r)			do {} while (0)
+#define trace_kdf_start(kdf, iterations, memory_kb, threads)	do {} while (0)
+#define trace_kdf_end(kdf, r)					do {} while (0)
+#define trace_dm_ioctl(task, r)					do {} while (0)
+#define trace_token_open(token, open_us, r)			do {} while (0)
+#endif
+
+#endif
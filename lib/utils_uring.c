@@ -0,0 +1,368 @@
+/*
+ * io_uring helpers for bulk data I/O
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils_uring.h"
+
+#if USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring implementation using raw syscalls (no liburing dependency).
+ * Only what bulk sequential I/O needs: one fixed file, optional fixed buffers.
+ */
+struct crypt_uring {
+	int ring_fd;
+	int fd;
+	bool fixed_file;
+	unsigned depth;
+
+	void *sq_ptr;
+	size_t sq_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	void *cq_ptr;
+	size_t cq_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct iovec bufs[CRYPT_URING_MAX_BUFFERS];
+	unsigned nbufs;
+
+	/* requests submitted to kernel and not reaped after a failed wait */
+	unsigned inflight;
+};
+
+static int _io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int _io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int crypt_uring_init(struct crypt_uring **ring, int fd, unsigned depth)
+{
+	struct io_uring_params p;
+	struct crypt_uring *u;
+	int r;
+
+	if (!ring || fd < 0 || !depth)
+		return -EINVAL;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -ENOMEM;
+
+	u->fd = fd;
+	u->sq_ptr = u->cq_ptr = u->sqes = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = _io_uring_setup(depth, &p);
+	if (u->ring_fd < 0) {
+		r = -errno;
+		free(u);
+		return r;
+	}
+
+	u->depth = p.sq_entries;
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = 0;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto err;
+
+	if (u->cq_len) {
+		u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED)
+			goto err;
+	}
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err;
+
+	u->sq_head  = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail  = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask  = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+
+	/* with single mmap CQ ring lives in the SQ ring mapping */
+	if (!u->cq_len)
+		u->cq_ptr = u->sq_ptr;
+	u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes    = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+
+	/* fixed file is an optimization only */
+	u->fixed_file = !_io_uring_register(u->ring_fd, IORING_REGISTER_FILES, &fd, 1);
+
+	*ring = u;
+	return 0;
+err:
+	r = -errno;
+	crypt_uring_destroy(u);
+	return r ?: -EINVAL;
+}
+
+/*
+ * Wait until kernel completes all requests it consumed from SQ ring, so
+ * their buffers can be used again. Entries not consumed yet are dropped
+ * (without SQPOLL kernel takes them only in io_uring_enter).
+ */
+static int uring_drain(struct crypt_uring *ring)
+{
+	unsigned head, tail, queued;
+
+	tail = *ring->sq_tail;
+	queued = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(ring->sq_tail, tail - queued, __ATOMIC_RELEASE);
+	ring->inflight -= queued;
+
+	while (ring->inflight) {
+		head = *ring->cq_head;
+		while (ring->inflight && head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			head++;
+			ring->inflight--;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (ring->inflight && _io_uring_enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR && errno != EAGAIN)
+			return -errno;
+	}
+
+	return 0;
+}
+
+void crypt_uring_destroy(struct crypt_uring *ring)
+{
+	if (!ring)
+		return;
+
+	/* last attempt, kernel must not write to buffers after they are freed */
+	if (ring->inflight)
+		(void)uring_drain(ring);
+
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_len && ring->cq_ptr != MAP_FAILED)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->ring_fd >= 0)
+		close(ring->ring_fd);
+
+	free(ring);
+}
+
+int crypt_uring_register_buffers(struct crypt_uring *ring, const struct iovec *iov, unsigned count)
+{
+	if (!ring || !iov || !count || count > CRYPT_URING_MAX_BUFFERS)
+		return -EINVAL;
+
+	if (ring->nbufs && _io_uring_register(ring->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0))
+		return -errno;
+	ring->nbufs = 0;
+
+	if (_io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, iov, count))
+		return -errno;
+
+	memcpy(ring->bufs, iov, count * sizeof(*iov));
+	ring->nbufs = count;
+
+	return 0;
+}
+
+static int uring_fixed_buffer(struct crypt_uring *ring, const void *buf, size_t len)
+{
+	const char *p = buf;
+	unsigned i;
+
+	for (i = 0; i < ring->nbufs; i++)
+		if (p >= (const char *)ring->bufs[i].iov_base &&
+		    p + len <= (const char *)ring->bufs[i].iov_base + ring->bufs[i].iov_len)
+			return (int)i;
+
+	return -1;
+}
+
+static void uring_queue(struct crypt_uring *ring, bool write, void *buf,
+			size_t len, off_t offset, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+	int buf_index;
+
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	buf_index = uring_fixed_buffer(ring, buf, len);
+	if (buf_index >= 0) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = (uint16_t)buf_index;
+	} else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	if (ring->fixed_file) {
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+	} else
+		sqe->fd = ring->fd;
+
+	sqe->off = (uint64_t)offset;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->user_data = user_data;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+ssize_t crypt_uring_rw(struct crypt_uring *ring, bool write,
+		       void *buffer, size_t length, off_t offset, size_t chunk)
+{
+	struct io_uring_cqe *cqe;
+	size_t chunks, submitted = 0, completed = 0, len;
+	unsigned head, inflight = 0, to_submit;
+	int r, err = 0;
+
+	if (!ring || !buffer || !chunk || offset < 0)
+		return -EINVAL;
+
+	if (!length)
+		return 0;
+
+	/* previous requests still may use any buffer */
+	if (ring->inflight && uring_drain(ring))
+		return -ENOTRECOVERABLE;
+
+	chunks = (length + chunk - 1) / chunk;
+
+	while (completed < chunks) {
+		while (!err && inflight < ring->depth && submitted < chunks) {
+			len = length - submitted * chunk;
+			if (len > chunk)
+				len = chunk;
+			uring_queue(ring, write, (char *)buffer + submitted * chunk, len,
+				    offset + (off_t)(submitted * chunk), submitted);
+			submitted++;
+			inflight++;
+		}
+
+		if (!inflight)
+			break;
+
+		/* kernel advances SQ head for consumed entries */
+		to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+		r = _io_uring_enter(ring->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			r = -errno;
+
+			/* requests in kernel must finish before the buffer is used again */
+			ring->inflight = inflight;
+			if (uring_drain(ring))
+				return -ENOTRECOVERABLE;
+			return r;
+		}
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+
+			len = length - cqe->user_data * chunk;
+			if (len > chunk)
+				len = chunk;
+
+			if (cqe->res < 0) {
+				if (!err)
+					err = cqe->res;
+			} else if ((size_t)cqe->res != len && !err)
+				err = -EIO;
+
+			head++;
+			inflight--;
+			completed++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return err ?: (ssize_t)length;
+}
+#else
+int crypt_uring_init(struct crypt_uring **ring, int fd, unsigned depth)
+{
+	return -ENOTSUP;
+}
+
+void crypt_uring_destroy(struct crypt_uring *ring)
+{
+}
+
+int crypt_uring_register_buffers(struct crypt_uring *ring, const struct iovec *iov, unsigned count)
+{
+	return -ENOTSUP;
+}
+
+ssize_t crypt_uring_rw(struct crypt_uring *ring, bool write,
+		       void *buffer, size_t length, off_t offset, size_t chunk)
+{
+	return -ENOTSUP;
+}
+#endif
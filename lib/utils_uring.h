@@ -0,0 +1,53 @@
+/*
+ * io_uring helpers for bulk data I/O
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UTILS_URING_H
+#define _UTILS_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct crypt_uring;
+
+#define CRYPT_URING_MAX_BUFFERS 4
+
+/*
+ * Ring is bound to single (fixed) file descriptor.
+ * All functions return -ENOTSUP if io_uring support is not compiled in.
+ */
+int crypt_uring_init(struct crypt_uring **ring, int fd, unsigned depth);
+void crypt_uring_destroy(struct crypt_uring *ring);
+
+int crypt_uring_register_buffers(struct crypt_uring *ring, const struct iovec *iov, unsigned count);
+
+/*
+ * Bulk read or write split in chunks kept in flight concurrently.
+ * Offset, length and buffer must be aligned to device block size.
+ * Returns length on success, negative errno otherwise (caller may retry
+ * with other I/O method). Returns -ENOTRECOVERABLE if some requests could
+ * not be reaped and kernel may still access the buffer; then the buffer
+ * and the ring must not be used and the caller must not retry.
+ */
+ssize_t crypt_uring_rw(struct crypt_uring *ring, bool write,
+		       void *buffer, size_t length, off_t offset, size_t chunk);
+
+#endif
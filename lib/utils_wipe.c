@@ -22,36 +22,151 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <linux/fs.h>
 #include "internal.h"
+#include "utils_uring.h"
 
 /* block device zeroout ioctls, introduced in Linux kernel 3.7 */
 #ifndef BLKZEROOUT
 #define BLKZEROOUT _IO(0x12,127)
 #endif
 
-static int wipe_zeroout(struct crypt_device *cd, int devfd,
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+
+/* io_uring queue depth and size of single request for wipe block */
+#define WIPE_URING_DEPTH	16
+#define WIPE_URING_CHUNK	(64 * 1024)
+
+/* upper limit for parallel wipe writers, every one has its own region */
+#define WIPE_MAX_THREADS	64
+
+/* number of blocks read back after discard (one from every part of the area) */
+#define WIPE_DISCARD_SAMPLES	16
+
+static int wipe_zeroout(struct crypt_device *cd, struct device *device, int devfd,
 			uint64_t offset, uint64_t length)
 {
-	static bool zeroout_available = true;
 	uint64_t range[2] = { offset, length };
 	int r;
 
-	if (!zeroout_available)
+	if (device_zeroout_disabled(device))
 		return -ENOTSUP;
 
 	r = ioctl(devfd, BLKZEROOUT, &range);
 	if (r < 0) {
-		log_dbg(cd, "BLKZEROOUT ioctl not available (error %i), disabling.", r);
-		zeroout_available = false;
+		log_dbg(cd, "BLKZEROOUT ioctl not available (error %i) on %s, disabling.",
+			r, device_path(device));
+		device_disable_zeroout(device);
 		return -ENOTSUP;
 	}
 
 	return 0;
 }
 
+static bool block_is_zero(const char *buf, size_t size)
+{
+	while (size--)
+		if (*buf++)
+			return false;
+	return true;
+}
+
+/*
+ * Read back one random block from every part of the area
+ * to confirm it reads as zeroes (after discard or zone reset).
+ */
+static int wipe_verify_zeroes(struct crypt_device *cd, int devfd, size_t bsize,
+			      size_t alignment, uint64_t offset, uint64_t length)
+{
+	uint64_t blocks = length / bsize, part, block;
+	unsigned int i, samples = WIPE_DISCARD_SAMPLES;
+	uint32_t rnd;
+	char *buf = NULL;
+	int r = -ENOTSUP;
+
+	if (posix_memalign((void **)&buf, alignment, bsize))
+		return -ENOMEM;
+
+	if (samples > blocks)
+		samples = blocks;
+	part = blocks / samples;
+
+	for (i = 0; i < samples; i++) {
+		if (crypt_random_get(cd, (char *)&rnd, sizeof(rnd), CRYPT_RND_NORMAL) < 0)
+			goto out;
+		/* the last part contains the remaining blocks as well */
+		block = i * part + rnd % (i == samples - 1 ? blocks - i * part : part);
+
+		if (read_lseek_blockwise(devfd, bsize, alignment, buf, bsize,
+					 offset + block * bsize) != (ssize_t)bsize ||
+		    !block_is_zero(buf, bsize)) {
+			log_dbg(cd, "Block %" PRIu64 " does not read as zeroes, using explicit wipe.",
+				block);
+			goto out;
+		}
+	}
+
+	log_dbg(cd, "Area cleared, %u sampled blocks verified.", samples);
+	r = 0;
+out:
+	free(buf);
+	return r;
+}
+
+/*
+ * Discard the whole area if the device guarantees zeroes on read afterwards.
+ * Returns -ENOTSUP if area needs to be written explicitly.
+ */
+static int wipe_discard(struct crypt_device *cd, struct device *device, int devfd,
+			size_t bsize, size_t alignment, uint64_t offset, uint64_t length)
+{
+	uint64_t range[2] = { offset, length };
+
+	if (MISALIGNED(offset, bsize) || MISALIGNED(length, bsize) || !(length / bsize))
+		return -ENOTSUP;
+
+	if (device_discard_zeroes(device) != 1) {
+		log_dbg(cd, "Device %s does not guarantee zeroes after discard.", device_path(device));
+		return -ENOTSUP;
+	}
+
+	if (ioctl(devfd, BLKDISCARD, &range) < 0) {
+		log_dbg(cd, "BLKDISCARD ioctl failed (error %i) on %s.", -errno, device_path(device));
+		return -ENOTSUP;
+	}
+
+	return wipe_verify_zeroes(cd, devfd, bsize, alignment, offset, length);
+}
+
+/*
+ * Reset all zones of zone aligned area on zoned device. Empty zones
+ * can be written sequentially from the start afterwards, zero wipe
+ * is complete if the reset zones read as zeroes.
+ * Returns -ENOTSUP if the area cannot be reset.
+ */
+static int wipe_zone_reset(struct crypt_device *cd, struct device *device, int devfd,
+			   size_t bsize, size_t alignment, uint64_t offset, uint64_t length,
+			   bool verify)
+{
+	int r;
+
+	if (MISALIGNED(offset, bsize) || MISALIGNED(length, bsize) || !(length / bsize))
+		return -ENOTSUP;
+
+	r = device_zone_reset(cd, device, offset, length);
+	if (r)
+		return -ENOTSUP;
+
+	log_dbg(cd, "Zones of wiped area reset on %s.", device_path(device));
+
+	return verify ? wipe_verify_zeroes(cd, devfd, bsize, alignment, offset, length) : 0;
+}
+
 /*
  * Wipe using Peter Gutmann method described in
  * https://www.cs.auckland.ac.nz/~pgut001/pubs/secure_del.html
@@ -79,9 +194,37 @@ static void wipeSpecial(char *buffer, size_t buffer_size, unsigned int turn)
 	}
 }
 
+/*
+ * Bulk random data for wipe are generated by ChaCha20 keystream, keyed once
+ * from the system RNG; reading the RNG for every block is too slow.
+ */
+static int wipe_rng_init(struct crypt_device *cd, struct crypt_chacha20 **rng)
+{
+	char seed[32 + 8];
+	int r;
+
+	if (crypt_random_get(cd, seed, sizeof(seed), CRYPT_RND_NORMAL) < 0)
+		return -EIO;
+
+	r = crypt_chacha20_init(rng, seed, 32, &seed[32], 8);
+	crypt_safe_memzero(seed, sizeof(seed));
+
+	return r;
+}
+
+static int wipe_random(struct crypt_device *cd, struct crypt_chacha20 *rng,
+		       char *buffer, size_t size)
+{
+	if (!rng)
+		return crypt_random_get(cd, buffer, size, CRYPT_RND_NORMAL) < 0 ? -EIO : 0;
+
+	crypt_chacha20_keystream(rng, buffer, size);
+	return 0;
+}
+
 static int crypt_wipe_special(struct crypt_device *cd, int fd, size_t bsize,
 			      size_t alignment, char *buffer,
-			      uint64_t offset, size_t size)
+			      uint64_t offset, size_t size, struct crypt_chacha20 *rng)
 {
 	int r = 0;
 	unsigned int i;
@@ -89,12 +232,12 @@ static int crypt_wipe_special(struct crypt_device *cd, int fd, size_t bsize,
 
 	for (i = 0; i < 39; ++i) {
 		if (i <  5) {
-			r = crypt_random_get(cd, buffer, size, CRYPT_RND_NORMAL);
+			r = wipe_random(cd, rng, buffer, size);
 		} else if (i >=  5 && i < 32) {
 			wipeSpecial(buffer, size, i - 5);
 			r = 0;
 		} else if (i >= 32 && i < 38) {
-			r = crypt_random_get(cd, buffer, size, CRYPT_RND_NORMAL);
+			r = wipe_random(cd, rng, buffer, size);
 		} else if (i >= 38 && i < 39) {
 			memset(buffer, 0xFF, size);
 			r = 0;
@@ -109,7 +252,7 @@ static int crypt_wipe_special(struct crypt_device *cd, int fd, size_t bsize,
 	}
 
 	/* Rewrite it finally with random */
-	if (crypt_random_get(cd, buffer, size, CRYPT_RND_NORMAL) < 0)
+	if (wipe_random(cd, rng, buffer, size) < 0)
 		return -EIO;
 
 	written = write_lseek_blockwise(fd, bsize, alignment, buffer, size, offset);
@@ -119,36 +262,43 @@ static int crypt_wipe_special(struct crypt_device *cd, int fd, size_t bsize,
 	return 0;
 }
 
-static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pattern,
-		      char *sf, size_t device_block_size, size_t alignment,
-		      size_t wipe_block_size, uint64_t offset, bool *need_block_init,
-		      bool blockdev)
+static int wipe_block_init(struct crypt_device *cd, crypt_wipe_pattern pattern,
+			   char *sf, size_t wipe_block_size, bool *need_block_init,
+			   struct crypt_chacha20 *rng)
+{
+	if (!*need_block_init)
+		return 0;
+
+	if (pattern == CRYPT_WIPE_ZERO) {
+		memset(sf, 0, wipe_block_size);
+		*need_block_init = false;
+		return 0;
+	}
+
+	if (pattern == CRYPT_WIPE_RANDOM || pattern == CRYPT_WIPE_ENCRYPTED_ZERO)
+		return wipe_random(cd, rng, sf, wipe_block_size);
+
+	return -EINVAL;
+}
+
+static int wipe_block(struct crypt_device *cd, struct device *device, int devfd,
+		      crypt_wipe_pattern pattern, char *sf, size_t device_block_size,
+		      size_t alignment, size_t wipe_block_size, uint64_t offset,
+		      bool *need_block_init, bool blockdev, struct crypt_uring *ring,
+		      struct crypt_chacha20 *rng)
 {
 	int r;
 
 	if (pattern == CRYPT_WIPE_SPECIAL)
 		return crypt_wipe_special(cd, devfd, device_block_size, alignment,
-					  sf, offset, wipe_block_size);
+					  sf, offset, wipe_block_size, rng);
 
-	if (*need_block_init) {
-		if (pattern == CRYPT_WIPE_ZERO) {
-			memset(sf, 0, wipe_block_size);
-			*need_block_init = false;
-			r = 0;
-		} else if (pattern == CRYPT_WIPE_RANDOM ||
-			   pattern == CRYPT_WIPE_ENCRYPTED_ZERO) {
-			r = crypt_random_get(cd, sf, wipe_block_size,
-					     CRYPT_RND_NORMAL) ? -EIO : 0;
-			*need_block_init = true;
-		} else
-			r = -EINVAL;
-
-		if (r)
-			return r;
-	}
+	r = wipe_block_init(cd, pattern, sf, wipe_block_size, need_block_init, rng);
+	if (r)
+		return r;
 
 	if (blockdev && pattern == CRYPT_WIPE_ZERO &&
-	    !wipe_zeroout(cd, devfd, offset, wipe_block_size)) {
+	    !wipe_zeroout(cd, device, devfd, offset, wipe_block_size)) {
 		/* zeroout ioctl does not move offset */
 		if (lseek64(devfd, offset + wipe_block_size, SEEK_SET) < 0) {
 			log_err(cd, _("Cannot seek to device offset."));
@@ -157,6 +307,22 @@ static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pat
 		return 0;
 	}
 
+	if (ring && !MISALIGNED(offset, device_block_size) &&
+	    !MISALIGNED(wipe_block_size, device_block_size)) {
+		r = crypt_uring_rw(ring, true, sf, wipe_block_size, offset, WIPE_URING_CHUNK);
+		/* kernel may still use the buffer, no fallback write */
+		if (r == -ENOTRECOVERABLE)
+			return -EIO;
+		if (r == (ssize_t)wipe_block_size) {
+			/* io_uring does not move offset either */
+			if (lseek64(devfd, offset + wipe_block_size, SEEK_SET) < 0) {
+				log_err(cd, _("Cannot seek to device offset."));
+				return -EINVAL;
+			}
+			return 0;
+		}
+	}
+
 	if (write_blockwise(devfd, device_block_size, alignment, sf,
 			    wipe_block_size) == (ssize_t)wipe_block_size)
 		return 0;
@@ -164,12 +330,209 @@ static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pat
 	return -EIO;
 }
 
-int crypt_wipe_device(struct crypt_device *cd,
+/*
+ * Parallel wipe splits the area to consecutive regions (aligned to wipe block),
+ * each written by its own thread with its own buffer and io_uring queue.
+ * Shared fd is used only with positioned I/O, file offset is not moved.
+ */
+struct wipe_parallel {
+	struct crypt_device *cd;
+	struct device *device;
+	int devfd;
+	bool blockdev;
+	crypt_wipe_pattern pattern;
+	size_t alignment;
+	size_t wipe_block_size;
+	uint64_t offset, dev_size, done;
+	bool stop;
+	int r;
+	pthread_mutex_t lock;
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr);
+	void *usrptr;
+};
+
+struct wipe_thread {
+	struct crypt_thread thread;
+	bool threaded;
+	struct wipe_parallel *wp;
+	uint64_t offset, end;
+	int r;
+};
+
+static int wipe_pwrite(int devfd, const char *buf, size_t length, uint64_t offset)
+{
+	ssize_t w;
+
+	while (length) {
+		w = pwrite(devfd, buf, length, offset);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -EIO;
+		buf += w;
+		offset += w;
+		length -= w;
+	}
+
+	return 0;
+}
+
+/* returns true if wipe should stop */
+static bool wipe_parallel_progress(struct wipe_parallel *wp, size_t length)
+{
+	bool stop;
+
+	pthread_mutex_lock(&wp->lock);
+	wp->done += length;
+	if (!wp->stop && wp->progress &&
+	    wp->progress(wp->dev_size, wp->offset + wp->done, wp->usrptr)) {
+		wp->r = -EINTR;
+		__atomic_store_n(&wp->stop, true, __ATOMIC_RELAXED);
+	}
+	stop = wp->stop;
+	pthread_mutex_unlock(&wp->lock);
+
+	return stop;
+}
+
+static void *wipe_worker(void *arg)
+{
+	struct wipe_thread *t = arg;
+	struct wipe_parallel *wp = t->wp;
+	struct crypt_uring *ring = NULL;
+	struct crypt_chacha20 *rng = NULL;
+	struct iovec iov;
+	uint64_t offset = t->offset;
+	size_t length;
+	ssize_t r = 0;
+	bool need_block_init = true;
+	char *sf = NULL;
+
+	if (posix_memalign((void **)&sf, wp->alignment, wp->wipe_block_size)) {
+		t->r = -ENOMEM;
+		goto out;
+	}
+
+	/* every writer has its own keystream, generated concurrently with other writes */
+	if (wp->pattern != CRYPT_WIPE_ZERO) {
+		t->r = wipe_rng_init(wp->cd, &rng);
+		if (t->r)
+			goto out;
+	}
+
+	if (!crypt_uring_init(&ring, wp->devfd, WIPE_URING_DEPTH)) {
+		iov.iov_base = sf;
+		iov.iov_len = wp->wipe_block_size;
+		(void)crypt_uring_register_buffers(ring, &iov, 1);
+	}
+
+	while (offset < t->end && !__atomic_load_n(&wp->stop, __ATOMIC_RELAXED)) {
+		length = wp->wipe_block_size;
+		if (offset + length > t->end)
+			length = t->end - offset;
+
+		t->r = wipe_block_init(wp->cd, wp->pattern, sf, length, &need_block_init, rng);
+		if (t->r)
+			break;
+
+		if (wp->blockdev && wp->pattern == CRYPT_WIPE_ZERO &&
+		    !wipe_zeroout(wp->cd, wp->device, wp->devfd, offset, length))
+			t->r = 0;
+		else if (ring && (r = crypt_uring_rw(ring, true, sf, length, offset,
+						     WIPE_URING_CHUNK)) == (ssize_t)length)
+			t->r = 0;
+		else if (ring && r == -ENOTRECOVERABLE)
+			/* kernel may still use the buffer, no fallback write */
+			t->r = -EIO;
+		else
+			t->r = wipe_pwrite(wp->devfd, sf, length, offset);
+		if (t->r) {
+			log_err(wp->cd, _("Device wipe error, offset %" PRIu64 "."), offset);
+			break;
+		}
+
+		offset += length;
+
+		if (wipe_parallel_progress(wp, length))
+			break;
+	}
+out:
+	if (t->r)
+		__atomic_store_n(&wp->stop, true, __ATOMIC_RELAXED);
+	crypt_chacha20_destroy(rng);
+	crypt_uring_destroy(ring);
+	free(sf);
+	return NULL;
+}
+
+static int wipe_parallel(struct wipe_parallel *wp, unsigned int threads)
+{
+	struct wipe_thread *t;
+	uint64_t blocks, region;
+	unsigned int i, started = 0;
+	int r = 0;
+
+	blocks = (wp->dev_size - wp->offset + wp->wipe_block_size - 1) / wp->wipe_block_size;
+	if (threads > blocks)
+		threads = blocks;
+	region = (blocks + threads - 1) / threads * wp->wipe_block_size;
+
+	t = calloc(threads, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&wp->lock, NULL)) {
+		free(t);
+		return -ENOMEM;
+	}
+
+	log_dbg(wp->cd, "Using %u threads for device wipe.", threads);
+
+	for (i = 0; i < threads; i++) {
+		t[i].wp = wp;
+		t[i].offset = wp->offset + i * region;
+		t[i].end = t[i].offset + region;
+		if (t[i].end > wp->dev_size)
+			t[i].end = wp->dev_size;
+		if (t[i].offset >= t[i].end)
+			break;
+		t[i].threaded = !crypt_thread_start(&t[i].thread, wipe_worker, &t[i], 0);
+		started++;
+	}
+
+	/* regions without a worker are wiped by the caller */
+	for (i = 0; i < started; i++)
+		if (!t[i].threaded)
+			wipe_worker(&t[i]);
+
+	for (i = 0; i < started; i++) {
+		crypt_thread_join(&t[i].thread);
+		if (!r && t[i].r)
+			r = t[i].r;
+	}
+
+	if (!r)
+		r = wp->r;
+
+	/* nothing was written if threads could not be started at all */
+	if (r == -ENOMEM && !started)
+		r = -EINVAL;
+
+	pthread_mutex_destroy(&wp->lock);
+	free(t);
+	return r;
+}
+
+static int wipe_device(struct crypt_device *cd,
 	struct device *device,
 	crypt_wipe_pattern pattern,
 	uint64_t offset,
 	uint64_t length,
 	size_t wipe_block_size,
+	char *buf,
+	uint32_t flags,
+	unsigned int threads,
+	const char **method,
 	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 	void *usrptr)
 {
@@ -178,7 +541,10 @@ int crypt_wipe_device(struct crypt_device *cd,
 	size_t bsize, alignment;
 	char *sf = NULL;
 	uint64_t dev_size;
-	bool need_block_init = true;
+	bool need_block_init = true, zoned;
+	struct crypt_uring *ring = NULL;
+	struct crypt_chacha20 *rng = NULL;
+	struct iovec iov;
 
 	/* Note: LUKS1 calls it with wipe_block not aligned to multiple of bsize */
 	bsize = device_block_size(cd, device);
@@ -217,8 +583,10 @@ int crypt_wipe_device(struct crypt_device *cd,
 		}
 	}
 
-	r = posix_memalign((void **)&sf, alignment, wipe_block_size);
-	if (r)
+	/* caller buffer (of at least wipe_block_size) is reused between ranges */
+	if (buf)
+		sf = buf;
+	else if ((r = posix_memalign((void **)&sf, alignment, wipe_block_size)))
 		goto out;
 
 	if (lseek64(devfd, offset, SEEK_SET) < 0) {
@@ -237,12 +605,81 @@ int crypt_wipe_device(struct crypt_device *cd,
 		pattern = CRYPT_WIPE_RANDOM;
 	}
 
+	if ((flags & CRYPT_WIPE_ALLOW_DISCARD) && pattern == CRYPT_WIPE_ZERO &&
+	    S_ISBLK(st.st_mode)) {
+		r = wipe_discard(cd, device, devfd, bsize, alignment, offset, dev_size - offset);
+		if (r != -ENOTSUP) {
+			if (!r && progress)
+				(void)progress(dev_size, dev_size, usrptr);
+			*method = "discard";
+			goto out;
+		}
+	}
+
+	/* zoned device accepts only sequential writes from the zone write pointer */
+	zoned = S_ISBLK(st.st_mode) && device_zoned(device, NULL) > 0;
+	if (zoned && pattern != CRYPT_WIPE_SPECIAL) {
+		r = wipe_zone_reset(cd, device, devfd, bsize, alignment, offset,
+				    dev_size - offset, pattern == CRYPT_WIPE_ZERO);
+		if (!r && pattern == CRYPT_WIPE_ZERO) {
+			if (progress)
+				(void)progress(dev_size, dev_size, usrptr);
+			*method = "zone reset";
+			goto out;
+		}
+		if (r && r != -ENOTSUP)
+			goto out;
+		log_dbg(cd, "Zoned device, using single sequential writer for wipe.");
+		threads = 1;
+	}
+
+	if (threads > WIPE_MAX_THREADS)
+		threads = WIPE_MAX_THREADS;
+
+	/* parallel writers use aligned positioned I/O only */
+	if (threads > 1 && pattern != CRYPT_WIPE_SPECIAL &&
+	    !MISALIGNED(offset, bsize) && !MISALIGNED(dev_size, bsize) &&
+	    !MISALIGNED(wipe_block_size, bsize)) {
+		struct wipe_parallel wp = {
+			.cd = cd,
+			.device = device,
+			.devfd = devfd,
+			.blockdev = S_ISBLK(st.st_mode),
+			.pattern = pattern,
+			.alignment = alignment,
+			.wipe_block_size = wipe_block_size,
+			.offset = offset,
+			.dev_size = dev_size,
+			.progress = progress,
+			.usrptr = usrptr,
+		};
+
+		r = wipe_parallel(&wp, threads);
+		device_sync(cd, device);
+		*method = "write";
+		goto out;
+	}
+
+	if (pattern != CRYPT_WIPE_ZERO) {
+		r = wipe_rng_init(cd, &rng);
+		if (r)
+			goto out;
+	}
+
+	if (pattern != CRYPT_WIPE_SPECIAL && !zoned &&
+	    !crypt_uring_init(&ring, devfd, WIPE_URING_DEPTH)) {
+		log_dbg(cd, "Using io_uring for device wipe.");
+		iov.iov_base = sf;
+		iov.iov_len = wipe_block_size;
+		(void)crypt_uring_register_buffers(ring, &iov, 1);
+	}
+
 	while (offset < dev_size) {
 		if ((offset + wipe_block_size) > dev_size)
 			wipe_block_size = dev_size - offset;
 
-		r = wipe_block(cd, devfd, pattern, sf, bsize, alignment,
-			       wipe_block_size, offset, &need_block_init, S_ISBLK(st.st_mode));
+		r = wipe_block(cd, device, devfd, pattern, sf, bsize, alignment,
+			       wipe_block_size, offset, &need_block_init, S_ISBLK(st.st_mode), ring, rng);
 		if (r) {
 			log_err(cd,_("Device wipe error, offset %" PRIu64 "."), offset);
 			break;
@@ -257,22 +694,157 @@ int crypt_wipe_device(struct crypt_device *cd,
 	}
 
 	device_sync(cd, device);
+	/* zeroout is disabled on the first failure, the rest is written */
+	*method = pattern == CRYPT_WIPE_ZERO && S_ISBLK(st.st_mode) &&
+		  !device_zeroout_disabled(device) ? "zeroout" : "write";
 out:
-	free(sf);
+	crypt_chacha20_destroy(rng);
+	crypt_uring_destroy(ring);
+	if (sf != buf)
+		free(sf);
 	return r;
 }
 
-int crypt_wipe(struct crypt_device *cd,
+int crypt_wipe_device(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	const char *method;
+
+	return wipe_device(cd, device, pattern, offset, length, wipe_block_size,
+			   NULL, 0, 1, &method, progress, usrptr);
+}
+
+struct wipe_ranges_progress {
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr);
+	void *usrptr;
+	uint64_t total;
+	uint64_t done;		/* bytes of already wiped ranges */
+	uint64_t offset;	/* start of current range */
+};
+
+/* Report progress of all ranges as one stream of total size */
+static int wipe_ranges_progress(uint64_t size __attribute__((unused)), uint64_t offset, void *usrptr)
+{
+	struct wipe_ranges_progress *wrp = usrptr;
+
+	return wrp->progress(wrp->total, wrp->done + offset - wrp->offset, wrp->usrptr);
+}
+
+static int wipe_range_cmp(const void *a, const void *b)
+{
+	const struct crypt_wipe_range *ra = a, *rb = b;
+
+	return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+/*
+ * Wipe several ranges of one device with the same pattern. Ranges are ordered
+ * by offset and adjacent or overlapping ones are merged, one block buffer
+ * is used for all of them. Zero wipe may discard (if discard reads zeroes)
+ * or use BLKZEROOUT. Zero length range is ignored.
+ */
+int crypt_wipe_device_ranges(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	const struct crypt_wipe_range *ranges,
+	unsigned int count,
+	size_t wipe_block_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	struct wipe_ranges_progress wrp = { .progress = progress, .usrptr = usrptr };
+	struct crypt_wipe_range *r_sorted;
+	const char *method;
+	unsigned int i, n = 0;
+	char *buf = NULL;
+	int r = 0;
+
+	if (!count)
+		return 0;
+
+	if (!ranges || !device_alignment(device))
+		return -EINVAL;
+
+	r_sorted = malloc(count * sizeof(*r_sorted));
+	if (!r_sorted)
+		return -ENOMEM;
+
+	memcpy(r_sorted, ranges, count * sizeof(*r_sorted));
+	qsort(r_sorted, count, sizeof(*r_sorted), wipe_range_cmp);
+
+	for (i = 0; i < count; i++) {
+		if (!r_sorted[i].length)
+			continue;
+		if (n && r_sorted[n - 1].offset + r_sorted[n - 1].length >= r_sorted[i].offset) {
+			if (r_sorted[i].offset + r_sorted[i].length > r_sorted[n - 1].offset + r_sorted[n - 1].length)
+				r_sorted[n - 1].length = r_sorted[i].offset + r_sorted[i].length - r_sorted[n - 1].offset;
+			continue;
+		}
+		r_sorted[n++] = r_sorted[i];
+	}
+
+	for (i = 0; i < n; i++)
+		wrp.total += r_sorted[i].length;
+
+	log_dbg(cd, "Wiping %u ranges (%u after merge, %" PRIu64 " bytes) of device %s.",
+		count, n, wrp.total, device_path(device));
+
+	if (n && posix_memalign((void **)&buf, device_alignment(device), wipe_block_size)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n && !r; i++) {
+		wrp.offset = r_sorted[i].offset;
+		r = wipe_device(cd, device, pattern, r_sorted[i].offset, r_sorted[i].length,
+				wipe_block_size, buf, pattern == CRYPT_WIPE_ZERO ? CRYPT_WIPE_ALLOW_DISCARD : 0,
+				1, &method, progress ? wipe_ranges_progress : NULL, &wrp);
+		wrp.done += r_sorted[i].length;
+	}
+out:
+	if (buf)
+		crypt_safe_memzero(buf, wipe_block_size);
+	free(buf);
+	free(r_sorted);
+	return r;
+}
+
+/*
+ * Clear unused area with zeroes, discard it if the device reads zeroes afterwards
+ * and fall back to BLKZEROOUT or plain write. Method used is returned in method.
+ */
+int crypt_wipe_device_discard(struct crypt_device *cd,
+	struct device *device,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	const char **method)
+{
+	*method = NULL;
+
+	return wipe_device(cd, device, CRYPT_WIPE_ZERO, offset, length, wipe_block_size,
+			   NULL, CRYPT_WIPE_ALLOW_DISCARD, 1, method, NULL, NULL);
+}
+
+int crypt_wipe_parallel(struct crypt_device *cd,
 	const char *dev_path,
 	crypt_wipe_pattern pattern,
 	uint64_t offset,
 	uint64_t length,
 	size_t wipe_block_size,
 	uint32_t flags,
+	unsigned int threads,
 	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 	void *usrptr)
 {
 	struct device *device;
+	const char *method;
 	int r;
 
 	if (!cd)
@@ -301,11 +873,25 @@ int crypt_wipe(struct crypt_device *cd,
 	log_dbg(cd, "Wipe [%u] device %s, offset %" PRIu64 ", length %" PRIu64 ", block %zu.",
 		(unsigned)pattern, device_path(device), offset, length, wipe_block_size);
 
-	r = crypt_wipe_device(cd, device, pattern, offset, length,
-			      wipe_block_size, progress, usrptr);
+	r = wipe_device(cd, device, pattern, offset, length,
+			wipe_block_size, NULL, flags, threads, &method, progress, usrptr);
 
 	if (dev_path)
 		device_free(cd, device);
 
 	return r;
 }
+
+int crypt_wipe(struct crypt_device *cd,
+	const char *dev_path,
+	crypt_wipe_pattern pattern,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	uint32_t flags,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	return crypt_wipe_parallel(cd, dev_path, pattern, offset, length,
+				   wipe_block_size, flags, 1, progress, usrptr);
+}
@@ -28,6 +28,8 @@
 
 #define RS_MIN(a, b) ((a) < (b) ? (a) : (b))
 
+#include <stddef.h>
+
 typedef unsigned char data_t;
 
 /* Reed-Solomon codec control block */
@@ -42,6 +44,8 @@ struct rs {
 	int prim;        /* Primitive element, index form */
 	int iprim;       /* prim-th root of 1, index form */
 	int pad;         /* Padding bytes in shortened block */
+	data_t *genpoly_mul;    /* Multiplication tables by genpoly[] coefficients */
+	data_t *genpoly_mul_hi; /* The same for high nibble only (symsize 8) */
 };
 
 static inline int modnn(struct rs *rs, int x)
@@ -58,6 +62,11 @@ void free_rs_char(struct rs *rs);
 
 /* General purpose RS codec, 8-bit symbols */
 void encode_rs_char(struct rs *rs, data_t *data, data_t *parity);
+int encode_rs_char_columns(struct rs *rs, const data_t *data, size_t stride,
+			   size_t columns, data_t *parity);
+void encode_rs_char_rows(struct rs *rs, const data_t *data, size_t stride,
+			 int first_row, int rows, size_t columns, data_t *planes);
+void encode_rs_char_planes(struct rs *rs, const data_t *planes, size_t columns, data_t *parity);
 int decode_rs_char(struct rs *rs, data_t *data);
 
 #endif
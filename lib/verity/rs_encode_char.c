@@ -20,10 +20,21 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "rs.h"
+#include "crypto_backend/crypto_backend.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define RS_X86 1
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+/* Columns encoded at once, parity of all of them should fit in L1 cache */
+#define RS_COLUMNS_CHUNK 512
 
 /* Initialize a Reed-Solomon codec
  * symsize = symbol size, bits
@@ -128,6 +139,23 @@ struct rs *init_rs_char(int symsize, int gfpoly, int fcr, int prim, int nroots,
 	for (i = 0; i <= nroots; i++)
 		rs->genpoly[i] = rs->index_of[rs->genpoly[i]];
 
+	/* tables for column encoder, row k is genpoly[k] * x for all x */
+	rs->genpoly_mul = malloc(sizeof(data_t) * (rs->nn + 1) * (nroots ?: 1));
+	rs->genpoly_mul_hi = malloc(sizeof(data_t) * 16 * (nroots ?: 1));
+	if (!rs->genpoly_mul || !rs->genpoly_mul_hi) {
+		free_rs_char(rs);
+		return NULL;
+	}
+
+	for (i = 0; i < nroots; i++) {
+		for (j = 0; j <= rs->nn; j++)
+			rs->genpoly_mul[i * (rs->nn + 1) + j] = (j && rs->genpoly[i] != A0) ?
+				rs->alpha_to[modnn(rs, rs->index_of[j] + rs->genpoly[i])] : 0;
+		for (j = 0; j < 16; j++)
+			rs->genpoly_mul_hi[i * 16 + j] = (j << 4) <= rs->nn ?
+				rs->genpoly_mul[i * (rs->nn + 1) + (j << 4)] : 0;
+	}
+
 	return rs;
 }
 
@@ -139,6 +167,8 @@ void free_rs_char(struct rs *rs)
 	free(rs->alpha_to);
 	free(rs->index_of);
 	free(rs->genpoly);
+	free(rs->genpoly_mul);
+	free(rs->genpoly_mul_hi);
 	free(rs);
 }
 
@@ -171,3 +201,156 @@ void encode_rs_char(struct rs *rs, data_t *data, data_t *parity)
 			parity[rs->nroots - 1] = 0;
 	}
 }
+
+/*
+ * Column encoder, the same code as encode_rs_char() for many codewords at once.
+ * Codeword c consists of data[i * stride + c] bytes of all data rows, its parity
+ * is stored to parity[c * nroots]. The shift register is kept per column in
+ * nroots planes (used as a ring starting at plane h) so the inner loops run
+ * over adjacent columns.
+ */
+static int encode_columns_generic(struct rs *rs, const data_t *data, size_t stride, int rows,
+				  int h, data_t *planes, size_t pstride, size_t first, size_t columns)
+{
+	const data_t *mul = rs->genpoly_mul;
+	int i, j, s;
+	size_t c, n = rs->nn + 1;
+	data_t fb;
+
+	for (i = 0; i < rows; i++) {
+		for (c = first; c < columns; c++) {
+			fb = data[i * stride + c] ^ planes[h * pstride + c];
+			for (j = 1, s = h + 1; j < rs->nroots; j++, s++) {
+				if (s == rs->nroots)
+					s = 0;
+				planes[s * pstride + c] ^= mul[(rs->nroots - j) * n + fb];
+			}
+			planes[h * pstride + c] = mul[fb];
+		}
+		if (++h == rs->nroots)
+			h = 0;
+	}
+
+	return h;
+}
+
+#if RS_X86
+/* GF(2^8) multiplication by constant as two PSHUFB nibble lookups */
+static AVX2 inline __m256i gf_mul_avx2(const data_t *lo, const data_t *hi,
+				       __m256i x_lo, __m256i x_hi)
+{
+	__m256i t_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+	__m256i t_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+
+	return _mm256_xor_si256(_mm256_shuffle_epi8(t_lo, x_lo), _mm256_shuffle_epi8(t_hi, x_hi));
+}
+
+static AVX2 size_t encode_columns_avx2(struct rs *rs, const data_t *data, size_t stride, int rows,
+				       int h, data_t *planes, size_t pstride, size_t columns)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	const data_t *mul = rs->genpoly_mul, *mul_hi = rs->genpoly_mul_hi;
+	int i, j, s, k;
+	__m256i fb, fb_lo, fb_hi, *p;
+	size_t c, n = rs->nn + 1;
+
+	columns &= ~(size_t)31;
+
+	for (i = 0; i < rows; i++) {
+		for (c = 0; c < columns; c += 32) {
+			p = (__m256i *)&planes[h * pstride + c];
+			fb = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&data[i * stride + c]),
+					      _mm256_loadu_si256(p));
+			fb_lo = _mm256_and_si256(fb, mask);
+			fb_hi = _mm256_and_si256(_mm256_srli_epi16(fb, 4), mask);
+
+			for (j = 1, s = h + 1; j < rs->nroots; j++, s++) {
+				if (s == rs->nroots)
+					s = 0;
+				k = rs->nroots - j;
+				p = (__m256i *)&planes[s * pstride + c];
+				_mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p),
+					gf_mul_avx2(&mul[k * n], &mul_hi[k * 16], fb_lo, fb_hi)));
+			}
+			p = (__m256i *)&planes[h * pstride + c];
+			_mm256_storeu_si256(p, gf_mul_avx2(mul, mul_hi, fb_lo, fb_hi));
+		}
+		if (++h == rs->nroots)
+			h = 0;
+	}
+
+	return columns;
+}
+#endif
+
+static int encode_columns(struct rs *rs, const data_t *data, size_t stride, int rows,
+			  int h, data_t *planes, size_t pstride, size_t columns)
+{
+	size_t first = 0;
+
+#if RS_X86
+	if (rs->mm == 8 && crypt_cpu_has(CRYPT_CPU_AVX2))
+		first = encode_columns_avx2(rs, data, stride, rows, h, planes, pstride, columns);
+#endif
+	return encode_columns_generic(rs, data, stride, rows, h, planes, pstride, first, columns);
+}
+
+/* ring starts at h, parity of column c is stored to parity[c * nroots] */
+static void planes_to_parity(struct rs *rs, const data_t *planes, size_t pstride,
+			     int h, size_t columns, data_t *parity)
+{
+	size_t c;
+	int j, s;
+
+	for (j = 0, s = h; j < rs->nroots; j++, s++) {
+		if (s == rs->nroots)
+			s = 0;
+		for (c = 0; c < columns; c++)
+			parity[c * rs->nroots + j] = planes[s * pstride + c];
+	}
+}
+
+int encode_rs_char_columns(struct rs *rs, const data_t *data, size_t stride,
+			   size_t columns, data_t *parity)
+{
+	data_t *planes;
+	size_t c0, w;
+	int h;
+
+	if (!rs->nroots)
+		return 0;
+
+	planes = malloc(sizeof(data_t) * rs->nroots * RS_COLUMNS_CHUNK);
+	if (!planes)
+		return -ENOMEM;
+
+	for (c0 = 0; c0 < columns; c0 += w) {
+		w = RS_MIN(columns - c0, RS_COLUMNS_CHUNK);
+		memset(planes, 0, sizeof(data_t) * rs->nroots * w);
+
+		h = encode_columns(rs, data + c0, stride, rs->nn - rs->nroots - rs->pad, 0, planes, w, w);
+		planes_to_parity(rs, planes, w, h, w, &parity[c0 * rs->nroots]);
+	}
+
+	free(planes);
+	return 0;
+}
+
+/*
+ * Incremental variant, data rows can come in more calls. The caller keeps
+ * shift registers of all columns in planes (nroots * columns bytes,
+ * zeroed before the first row) and gets parity once all rows are encoded.
+ */
+void encode_rs_char_rows(struct rs *rs, const data_t *data, size_t stride,
+			 int first_row, int rows, size_t columns, data_t *planes)
+{
+	if (rs->nroots)
+		encode_columns(rs, data, stride, rows, first_row % rs->nroots, planes, columns, columns);
+}
+
+void encode_rs_char_planes(struct rs *rs, const data_t *planes, size_t columns, data_t *parity)
+{
+	if (rs->nroots)
+		planes_to_parity(rs, planes, columns, (rs->nn - rs->nroots - rs->pad) % rs->nroots,
+				 columns, parity);
+}
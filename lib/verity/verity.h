@@ -21,6 +21,7 @@
 #ifndef _VERITY_H
 #define _VERITY_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -30,7 +31,10 @@
 
 struct crypt_device;
 struct crypt_params_verity;
+struct crypt_verity_range;
+struct crypt_verity_hash_stream;
 struct device;
+struct verity_fec_stream;
 
 int VERITY_read_sb(struct crypt_device *cd,
 		   uint64_t sb_offset,
@@ -56,20 +60,61 @@ int VERITY_verify(struct crypt_device *cd,
 		const char *root_hash,
 		size_t root_hash_size);
 
+int VERITY_verify_sample(struct crypt_device *cd,
+			 struct crypt_params_verity *params,
+			 const char *root_hash,
+			 size_t root_hash_size,
+			 uint64_t samples,
+			 uint32_t flags,
+			 uint64_t *verified_blocks);
+
 int VERITY_create(struct crypt_device *cd,
 		  struct crypt_params_verity *verity_hdr,
 		  const char *root_hash,
 		  size_t root_hash_size);
 
+int VERITY_update(struct crypt_device *cd,
+		  struct crypt_params_verity *params,
+		  struct device *old_data_device,
+		  const struct crypt_verity_range *ranges,
+		  unsigned int ranges_count,
+		  char *root_hash,
+		  size_t root_hash_size);
+
+int VERITY_stream_init(struct crypt_device *cd,
+		       struct crypt_params_verity *params,
+		       struct device *fec_device,
+		       bool write_data,
+		       size_t digest_size,
+		       struct crypt_verity_hash_stream **stream);
+int VERITY_stream_write(struct crypt_device *cd,
+			struct crypt_verity_hash_stream *stream,
+			const char *data,
+			size_t length);
+int VERITY_stream_final(struct crypt_device *cd,
+			struct crypt_verity_hash_stream *stream,
+			char *root_hash,
+			size_t root_hash_size);
+void VERITY_stream_free(struct crypt_verity_hash_stream *stream);
+
 int VERITY_FEC_process(struct crypt_device *cd,
 		      struct crypt_params_verity *params,
 		      struct device *fec_device,
 		      int check_fec,
 		      unsigned int *errors);
 
+int VERITY_FEC_stream_init(struct crypt_device *cd,
+			   struct crypt_params_verity *params,
+			   struct device *fec_device,
+			   struct verity_fec_stream **fs);
+void VERITY_FEC_stream_write(struct verity_fec_stream *fs, const char *block);
+int VERITY_FEC_stream_final(struct crypt_device *cd, struct verity_fec_stream *fs);
+void VERITY_FEC_stream_free(struct verity_fec_stream *fs);
+
 uint64_t VERITY_hash_offset_block(struct crypt_params_verity *params);
 
 uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params);
+int VERITY_hash_area_size(struct crypt_params_verity *params, size_t digest_size, uint64_t *size);
 
 uint64_t VERITY_FEC_blocks(struct crypt_device *cd,
 			   struct device *fec_device,
@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "verity.h"
 #include "internal.h"
@@ -33,6 +34,15 @@
 
 #define FEC_INPUT_DEVICES 2
 
+/* encoding threads, each gets at least this many rounds */
+#define FEC_MAX_THREADS		64
+#define FEC_MIN_THREAD_ROUNDS	16
+
+#define FEC_WRITE_BUFFER_SIZE	(1024 * 1024)
+
+/* staging buffers for grouped input reads, see crypt_set_verity_fec_memory() */
+#define FEC_DEFAULT_MEMORY_KB	(64 * 1024)
+
 /* parameters to init_rs_char */
 #define FEC_PARAMS(roots) \
     8,          /* symbol size in bits */ \
@@ -73,51 +83,324 @@ static inline uint64_t FEC_interleave(struct fec_context *ctx, uint64_t offset)
 			(offset % ctx->rsn) * ctx->rounds * ctx->block_size;
 }
 
-/* returns data for a byte at the specified RS offset */
+/*
+ * returns data for bytes starting at the specified RS offset,
+ * count can span more blocks following each other on the input
+ */
 static int FEC_read_interleaved(struct fec_context *ctx, uint64_t i,
 				void *output, size_t count)
 {
-	size_t n;
-	uint64_t offset = FEC_interleave(ctx, i);
+	uint8_t *out = output;
+	uint64_t pos, offset = FEC_interleave(ctx, i);
+	size_t n, len;
+
+	while (count) {
+		/* offsets outside input area are assumed to contain zeros */
+		if (offset >= ctx->size) {
+			memset(out, 0, count);
+			return 0;
+		}
 
-	/* offsets outside input area are assumed to contain zeros */
-	if (offset >= ctx->size) {
-		memset(output, 0, count);
-		return 0;
+		/* find the correct input device and read from it */
+		for (n = 0, pos = offset; pos >= ctx->inputs[n].count; ++n)
+			pos -= ctx->inputs[n].count;
+
+		len = count;
+		if (len > ctx->inputs[n].count - pos)
+			len = ctx->inputs[n].count - pos;
+
+		/* FIXME: read_lseek_blockwise candidate */
+		if (lseek(ctx->inputs[n].fd, ctx->inputs[n].start + pos, SEEK_SET) < 0 ||
+		    read_buffer(ctx->inputs[n].fd, out, len) != (ssize_t)len)
+			return -1;
+
+		out += len;
+		offset += len;
+		count -= len;
+	}
+
+	return 0;
+}
+
+/*
+ * Input block i of round n is the block i * rounds + n, so the same
+ * input block of consecutive rounds follows each other on the device.
+ * Rounds are read in groups, every of rsn input rows of the group is one
+ * sequential read; block i of round n + j is stored to buf[(i * count + j) * block_size].
+ *
+ * The group size is limited by the memory available for staging buffers.
+ */
+static uint64_t FEC_group_rounds(struct fec_context *ctx, uint64_t memory_kb, uint64_t rounds)
+{
+	uint64_t group = memory_kb * 1024 / ((uint64_t)ctx->block_size * ctx->rsn);
+
+	if (group > rounds)
+		group = rounds;
+
+	return group ?: 1;
+}
+
+static int FEC_read_rounds(struct crypt_device *cd, struct fec_context *ctx,
+			   uint64_t n, uint64_t count, uint8_t *buf)
+{
+	size_t row = (size_t)count * ctx->block_size;
+	unsigned int i;
+
+	for (i = 0; i < ctx->rsn; ++i) {
+		if (FEC_read_interleaved(ctx, n * ctx->rsn * ctx->block_size + i,
+					 &buf[i * row], row)) {
+			log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."), n, i);
+			return -EIO;
+		}
 	}
 
-	/* find the correct input device and read from it */
+	return 0;
+}
+
+/*
+ * Rounds are independent RS codewords, encoding and decoding is split
+ * to contiguous ranges of rounds, every worker reads its input blocks and
+ * reads or writes its parity through its own file descriptors.
+ */
+struct fec_worker {
+	struct crypt_device *cd;
+	struct fec_context ctx;
+	struct fec_input_device inputs[FEC_INPUT_DEVICES];
+	struct rs *rs;
+	struct device *fec_device;
+	uint64_t fec_offset;
+	uint64_t memory_kb;
+	uint64_t round;
+	uint64_t rounds;
+	bool decode;
+	unsigned int errors;
+	struct crypt_thread thread;
+	bool threaded;
+	int r;
+};
+
+/*
+ * Parity of consecutive rounds is stored together, it is read in large
+ * chunks for the whole group of rounds. Most codewords of a damaged image
+ * are intact, decode_rs_char() returns right after syndrome check for them.
+ */
+static void FEC_worker_decode(struct fec_worker *w, int fd, uint8_t *buf, uint64_t group)
+{
+	struct fec_context *ctx = &w->ctx;
+	size_t round_size = (size_t)ctx->block_size * ctx->roots, row;
+	uint64_t round, end = w->round + w->rounds, j, count;
+	uint8_t rs_block[FEC_RSM], *parity;
+	unsigned int i;
+	uint32_t b;
+	int r;
+
+	parity = &buf[(size_t)ctx->block_size * ctx->rsn * group];
+
+	for (round = w->round; round < end; round += count) {
+		count = end - round;
+		if (count > group)
+			count = group;
+		row = (size_t)count * ctx->block_size;
+
+		w->r = FEC_read_rounds(w->cd, ctx, round, count, buf);
+		if (w->r)
+			return;
+
+		if (lseek(fd, w->fec_offset + round * round_size, SEEK_SET) < 0 ||
+		    read_buffer(fd, parity, count * round_size) != (ssize_t)(count * round_size)) {
+			log_err(w->cd, _("Failed to read parity for RS block %" PRIu64 "."), round);
+			w->r = -EIO;
+			return;
+		}
+
+		for (j = 0; j < count; j++) {
+			for (b = 0; b < ctx->block_size; ++b) {
+				for (i = 0; i < ctx->rsn; ++i)
+					rs_block[i] = buf[i * row + j * ctx->block_size + b];
+				memcpy(&rs_block[ctx->rsn], &parity[j * round_size + b * ctx->roots], ctx->roots);
+
+				/* coverity[tainted_data] */
+				r = decode_rs_char(w->rs, rs_block);
+				if (r < 0) {
+					log_err(w->cd, _("Failed to repair parity for block %" PRIu64 "."), round + j);
+					w->r = -EPERM;
+					return;
+				}
+				/* return number of detected errors */
+				w->errors += r;
+			}
+		}
+	}
+
+	w->r = 0;
+}
+
+static void FEC_worker_run(struct fec_worker *w)
+{
+	struct fec_context *ctx = &w->ctx;
+	size_t n, round_size = (size_t)ctx->block_size * ctx->roots, batch, done = 0;
+	uint8_t *buf = NULL, *parity = NULL;
+	uint64_t round, end = w->round + w->rounds, j, count, group;
+	int fd = -1;
+
+	for (n = 0; n < ctx->ninputs; ++n)
+		w->inputs[n].fd = -1;
+
+	if (!w->rounds)
+		return;
+
+	group = FEC_group_rounds(ctx, w->memory_kb, w->rounds);
+
+	/* parity is written in large chunks, not per codeword */
+	batch = FEC_WRITE_BUFFER_SIZE / round_size ?: 1;
+	if (batch > w->rounds)
+		batch = w->rounds;
+
+	/* decode reads parity of the whole group after the input blocks */
+	buf = malloc((size_t)ctx->block_size * (ctx->rsn + (w->decode ? ctx->roots : 0)) * group);
+	parity = w->decode ? NULL : malloc(batch * round_size);
+	if (!buf || (!w->decode && !parity)) {
+		log_err(w->cd, _("Failed to allocate buffer."));
+		w->r = -ENOMEM;
+		goto out;
+	}
+
+	w->r = -EIO;
 	for (n = 0; n < ctx->ninputs; ++n) {
-		if (offset >= ctx->inputs[n].count) {
-			offset -= ctx->inputs[n].count;
-			continue;
+		w->inputs[n].fd = open(device_path(w->inputs[n].device), O_RDONLY);
+		if (w->inputs[n].fd == -1) {
+			log_err(w->cd, _("Cannot open device %s."), device_path(w->inputs[n].device));
+			goto out;
 		}
+	}
 
-		/* FIXME: read_lseek_blockwise candidate */
-		if (lseek(ctx->inputs[n].fd, ctx->inputs[n].start + offset, SEEK_SET) < 0)
-			return -1;
-		return (read_buffer(ctx->inputs[n].fd, output, count) == (ssize_t)count) ? 0 : -1;
+	fd = open(device_path(w->fec_device), w->decode ? O_RDONLY : O_RDWR);
+	if (fd == -1) {
+		log_err(w->cd, _("Cannot open device %s."), device_path(w->fec_device));
+		goto out;
+	}
+
+	if (w->decode) {
+		FEC_worker_decode(w, fd, buf, group);
+		goto out;
+	}
+
+	for (round = w->round; round < end; round += count) {
+		count = end - round;
+		if (count > group)
+			count = group;
+
+		w->r = FEC_read_rounds(w->cd, ctx, round, count, buf);
+		if (w->r)
+			goto out;
+
+		for (j = 0; j < count; j++) {
+			w->r = encode_rs_char_columns(w->rs, &buf[j * ctx->block_size],
+						      (size_t)count * ctx->block_size, ctx->block_size,
+						      &parity[done * round_size]);
+			if (w->r)
+				goto out;
+
+			if (++done < batch && round + j + 1 < end)
+				continue;
+
+			/* encoding and writing parity data to fec device */
+			if (lseek(fd, w->fec_offset + (round + j + 1 - done) * round_size, SEEK_SET) < 0 ||
+			    write_buffer(fd, parity, done * round_size) < 0) {
+				log_err(w->cd, _("Failed to write parity for RS block %" PRIu64 "."), round + j);
+				w->r = -EIO;
+				goto out;
+			}
+			done = 0;
+		}
+	}
+out:
+	if (fd != -1)
+		close(fd);
+	for (n = 0; n < ctx->ninputs; ++n)
+		if (w->inputs[n].fd != -1)
+			close(w->inputs[n].fd);
+	free(buf);
+	free(parity);
+}
+
+static void *FEC_worker_fn(void *arg)
+{
+	FEC_worker_run(arg);
+	return NULL;
+}
+
+static int FEC_process_rounds(struct crypt_device *cd, struct fec_context *ctx,
+			      struct rs *rs, struct device *fec_device, uint64_t fec_offset,
+			      uint64_t memory_kb, int decode, unsigned int *errors)
+{
+	struct fec_worker *w;
+	uint64_t threads = crypt_cpusonline(), start = 0, end;
+	unsigned int i;
+	int r = 0;
+
+	if (threads > FEC_MAX_THREADS)
+		threads = FEC_MAX_THREADS;
+	if (threads > ctx->rounds / FEC_MIN_THREAD_ROUNDS)
+		threads = ctx->rounds / FEC_MIN_THREAD_ROUNDS;
+	if (!threads)
+		threads = 1;
+
+	w = calloc(threads, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	log_dbg(cd, "Using %" PRIu64 " threads for FEC %s, reading %" PRIu64 " rounds at once.",
+		threads, decode ? "decoding" : "encoding",
+		FEC_group_rounds(ctx, memory_kb / threads, ctx->rounds / threads));
+
+	for (i = 0; i < threads; i++) {
+		end = ctx->rounds * (i + 1) / threads;
+
+		w[i].cd = cd;
+		w[i].ctx = *ctx;
+		memcpy(w[i].inputs, ctx->inputs, ctx->ninputs * sizeof(*ctx->inputs));
+		w[i].ctx.inputs = w[i].inputs;
+		w[i].rs = rs;
+		w[i].fec_device = fec_device;
+		w[i].fec_offset = fec_offset;
+		w[i].memory_kb = memory_kb / threads;
+		w[i].round = start;
+		w[i].rounds = end - start;
+		w[i].decode = decode;
+		start = end;
+
+		/* the last range runs in caller thread */
+		if (i < threads - 1)
+			w[i].threaded = !crypt_thread_start(&w[i].thread, FEC_worker_fn, &w[i], 0);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (w[i].threaded)
+			crypt_thread_join(&w[i].thread);
+		else
+			FEC_worker_run(&w[i]);
+		if (!r)
+			r = w[i].r;
+		if (errors)
+			*errors += w[i].errors;
 	}
 
-	/* should never be reached */
-	return -1;
+	free(w);
+	return r;
 }
 
-/* encodes/decode inputs to/from fd */
+/* encodes/decodes inputs to/from fec_device, workers use own descriptors */
 static int FEC_process_inputs(struct crypt_device *cd,
 			      struct crypt_params_verity *params,
 			      struct fec_input_device *inputs,
-			      size_t ninputs, int fd,
+			      size_t ninputs, struct device *fec_device,
 			      int decode, unsigned int *errors)
 {
-	int r = 0;
-	unsigned int i;
+	int r;
 	struct fec_context ctx;
-	uint32_t b;
-	uint64_t n;
-	uint8_t rs_block[FEC_RSM];
-	uint8_t *buf = NULL;
-	void *rs;
+	uint64_t n, memory_kb;
+	struct rs *rs;
 
 	/* initialize parameters */
 	ctx.roots = params->fec_roots;
@@ -144,61 +427,12 @@ static int FEC_process_inputs(struct crypt_device *cd,
 	ctx.blocks = FEC_div_round_up(ctx.size, ctx.block_size);
 	ctx.rounds = FEC_div_round_up(ctx.blocks, ctx.rsn);
 
-	buf = malloc((size_t)ctx.block_size * ctx.rsn);
-	if (!buf) {
-		log_err(cd, _("Failed to allocate buffer."));
-		r = -ENOMEM;
-		goto out;
-	}
+	memory_kb = crypt_verity_fec_memory_kb(cd) ?: FEC_DEFAULT_MEMORY_KB;
 
-	/* encode/decode input */
-	for (n = 0; n < ctx.rounds; ++n) {
-		for (i = 0; i < ctx.rsn; ++i) {
-			if (FEC_read_interleaved(&ctx, n * ctx.rsn * ctx.block_size + i,
-						 &buf[i * ctx.block_size], ctx.block_size)) {
-				log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."), n, i);
-				r = -EIO;
-				goto out;
-			}
-		}
-
-		for (b = 0; b < ctx.block_size; ++b) {
-			for (i = 0; i < ctx.rsn; ++i)
-				rs_block[i] = buf[i * ctx.block_size + b];
+	r = FEC_process_rounds(cd, &ctx, rs, fec_device, params->fec_area_offset,
+			       memory_kb, decode, errors);
 
-			/* decoding from parity device */
-			if (decode) {
-				if (read_buffer(fd, &rs_block[ctx.rsn], ctx.roots) < 0) {
-					log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."), n);
-					r = -EIO;
-					goto out;
-				}
-
-				/* coverity[tainted_data] */
-				r = decode_rs_char(rs, rs_block);
-				if (r < 0) {
-					log_err(cd, _("Failed to repair parity for block %" PRIu64 "."), n);
-					r = -EPERM;
-					goto out;
-				}
-				/* return number of detected errors */
-				if (errors)
-					*errors += r;
-				r = 0;
-			} else {
-				/* encoding and writing parity data to fec device */
-				encode_rs_char(rs, rs_block, &rs_block[ctx.rsn]);
-				if (write_buffer(fd, &rs_block[ctx.rsn], ctx.roots) < 0) {
-					log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."), n);
-					r = -EIO;
-					goto out;
-				}
-			}
-		}
-	}
-out:
 	free_rs_char(rs);
-	free(buf);
 	return r;
 }
 
@@ -278,7 +512,7 @@ int VERITY_FEC_process(struct crypt_device *cd,
 		goto out;
 	}
 
-	r = FEC_process_inputs(cd, params, inputs, ninputs, fd, check_fec, errors);
+	r = FEC_process_inputs(cd, params, inputs, ninputs, fec_device, check_fec, errors);
 out:
 	if (inputs[0].fd != -1)
 		close(inputs[0].fd);
@@ -290,6 +524,185 @@ out:
 	return r;
 }
 
+/*
+ * Streamed encoding, input blocks come in device order (data blocks first,
+ * then hash device metadata is read back at the end). Input block k is
+ * row k / rounds of round k % rounds, so rows of every round arrive in order
+ * and only shift registers of all rounds are kept (the size of parity area).
+ */
+struct verity_fec_stream {
+	struct fec_context ctx;
+	struct rs *rs;
+	struct device *fec_device;
+	struct crypt_params_verity *params;
+	uint8_t *planes;
+	uint64_t block;		/* next input block */
+};
+
+int VERITY_FEC_stream_init(struct crypt_device *cd,
+			   struct crypt_params_verity *params,
+			   struct device *fec_device,
+			   struct verity_fec_stream **fs)
+{
+	struct verity_fec_stream *s;
+	uint64_t blocks, hash_blocks;
+	size_t size;
+	int r;
+
+	r = VERITY_FEC_validate(cd, params);
+	if (r < 0)
+		return r;
+
+	/* hash area is not written yet, FEC must cover it once it is */
+	blocks = VERITY_FEC_blocks(cd, fec_device, params);
+	hash_blocks = VERITY_hash_blocks(cd, params);
+	if (blocks < params->data_size + hash_blocks)
+		blocks = params->data_size + hash_blocks;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->ctx.roots = params->fec_roots;
+	s->ctx.rsn = FEC_RSM - s->ctx.roots;
+	s->ctx.block_size = params->data_block_size;
+	s->ctx.size = blocks * params->data_block_size;
+	s->ctx.blocks = blocks;
+	s->ctx.rounds = FEC_div_round_up(blocks, s->ctx.rsn);
+	s->fec_device = fec_device;
+	s->params = params;
+
+	size = (size_t)s->ctx.rounds * s->ctx.roots * s->ctx.block_size;
+	if (size / s->ctx.rounds != (size_t)s->ctx.roots * s->ctx.block_size) {
+		free(s);
+		return -EINVAL;
+	}
+
+	log_dbg(cd, "Streamed FEC encoding of %" PRIu64 " blocks in %" PRIu64 " rounds, %zu bytes of state.",
+		blocks, s->ctx.rounds, size);
+
+	s->rs = init_rs_char(FEC_PARAMS(s->ctx.roots));
+	s->planes = calloc(1, size);
+	if (!s->rs || !s->planes) {
+		log_err(cd, _("Failed to allocate buffer."));
+		VERITY_FEC_stream_free(s);
+		return -ENOMEM;
+	}
+
+	*fs = s;
+	return 0;
+}
+
+void VERITY_FEC_stream_write(struct verity_fec_stream *fs, const char *block)
+{
+	struct fec_context *ctx = &fs->ctx;
+	size_t round_size = (size_t)ctx->roots * ctx->block_size;
+
+	if (fs->block >= ctx->blocks)
+		return;
+
+	encode_rs_char_rows(fs->rs, (const uint8_t *)block, ctx->block_size,
+			    fs->block / ctx->rounds, 1, ctx->block_size,
+			    &fs->planes[(fs->block % ctx->rounds) * round_size]);
+	fs->block++;
+}
+
+/* encodes hash device metadata, pads rounds with zero rows and writes parity */
+int VERITY_FEC_stream_final(struct crypt_device *cd, struct verity_fec_stream *fs)
+{
+	struct fec_context *ctx = &fs->ctx;
+	size_t round_size = (size_t)ctx->roots * ctx->block_size, batch, i, len;
+	uint64_t n, rows, count, done;
+	uint8_t *buf = NULL;
+	int r = -EIO, fd = -1;
+
+	/* the same buffer is used for metadata reads and parity writes */
+	batch = FEC_WRITE_BUFFER_SIZE / round_size ?: 1;
+	if (batch > ctx->rounds)
+		batch = ctx->rounds;
+	len = size_round_up(batch * round_size, ctx->block_size);
+
+	buf = malloc(len);
+	if (!buf) {
+		log_err(cd, _("Failed to allocate buffer."));
+		return -ENOMEM;
+	}
+
+	if (fs->block < ctx->blocks) {
+		fd = open(device_path(crypt_metadata_device(cd)), O_RDONLY);
+		if (fd == -1) {
+			log_err(cd, _("Cannot open device %s."), device_path(crypt_metadata_device(cd)));
+			goto out;
+		}
+		if (lseek(fd, VERITY_hash_offset_block(fs->params) * ctx->block_size, SEEK_SET) < 0)
+			goto out;
+
+		while (fs->block < ctx->blocks) {
+			count = (ctx->blocks - fs->block) * ctx->block_size;
+			if (count > len)
+				count = len;
+			/* hash device can be shorter than the covered area, the rest is zeroes */
+			memset(buf, 0, count);
+			if (read_buffer(fd, buf, count) < 0) {
+				log_err(cd, _("Cannot read device %s."),
+					device_path(crypt_metadata_device(cd)));
+				goto out;
+			}
+			for (i = 0; i < count; i += ctx->block_size)
+				VERITY_FEC_stream_write(fs, (const char *)&buf[i]);
+		}
+		close(fd);
+		fd = -1;
+	}
+
+	memset(buf, 0, ctx->block_size);
+	for (n = 0; n < ctx->rounds; n++) {
+		rows = FEC_div_round_up(ctx->blocks - n, ctx->rounds);
+		if (rows < ctx->rsn)
+			encode_rs_char_rows(fs->rs, buf, 0, rows, ctx->rsn - rows,
+					    ctx->block_size, &fs->planes[n * round_size]);
+	}
+
+	fd = open(device_path(fs->fec_device), O_RDWR);
+	if (fd == -1) {
+		log_err(cd, _("Cannot open device %s."), device_path(fs->fec_device));
+		goto out;
+	}
+
+	for (n = 0; n < ctx->rounds; n += done) {
+		done = ctx->rounds - n;
+		if (done > batch)
+			done = batch;
+
+		for (i = 0; i < done; i++)
+			encode_rs_char_planes(fs->rs, &fs->planes[(n + i) * round_size],
+					      ctx->block_size, &buf[i * round_size]);
+
+		if (lseek(fd, fs->params->fec_area_offset + n * round_size, SEEK_SET) < 0 ||
+		    write_buffer(fd, buf, done * round_size) < 0) {
+			log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."), n);
+			goto out;
+		}
+	}
+
+	r = fsync(fd) ? -EIO : 0;
+out:
+	if (fd != -1)
+		close(fd);
+	free(buf);
+	return r;
+}
+
+void VERITY_FEC_stream_free(struct verity_fec_stream *fs)
+{
+	if (!fs)
+		return;
+
+	free_rs_char(fs->rs);
+	free(fs->planes);
+	free(fs);
+}
+
 /* All blocks that are covered by FEC */
 uint64_t VERITY_FEC_blocks(struct crypt_device *cd,
 			   struct device *fec_device,
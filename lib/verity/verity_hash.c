@@ -19,10 +19,13 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include "verity.h"
 #include "internal.h"
@@ -30,6 +33,16 @@
 #define VERITY_MAX_LEVELS	63
 #define VERITY_MAX_DIGEST_SIZE	1024
 
+/* Minimal number of hash blocks per worker thread (of the bottom level) */
+#define VERITY_MIN_THREAD_HASH_BLOCKS	64
+#define VERITY_MAX_THREADS		64
+
+/* Size of one read (or write) request of a data or hash stream */
+#define VERITY_IO_BUFFER_SIZE		(1024 * 1024)
+
+/* Hash tree up to this size (and 1/16 of RAM) is created in memory */
+#define VERITY_MEMORY_TREE_MAX		(256 * 1024 * 1024)
+
 static unsigned get_bits_up(size_t u)
 {
 	unsigned i = 0;
@@ -46,58 +59,363 @@ static unsigned get_bits_down(size_t u)
 	return i;
 }
 
-static int verify_zero(struct crypt_device *cd, FILE *wr, size_t bytes)
+/*
+ * Device parameters, resolved before any worker thread is started.
+ * If mem is set, the device range from mem_offset is accessed in memory only.
+ */
+struct verity_device {
+	struct device *device;
+	size_t bsize;
+	size_t alignment;
+	bool direct_io;
+	char *mem;
+	uint64_t mem_offset;
+	uint64_t mem_size;
+};
+
+/*
+ * Sequential access to a device range in VERITY_IO_BUFFER_SIZE chunks.
+ * Reads go through the shared bulk reader (next chunk is prefetched),
+ * callers get pointers into the chunk (blocks never cross the chunk boundary).
+ * Writes are collected in the buffer and written once it is full.
+ */
+struct verity_stream {
+	const struct verity_device *vd;
+	int fd;
+	struct bulk_reader *br;
+	const char *rbuf;
+	char *buf;
+	size_t buf_size;
+	uint64_t offset;	/* device offset of the chunk (buf[0]) */
+	uint64_t end;
+	size_t pos, len;
+};
+
+static int verity_device_init(struct crypt_device *cd, struct verity_device *vd,
+			      struct device *device, bool direct_io)
+{
+	vd->device = device;
+	vd->bsize = device_block_size(cd, device);
+	vd->alignment = device_alignment(device);
+	vd->direct_io = direct_io && device_direct_io(device);
+	vd->mem = NULL;
+	vd->mem_offset = vd->mem_size = 0;
+
+	return vd->bsize && vd->alignment ? 0 : -EINVAL;
+}
+
+static int verity_open(const struct verity_device *vd, int flags)
+{
+	int fd = -1;
+
+	if (vd->direct_io)
+		fd = open(device_path(vd->device), flags | O_DIRECT);
+	if (fd < 0)
+		fd = open(device_path(vd->device), flags);
+
+	return fd;
+}
+
+static int stream_init(struct verity_stream *s, const struct verity_device *vd, int fd,
+		       uint64_t offset, uint64_t length, size_t block_size)
+{
+	s->vd = vd;
+	s->fd = fd;
+	s->br = NULL;
+	s->buf = NULL;
+	s->offset = offset;
+	s->end = offset + length;
+	s->pos = s->len = 0;
+
+	s->buf_size = size_round_up(VERITY_IO_BUFFER_SIZE, block_size);
+	if (length && length < s->buf_size)
+		s->buf_size = length;
+
+	return 0;
+}
+
+static void stream_destroy(struct verity_stream *s)
+{
+	bulk_reader_destroy(s->br);
+	s->br = NULL;
+	free(s->buf);
+	s->buf = NULL;
+}
+
+static uint64_t stream_pos(const struct verity_stream *s)
+{
+	return s->offset + s->pos;
+}
+
+/* Reads up to max blocks available in one chunk, returns their count */
+static int stream_read_blocks(struct verity_stream *s, size_t size, unsigned max, const char **data)
+{
+	unsigned count;
+	ssize_t r;
+
+	if (s->vd->mem) {
+		if (s->offset + s->pos + size > s->end ||
+		    s->offset + s->pos < s->vd->mem_offset ||
+		    s->end > s->vd->mem_offset + s->vd->mem_size)
+			return -EIO;
+
+		count = (s->end - s->offset - s->pos) / size;
+		if (count > max)
+			count = max;
+
+		*data = s->vd->mem + (s->offset + s->pos - s->vd->mem_offset);
+		s->pos += count * size;
+		return (int)count;
+	}
+
+	if (s->pos + size > s->len) {
+		if (s->pos != s->len)
+			return -EINVAL;
+
+		if (!s->br && bulk_reader_init(&s->br, s->fd, s->vd->bsize, s->vd->alignment,
+					       s->offset, s->end - s->offset, s->buf_size,
+					       BULK_READ_PREFETCH | BULK_READ_DROP_BEHIND))
+			return -ENOMEM;
+
+		s->offset += s->len;
+		s->pos = s->len = 0;
+
+		if (s->end - s->offset < size)
+			return -EIO;
+
+		r = bulk_reader_next(s->br, &s->rbuf);
+		if (r < (ssize_t)size)
+			return -EIO;
+		s->len = r;
+	}
+
+	count = (s->len - s->pos) / size;
+	if (count > max)
+		count = max;
+
+	*data = s->rbuf + s->pos;
+	s->pos += count * size;
+	return (int)count;
+}
+
+static int stream_read(struct verity_stream *s, size_t size, const char **data)
+{
+	int r = stream_read_blocks(s, size, 1, data);
+
+	return r < 0 ? r : 0;
+}
+
+static int stream_flush(struct verity_stream *s)
+{
+	ssize_t r;
+
+	if (!s->len)
+		return 0;
+
+	if (s->vd->mem) {
+		s->offset += s->len;
+		s->len = 0;
+		return 0;
+	}
+
+	r = write_lseek_blockwise(s->fd, s->vd->bsize, s->vd->alignment,
+				  s->buf, s->len, s->offset);
+	if (r < 0 || (size_t)r != s->len)
+		return -EIO;
+
+	s->offset += s->len;
+	s->len = 0;
+	return 0;
+}
+
+/* NULL data writes zeroes */
+static int stream_write(struct verity_stream *s, const char *data, size_t size)
 {
-	char *block = NULL;
-	size_t i;
 	int r;
 
-	block = malloc(bytes);
-	if (!block)
+	if (s->len + size > s->buf_size && (r = stream_flush(s)))
+		return r;
+
+	if (size > s->buf_size)
+		return -EINVAL;
+
+	if (s->vd->mem) {
+		if (s->offset + s->len + size > s->end ||
+		    s->offset + s->len < s->vd->mem_offset ||
+		    s->end > s->vd->mem_offset + s->vd->mem_size)
+			return -EIO;
+		if (data)
+			memcpy(s->vd->mem + (s->offset + s->len - s->vd->mem_offset), data, size);
+		else
+			memset(s->vd->mem + (s->offset + s->len - s->vd->mem_offset), 0, size);
+		s->len += size;
+		return 0;
+	}
+
+	if (!s->buf && posix_memalign((void **)&s->buf, s->vd->alignment, s->buf_size)) {
+		s->buf = NULL;
 		return -ENOMEM;
+	}
+
+	if (data)
+		memcpy(s->buf + s->len, data, size);
+	else
+		memset(s->buf + s->len, 0, size);
+	s->len += size;
+
+	return 0;
+}
 
-	if (fread(block, bytes, 1, wr) != 1) {
+static int verify_zero(struct crypt_device *cd, struct verity_stream *s, size_t bytes)
+{
+	const char *block;
+	size_t i;
+
+	if (stream_read(s, bytes, &block)) {
 		log_dbg(cd, "EIO while reading spare area.");
-		r = -EIO;
-		goto out;
+		return -EIO;
 	}
 	for (i = 0; i < bytes; i++)
 		if (block[i]) {
 			log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."),
-				ftello(wr) - bytes);
-			r = -EPERM;
-			goto out;
+				stream_pos(s) - bytes);
+			return -EPERM;
 		}
-	r = 0;
-out:
-	free(block);
-	return r;
+
+	return 0;
 }
 
-static int verify_hash_block(const char *hash_name, int version,
-			      char *hash, size_t hash_size,
-			      const char *data, size_t data_size,
-			      const char *salt, size_t salt_size)
+/* Salt prefix long enough to be kept hashed in a saved context (version 1) */
+#define VERITY_SALT_MIDSTATE_MIN	64
+
+/*
+ * Block hashing with salt, one backend context is reused (final resets it).
+ * If SIMD lanes are faster, consecutive blocks are hashed at once
+ * with salt already in the prefix state (version 1).
+ * Long salt prefix is hashed once and its state copied for every block.
+ */
+struct verity_hasher {
+	struct crypt_hash *ctx;
+	struct crypt_hash *salt_ctx;
+	struct crypt_hash_multi *mctx;
+	int version;
+	const char *salt;
+	size_t salt_size;
+	size_t digest_size;
+	unsigned lanes;
+	char *digests;
+	unsigned count, next;
+	uint64_t offset;	/* device offset of the first hashed block */
+};
+
+static void hasher_destroy(struct verity_hasher *vh)
 {
-	struct crypt_hash *ctx = NULL;
-	int r;
+	if (vh->ctx)
+		crypt_hash_destroy(vh->ctx);
+	if (vh->salt_ctx)
+		crypt_hash_destroy(vh->salt_ctx);
+	crypt_hash_multi_destroy(vh->mctx);
+	free(vh->digests);
+	memset(vh, 0, sizeof(*vh));
+}
+
+static int hasher_init(struct verity_hasher *vh, const char *hash_name, int version,
+		       const char *salt, size_t salt_size, size_t digest_size)
+{
+	memset(vh, 0, sizeof(*vh));
+	vh->version = version;
+	vh->salt = salt;
+	vh->salt_size = salt_size;
+	vh->digest_size = digest_size;
 
-	if (crypt_hash_init(&ctx, hash_name))
+	if (crypt_hash_init(&vh->ctx, hash_name))
 		return -EINVAL;
 
-	if (version == 1 && (r = crypt_hash_write(ctx, salt, salt_size)))
-		goto out;
+	/* state copy is a syscall with kernel backend, not worth it */
+	if (version == 1 && salt_size >= VERITY_SALT_MIDSTATE_MIN &&
+	    !(crypt_backend_flags() & CRYPT_BACKEND_KERNEL)) {
+		if (crypt_hash_init(&vh->salt_ctx, hash_name) ||
+		    crypt_hash_write(vh->salt_ctx, salt, salt_size)) {
+			hasher_destroy(vh);
+			return -EINVAL;
+		}
+	}
 
-	if ((r = crypt_hash_write(ctx, data, data_size)))
-		goto out;
+	vh->lanes = crypt_hash_multi_lanes(hash_name);
+	if (vh->lanes > 1 && digest_size == (size_t)crypt_hash_size(hash_name) &&
+	    !crypt_hash_multi_init(&vh->mctx, hash_name,
+				   version == 1 ? salt : NULL, version == 1 ? salt_size : 0,
+				   version == 0 ? salt : NULL, version == 0 ? salt_size : 0)) {
+		vh->digests = malloc(vh->lanes * digest_size);
+		if (!vh->digests) {
+			hasher_destroy(vh);
+			return -ENOMEM;
+		}
+	} else {
+		crypt_hash_multi_destroy(vh->mctx);
+		vh->mctx = NULL;
+		vh->lanes = 1;
+		vh->digests = malloc(digest_size);
+		if (!vh->digests) {
+			hasher_destroy(vh);
+			return -ENOMEM;
+		}
+	}
 
-	if (version == 0 && (r = crypt_hash_write(ctx, salt, salt_size)))
-		goto out;
+	return 0;
+}
 
-	r = crypt_hash_final(ctx, hash, hash_size);
-out:
-	crypt_hash_destroy(ctx);
-	return r;
+static int verify_hash_block(struct verity_hasher *vh, char *hash,
+			     const char *data, size_t data_size)
+{
+	int r;
+
+	if (vh->salt_ctx) {
+		if ((r = crypt_hash_copy(vh->ctx, vh->salt_ctx)))
+			return r;
+	} else if (vh->version == 1 && (r = crypt_hash_write(vh->ctx, vh->salt, vh->salt_size)))
+		return r;
+
+	if ((r = crypt_hash_write(vh->ctx, data, data_size)))
+		return r;
+
+	if (vh->version == 0 && (r = crypt_hash_write(vh->ctx, vh->salt, vh->salt_size)))
+		return r;
+
+	return crypt_hash_final(vh->ctx, hash, vh->digest_size);
+}
+
+/* Digest of the next block (of blocks left in the stream range) and its offset */
+static int hasher_next(struct verity_hasher *vh, struct verity_stream *rs, size_t block_size,
+		       uint64_t blocks, char *digest, uint64_t *offset)
+{
+	const char *data;
+	int r;
+
+	if (vh->next == vh->count) {
+		r = stream_read_blocks(rs, block_size, blocks < vh->lanes ? (unsigned)blocks : vh->lanes, &data);
+		if (r <= 0)
+			return -EIO;
+
+		vh->count = (unsigned)r;
+		vh->next = 0;
+		vh->offset = stream_pos(rs) - (uint64_t)vh->count * block_size;
+
+		if (vh->count > 1)
+			r = crypt_hash_multi(vh->mctx, data, block_size, vh->count, vh->digests);
+		else
+			r = verify_hash_block(vh, vh->digests, data, block_size);
+		if (r) {
+			vh->count = 0;
+			return -EINVAL;
+		}
+	}
+
+	memcpy(digest, vh->digests + vh->next * vh->digest_size, vh->digest_size);
+	*offset = vh->offset + (uint64_t)vh->next * block_size;
+	vh->next++;
+
+	return 0;
 }
 
 static int hash_levels(size_t hash_block_size, size_t digest_size,
@@ -141,7 +459,9 @@ static int hash_levels(size_t hash_block_size, size_t digest_size,
 	return 0;
 }
 
-static int create_or_verify(struct crypt_device *cd, FILE *rd, FILE *wr,
+static int create_or_verify(struct crypt_device *cd,
+				   const struct verity_device *rd_dev, int rd,
+				   const struct verity_device *wr_dev, int wr,
 				   uint64_t data_block, size_t data_block_size,
 				   uint64_t hash_block, size_t hash_block_size,
 				   uint64_t blocks, int version,
@@ -149,79 +469,65 @@ static int create_or_verify(struct crypt_device *cd, FILE *rd, FILE *wr,
 				   char *calculated_digest, size_t digest_size,
 				   const char *salt, size_t salt_size)
 {
-	char *left_block, *data_buffer;
-	char read_digest[VERITY_MAX_DIGEST_SIZE];
+	struct verity_stream rs = { .buf = NULL }, ws = { .buf = NULL };
+	struct verity_hasher vh = { .ctx = NULL };
+	const char *read_digest;
 	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
 	size_t digest_size_full = 1 << get_bits_up(digest_size);
 	uint64_t blocks_to_write = (blocks + hash_per_block - 1) / hash_per_block;
-	uint64_t seek_rd, seek_wr;
+	uint64_t seek_rd, seek_wr, len_rd, len_wr, pos_rd;
 	size_t left_bytes;
 	unsigned i;
 	int r;
 
-	if (digest_size > sizeof(read_digest))
+	if (digest_size > VERITY_MAX_DIGEST_SIZE)
 		return -EINVAL;
 
 	if (uint64_mult_overflow(&seek_rd, data_block, data_block_size) ||
-	    uint64_mult_overflow(&seek_wr, hash_block, hash_block_size)) {
+	    uint64_mult_overflow(&seek_wr, hash_block, hash_block_size) ||
+	    uint64_mult_overflow(&len_rd, blocks, data_block_size) ||
+	    uint64_mult_overflow(&len_wr, blocks_to_write, hash_block_size) ||
+	    seek_rd + len_rd < seek_rd || seek_wr + len_wr < seek_wr) {
 		log_err(cd, _("Device offset overflow."));
 		return -EINVAL;
 	}
 
-	if (fseeko(rd, seek_rd, SEEK_SET)) {
-		log_dbg(cd, "Cannot seek to requested position in data device.");
-		return -EIO;
-	}
-
-	if (wr && fseeko(wr, seek_wr, SEEK_SET)) {
-		log_dbg(cd, "Cannot seek to requested position in hash device.");
-		return -EIO;
-	}
-
-	left_block = malloc(hash_block_size);
-	data_buffer = malloc(data_block_size);
-	if (!left_block || !data_buffer) {
-		r = -ENOMEM;
+	r = hasher_init(&vh, hash_name, version, salt, salt_size, digest_size);
+	if (!r)
+		r = stream_init(&rs, rd_dev, rd, seek_rd, len_rd, data_block_size);
+	if (!r && wr >= 0)
+		r = stream_init(&ws, wr_dev, wr, seek_wr, len_wr, hash_block_size);
+	if (r)
 		goto out;
-	}
 
-	memset(left_block, 0, hash_block_size);
 	while (blocks_to_write--) {
 		left_bytes = hash_block_size;
 		for (i = 0; i < hash_per_block; i++) {
 			if (!blocks)
 				break;
-			blocks--;
-			if (fread(data_buffer, data_block_size, 1, rd) != 1) {
+			r = hasher_next(&vh, &rs, data_block_size, blocks--,
+					calculated_digest, &pos_rd);
+			if (r == -EIO)
 				log_dbg(cd, "Cannot read data device block.");
-				r = -EIO;
-				goto out;
-			}
-
-			if (verify_hash_block(hash_name, version,
-					calculated_digest, digest_size,
-					data_buffer, data_block_size,
-					salt, salt_size)) {
-				r = -EINVAL;
+			if (r)
 				goto out;
-			}
 
-			if (!wr)
+			if (wr < 0)
 				break;
 			if (verify) {
-				if (fread(read_digest, digest_size, 1, wr) != 1) {
+				if (stream_read(&ws, digest_size, &read_digest)) {
 					log_dbg(cd, "Cannot read digest form hash device.");
 					r = -EIO;
 					goto out;
 				}
 				if (crypt_backend_memeq(read_digest, calculated_digest, digest_size)) {
 					log_err(cd, _("Verification failed at position %" PRIu64 "."),
-						ftello(rd) - data_block_size);
+						pos_rd);
 					r = -EPERM;
 					goto out;
 				}
 			} else {
-				if (fwrite(calculated_digest, digest_size, 1, wr) != 1) {
+				if (stream_write(&ws, calculated_digest, digest_size)) {
 					log_dbg(cd, "Cannot write digest to hash device.");
 					r = -EIO;
 					goto out;
@@ -232,10 +538,10 @@ static int create_or_verify(struct crypt_device *cd, FILE *rd, FILE *wr,
 			} else {
 				if (digest_size_full - digest_size) {
 					if (verify) {
-						r = verify_zero(cd, wr, digest_size_full - digest_size);
+						r = verify_zero(cd, &ws, digest_size_full - digest_size);
 						if (r)
 							goto out;
-					} else if (fwrite(left_block, digest_size_full - digest_size, 1, wr) != 1) {
+					} else if (stream_write(&ws, NULL, digest_size_full - digest_size)) {
 						log_dbg(cd, "Cannot write spare area to hash device.");
 						r = -EIO;
 						goto out;
@@ -244,22 +550,158 @@ static int create_or_verify(struct crypt_device *cd, FILE *rd, FILE *wr,
 				left_bytes -= digest_size_full;
 			}
 		}
-		if (wr && left_bytes) {
+		if (wr >= 0 && left_bytes) {
 			if (verify) {
-				r = verify_zero(cd , wr, left_bytes);
+				r = verify_zero(cd , &ws, left_bytes);
 				if (r)
 					goto out;
-			} else if (fwrite(left_block, left_bytes, 1, wr) != 1) {
+			} else if (stream_write(&ws, NULL, left_bytes)) {
 				log_dbg(cd, "Cannot write remaining spare area to hash device.");
 				r = -EIO;
 				goto out;
 			}
 		}
 	}
+
+	if (wr >= 0 && !verify && stream_flush(&ws)) {
+		log_dbg(cd, "Cannot write digest to hash device.");
+		r = -EIO;
+		goto out;
+	}
 	r = 0;
 out:
-	free(left_block);
-	free(data_buffer);
+	hasher_destroy(&vh);
+	stream_destroy(&rs);
+	stream_destroy(&ws);
+	return r;
+}
+
+/*
+ * The bottom hash level is split to contiguous ranges of hash blocks,
+ * every worker hashes data blocks covered by its range through its own
+ * file descriptors. Ranges do not overlap, so the output is the same
+ * as if the level was calculated in one run.
+ */
+struct verity_worker {
+	struct crypt_device *cd;
+	struct crypt_params_verity *params;
+	const struct verity_device *data_dev;
+	const struct verity_device *hash_dev;
+	bool verify;
+	size_t digest_size;
+	uint64_t data_block;
+	uint64_t hash_block;
+	uint64_t blocks;
+	struct crypt_thread thread;
+	bool threaded;
+	int r;
+};
+
+static void verity_worker_run(struct verity_worker *w)
+{
+	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
+	int rd, wr = -1;
+
+	rd = verity_open(w->data_dev, O_RDONLY);
+	if (rd >= 0)
+		wr = verity_open(w->hash_dev, w->verify ? O_RDONLY : O_RDWR);
+	if (rd < 0 || wr < 0) {
+		log_dbg(w->cd, "Cannot open device for hash worker.");
+		w->r = -EIO;
+		goto out;
+	}
+
+	w->r = create_or_verify(w->cd, w->data_dev, rd, w->hash_dev, wr,
+				w->data_block, w->params->data_block_size,
+				w->hash_block, w->params->hash_block_size,
+				w->blocks, w->params->hash_type, w->params->hash_name, w->verify,
+				calculated_digest, w->digest_size,
+				w->params->salt, w->params->salt_size);
+out:
+	if (wr >= 0)
+		close(wr);
+	if (rd >= 0)
+		close(rd);
+}
+
+static void *verity_worker_fn(void *arg)
+{
+	verity_worker_run(arg);
+	return NULL;
+}
+
+static unsigned verity_threads(struct crypt_device *cd, uint64_t hash_blocks)
+{
+	uint64_t threads = crypt_verity_threads(cd) ?: crypt_cpusonline();
+
+	if (threads > VERITY_MAX_THREADS)
+		threads = VERITY_MAX_THREADS;
+	if (threads > hash_blocks / VERITY_MIN_THREAD_HASH_BLOCKS)
+		threads = hash_blocks / VERITY_MIN_THREAD_HASH_BLOCKS;
+
+	return threads ?: 1;
+}
+
+static int create_or_verify_parallel(struct crypt_device *cd, bool verify,
+				     struct crypt_params_verity *params,
+				     const struct verity_device *data_dev,
+				     const struct verity_device *hash_dev,
+				     uint64_t hash_block, uint64_t blocks,
+				     size_t digest_size, unsigned threads)
+{
+	struct verity_worker *w;
+	size_t hash_per_block = 1 << get_bits_down(params->hash_block_size / digest_size);
+	uint64_t hash_blocks = (blocks + hash_per_block - 1) / hash_per_block;
+	uint64_t start = 0, end, unit = 1;
+	unsigned i;
+	int r = 0;
+
+	w = calloc(threads, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	log_dbg(cd, "Using %u threads for the bottom hash level.", threads);
+
+	/* partial device block writes are read-modify-write, workers must not share one */
+	if (hash_dev->bsize > params->hash_block_size)
+		unit = hash_dev->bsize / params->hash_block_size;
+
+	for (i = 0; i < threads; i++) {
+		end = hash_blocks * (i + 1) / threads;
+		end = (hash_block + end + unit - 1) / unit * unit - hash_block;
+		if (end > hash_blocks || i == threads - 1)
+			end = hash_blocks;
+		if (end < start)
+			end = start;
+
+		w[i].cd = cd;
+		w[i].params = params;
+		w[i].data_dev = data_dev;
+		w[i].hash_dev = hash_dev;
+		w[i].verify = verify;
+		w[i].digest_size = digest_size;
+		w[i].hash_block = hash_block + start;
+		w[i].data_block = start * hash_per_block;
+		w[i].blocks = (end - start) * hash_per_block;
+		if (w[i].data_block + w[i].blocks > blocks)
+			w[i].blocks = w[i].data_block < blocks ? blocks - w[i].data_block : 0;
+		start = end;
+
+		/* the last range runs in caller thread */
+		if (i < threads - 1)
+			w[i].threaded = !crypt_thread_start(&w[i].thread, verity_worker_fn, &w[i], 0);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (w[i].threaded)
+			crypt_thread_join(&w[i].thread);
+		else
+			verity_worker_run(&w[i]);
+		if (!r)
+			r = w[i].r;
+	}
+
+	free(w);
 	return r;
 }
 
@@ -268,14 +710,16 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
 	char *root_hash, size_t digest_size)
 {
 	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
-	FILE *data_file = NULL;
-	FILE *hash_file = NULL, *hash_file_2;
+	struct verity_device data_dev, hash_dev = { .mem = NULL };
+	int data_fd = -1, hash_fd = -1, hash_fd_2;
 	uint64_t hash_level_block[VERITY_MAX_LEVELS];
 	uint64_t hash_level_size[VERITY_MAX_LEVELS];
 	uint64_t data_file_blocks;
 	uint64_t data_device_offset_max = 0, hash_device_offset_max = 0;
 	uint64_t hash_position = VERITY_hash_offset_block(params);
-	uint64_t dev_size;
+	uint64_t dev_size, tree_offset = 0, tree_size = 0;
+	unsigned threads;
+	ssize_t w;
 	int levels, i, r;
 
 	log_dbg(cd, "Hash %s %s, data device %s, data blocks %" PRIu64
@@ -315,8 +759,39 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
 		hash_device_offset_max - params->hash_area_offset);
 	log_dbg(cd, "Using %d hash levels.", levels);
 
-	data_file = fopen(device_path(crypt_data_device(cd)), "r");
-	if (!data_file) {
+	threads = levels ? verity_threads(cd, hash_level_size[0]) : 1;
+
+	/*
+	 * Only the data device is read with direct-io (if it supports it),
+	 * hash blocks are read back for upper levels through page cache.
+	 */
+	if (verity_device_init(cd, &data_dev, crypt_data_device(cd), true) ||
+	    verity_device_init(cd, &hash_dev, crypt_metadata_device(cd), false)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	/*
+	 * Small enough tree is created in memory (upper levels are calculated
+	 * from memory) and written at once by one sequential write at the end.
+	 */
+	if (!verify && levels) {
+		tree_offset = hash_level_block[levels - 1] * params->hash_block_size;
+		tree_size = hash_device_offset_max - tree_offset;
+	}
+	if (tree_size && tree_size <= VERITY_MEMORY_TREE_MAX &&
+	    tree_size <= crypt_getphysmemory_kb() * 1024 / 16) {
+		if (posix_memalign((void **)&hash_dev.mem, hash_dev.alignment, tree_size))
+			hash_dev.mem = NULL;
+		else {
+			hash_dev.mem_offset = tree_offset;
+			hash_dev.mem_size = tree_size;
+			log_dbg(cd, "Creating hash tree (%" PRIu64 " bytes) in memory.", tree_size);
+		}
+	}
+
+	data_fd = verity_open(&data_dev, O_RDONLY);
+	if (data_fd < 0) {
 		log_err(cd, _("Cannot open device %s."),
 			device_path(crypt_data_device(cd))
 		);
@@ -324,8 +799,8 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
 		goto out;
 	}
 
-	hash_file = fopen(device_path(crypt_metadata_device(cd)), verify ? "r" : "r+");
-	if (!hash_file) {
+	hash_fd = verity_open(&hash_dev, verify ? O_RDONLY : O_RDWR);
+	if (hash_fd < 0) {
 		log_err(cd, _("Cannot open device %s."),
 			device_path(crypt_metadata_device(cd)));
 		r = -EIO;
@@ -335,8 +810,13 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
 	memset(calculated_digest, 0, digest_size);
 
 	for (i = 0; i < levels; i++) {
-		if (!i) {
-			r = create_or_verify(cd, data_file, hash_file,
+		if (!i && threads > 1) {
+			r = create_or_verify_parallel(cd, verify, params, &data_dev, &hash_dev, hash_level_block[i],
+						      data_file_blocks, digest_size, threads);
+			if (r)
+				goto out;
+		} else if (!i) {
+			r = create_or_verify(cd, &data_dev, data_fd, &hash_dev, hash_fd,
 						    0, params->data_block_size,
 						    hash_level_block[i], params->hash_block_size,
 						    data_file_blocks, params->hash_type, params->hash_name, verify,
@@ -344,36 +824,43 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
 			if (r)
 				goto out;
 		} else {
-			hash_file_2 = fopen(device_path(crypt_metadata_device(cd)), "r");
-			if (!hash_file_2) {
+			hash_fd_2 = verity_open(&hash_dev, O_RDONLY);
+			if (hash_fd_2 < 0) {
 				log_err(cd, _("Cannot open device %s."),
 					device_path(crypt_metadata_device(cd)));
 				r = -EIO;
 				goto out;
 			}
-			r = create_or_verify(cd, hash_file_2, hash_file,
+			r = create_or_verify(cd, &hash_dev, hash_fd_2, &hash_dev, hash_fd,
 						    hash_level_block[i - 1], params->hash_block_size,
 						    hash_level_block[i], params->hash_block_size,
 						    hash_level_size[i - 1], params->hash_type, params->hash_name, verify,
 						    calculated_digest, digest_size, params->salt, params->salt_size);
-			fclose(hash_file_2);
+			close(hash_fd_2);
 			if (r)
 				goto out;
 		}
 	}
 
 	if (levels)
-		r = create_or_verify(cd, hash_file, NULL,
+		r = create_or_verify(cd, &hash_dev, hash_fd, NULL, -1,
 					    hash_level_block[levels - 1], params->hash_block_size,
 					    0, params->hash_block_size,
 					    1, params->hash_type, params->hash_name, verify,
 					    calculated_digest, digest_size, params->salt, params->salt_size);
 	else
-		r = create_or_verify(cd, data_file, NULL,
+		r = create_or_verify(cd, &data_dev, data_fd, NULL, -1,
 					    0, params->data_block_size,
 					    0, params->hash_block_size,
 					    data_file_blocks, params->hash_type, params->hash_name, verify,
 					    calculated_digest, digest_size, params->salt, params->salt_size);
+
+	if (!r && hash_dev.mem) {
+		w = write_lseek_blockwise(hash_fd, hash_dev.bsize, hash_dev.alignment,
+					  hash_dev.mem, hash_dev.mem_size, hash_dev.mem_offset);
+		if (w < 0 || (uint64_t)w != hash_dev.mem_size)
+			r = -EIO;
+	}
 out:
 	if (verify) {
 		if (r)
@@ -392,53 +879,854 @@ out:
 		else if (r)
 			log_err(cd, _("Creation of hash area failed."));
 		else {
-			fsync(fileno(hash_file));
+			fsync(hash_fd);
 			memcpy(root_hash, calculated_digest, digest_size);
 		}
 	}
 
-	if (data_file)
-		fclose(data_file);
-	if (hash_file)
-		fclose(hash_file);
+	free(hash_dev.mem);
+	if (data_fd >= 0)
+		close(data_fd);
+	if (hash_fd >= 0)
+		close(hash_fd);
 	return r;
 }
 
-/* Verify verity device using userspace crypto backend */
-int VERITY_verify(struct crypt_device *cd,
-		  struct crypt_params_verity *verity_hdr,
-		  const char *root_hash,
-		  size_t root_hash_size)
+/*
+ * Incremental update of an existing hash tree. Only digests of changed
+ * blocks and of their ancestors are recalculated, the rest of hash area
+ * is kept. Ranges are [start, end) in blocks of the level being processed.
+ */
+struct verity_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+struct verity_ranges {
+	struct verity_range *list;
+	unsigned count;
+	unsigned size;
+};
+
+static void ranges_free(struct verity_ranges *rs)
 {
-	return VERITY_create_or_verify_hash(cd, 1, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size);
+	free(rs->list);
+	memset(rs, 0, sizeof(*rs));
 }
 
-/* Create verity hash */
-int VERITY_create(struct crypt_device *cd,
-		  struct crypt_params_verity *verity_hdr,
-		  const char *root_hash,
-		  size_t root_hash_size)
+static int ranges_append(struct verity_ranges *rs, uint64_t start, uint64_t end)
 {
-	unsigned pgsize = (unsigned)crypt_getpagesize();
+	struct verity_range *tmp;
 
-	if (verity_hdr->salt_size > 256)
-		return -EINVAL;
+	if (start >= end)
+		return 0;
 
-	if (verity_hdr->data_block_size > pgsize)
-		log_err(cd, _("WARNING: Kernel cannot activate device if data "
-			      "block size exceeds page size (%u)."), pgsize);
+	if (rs->count == rs->size) {
+		tmp = realloc(rs->list, (rs->size ? 2 * rs->size : 16) * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		rs->list = tmp;
+		rs->size = rs->size ? 2 * rs->size : 16;
+	}
 
-	return VERITY_create_or_verify_hash(cd, 0, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size);
+	rs->list[rs->count].start = start;
+	rs->list[rs->count++].end = end;
+	return 0;
 }
 
-uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params)
+/* ranges must be added in ascending order of start, overlaps are merged */
+static int ranges_add(struct verity_ranges *rs, uint64_t start, uint64_t end)
 {
-	uint64_t hash_position = 0;
-	int levels = 0;
+	if (start < end && rs->count && rs->list[rs->count - 1].end >= start) {
+		if (end > rs->list[rs->count - 1].end)
+			rs->list[rs->count - 1].end = end;
+		return 0;
+	}
 
-	if (hash_levels(params->hash_block_size, crypt_get_volume_key_size(cd),
-		params->data_size, &hash_position, &levels, NULL, NULL))
+	return ranges_append(rs, start, end);
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct verity_range *r1 = a, *r2 = b;
+
+	if (r1->start == r2->start)
 		return 0;
+	return r1->start < r2->start ? -1 : 1;
+}
 
-	return (uint64_t)hash_position;
+static int ranges_normalize(struct verity_ranges *rs)
+{
+	struct verity_ranges tmp = { .list = NULL };
+	unsigned i;
+	int r = 0;
+
+	qsort(rs->list, rs->count, sizeof(*rs->list), range_cmp);
+
+	for (i = 0; i < rs->count && !r; i++)
+		r = ranges_add(&tmp, rs->list[i].start, rs->list[i].end);
+
+	ranges_free(rs);
+	*rs = tmp;
+	return r;
+}
+
+/* Data blocks that differ from old data device */
+static int verity_changed_blocks(struct crypt_device *cd,
+				 const struct verity_device *data_dev,
+				 const struct verity_device *old_dev,
+				 uint64_t blocks, size_t block_size,
+				 struct verity_ranges *changed)
+{
+	struct verity_stream ns = { .buf = NULL }, os = { .buf = NULL };
+	const char *new_data, *old_data;
+	uint64_t block = 0;
+	int nfd, ofd = -1, n, o, i, r;
+
+	nfd = verity_open(data_dev, O_RDONLY);
+	if (nfd >= 0)
+		ofd = verity_open(old_dev, O_RDONLY);
+	if (nfd < 0 || ofd < 0) {
+		log_err(cd, _("Cannot open device %s."),
+			device_path(nfd < 0 ? data_dev->device : old_dev->device));
+		r = -EIO;
+		goto out;
+	}
+
+	r = stream_init(&ns, data_dev, nfd, 0, blocks * block_size, block_size);
+	if (!r)
+		r = stream_init(&os, old_dev, ofd, 0, blocks * block_size, block_size);
+	if (r)
+		goto out;
+
+	while (block < blocks) {
+		/* both streams use the same chunk size, chunks are aligned */
+		n = stream_read_blocks(&ns, block_size, UINT32_MAX, &new_data);
+		o = n > 0 ? stream_read_blocks(&os, block_size, n, &old_data) : n;
+		if (n <= 0 || o != n) {
+			log_err(cd, _("Cannot read old data device %s."), device_path(old_dev->device));
+			r = -EIO;
+			goto out;
+		}
+
+		for (i = 0; i < n; i++)
+			if (memcmp(new_data + (size_t)i * block_size, old_data + (size_t)i * block_size, block_size) &&
+			    (r = ranges_add(changed, block + i, block + i + 1)))
+				goto out;
+		block += n;
+	}
+out:
+	stream_destroy(&ns);
+	stream_destroy(&os);
+	if (ofd >= 0)
+		close(ofd);
+	if (nfd >= 0)
+		close(nfd);
+	return r;
+}
+
+/*
+ * Recalculate digests of changed blocks of one level (data or lower hash level)
+ * in their hash blocks and return changed hash block ranges.
+ */
+static int update_level(struct crypt_device *cd, struct verity_hasher *vh,
+			const struct verity_device *src_dev, int src,
+			uint64_t src_block, size_t src_block_size,
+			const struct verity_device *hash_dev, int wr,
+			uint64_t hash_block, size_t hash_block_size,
+			size_t hash_per_block, size_t digest_step,
+			const struct verity_ranges *in, struct verity_ranges *out)
+{
+	struct verity_stream rs = { .buf = NULL };
+	char *block = NULL;
+	uint64_t start, end, p, c, c_end, pos;
+	unsigned i;
+	int r = 0;
+
+	if (posix_memalign((void **)&block, hash_dev->alignment, hash_block_size))
+		return -ENOMEM;
+
+	for (i = 0; i < in->count && !r; i++) {
+		start = in->list[i].start;
+		end = in->list[i].end;
+
+		r = stream_init(&rs, src_dev, src, (src_block + start) * src_block_size,
+				(end - start) * src_block_size, src_block_size);
+		if (r)
+			break;
+		vh->count = vh->next = 0;
+
+		for (p = start / hash_per_block; p <= (end - 1) / hash_per_block && !r; p++) {
+			if (read_lseek_blockwise(wr, hash_dev->bsize, hash_dev->alignment, block,
+			    hash_block_size, (hash_block + p) * hash_block_size) != (ssize_t)hash_block_size) {
+				log_dbg(cd, "Cannot read hash block %" PRIu64 ".", hash_block + p);
+				r = -EIO;
+				break;
+			}
+
+			c = p * hash_per_block > start ? p * hash_per_block : start;
+			c_end = (p + 1) * hash_per_block < end ? (p + 1) * hash_per_block : end;
+			for (; c < c_end && !r; c++)
+				r = hasher_next(vh, &rs, src_block_size, end - c,
+						block + (c % hash_per_block) * digest_step, &pos);
+			if (r)
+				break;
+
+			if (write_lseek_blockwise(wr, hash_dev->bsize, hash_dev->alignment, block,
+			    hash_block_size, (hash_block + p) * hash_block_size) != (ssize_t)hash_block_size) {
+				log_dbg(cd, "Cannot write hash block %" PRIu64 ".", hash_block + p);
+				r = -EIO;
+			}
+		}
+		stream_destroy(&rs);
+
+		if (!r)
+			r = ranges_add(out, start / hash_per_block, (end - 1) / hash_per_block + 1);
+	}
+
+	free(block);
+	return r;
+}
+
+int VERITY_update(struct crypt_device *cd,
+		  struct crypt_params_verity *params,
+		  struct device *old_data_device,
+		  const struct crypt_verity_range *ranges,
+		  unsigned int ranges_count,
+		  char *root_hash,
+		  size_t digest_size)
+{
+	struct verity_device data_dev, hash_dev, old_dev;
+	struct verity_ranges changed = { .list = NULL }, next = { .list = NULL };
+	struct verity_hasher vh = { .ctx = NULL };
+	struct verity_stream rs = { .buf = NULL };
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t hash_position = VERITY_hash_offset_block(params);
+	uint64_t blocks = params->data_size, pos, rehashed;
+	size_t hash_per_block, digest_step;
+	int data_fd = -1, hash_fd = -1, levels, i, r;
+
+	if (!blocks || digest_size > VERITY_MAX_DIGEST_SIZE ||
+	    (!old_data_device && !ranges_count) || (ranges_count && !ranges))
+		return -EINVAL;
+
+	if (hash_levels(params->hash_block_size, digest_size, blocks, &hash_position,
+		&levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		return -EINVAL;
+	}
+
+	hash_per_block = 1 << get_bits_down(params->hash_block_size / digest_size);
+	digest_step = params->hash_type == 0 ? digest_size : (size_t)1 << get_bits_up(digest_size);
+
+	if (verity_device_init(cd, &data_dev, crypt_data_device(cd), true) ||
+	    verity_device_init(cd, &hash_dev, crypt_metadata_device(cd), false) ||
+	    (old_data_device && verity_device_init(cd, &old_dev, old_data_device, true)))
+		return -EINVAL;
+
+	if (old_data_device) {
+		log_dbg(cd, "Comparing data device with old data device %s.", device_path(old_data_device));
+		r = verity_changed_blocks(cd, &data_dev, &old_dev, blocks,
+					  params->data_block_size, &changed);
+		if (r)
+			goto out;
+	}
+
+	for (i = 0; i < (int)ranges_count; i++) {
+		if (ranges[i].offset >= blocks || ranges[i].length > blocks - ranges[i].offset) {
+			log_err(cd, _("Changed range is outside of data area."));
+			r = -EINVAL;
+			goto out;
+		}
+		/* unsorted, normalized below */
+		if ((r = ranges_append(&changed, ranges[i].offset, ranges[i].offset + ranges[i].length)))
+			goto out;
+	}
+	r = ranges_normalize(&changed);
+	if (r)
+		goto out;
+
+	for (i = 0, rehashed = 0; i < (int)changed.count; i++)
+		rehashed += changed.list[i].end - changed.list[i].start;
+	log_dbg(cd, "Updating hash tree for %" PRIu64 " changed data blocks in %u ranges.",
+		rehashed, changed.count);
+
+	data_fd = verity_open(&data_dev, O_RDONLY);
+	if (data_fd < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(data_dev.device));
+		r = -EIO;
+		goto out;
+	}
+
+	hash_fd = verity_open(&hash_dev, O_RDWR);
+	if (hash_fd < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(hash_dev.device));
+		r = -EIO;
+		goto out;
+	}
+
+	r = hasher_init(&vh, params->hash_name, params->hash_type,
+			params->salt, params->salt_size, digest_size);
+	if (r)
+		goto out;
+
+	for (i = 0; i < levels; i++) {
+		if (!i)
+			r = update_level(cd, &vh, &data_dev, data_fd, 0, params->data_block_size,
+					 &hash_dev, hash_fd, hash_level_block[i], params->hash_block_size,
+					 hash_per_block, digest_step, &changed, &next);
+		else
+			r = update_level(cd, &vh, &hash_dev, hash_fd, hash_level_block[i - 1],
+					 params->hash_block_size, &hash_dev, hash_fd, hash_level_block[i],
+					 params->hash_block_size, hash_per_block, digest_step, &changed, &next);
+		if (r)
+			goto out;
+		ranges_free(&changed);
+		changed = next;
+		next = (struct verity_ranges){ .list = NULL };
+	}
+
+	/* root hash is digest of the top level block (or of the only data block) */
+	if (levels)
+		r = stream_init(&rs, &hash_dev, hash_fd, hash_level_block[levels - 1] * params->hash_block_size,
+				params->hash_block_size, params->hash_block_size);
+	else
+		r = stream_init(&rs, &data_dev, data_fd, 0, params->data_block_size, params->data_block_size);
+	vh.count = vh.next = 0;
+	if (!r)
+		r = hasher_next(&vh, &rs, levels ? params->hash_block_size : params->data_block_size,
+				1, root_hash, &pos);
+	if (!r && fsync(hash_fd))
+		r = -EIO;
+out:
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while creating hash area."));
+	else if (r)
+		log_err(cd, _("Creation of hash area failed."));
+
+	stream_destroy(&rs);
+	hasher_destroy(&vh);
+	ranges_free(&changed);
+	ranges_free(&next);
+	if (data_fd >= 0)
+		close(data_fd);
+	if (hash_fd >= 0)
+		close(hash_fd);
+	return r;
+}
+
+/*
+ * Streamed hash tree creation, data blocks are pushed in order by the caller
+ * (optionally also written to the data device) and never read back.
+ * Only one hash block per level is kept in memory, a completed block
+ * is written to its level (through a buffered stream) and its digest
+ * is pushed to the level above. Digest of the top level block is the root hash.
+ */
+struct crypt_verity_hash_stream {
+	struct crypt_params_verity *params;
+	struct verity_device data_dev, hash_dev;
+	struct verity_stream data_ws;
+	struct verity_stream level_ws[VERITY_MAX_LEVELS];
+	struct verity_hasher vh;
+	struct verity_fec_stream *fec;
+	int data_fd, hash_fd;
+	int levels;
+	size_t digest_size, digest_step, hash_per_block;
+	char *level_block;		/* levels * hash_block_size */
+	size_t level_count[VERITY_MAX_LEVELS];
+	char *partial;			/* incomplete data block */
+	size_t partial_len;
+	uint64_t blocks;		/* data blocks pushed */
+	char root_hash[VERITY_MAX_DIGEST_SIZE];
+	int r;				/* sticky error */
+};
+
+void VERITY_stream_free(struct crypt_verity_hash_stream *hs)
+{
+	int i;
+
+	if (!hs)
+		return;
+
+	stream_destroy(&hs->data_ws);
+	for (i = 0; i < hs->levels; i++)
+		stream_destroy(&hs->level_ws[i]);
+	hasher_destroy(&hs->vh);
+	VERITY_FEC_stream_free(hs->fec);
+	free(hs->level_block);
+	free(hs->partial);
+	if (hs->data_fd >= 0)
+		close(hs->data_fd);
+	if (hs->hash_fd >= 0)
+		close(hs->hash_fd);
+	free(hs);
+}
+
+int VERITY_stream_init(struct crypt_device *cd,
+		       struct crypt_params_verity *params,
+		       struct device *fec_device,
+		       bool write_data,
+		       size_t digest_size,
+		       struct crypt_verity_hash_stream **stream)
+{
+	struct crypt_verity_hash_stream *hs;
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t hash_position = VERITY_hash_offset_block(params);
+	uint64_t data_length;
+	int i, r;
+
+	if (!params->data_size || digest_size > VERITY_MAX_DIGEST_SIZE)
+		return -EINVAL;
+
+	if (uint64_mult_overflow(&data_length, params->data_size, params->data_block_size)) {
+		log_err(cd, _("Device offset overflow."));
+		return -EINVAL;
+	}
+
+	hs = calloc(1, sizeof(*hs));
+	if (!hs)
+		return -ENOMEM;
+
+	hs->params = params;
+	hs->digest_size = digest_size;
+	hs->data_fd = hs->hash_fd = -1;
+
+	if (hash_levels(params->hash_block_size, digest_size, params->data_size, &hash_position,
+		&hs->levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		hs->levels = 0;
+		r = -EINVAL;
+		goto out;
+	}
+
+	hs->hash_per_block = 1 << get_bits_down(params->hash_block_size / digest_size);
+	hs->digest_step = params->hash_type == 0 ? digest_size : (size_t)1 << get_bits_up(digest_size);
+
+	log_dbg(cd, "Hash stream creation %s, data blocks %" PRIu64 ", %d hash levels%s.",
+		params->hash_name, params->data_size, hs->levels,
+		write_data ? ", writing data device" : "");
+
+	if (verity_device_init(cd, &hs->data_dev, crypt_data_device(cd), true) ||
+	    verity_device_init(cd, &hs->hash_dev, crypt_metadata_device(cd), false)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = hasher_init(&hs->vh, params->hash_name, params->hash_type,
+			params->salt, params->salt_size, digest_size);
+	if (r)
+		goto out;
+
+	hs->partial = malloc(params->data_block_size);
+	hs->level_block = calloc(hs->levels ?: 1, params->hash_block_size);
+	if (!hs->partial || !hs->level_block) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (write_data) {
+		hs->data_fd = verity_open(&hs->data_dev, O_RDWR);
+		if (hs->data_fd < 0) {
+			log_err(cd, _("Cannot open device %s."), device_path(hs->data_dev.device));
+			r = -EIO;
+			goto out;
+		}
+		r = stream_init(&hs->data_ws, &hs->data_dev, hs->data_fd, 0,
+				data_length, params->data_block_size);
+		if (r)
+			goto out;
+	}
+
+	hs->hash_fd = verity_open(&hs->hash_dev, O_RDWR);
+	if (hs->hash_fd < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(hs->hash_dev.device));
+		r = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < hs->levels; i++) {
+		r = stream_init(&hs->level_ws[i], &hs->hash_dev, hs->hash_fd,
+				hash_level_block[i] * params->hash_block_size,
+				hash_level_size[i] * params->hash_block_size, params->hash_block_size);
+		if (r)
+			goto out;
+	}
+
+	if (fec_device) {
+		r = VERITY_FEC_stream_init(cd, params, fec_device, &hs->fec);
+		if (r)
+			goto out;
+	}
+
+	*stream = hs;
+	return 0;
+out:
+	VERITY_stream_free(hs);
+	return r;
+}
+
+static int stream_push_digest(struct crypt_verity_hash_stream *hs, int level, const char *digest);
+
+/* zero padded block of the level is written and hashed to the level above */
+static int stream_complete_level(struct crypt_verity_hash_stream *hs, int level)
+{
+	size_t hash_block_size = hs->params->hash_block_size;
+	char *block = &hs->level_block[level * hash_block_size];
+	char digest[VERITY_MAX_DIGEST_SIZE];
+	int r;
+
+	if (stream_write(&hs->level_ws[level], block, hash_block_size))
+		return -EIO;
+
+	r = verify_hash_block(&hs->vh, digest, block, hash_block_size);
+	if (r)
+		return -EINVAL;
+
+	memset(block, 0, hash_block_size);
+	hs->level_count[level] = 0;
+
+	return stream_push_digest(hs, level + 1, digest);
+}
+
+static int stream_push_digest(struct crypt_verity_hash_stream *hs, int level, const char *digest)
+{
+	if (level == hs->levels) {
+		memcpy(hs->root_hash, digest, hs->digest_size);
+		return 0;
+	}
+
+	memcpy(&hs->level_block[level * hs->params->hash_block_size +
+				hs->level_count[level] * hs->digest_step],
+	       digest, hs->digest_size);
+
+	if (++hs->level_count[level] < hs->hash_per_block)
+		return 0;
+
+	return stream_complete_level(hs, level);
+}
+
+/* pushes count consecutive full data blocks */
+static int stream_push_blocks(struct crypt_verity_hash_stream *hs, const char *data, size_t count)
+{
+	size_t block_size = hs->params->data_block_size, n, i;
+	struct verity_hasher *vh = &hs->vh;
+	int r;
+
+	if (count > hs->params->data_size - hs->blocks)
+		return -EINVAL;
+
+	if (hs->data_fd >= 0) {
+		for (i = 0; i < count; i++)
+			if (stream_write(&hs->data_ws, &data[i * block_size], block_size))
+				return -EIO;
+	}
+
+	while (count) {
+		n = count < vh->lanes ? count : vh->lanes;
+
+		if (n > 1)
+			r = crypt_hash_multi(vh->mctx, data, block_size, n, vh->digests);
+		else
+			r = verify_hash_block(vh, vh->digests, data, block_size);
+		if (r)
+			return -EINVAL;
+
+		for (i = 0; i < n; i++) {
+			if (hs->fec)
+				VERITY_FEC_stream_write(hs->fec, &data[i * block_size]);
+			r = stream_push_digest(hs, 0, &vh->digests[i * hs->digest_size]);
+			if (r)
+				return r;
+		}
+
+		hs->blocks += n;
+		data += n * block_size;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int VERITY_stream_write(struct crypt_device *cd,
+			struct crypt_verity_hash_stream *hs,
+			const char *data,
+			size_t length)
+{
+	size_t block_size = hs->params->data_block_size, len;
+	int r;
+
+	if (hs->r)
+		return hs->r;
+
+	if (length > (hs->params->data_size - hs->blocks) * block_size - hs->partial_len) {
+		log_err(cd, _("Data written to hash stream exceed data area size."));
+		hs->r = -EINVAL;
+		return hs->r;
+	}
+
+	if (hs->partial_len) {
+		len = block_size - hs->partial_len;
+		if (len > length)
+			len = length;
+		memcpy(&hs->partial[hs->partial_len], data, len);
+		hs->partial_len += len;
+		data += len;
+		length -= len;
+
+		if (hs->partial_len < block_size)
+			return 0;
+
+		hs->partial_len = 0;
+		r = stream_push_blocks(hs, hs->partial, 1);
+		if (r)
+			goto out;
+	}
+
+	r = stream_push_blocks(hs, data, length / block_size);
+	if (r)
+		goto out;
+
+	hs->partial_len = length % block_size;
+	memcpy(hs->partial, &data[length - hs->partial_len], hs->partial_len);
+out:
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while creating hash area."));
+	else if (r)
+		log_err(cd, _("Creation of hash area failed."));
+	hs->r = r;
+	return r;
+}
+
+int VERITY_stream_final(struct crypt_device *cd,
+			struct crypt_verity_hash_stream *hs,
+			char *root_hash,
+			size_t root_hash_size)
+{
+	int i, r;
+
+	if (hs->r)
+		return hs->r;
+
+	if (root_hash_size != hs->digest_size)
+		return -EINVAL;
+
+	if (hs->partial_len || hs->blocks != hs->params->data_size) {
+		log_err(cd, _("Data written to hash stream do not match data area size."));
+		return -EINVAL;
+	}
+
+	/* last blocks of lower levels are incomplete, pushing them completes upper ones */
+	for (i = 0, r = 0; !r && i < hs->levels; i++)
+		if (hs->level_count[i])
+			r = stream_complete_level(hs, i);
+
+	for (i = 0; !r && i < hs->levels; i++)
+		if (stream_flush(&hs->level_ws[i]))
+			r = -EIO;
+
+	if (!r && hs->data_fd >= 0 && (stream_flush(&hs->data_ws) || fsync(hs->data_fd)))
+		r = -EIO;
+
+	if (!r && fsync(hs->hash_fd))
+		r = -EIO;
+
+	/* FEC covers hash area as well, it is read back once written */
+	if (!r && hs->fec)
+		r = VERITY_FEC_stream_final(cd, hs->fec);
+
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while creating hash area."));
+	else if (r)
+		log_err(cd, _("Creation of hash area failed."));
+	else
+		memcpy(root_hash, hs->root_hash, root_hash_size);
+
+	hs->r = r ?: -EINVAL;
+	return r;
+}
+
+/* Verify verity device using userspace crypto backend */
+int VERITY_verify(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size)
+{
+	return VERITY_create_or_verify_hash(cd, 1, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size);
+}
+
+/*
+ * Sampled verification. The whole hash tree is verified against the root hash
+ * (it is a small fraction of data size), then data blocks are verified only
+ * for sampled bottom level hash blocks (each covers a contiguous range of data
+ * blocks). Bottom level is split to equal parts, one hash block is taken
+ * from every part, its random or the first one (strided sampling).
+ */
+int VERITY_verify_sample(struct crypt_device *cd,
+			 struct crypt_params_verity *params,
+			 const char *root_hash,
+			 size_t root_hash_size,
+			 uint64_t samples,
+			 uint32_t flags,
+			 uint64_t *verified_blocks)
+{
+	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
+	struct verity_device data_dev, hash_dev;
+	int data_fd = -1, hash_fd = -1, hash_fd_2 = -1;
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t hash_position = VERITY_hash_offset_block(params);
+	uint64_t j, unit, first, parts, rnd, blocks, verified = 0;
+	size_t hash_per_block;
+	int levels, i, r;
+
+	if (!samples || root_hash_size > sizeof(calculated_digest))
+		return -EINVAL;
+
+	if (hash_levels(params->hash_block_size, root_hash_size, params->data_size, &hash_position,
+			&levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		return -EINVAL;
+	}
+
+	/* nothing to sample from */
+	if (!levels || samples >= hash_level_size[0]) {
+		r = VERITY_verify(cd, params, root_hash, root_hash_size);
+		if (!r && verified_blocks)
+			*verified_blocks = params->data_size;
+		return r;
+	}
+
+	hash_per_block = 1 << get_bits_down(params->hash_block_size / root_hash_size);
+
+	log_dbg(cd, "Sampled hash verification of %" PRIu64 " of %" PRIu64 " hash blocks (%s).",
+		samples, hash_level_size[0], flags & CRYPT_VERITY_SAMPLE_STRIDED ? "strided" : "random");
+
+	if (verity_device_init(cd, &data_dev, crypt_data_device(cd), true) ||
+	    verity_device_init(cd, &hash_dev, crypt_metadata_device(cd), false))
+		return -EINVAL;
+
+	data_fd = verity_open(&data_dev, O_RDONLY);
+	hash_fd = verity_open(&hash_dev, O_RDONLY);
+	hash_fd_2 = verity_open(&hash_dev, O_RDONLY);
+	if (data_fd < 0 || hash_fd < 0 || hash_fd_2 < 0) {
+		log_err(cd, _("Cannot open device %s."),
+			device_path(data_fd < 0 ? crypt_data_device(cd) : crypt_metadata_device(cd)));
+		r = -EIO;
+		goto out;
+	}
+
+	/* upper levels, from the root down */
+	r = create_or_verify(cd, &hash_dev, hash_fd, NULL, -1,
+			     hash_level_block[levels - 1], params->hash_block_size,
+			     0, params->hash_block_size,
+			     1, params->hash_type, params->hash_name, 1,
+			     calculated_digest, root_hash_size, params->salt, params->salt_size);
+	if (r)
+		goto out;
+
+	if (crypt_backend_memeq(root_hash, calculated_digest, root_hash_size)) {
+		log_err(cd, _("Verification of root hash failed."));
+		r = -EFAULT;
+		goto out;
+	}
+
+	for (i = levels - 1; i > 0; i--) {
+		r = create_or_verify(cd, &hash_dev, hash_fd_2, &hash_dev, hash_fd,
+				     hash_level_block[i - 1], params->hash_block_size,
+				     hash_level_block[i], params->hash_block_size,
+				     hash_level_size[i - 1], params->hash_type, params->hash_name, 1,
+				     calculated_digest, root_hash_size, params->salt, params->salt_size);
+		if (r)
+			goto out;
+	}
+	log_dbg(cd, "Verification of hash tree succeeded.");
+
+	/* sampled data blocks, parts are in device order */
+	parts = hash_level_size[0];
+	for (j = 0; j < samples; j++) {
+		first = parts * j / samples;
+		unit = first;
+		if (!(flags & CRYPT_VERITY_SAMPLE_STRIDED)) {
+			r = crypt_random_get(cd, (char *)&rnd, sizeof(rnd), CRYPT_RND_NORMAL);
+			if (r < 0)
+				goto out;
+			unit += rnd % (parts * (j + 1) / samples - first);
+		}
+
+		blocks = params->data_size - unit * hash_per_block;
+		if (blocks > hash_per_block)
+			blocks = hash_per_block;
+
+		r = create_or_verify(cd, &data_dev, data_fd, &hash_dev, hash_fd,
+				     unit * hash_per_block, params->data_block_size,
+				     hash_level_block[0] + unit, params->hash_block_size,
+				     blocks, params->hash_type, params->hash_name, 1,
+				     calculated_digest, root_hash_size, params->salt, params->salt_size);
+		if (r)
+			goto out;
+		verified += blocks;
+	}
+
+	log_dbg(cd, "Verification of %" PRIu64 " sampled data blocks succeeded.", verified);
+	if (verified_blocks)
+		*verified_blocks = verified;
+out:
+	if (r && r != -EFAULT)
+		log_err(cd, _("Verification of data area failed."));
+	if (data_fd >= 0)
+		close(data_fd);
+	if (hash_fd >= 0)
+		close(hash_fd);
+	if (hash_fd_2 >= 0)
+		close(hash_fd_2);
+	return r;
+}
+
+/* Create verity hash */
+int VERITY_create(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size)
+{
+	unsigned pgsize = (unsigned)crypt_getpagesize();
+
+	if (verity_hdr->salt_size > 256)
+		return -EINVAL;
+
+	if (verity_hdr->data_block_size > pgsize)
+		log_err(cd, _("WARNING: Kernel cannot activate device if data "
+			      "block size exceeds page size (%u)."), pgsize);
+
+	return VERITY_create_or_verify_hash(cd, 0, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size);
+}
+
+uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params)
+{
+	uint64_t hash_position = 0;
+	int levels = 0;
+
+	if (hash_levels(params->hash_block_size, crypt_get_volume_key_size(cd),
+		params->data_size, &hash_position, &levels, NULL, NULL))
+		return 0;
+
+	return (uint64_t)hash_position;
+}
+
+/* Size of hash area (including superblock) starting at hash_area_offset */
+int VERITY_hash_area_size(struct crypt_params_verity *params, size_t digest_size, uint64_t *size)
+{
+	uint64_t hash_position = VERITY_hash_offset_block(params);
+	int levels = 0;
+
+	if (hash_levels(params->hash_block_size, digest_size, params->data_size,
+			&hash_position, &levels, NULL, NULL))
+		return -EINVAL;
+
+	if (uint64_mult_overflow(size, hash_position, params->hash_block_size))
+		return -EINVAL;
+
+	*size -= params->hash_area_offset;
+	return 0;
 }
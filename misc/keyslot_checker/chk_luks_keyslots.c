@@ -1,5 +1,5 @@
 /*
- * LUKS keyslot entropy tester. Works only for header version 1.
+ * LUKS keyslot entropy tester. Works for header version 1 and 2.
  *
  * Functionality: Determines sample entropy (symbols: bytes) for
  * each (by default) 512B sector in each used keyslot. If it
@@ -11,6 +11,7 @@
  * Version history:
  *    v0.1: 09.09.2012 Initial release
  *    v0.2: 08.10.2012 Converted to use libcryptsetup
+ *    v0.3: LUKS2 support, mmap keyslot areas, parallel scan
  *
  * Copyright (C) 2012, Arno Wagner <arno@wagner.name>
  *
@@ -36,10 +37,13 @@
 #include <math.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <libcryptsetup.h>
 
 const char *help =
-"Version 0.2 [8.10.2012]\n"
+"Version 0.3\n"
 "\n"
 "    chk_luks_keyslots [options] luks-device \n"
 "\n"
@@ -63,6 +67,8 @@ const char *help =
 "            up to retain sensitivity.\n"
 "  -v        Print found suspicious sectors verbosely. \n"
 "  -d        Print decimal addresses instead of hex ones.\n"
+"  -j <num>  Number of keyslots scanned in parallel.\n"
+"            Default: number of online CPUs.\n"
 "\n";
 
 
@@ -72,44 +78,62 @@ static int sector_size = 512;
 static double threshold = 0.90;
 static int print_decimal = 0;
 static int verbose = 0;
+static int threads = 1;
 
 /* tools */
 
+/* Precomputes -p*log2(p)/8 for every possible symbol count in a sector,
+ * len is the same for all sectors.
+ */
+static double *ent_table(int len)
+{
+	double *tbl, f;
+	int i;
+
+	tbl = malloc((len + 1) * sizeof(*tbl));
+	if (!tbl)
+		return NULL;
+
+	tbl[0] = 0.0;
+	for (i = 1; i <= len; i++) {
+		f = i / (double)len;
+		tbl[i] = -1.0 * f * log2(f) / 8.0;
+	}
+
+	return tbl;
+}
+
 /* Calculates and returns sample entropy on byte level for
- * The argument.
+ * The argument. Four histograms are counted so that consecutive
+ * equal bytes do not serialize on the same counter.
  */
-static double ent_samp(unsigned char * buf, int len)
+static double ent_samp(const unsigned char *buf, int len, const double *tbl)
 {
-	int freq[256];   /* stores symbol frequencies */
+	uint32_t freq[4][256];   /* stores symbol frequencies */
 	int i;
-	double e, f;
+	double e;
 
 	/* 0. Plausibility checks */
 	if (len <= 0)
 		return 0.0;
 
 	/* 1. count all frequencies */
-	for (i = 0; i < 256; i++) {
-		freq[i] = 0.0;
-	}
+	memset(freq, 0, sizeof(freq));
 
-	for (i = 0; i < len; i ++)
-		freq[buf[i]]++;
+	for (i = 0; i + 4 <= len; i += 4) {
+		freq[0][buf[i]]++;
+		freq[1][buf[i + 1]]++;
+		freq[2][buf[i + 2]]++;
+		freq[3][buf[i + 3]]++;
+	}
+	for (; i < len; i++)
+		freq[0][buf[i]]++;
 
 	/* 2. calculate sample entropy */
 	e = 0.0;
-	for (i = 0; i < 256; i++) {
-		f = freq[i];
-		if (f > 0) {
-			f =  f / (double)len;
-			e += f * log2(f);
-		}
-	}
+	for (i = 0; i < 256; i++)
+		e += tbl[freq[0][i] + freq[1][i] + freq[2][i] + freq[3][i]];
 
-	if (e != 0.0)
-		e = -1.0 * e;
-
-	e = e / 8.0;
 	return e;
 }
 
@@ -123,7 +147,7 @@ static void print_address(FILE *out, uint64_t value)
 }
 
 /* uses default "hd" style, i.e. 16 bytes followed by ASCII */
-static void hexdump_line(FILE *out, uint64_t address, unsigned char *buf) {
+static void hexdump_line(FILE *out, uint64_t address, const unsigned char *buf) {
 	int i;
 	static char tbl[16] = "0123456789ABCDEF";
 
@@ -154,7 +178,7 @@ static void hexdump_line(FILE *out, uint64_t address, unsigned char *buf) {
 	fprintf(out, "\n");
 }
 
-static void hexdump_sector(FILE *out, unsigned char *buf, uint64_t address, int len)
+static void hexdump_sector(FILE *out, const unsigned char *buf, uint64_t address, int len)
 {
 	int done;
 
@@ -165,71 +189,210 @@ static void hexdump_sector(FILE *out, unsigned char *buf, uint64_t address, int
 	}
 }
 
-static int check_keyslots(FILE *out, struct crypt_device *cd, int f_luks)
+/* Scans one keyslot area, output goes to the memory buffer of the job
+ * so that keyslots can be scanned in parallel and printed in order.
+ */
+struct slot_job {
+	int keyslot;
+	uint64_t start, length;
+	char *out_buf;
+	size_t out_size;
+	int r;
+};
+
+struct scan_ctx {
+	int f_luks;
+	const double *ent_tbl;
+	struct slot_job *jobs;
+	int jobs_count;
+	int next_job;
+	pthread_mutex_t lock;
+};
+
+/* Maps the keyslot area (mmap offset must be page aligned), falls back
+ * to one large read if the device cannot be mapped.
+ */
+static unsigned char *map_area(int f_luks, uint64_t start, uint64_t length,
+			       void **map, size_t *map_len)
 {
-	int i;
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t map_start = start & ~((uint64_t)page - 1);
+	unsigned char *buf;
+	ssize_t n;
+	size_t done;
+
+	*map_len = length + (start - map_start);
+	*map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, f_luks, map_start);
+	if (*map != MAP_FAILED) {
+		(void)madvise(*map, *map_len, MADV_SEQUENTIAL);
+		return (unsigned char *)*map + (start - map_start);
+	}
+
+	*map = NULL;
+	buf = malloc(length);
+	if (!buf)
+		return NULL;
+
+	for (done = 0; done < length; done += n) {
+		n = pread(f_luks, buf + done, length - done, start + done);
+		if (n <= 0) {
+			free(buf);
+			return NULL;
+		}
+	}
+
+	return buf;
+}
+
+static void scan_area(FILE *out, struct scan_ctx *ctx, struct slot_job *job)
+{
+	unsigned char *area;
+	uint64_t ofs;
+	size_t map_len;
+	void *map;
 	double ent;
-	off_t ofs;
-	uint64_t start, length, end;
+
+	area = map_area(ctx->f_luks, job->start, job->length, &map, &map_len);
+	if (!area) {
+		fprintf(out, "\nCannot read keyslot area.\n");
+		job->r = EXIT_FAILURE;
+		return;
+	}
+
+	for (ofs = 0; ofs < job->length; ofs += sector_size) {
+		ent = ent_samp(area + ofs, sector_size, ctx->ent_tbl);
+		if (ent < threshold) {
+			fprintf(out, "  low entropy at: ");
+			print_address(out, job->start + ofs);
+			fprintf(out, "   entropy: %f\n", ent);
+			if (verbose) {
+				fprintf(out, "  Binary dump:\n");
+				hexdump_sector(out, area + ofs, job->start + ofs, sector_size);
+				fprintf(out,"\n");
+			}
+		}
+	}
+
+	if (map)
+		munmap(map, map_len);
+	else
+		free(area);
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scan_ctx *ctx = arg;
+	struct slot_job *job;
+	FILE *out;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		job = ctx->next_job < ctx->jobs_count ? &ctx->jobs[ctx->next_job++] : NULL;
+		pthread_mutex_unlock(&ctx->lock);
+		if (!job)
+			break;
+
+		out = open_memstream(&job->out_buf, &job->out_size);
+		if (!out) {
+			job->r = EXIT_FAILURE;
+			continue;
+		}
+		scan_area(out, ctx, job);
+		fclose(out);
+	}
+
+	return NULL;
+}
+
+static int check_keyslots(FILE *out, struct crypt_device *cd, int f_luks)
+{
+	struct scan_ctx ctx = { .f_luks = f_luks };
+	struct slot_job *jobs;
+	pthread_t *tids;
 	crypt_keyslot_info ki;
-	unsigned char buffer[sector_size];
+	double *ent_tbl;
+	int i, j, max, started, r = EXIT_SUCCESS;
+
+	max = crypt_keyslot_max(crypt_get_type(cd));
+	jobs = calloc(max, sizeof(*jobs));
+	tids = calloc(threads, sizeof(*tids));
+	ent_tbl = ent_table(sector_size);
+	if (max <= 0 || !jobs || !tids || !ent_tbl) {
+		fprintf(stderr,"\nError: out of memory.\n");
+		r = EXIT_FAILURE;
+		goto out;
+	}
 
-	for (i = 0; i < crypt_keyslot_max(CRYPT_LUKS1) ; i++) {
-		fprintf(out, "- processing keyslot %d:", i);
+	/* keyslot areas are queried here, libcryptsetup context is not shared */
+	for (i = 0; i < max; i++) {
 		ki = crypt_keyslot_status(cd, i);
-		if (ki == CRYPT_SLOT_INACTIVE) {
-			fprintf(out, "  keyslot not in use\n");
+		if (ki == CRYPT_SLOT_INACTIVE)
 			continue;
-		}
 
 		if (ki == CRYPT_SLOT_INVALID) {
-			fprintf(out, "\nError: keyslot invalid.\n");
-			return EXIT_FAILURE;
+			fprintf(out, "\nError: keyslot %d invalid.\n", i);
+			r = EXIT_FAILURE;
+			goto out;
 		}
 
-		if (crypt_keyslot_area(cd, i, &start, &length) < 0) {
+		if (crypt_keyslot_area(cd, i, &jobs[ctx.jobs_count].start,
+				       &jobs[ctx.jobs_count].length) < 0) {
 			fprintf(stderr,"\nError: querying keyslot area failed for slot %d\n", i);
 			perror(NULL);
-			return EXIT_FAILURE;
+			r = EXIT_FAILURE;
+			goto out;
 		}
-		end = start + length;
-
-		fprintf(out, "  start: ");
-		print_address(out, start);
-		fprintf(out, "  end: ");
-		print_address(out, end);
-		fprintf(out, "\n");
 
 		/* check whether sector-size divides size */
-		if (length % sector_size != 0) {
+		if (jobs[ctx.jobs_count].length % sector_size != 0) {
 			fprintf(stderr,"\nError: Argument to -s does not divide keyslot size\n");
-			return EXIT_FAILURE;
+			r = EXIT_FAILURE;
+			goto out;
 		}
 
-		for (ofs = start; (uint64_t)ofs < end; ofs += sector_size) {
-			if (lseek(f_luks, ofs, SEEK_SET) != ofs) {
-				fprintf(stderr,"\nCannot seek to keyslot area.\n");
-				return EXIT_FAILURE;
-			}
-			if (read(f_luks, buffer, sector_size) != sector_size) {
-				fprintf(stderr,"\nCannot read keyslot area.\n");
-				return EXIT_FAILURE;
-			}
-			ent = ent_samp(buffer, sector_size);
-			if (ent < threshold) {
-				fprintf(out, "  low entropy at: ");
-				print_address(out, ofs);
-				fprintf(out, "   entropy: %f\n", ent);
-				if (verbose) {
-					fprintf(out, "  Binary dump:\n");
-					hexdump_sector(out, buffer, (uint64_t)ofs, sector_size);
-					fprintf(out,"\n");
-				}
-			}
-		}
+		jobs[ctx.jobs_count++].keyslot = i;
 	}
 
-	return EXIT_SUCCESS;
+	ctx.jobs = jobs;
+	ctx.ent_tbl = ent_tbl;
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	for (started = 0; started < threads && started < ctx.jobs_count; started++)
+		if (pthread_create(&tids[started], NULL, scan_thread, &ctx))
+			break;
+	/* no thread could be started, scan in this one */
+	if (!started)
+		scan_thread(&ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	pthread_mutex_destroy(&ctx.lock);
+
+	for (i = 0, j = 0; i < max; i++) {
+		fprintf(out, "- processing keyslot %d:", i);
+		if (j >= ctx.jobs_count || jobs[j].keyslot != i) {
+			fprintf(out, "  keyslot not in use\n");
+			continue;
+		}
+
+		fprintf(out, "  start: ");
+		print_address(out, jobs[j].start);
+		fprintf(out, "  end: ");
+		print_address(out, jobs[j].start + jobs[j].length);
+		fprintf(out, "\n");
+		if (jobs[j].out_buf)
+			fwrite(jobs[j].out_buf, 1, jobs[j].out_size, out);
+		if (jobs[j].r != EXIT_SUCCESS)
+			r = jobs[j].r;
+		j++;
+	}
+out:
+	for (i = 0; jobs && i < ctx.jobs_count; i++)
+		free(jobs[i].out_buf);
+	free(jobs);
+	free(tids);
+	free(ent_tbl);
+	return r;
 }
 
 /* Main */
@@ -256,9 +419,12 @@ int main(int argc, char **argv)
 
 	/* global initializations */
 	out = stdout;
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
 
 	/* get commandline parameters */
-	while ((c = getopt (argc, argv, "t:s:vd")) != -1) {
+	while ((c = getopt (argc, argv, "t:s:vdj:")) != -1) {
 		switch (c) {
 		case 't':
 			s = optarg;
@@ -288,6 +454,15 @@ int main(int argc, char **argv)
 			}
 			sector_size = svalue;
 			break;
+		case 'j':
+			s = optarg;
+			svalue = strtol(s, &end, 10);
+			if (s == end || svalue < 1) {
+				fprintf(stderr, "\nError: Argument to -j must be >= 1\n");
+				exit(EXIT_FAILURE);
+			}
+			threads = svalue;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -295,7 +470,7 @@ int main(int argc, char **argv)
 			print_decimal = 1;
 			break;
 		case '?':
-			if (optopt == 't' || optopt == 's')
+			if (optopt == 't' || optopt == 's' || optopt == 'j')
 				fprintf (stderr,"\nError: Option -%c requires an argument.\n",
 					 optopt);
 			else if (isprint (optopt)) {
@@ -348,10 +523,11 @@ int main(int argc, char **argv)
 	}
 
 	/* now load LUKS header into the crypt_device
-	 * This should also make sure a valid LUKS1 header is on disk
+	 * This should also make sure a valid LUKS1 or LUKS2 header is on disk
 	 * and hence we should be able to skip magic and version checks.
+	 * LUKS2 keyslot areas are taken from the JSON metadata.
 	 */
-	res = crypt_load(cd, CRYPT_LUKS1, NULL);
+	res = crypt_load(cd, CRYPT_LUKS, NULL);
 	if (res < 0) {
 		fprintf(stderr, "crypt_load() failed. LUKS header too broken/absent?\n");
 		crypt_free(cd);
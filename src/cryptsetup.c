@@ -21,7 +21,10 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
+#include <sys/utsname.h>
 #include <uuid/uuid.h>
+#include <json-c/json.h>
 
 #include "cryptsetup.h"
 #include "cryptsetup_args.h"
@@ -737,17 +740,93 @@ out:
 	return r;
 }
 
+static int action_status_all(void)
+{
+	struct crypt_active_device_summary *devs, *d;
+	size_t i, count;
+	int r;
+
+	r = crypt_active_devices_list(&devs, &count);
+	if (r < 0)
+		return r;
+
+	if (ARG_SET(OPT_JSON_ID))
+		log_std("[");
+
+	for (i = 0; i < count; i++) {
+		d = &devs[i];
+		if (!ARG_SET(OPT_JSON_ID)) {
+			log_std("%s/%s: type %s, target %s, size %" PRIu64 " sectors, %s%s%s\n",
+				crypt_get_dir(), d->name, d->type, d->target ?: "n/a", d->size,
+				d->flags & CRYPT_ACTIVATE_READONLY ? "readonly" : "read/write",
+				d->flags & CRYPT_ACTIVATE_SUSPENDED ? " (suspended)" : "",
+				d->open_count ? ", in use" : "");
+			continue;
+		}
+
+		log_std("%s\n  {\"name\":", i ? "," : "");
+		tools_json_print_string(d->name);
+		log_std(",\"uuid\":");
+		tools_json_print_string(d->uuid);
+		log_std(",\"type\":");
+		tools_json_print_string(d->type);
+		log_std(",\"target\":");
+		if (d->target)
+			tools_json_print_string(d->target);
+		else
+			log_std("null");
+		log_std(",\"segments\":%" PRIu32 ",\"size\":%" PRIu64 ",\"major\":%" PRIu32
+			",\"minor\":%" PRIu32 ",\"open_count\":%" PRId32 ",\"readonly\":%s,\"suspended\":%s}",
+			d->segments, d->size, d->major, d->minor, d->open_count,
+			d->flags & CRYPT_ACTIVATE_READONLY ? "true" : "false",
+			d->flags & CRYPT_ACTIVATE_SUSPENDED ? "true" : "false");
+	}
+
+	if (ARG_SET(OPT_JSON_ID))
+		log_std("%s]\n", count ? "\n" : "");
+
+	crypt_active_devices_free(devs, count);
+	return 0;
+}
+
+static void print_io_stats(const char *label, const struct crypt_io_stats *s)
+{
+	uint32_t i;
+
+	log_std("  %s I/O:\n", label);
+	log_std("    reads:   %" PRIu64 " (%" PRIu64 " bytes, avg %" PRIu64 " us)\n", s->reads,
+		s->read_bytes, s->reads ? s->read_us / s->reads : 0);
+	log_std("    writes:  %" PRIu64 " (%" PRIu64 " bytes, avg %" PRIu64 " us)\n", s->writes,
+		s->write_bytes, s->writes ? s->write_us / s->writes : 0);
+	if (s->io_us)
+		log_std("    throughput: %.1f MiB/s\n",
+			(double)(s->read_bytes + s->write_bytes) / s->io_us * 1000000 / (1024 * 1024));
+
+	for (i = 0; i < s->histogram_bins; i++) {
+		if (s->histogram_upper_us[i] == UINT64_MAX)
+			log_std("    > %" PRIu64 " us: %" PRIu64 "\n",
+				i ? s->histogram_upper_us[i - 1] : 0, s->histogram[i]);
+		else
+			log_std("    < %" PRIu64 " us: %" PRIu64 "\n",
+				s->histogram_upper_us[i], s->histogram[i]);
+	}
+}
+
 static int action_status(void)
 {
 	crypt_status_info ci;
 	crypt_reencrypt_info ri;
 	struct crypt_active_device cad;
 	struct crypt_params_integrity ip = {};
+	struct crypt_io_stats stats, backing;
 	struct crypt_device *cd = NULL;
 	char *backing_file;
 	const char *device;
 	int path = 0, r = 0;
 
+	if (ARG_SET(OPT_ALL_ID))
+		return action_status_all();
+
 	/* perhaps a path, not a dm device name */
 	if (strchr(action_argv[0], '/'))
 		path = 1;
@@ -820,13 +899,25 @@ static int action_status(void)
 				 CRYPT_ACTIVATE_SAME_CPU_CRYPT|
 				 CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS|
 				 CRYPT_ACTIVATE_NO_READ_WORKQUEUE|
-				 CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE))
-			log_std("  flags:   %s%s%s%s%s\n",
+				 CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE|
+				 CRYPT_ACTIVATE_INLINE_CRYPT))
+			log_std("  flags:   %s%s%s%s%s%s\n",
 				(cad.flags & CRYPT_ACTIVATE_ALLOW_DISCARDS) ? "discards " : "",
 				(cad.flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT) ? "same_cpu_crypt " : "",
 				(cad.flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS) ? "submit_from_crypt_cpus " : "",
 				(cad.flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE) ? "no_read_workqueue " : "",
-				(cad.flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) ? "no_write_workqueue" : "");
+				(cad.flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) ? "no_write_workqueue " : "",
+				(cad.flags & CRYPT_ACTIVATE_INLINE_CRYPT) ? "inline_crypt" : "");
+
+		if (ARG_SET(OPT_STATS_ID)) {
+			r = crypt_get_io_stats(cd, action_argv[0], &stats, &backing);
+			if (r == -ENOENT)
+				log_err(_("I/O statistics are not enabled for device %s."), action_argv[0]);
+			if (r < 0)
+				goto out;
+			print_io_stats("device", &stats);
+			print_io_stats("backing device", &backing);
+		}
 	}
 out:
 	crypt_free(cd);
@@ -835,6 +926,275 @@ out:
 	return r;
 }
 
+/* benchmark results collected for --json and --compare */
+static json_object *bench_jobj = NULL;
+
+static void benchmark_json_add(const char *section, json_object *jobj_entry)
+{
+	json_object *jobj_array;
+
+	if (!json_object_object_get_ex(bench_jobj, section, &jobj_array)) {
+		jobj_array = json_object_new_array();
+		json_object_object_add(bench_jobj, section, jobj_array);
+	}
+	json_object_array_add(jobj_array, jobj_entry);
+}
+
+/* one decimal place is enough, keeps the output readable */
+static json_object *benchmark_json_double(double d)
+{
+	char buf[32];
+
+	if (snprintf(buf, sizeof(buf), "%.1f", d) < 0)
+		return json_object_new_double(d);
+
+	return json_object_new_double_s(d, buf);
+}
+
+static void benchmark_cpu_model(char *buf, size_t len)
+{
+	static const char *const keys[] = { "model name", "CPU part", "cpu model", "cpu" };
+	char line[256], *p;
+	unsigned int i;
+	FILE *f;
+
+	*buf = '\0';
+
+	f = fopen("/proc/cpuinfo", "re");
+	if (!f)
+		return;
+
+	for (i = 0; !*buf && i < ARRAY_SIZE(keys); i++) {
+		rewind(f);
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, keys[i], strlen(keys[i])) || !(p = strchr(line, ':')))
+				continue;
+			p += strspn(p + 1, " \t") + 1;
+			p[strcspn(p, "\n")] = '\0';
+			snprintf(buf, len, "%s", p);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+static json_object *benchmark_json_environment(void)
+{
+	json_object *jobj = json_object_new_object();
+	struct utsname uts;
+	char buf[256];
+	const char *backend;
+	long n;
+
+	benchmark_cpu_model(buf, sizeof(buf));
+	json_object_object_add(jobj, "cpu", json_object_new_string(buf));
+
+	if (!uname(&uts) && snprintf(buf, sizeof(buf), "%s %s %s", uts.sysname,
+				     uts.release, uts.machine) > 0)
+		json_object_object_add(jobj, "kernel", json_object_new_string(buf));
+
+	backend = crypt_get_crypto_backend_version();
+	json_object_object_add(jobj, "crypto_backend", backend ? json_object_new_string(backend) : NULL);
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	json_object_object_add(jobj, "threads", json_object_new_int(n > 0 ? (int)n : 1));
+	json_object_object_add(jobj, "version", json_object_new_string(PACKAGE_VERSION));
+
+	return jobj;
+}
+
+static void benchmark_json_kdf(const char *kdf, const char *hash, size_t key_size,
+			       const struct crypt_pbkdf_type *pbkdf,
+			       unsigned int samples, double deviation)
+{
+	json_object *jobj = json_object_new_object();
+
+	json_object_object_add(jobj, "type", json_object_new_string(kdf));
+	if (hash)
+		json_object_object_add(jobj, "hash", json_object_new_string(hash));
+	json_object_object_add(jobj, "key_size", json_object_new_int(key_size * 8));
+	json_object_object_add(jobj, "iterations", json_object_new_int64(pbkdf->iterations));
+	if (strcmp(kdf, CRYPT_KDF_PBKDF2)) {
+		json_object_object_add(jobj, "memory", json_object_new_int64(pbkdf->max_memory_kb));
+		json_object_object_add(jobj, "parallel", json_object_new_int64(pbkdf->parallel_threads));
+		json_object_object_add(jobj, "time_ms", json_object_new_int64(pbkdf->time_ms));
+	}
+	if (ARG_SET(OPT_PBKDF_SAMPLES_ID)) {
+		json_object_object_add(jobj, "samples", json_object_new_int64(samples));
+		json_object_object_add(jobj, "deviation", benchmark_json_double(deviation));
+	}
+
+	benchmark_json_add("kdf", jobj);
+}
+
+static void benchmark_json_cipher(const char *cipher, size_t key_size,
+				  double enc_mbr, double dec_mbr)
+{
+	json_object *jobj = json_object_new_object();
+
+	json_object_object_add(jobj, "cipher", json_object_new_string(cipher));
+	json_object_object_add(jobj, "key_size", json_object_new_int(key_size * 8));
+	json_object_object_add(jobj, "encryption", benchmark_json_double(enc_mbr));
+	json_object_object_add(jobj, "decryption", benchmark_json_double(dec_mbr));
+
+	benchmark_json_add("cipher", jobj);
+}
+
+static const char *benchmark_json_str(json_object *jobj, const char *key)
+{
+	json_object *jobj_val;
+
+	if (!json_object_object_get_ex(jobj, key, &jobj_val))
+		return NULL;
+
+	return json_object_get_string(jobj_val);
+}
+
+static double benchmark_json_num(json_object *jobj, const char *key)
+{
+	json_object *jobj_val;
+
+	if (!json_object_object_get_ex(jobj, key, &jobj_val))
+		return 0.;
+
+	return json_object_get_double(jobj_val);
+}
+
+static bool benchmark_json_same(json_object *jobj1, json_object *jobj2, const char *key)
+{
+	const char *s1 = benchmark_json_str(jobj1, key), *s2 = benchmark_json_str(jobj2, key);
+
+	return (!s1 && !s2) || (s1 && s2 && !strcmp(s1, s2));
+}
+
+/* Find baseline result for the same algorithm and key size. */
+static json_object *benchmark_json_find(json_object *jobj_baseline, const char *section,
+					json_object *jobj)
+{
+	json_object *jobj_array, *jobj_base;
+	size_t i;
+
+	if (!json_object_object_get_ex(jobj_baseline, section, &jobj_array))
+		return NULL;
+
+	for (i = 0; i < json_object_array_length(jobj_array); i++) {
+		jobj_base = json_object_array_get_idx(jobj_array, i);
+		if (benchmark_json_num(jobj_base, "key_size") != benchmark_json_num(jobj, "key_size"))
+			continue;
+		if (!strcmp(section, "kdf") && benchmark_json_same(jobj_base, jobj, "type") &&
+		    benchmark_json_same(jobj_base, jobj, "hash"))
+			return jobj_base;
+		if (!strcmp(section, "cipher") && benchmark_json_same(jobj_base, jobj, "cipher"))
+			return jobj_base;
+	}
+
+	return NULL;
+}
+
+/*
+ * PBKDF2 is measured for one second. Argon2 calibrates iterations and memory
+ * cost to requested time, so compare the amount of work (iterations * KiB) per second.
+ */
+static double benchmark_kdf_rate(json_object *jobj)
+{
+	double memory = benchmark_json_num(jobj, "memory") ?: 1.,
+	       time_ms = benchmark_json_num(jobj, "time_ms") ?: 1000.;
+
+	return benchmark_json_num(jobj, "iterations") * memory * 1000. / time_ms;
+}
+
+static bool benchmark_compare_one(const char *name, int key_size, const char *metric,
+				  double baseline, double current, unsigned int threshold,
+				  json_object *jobj_comparison)
+{
+	json_object *jobj;
+	double change;
+	bool regression;
+
+	if (baseline <= 0.)
+		return false;
+
+	change = (current - baseline) / baseline * 100.;
+	regression = change < -(double)threshold;
+
+	if (jobj_comparison) {
+		jobj = json_object_new_object();
+		json_object_object_add(jobj, "name", json_object_new_string(name));
+		json_object_object_add(jobj, "key_size", json_object_new_int(key_size));
+		json_object_object_add(jobj, "metric", json_object_new_string(metric));
+		json_object_object_add(jobj, "baseline", benchmark_json_double(baseline));
+		json_object_object_add(jobj, "current", benchmark_json_double(current));
+		json_object_object_add(jobj, "change", benchmark_json_double(change));
+		json_object_object_add(jobj, "regression", json_object_new_boolean(regression));
+		json_object_array_add(jobj_comparison, jobj);
+	} else
+		log_std("%20s  %9db  %10s  %+8.1f %%%s\n", name, key_size, metric, change,
+			regression ? _("  REGRESSION") : "");
+
+	return regression;
+}
+
+/*
+ * Compare the current results with baseline. Only results present
+ * in both are compared. Returns number of detected regressions.
+ */
+static int benchmark_compare(json_object *jobj_baseline, unsigned int threshold, bool json)
+{
+	static const char *const env_keys[] = { "cpu", "kernel", "crypto_backend", "threads" };
+	json_object *jobj_array, *jobj, *jobj_base, *jobj_env, *jobj_base_env, *jobj_comparison = NULL;
+	char name[MAX_CIPHER_LEN * 2];
+	const char *hash;
+	size_t i;
+	int regressions = 0;
+
+	json_object_object_get_ex(bench_jobj, "environment", &jobj_env);
+	if (json_object_object_get_ex(jobj_baseline, "environment", &jobj_base_env)) {
+		/* results are still compared, the difference can be the reason */
+		for (i = 0; i < ARRAY_SIZE(env_keys); i++)
+			if (!benchmark_json_same(jobj_env, jobj_base_env, env_keys[i]))
+				log_err(_("Baseline environment differs in %s (%s)."), env_keys[i],
+					benchmark_json_str(jobj_base_env, env_keys[i]) ?: "null");
+	}
+
+	if (json) {
+		jobj_comparison = json_object_new_array();
+		json_object_object_add(bench_jobj, "comparison", jobj_comparison);
+	} else {
+		log_std(_("# Compared with baseline, regression threshold %u %%.\n"), threshold);
+		/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+		log_std(_("#          Algorithm |       Key |    Metric |    Change\n"));
+	}
+
+	if (json_object_object_get_ex(bench_jobj, "kdf", &jobj_array))
+		for (i = 0; i < json_object_array_length(jobj_array); i++) {
+			jobj = json_object_array_get_idx(jobj_array, i);
+			if (!(jobj_base = benchmark_json_find(jobj_baseline, "kdf", jobj)))
+				continue;
+			hash = benchmark_json_str(jobj, "hash");
+			snprintf(name, sizeof(name), "%s%s%s", benchmark_json_str(jobj, "type"),
+				 hash ? "-" : "", hash ?: "");
+			regressions += benchmark_compare_one(name, benchmark_json_num(jobj, "key_size"),
+				"kdf", benchmark_kdf_rate(jobj_base), benchmark_kdf_rate(jobj),
+				threshold, jobj_comparison);
+		}
+
+	if (json_object_object_get_ex(bench_jobj, "cipher", &jobj_array))
+		for (i = 0; i < json_object_array_length(jobj_array); i++) {
+			jobj = json_object_array_get_idx(jobj_array, i);
+			if (!(jobj_base = benchmark_json_find(jobj_baseline, "cipher", jobj)))
+				continue;
+			snprintf(name, sizeof(name), "%s", benchmark_json_str(jobj, "cipher"));
+			regressions += benchmark_compare_one(name, benchmark_json_num(jobj, "key_size"),
+				"encryption", benchmark_json_num(jobj_base, "encryption"),
+				benchmark_json_num(jobj, "encryption"), threshold, jobj_comparison);
+			regressions += benchmark_compare_one(name, benchmark_json_num(jobj, "key_size"),
+				"decryption", benchmark_json_num(jobj_base, "decryption"),
+				benchmark_json_num(jobj, "decryption"), threshold, jobj_comparison);
+		}
+
+	return regressions;
+}
+
 static int benchmark_callback(uint32_t time_ms, void *usrptr)
 {
 	struct crypt_pbkdf_type *pbkdf = usrptr;
@@ -850,42 +1210,72 @@ static int benchmark_callback(uint32_t time_ms, void *usrptr)
 	return r;
 }
 
+static void benchmark_kdf_variance(unsigned int samples, double deviation)
+{
+	if (ARG_SET(OPT_PBKDF_SAMPLES_ID))
+		log_std(_("%-10s deviation %.1f %% (%u of %u samples)\n"), "", deviation,
+			samples, ARG_UINT32(OPT_PBKDF_SAMPLES_ID));
+}
+
 static int action_benchmark_kdf(const char *kdf, const char *hash, size_t key_size)
 {
+	unsigned int samples = 0;
+	double deviation = 0.;
+	uint32_t flags = 0;
 	int r;
+
+	if (ARG_SET(OPT_PBKDF_SAMPLES_ID))
+		flags = CRYPT_PBKDF_BENCH_ROBUST | CRYPT_PBKDF_BENCH_SAMPLES(ARG_UINT32(OPT_PBKDF_SAMPLES_ID));
+
 	if (!strcmp(kdf, CRYPT_KDF_PBKDF2)) {
 		struct crypt_pbkdf_type pbkdf = {
 			.type = CRYPT_KDF_PBKDF2,
 			.hash = hash,
 			.time_ms = 1000,
+			.flags = flags,
 		};
 
-		r = crypt_benchmark_pbkdf(NULL, &pbkdf, "foo", 3, "0123456789abcdef", 16, key_size,
-					&benchmark_callback, &pbkdf);
+		r = crypt_benchmark_pbkdf_stats(NULL, &pbkdf, "foo", 3, "0123456789abcdef", 16, key_size,
+					&samples, &deviation, &benchmark_callback, &pbkdf);
+		if (r >= 0 && bench_jobj)
+			benchmark_json_kdf(kdf, hash, key_size, &pbkdf, samples, deviation);
+		if (ARG_SET(OPT_JSON_ID))
+			return r;
+
 		if (r < 0)
 			log_std(_("PBKDF2-%-9s     N/A\n"), hash);
-		else
+		else {
 			log_std(_("PBKDF2-%-9s %7u iterations per second for %zu-bit key\n"),
 				hash, pbkdf.iterations, key_size * 8);
+			benchmark_kdf_variance(samples, deviation);
+		}
 	} else {
 		struct crypt_pbkdf_type pbkdf = {
 			.type = kdf,
 			.time_ms = ARG_UINT32(OPT_ITER_TIME_ID) ?: DEFAULT_LUKS2_ITER_TIME,
 			.max_memory_kb = ARG_UINT32(OPT_PBKDF_MEMORY_ID),
-			.parallel_threads = ARG_UINT32(OPT_PBKDF_PARALLEL_ID)
+			.parallel_threads = ARG_UINT32(OPT_PBKDF_PARALLEL_ID),
+			.flags = flags,
 		};
 
-		r = crypt_benchmark_pbkdf(NULL, &pbkdf, "foo", 3,
+		r = crypt_benchmark_pbkdf_stats(NULL, &pbkdf, "foo", 3,
 			"0123456789abcdef0123456789abcdef", 32,
-			key_size, &benchmark_callback, &pbkdf);
+			key_size, &samples, &deviation, &benchmark_callback, &pbkdf);
+		if (r >= 0 && bench_jobj)
+			benchmark_json_kdf(kdf, NULL, key_size, &pbkdf, samples, deviation);
+		if (ARG_SET(OPT_JSON_ID))
+			return r;
+
 		if (r < 0)
 			log_std(_("%-10s N/A\n"), kdf);
-		else
+		else {
 			log_std(_("%-10s %4u iterations, %5u memory, "
 				"%1u parallel threads (CPUs) for "
 				"%zu-bit key (requested %u ms time)\n"), kdf,
 				pbkdf.iterations, pbkdf.max_memory_kb, pbkdf.parallel_threads,
 				key_size * 8, pbkdf.time_ms);
+			benchmark_kdf_variance(samples, deviation);
+		}
 	}
 
 	return r;
@@ -914,6 +1304,114 @@ static int benchmark_cipher_loop(const char *cipher, const char *cipher_mode,
 	return r;
 }
 
+static int benchmark_cipher_scaling(const char *cipher, const char *cipher_mode, size_t key_size)
+{
+	static const size_t sector_sizes[] = { 512, 4096 };
+	static const size_t buffer_sizes[] = { 64 * 1024, 4 * 1024 * 1024 };
+	double enc_mbr, dec_mbr;
+	unsigned int threads, cpus;
+	long n;
+	size_t i, j;
+	int r = 0, tests = 0, failed = 0;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	cpus = n > 0 ? (unsigned int)n : 1;
+
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("# Threads |  Sector |    Buffer |      Encryption |      Decryption\n"));
+
+	/* 1, 2, 4, ... and all online CPUs */
+	for (threads = 1;; threads *= 2) {
+		if (threads > cpus)
+			threads = cpus;
+		for (i = 0; i < sizeof(sector_sizes) / sizeof(*sector_sizes); i++) {
+			if (ARG_SET(OPT_SECTOR_SIZE_ID) && ARG_UINT32(OPT_SECTOR_SIZE_ID) != sector_sizes[i])
+				continue;
+			for (j = 0; j < sizeof(buffer_sizes) / sizeof(*buffer_sizes); j++) {
+				r = crypt_benchmark_parallel(NULL, cipher, cipher_mode, key_size,
+							     sector_sizes[i], buffer_sizes[j], threads,
+							     &enc_mbr, &dec_mbr);
+				check_signal(&r);
+				if (r == -EINTR)
+					return r;
+				tests++;
+				if (r < 0) {
+					failed++;
+					log_std("%9u  %7zu  %8zuK %17s %17s\n", threads, sector_sizes[i],
+						buffer_sizes[j] / 1024, _("N/A"), _("N/A"));
+					r = 0;
+					continue;
+				}
+				log_std("%9u  %7zu  %8zuK  %10.1f MiB/s  %10.1f MiB/s\n", threads,
+					sector_sizes[i], buffer_sizes[j] / 1024, enc_mbr, dec_mbr);
+			}
+		}
+		if (threads == cpus)
+			break;
+	}
+
+	return (tests && tests == failed) ? -ENOTSUP : 0;
+}
+
+static int benchmark_dm(const char *cipher, size_t key_size)
+{
+	static const struct {
+		uint32_t flags;
+		const char *name;
+	} combos[] = {
+		{ 0, "default" },
+		{ CRYPT_ACTIVATE_NO_READ_WORKQUEUE, "no_read_wq" },
+		{ CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE, "no_write_wq" },
+		{ CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE, "no_wq" },
+		{ CRYPT_ACTIVATE_SAME_CPU_CRYPT, "same_cpu" },
+		{ CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS, "submit_crypt_cpus" },
+	};
+	static const size_t seq_block = 1024 * 1024, rand_block = 4096;
+	uint32_t cli_flags = 0;
+	size_t sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID) ?: SECTOR_SIZE;
+	unsigned int qd = ARG_UINT32(OPT_QUEUE_DEPTH_ID) ?: 1;
+	double rd, wr, k = 1024.0 * 1024.0;
+	size_t i, count = sizeof(combos) / sizeof(*combos);
+	int r = 0, tests = 0, failed = 0, random_io;
+
+	set_activation_flags(&cli_flags);
+	cli_flags &= CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS |
+		     CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+
+	log_std(_("# dm-crypt %s, %zu bits key, %zu bytes sector, queue depth %u.\n"),
+		cipher, key_size * 8, sector_size, qd);
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#             Flags |       I/O |            Read |           Write\n"));
+
+	/* with performance flags on command line measure only that combination */
+	for (i = 0; i < (cli_flags ? 1 : count); i++) {
+		for (random_io = 0; random_io < 2; random_io++) {
+			r = crypt_benchmark_dm(NULL, cipher, key_size, sector_size,
+					       cli_flags ?: combos[i].flags, random_io ? rand_block : seq_block,
+					       qd, random_io, &rd, &wr);
+			check_signal(&r);
+			if (r == -EINTR || r == -EPERM)
+				return r;
+			tests++;
+			if (r < 0) {
+				failed++;
+				log_std("%19s  %9s %17s %15s\n", cli_flags ? "custom" : combos[i].name,
+					random_io ? "rand 4K" : "seq 1M", _("N/A"), _("N/A"));
+				continue;
+			}
+			if (random_io)
+				log_std("%19s  %9s  %10.0f IOPS  %10.0f IOPS\n",
+					cli_flags ? "custom" : combos[i].name, "rand 4K",
+					rd * k / rand_block, wr * k / rand_block);
+			else
+				log_std("%19s  %9s  %9.1f MiB/s  %9.1f MiB/s\n",
+					cli_flags ? "custom" : combos[i].name, "seq 1M", rd, wr);
+		}
+	}
+
+	return (tests && tests == failed) ? -ENOTSUP : 0;
+}
+
 static int action_benchmark(void)
 {
 	static struct {
@@ -948,20 +1446,47 @@ static int action_benchmark(void)
 		{ CRYPT_KDF_ARGON2ID, NULL },
 		{ NULL, NULL }
 	};
-	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN], cipher_name[MAX_CIPHER_LEN * 2];
 	double enc_mbr = 0, dec_mbr = 0;
 	int key_size = (ARG_UINT32(OPT_KEY_SIZE_ID) ?: DEFAULT_PLAIN_KEYBITS) / 8;
 	int skipped = 0, width;
+	json_object *jobj_baseline = NULL;
+	bool json = ARG_SET(OPT_JSON_ID);
 	char *c;
-	int i, r;
+	int i, r, regressions;
+
+	if (ARG_SET(OPT_DM_ID)) {
+		r = benchmark_dm(ARG_STR(OPT_CIPHER_ID) ?: DEFAULT_CIPHER(LUKS1), key_size);
+		if (r == -EPERM)
+			log_err(_("Benchmark of dm-crypt data path requires root privilege."));
+		else if (r == -ENOTSUP)
+			log_err(_("Cannot create dm-crypt device for benchmark (cipher or options not supported)."));
+		return r;
+	}
+
+	if (ARG_SET(OPT_COMPARE_ID)) {
+		jobj_baseline = json_object_from_file(ARG_STR(OPT_COMPARE_ID));
+		if (!jobj_baseline || !json_object_is_type(jobj_baseline, json_type_object)) {
+			log_err(_("Cannot read benchmark baseline %s."), ARG_STR(OPT_COMPARE_ID));
+			json_object_put(jobj_baseline);
+			return -EINVAL;
+		}
+	}
 
-	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	if (json || jobj_baseline) {
+		bench_jobj = json_object_new_object();
+		json_object_object_add(bench_jobj, "environment", benchmark_json_environment());
+	}
+
+	if (!json)
+		log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
 	if (set_pbkdf || ARG_SET(OPT_HASH_ID)) {
 		if (!set_pbkdf && ARG_SET(OPT_HASH_ID))
 			set_pbkdf = CRYPT_KDF_PBKDF2;
 		r = action_benchmark_kdf(set_pbkdf, ARG_STR(OPT_HASH_ID), key_size);
-	} else if (ARG_SET(OPT_CIPHER_ID)) {
-		r = crypt_parse_name_and_mode(ARG_STR(OPT_CIPHER_ID), cipher, NULL, cipher_mode);
+	} else if (ARG_SET(OPT_CIPHER_ID) || ARG_SET(OPT_SCALING_ID)) {
+		r = crypt_parse_name_and_mode(ARG_STR(OPT_CIPHER_ID) ?: DEFAULT_CIPHER(LUKS1),
+					      cipher, NULL, cipher_mode);
 		if (r < 0) {
 			log_err(_("No known cipher specification pattern detected."));
 			return r;
@@ -969,8 +1494,20 @@ static int action_benchmark(void)
 		if ((c  = strchr(cipher_mode, '-')))
 			*c = '\0';
 
+		if (ARG_SET(OPT_SCALING_ID)) {
+			log_std(_("# Cipher %s-%s, %i bits key.\n"), cipher, cipher_mode, key_size * 8);
+			r = benchmark_cipher_scaling(cipher, cipher_mode, key_size);
+			if (r == -ENOTSUP)
+				log_err(_("Required kernel crypto interface not available."));
+			return r;
+		}
+
 		r = benchmark_cipher_loop(cipher, cipher_mode, key_size, &enc_mbr, &dec_mbr);
-		if (!r) {
+		if (!r && bench_jobj) {
+			snprintf(cipher_name, sizeof(cipher_name), "%s-%s", cipher, cipher_mode);
+			benchmark_json_cipher(cipher_name, key_size, enc_mbr, dec_mbr);
+		}
+		if (!r && !json) {
 			width = strlen(cipher) + strlen(cipher_mode) + 1;
 			if (width < 11)
 				width = 11;
@@ -996,7 +1533,7 @@ static int action_benchmark(void)
 				break;
 			if (r == -ENOENT)
 				skipped++;
-			if (i == 0)
+			if (i == 0 && !json)
 				/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
 				log_std(_("#     Algorithm |       Key |      Encryption |      Decryption\n"));
 
@@ -1004,6 +1541,11 @@ static int action_benchmark(void)
 				     bciphers[i].cipher, bciphers[i].mode) < 0)
 				r = -EINVAL;
 
+			if (!r && bench_jobj)
+				benchmark_json_cipher(cipher, bciphers[i].key_size, enc_mbr, dec_mbr);
+
+			if (json)
+				continue;
 			if (!r)
 				log_std("%15s  %9zub  %10.1f MiB/s  %10.1f MiB/s\n",
 					cipher, bciphers[i].key_size*8, enc_mbr, dec_mbr);
@@ -1021,6 +1563,23 @@ static int action_benchmark(void)
 		log_err( _("Ensure you have algif_skcipher kernel module loaded."));
 #endif
 	}
+
+	if (jobj_baseline && r != -EINTR) {
+		regressions = benchmark_compare(jobj_baseline,
+			ARG_SET(OPT_COMPARE_THRESHOLD_ID) ? ARG_UINT32(OPT_COMPARE_THRESHOLD_ID) : 10, json);
+		if (regressions) {
+			log_err(_("Benchmark regression detected in %d result(s)."), regressions);
+			r = -EINVAL;
+		}
+	}
+
+	if (json && r != -EINTR)
+		log_std("%s\n", json_object_to_json_string_ext(bench_jobj,
+			JSON_C_TO_STRING_PRETTY | JSON_C_TO_STRING_NOSLASHESCAPE));
+
+	json_object_put(jobj_baseline);
+	json_object_put(bench_jobj);
+	bench_jobj = NULL;
 	return r;
 }
 
@@ -1174,6 +1733,8 @@ static int _wipe_data_device(struct crypt_device *cd)
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
 		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
 		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
+		.fd_output = ARG_SET(OPT_PROGRESS_FD_ID),
+		.fd = ARG_INT32(OPT_PROGRESS_FD_ID),
 		.interrupt_message = _("\nWipe interrupted."),
 		.device = tools_get_device_name(crypt_get_device_name(cd), &backing_file)
 	};
@@ -1198,8 +1759,8 @@ static int _wipe_data_device(struct crypt_device *cd)
 
 	/* Wipe the device */
 	set_int_handler(0);
-	r = crypt_wipe(cd, tmp_path, CRYPT_WIPE_ZERO, 0, 0, DEFAULT_WIPE_BLOCK,
-		       0, &tools_progress, &prog_parms);
+	r = crypt_wipe_parallel(cd, tmp_path, CRYPT_WIPE_ZERO, 0, 0, DEFAULT_WIPE_BLOCK,
+				0, ARG_UINT32(OPT_WIPE_THREADS_ID), &tools_progress, &prog_parms);
 	if (crypt_deactivate(cd, tmp_name))
 		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
 	set_int_block(0);
@@ -1328,6 +1889,12 @@ int luksFormat(struct crypt_device **r_cd, char **r_password, size_t *r_password
 			goto out;
 	}
 
+	if (ARG_SET(OPT_OPTIMIZE_LAYOUT_ID)) {
+		r = crypt_set_layout_optimize(cd, 1);
+		if (r < 0)
+			goto out;
+	}
+
 	/* Print all present signatures in read-only mode */
 	r = tools_detect_signatures(header_device, PRB_FILTER_NONE, &signatures, ARG_SET(OPT_BATCH_MODE_ID));
 	if (r < 0)
@@ -1420,13 +1987,29 @@ static int action_luksFormat(void)
 	return luksFormat(NULL, NULL, NULL);
 }
 
+/* Per token timing of the last token unlock, JSON object per line */
+static void token_stats_dbg(struct crypt_device *cd)
+{
+	struct crypt_token_open_stats st;
+	int i, r;
+
+	if (!ARG_SET(OPT_DEBUG_ID) && !ARG_SET(OPT_DEBUG_JSON_ID))
+		return;
+
+	for (i = 0; (r = crypt_token_open_stats(cd, i, &st)) != -EINVAL; i++)
+		if (!r)
+			log_dbg("Token stats: {\"token\":%d,\"type\":\"%s\",\"result\":%d,"
+				"\"load_us\":%" PRIu64 ",\"open_us\":%" PRIu64 ",\"keyslot_us\":%" PRIu64 "}",
+				i, st.type ?: "", st.result, st.load_us, st.open_us, st.keyslot_us);
+}
+
 static int action_open_luks(void)
 {
 	struct crypt_active_device cad;
 	struct crypt_device *cd = NULL;
 	const char *data_device, *header_device, *activated_name;
 	char *key = NULL;
-	uint32_t activate_flags = 0;
+	uint32_t activate_flags = 0, tuned_flags = 0;
 	int r, keysize, tries;
 	char *password = NULL;
 	size_t passwordLen;
@@ -1460,6 +2043,34 @@ static int action_open_luks(void)
 
 	set_activation_flags(&activate_flags);
 
+	if (ARG_SET(OPT_TOKEN_KEYRING_CACHE_ID) &&
+	    crypt_token_keyring_cache(cd, ARG_UINT32(OPT_TOKEN_KEYRING_CACHE_ID)))
+		log_dbg("Kernel keyring not available for token secret cache.");
+
+	if (ARG_SET(OPT_TOKEN_TIMEOUT_ID))
+		crypt_token_set_timeout(cd, ARG_UINT32(OPT_TOKEN_TIMEOUT_ID) > UINT32_MAX / 1000 ?
+					UINT32_MAX : ARG_UINT32(OPT_TOKEN_TIMEOUT_ID) * 1000);
+
+	if (ARG_SET(OPT_CRYPT_SHARDS_ID) &&
+	    (r = crypt_set_dm_crypt_shards(cd, ARG_UINT32(OPT_CRYPT_SHARDS_ID)))) {
+		log_err(_("Invalid number of dm-crypt targets."));
+		goto out;
+	}
+
+	if (ARG_SET(OPT_PERF_AUTO_ID) || ARG_SET(OPT_PERF_AUTO_PROBE_ID)) {
+		r = crypt_activation_flags_tune(cd, ARG_SET(OPT_PERF_AUTO_PROBE_ID) ? CRYPT_TUNE_PROBE : 0,
+						&tuned_flags);
+		if (r < 0)
+			goto out;
+		log_verbose(_("Selected dm-crypt performance flags:%s%s%s%s%s."),
+			    tuned_flags ? "" : _(" none"),
+			    tuned_flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT ? " same_cpu_crypt" : "",
+			    tuned_flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS ? " submit_from_crypt_cpus" : "",
+			    tuned_flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE ? " no_read_workqueue" : "",
+			    tuned_flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE ? " no_write_workqueue" : "");
+		activate_flags |= tuned_flags;
+	}
+
 	if (ARG_SET(OPT_VOLUME_KEY_FILE_ID)) {
 		keysize = crypt_get_volume_key_size(cd);
 		if (!keysize && !ARG_SET(OPT_KEY_SIZE_ID)) {
@@ -1485,35 +2096,263 @@ static int action_open_luks(void)
 				     ARG_SET(OPT_TOKEN_ID_ID)))
 			r = _try_token_pin_unlock(cd, ARG_INT32(OPT_TOKEN_ID_ID), activated_name, ARG_STR(OPT_TOKEN_TYPE_ID), activate_flags, set_tries_tty(), true);
 
-		if (r >= 0 || r == -EEXIST || quit || ARG_SET(OPT_TOKEN_ONLY_ID))
+		token_stats_dbg(cd);
+
+		if (r >= 0 || r == -EEXIST || quit || ARG_SET(OPT_TOKEN_ONLY_ID))
+			goto out;
+
+		tries = set_tries_tty();
+		do {
+			r = tools_get_key(NULL, &password, &passwordLen,
+					ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), ARG_STR(OPT_KEY_FILE_ID),
+					ARG_UINT32(OPT_TIMEOUT_ID), verify_passphrase(0), 0, cd);
+			if (r < 0)
+				goto out;
+
+			r = crypt_activate_by_passphrase(cd, activated_name,
+				ARG_INT32(OPT_KEY_SLOT_ID), password, passwordLen, activate_flags);
+			tools_keyslot_msg(r, UNLOCKED);
+			tools_passphrase_msg(r);
+			check_signal(&r);
+			crypt_safe_free(password);
+			password = NULL;
+		} while ((r == -EPERM || r == -ERANGE) && (--tries > 0));
+	}
+out:
+	if (r >= 0 && ARG_SET(OPT_PERSISTENT_ID) &&
+	    (crypt_get_active_device(cd, activated_name, &cad) ||
+	     crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION, cad.flags & activate_flags)))
+		log_err(_("Device activated but cannot make flags persistent."));
+
+	crypt_safe_free(key);
+	crypt_safe_free(password);
+	crypt_free(cd);
+	return r;
+}
+
+/* open --batch-file: one "<device> <name>" pair per line */
+#define OPEN_BATCH_MAX 1024
+
+struct open_batch_entry {
+	char *device;
+	char *name;
+	struct crypt_device *cd;
+	int r;
+};
+
+struct open_batch {
+	struct open_batch_entry *entries;
+	unsigned count;
+	unsigned next;
+	uint32_t flags;
+	const char *password;
+	size_t password_len;
+	pthread_mutex_t lock;
+};
+
+static int open_batch_read(const char *file, struct open_batch *b)
+{
+	char *line = NULL, *device, *name, *save;
+	size_t line_size = 0;
+	FILE *f;
+	int r = 0;
+
+	f = tools_is_stdin(file) ? stdin : fopen(file, "r");
+	if (!f) {
+		log_err(_("Cannot open batch file %s."), file);
+		return -EINVAL;
+	}
+
+	while (getline(&line, &line_size, f) > 0) {
+		device = strtok_r(line, " \t\n", &save);
+		if (!device || *device == '#')
+			continue;
+		name = strtok_r(NULL, " \t\n", &save);
+		if (!name || strtok_r(NULL, " \t\n", &save)) {
+			log_err(_("Invalid line for device %s in batch file."), device);
+			r = -EINVAL;
+			break;
+		}
+		if (b->count == OPEN_BATCH_MAX) {
+			log_err(_("Too many devices in batch file."));
+			r = -EINVAL;
+			break;
+		}
+		b->entries[b->count].device = strdup(device);
+		b->entries[b->count].name = strdup(name);
+		b->entries[b->count].r = -EINVAL;
+		if (!b->entries[b->count].device || !b->entries[b->count].name)
+			r = -ENOMEM;
+		b->count++;
+		if (r)
+			break;
+	}
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return r;
+}
+
+/* Token (if not passphrase yet) or passphrase unlock of not yet opened devices */
+static void *open_batch_worker(void *arg)
+{
+	struct open_batch *b = arg;
+	struct open_batch_entry *e;
+	unsigned i;
+
+	while (!quit) {
+		pthread_mutex_lock(&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->count)
+			break;
+
+		e = &b->entries[i];
+		if (!e->cd || (e->r != -EPERM && e->r != -ENOENT && e->r != -ENOANO))
+			continue;
+
+		if (b->password)
+			e->r = crypt_activate_by_passphrase(e->cd, e->name, ARG_INT32(OPT_KEY_SLOT_ID),
+							    b->password, b->password_len, b->flags);
+		else {
+			e->r = crypt_activate_by_token_pin(e->cd, e->name, ARG_STR(OPT_TOKEN_TYPE_ID),
+							   ARG_INT32(OPT_TOKEN_ID_ID), NULL, 0, NULL, b->flags);
+			/* any token failure leaves device for passphrase */
+			if (e->r < 0 && e->r != -EEXIST)
+				e->r = -ENOENT;
+		}
+	}
+
+	return NULL;
+}
+
+static void open_batch_run(struct open_batch *b, unsigned workers)
+{
+	pthread_t threads[64];
+	unsigned i, started = 0;
+
+	b->next = 0;
+	if (workers > ARRAY_SIZE(threads))
+		workers = ARRAY_SIZE(threads);
+	if (workers > b->count)
+		workers = b->count;
+
+	for (i = 1; i < workers; i++)
+		if (!pthread_create(&threads[started], NULL, open_batch_worker, b))
+			started++;
+
+	/* caller thread works too, so batch runs even if no thread starts */
+	open_batch_worker(b);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static struct crypt_device *open_batch_pending(struct open_batch *b)
+{
+	unsigned i;
+
+	for (i = 0; i < b->count; i++)
+		if (b->entries[i].cd && (b->entries[i].r == -EPERM || b->entries[i].r == -ENOENT ||
+					 b->entries[i].r == -ENOANO))
+			return b->entries[i].cd;
+
+	return NULL;
+}
+
+/*
+ * Every header is loaded once, tokens are tried for all devices and then
+ * one passphrase (or key file) is tried on all remaining devices. Passphrase
+ * is asked again (up to --tries) only if some device is still locked.
+ */
+static int action_open_luks_batch(void)
+{
+	struct open_batch b = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	struct open_batch_entry *e;
+	struct crypt_device *cd;
+	unsigned i, workers;
+	char *password = NULL;
+	size_t passwordLen;
+	int r, tries;
+	long cpus;
+
+	b.entries = calloc(OPEN_BATCH_MAX, sizeof(*b.entries));
+	if (!b.entries)
+		return -ENOMEM;
+
+	r = open_batch_read(ARG_STR(OPT_BATCH_FILE_ID), &b);
+	if (r < 0)
+		goto out;
+
+	if (ARG_SET(OPT_PARALLEL_ID))
+		workers = ARG_UINT32(OPT_PARALLEL_ID);
+	else {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? (unsigned)cpus : 1;
+	}
+
+	set_activation_flags(&b.flags);
+
+	for (i = 0; i < b.count; i++) {
+		e = &b.entries[i];
+		e->r = crypt_init(&e->cd, e->device);
+		if (!e->r && (e->r = crypt_load(e->cd, luksType(device_type), NULL)))
+			log_err(_("Device %s is not a valid LUKS device."), e->device);
+		if (e->r) {
+			crypt_free(e->cd);
+			e->cd = NULL;
+			continue;
+		}
+		if (ARG_SET(OPT_TOKEN_TIMEOUT_ID))
+			crypt_token_set_timeout(e->cd, ARG_UINT32(OPT_TOKEN_TIMEOUT_ID) > UINT32_MAX / 1000 ?
+						UINT32_MAX : ARG_UINT32(OPT_TOKEN_TIMEOUT_ID) * 1000);
+		/* pending unlock */
+		e->r = -ENOENT;
+	}
+
+	if (!ARG_SET(OPT_KEY_FILE_ID))
+		open_batch_run(&b, workers);
+
+	tries = set_tries_tty();
+	while (!ARG_SET(OPT_TOKEN_ONLY_ID) && !quit && tries-- > 0 && (cd = open_batch_pending(&b))) {
+		r = tools_get_key(NULL, &password, &passwordLen,
+				  ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID),
+				  ARG_STR(OPT_KEY_FILE_ID), ARG_UINT32(OPT_TIMEOUT_ID),
+				  verify_passphrase(0), 0, cd);
+		if (r < 0)
 			goto out;
 
-		tries = set_tries_tty();
-		do {
-			r = tools_get_key(NULL, &password, &passwordLen,
-					ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), ARG_STR(OPT_KEY_FILE_ID),
-					ARG_UINT32(OPT_TIMEOUT_ID), verify_passphrase(0), 0, cd);
-			if (r < 0)
-				goto out;
+		b.password = password;
+		b.password_len = passwordLen;
+		open_batch_run(&b, workers);
+		b.password = NULL;
+		crypt_safe_free(password);
+		password = NULL;
+	}
 
-			r = crypt_activate_by_passphrase(cd, activated_name,
-				ARG_INT32(OPT_KEY_SLOT_ID), password, passwordLen, activate_flags);
-			tools_keyslot_msg(r, UNLOCKED);
-			tools_passphrase_msg(r);
-			check_signal(&r);
-			crypt_safe_free(password);
-			password = NULL;
-		} while ((r == -EPERM || r == -ERANGE) && (--tries > 0));
+	r = 0;
+	for (i = 0; i < b.count; i++) {
+		e = &b.entries[i];
+		if (e->r >= 0)
+			log_verbose(_("Device %s activated as %s."), e->device, e->name);
+		else if (e->r == -EPERM || e->r == -ENOENT || e->r == -ENOANO)
+			log_err(_("No usable key available for device %s."), e->device);
+		else if (e->cd)
+			log_err(_("Cannot activate device %s (%s)."), e->device, strerror(-e->r));
+		if (e->r < 0 && !r)
+			r = e->r;
 	}
+	check_signal(&r);
 out:
-	if (r >= 0 && ARG_SET(OPT_PERSISTENT_ID) &&
-	    (crypt_get_active_device(cd, activated_name, &cad) ||
-	     crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION, cad.flags & activate_flags)))
-		log_err(_("Device activated but cannot make flags persistent."));
-
-	crypt_safe_free(key);
 	crypt_safe_free(password);
-	crypt_free(cd);
+	for (i = 0; i < b.count; i++) {
+		crypt_free(b.entries[i].cd);
+		free(b.entries[i].device);
+		free(b.entries[i].name);
+	}
+	free(b.entries);
+	pthread_mutex_destroy(&b.lock);
 	return r;
 }
 
@@ -1793,8 +2632,30 @@ static int try_keyslot_add(struct crypt_device *cd,
 	return r;
 }
 
+/*
+ * Keyslot added while the new passphrase quality check ran (inside metadata
+ * batch) is committed only if the check passes, otherwise its area is wiped.
+ */
+static int keyslot_add_finish(struct crypt_device *cd, int keyslot)
+{
+	int r;
+
+	r = tools_check_password_wait();
+	if (keyslot < 0)
+		return keyslot;
+
+	if (r < 0) {
+		(void) crypt_keyslot_destroy(cd, keyslot);
+		return r;
+	}
+
+	r = crypt_metadata_commit(cd);
+	return r < 0 ? r : keyslot;
+}
+
 static int action_luksAddKey(void)
 {
+	bool check_async = false;
 	int keyslot_old, keyslot_new, keysize = 0, r = -EINVAL;
 	const char *new_key_file = (action_argc > 1 ? action_argv[1] : NULL);
 	char *key = NULL, *password = NULL, *password_new = NULL, *pin = NULL, *pin_new = NULL;
@@ -1923,10 +2784,12 @@ static int action_luksAddKey(void)
 			p_kc_new = kc_new;
 		}
 	} else {
+		/* LUKS2 can run quality check during KDF and commit the keyslot later */
 		r = tools_get_key(_("Enter new passphrase for key slot:"),
 			      &password_new, &password_new_size,
 			      ARG_UINT64(OPT_NEW_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_NEW_KEYFILE_SIZE_ID), new_key_file,
-			      ARG_UINT32(OPT_TIMEOUT_ID), verify_passphrase(1), !ARG_SET(OPT_FORCE_PASSWORD_ID), cd);
+			      ARG_UINT32(OPT_TIMEOUT_ID), verify_passphrase(1),
+			      ARG_SET(OPT_FORCE_PASSWORD_ID) ? 0 : isLUKS2(crypt_get_type(cd)) ? TOOLS_PWQUALITY_ASYNC : 1, cd);
 
 		if (r < 0)
 			goto out;
@@ -1939,6 +2802,12 @@ static int action_luksAddKey(void)
 	if (!p_kc_new)
 		p_kc_new = kc_new;
 
+	if (tools_check_password_pending()) {
+		check_async = !crypt_metadata_begin(cd);
+		if (!check_async && (r = tools_check_password_wait()) < 0)
+			goto out;
+	}
+
 	r = try_keyslot_add(cd, keyslot_old, keyslot_new, kc, p_kc_new, pin, pin_new);
 	if (r >= 0 || r != -ENOANO)
 		goto out;
@@ -1960,6 +2829,10 @@ static int action_luksAddKey(void)
 		r = try_keyslot_add(cd, keyslot_old, keyslot_new, kc, p_kc_new, pin, pin_new);
 	}
 out:
+	if (check_async)
+		r = keyslot_add_finish(cd, r);
+	else
+		(void) tools_check_password_wait();
 	tools_keyslot_msg(r, CREATED);
 	crypt_keyslot_context_free(kc);
 	crypt_keyslot_context_free(kc_new);
@@ -2256,11 +3129,165 @@ out:
 	return r;
 }
 
+/* luksDump --batch-file: one device per line, one compact JSON line per device */
+struct dump_batch {
+	char **devices;
+	unsigned count;
+	unsigned next;
+	int r;
+	pthread_mutex_t lock;
+};
+
+static int dump_batch_read(const char *file, struct dump_batch *b)
+{
+	char *line = NULL, *device, *save;
+	size_t line_size = 0;
+	FILE *f;
+	int r = 0;
+
+	f = tools_is_stdin(file) ? stdin : fopen(file, "r");
+	if (!f) {
+		log_err(_("Cannot open batch file %s."), file);
+		return -EINVAL;
+	}
+
+	while (getline(&line, &line_size, f) > 0) {
+		device = strtok_r(line, " \t\n", &save);
+		if (!device || *device == '#')
+			continue;
+		if (strtok_r(NULL, " \t\n", &save)) {
+			log_err(_("Invalid line for device %s in batch file."), device);
+			r = -EINVAL;
+			break;
+		}
+		if (b->count == OPEN_BATCH_MAX) {
+			log_err(_("Too many devices in batch file."));
+			r = -EINVAL;
+			break;
+		}
+		if (!(b->devices[b->count++] = strdup(device))) {
+			r = -ENOMEM;
+			break;
+		}
+	}
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return r;
+}
+
+static void dump_batch_one(struct dump_batch *b, const char *device)
+{
+	struct crypt_device *cd = NULL;
+	json_object *jobj_device;
+	const char *json = NULL;
+	int r;
+
+	r = crypt_init(&cd, device);
+	if (!r)
+		r = crypt_load(cd, CRYPT_LUKS2, NULL);
+	if (!r)
+		r = crypt_dump_json(cd, &json, CRYPT_DUMP_JSON_COMPACT);
+
+	/* device path needs JSON escaping, metadata is already serialized */
+	jobj_device = json_object_new_string(device);
+
+	pthread_mutex_lock(&b->lock);
+	if (r < 0) {
+		log_std("{\"device\":%s,\"error\":%d}\n",
+			json_object_to_json_string_ext(jobj_device, JSON_C_TO_STRING_PLAIN), r);
+		if (!b->r)
+			b->r = r;
+	} else
+		log_std("{\"device\":%s,\"uuid\":\"%s\",\"metadata\":%s}\n",
+			json_object_to_json_string_ext(jobj_device, JSON_C_TO_STRING_PLAIN),
+			crypt_get_uuid(cd) ?: "", json);
+	pthread_mutex_unlock(&b->lock);
+
+	json_object_put(jobj_device);
+	crypt_free(cd);
+}
+
+static void *dump_batch_worker(void *arg)
+{
+	struct dump_batch *b = arg;
+	unsigned i;
+
+	while (!quit) {
+		pthread_mutex_lock(&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->count)
+			break;
+
+		dump_batch_one(b, b->devices[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Headers are read without metadata locks (the dump is read-only and every
+ * header is checksummed, so a concurrent update is reported as an error)
+ * and printed in completion order as soon as they are read.
+ */
+static int action_luksDump_batch(void)
+{
+	struct dump_batch b = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	pthread_t threads[64];
+	unsigned i, workers, started = 0;
+	long cpus;
+	int r;
+
+	b.devices = calloc(OPEN_BATCH_MAX, sizeof(*b.devices));
+	if (!b.devices)
+		return -ENOMEM;
+
+	r = dump_batch_read(ARG_STR(OPT_BATCH_FILE_ID), &b);
+	if (r < 0)
+		goto out;
+
+	if (ARG_SET(OPT_PARALLEL_ID))
+		workers = ARG_UINT32(OPT_PARALLEL_ID);
+	else {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? (unsigned)cpus : 1;
+	}
+	if (workers > ARRAY_SIZE(threads))
+		workers = ARRAY_SIZE(threads);
+	if (workers > b.count)
+		workers = b.count;
+
+	crypt_metadata_locking(NULL, 0);
+
+	for (i = 1; i < workers; i++)
+		if (!pthread_create(&threads[started], NULL, dump_batch_worker, &b))
+			started++;
+
+	dump_batch_worker(&b);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	r = b.r;
+	check_signal(&r);
+out:
+	for (i = 0; i < b.count; i++)
+		free(b.devices[i]);
+	free(b.devices);
+	pthread_mutex_destroy(&b.lock);
+	return r;
+}
+
 static int action_luksDump(void)
 {
 	struct crypt_device *cd = NULL;
 	int r;
 
+	if (ARG_SET(OPT_BATCH_FILE_ID))
+		return action_luksDump_batch();
+
 	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
 		goto out;
 
@@ -2283,14 +3310,82 @@ out:
 	return r;
 }
 
+/* Keep volume key wrapped in keyring for fast luksResume */
+static int luksSuspend_wrapped(struct crypt_device *cd)
+{
+	char *wrapping_key = NULL, *password = NULL, *vk = NULL;
+	size_t wrapping_key_size, password_size, vk_size;
+	int r;
+
+	r = crypt_keyfile_device_read(cd, ARG_STR(OPT_WRAPPING_KEY_FILE_ID),
+				      &wrapping_key, &wrapping_key_size, 0, 0, 0);
+	if (r < 0)
+		return r;
+
+	r = crypt_suspend_wrapped_key(cd, action_argv[0], NULL, 0, wrapping_key,
+				      wrapping_key_size, ARG_UINT32(OPT_WRAPPED_KEY_TIMEOUT_ID));
+	if (r != -ENOKEY)
+		goto out;
+
+	/* Volume key is in kernel keyring, unlock it once here instead of on resume */
+	r = crypt_get_volume_key_size(cd);
+	if (r <= 0) {
+		r = -EINVAL;
+		goto out;
+	}
+	vk_size = r;
+
+	if (ARG_SET(OPT_VOLUME_KEY_FILE_ID))
+		r = tools_read_vk(ARG_STR(OPT_VOLUME_KEY_FILE_ID), &vk, vk_size);
+	else {
+		vk = crypt_safe_alloc(vk_size);
+		if (!vk) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		r = tools_get_key(NULL, &password, &password_size,
+			ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), ARG_STR(OPT_KEY_FILE_ID),
+			ARG_UINT32(OPT_TIMEOUT_ID), 0, 0, cd);
+		if (r < 0)
+			goto out;
+
+		r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, vk, &vk_size, password, password_size);
+		tools_passphrase_msg(r);
+		check_signal(&r);
+	}
+
+	if (r >= 0)
+		r = crypt_suspend_wrapped_key(cd, action_argv[0], vk, vk_size, wrapping_key,
+					      wrapping_key_size, ARG_UINT32(OPT_WRAPPED_KEY_TIMEOUT_ID));
+out:
+	crypt_safe_free(vk);
+	crypt_safe_free(password);
+	crypt_safe_free(wrapping_key);
+	return r;
+}
+
 static int action_luksSuspend(void)
 {
 	struct crypt_device *cd = NULL;
 	int r;
 
+	if (ARG_SET(OPT_WRAPPED_KEY_TIMEOUT_ID) && !ARG_SET(OPT_WRAPPING_KEY_FILE_ID)) {
+		log_err(_("Option --wrapped-key-timeout requires --wrapping-key-file."));
+		return -EINVAL;
+	}
+
+	if (ARG_SET(OPT_WRAPPING_KEY_FILE_ID) && !ARG_UINT32(OPT_WRAPPED_KEY_TIMEOUT_ID)) {
+		log_err(_("Wrapped key timeout must not be zero."));
+		return -EINVAL;
+	}
+
 	r = crypt_init_by_name_and_header(&cd, action_argv[0], uuid_or_device(ARG_STR(OPT_HEADER_ID)));
 	if (!r) {
-		r = crypt_suspend(cd, action_argv[0]);
+		if (ARG_SET(OPT_WRAPPING_KEY_FILE_ID))
+			r = luksSuspend_wrapped(cd);
+		else
+			r = crypt_suspend(cd, action_argv[0]);
 		if (r == -ENODEV)
 			log_err(_("%s is not active %s device name."), action_argv[0], "LUKS");
 	}
@@ -2299,6 +3394,27 @@ static int action_luksSuspend(void)
 	return r;
 }
 
+static int luksResume_wrapped(struct crypt_device *cd)
+{
+	char *wrapping_key = NULL;
+	size_t wrapping_key_size;
+	int r;
+
+	r = crypt_keyfile_device_read(cd, ARG_STR(OPT_WRAPPING_KEY_FILE_ID),
+				      &wrapping_key, &wrapping_key_size, 0, 0, 0);
+	if (r < 0)
+		return r;
+
+	r = crypt_resume_by_wrapped_key(cd, action_argv[0], wrapping_key, wrapping_key_size);
+	if (r == -ENOKEY)
+		log_verbose(_("No wrapped volume key available for %s."), action_argv[0]);
+	else if (r == -EPERM)
+		log_err(_("Wrapping key does not match the stored volume key."));
+
+	crypt_safe_free(wrapping_key);
+	return r;
+}
+
 static int action_luksResume(void)
 {
 	struct crypt_device *cd = NULL;
@@ -2311,6 +3427,11 @@ static int action_luksResume(void)
 	if (req_type && !isLUKS(req_type))
 		return -EINVAL;
 
+	if (ARG_SET(OPT_WRAPPED_KEY_ONLY_ID) && !ARG_SET(OPT_WRAPPING_KEY_FILE_ID)) {
+		log_err(_("Option --wrapped-key-only requires --wrapping-key-file."));
+		return -EINVAL;
+	}
+
 	if ((r = crypt_init_by_name_and_header(&cd, action_argv[0], uuid_or_device(ARG_STR(OPT_HEADER_ID)))))
 		return r;
 
@@ -2335,6 +3456,13 @@ static int action_luksResume(void)
 		goto out;
 	}
 
+	/* wrapped volume key from luksSuspend avoids keyslot PBKDF */
+	if (ARG_SET(OPT_WRAPPING_KEY_FILE_ID)) {
+		r = luksResume_wrapped(cd);
+		if (r >= 0 || quit || ARG_SET(OPT_WRAPPED_KEY_ONLY_ID))
+			goto out;
+	}
+
 	/* try to resume LUKS2 device by token first */
 	r = crypt_resume_by_token_pin(cd, action_argv[0], ARG_STR(OPT_TOKEN_TYPE_ID),
 					ARG_INT32(OPT_TOKEN_ID_ID), NULL, 0, NULL);
@@ -2372,6 +3500,54 @@ out:
 	return r;
 }
 
+static int backup_archive_add(struct crypt_device *cd)
+{
+	struct crypt_backup_archive *archive;
+	int r;
+
+	r = crypt_backup_archive_open(&archive, ARG_STR(OPT_HEADER_BACKUP_FILE_ID), 0);
+	if (r < 0) {
+		log_err(_("Cannot open header backup archive %s."), ARG_STR(OPT_HEADER_BACKUP_FILE_ID));
+		return r;
+	}
+
+	r = crypt_backup_archive_add(archive, cd, NULL);
+	if (r == 1) {
+		log_verbose(_("Header is unchanged since the last backup in archive."));
+		r = 0;
+	}
+
+	crypt_backup_archive_free(archive);
+	return r;
+}
+
+/* archived header is selected by --uuid or by UUID of the current header */
+static int backup_archive_restore(struct crypt_device *cd)
+{
+	struct crypt_backup_archive *archive;
+	const char *uuid = ARG_STR(OPT_UUID_ID);
+	int r;
+
+	if (!uuid && !crypt_load(cd, CRYPT_LUKS, NULL))
+		uuid = crypt_get_uuid(cd);
+	if (!uuid) {
+		log_err(_("Option --uuid is required, device %s has no LUKS header."),
+			uuid_or_device_header(NULL));
+		return -EINVAL;
+	}
+
+	r = crypt_backup_archive_open(&archive, ARG_STR(OPT_HEADER_BACKUP_FILE_ID),
+				      CRYPT_BACKUP_ARCHIVE_READONLY);
+	if (r < 0) {
+		log_err(_("Cannot open header backup archive %s."), ARG_STR(OPT_HEADER_BACKUP_FILE_ID));
+		return r;
+	}
+
+	r = crypt_backup_archive_restore(archive, cd, NULL, uuid);
+	crypt_backup_archive_free(archive);
+	return r;
+}
+
 static int action_luksBackup(void)
 {
 	struct crypt_device *cd = NULL;
@@ -2385,7 +3561,10 @@ static int action_luksBackup(void)
 	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
 		goto out;
 
-	r = crypt_header_backup(cd, NULL, ARG_STR(OPT_HEADER_BACKUP_FILE_ID));
+	if (ARG_SET(OPT_BACKUP_ARCHIVE_ID))
+		r = backup_archive_add(cd);
+	else
+		r = crypt_header_backup(cd, NULL, ARG_STR(OPT_HEADER_BACKUP_FILE_ID));
 out:
 	crypt_free(cd);
 	return r;
@@ -2406,7 +3585,11 @@ static int action_luksRestore(void)
 
 	if (!ARG_SET(OPT_BATCH_MODE_ID))
 		crypt_set_confirm_callback(cd, yesDialog, NULL);
-	r = crypt_header_restore(cd, NULL, ARG_STR(OPT_HEADER_BACKUP_FILE_ID));
+
+	if (ARG_SET(OPT_BACKUP_ARCHIVE_ID))
+		r = backup_archive_restore(cd);
+	else
+		r = crypt_header_restore(cd, NULL, ARG_STR(OPT_HEADER_BACKUP_FILE_ID));
 out:
 	crypt_free(cd);
 	return r;
@@ -2448,6 +3631,25 @@ static const char *_get_device_type(void)
 	return type;
 }
 
+/* dm-stats region for --io-stats, failure does not fail already activated device */
+static int open_io_stats(int r)
+{
+	struct crypt_device *cd = NULL;
+	int r_stats;
+
+	if (r < 0 || !ARG_SET(OPT_IO_STATS_ID) || action_argc < 2 || ARG_SET(OPT_TEST_PASSPHRASE_ID))
+		return r;
+
+	r_stats = crypt_init_by_name_and_header(&cd, action_argv[1], ARG_STR(OPT_HEADER_ID));
+	if (!r_stats)
+		r_stats = crypt_io_stats_enable(cd, action_argv[1]);
+	if (r_stats < 0)
+		log_err(_("Cannot enable I/O statistics for device %s."), action_argv[1]);
+
+	crypt_free(cd);
+	return r;
+}
+
 static int action_open(void)
 {
 	int r = -EINVAL;
@@ -2462,25 +3664,27 @@ static int action_open(void)
 	if (!strcmp(device_type, "luks") ||
 	    !strcmp(device_type, "luks1") ||
 	    !strcmp(device_type, "luks2")) {
+		if (ARG_SET(OPT_BATCH_FILE_ID))
+			return open_io_stats(action_open_luks_batch());
 		if (action_argc < 2 && (!ARG_SET(OPT_TEST_PASSPHRASE_ID) && !ARG_SET(OPT_REFRESH_ID)))
 			goto out;
-		return action_open_luks();
+		return open_io_stats(action_open_luks());
 	} else if (!strcmp(device_type, "plain")) {
 		if (action_argc < 2 && !ARG_SET(OPT_REFRESH_ID))
 			goto out;
-		return action_open_plain();
+		return open_io_stats(action_open_plain());
 	} else if (!strcmp(device_type, "loopaes")) {
 		if (action_argc < 2 && !ARG_SET(OPT_REFRESH_ID))
 			goto out;
-		return action_open_loopaes();
+		return open_io_stats(action_open_loopaes());
 	} else if (!strcmp(device_type, "tcrypt")) {
 		if (action_argc < 2 && !ARG_SET(OPT_TEST_PASSPHRASE_ID))
 			goto out;
-		return action_open_tcrypt();
+		return open_io_stats(action_open_tcrypt());
 	} else if (!strcmp(device_type, "bitlk")) {
 		if (action_argc < 2 && !ARG_SET(OPT_TEST_PASSPHRASE_ID))
 			goto out;
-		return action_open_bitlk();
+		return open_io_stats(action_open_bitlk());
 	} else
 		r = -ENOENT;
 out:
@@ -2883,12 +4087,30 @@ static const char * verify_open(void)
 	if (ARG_SET(OPT_DEVICE_SIZE_ID) && ARG_SET(OPT_SIZE_ID))
 		return _("Options --device-size and --size cannot be combined.");
 
+	if ((ARG_SET(OPT_PERF_AUTO_ID) || ARG_SET(OPT_PERF_AUTO_PROBE_ID)) &&
+	    (ARG_SET(OPT_PERF_SAME_CPU_CRYPT_ID) || ARG_SET(OPT_PERF_SUBMIT_FROM_CRYPT_CPUS_ID) ||
+	     ARG_SET(OPT_PERF_NO_READ_WORKQUEUE_ID) || ARG_SET(OPT_PERF_NO_WRITE_WORKQUEUE_ID)))
+		return _("Option --perf-auto cannot be combined with explicit --perf-* options.");
+
+	if ((ARG_SET(OPT_PERF_AUTO_ID) || ARG_SET(OPT_PERF_AUTO_PROBE_ID)) &&
+	    (!device_type || strncmp(device_type, "luks", 4)))
+		return _("Option --perf-auto is supported only for LUKS devices.");
+
 	if (ARG_SET(OPT_UNBOUND_ID) && device_type && strncmp(device_type, "luks", 4))
 		return _("Option --unbound is allowed only for open of luks device.");
 
 	if (ARG_SET(OPT_UNBOUND_ID) && !ARG_SET(OPT_TEST_PASSPHRASE_ID))
 		return _("Option --unbound cannot be used without --test-passphrase.");
 
+	if (ARG_SET(OPT_BATCH_FILE_ID) && (action_argc || (device_type && strncmp(device_type, "luks", 4)) ||
+	    ARG_SET(OPT_HEADER_ID) || ARG_SET(OPT_TEST_PASSPHRASE_ID) || ARG_SET(OPT_REFRESH_ID) ||
+	    ARG_SET(OPT_VOLUME_KEY_FILE_ID) || ARG_SET(OPT_PERSISTENT_ID)))
+		return _("Option --batch-file can be used only for open of LUKS devices without device arguments, "
+			 "--header, --test-passphrase, --refresh, --volume-key-file or --persistent.");
+
+	if (ARG_SET(OPT_PARALLEL_ID) && !ARG_SET(OPT_BATCH_FILE_ID))
+		return _("Option --parallel with open action requires --batch-file.");
+
 	/* "open --type tcrypt" and "tcryptDump" checks are identical */
 	return verify_tcryptdump();
 }
@@ -2901,6 +4123,17 @@ static const char *verify_close(void)
 	return NULL;
 }
 
+static const char *verify_status(void)
+{
+	if (ARG_SET(OPT_JSON_ID) && !ARG_SET(OPT_ALL_ID))
+		return _("Option --json is allowed only with --all.");
+
+	if (ARG_SET(OPT_ALL_ID) ? action_argc > 0 : action_argc < 1)
+		return _("Command requires either <name> argument or --all option.");
+
+	return NULL;
+}
+
 static const char *verify_resize(void)
 {
 	if (ARG_SET(OPT_DEVICE_SIZE_ID) && ARG_SET(OPT_SIZE_ID))
@@ -2920,6 +4153,30 @@ static const char *verify_reencrypt(void)
 	if (ARG_SET(OPT_ACTIVE_NAME_ID) && ARG_SET(OPT_FORCE_OFFLINE_REENCRYPT_ID))
 		return _("Options --active-name and --force-offline-reencrypt cannot be combined.");
 
+	if (ARG_SET(OPT_PARALLEL_ID) && (ARG_SET(OPT_ACTIVE_NAME_ID) || ARG_SET(OPT_HEADER_ID) ||
+	    ARG_SET(OPT_ENCRYPT_ID) || ARG_SET(OPT_DECRYPT_ID)))
+		return _("Option --parallel cannot be combined with --active-name, --header, --encrypt or --decrypt.");
+
+	if (ARG_UINT32(OPT_PARALLEL_ID) > 1 && !ARG_SET(OPT_KEY_FILE_ID))
+		return _("Option --parallel requires --key-file.");
+
+	return NULL;
+}
+
+static const char *verify_benchmark(void)
+{
+	if (ARG_SET(OPT_DM_ID) && (ARG_SET(OPT_SCALING_ID) || ARG_SET(OPT_PBKDF_ID) || ARG_SET(OPT_HASH_ID)))
+		return _("Option --dm cannot be combined with --scaling, --pbkdf or --hash.");
+
+	if (ARG_SET(OPT_QUEUE_DEPTH_ID) && !ARG_SET(OPT_DM_ID))
+		return _("Option --queue-depth can be used only with --dm.");
+
+	if ((ARG_SET(OPT_JSON_ID) || ARG_SET(OPT_COMPARE_ID)) && (ARG_SET(OPT_DM_ID) || ARG_SET(OPT_SCALING_ID)))
+		return _("Options --json and --compare cannot be combined with --dm or --scaling.");
+
+	if (ARG_SET(OPT_COMPARE_THRESHOLD_ID) && !ARG_SET(OPT_COMPARE_ID))
+		return _("Option --compare-threshold can be used only with --compare.");
+
 	return NULL;
 }
 
@@ -2958,6 +4215,14 @@ static const char *verify_luksDump(void)
 	if (ARG_SET(OPT_UNBOUND_ID) && ARG_INT32(OPT_KEY_SLOT_ID) == CRYPT_ANY_SLOT)
 		return _("Keyslot specification is required.");
 
+	if (ARG_SET(OPT_BATCH_FILE_ID) && (action_argc || (device_type && strcmp(device_type, "luks2")) ||
+	    ARG_SET(OPT_HEADER_ID) || ARG_SET(OPT_DUMP_VOLUME_KEY_ID) || ARG_SET(OPT_UNBOUND_ID)))
+		return _("Option --batch-file can be used only for luksDump of LUKS2 devices without device arguments, "
+			 "--header, --dump-volume-key or --unbound.");
+
+	if (ARG_SET(OPT_PARALLEL_ID) && !ARG_SET(OPT_BATCH_FILE_ID))
+		return _("Option --parallel with luksDump action requires --batch-file.");
+
 	return NULL;
 }
 
@@ -3005,8 +4270,8 @@ static struct action_type {
 	{ OPEN_ACTION,		action_open,		verify_open,		1, N_("<device> [--type <type>] [<name>]"),N_("open device as <name>") },
 	{ CLOSE_ACTION,		action_close,		verify_close,		1, N_("<name>"), N_("close device (remove mapping)") },
 	{ RESIZE_ACTION,	action_resize,		verify_resize,		1, N_("<name>"), N_("resize active device") },
-	{ STATUS_ACTION,	action_status,		NULL,			1, N_("<name>"), N_("show device status") },
-	{ BENCHMARK_ACTION,	action_benchmark,	NULL,			0, N_("[--cipher <cipher>]"), N_("benchmark cipher") },
+	{ STATUS_ACTION,	action_status,		verify_status,		0, N_("<name> | --all"), N_("show device status") },
+	{ BENCHMARK_ACTION,	action_benchmark,	verify_benchmark,	0, N_("[--cipher <cipher>]"), N_("benchmark cipher") },
 	{ REPAIR_ACTION,	action_luksRepair,	NULL,			1, N_("<device>"), N_("try to repair on-disk metadata") },
 	{ REENCRYPT_ACTION,	action_reencrypt,	verify_reencrypt,	0, N_("<device>"), N_("reencrypt LUKS2 device") },
 	{ ERASE_ACTION,		action_luksErase,	NULL,			1, N_("<device>"), N_("erase all keyslots (remove encryption key)") },
@@ -3031,6 +4296,24 @@ static struct action_type {
 	{}
 };
 
+#if CRYPTSETUP_UNLOCK_ONLY
+/* initramfs build, see --enable-unlock-only */
+static bool unlock_only_action(const char *type)
+{
+	static const char *const allowed[] = {
+		OPEN_ACTION, CLOSE_ACTION, STATUS_ACTION, RESIZE_ACTION,
+		ISLUKS_ACTION, UUID_ACTION, SUSPEND_ACTION, RESUME_ACTION
+	};
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(allowed); i++)
+		if (!strcmp(type, allowed[i]))
+			return true;
+
+	return false;
+}
+#endif
+
 static void help(poptContext popt_context,
 		 enum poptCallbackReason reason __attribute__((unused)),
 		 struct poptOption *key,
@@ -3118,6 +4401,31 @@ static void help_args(struct action_type *action, poptContext popt_context)
 	usage(popt_context, EXIT_FAILURE, buf, poptGetInvocationName(popt_context));
 }
 
+static void print_perf_stats(void)
+{
+	struct crypt_perf_stats st;
+
+	if (crypt_get_perf_stats(NULL, &st))
+		return;
+
+	log_std(_("Performance statistics:\n"
+		  "\tmetadata read:   %" PRIu64 " bytes\n"
+		  "\tmetadata write:  %" PRIu64 " bytes\n"
+		  "\theader reads:    %" PRIu64 "\n"
+		  "\theader writes:   %" PRIu64 "\n"
+		  "\tfsyncs:          %" PRIu64 "\n"
+		  "\tKDF runs:        %" PRIu64 "\n"
+		  "\tKDF wall time:   %" PRIu64 " us\n"
+		  "\tKDF CPU time:    %" PRIu64 " us\n"
+		  "\tkernel crypto:   %" PRIu64 " requests\n"
+		  "\tdm ioctls:       %" PRIu64 "\n"
+		  "\tudev wait:       %" PRIu64 " us\n"),
+		st.metadata_read_bytes, st.metadata_write_bytes,
+		st.header_reads, st.header_writes, st.fsyncs,
+		st.kdf_runs, st.kdf_wall_us, st.kdf_cpu_us,
+		st.kernel_crypto_calls, st.dm_ioctls, st.udev_wait_us);
+}
+
 static int run_action(struct action_type *action)
 {
 	int r;
@@ -3147,7 +4455,7 @@ static bool needs_size_conversion(unsigned arg_id)
 {
 	return (arg_id == OPT_DEVICE_SIZE_ID || arg_id == OPT_HOTZONE_SIZE_ID ||
 		arg_id == OPT_LUKS2_KEYSLOTS_SIZE_ID || arg_id == OPT_LUKS2_METADATA_SIZE_ID ||
-		arg_id == OPT_REDUCE_DEVICE_SIZE_ID);
+		arg_id == OPT_MAX_THROUGHPUT_ID || arg_id == OPT_REDUCE_DEVICE_SIZE_ID);
 }
 
 static void check_key_slot_value(poptContext popt_context)
@@ -3369,8 +4677,14 @@ int main(int argc, const char **argv)
 	if (!action->type)
 		usage(popt_context, EXIT_FAILURE, _("Unknown action."),
 		      poptGetInvocationName(popt_context));
+#if CRYPTSETUP_UNLOCK_ONLY
+	if (!unlock_only_action(action->type))
+		usage(popt_context, EXIT_FAILURE, _("Action is not supported by unlock-only cryptsetup."),
+		      poptGetInvocationName(popt_context));
+#endif
 
-	if (action_argc < action->required_action_argc)
+	if (action_argc < action->required_action_argc &&
+	    !((!strcmp(aname, OPEN_ACTION) || !strcmp(aname, LUKSDUMP_ACTION)) && ARG_SET(OPT_BATCH_FILE_ID)))
 		help_args(action, popt_context);
 
 	/* this routine short circuits to exit() on error */
@@ -3404,6 +4718,18 @@ int main(int argc, const char **argv)
 		_("PBKDF forced iterations cannot be combined with iteration time option."),
 		poptGetInvocationName(popt_context));
 
+	if (ARG_SET(OPT_PBKDF_SAMPLES_ID) &&
+	    (ARG_UINT32(OPT_PBKDF_SAMPLES_ID) < 1 || ARG_UINT32(OPT_PBKDF_SAMPLES_ID) > 64))
+		usage(popt_context, EXIT_FAILURE,
+		_("PBKDF benchmark samples must be in range 1 - 64."),
+		poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_PROGRESS_FD_ID) &&
+	    (ARG_INT32(OPT_PROGRESS_FD_ID) < 0 || fcntl(ARG_INT32(OPT_PROGRESS_FD_ID), F_GETFL) < 0))
+		usage(popt_context, EXIT_FAILURE,
+		_("Invalid progress file descriptor."),
+		poptGetInvocationName(popt_context));
+
 	if (ARG_SET(OPT_DEBUG_ID) || ARG_SET(OPT_DEBUG_JSON_ID)) {
 		crypt_set_debug_level(ARG_SET(OPT_DEBUG_JSON_ID)? CRYPT_DEBUG_JSON : CRYPT_DEBUG_ALL);
 		dbg_version_and_cmd(argc, argv);
@@ -3437,6 +4763,8 @@ int main(int argc, const char **argv)
 		r = EXIT_FAILURE;
 	} else {
 		r = run_action(action);
+		if (ARG_SET(OPT_PERF_STATS_ID))
+			print_perf_stats();
 	}
 
 	tools_cleanup();
@@ -39,6 +39,7 @@
 #include <popt.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "lib/nls.h"
 #include "lib/bitops.h"
@@ -73,6 +74,7 @@ void tools_keyslot_msg(int keyslot, crypt_object_op op);
 void tools_token_msg(int token, crypt_object_op op);
 void tools_token_error_msg(int error, const char *type, int token, bool pin_provided);
 void tools_package_version(const char *name, bool use_pwlibs);
+void tools_json_print_string(const char *str);
 
 extern volatile int quit;
 void set_int_block(int block);
@@ -80,6 +82,9 @@ void set_int_handler(int block);
 void check_signal(int *r);
 int tools_signals_blocked(void);
 
+/* tools_get_key() pwquality value: check runs in background until tools_check_password_wait() */
+#define TOOLS_PWQUALITY_ASYNC 2
+
 int tools_get_key(const char *prompt,
 		  char **key, size_t *key_size,
 		  uint64_t keyfile_offset, size_t keyfile_size_max,
@@ -87,21 +92,32 @@ int tools_get_key(const char *prompt,
 		  int timeout, int verify, int pwquality,
 		  struct crypt_device *cd);
 void tools_passphrase_msg(int r);
+bool tools_check_password_pending(void);
+int tools_check_password_wait(void);
 int tools_is_stdin(const char *key_file);
 int tools_string_to_size(const char *s, uint64_t *size);
 
 struct tools_progress_params {
 	uint32_t frequency;
-	struct timeval start_time;
-	struct timeval end_time;
+	struct timespec start_time;
+	struct timespec end_time;
 	uint64_t start_offset;
 	bool batch_mode;
 	bool json_output;
+	bool fd_output;
+	int fd;
 	const char *interrupt_message;
 	const char *device;
+	/* wipe checkpoint, see tools_checkpoint_load() */
+	const char *checkpoint;
+	const char *checkpoint_device;
+	uint64_t checkpoint_offset;
 };
 
 int tools_progress(uint64_t size, uint64_t offset, void *usrptr);
+int tools_checkpoint_load(const char *file, uint64_t size, uint64_t *offset);
+void tools_checkpoint_remove(const char *file);
+void tools_reencrypt_stats(const struct crypt_reencrypt_step_stats *stats, void *usrptr);
 const char *tools_get_device_name(const char *device, char **r_backing_file);
 
 int tools_read_vk(const char *file, char **key, int keysize);
@@ -117,6 +133,15 @@ typedef enum {
 } tools_probe_filter_info;
 
 int tools_detect_signatures(const char *device, tools_probe_filter_info filter, size_t *count, bool batch_mode);
+
+struct tools_signatures_probe {
+	const char *device;
+	size_t count;	/* detected signatures */
+	int r;
+};
+
+int tools_detect_signatures_batch(struct tools_signatures_probe *probes, size_t probes_count,
+		tools_probe_filter_info filter, unsigned threads);
 int tools_wipe_all_signatures(const char *path, bool exclusive, bool only_luks);
 int tools_superblock_block_size(const char *device, char *sb_name,
 				size_t sb_name_len, unsigned *r_block_size);
@@ -25,14 +25,26 @@ ARG(OPT_ACTIVE_NAME, '\0', POPT_ARG_STRING, N_("Override device autodetection of
 
 ARG(OPT_ALIGN_PAYLOAD, '\0', POPT_ARG_STRING, N_("Align payload at <n> sector boundaries - for luksFormat"), N_("SECTORS"), CRYPT_ARG_UINT32, {}, OPT_ALIGN_PAYLOAD_ACTIONS)
 
+ARG(OPT_ALL, '\0', POPT_ARG_NONE, N_("Show status of all active devices"), NULL, CRYPT_ARG_BOOL, {}, OPT_ALL_ACTIONS)
+
 ARG(OPT_ALLOW_DISCARDS, '\0', POPT_ARG_NONE, N_("Allow discards (aka TRIM) requests for device"), NULL, CRYPT_ARG_BOOL, {}, OPT_ALLOW_DISCARDS_ACTIONS)
 
+ARG(OPT_BACKUP_ARCHIVE, '\0', POPT_ARG_NONE, N_("Header backup file is a deduplicating archive of many headers"), NULL, CRYPT_ARG_BOOL, {}, OPT_BACKUP_ARCHIVE_ACTIONS)
+
+ARG(OPT_BATCH_FILE, '\0', POPT_ARG_STRING, N_("Process all LUKS devices listed in file (see man page for format)"), NULL, CRYPT_ARG_STRING, {}, OPT_BATCH_FILE_ACTIONS)
+
 ARG(OPT_BATCH_MODE, 'q', POPT_ARG_NONE, N_("Do not ask for confirmation"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_CANCEL_DEFERRED, '\0', POPT_ARG_NONE, N_("Cancel a previously set deferred device removal"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEFERRED_ACTIONS)
 
 ARG(OPT_CIPHER, 'c', POPT_ARG_STRING, N_("The cipher used to encrypt the disk (see /proc/crypto)"), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_COMPARE, '\0', POPT_ARG_STRING, N_("Compare benchmark results with baseline JSON file"), N_("file"), CRYPT_ARG_STRING, {}, OPT_COMPARE_ACTIONS)
+
+ARG(OPT_COMPARE_THRESHOLD, '\0', POPT_ARG_STRING, N_("Slowdown reported as regression by --compare (in percent)"), N_("percent"), CRYPT_ARG_UINT32, {}, OPT_COMPARE_ACTIONS)
+
+ARG(OPT_CRYPT_SHARDS, '\0', POPT_ARG_STRING, N_("Split dm-crypt mapping to number of targets"), N_("num"), CRYPT_ARG_UINT32, {}, OPT_CRYPT_SHARDS_ACTIONS)
+
 ARG(OPT_DEBUG, '\0', POPT_ARG_NONE, N_("Show debug messages"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_DEBUG_JSON, '\0', POPT_ARG_NONE, N_("Show debug messages including JSON metadata"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -51,6 +63,10 @@ ARG(OPT_DISABLE_LOCKS, '\0', POPT_ARG_NONE, N_("Disable locking of on-disk metad
 
 ARG(OPT_DISABLE_VERACRYPT, '\0', POPT_ARG_NONE, N_("Do not scan for VeraCrypt compatible device"), NULL, CRYPT_ARG_BOOL, {}, OPT_DISABLE_VERACRYPT_ACTIONS)
 
+ARG(OPT_DISCARD_UNUSED, '\0', POPT_ARG_NONE, N_("Discard (or zero) data device area freed by data shift instead of random wipe"), NULL, CRYPT_ARG_BOOL, {}, OPT_DISCARD_UNUSED_ACTIONS)
+
+ARG(OPT_DM, '\0', POPT_ARG_NONE, N_("Benchmark dm-crypt data path over temporary device"), NULL, CRYPT_ARG_BOOL, {}, OPT_DM_ACTIONS)
+
 ARG(OPT_DUMP_JSON, '\0', POPT_ARG_NONE, N_("Dump info in JSON format (LUKS2 only)"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_DUMP_VOLUME_KEY, '\0', POPT_ARG_NONE, N_("Dump volume key instead of keyslots info"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -67,10 +83,16 @@ ARG(OPT_HEADER, '\0', POPT_ARG_STRING, N_("Device or file with separated LUKS he
 
 ARG(OPT_HEADER_BACKUP_FILE, '\0', POPT_ARG_STRING, N_("File with LUKS header and keyslots backup"), NULL, CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_HOTZONE_BATCH, '\0', POPT_ARG_STRING, N_("Number of hotzones protected by single checksum resilience metadata commit."), N_("number"), CRYPT_ARG_UINT32, {}, OPT_HOTZONE_BATCH_ACTIONS)
+
+ARG(OPT_HOTZONE_LATENCY, '\0', POPT_ARG_STRING, N_("Adapt reencryption hotzone size to target duration of single step."), N_("ms"), CRYPT_ARG_UINT32, {}, OPT_HOTZONE_LATENCY_ACTIONS)
+
 ARG(OPT_HOTZONE_SIZE, '\0', POPT_ARG_STRING, N_("Maximal reencryption hotzone size."), N_("bytes"), CRYPT_ARG_UINT64, {}, OPT_HOTZONE_SIZE_ACTIONS)
 
 ARG(OPT_INIT_ONLY, '\0', POPT_ARG_NONE, N_("Initialize LUKS2 reencryption in metadata only."), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_INLINE_CRYPT, '\0', POPT_ARG_NONE, N_("Use inline encryption hardware of device if available"), NULL, CRYPT_ARG_BOOL, {}, OPT_INLINE_CRYPT_ACTIONS)
+
 ARG(OPT_INTEGRITY, 'I', POPT_ARG_STRING, N_("Data integrity algorithm (LUKS2 only)"), NULL, CRYPT_ARG_STRING, {}, OPT_INTEGRITY_ACTIONS)
 
 ARG(OPT_INTEGRITY_LEGACY_PADDING,'\0', POPT_ARG_NONE, N_("Use inefficient legacy padding (old kernels)"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -79,10 +101,16 @@ ARG(OPT_INTEGRITY_NO_JOURNAL, '\0', POPT_ARG_NONE, N_("Disable journal for integ
 
 ARG(OPT_INTEGRITY_NO_WIPE, '\0', POPT_ARG_NONE, N_("Do not wipe device after format"), NULL, CRYPT_ARG_BOOL, {}, OPT_INTEGRITY_NO_WIPE_ACTIONS)
 
+ARG(OPT_IO_IDLE, '\0', POPT_ARG_NONE, N_("Use idle I/O scheduling class for reencryption."), NULL, CRYPT_ARG_BOOL, {}, OPT_IO_IDLE_ACTIONS)
+
+ARG(OPT_IO_STATS, '\0', POPT_ARG_NONE, N_("Collect I/O latency statistics of the activated device"), NULL, CRYPT_ARG_BOOL, {}, OPT_IO_STATS_ACTIONS)
+
 ARG(OPT_ITER_TIME, 'i', POPT_ARG_STRING, N_("PBKDF iteration time for LUKS (in ms)"), N_("msecs"), CRYPT_ARG_UINT32, {}, OPT_ITER_TIME_ACTIONS)
 
 ARG(OPT_IV_LARGE_SECTORS, '\0', POPT_ARG_NONE, N_("Use IV counted in sector size (not in 512 bytes)"), NULL , CRYPT_ARG_BOOL, {}, OPT_IV_LARGE_SECTORS_ACTIONS)
 
+ARG(OPT_JSON, '\0', POPT_ARG_NONE, N_("Print output in json format"), NULL, CRYPT_ARG_BOOL, {}, OPT_JSON_ACTIONS)
+
 ARG(OPT_JSON_FILE, '\0', POPT_ARG_STRING, N_("Read or write the json from or to a file"), NULL, CRYPT_ARG_STRING, {}, {})
 
 ARG(OPT_KEEP_KEY, '\0', POPT_ARG_NONE, N_("Do not change volume key."), NULL, CRYPT_ARG_BOOL, {}, OPT_KEEP_KEY_ACTIONS)
@@ -101,6 +129,8 @@ ARG(OPT_KEYFILE_SIZE, 'l', POPT_ARG_STRING, N_("Limits the read from keyfile"),
 
 ARG(OPT_KEYSLOT_CIPHER, '\0', POPT_ARG_STRING, N_("LUKS2 keyslot: The cipher used for keyslot encryption"), NULL, CRYPT_ARG_STRING, {}, OPT_KEYSLOT_CIPHER_ACTIONS)
 
+ARG(OPT_KEYSLOT_HINT, '\0', POPT_ARG_NONE, N_("Try keyslot that opened the same key file or token last time first"), NULL, CRYPT_ARG_BOOL, {}, OPT_KEYSLOT_HINT_ACTIONS)
+
 ARG(OPT_KEYSLOT_KEY_SIZE, '\0', POPT_ARG_STRING, N_("LUKS2 keyslot: The size of the encryption key"), N_("BITS"), CRYPT_ARG_UINT32, {}, OPT_KEYSLOT_KEY_SIZE_ACTIONS)
 
 ARG(OPT_LABEL, '\0', POPT_ARG_STRING, N_("Set label for the LUKS2 device"), NULL, CRYPT_ARG_STRING, {}, OPT_LABEL_ACTIONS)
@@ -109,6 +139,10 @@ ARG(OPT_LUKS2_KEYSLOTS_SIZE, '\0', POPT_ARG_STRING, N_("LUKS2 header keyslots ar
 
 ARG(OPT_LUKS2_METADATA_SIZE, '\0', POPT_ARG_STRING, N_("LUKS2 header metadata area size"), N_("bytes"), CRYPT_ARG_UINT64, {}, OPT_LUKS2_METADATA_SIZE_ACTIONS)
 
+ARG(OPT_MAX_IO_LATENCY, '\0', POPT_ARG_STRING, N_("Back off online reencryption while I/O latency of active device exceeds this value"), N_("ms"), CRYPT_ARG_UINT32, {}, OPT_MAX_IO_LATENCY_ACTIONS)
+
+ARG(OPT_MAX_THROUGHPUT, '\0', POPT_ARG_STRING, N_("Limit reencryption throughput (per second)"), N_("bytes"), CRYPT_ARG_UINT64, {}, OPT_MAX_THROUGHPUT_ACTIONS)
+
 ARG(OPT_VOLUME_KEY_FILE, '\0', POPT_ARG_STRING, N_("Use the volume key from file."), NULL, CRYPT_ARG_STRING, {}, {})
 
 ARG(OPT_NEW_KEYFILE, '\0', POPT_ARG_STRING, N_("Read the key for a new slot from a file"), NULL, CRYPT_ARG_STRING, {}, OPT_NEW_KEYFILE_ACTIONS)
@@ -123,6 +157,14 @@ ARG(OPT_NEW_TOKEN_ID, '\0', POPT_ARG_STRING, N_("Token number (default: any)"),
 
 ARG(OPT_OFFSET, 'o', POPT_ARG_STRING, N_("The start offset in the backend device"), N_("SECTORS"), CRYPT_ARG_UINT64, {}, OPT_OFFSET_ACTIONS)
 
+ARG(OPT_OPTIMIZE_LAYOUT, '\0', POPT_ARG_NONE, N_("Choose data offset and sector size from device topology and cipher speed"), NULL, CRYPT_ARG_BOOL, {}, OPT_OPTIMIZE_LAYOUT_ACTIONS)
+
+ARG(OPT_PARALLEL, '\0', POPT_ARG_STRING, N_("Process all listed devices, at most this many at once"), N_("number"), CRYPT_ARG_UINT32, {}, OPT_PARALLEL_ACTIONS)
+
+ARG(OPT_PARALLEL_KEYSLOTS, '\0', POPT_ARG_NONE, N_("Try all keyslots concurrently (limited by available memory and CPUs)"), NULL, CRYPT_ARG_BOOL, {}, OPT_PARALLEL_KEYSLOTS_ACTIONS)
+
+ARG(OPT_PARALLEL_TOKENS, '\0', POPT_ARG_NONE, N_("Run token handlers concurrently, first one to unlock wins"), NULL, CRYPT_ARG_BOOL, {}, OPT_PARALLEL_TOKENS_ACTIONS)
+
 ARG(OPT_PBKDF, '\0', POPT_ARG_STRING, N_("PBKDF algorithm (for LUKS2): argon2i, argon2id, pbkdf2"), NULL, CRYPT_ARG_STRING, {}, OPT_PBKDF_ACTIONS)
 
 ARG(OPT_PBKDF_FORCE_ITERATIONS, '\0', POPT_ARG_STRING, N_("PBKDF iterations cost (forced, disables benchmark)"), "LONG", CRYPT_ARG_UINT32, {}, OPT_PBKDF_FORCE_ITERATIONS_ACTIONS)
@@ -131,12 +173,20 @@ ARG(OPT_PBKDF_MEMORY, '\0', POPT_ARG_STRING, N_("PBKDF memory cost limit"), N_("
 
 ARG(OPT_PBKDF_PARALLEL, '\0', POPT_ARG_STRING, N_("PBKDF parallel cost"), N_("threads"), CRYPT_ARG_UINT32, { .u32_value = DEFAULT_LUKS2_PARALLEL_THREADS }, {})
 
+ARG(OPT_PBKDF_SAMPLES, '\0', POPT_ARG_STRING, N_("PBKDF benchmark samples (median with outlier rejection)"), N_("number"), CRYPT_ARG_UINT32, {}, OPT_PBKDF_SAMPLES_ACTIONS)
+
+ARG(OPT_PERF_AUTO, '\0', POPT_ARG_NONE, N_("Select dm-crypt performance options automatically for data device"), NULL, CRYPT_ARG_BOOL, {}, OPT_PERF_AUTO_ACTIONS)
+
+ARG(OPT_PERF_AUTO_PROBE, '\0', POPT_ARG_NONE, N_("Verify automatically selected performance options with short benchmark"), NULL, CRYPT_ARG_BOOL, {}, OPT_PERF_AUTO_ACTIONS)
+
 ARG(OPT_PERF_NO_READ_WORKQUEUE, '\0', POPT_ARG_NONE, N_("Bypass dm-crypt workqueue and process read requests synchronously"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_PERF_NO_WRITE_WORKQUEUE, '\0', POPT_ARG_NONE, N_("Bypass dm-crypt workqueue and process write requests synchronously"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_PERF_SAME_CPU_CRYPT, '\0', POPT_ARG_NONE, N_("Use dm-crypt same_cpu_crypt performance compatibility option"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_PERF_STATS, '\0', POPT_ARG_NONE, N_("Print library performance counters after the action"), NULL, CRYPT_ARG_BOOL, {}, {})
+
 ARG(OPT_PERF_SUBMIT_FROM_CRYPT_CPUS, '\0', POPT_ARG_NONE, N_("Use dm-crypt submit_from_crypt_cpus performance compatibility option"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_PERSISTENT, '\0', POPT_ARG_NONE, N_("Set activation flags persistent for device"), NULL, CRYPT_ARG_BOOL, {}, OPT_PERSISTENT_ACTIONS)
@@ -145,30 +195,44 @@ ARG(OPT_PRIORITY, '\0', POPT_ARG_STRING, N_("Keyslot priority: ignore, normal, p
 
 ARG(OPT_PROGRESS_JSON, '\0', POPT_ARG_NONE, N_("Print progress data in json format (suitable for machine processing)"), NULL, CRYPT_ARG_BOOL, {}, OPT_PROGRESS_JSON_ACTIONS)
 
+ARG(OPT_PROGRESS_FD, '\0', POPT_ARG_STRING, N_("Write progress data in json format to file descriptor"), N_("fd"), CRYPT_ARG_INT32, {}, OPT_PROGRESS_FD_ACTIONS)
+
 ARG(OPT_PROGRESS_FREQUENCY, '\0', POPT_ARG_STRING, N_("Progress line update (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, {})
 
+ARG(OPT_PROGRESS_STATS, '\0', POPT_ARG_NONE, N_("Print per hotzone reencryption statistics in json format"), NULL, CRYPT_ARG_BOOL, {}, OPT_PROGRESS_STATS_ACTIONS)
+
+ARG(OPT_QUEUE_DEPTH, '\0', POPT_ARG_STRING, N_("Number of concurrent I/O requests in dm-crypt benchmark"), N_("number"), CRYPT_ARG_UINT32, {}, OPT_QUEUE_DEPTH_ACTIONS)
+
 ARG(OPT_READONLY, 'r', POPT_ARG_NONE, N_("Create a readonly mapping"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_REDUCE_DEVICE_SIZE, '\0', POPT_ARG_STRING, N_("Reduce data device size (move data offset). DANGEROUS!"), N_("bytes"), CRYPT_ARG_UINT64, {}, {})
 
 ARG(OPT_REFRESH, '\0', POPT_ARG_NONE, N_("Refresh (reactivate) device with new parameters"), NULL, CRYPT_ARG_BOOL, {}, OPT_REFRESH_ACTIONS)
 
-ARG(OPT_RESILIENCE, '\0', POPT_ARG_STRING, N_("Reencryption hotzone resilience type (checksum,journal,none)"), NULL, CRYPT_ARG_STRING, {}, {})
+ARG(OPT_RESILIENCE, '\0', POPT_ARG_STRING, N_("Reencryption hotzone resilience type (checksum,journal,journal-ring,none)"), NULL, CRYPT_ARG_STRING, {}, {})
+
+ARG(OPT_RESILIENCE_ADAPTIVE, '\0', POPT_ARG_NONE, N_("Switch between checksum and journal resilience per hotzone, whichever is faster"), NULL, CRYPT_ARG_BOOL, {}, OPT_RESILIENCE_ADAPTIVE_ACTIONS)
 
 ARG(OPT_RESILIENCE_HASH, '\0', POPT_ARG_STRING, N_("Reencryption hotzone checksums hash"), NULL, CRYPT_ARG_STRING, {}, {})
 
 ARG(OPT_RESUME_ONLY, '\0', POPT_ARG_NONE, N_("Resume initialized LUKS2 reencryption only."), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_SCALING, '\0', POPT_ARG_NONE, N_("Benchmark cipher scaling with threads, sector and buffer sizes"), NULL, CRYPT_ARG_BOOL, {}, OPT_SCALING_ACTIONS)
+
 ARG(OPT_SECTOR_SIZE, '\0', POPT_ARG_STRING, N_("Encryption sector size (default: 512 bytes)"), "INT", CRYPT_ARG_UINT32, {}, OPT_SECTOR_SIZE_ACTIONS)
 
 ARG(OPT_SERIALIZE_MEMORY_HARD_PBKDF, '\0', POPT_ARG_NONE, N_("Use global lock to serialize memory hard PBKDF (OOM workaround)"), NULL, CRYPT_ARG_BOOL, {}, OPT_SERIALIZE_MEMORY_HARD_PBKDF_ACTIONS)
 
+ARG(OPT_SKIP_UNALLOCATED, '\0', POPT_ARG_NONE, N_("Do not encrypt unallocated areas of sparse data device"), NULL, CRYPT_ARG_BOOL, {}, OPT_SKIP_UNALLOCATED_ACTIONS)
+
 ARG(OPT_SHARED, '\0', POPT_ARG_NONE, N_("Share device with another non-overlapping crypt segment"), NULL, CRYPT_ARG_BOOL, {}, OPT_SHARED_ACTIONS )
 
 ARG(OPT_SIZE, 'b', POPT_ARG_STRING, N_("The size of the device"), N_("SECTORS"), CRYPT_ARG_UINT64, {}, OPT_SIZE_ACTIONS)
 
 ARG(OPT_SKIP, 'p', POPT_ARG_STRING, N_("How many sectors of the encrypted data to skip at the beginning"), N_("SECTORS"), CRYPT_ARG_UINT64, {}, OPT_SKIP_ACTIONS)
 
+ARG(OPT_STATS, '\0', POPT_ARG_NONE, N_("Print I/O statistics of the device and its backing device"), NULL, CRYPT_ARG_BOOL, {}, OPT_STATS_ACTIONS)
+
 ARG(OPT_SUBSYSTEM, '\0', POPT_ARG_STRING, N_("Set subsystem label for the LUKS2 device"), NULL, CRYPT_ARG_STRING, {}, OPT_SUBSYSTEM_ACTIONS)
 
 ARG(OPT_TCRYPT_BACKUP, '\0', POPT_ARG_NONE, N_("Use backup (secondary) TCRYPT header"), NULL, CRYPT_ARG_BOOL, {}, OPT_TCRYPT_BACKUP_ACTIONS)
@@ -181,14 +245,20 @@ ARG(OPT_TEST_ARGS, '\0', POPT_ARG_NONE, N_("Do not run action, just validate all
 
 ARG(OPT_TEST_PASSPHRASE, '\0', POPT_ARG_NONE, N_("Do not activate device, just check passphrase"), NULL, CRYPT_ARG_BOOL, {}, OPT_TEST_PASSPHRASE_ACTIONS)
 
+ARG(OPT_THREADS, '\0', POPT_ARG_STRING, N_("Number of threads used for reencryption data processing"), N_("threads"), CRYPT_ARG_UINT32, {}, OPT_THREADS_ACTIONS)
+
 ARG(OPT_TIMEOUT, 't', POPT_ARG_STRING, N_("Timeout for interactive passphrase prompt (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, {})
 
 ARG(OPT_TOKEN_ID, '\0', POPT_ARG_STRING, N_("Token number (default: any)"), "INT", CRYPT_ARG_INT32, { .i32_value = CRYPT_ANY_TOKEN }, {})
 
+ARG(OPT_TOKEN_KEYRING_CACHE, '\0', POPT_ARG_STRING, N_("Cache token secret in user keyring for other devices (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, OPT_TOKEN_KEYRING_CACHE_ACTIONS)
+
 ARG(OPT_TOKEN_ONLY, '\0', POPT_ARG_NONE, N_("Do not ask for passphrase if activation by token fails"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_TOKEN_REPLACE, '\0', POPT_ARG_NONE, N_("Replace the current token"), NULL, CRYPT_ARG_BOOL, {}, OPT_TOKEN_REPLACE_ACTIONS)
 
+ARG(OPT_TOKEN_TIMEOUT, '\0', POPT_ARG_STRING, N_("Give up waiting for token without PIN after timeout (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, OPT_TOKEN_TIMEOUT_ACTIONS)
+
 ARG(OPT_TOKEN_TYPE, '\0', POPT_ARG_STRING, N_("Restrict allowed token types used to retrieve LUKS2 key"), NULL, CRYPT_ARG_STRING, {}, {})
 
 ARG(OPT_TRIES, 'T', POPT_ARG_STRING, N_("How often the input of the passphrase can be retried"), "INT", CRYPT_ARG_UINT32, { .u32_value = 3 }, {})
@@ -213,6 +283,14 @@ ARG(OPT_VERBOSE, 'v', POPT_ARG_NONE, N_("Shows more detailed error messages"), N
 
 ARG(OPT_VERIFY_PASSPHRASE, 'y', POPT_ARG_NONE, N_("Verifies the passphrase by asking for it twice"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_WIPE_THREADS, '\0', POPT_ARG_STRING, N_("Number of parallel writers used for initial integrity wipe"), N_("threads"), CRYPT_ARG_UINT32, {}, OPT_WIPE_THREADS_ACTIONS)
+
+ARG(OPT_WRAPPED_KEY_ONLY, '\0', POPT_ARG_NONE, N_("Do not ask for passphrase if resume by wrapped volume key fails"), NULL, CRYPT_ARG_BOOL, {}, OPT_WRAPPED_KEY_ONLY_ACTIONS)
+
+ARG(OPT_WRAPPED_KEY_TIMEOUT, '\0', POPT_ARG_STRING, N_("Lifetime of wrapped volume key kept for resume (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, { .u32_value = 300 }, OPT_WRAPPED_KEY_TIMEOUT_ACTIONS)
+
+ARG(OPT_WRAPPING_KEY_FILE, '\0', POPT_ARG_STRING, N_("Read the key used to wrap volume key for fast resume from file"), NULL, CRYPT_ARG_STRING, {}, OPT_WRAPPING_KEY_FILE_ACTIONS)
+
 /* added for reencryption */
 
 ARG(OPT_BLOCK_SIZE, 'B', POPT_ARG_STRING, N_("Reencryption block size"), N_("MiB"), CRYPT_ARG_UINT32, { .u32_value = 4 }, {})
@@ -54,20 +54,34 @@
 
 /* avoid unshielded commas in ARG() macros later */
 #define OPT_ALIGN_PAYLOAD_ACTIONS		{ FORMAT_ACTION, REENCRYPT_ACTION }
-#define OPT_ALLOW_DISCARDS_ACTIONS		{ OPEN_ACTION }
+#define OPT_ALL_ACTIONS				{ STATUS_ACTION }
+#define OPT_ALLOW_DISCARDS_ACTIONS		{ OPEN_ACTION, LUKSDUMP_ACTION }
+#define OPT_BACKUP_ARCHIVE_ACTIONS		{ HEADERBACKUP_ACTION, HEADERRESTORE_ACTION }
+#define OPT_BATCH_FILE_ACTIONS			{ OPEN_ACTION, LUKSDUMP_ACTION }
+#define OPT_COMPARE_ACTIONS			{ BENCHMARK_ACTION }
+#define OPT_CRYPT_SHARDS_ACTIONS		{ OPEN_ACTION }
 #define OPT_DEFERRED_ACTIONS			{ CLOSE_ACTION }
 #define OPT_DEVICE_SIZE_ACTIONS			{ OPEN_ACTION, RESIZE_ACTION, REENCRYPT_ACTION }
 #define OPT_DISABLE_VERACRYPT_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
+#define OPT_DISCARD_UNUSED_ACTIONS		{ REENCRYPT_ACTION }
+#define OPT_DM_ACTIONS				{ BENCHMARK_ACTION }
+#define OPT_HOTZONE_BATCH_ACTIONS		{ REENCRYPT_ACTION }
+#define OPT_HOTZONE_LATENCY_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_HOTZONE_SIZE_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_FORCE_OFFLINE_REENCRYPT_ACTIONS	{ REENCRYPT_ACTION }
+#define OPT_INLINE_CRYPT_ACTIONS		{ OPEN_ACTION }
 #define OPT_INTEGRITY_ACTIONS			{ FORMAT_ACTION, REENCRYPT_ACTION }
 #define OPT_INTEGRITY_NO_WIPE_ACTIONS		{ FORMAT_ACTION, REENCRYPT_ACTION }
+#define OPT_IO_IDLE_ACTIONS			{ REENCRYPT_ACTION }
+#define OPT_IO_STATS_ACTIONS			{ OPEN_ACTION }
 #define OPT_ITER_TIME_ACTIONS			{ BENCHMARK_ACTION, FORMAT_ACTION, ADDKEY_ACTION, CHANGEKEY_ACTION, CONVERTKEY_ACTION, REENCRYPT_ACTION }
 #define OPT_IV_LARGE_SECTORS_ACTIONS		{ OPEN_ACTION }
+#define OPT_JSON_ACTIONS			{ STATUS_ACTION, BENCHMARK_ACTION }
 #define OPT_KEEP_KEY_ACTIONS			{ REENCRYPT_ACTION }
 #define OPT_KEY_SIZE_ACTIONS			{ OPEN_ACTION, BENCHMARK_ACTION, FORMAT_ACTION, REENCRYPT_ACTION, ADDKEY_ACTION }
 #define OPT_KEY_SLOT_ACTIONS			{ OPEN_ACTION, REENCRYPT_ACTION, CONFIG_ACTION, FORMAT_ACTION, ADDKEY_ACTION, CHANGEKEY_ACTION, CONVERTKEY_ACTION, LUKSDUMP_ACTION, TOKEN_ACTION, RESUME_ACTION }
 #define OPT_KEYSLOT_CIPHER_ACTIONS		{ FORMAT_ACTION, REENCRYPT_ACTION, ADDKEY_ACTION, CHANGEKEY_ACTION, CONVERTKEY_ACTION }
+#define OPT_KEYSLOT_HINT_ACTIONS		{ OPEN_ACTION }
 #define OPT_KEYSLOT_KEY_SIZE_ACTIONS		OPT_KEYSLOT_CIPHER_ACTIONS
 #define OPT_NEW_KEYFILE_ACTIONS			{ ADDKEY_ACTION }
 #define OPT_NEW_KEY_SLOT_ACTIONS		{ ADDKEY_ACTION }
@@ -75,30 +89,52 @@
 #define OPT_LABEL_ACTIONS			{ CONFIG_ACTION, FORMAT_ACTION, REENCRYPT_ACTION }
 #define OPT_LUKS2_KEYSLOTS_SIZE_ACTIONS		{ REENCRYPT_ACTION, FORMAT_ACTION }
 #define OPT_LUKS2_METADATA_SIZE_ACTIONS		{ REENCRYPT_ACTION, FORMAT_ACTION }
+#define OPT_MAX_IO_LATENCY_ACTIONS		{ REENCRYPT_ACTION }
+#define OPT_MAX_THROUGHPUT_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_OFFSET_ACTIONS			{ OPEN_ACTION, REENCRYPT_ACTION, FORMAT_ACTION }
+#define OPT_OPTIMIZE_LAYOUT_ACTIONS		{ FORMAT_ACTION }
+#define OPT_PARALLEL_ACTIONS			{ OPEN_ACTION, LUKSDUMP_ACTION, REENCRYPT_ACTION }
+#define OPT_PARALLEL_KEYSLOTS_ACTIONS		{ OPEN_ACTION }
+#define OPT_PARALLEL_TOKENS_ACTIONS		{ OPEN_ACTION }
 #define OPT_PBKDF_ACTIONS			{ BENCHMARK_ACTION, FORMAT_ACTION, ADDKEY_ACTION, CHANGEKEY_ACTION, CONVERTKEY_ACTION, REENCRYPT_ACTION }
 #define OPT_PBKDF_FORCE_ITERATIONS_ACTIONS	{ FORMAT_ACTION, ADDKEY_ACTION, CHANGEKEY_ACTION, CONVERTKEY_ACTION, REENCRYPT_ACTION }
+#define OPT_PBKDF_SAMPLES_ACTIONS		{ BENCHMARK_ACTION, FORMAT_ACTION, ADDKEY_ACTION, CHANGEKEY_ACTION, CONVERTKEY_ACTION, REENCRYPT_ACTION }
+#define OPT_PERF_AUTO_ACTIONS			{ OPEN_ACTION }
 #define OPT_PERSISTENT_ACTIONS			{ OPEN_ACTION }
 #define OPT_PRIORITY_ACTIONS			{ CONFIG_ACTION }
+#define OPT_PROGRESS_FD_ACTIONS			{ FORMAT_ACTION, REENCRYPT_ACTION }
 #define OPT_PROGRESS_JSON_ACTIONS		{ FORMAT_ACTION, REENCRYPT_ACTION }
+#define OPT_PROGRESS_STATS_ACTIONS		{ REENCRYPT_ACTION }
+#define OPT_QUEUE_DEPTH_ACTIONS			{ BENCHMARK_ACTION }
 #define OPT_REFRESH_ACTIONS			{ OPEN_ACTION }
-#define OPT_SECTOR_SIZE_ACTIONS			{ OPEN_ACTION, REENCRYPT_ACTION, FORMAT_ACTION }
+#define OPT_RESILIENCE_ADAPTIVE_ACTIONS		{ REENCRYPT_ACTION }
+#define OPT_SCALING_ACTIONS			{ BENCHMARK_ACTION }
+#define OPT_SECTOR_SIZE_ACTIONS			{ OPEN_ACTION, REENCRYPT_ACTION, FORMAT_ACTION, BENCHMARK_ACTION }
 #define OPT_SERIALIZE_MEMORY_HARD_PBKDF_ACTIONS { OPEN_ACTION }
 #define OPT_SHARED_ACTIONS			{ OPEN_ACTION }
+#define OPT_SKIP_UNALLOCATED_ACTIONS		{ REENCRYPT_ACTION }
 #define OPT_SIZE_ACTIONS			{ OPEN_ACTION, RESIZE_ACTION }
 #define OPT_SKIP_ACTIONS			{ OPEN_ACTION }
+#define OPT_STATS_ACTIONS			{ STATUS_ACTION }
 #define OPT_SUBSYSTEM_ACTIONS			{ CONFIG_ACTION, FORMAT_ACTION, REENCRYPT_ACTION }
 #define OPT_TCRYPT_BACKUP_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
 #define OPT_TCRYPT_HIDDEN_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
 #define OPT_TCRYPT_SYSTEM_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
 #define OPT_TEST_PASSPHRASE_ACTIONS		{ OPEN_ACTION }
+#define OPT_THREADS_ACTIONS			{ REENCRYPT_ACTION }
+#define OPT_TOKEN_KEYRING_CACHE_ACTIONS		{ OPEN_ACTION }
 #define OPT_TOKEN_REPLACE_ACTIONS		{ TOKEN_ACTION }
+#define OPT_TOKEN_TIMEOUT_ACTIONS		{ OPEN_ACTION }
 #define OPT_UNBOUND_ACTIONS			{ ADDKEY_ACTION, LUKSDUMP_ACTION, OPEN_ACTION, TOKEN_ACTION }
 #define OPT_USE_RANDOM_ACTIONS			{ FORMAT_ACTION, REENCRYPT_ACTION }
 #define OPT_USE_URANDOM_ACTIONS			{ FORMAT_ACTION, REENCRYPT_ACTION }
-#define OPT_UUID_ACTIONS			{ FORMAT_ACTION, UUID_ACTION, REENCRYPT_ACTION }
+#define OPT_UUID_ACTIONS			{ FORMAT_ACTION, UUID_ACTION, REENCRYPT_ACTION, HEADERRESTORE_ACTION }
 #define OPT_VERACRYPT_PIM_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
 #define OPT_VERACRYPT_QUERY_PIM_ACTIONS		{ OPEN_ACTION, TCRYPTDUMP_ACTION }
+#define OPT_WIPE_THREADS_ACTIONS		{ FORMAT_ACTION }
+#define OPT_WRAPPED_KEY_ONLY_ACTIONS		{ RESUME_ACTION }
+#define OPT_WRAPPED_KEY_TIMEOUT_ACTIONS		{ SUSPEND_ACTION }
+#define OPT_WRAPPING_KEY_FILE_ACTIONS		{ SUSPEND_ACTION, RESUME_ACTION }
 
 enum {
 OPT_UNUSED_ID = 0, /* leave unused due to popt library */
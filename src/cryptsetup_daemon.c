@@ -0,0 +1,704 @@
+/*
+ * cryptsetup-daemon - resident service for opening and closing devices
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The daemon keeps one process with initialized crypto backend, loaded token
+ * plugins, device-mapper capabilities and PBKDF calibration cache, so frequent
+ * open/close/status requests do not pay process and library startup.
+ *
+ * Protocol: a client connects to the Unix socket, writes one request per line
+ * and shuts down its writing side. Requests of one connection are processed
+ * as a batch (consecutive opens with keys are activated together with one
+ * udev synchronization) and one reply line per request is written back:
+ *
+ *   open <device> <name> [keyfd]   (LUKS device, without keyfd by token)
+ *   close <name>
+ *   status <name>
+ *
+ *   OK [<info>]  or  ERR <errno> <message>
+ *
+ * The key is never given by path (the daemon runs as root), the client passes
+ * an open file descriptor (SCM_RIGHTS) for every "keyfd" request, in request
+ * order. Non-root peers must always pass a key (no token unlock) and can close
+ * only mappings the daemon opened for them.
+ *
+ * Clients are served one at a time. The whole request and the keys from passed
+ * descriptors must arrive within CLIENT_TIMEOUT_SEC, so a slow client delays the others by that much at most
+ * (plus the time its own unlocks take).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <locale.h>
+#include <limits.h>
+#include <poll.h>
+#include <popt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "lib/nls.h"
+#include "libcryptsetup.h"
+
+#define DEFAULT_DAEMON_SOCKET	DEFAULT_LUKS2_LOCK_PATH "/daemon.sock"
+
+#define MAX_REQUEST_SIZE	65536
+#define MAX_REQUESTS		256
+#define MAX_KEY_SIZE		(DEFAULT_KEYFILE_SIZE_MAXKB * 1024)
+/* slow or stuck client must not block other clients for long */
+#define CLIENT_TIMEOUT_SEC	5
+
+enum request_type { REQ_OPEN, REQ_CLOSE, REQ_STATUS };
+
+struct request {
+	enum request_type type;
+	const char *device;
+	const char *name;
+	bool has_key;
+	int keyfd;
+	uid_t uid;
+	const struct timespec *deadline;
+	struct crypt_device *cd;
+	char *passphrase;
+	size_t passphrase_size;
+	const char *info;
+	int r;
+};
+
+/* mappings opened for non-root peers, the only ones they may close */
+struct owned_mapping {
+	char *name;
+	uid_t uid;
+};
+
+static struct owned_mapping *owned;
+static size_t owned_count;
+
+static const char *opt_socket = DEFAULT_DAEMON_SOCKET;
+static const char *opt_socket_group = NULL;
+static int opt_allow_uid = -1;
+static int opt_verbose = 0;
+static int opt_debug = 0;
+static int opt_version = 0;
+
+static volatile sig_atomic_t quit = 0;
+
+static void daemon_log(int level, const char *msg, void *usrptr __attribute__((unused)))
+{
+	if (level == CRYPT_LOG_ERROR || opt_verbose || opt_debug)
+		fputs(msg, stderr);
+	if (level != CRYPT_LOG_DEBUG && msg[0] && msg[strlen(msg) - 1] != '\n')
+		fputc('\n', stderr);
+}
+
+#define log_err(x...) crypt_logf(NULL, CRYPT_LOG_ERROR, x)
+#define log_verbose(x...) crypt_logf(NULL, CRYPT_LOG_VERBOSE, x)
+
+static void int_handler(int sig __attribute__((unused)))
+{
+	quit = 1;
+}
+
+static int parse_request(char *line, struct request *req)
+{
+	char *argv[4], *saveptr = NULL, *tok;
+	int argc = 0;
+
+	memset(req, 0, sizeof(*req));
+	req->keyfd = -1;
+
+	for (tok = strtok_r(line, " \t", &saveptr); tok; tok = strtok_r(NULL, " \t", &saveptr)) {
+		if (argc == 4)
+			return -EINVAL;
+		argv[argc++] = tok;
+	}
+
+	if (argc == 3 || argc == 4) {
+		if (strcmp(argv[0], "open"))
+			return -EINVAL;
+		req->type = REQ_OPEN;
+		req->device = argv[1];
+		req->name = argv[2];
+		if (argc == 4 && strcmp(argv[3], "keyfd"))
+			return -EINVAL;
+		req->has_key = argc == 4;
+	} else if (argc == 2 && !strcmp(argv[0], "close")) {
+		req->type = REQ_CLOSE;
+		req->name = argv[1];
+	} else if (argc == 2 && !strcmp(argv[0], "status")) {
+		req->type = REQ_STATUS;
+		req->name = argv[1];
+	} else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int ms_left(const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? (int)ms : 0;
+}
+
+/*
+ * Key is read from the descriptor passed by the client, never reopened by path.
+ * The descriptor may be a pipe the client never writes to, so it is read
+ * without blocking within the client deadline.
+ */
+static int read_key_fd(int fd, const struct timespec *deadline, char **key, size_t *key_size)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char *buf = NULL, *tmp;
+	size_t size = 0, alloc = 0;
+	ssize_t r;
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || ((flags & O_ACCMODE) != O_RDONLY && (flags & O_ACCMODE) != O_RDWR))
+		return -EBADF;
+
+	if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -EBADF;
+
+	do {
+		if (size == alloc) {
+			if (alloc == MAX_KEY_SIZE) {
+				crypt_safe_free(buf);
+				return -EINVAL;
+			}
+			alloc = alloc ? alloc * 2 : 4096;
+			if (alloc > MAX_KEY_SIZE)
+				alloc = MAX_KEY_SIZE;
+			tmp = crypt_safe_realloc(buf, alloc);
+			if (!tmp) {
+				crypt_safe_free(buf);
+				return -ENOMEM;
+			}
+			buf = tmp;
+		}
+		r = read(fd, buf + size, alloc - size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN) {
+			r = poll(&pfd, 1, ms_left(deadline));
+			if (r < 0 && errno == EINTR && !quit)
+				continue;
+			if (r <= 0) {
+				crypt_safe_free(buf);
+				return -ETIMEDOUT;
+			}
+			continue;
+		}
+		if (r < 0) {
+			crypt_safe_free(buf);
+			return -EIO;
+		}
+		size += r;
+	} while (r);
+
+	if (!size) {
+		crypt_safe_free(buf);
+		return -EINVAL;
+	}
+
+	*key = buf;
+	*key_size = size;
+	return 0;
+}
+
+/* Load header and read the passphrase, activation is done later in batch. */
+static int open_prepare(struct request *req)
+{
+	int r;
+
+	r = crypt_init(&req->cd, req->device);
+	if (r < 0)
+		return r;
+
+	r = crypt_load(req->cd, CRYPT_LUKS, NULL);
+	if (r < 0)
+		return r;
+
+	if (!req->has_key)
+		return 0;
+
+	return read_key_fd(req->keyfd, req->deadline, &req->passphrase, &req->passphrase_size);
+}
+
+static struct owned_mapping *owned_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < owned_count; i++)
+		if (!strcmp(owned[i].name, name))
+			return &owned[i];
+
+	return NULL;
+}
+
+static void owned_add(const char *name, uid_t uid)
+{
+	struct owned_mapping *o;
+
+	if (!uid)
+		return;
+
+	/* mapping may have been removed outside of the daemon meanwhile */
+	o = owned_find(name);
+	if (o) {
+		o->uid = uid;
+		return;
+	}
+
+	o = realloc(owned, (owned_count + 1) * sizeof(*owned));
+	if (!o)
+		return;
+	owned = o;
+
+	owned[owned_count].name = strdup(name);
+	if (owned[owned_count].name)
+		owned[owned_count++].uid = uid;
+}
+
+static void owned_remove(const char *name)
+{
+	struct owned_mapping *o = owned_find(name);
+
+	if (!o)
+		return;
+
+	free(o->name);
+	*o = owned[--owned_count];
+}
+
+static void open_batch(struct request *reqs, int count)
+{
+	struct crypt_activate_batch_entry entries[MAX_REQUESTS];
+	struct request *batch[MAX_REQUESTS];
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		reqs[i].r = open_prepare(&reqs[i]);
+		if (reqs[i].r < 0)
+			continue;
+
+		/*
+		 * Token unlock uses secrets available to root (keyring, token
+		 * plugins), it is never done on behalf of other users.
+		 */
+		if (!reqs[i].has_key && reqs[i].uid) {
+			reqs[i].r = -EPERM;
+			continue;
+		}
+
+		/* token unlock runs token handlers, it cannot be batched */
+		if (!reqs[i].has_key) {
+			reqs[i].r = crypt_activate_by_token(reqs[i].cd, reqs[i].name,
+							    CRYPT_ANY_TOKEN, NULL, 0);
+			if (reqs[i].r >= 0)
+				owned_add(reqs[i].name, reqs[i].uid);
+			continue;
+		}
+
+		entries[n] = (struct crypt_activate_batch_entry) {
+			.cd = reqs[i].cd,
+			.name = reqs[i].name,
+			.keyslot = CRYPT_ANY_SLOT,
+			.passphrase = reqs[i].passphrase,
+			.passphrase_size = reqs[i].passphrase_size,
+		};
+		batch[n++] = &reqs[i];
+	}
+
+	if (!n)
+		return;
+
+	(void) crypt_activate_batch(entries, n);
+	for (i = 0; i < n; i++) {
+		batch[i]->r = entries[i].result;
+		if (batch[i]->r >= 0)
+			owned_add(batch[i]->name, batch[i]->uid);
+	}
+}
+
+static void process_close(struct request *req)
+{
+	struct owned_mapping *o = owned_find(req->name);
+
+	if (req->uid && (!o || o->uid != req->uid)) {
+		req->r = -EPERM;
+		return;
+	}
+
+	req->r = crypt_init_by_name(&req->cd, req->name);
+	if (!req->r)
+		req->r = crypt_deactivate(req->cd, req->name);
+	if (!req->r)
+		owned_remove(req->name);
+}
+
+static void process_status(struct request *req)
+{
+	switch (crypt_status(NULL, req->name)) {
+	case CRYPT_INACTIVE:
+		req->info = "inactive";
+		break;
+	case CRYPT_ACTIVE:
+		req->info = "active";
+		break;
+	case CRYPT_BUSY:
+		req->info = "busy";
+		break;
+	default:
+		req->r = -EINVAL;
+	}
+}
+
+/* Requests are processed in order, only consecutive opens are joined to one batch. */
+static void process_requests(struct request *reqs, int count)
+{
+	int i, first_open = -1;
+
+	for (i = 0; i <= count; i++) {
+		if (i < count && reqs[i].r < 0)
+			continue;
+		if (i < count && reqs[i].type == REQ_OPEN) {
+			if (first_open < 0)
+				first_open = i;
+			continue;
+		}
+		if (first_open >= 0) {
+			open_batch(&reqs[first_open], i - first_open);
+			first_open = -1;
+		}
+		if (i == count)
+			break;
+		if (reqs[i].type == REQ_CLOSE)
+			process_close(&reqs[i]);
+		else
+			process_status(&reqs[i]);
+	}
+}
+
+static int write_reply(int fd, const char *msg)
+{
+	size_t len = strlen(msg);
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, msg, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -EIO;
+		msg += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static bool peer_allowed(int fd, uid_t *uid)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return false;
+
+	log_verbose(_("Connection from pid %d, uid %d."), (int)cred.pid, (int)cred.uid);
+
+	*uid = cred.uid;
+	return cred.uid == 0 || (opt_allow_uid >= 0 && cred.uid == (uid_t)opt_allow_uid);
+}
+
+/*
+ * Read the whole batch (until the client shuts down its side) within the client
+ * deadline, collecting key descriptors passed along with the data.
+ */
+static int read_request(int fd, const struct timespec *deadline, char *buf, size_t *size,
+			int *fds, int *nfds)
+{
+	char control[CMSG_SPACE(sizeof(int) * 16)];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t r;
+	int i, n;
+
+	*size = 0;
+	*nfds = 0;
+	while (*size < MAX_REQUEST_SIZE) {
+		r = poll(&pfd, 1, ms_left(deadline));
+		if (r < 0 && errno == EINTR && !quit)
+			continue;
+		if (r <= 0)
+			return -ETIMEDOUT;
+
+		iov = (struct iovec) { .iov_base = buf + *size, .iov_len = MAX_REQUEST_SIZE - *size };
+		msg = (struct msghdr) { .msg_iov = &iov, .msg_iovlen = 1,
+					.msg_control = control, .msg_controllen = sizeof(control) };
+
+		r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN) && !quit)
+			continue;
+		if (r < 0)
+			return -EIO;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (i = 0; i < n; i++) {
+				if (*nfds < MAX_REQUESTS)
+					memcpy(&fds[(*nfds)++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				else {
+					memcpy(&n, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+					close(n);
+					return -EINVAL;
+				}
+			}
+		}
+
+		if (msg.msg_flags & MSG_CTRUNC)
+			return -EINVAL;
+		if (!r)
+			break;
+		*size += r;
+	}
+	buf[*size] = '\0';
+
+	return 0;
+}
+
+static void handle_client(int fd)
+{
+	struct request *reqs = NULL;
+	struct timeval tv = { .tv_sec = CLIENT_TIMEOUT_SEC };
+	struct timespec deadline;
+	char *buf = NULL, *line, *next, reply[256];
+	int fds[MAX_REQUESTS];
+	size_t size = 0;
+	uid_t uid;
+	int i, count = 0, nfds = 0, key = 0;
+
+	if (!peer_allowed(fd, &uid)) {
+		(void) write_reply(fd, "ERR -1 Operation not permitted\n");
+		return;
+	}
+
+	(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* request and key descriptors must arrive within one deadline */
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += CLIENT_TIMEOUT_SEC;
+
+	buf = malloc(MAX_REQUEST_SIZE + 1);
+	reqs = calloc(MAX_REQUESTS, sizeof(*reqs));
+	if (!buf || !reqs)
+		goto out;
+
+	if (read_request(fd, &deadline, buf, &size, fds, &nfds) < 0) {
+		log_err(_("Cannot read client request."));
+		goto out;
+	}
+
+	for (line = buf; line && *line && count < MAX_REQUESTS; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (!*line)
+			continue;
+		if (parse_request(line, &reqs[count]) < 0)
+			reqs[count].r = -EINVAL;
+		else if (reqs[count].has_key && key < nfds)
+			reqs[count].keyfd = fds[key++];
+		else if (reqs[count].has_key)
+			reqs[count].r = -EBADF;
+		reqs[count].uid = uid;
+		reqs[count].deadline = &deadline;
+		count++;
+	}
+
+	process_requests(reqs, count);
+
+	for (i = 0; i < count; i++) {
+		if (reqs[i].r < 0)
+			snprintf(reply, sizeof(reply), "ERR %d %s\n", reqs[i].r, strerror(-reqs[i].r));
+		else
+			snprintf(reply, sizeof(reply), "OK%s%s\n", reqs[i].info ? " " : "", reqs[i].info ?: "");
+		if (write_reply(fd, reply) < 0)
+			break;
+	}
+out:
+	for (i = 0; reqs && i < count; i++) {
+		crypt_safe_free(reqs[i].passphrase);
+		crypt_free(reqs[i].cd);
+	}
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	free(reqs);
+	free(buf);
+}
+
+static int socket_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct group *gr = NULL;
+	int fd;
+
+	if (opt_socket_group) {
+		gr = getgrnam(opt_socket_group);
+		if (!gr) {
+			log_err(_("Unknown group %s."), opt_socket_group);
+			return -EINVAL;
+		}
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_err(_("Socket path %s is too long."), path);
+		return -EINVAL;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	(void) unlink(path);
+	/* only the socket group can connect, peer credentials are checked as well */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    (gr && chown(path, (uid_t)-1, gr->gr_gid) < 0) ||
+	    chmod(path, gr ? 0660 : 0600) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		log_err(_("Cannot listen on socket %s."), path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	return fd;
+}
+
+/* Query device-mapper once, capabilities are then cached for the daemon lifetime. */
+static void warm_up(void)
+{
+	struct crypt_active_device_summary *devs;
+	size_t count;
+
+	if (!crypt_active_devices_list(&devs, &count))
+		crypt_active_devices_free(devs, count);
+}
+
+int main(int argc, const char **argv)
+{
+	static struct poptOption popt_options[] = {
+		POPT_AUTOHELP
+		{ "socket",    '\0', POPT_ARG_STRING, &opt_socket,    0, N_("Path to the listening Unix socket"), N_("path") },
+		{ "allow-uid", '\0', POPT_ARG_INT,    &opt_allow_uid, 0, N_("Accept requests also from this user (besides root)"), N_("uid") },
+		{ "socket-group", '\0', POPT_ARG_STRING, &opt_socket_group, 0, N_("Group allowed to connect to the socket"), N_("group") },
+		{ "verbose",   'v',  POPT_ARG_NONE,   &opt_verbose,   0, N_("Shows more detailed error messages"), NULL },
+		{ "debug",     '\0', POPT_ARG_NONE,   &opt_debug,     0, N_("Show debug messages"), NULL },
+		{ "version",   'V',  POPT_ARG_NONE,   &opt_version,   0, N_("Print package version"), NULL },
+		POPT_TABLEEND
+	};
+	struct sigaction sa = { .sa_handler = int_handler };
+	struct pollfd pfd;
+	poptContext popt_context;
+	int fd, client, r;
+
+	setlocale(LC_ALL, "");
+	bindtextdomain(PACKAGE, LOCALEDIR);
+	textdomain(PACKAGE);
+
+	popt_context = poptGetContext("cryptsetup-daemon", argc, argv, popt_options, 0);
+	while ((r = poptGetNextOpt(popt_context)) > 0) {}
+	if (r < -1 || poptGetArg(popt_context)) {
+		fprintf(stderr, "%s: %s\n", poptBadOption(popt_context, POPT_BADOPTION_NOALIAS),
+			r < -1 ? poptStrerror(r) : _("Unknown argument."));
+		poptFreeContext(popt_context);
+		return EXIT_FAILURE;
+	}
+
+	if (opt_version) {
+		printf("cryptsetup-daemon %s\n", PACKAGE_VERSION);
+		poptFreeContext(popt_context);
+		return EXIT_SUCCESS;
+	}
+
+	if (opt_allow_uid >= 0 && !opt_socket_group) {
+		fprintf(stderr, _("Option --allow-uid requires --socket-group.\n"));
+		poptFreeContext(popt_context);
+		return EXIT_FAILURE;
+	}
+
+	crypt_set_log_callback(NULL, daemon_log, NULL);
+	if (opt_debug)
+		crypt_set_debug_level(CRYPT_DEBUG_ALL);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = socket_listen(opt_socket);
+	if (fd < 0) {
+		poptFreeContext(popt_context);
+		return EXIT_FAILURE;
+	}
+
+	warm_up();
+	log_verbose(_("Listening on %s."), opt_socket);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!quit) {
+		if (poll(&pfd, 1, -1) < 0)
+			continue;
+
+		client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0)
+			continue;
+
+		handle_client(client);
+		close(client);
+	}
+
+	close(fd);
+	(void) unlink(opt_socket);
+	while (owned_count)
+		owned_remove(owned[0].name);
+	free(owned);
+	poptFreeContext(popt_context);
+	return EXIT_SUCCESS;
+}
@@ -20,6 +20,9 @@
  */
 
 #include <uuid/uuid.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+# include <sys/sysmacros.h>     /* for major, minor */
+#endif
 
 #define DEFAULT_ALG_NAME "crc32c"
 
@@ -76,18 +79,61 @@ static int _read_keys(char **integrity_key, struct crypt_params_integrity *param
 	return 0;
 }
 
-static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
+static int _temporary_name(char *name, size_t size)
 {
-	char tmp_name[64], tmp_path[128], tmp_uuid[40];
+	char tmp_uuid[40];
 	uuid_t tmp_uuid_bin;
+
+	uuid_generate(tmp_uuid_bin);
+	uuid_unparse(tmp_uuid_bin, tmp_uuid);
+
+	return snprintf(name, size, "temporary-cryptsetup-%s", tmp_uuid);
+}
+
+/*
+ * Lazy initialization, no data are written. The first activation with recalculate
+ * flag marks the superblock, kernel then recalculates tags in the background
+ * after every activation until the whole device is done.
+ */
+static int _recalculate_data_device(struct crypt_device *cd, const char *integrity_key)
+{
+	char tmp_name[64];
+	int r;
+
+	if (_temporary_name(tmp_name, sizeof(tmp_name)) < 0)
+		return -EINVAL;
+
+	r = crypt_activate_by_volume_key(cd, tmp_name, integrity_key,
+		ARG_UINT32(OPT_INTEGRITY_KEY_SIZE_ID), CRYPT_ACTIVATE_PRIVATE | CRYPT_ACTIVATE_RECALCULATE);
+	if (r < 0)
+		return r;
+
+	if (crypt_deactivate(cd, tmp_name)) {
+		log_err(_("Cannot deactivate temporary device %s/%s."), crypt_get_dir(), tmp_name);
+		return -EINVAL;
+	}
+
+	if (!ARG_SET(OPT_BATCH_MODE_ID))
+		log_std(_("Integrity tags will be recalculated in the background after activation.\n"));
+
+	return 0;
+}
+
+static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
+{
+	char tmp_name[64], tmp_path[128];
 	int r = -EINVAL;
 	char *backing_file = NULL;
+	uint64_t offset = 0;
+	struct crypt_active_device cad;
 	struct tools_progress_params prog_parms = {
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
 		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
 		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
 		.interrupt_message = _("\nWipe interrupted."),
-		.device = tools_get_device_name(crypt_get_device_name(cd), &backing_file)
+		.device = tools_get_device_name(crypt_get_device_name(cd), &backing_file),
+		.checkpoint = ARG_STR(OPT_CHECKPOINT_ID),
+		.checkpoint_device = tmp_path
 	};
 
 	if (!ARG_SET(OPT_BATCH_MODE_ID))
@@ -96,9 +142,7 @@ static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
 			"(rest of not wiped device will contain invalid checksum).\n"));
 
 	/* Activate the device a temporary one */
-	uuid_generate(tmp_uuid_bin);
-	uuid_unparse(tmp_uuid_bin, tmp_uuid);
-	if (snprintf(tmp_name, sizeof(tmp_name), "temporary-cryptsetup-%s", tmp_uuid) < 0)
+	if (_temporary_name(tmp_name, sizeof(tmp_name)) < 0)
 		goto out;
 	if (snprintf(tmp_path, sizeof(tmp_path), "%s/%s", crypt_get_dir(), tmp_name) < 0)
 		goto out;
@@ -108,14 +152,31 @@ static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
 	if (r < 0)
 		goto out;
 
+	/* Resume from the last recorded checkpoint, the format must be the same */
+	if (prog_parms.checkpoint) {
+		r = crypt_get_active_device(cd, tmp_name, &cad);
+		if (!r)
+			r = tools_checkpoint_load(prog_parms.checkpoint, cad.size << SECTOR_SHIFT, &offset);
+		if (r < 0) {
+			(void)crypt_deactivate(cd, tmp_name);
+			goto out;
+		}
+		if (offset)
+			log_std(_("Resuming wipe at offset %" PRIu64 ".\n"), offset);
+		prog_parms.checkpoint_offset = offset;
+	}
+
 	/* Wipe the device */
 	set_int_handler(0);
-	r = crypt_wipe(cd, tmp_path, CRYPT_WIPE_ZERO, 0, 0, DEFAULT_WIPE_BLOCK,
+	r = crypt_wipe(cd, tmp_path, CRYPT_WIPE_ZERO, offset, 0, DEFAULT_WIPE_BLOCK,
 		       0, &tools_progress, &prog_parms);
 	if (crypt_deactivate(cd, tmp_name))
 		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
 	set_int_block(0);
 
+	if (!r)
+		tools_checkpoint_remove(prog_parms.checkpoint);
+
 out:
 	free(backing_file);
 	return r;
@@ -173,7 +234,8 @@ static int action_format(void)
 		goto out;
 
 	if (!ARG_SET(OPT_BATCH_MODE_ID)) {
-		if (ARG_SET(OPT_DATA_DEVICE_ID) && !ARG_SET(OPT_NO_WIPE_ID))
+		if (ARG_SET(OPT_DATA_DEVICE_ID) && !ARG_SET(OPT_NO_WIPE_ID) &&
+		    !ARG_SET(OPT_INTEGRITY_RECALCULATE_ID))
 			r = asprintf(&msg, _("This will overwrite data on %s and %s irrevocably.\n"
 			"To preserve data device use --no-wipe option (and then activate with --integrity-recalculate)."),
 			action_argv[0], ARG_STR(OPT_DATA_DEVICE_ID));
@@ -212,7 +274,9 @@ static int action_format(void)
 		log_std(_("Formatted with tag size %u, internal integrity %s.\n"),
 			params2.tag_size, params2.integrity);
 
-	if (!ARG_SET(OPT_NO_WIPE_ID))
+	if (ARG_SET(OPT_INTEGRITY_RECALCULATE_ID))
+		r = _recalculate_data_device(cd, integrity_key);
+	else if (!ARG_SET(OPT_NO_WIPE_ID))
 		r = _wipe_data_device(cd, integrity_key);
 out:
 	crypt_safe_free(integrity_key);
@@ -296,6 +360,294 @@ out:
 	return r;
 }
 
+/*
+ * Restart tags recalculation of an active device (table reload with recalculate
+ * flag), kernel continues in the background. Without batch mode the progress
+ * is polled from dm status until the recalculation finishes or is interrupted.
+ */
+static int action_recalculate(void)
+{
+	struct crypt_device *cd = NULL;
+	uint64_t recalc, provided;
+	uint32_t activate_flags = CRYPT_ACTIVATE_REFRESH | CRYPT_ACTIVATE_RECALCULATE;
+	char *backing_file = NULL;
+	bool polled = false;
+	struct tools_progress_params prog_parms = {
+		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
+		.interrupt_message = _("\nRecalculation continues in the background."),
+	};
+	int r;
+
+	if (ARG_SET(OPT_INTEGRITY_RECALCULATE_RESET_ID))
+		activate_flags |= CRYPT_ACTIVATE_RECALCULATE_RESET;
+
+	r = crypt_init_by_name_and_header(&cd, action_argv[0], NULL);
+	if (r)
+		goto out;
+
+	if (ARG_SET(OPT_INTEGRITY_LEGACY_RECALC_ID))
+		crypt_set_compatibility(cd, CRYPT_COMPAT_LEGACY_INTEGRITY_RECALC);
+
+	r = crypt_activate_by_volume_key(cd, action_argv[0], NULL, 0, activate_flags);
+	if (r == -ENOTSUP)
+		log_err(_("Setting recalculate flag is not supported."));
+	if (r || (ARG_SET(OPT_BATCH_MODE_ID) && !ARG_SET(OPT_PROGRESS_JSON_ID)))
+		goto out;
+
+	prog_parms.device = tools_get_device_name(crypt_get_device_name(cd), &backing_file);
+
+	set_int_handler(0);
+	while ((r = crypt_get_active_integrity_recalculation(cd, action_argv[0], &recalc, &provided)) > 0) {
+		polled = true;
+		if (tools_progress(provided * SECTOR_SIZE, recalc * SECTOR_SIZE, &prog_parms)) {
+			polled = false;
+			r = 0;
+			break;
+		}
+		sleep(1);
+	}
+	if (!r && polled)
+		tools_progress(provided * SECTOR_SIZE, provided * SECTOR_SIZE, &prog_parms);
+	set_int_block(0);
+out:
+	free(backing_file);
+	crypt_free(cd);
+	return r;
+}
+
+/*
+ * Benchmark of activation parameters. The device is formatted once, then
+ * each candidate mode is activated and the same synthetic workload replayed.
+ * Write amplification is taken from sysfs write counters of backing devices.
+ */
+#define BENCH_REGION		(256 * 1024 * 1024)
+#define BENCH_SEQ_BLOCK		(1024 * 1024)
+#define BENCH_SEQ_BYTES		(64 * 1024 * 1024)
+#define BENCH_RAND_BLOCK	4096
+#define BENCH_RAND_BYTES	(16 * 1024 * 1024)
+
+static const struct bench_candidate {
+	const char *mode;
+	uint32_t flags;
+	uint32_t sectors_per_bit;
+} bench_candidates[] = {
+	{ "journal", 0, 0 },
+	{ "bitmap", CRYPT_ACTIVATE_NO_JOURNAL | CRYPT_ACTIVATE_NO_JOURNAL_BITMAP, 0 },
+	{ "bitmap", CRYPT_ACTIVATE_NO_JOURNAL | CRYPT_ACTIVATE_NO_JOURNAL_BITMAP, 262144 },
+	{ "direct", CRYPT_ACTIVATE_NO_JOURNAL, 0 },
+	{}
+};
+
+/* sectors written to a block device so far, 0 if not available */
+static uint64_t bench_sectors_written(const char *device)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t sectors = 0;
+	FILE *f;
+
+	if (!device || stat(device, &st) < 0 || !S_ISBLK(st.st_mode) ||
+	    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/stat",
+		     major(st.st_rdev), minor(st.st_rdev)) < 0)
+		return 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%*u %*u %*u %*u %*u %*u %" SCNu64, &sectors) != 1)
+		sectors = 0;
+	fclose(f);
+
+	return sectors;
+}
+
+static int bench_write(const char *path, uint64_t region, size_t block,
+		       uint64_t total, bool random, double *secs)
+{
+	struct timespec start, end;
+	uint64_t i, blocks = region / block, seed = 0x2545f4914f6cdd1dULL, offset;
+	void *buf = NULL;
+	int fd, r = 0;
+
+	if (!blocks)
+		return -EINVAL;
+
+	fd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (posix_memalign(&buf, BENCH_RAND_BLOCK, block)) {
+		close(fd);
+		return -ENOMEM;
+	}
+	memset(buf, 0x5a, block);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; !r && i < total / block; i++) {
+		if (random) {
+			/* xorshift, the same sequence for all candidates */
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			offset = (seed % blocks) * block;
+		} else
+			offset = (i % blocks) * block;
+
+		if (pwrite(fd, buf, block, offset) != (ssize_t)block)
+			r = -EIO;
+		else
+			check_signal(&r);
+	}
+	if (!r && fdatasync(fd))
+		r = -EIO;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1E9;
+	free(buf);
+	close(fd);
+	return r;
+}
+
+static int bench_candidate_run(const struct bench_candidate *bc,
+			       struct crypt_params_integrity *params,
+			       const char *integrity_key)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_active_device cad;
+	char tmp_name[64], tmp_path[128], desc[32];
+	uint64_t region, written_start, written;
+	double seq_secs = 0, rand_secs = 0;
+	int r;
+
+	if (bc->flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP) {
+		params->journal_watermark = bc->sectors_per_bit ?: ARG_UINT32(OPT_BITMAP_SECTORS_PER_BIT_ID);
+		params->journal_commit_time = ARG_UINT32(OPT_BITMAP_FLUSH_TIME_ID);
+		if (params->journal_watermark)
+			snprintf(desc, sizeof(desc), "sectors/bit %u", params->journal_watermark);
+		else
+			snprintf(desc, sizeof(desc), "default");
+	} else {
+		params->journal_watermark = ARG_UINT32(OPT_JOURNAL_WATERMARK_ID);
+		params->journal_commit_time = ARG_UINT32(OPT_JOURNAL_COMMIT_TIME_ID);
+		if (!(bc->flags & CRYPT_ACTIVATE_NO_JOURNAL) && params->journal_watermark)
+			snprintf(desc, sizeof(desc), "watermark %u%%", params->journal_watermark);
+		else
+			snprintf(desc, sizeof(desc), "default");
+	}
+
+	if (_temporary_name(tmp_name, sizeof(tmp_name)) < 0 ||
+	    snprintf(tmp_path, sizeof(tmp_path), "%s/%s", crypt_get_dir(), tmp_name) < 0)
+		return -EINVAL;
+
+	r = crypt_init_data_device(&cd, action_argv[0], ARG_STR(OPT_DATA_DEVICE_ID));
+	if (r)
+		return r;
+
+	r = crypt_load(cd, CRYPT_INTEGRITY, params);
+	if (r)
+		goto out;
+
+	written_start = bench_sectors_written(action_argv[0]) +
+			bench_sectors_written(ARG_STR(OPT_DATA_DEVICE_ID));
+
+	r = crypt_activate_by_volume_key(cd, tmp_name, integrity_key,
+		ARG_UINT32(OPT_INTEGRITY_KEY_SIZE_ID), CRYPT_ACTIVATE_PRIVATE | bc->flags);
+	if (r < 0)
+		goto out;
+
+	r = crypt_get_active_device(cd, tmp_name, &cad);
+	if (!r) {
+		region = cad.size * SECTOR_SIZE;
+		if (region > BENCH_REGION)
+			region = BENCH_REGION;
+		r = bench_write(tmp_path, region, BENCH_SEQ_BLOCK, BENCH_SEQ_BYTES, false, &seq_secs);
+		if (!r)
+			r = bench_write(tmp_path, region, BENCH_RAND_BLOCK, BENCH_RAND_BYTES, true, &rand_secs);
+	}
+
+	/* deactivation flushes journal or bitmap, count it in */
+	if (crypt_deactivate(cd, tmp_name))
+		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
+	if (r)
+		goto out;
+
+	written = bench_sectors_written(action_argv[0]) +
+		  bench_sectors_written(ARG_STR(OPT_DATA_DEVICE_ID)) - written_start;
+
+	log_std("%-8s %-20s %10.1f %10.1f ", bc->mode, desc,
+		seq_secs > 0 ? BENCH_SEQ_BYTES / seq_secs / (1024 * 1024) : 0,
+		rand_secs > 0 ? BENCH_RAND_BYTES / rand_secs / (1024 * 1024) : 0);
+	if (written_start && written)
+		log_std("%10.2f\n", (double)written * SECTOR_SIZE / (BENCH_SEQ_BYTES + BENCH_RAND_BYTES));
+	else
+		log_std("%10s\n", "N/A");
+out:
+	crypt_free(cd);
+	return r;
+}
+
+static int action_benchmark(void)
+{
+	const struct bench_candidate *bc;
+	struct crypt_device *cd = NULL;
+	struct crypt_params_integrity params = {
+		.journal_size = ARG_UINT64(OPT_JOURNAL_SIZE_ID),
+		.interleave_sectors = ARG_UINT32(OPT_INTERLEAVE_SECTORS_ID),
+		.buffer_sectors = ARG_UINT32(OPT_BUFFER_SECTORS_ID),
+		.tag_size = ARG_UINT32(OPT_TAG_SIZE_ID),
+		.sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID),
+	};
+	char integrity[MAX_CIPHER_LEN], *integrity_key = NULL, *msg = NULL;
+	int r;
+
+	r = crypt_parse_hash_integrity_mode(ARG_STR(OPT_INTEGRITY_ID), integrity);
+	if (r < 0) {
+		log_err(_("No known integrity specification pattern detected."));
+		return r;
+	}
+	params.integrity = integrity;
+
+	r = _read_keys(&integrity_key, &params);
+	if (r)
+		goto out;
+
+	if (!ARG_SET(OPT_BATCH_MODE_ID)) {
+		if (asprintf(&msg, _("This will overwrite data on %s irrevocably."), action_argv[0]) == -1) {
+			r = -ENOMEM;
+			goto out;
+		}
+		r = yesDialog(msg, _("Operation aborted.\n")) ? 0 : -EINVAL;
+		free(msg);
+		if (r < 0)
+			goto out;
+	}
+
+	r = crypt_init_data_device(&cd, action_argv[0], ARG_STR(OPT_DATA_DEVICE_ID));
+	if (r < 0)
+		goto out;
+
+	/* data are not wiped, the workload only writes */
+	r = crypt_format(cd, CRYPT_INTEGRITY, NULL, NULL, NULL, NULL, 0, &params);
+	crypt_free(cd);
+	if (r < 0)
+		goto out;
+
+	log_std(_("# Synthetic workload: %u MiB sequential %u KiB writes, %u MiB random %u KiB writes.\n"),
+		BENCH_SEQ_BYTES / (1024 * 1024), BENCH_SEQ_BLOCK / 1024,
+		BENCH_RAND_BYTES / (1024 * 1024), BENCH_RAND_BLOCK / 1024);
+	log_std(_("# mode   parameters            seq MiB/s rand MiB/s  write amp\n"));
+
+	set_int_handler(0);
+	for (bc = bench_candidates; bc->mode && !r; bc++)
+		r = bench_candidate_run(bc, &params, integrity_key);
+	set_int_block(0);
+out:
+	crypt_safe_free(integrity_key);
+	return r;
+}
+
 static int action_open(void)
 {
 	struct crypt_device *cd = NULL;
@@ -405,6 +757,77 @@ static int action_close(void)
 	return r;
 }
 
+/*
+ * Only dm list, table and status queries, no superblock is read. Standalone
+ * and LUKS2 integrity subdevices are reported (all dm-integrity targets).
+ */
+static int action_status_all(void)
+{
+	struct crypt_active_device_summary *devs, *d;
+	struct crypt_device *cd;
+	struct crypt_params_integrity ip;
+	uint64_t failures, recalc = 0, provided = 0;
+	size_t i, count, n = 0;
+	int r, recalculating;
+
+	r = crypt_active_devices_list(&devs, &count);
+	if (r < 0)
+		return r;
+
+	if (ARG_SET(OPT_JSON_ID))
+		log_std("[");
+
+	for (i = 0; i < count; i++) {
+		d = &devs[i];
+		if (!d->target || strcmp(d->target, "integrity"))
+			continue;
+
+		memset(&ip, 0, sizeof(ip));
+		cd = NULL;
+		if (!crypt_init_by_name(&cd, d->name))
+			(void)crypt_get_integrity_info(cd, &ip);
+		failures = crypt_get_active_integrity_failures(cd, d->name);
+		recalculating = crypt_get_active_integrity_recalculation(cd, d->name, &recalc, &provided) > 0;
+
+		if (!ARG_SET(OPT_JSON_ID)) {
+			log_std("%s/%s: type %s, integrity %s, tag size %u, size %" PRIu64 " sectors, %s, failures %" PRIu64,
+				crypt_get_dir(), d->name, d->type, ip.integrity ?: "n/a", ip.tag_size, d->size,
+				d->flags & CRYPT_ACTIVATE_READONLY ? "readonly" : "read/write", failures);
+			if (recalculating)
+				log_std(", recalculating %" PRIu64 "%%", provided ? recalc * 100 / provided : 0);
+			log_std("\n");
+		} else {
+			log_std("%s\n  {\"name\":", n ? "," : "");
+			tools_json_print_string(d->name);
+			log_std(",\"type\":");
+			tools_json_print_string(d->type);
+			log_std(",\"integrity\":");
+			if (ip.integrity)
+				tools_json_print_string(ip.integrity);
+			else
+				log_std("null");
+			log_std(",\"tag_size\":%u,\"size\":%" PRIu64 ",\"major\":%" PRIu32
+				",\"minor\":%" PRIu32 ",\"open_count\":%" PRId32 ",\"readonly\":%s"
+				",\"failures\":%" PRIu64 ",\"recalculating\":%s",
+				ip.tag_size, d->size, d->major, d->minor, d->open_count,
+				d->flags & CRYPT_ACTIVATE_READONLY ? "true" : "false",
+				failures, recalculating ? "true" : "false");
+			if (recalculating)
+				log_std(",\"recalculate_sector\":%" PRIu64 ",\"provided_sectors\":%" PRIu64,
+					recalc, provided);
+			log_std("}");
+		}
+		n++;
+		crypt_free(cd);
+	}
+
+	if (ARG_SET(OPT_JSON_ID))
+		log_std("%s]\n", n ? "\n" : "");
+
+	crypt_active_devices_free(devs, count);
+	return 0;
+}
+
 static int action_status(void)
 {
 	crypt_status_info ci;
@@ -413,8 +836,12 @@ static int action_status(void)
 	struct crypt_device *cd = NULL;
 	char *backing_file;
 	const char *device, *metadata_device;
+	uint64_t recalc, provided;
 	int path = 0, r = 0;
 
+	if (ARG_SET(OPT_ALL_ID))
+		return action_status_all();
+
 	/* perhaps a path, not a dm device name */
 	if (strchr(action_argv[0], '/'))
 		path = 1;
@@ -479,6 +906,9 @@ static int action_status(void)
 			cad.flags & CRYPT_ACTIVATE_RECOVERY ? " recovery" : "");
 		log_std("  failures: %" PRIu64 "\n",
 			crypt_get_active_integrity_failures(cd, action_argv[0]));
+		if (crypt_get_active_integrity_recalculation(cd, action_argv[0], &recalc, &provided) > 0)
+			log_std("  recalculating: %" PRIu64 "%% (%" PRIu64 " of %" PRIu64 " sectors)\n",
+				provided ? recalc * 100 / provided : 0, recalc, provided);
 		if (cad.flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP) {
 			log_std("  bitmap 512-byte sectors per bit: %u\n", ip.journal_watermark);
 			log_std("  bitmap flush interval: %u ms\n", ip.journal_commit_time);
@@ -537,6 +967,8 @@ static struct action_type {
 	{ STATUS_ACTION,action_status, 1, N_("<name>"),N_("show active device status") },
 	{ DUMP_ACTION,	action_dump,   1, N_("<integrity_device>"),N_("show on-disk information") },
 	{ RESIZE_ACTION,action_resize, 1, N_("<name>"), N_("resize active device") },
+	{ RECALCULATE_ACTION,action_recalculate, 1, N_("<name>"), N_("recalculate integrity tags of active device") },
+	{ BENCHMARK_ACTION,action_benchmark, 1, N_("<integrity_device>"), N_("benchmark activation modes (destroys data)") },
 	{}
 };
 
@@ -706,7 +1138,15 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, _("Unknown action."),
 		      poptGetInvocationName(popt_context));
 
-	if (action_argc < action->required_action_argc) {
+	if (ARG_SET(OPT_JSON_ID) && !ARG_SET(OPT_ALL_ID))
+		usage(popt_context, EXIT_FAILURE, _("Option --json is allowed only with --all."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_ALL_ID) && action_argc)
+		usage(popt_context, EXIT_FAILURE, _("Command requires either <name> argument or --all option."),
+		      poptGetInvocationName(popt_context));
+
+	if (action_argc < action->required_action_argc && !ARG_SET(OPT_ALL_ID)) {
 		char buf[128];
 		if (snprintf(buf, 128,_("%s: requires %s as arguments"), action->type, action->arg_desc) < 0)
 			buf[0] ='\0';
@@ -31,16 +31,21 @@
 #define STATUS_ACTION	"status"
 #define DUMP_ACTION	"dump"
 #define RESIZE_ACTION	"resize"
+#define RECALCULATE_ACTION "recalculate"
+#define BENCHMARK_ACTION "benchmark"
 
+#define OPT_ALL_ACTIONS				{ STATUS_ACTION }
 #define OPT_ALLOW_DISCARDS_ACTIONS		{ OPEN_ACTION }
 #define OPT_DEFERRED_ACTIONS			{ CLOSE_ACTION }
-#define OPT_INTEGRITY_RECALCULATE_ACTIONS	{ OPEN_ACTION }
-#define OPT_JOURNAL_SIZE_ACTIONS		{ FORMAT_ACTION }
+#define OPT_INTEGRITY_RECALCULATE_ACTIONS	{ OPEN_ACTION, FORMAT_ACTION, RECALCULATE_ACTION }
+#define OPT_JSON_ACTIONS			{ STATUS_ACTION }
+#define OPT_JOURNAL_SIZE_ACTIONS		{ FORMAT_ACTION, BENCHMARK_ACTION }
 #define OPT_NO_WIPE_ACTIONS			{ FORMAT_ACTION }
-#define OPT_INTERLEAVE_SECTORS_ACTIONS		{ FORMAT_ACTION }
-#define OPT_PROGRESS_JSON_ACTIONS		{ FORMAT_ACTION, RESIZE_ACTION }
-#define OPT_SECTOR_SIZE_ACTIONS			{ FORMAT_ACTION }
-#define OPT_TAG_SIZE_ACTIONS			{ FORMAT_ACTION }
+#define OPT_CHECKPOINT_ACTIONS			{ FORMAT_ACTION }
+#define OPT_INTERLEAVE_SECTORS_ACTIONS		{ FORMAT_ACTION, BENCHMARK_ACTION }
+#define OPT_PROGRESS_JSON_ACTIONS		{ FORMAT_ACTION, RESIZE_ACTION, RECALCULATE_ACTION }
+#define OPT_SECTOR_SIZE_ACTIONS			{ FORMAT_ACTION, BENCHMARK_ACTION }
+#define OPT_TAG_SIZE_ACTIONS			{ FORMAT_ACTION, BENCHMARK_ACTION }
 #define OPT_DEVICE_SIZE_ACTIONS			{ RESIZE_ACTION }
 #define OPT_SIZE_ACTIONS			{ RESIZE_ACTION }
 #define OPT_WIPE_ACTIONS			{ RESIZE_ACTION }
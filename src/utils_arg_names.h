@@ -24,18 +24,27 @@
 
 #define OPT_ACTIVE_NAME			"active-name"
 #define OPT_ALIGN_PAYLOAD		"align-payload"
+#define OPT_ALL				"all"
 #define OPT_ALLOW_DISCARDS		"allow-discards"
+#define OPT_BACKUP_ARCHIVE		"backup-archive"
+#define OPT_BATCH_FILE			"batch-file"
 #define OPT_BATCH_MODE			"batch-mode"
 #define OPT_BITMAP_FLUSH_TIME		"bitmap-flush-time"
 #define OPT_BITMAP_SECTORS_PER_BIT	"bitmap-sectors-per-bit"
 #define OPT_BLOCK_SIZE			"block-size"
 #define OPT_BUFFER_SECTORS		"buffer-sectors"
 #define OPT_CANCEL_DEFERRED		"cancel-deferred"
+#define OPT_CHANGED_BLOCKS		"changed-blocks"
+#define OPT_CHECKPOINT			"checkpoint"
 #define OPT_CHECK_AT_MOST_ONCE		"check-at-most-once"
 #define OPT_CIPHER			"cipher"
+#define OPT_COMPARE			"compare"
+#define OPT_COMPARE_THRESHOLD		"compare-threshold"
+#define OPT_CRYPT_SHARDS		"crypt-shards"
 #define OPT_DATA_BLOCK_SIZE		"data-block-size"
 #define OPT_DATA_BLOCKS			"data-blocks"
 #define OPT_DATA_DEVICE			"data-device"
+#define OPT_DATA_INPUT			"data-input"
 #define OPT_DEBUG			"debug"
 #define OPT_DEBUG_JSON			"debug-json"
 #define OPT_DEFERRED			"deferred"
@@ -45,11 +54,14 @@
 #define OPT_DISABLE_KEYRING		"disable-keyring"
 #define OPT_DISABLE_LOCKS		"disable-locks"
 #define OPT_DISABLE_VERACRYPT		"disable-veracrypt"
+#define OPT_DISCARD_UNUSED		"discard-unused"
+#define OPT_DM				"dm"
 #define OPT_DUMP_JSON			"dump-json-metadata"
 #define OPT_DUMP_MASTER_KEY		"dump-master-key"
 #define OPT_DUMP_VOLUME_KEY		"dump-volume-key"
 #define OPT_ENCRYPT			"encrypt"
 #define OPT_FEC_DEVICE			"fec-device"
+#define OPT_FEC_MEMORY			"fec-memory"
 #define OPT_FEC_OFFSET			"fec-offset"
 #define OPT_FEC_ROOTS			"fec-roots"
 #define OPT_FORCE_PASSWORD		"force-password"
@@ -60,10 +72,13 @@
 #define OPT_HASH_OFFSET			"hash-offset"
 #define OPT_HEADER			"header"
 #define OPT_HEADER_BACKUP_FILE		"header-backup-file"
+#define OPT_HOTZONE_BATCH		"hotzone-batch"
+#define OPT_HOTZONE_LATENCY		"hotzone-latency"
 #define OPT_HOTZONE_SIZE		"hotzone-size"
 #define OPT_IGNORE_CORRUPTION		"ignore-corruption"
 #define OPT_IGNORE_ZERO_BLOCKS		"ignore-zero-blocks"
 #define OPT_INIT_ONLY			"init-only"
+#define OPT_INLINE_CRYPT		"inline-crypt"
 #define OPT_INTEGRITY			"integrity"
 #define OPT_INTEGRITY_BITMAP_MODE	"integrity-bitmap-mode"
 #define OPT_INTEGRITY_KEY_FILE		"integrity-key-file"
@@ -77,8 +92,11 @@
 #define OPT_INTEGRITY_RECALCULATE_RESET	"integrity-recalculate-reset"
 #define OPT_INTEGRITY_RECOVERY_MODE	"integrity-recovery-mode"
 #define OPT_INTERLEAVE_SECTORS		"interleave-sectors"
+#define OPT_IO_IDLE			"io-idle"
+#define OPT_IO_STATS			"io-stats"
 #define OPT_ITER_TIME			"iter-time"
 #define OPT_IV_LARGE_SECTORS		"iv-large-sectors"
+#define OPT_JSON			"json"
 #define OPT_JSON_FILE			"json-file"
 #define OPT_JOURNAL_COMMIT_TIME		"journal-commit-time"
 #define OPT_JOURNAL_CRYPT		"journal-crypt"
@@ -97,6 +115,7 @@
 #define OPT_KEYFILE_OFFSET		"keyfile-offset"
 #define OPT_KEYFILE_SIZE		"keyfile-size"
 #define OPT_KEYSLOT_CIPHER		"keyslot-cipher"
+#define OPT_KEYSLOT_HINT		"keyslot-hint"
 #define OPT_KEYSLOT_KEY_SIZE		"keyslot-key-size"
 #define OPT_NO_SUPERBLOCK		"no-superblock"
 #define OPT_NO_WIPE			"no-wipe"
@@ -105,6 +124,8 @@
 #define OPT_LUKS2_KEYSLOTS_SIZE		"luks2-keyslots-size"
 #define OPT_LUKS2_METADATA_SIZE		"luks2-metadata-size"
 #define OPT_MASTER_KEY_FILE		"master-key-file"
+#define OPT_MAX_IO_LATENCY		"max-io-latency"
+#define OPT_MAX_THROUGHPUT		"max-throughput"
 #define OPT_VOLUME_KEY_FILE		"volume-key-file"
 #define OPT_NEW				"new"
 #define OPT_NEW_KEY_SLOT		"new-key-slot"
@@ -113,35 +134,54 @@
 #define OPT_NEW_KEYFILE_SIZE		"new-keyfile-size"
 #define OPT_NEW_TOKEN_ID		"new-token-id"
 #define OPT_OFFSET			"offset"
+#define OPT_OLD_DATA_DEVICE		"old-data-device"
+#define OPT_OPTIMIZE_LAYOUT		"optimize-layout"
 #define OPT_PANIC_ON_CORRUPTION		"panic-on-corruption"
+#define OPT_PARALLEL			"parallel"
+#define OPT_PARALLEL_KEYSLOTS		"parallel-keyslots"
+#define OPT_PARALLEL_TOKENS		"parallel-tokens"
 #define OPT_PBKDF			"pbkdf"
 #define OPT_PBKDF_FORCE_ITERATIONS	"pbkdf-force-iterations"
 #define OPT_PBKDF_MEMORY		"pbkdf-memory"
 #define OPT_PBKDF_PARALLEL		"pbkdf-parallel"
+#define OPT_PBKDF_SAMPLES		"pbkdf-samples"
+#define OPT_PERF_AUTO			"perf-auto"
+#define OPT_PERF_AUTO_PROBE		"perf-auto-probe"
 #define OPT_PERF_NO_READ_WORKQUEUE	"perf-no_read_workqueue"
 #define OPT_PERF_NO_WRITE_WORKQUEUE	"perf-no_write_workqueue"
 #define OPT_PERF_SAME_CPU_CRYPT		"perf-same_cpu_crypt"
+#define OPT_PERF_STATS			"perf-stats"
 #define OPT_PERF_SUBMIT_FROM_CRYPT_CPUS	"perf-submit_from_crypt_cpus"
 #define OPT_PERSISTENT			"persistent"
 #define OPT_PLUGIN			"plugin"
 #define OPT_PRIORITY			"priority"
 #define OPT_PROGRESS_JSON		"progress-json"
+#define OPT_PROGRESS_FD			"progress-fd"
 #define OPT_PROGRESS_FREQUENCY		"progress-frequency"
+#define OPT_PROGRESS_STATS		"progress-stats"
+#define OPT_QUEUE_DEPTH			"queue-depth"
 #define OPT_READONLY			"readonly"
 #define OPT_REDUCE_DEVICE_SIZE		"reduce-device-size"
 #define OPT_REFRESH			"refresh"
 #define OPT_RESILIENCE			"resilience"
+#define OPT_RESILIENCE_ADAPTIVE		"resilience-adaptive"
 #define OPT_RESILIENCE_HASH		"resilience-hash"
 #define OPT_RESTART_ON_CORRUPTION	"restart-on-corruption"
 #define OPT_RESUME_ONLY			"resume-only"
 #define OPT_ROOT_HASH_FILE		"root-hash-file"
 #define OPT_ROOT_HASH_SIGNATURE		"root-hash-signature"
+#define OPT_ROOT_HASH_SIGNATURE_CACHE	"root-hash-signature-cache"
 #define OPT_SALT			"salt"
+#define OPT_SAMPLE			"sample"
+#define OPT_SAMPLE_STRIDED		"sample-strided"
+#define OPT_SCALING			"scaling"
 #define OPT_SECTOR_SIZE			"sector-size"
 #define OPT_SERIALIZE_MEMORY_HARD_PBKDF	"serialize-memory-hard-pbkdf"
 #define OPT_SHARED			"shared"
+#define OPT_SKIP_UNALLOCATED		"skip-unallocated"
 #define OPT_SIZE			"size"
 #define OPT_SKIP			"skip"
+#define OPT_STATS			"stats"
 #define OPT_SUBSYSTEM			"subsystem"
 #define OPT_TAG_SIZE			"tag-size"
 #define OPT_TCRYPT_BACKUP		"tcrypt-backup"
@@ -149,10 +189,13 @@
 #define OPT_TCRYPT_SYSTEM		"tcrypt-system"
 #define OPT_TEST_ARGS			"test-args"
 #define OPT_TEST_PASSPHRASE		"test-passphrase"
+#define OPT_THREADS			"threads"
 #define OPT_TIMEOUT			"timeout"
 #define OPT_TOKEN_ID			"token-id"
+#define OPT_TOKEN_KEYRING_CACHE		"token-keyring-cache"
 #define OPT_TOKEN_ONLY			"token-only"
 #define OPT_TOKEN_REPLACE		"token-replace"
+#define OPT_TOKEN_TIMEOUT		"token-timeout"
 #define OPT_TOKEN_TYPE			"token-type"
 #define OPT_TRIES			"tries"
 #define OPT_TYPE			"type"
@@ -168,6 +211,10 @@
 #define OPT_VERACRYPT_QUERY_PIM		"veracrypt-query-pim"
 #define OPT_VERBOSE			"verbose"
 #define OPT_VERIFY_PASSPHRASE		"verify-passphrase"
+#define OPT_WIPE_THREADS		"wipe-threads"
+#define OPT_WRAPPED_KEY_ONLY		"wrapped-key-only"
+#define OPT_WRAPPED_KEY_TIMEOUT		"wrapped-key-timeout"
+#define OPT_WRAPPING_KEY_FILE		"wrapping-key-file"
 #define OPT_WRITE_LOG			"write-log"
 
 #endif
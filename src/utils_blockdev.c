@@ -21,6 +21,7 @@
 
 #include "cryptsetup.h"
 #include <dirent.h>
+#include <pthread.h>
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>     /* for major, minor */
 #endif
@@ -197,26 +198,22 @@ static void report_superblock(const char *value, const char *device, bool batch_
 		log_std(_("WARNING: Device %s already contains a '%s' superblock signature.\n"), device, value);
 }
 
-int tools_detect_signatures(const char *device, tools_probe_filter_info filter,
-		size_t *count,bool batch_mode)
+/*
+ * Fast mode checks only the signature type (no label, uuid or version parsing
+ * and no partition table details), that is enough to decide about the wipe.
+ */
+static int probe_signatures(const char *device, tools_probe_filter_info filter,
+		size_t *count, bool fast, bool report, bool batch_mode)
 {
 	int r;
-	size_t tmp_count;
 	struct blkid_handle *h;
 	blk_probe_status pr;
 
-	if (!count)
-		count = &tmp_count;
-
 	*count = 0;
 
-	if (!blk_supported()) {
-		log_dbg("Blkid support disabled.");
-		return 0;
-	}
-
 	if ((r = blk_init_by_path(&h, device))) {
-		log_err(_("Failed to initialize device signature probes."));
+		if (report)
+			log_err(_("Failed to initialize device signature probes."));
 		return -EINVAL;
 	}
 
@@ -228,7 +225,10 @@ int tools_detect_signatures(const char *device, tools_probe_filter_info filter,
 		}
 		/* fall-through */
 	case PRB_FILTER_NONE:
-		blk_set_chains_for_full_print(h);
+		if (fast)
+			blk_set_chains_for_fast_detection(h);
+		else
+			blk_set_chains_for_full_print(h);
 		break;
 	case PRB_ONLY_LUKS:
 		blk_set_chains_for_fast_detection(h);
@@ -239,11 +239,13 @@ int tools_detect_signatures(const char *device, tools_probe_filter_info filter,
 	}
 
 	while ((pr = blk_probe(h)) < PRB_EMPTY) {
-		if (blk_is_partition(h))
-			report_partition(blk_get_partition_type(h), device, batch_mode);
-		else if (blk_is_superblock(h))
-			report_superblock(blk_get_superblock_type(h), device, batch_mode);
-		else {
+		if (blk_is_partition(h)) {
+			if (report)
+				report_partition(blk_get_partition_type(h), device, batch_mode);
+		} else if (blk_is_superblock(h)) {
+			if (report)
+				report_superblock(blk_get_superblock_type(h), device, batch_mode);
+		} else {
 			log_dbg("Internal tools_detect_signatures() error.");
 			r = -EINVAL;
 			goto out;
@@ -258,6 +260,110 @@ out:
 	return r;
 }
 
+int tools_detect_signatures(const char *device, tools_probe_filter_info filter,
+		size_t *count,bool batch_mode)
+{
+	size_t tmp_count;
+
+	if (!count)
+		count = &tmp_count;
+
+	*count = 0;
+
+	if (!blk_supported()) {
+		log_dbg("Blkid support disabled.");
+		return 0;
+	}
+
+	/* in batch mode signatures are only logged in debug, type is enough */
+	return probe_signatures(device, filter, count, batch_mode, true, batch_mode);
+}
+
+struct signatures_batch {
+	pthread_mutex_t lock;
+	struct tools_signatures_probe *probes;
+	size_t probes_count;
+	size_t next;
+	tools_probe_filter_info filter;
+};
+
+static void *signatures_batch_worker(void *arg)
+{
+	struct signatures_batch *b = arg;
+	struct tools_signatures_probe *p;
+
+	while (1) {
+		pthread_mutex_lock(&b->lock);
+		p = b->next < b->probes_count ? &b->probes[b->next++] : NULL;
+		pthread_mutex_unlock(&b->lock);
+
+		if (!p)
+			break;
+
+		p->r = probe_signatures(p->device, b->filter, &p->count, true, false, true);
+	}
+
+	return NULL;
+}
+
+/*
+ * Fast signature probe of more devices at once (e.g. to decide which disks
+ * need a signature wipe before format), at most threads devices are probed
+ * in parallel. Returns 0 or the first error, result is set per device.
+ */
+int tools_detect_signatures_batch(struct tools_signatures_probe *probes, size_t probes_count,
+		tools_probe_filter_info filter, unsigned threads)
+{
+	struct signatures_batch b = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.probes = probes,
+		.probes_count = probes_count,
+		.filter = filter
+	};
+	pthread_t *tids;
+	unsigned i, started = 0;
+	size_t j;
+
+	for (j = 0; j < probes_count; j++) {
+		probes[j].count = 0;
+		probes[j].r = 0;
+	}
+
+	if (!blk_supported()) {
+		log_dbg("Blkid support disabled.");
+		return 0;
+	}
+
+	if (!threads)
+		threads = 1;
+	if (threads > probes_count)
+		threads = probes_count;
+
+	tids = threads > 1 ? calloc(threads, sizeof(*tids)) : NULL;
+	if (tids) {
+		for (i = 0; i < threads; i++, started++)
+			if (pthread_create(&tids[i], NULL, signatures_batch_worker, &b))
+				break;
+		log_dbg("Probing signatures on %zu devices with %u threads.", probes_count, started);
+	}
+
+	/* this thread probes as well, alone if no thread could be started */
+	signatures_batch_worker(&b);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	for (j = 0; j < probes_count; j++) {
+		if (probes[j].r < 0) {
+			log_dbg("Signature probe of device %s failed.", probes[j].device);
+			return probes[j].r;
+		}
+	}
+
+	return 0;
+}
+
 int tools_wipe_all_signatures(const char *path, bool exclusive, bool only_luks)
 {
 	int fd, flags, r;
@@ -94,6 +94,9 @@ void set_activation_flags(uint32_t *flags)
 	if (ARG_SET(OPT_INTEGRITY_NO_JOURNAL_ID))
 		*flags |= CRYPT_ACTIVATE_NO_JOURNAL;
 
+	if (ARG_SET(OPT_INLINE_CRYPT_ID))
+		*flags |= CRYPT_ACTIVATE_INLINE_CRYPT;
+
 	/* In persistent mode, we use what is set on command line */
 	if (ARG_SET(OPT_PERSISTENT_ID))
 		*flags |= CRYPT_ACTIVATE_IGNORE_PERSISTENT;
@@ -106,6 +109,15 @@ void set_activation_flags(uint32_t *flags)
 	if (ARG_SET(OPT_SERIALIZE_MEMORY_HARD_PBKDF_ID))
 		*flags |= CRYPT_ACTIVATE_SERIALIZE_MEMORY_HARD_PBKDF;
 
+	if (ARG_SET(OPT_PARALLEL_KEYSLOTS_ID))
+		*flags |= CRYPT_ACTIVATE_PARALLEL_KEYSLOTS;
+
+	if (ARG_SET(OPT_PARALLEL_TOKENS_ID))
+		*flags |= CRYPT_ACTIVATE_PARALLEL_TOKENS;
+
+	if (ARG_SET(OPT_KEYSLOT_HINT_ID))
+		*flags |= CRYPT_ACTIVATE_KEYSLOT_HINT;
+
 	/* Only for plain */
 	if (ARG_SET(OPT_IV_LARGE_SECTORS_ID))
 		*flags |= CRYPT_ACTIVATE_IV_LARGE_SECTORS;
@@ -132,6 +144,9 @@ int set_pbkdf_params(struct crypt_device *cd, const char *dev_type)
 		pbkdf.iterations = ARG_UINT32(OPT_PBKDF_FORCE_ITERATIONS_ID);
 		pbkdf.time_ms = 0;
 		pbkdf.flags |= CRYPT_PBKDF_NO_BENCHMARK;
+	} else if (ARG_SET(OPT_PBKDF_SAMPLES_ID)) {
+		pbkdf.flags |= CRYPT_PBKDF_BENCH_ROBUST;
+		pbkdf.flags |= CRYPT_PBKDF_BENCH_SAMPLES(ARG_UINT32(OPT_PBKDF_SAMPLES_ID));
 	}
 
 	return crypt_set_pbkdf_type(cd, &pbkdf);
@@ -20,30 +20,37 @@
  */
 
 #include "cryptsetup.h"
+#include <pthread.h>
 #include <termios.h>
 
 #if defined ENABLE_PWQUALITY
 #include <pwquality.h>
 
+/* settings are read once and kept for all passwords checked by the process */
+static pwquality_settings_t *pwq;
+
 static int tools_check_pwquality(const char *password)
 {
 	int r;
 	void *auxerror;
-	pwquality_settings_t *pwq;
-
-	log_dbg("Checking new password using default pwquality settings.");
-	pwq = pwquality_default_settings();
-	if (!pwq)
-		return -EINVAL;
 
-	r = pwquality_read_config(pwq, NULL, &auxerror);
-	if (r) {
-		log_err(_("Cannot check password quality: %s"),
-			pwquality_strerror(NULL, 0, r, auxerror));
-		pwquality_free_settings(pwq);
-		return -EINVAL;
+	if (!pwq) {
+		log_dbg("Reading default pwquality settings.");
+		pwq = pwquality_default_settings();
+		if (!pwq)
+			return -EINVAL;
+
+		r = pwquality_read_config(pwq, NULL, &auxerror);
+		if (r) {
+			log_err(_("Cannot check password quality: %s"),
+				pwquality_strerror(NULL, 0, r, auxerror));
+			pwquality_free_settings(pwq);
+			pwq = NULL;
+			return -EINVAL;
+		}
 	}
 
+	log_dbg("Checking new password using pwquality settings.");
 	r = pwquality_check(pwq, password, NULL, NULL, &auxerror);
 	if (r < 0) {
 		log_err(_("Password quality check failed:\n %s"),
@@ -54,41 +61,44 @@ static int tools_check_pwquality(const char *password)
 		r = 0;
 	}
 
-	pwquality_free_settings(pwq);
 	return r;
 }
 #elif defined ENABLE_PASSWDQC
 #include <passwdqc.h>
 
+/* configuration is loaded once and kept for all passwords checked by the process */
+static passwdqc_params_t params;
+static bool params_loaded;
+
 static int tools_check_passwdqc(const char *password)
 {
-	passwdqc_params_t params;
 	char *parse_reason = NULL;
 	const char *check_reason;
 	const char *config = PASSWDQC_CONFIG_FILE;
-	int r = -EINVAL;
 
-	passwdqc_params_reset(&params);
+	if (!params_loaded) {
+		passwdqc_params_reset(&params);
 
-	if (*config && passwdqc_params_load(&params, &parse_reason, config)) {
-		log_err(_("Cannot check password quality: %s"),
-			(parse_reason ? parse_reason : "Out of memory"));
-		goto out;
+		if (*config && passwdqc_params_load(&params, &parse_reason, config)) {
+			log_err(_("Cannot check password quality: %s"),
+				(parse_reason ? parse_reason : "Out of memory"));
+#if HAVE_PASSWDQC_PARAMS_FREE
+			passwdqc_params_free(&params);
+#endif
+			free(parse_reason);
+			return -EINVAL;
+		}
+		params_loaded = true;
 	}
 
 	check_reason = passwdqc_check(&params.qc, password, NULL, NULL);
 	if (check_reason) {
 		log_err(_("Password quality check failed: Bad passphrase (%s)"),
 			check_reason);
-		r = -EPERM;
-	} else
-		r = 0;
-out:
-#if HAVE_PASSWDQC_PARAMS_FREE
-	passwdqc_params_free(&params);
-#endif
-	free(parse_reason);
-	return r;
+		return -EPERM;
+	}
+
+	return 0;
 }
 #endif /* ENABLE_PWQUALITY || ENABLE_PASSWDQC */
 
@@ -104,6 +114,54 @@ static int tools_check_password(const char *password)
 #endif
 }
 
+/* Quality check started by tools_get_key(), finished by tools_check_password_wait() */
+static struct {
+	pthread_t thread;
+	const char *password;
+	bool running;
+	int r;
+} pending_check;
+
+#if defined ENABLE_PWQUALITY || defined ENABLE_PASSWDQC
+static void *password_check_thread(void *arg __attribute__((unused)))
+{
+	pending_check.r = tools_check_password(pending_check.password);
+	return NULL;
+}
+#endif
+
+static int tools_check_password_start(const char *password)
+{
+#if defined ENABLE_PWQUALITY || defined ENABLE_PASSWDQC
+	pending_check.password = password;
+	pending_check.r = 0;
+	if (!pthread_create(&pending_check.thread, NULL, password_check_thread, NULL)) {
+		log_dbg("Password quality check runs in background.");
+		pending_check.running = true;
+		return 0;
+	}
+#endif
+	return tools_check_password(password);
+}
+
+bool tools_check_password_pending(void)
+{
+	return pending_check.running;
+}
+
+/* The checked password must not be freed before this call */
+int tools_check_password_wait(void)
+{
+	if (!pending_check.running)
+		return 0;
+
+	pthread_join(pending_check.thread, NULL);
+	pending_check.running = false;
+	pending_check.password = NULL;
+
+	return pending_check.r;
+}
+
 /* Password reading helpers */
 
 static ssize_t read_tty_eol(int fd, char *pass, size_t maxlen)
@@ -317,7 +375,9 @@ int tools_get_key(const char *prompt,
 		set_int_block(1);
 
 	/* Check pwquality for password (not keyfile) */
-	if (pwquality && !key_file && !r)
+	if (pwquality == TOOLS_PWQUALITY_ASYNC && !key_file && !r)
+		r = tools_check_password_start(*key);
+	else if (pwquality && !key_file && !r)
 		r = tools_check_password(*key);
 
 	return r;
@@ -33,11 +33,21 @@
 #define REMAIN_SECONDS(A) (SECONDS((A))) % 60
 #define REMAIN_MINUTES(A) (MINUTES((A))) % 60
 
-/* The difference in microseconds between two times in "timeval" format. */
-static uint64_t time_diff(struct timeval *start, struct timeval *end)
+/*
+ * Coarse monotonic clock is read from vDSO without touching the hardware
+ * counter and its resolution (one tick) is fine for progress reports.
+ */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define PROGRESS_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define PROGRESS_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* The difference in microseconds between two times in "timespec" format. */
+static uint64_t time_diff(struct timespec *start, struct timespec *end)
 {
 	return (end->tv_sec - start->tv_sec) * UINT64_C(1000000)
-		+ (end->tv_usec - start->tv_usec);
+		+ (end->tv_nsec - start->tv_nsec) / 1000;
 }
 
 static void tools_clear_line(void)
@@ -153,12 +163,14 @@ static void log_progress_final(uint64_t time_spent, uint64_t bytes, double uib,
 static bool calculate_tdiff(bool final, uint64_t bytes, struct tools_progress_params *parms, double *r_tdiff)
 {
 	uint64_t frequency;
-	struct timeval now_time;
+	struct timespec now_time;
 
 	assert(r_tdiff);
 
-	gettimeofday(&now_time, NULL);
-	if (parms->start_time.tv_sec == 0 && parms->start_time.tv_usec == 0) {
+	if (clock_gettime(PROGRESS_CLOCK, &now_time))
+		return false;
+
+	if (parms->start_time.tv_sec == 0 && parms->start_time.tv_nsec == 0) {
 		parms->start_time = now_time;
 		parms->end_time = now_time;
 		parms->start_offset = bytes;
@@ -182,16 +194,14 @@ static bool calculate_tdiff(bool final, uint64_t bytes, struct tools_progress_pa
 	return true;
 }
 
-static void tools_time_progress(uint64_t device_size, uint64_t bytes, struct tools_progress_params *parms)
+static void tools_time_progress(uint64_t device_size, uint64_t bytes, double tdiff,
+				struct tools_progress_params *parms)
 {
 	uint64_t eta;
-	double tdiff, uib;
+	double uib;
 	const char *eol, *ustr;
 	bool final = (bytes == device_size);
 
-	if (!calculate_tdiff(final, bytes, parms, &tdiff))
-		return;
-
 	if (parms->frequency)
 		eol = "\n";
 	else
@@ -224,7 +234,12 @@ static void tools_time_progress(uint64_t device_size, uint64_t bytes, struct too
 	fflush(stdout);
 }
 
-static void log_progress_json(const char *device, uint64_t bytes, uint64_t device_size, uint64_t eta, uint64_t uib, uint64_t time_spent)
+/*
+ * Progress line goes to stdout, or with fd >= 0 directly to the progress
+ * file descriptor with a single write (no stdio buffering, one line per write).
+ */
+static bool log_progress_json(int fd, const char *device, uint64_t bytes, uint64_t device_size,
+			      uint64_t eta, uint64_t uib, uint64_t time_spent)
 {
 	int r;
 	char json[PATH_MAX+256];
@@ -239,40 +254,135 @@ static void log_progress_json(const char *device, uint64_t bytes, uint64_t devic
 		     device, bytes, device_size, uib, eta, time_spent);
 
 	if (r < 0 || (size_t)r >= sizeof(json) - 1)
-		return;
+		return true;
+
+	if (fd >= 0)
+		return write_buffer(fd, json, r) == r;
 
 	log_std("%s", json);
+	fflush(stdout);
+	return true;
 }
 
-static void tools_time_progress_json(uint64_t device_size, uint64_t bytes, struct tools_progress_params *parms)
+static void tools_time_progress_json(uint64_t device_size, uint64_t bytes, double tdiff,
+				     struct tools_progress_params *parms, bool to_fd)
 {
-	double tdiff, uib;
+	double uib;
 	bool final = (bytes == device_size);
 
-	if (!calculate_tdiff(final, bytes, parms, &tdiff))
-		return;
-
 	uib = (double)(bytes - parms->start_offset) / tdiff;
 
-	log_progress_json(parms->device,
+	if (!log_progress_json(to_fd ? parms->fd : -1,
+			  parms->device,
 			  bytes,
 			  device_size,
 			  final ? UINT64_C(0) : (uint64_t)((device_size / uib - tdiff) * 1E3),
 			  (uint64_t)uib,
-			  (uint64_t)(tdiff * 1E3));
+			  (uint64_t)(tdiff * 1E3))) {
+		log_dbg("Failed to write progress to file descriptor %d.", parms->fd);
+		parms->fd_output = false;
+	}
+}
 
-	fflush(stdout);
+/*
+ * Wipe checkpoint is a text file with "<size> <offset>" line, offset is
+ * the end of the already written area. It is replaced by rename only
+ * after the wiped device is flushed, so it never points past stable data.
+ */
+#define CHECKPOINT_BYTES (UINT64_C(1) << 30)
+
+int tools_checkpoint_load(const char *file, uint64_t size, uint64_t *offset)
+{
+	FILE *f;
+	uint64_t c_size, c_offset;
+	int r = 0;
+
+	*offset = 0;
+
+	f = fopen(file, "r");
+	if (!f)
+		return errno == ENOENT ? 0 : -EINVAL;
+
+	if (fscanf(f, "%" SCNu64 " %" SCNu64, &c_size, &c_offset) != 2 ||
+	    c_size != size || c_offset > size || MISALIGNED_512(c_offset)) {
+		log_err(_("Checkpoint file %s does not match the device."), file);
+		r = -EINVAL;
+	} else
+		*offset = c_offset;
+
+	fclose(f);
+	return r;
+}
+
+void tools_checkpoint_remove(const char *file)
+{
+	if (file && unlink(file) && errno != ENOENT)
+		log_dbg("Cannot remove checkpoint file %s.", file);
+}
+
+static void tools_checkpoint_save(uint64_t size, uint64_t offset,
+				  struct tools_progress_params *parms)
+{
+	char tmp[PATH_MAX], line[64];
+	int fd, r;
+
+	if (offset < size && offset - parms->checkpoint_offset < CHECKPOINT_BYTES)
+		return;
+
+	if (parms->checkpoint_device) {
+		fd = open(parms->checkpoint_device, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || fsync(fd)) {
+			if (fd >= 0)
+				close(fd);
+			log_dbg("Cannot flush %s, checkpoint not updated.", parms->checkpoint_device);
+			return;
+		}
+		close(fd);
+	}
+
+	r = snprintf(tmp, sizeof(tmp), "%s.tmp", parms->checkpoint);
+	if (r < 0 || (size_t)r >= sizeof(tmp))
+		return;
+	r = snprintf(line, sizeof(line), "%" PRIu64 " %" PRIu64 "\n", size, offset);
+	if (r < 0 || (size_t)r >= sizeof(line))
+		return;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		log_dbg("Cannot create checkpoint file %s.", tmp);
+		return;
+	}
+
+	if (write_buffer(fd, line, r) != r || fsync(fd) || rename(tmp, parms->checkpoint)) {
+		log_dbg("Cannot write checkpoint file %s.", parms->checkpoint);
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+
+	parms->checkpoint_offset = offset;
 }
 
 int tools_progress(uint64_t size, uint64_t offset, void *usrptr)
 {
 	int r = 0;
+	double tdiff;
 	struct tools_progress_params *parms = (struct tools_progress_params *)usrptr;
 
-	if (parms && parms->json_output)
-		tools_time_progress_json(size, offset, parms);
-	else if (parms && !parms->batch_mode)
-		tools_time_progress(size, offset, parms);
+	/* time and output formatting only once per --progress-frequency interval */
+	if (parms && (parms->fd_output || parms->json_output || !parms->batch_mode) &&
+	    calculate_tdiff(offset == size, offset, parms, &tdiff)) {
+		if (parms->fd_output)
+			tools_time_progress_json(size, offset, tdiff, parms, true);
+		if (parms->json_output)
+			tools_time_progress_json(size, offset, tdiff, parms, false);
+		else if (!parms->batch_mode)
+			tools_time_progress(size, offset, tdiff, parms);
+	}
+
+	if (parms && parms->checkpoint)
+		tools_checkpoint_save(size, offset, parms);
 
 	check_signal(&r);
 	if (r) {
@@ -285,6 +395,46 @@ int tools_progress(uint64_t size, uint64_t offset, void *usrptr)
 	return r;
 }
 
+void tools_reencrypt_stats(const struct crypt_reencrypt_step_stats *stats, void *usrptr)
+{
+	int r;
+	char json[PATH_MAX+512];
+	struct tools_progress_params *parms = (struct tools_progress_params *)usrptr;
+
+	if (!stats || !parms)
+		return;
+
+	r = snprintf(json, sizeof(json) - 1,
+		     "{\"device\":\"%s\","
+		     "\"offset\":\"%"		PRIu64 "\","	/* in bytes */
+		     "\"length\":\"%"		PRIu64 "\","	/* in bytes */
+		     "\"read_us\":\"%"		PRIu64 "\","
+		     "\"protect_us\":\"%"		PRIu64 "\","
+		     "\"decrypt_us\":\"%"		PRIu64 "\","
+		     "\"encrypt_write_us\":\"%"	PRIu64 "\","
+		     "\"sync_us\":\"%"		PRIu64 "\","
+		     "\"commit_us\":\"%"		PRIu64 "\","
+		     "\"switch_us\":\"%"		PRIu64 "\","
+		     "\"total_us\":\"%"		PRIu64 "\"}\n",
+		     parms->device ?: "", stats->offset, stats->length, stats->read_us,
+		     stats->protect_us, stats->decrypt_us, stats->encrypt_write_us,
+		     stats->sync_us, stats->commit_us, stats->switch_us, stats->total_us);
+
+	if (r < 0 || (size_t)r >= sizeof(json) - 1)
+		return;
+
+	if (parms->fd_output) {
+		if (write_buffer(parms->fd, json, r) != r) {
+			log_dbg("Failed to write statistics to file descriptor %d.", parms->fd);
+			parms->fd_output = false;
+		}
+		return;
+	}
+
+	log_std("%s", json);
+	fflush(stdout);
+}
+
 const char *tools_get_device_name(const char *device, char **r_backing_file)
 {
 	char *bfile;
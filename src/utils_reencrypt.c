@@ -20,7 +20,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <dirent.h>
+#include <poll.h>
 #include <uuid/uuid.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
 
 #include "cryptsetup.h"
 #include "cryptsetup_args.h"
@@ -39,6 +44,17 @@ enum device_status_info {
 	DEVICE_INVALID		/* device is invalid */
 };
 
+/* set in batch worker process only */
+static int batch_progress_fd = -1;
+static uint32_t batch_index;
+static uint32_t batch_workers = 1;
+
+/* throughput limit is shared by all parallel batch workers */
+static uint64_t reencrypt_max_throughput(void)
+{
+	return ARG_UINT64(OPT_MAX_THROUGHPUT_ID) / batch_workers;
+}
+
 static void _set_reencryption_flags(uint32_t *flags)
 {
 	if (ARG_SET(OPT_INIT_ONLY_ID))
@@ -46,6 +62,43 @@ static void _set_reencryption_flags(uint32_t *flags)
 
 	if (ARG_SET(OPT_RESUME_ONLY_ID))
 		*flags |= CRYPT_REENCRYPT_RESUME_ONLY;
+
+	if (ARG_SET(OPT_SKIP_UNALLOCATED_ID))
+		*flags |= CRYPT_REENCRYPT_SKIP_HOLES;
+
+	if (ARG_SET(OPT_RESILIENCE_ADAPTIVE_ID))
+		*flags |= CRYPT_REENCRYPT_ADAPTIVE_RESILIENCE;
+
+	if (ARG_SET(OPT_DISCARD_UNUSED_ID))
+		*flags |= CRYPT_REENCRYPT_DISCARD_UNUSED;
+}
+
+/* apply tuning options before reencryption context is loaded */
+static int reencrypt_init_by_passphrase(struct crypt_device *cd,
+	const char *name,
+	const char *passphrase,
+	size_t passphrase_size,
+	int keyslot_old,
+	int keyslot_new,
+	const char *cipher,
+	const char *cipher_mode,
+	const struct crypt_params_reencrypt *params)
+{
+	int r;
+
+	r = crypt_reencrypt_set_threads(cd, ARG_UINT32(OPT_THREADS_ID));
+	if (!r)
+		r = crypt_reencrypt_set_step_latency(cd, ARG_UINT32(OPT_HOTZONE_LATENCY_ID));
+	if (!r)
+		r = crypt_reencrypt_set_hotzone_batch(cd, ARG_UINT32(OPT_HOTZONE_BATCH_ID));
+	if (!r)
+		r = crypt_reencrypt_set_throttle(cd, reencrypt_max_throughput(),
+						 ARG_UINT32(OPT_MAX_IO_LATENCY_ID));
+	if (r)
+		return r;
+
+	return crypt_reencrypt_init_by_passphrase(cd, name, passphrase, passphrase_size,
+						  keyslot_old, keyslot_new, cipher, cipher_mode, params);
 }
 
 static int reencrypt_check_passphrase(struct crypt_device *cd,
@@ -257,6 +310,12 @@ static int reencrypt_verify_and_update_params(struct crypt_params_reencrypt *par
 	params->max_hotzone_size = ARG_UINT64(OPT_HOTZONE_SIZE_ID) / SECTOR_SIZE;
 	params->device_size = ARG_UINT64(OPT_DEVICE_SIZE_ID) / SECTOR_SIZE;
 	params->flags = CRYPT_REENCRYPT_RESUME_ONLY;
+	if (ARG_SET(OPT_SKIP_UNALLOCATED_ID))
+		params->flags |= CRYPT_REENCRYPT_SKIP_HOLES;
+	if (ARG_SET(OPT_RESILIENCE_ADAPTIVE_ID))
+		params->flags |= CRYPT_REENCRYPT_ADAPTIVE_RESILIENCE;
+	if (ARG_SET(OPT_DISCARD_UNUSED_ID))
+		params->flags |= CRYPT_REENCRYPT_DISCARD_UNUSED;
 
 	return 0;
 }
@@ -327,7 +386,7 @@ static int reencrypt_luks2_load(struct crypt_device *cd, const char *data_device
 	if (!ARG_SET(OPT_FORCE_OFFLINE_REENCRYPT_ID))
 		r = reencrypt_get_active_name(cd, data_device, &active_name);
 	if (r >= 0)
-		r = crypt_reencrypt_init_by_passphrase(cd, active_name, password,
+		r = reencrypt_init_by_passphrase(cd, active_name, password,
 				passwordLen, ARG_INT32(OPT_KEY_SLOT_ID),
 				ARG_INT32(OPT_KEY_SLOT_ID), NULL, NULL, &params);
 out:
@@ -590,7 +649,7 @@ static int encrypt_luks2_init(struct crypt_device **cd, const char *data_device,
 		params.resilience = "datashift";
 	}
 	keyslot = !ARG_SET(OPT_KEY_SLOT_ID) ? 0 : ARG_INT32(OPT_KEY_SLOT_ID);
-	r = crypt_reencrypt_init_by_passphrase(*cd, NULL, password, passwordLen,
+	r = reencrypt_init_by_passphrase(*cd, NULL, password, passwordLen,
 			CRYPT_ANY_SLOT, keyslot, crypt_get_cipher(*cd),
 			crypt_get_cipher_mode(*cd), &params);
 	if (r < 0) {
@@ -627,7 +686,7 @@ static int encrypt_luks2_init(struct crypt_device **cd, const char *data_device,
 	/* just load reencryption context to continue reencryption */
 	if (!ARG_SET(OPT_INIT_ONLY_ID)) {
 		params.flags &= ~CRYPT_REENCRYPT_INITIALIZE_ONLY;
-		r = crypt_reencrypt_init_by_passphrase(*cd, device_name, password, passwordLen,
+		r = reencrypt_init_by_passphrase(*cd, device_name, password, passwordLen,
 				CRYPT_ANY_SLOT, keyslot, NULL, NULL, &params);
 	}
 out:
@@ -803,7 +862,7 @@ static int decrypt_luks2_datashift_init(struct crypt_device **cd,
 
 	remove_header = false;
 
-	r = crypt_reencrypt_init_by_passphrase(*cd, active_name, password,
+	r = reencrypt_init_by_passphrase(*cd, active_name, password,
 			passwordLen, ARG_INT32(OPT_KEY_SLOT_ID), CRYPT_ANY_SLOT,
 			NULL, NULL, &params);
 
@@ -868,7 +927,7 @@ static int decrypt_luks2_init(struct crypt_device *cd, const char *data_device)
 	if (!ARG_SET(OPT_FORCE_OFFLINE_REENCRYPT_ID))
 		r = reencrypt_get_active_name(cd, data_device, &active_name);
 	if (r >= 0)
-		r = crypt_reencrypt_init_by_passphrase(cd, active_name, password,
+		r = reencrypt_init_by_passphrase(cd, active_name, password,
 				passwordLen, ARG_INT32(OPT_KEY_SLOT_ID), CRYPT_ANY_SLOT, NULL, NULL, &params);
 
 out:
@@ -1251,7 +1310,7 @@ static int reencrypt_luks2_init(struct crypt_device *cd, const char *data_device
 			goto out;
 	}
 
-	r = crypt_reencrypt_init_by_passphrase(cd,
+	r = reencrypt_init_by_passphrase(cd,
 			ARG_SET(OPT_INIT_ONLY_ID) ? NULL : active_name,
 			kp[keyslot_old].password, kp[keyslot_old].passwordLen,
 			keyslot_old, kp[keyslot_old].new, cipher, mode, &params);
@@ -1271,6 +1330,47 @@ out:
 	return r;
 }
 
+/* ioprio_set(2) constants, not exported in userspace headers */
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+
+static void reencrypt_set_io_idle(void)
+{
+#ifdef SYS_ioprio_set
+	/* inherited by all library worker threads created later */
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+		log_dbg("Failed to set idle I/O scheduling class.");
+	else
+		log_dbg("Using idle I/O scheduling class.");
+#else
+	log_dbg("Idle I/O scheduling class is not supported.");
+#endif
+}
+
+struct reencrypt_batch_msg {
+	uint32_t index;
+	uint64_t size;
+	uint64_t offset;
+};
+
+static int reencrypt_batch_progress(uint64_t size, uint64_t offset, void *usrptr __attribute__((unused)))
+{
+	int r = 0;
+	struct reencrypt_batch_msg msg = {
+		.index = batch_index,
+		.size = size,
+		.offset = offset
+	};
+
+	/* message is smaller than PIPE_BUF, write is atomic */
+	if (write(batch_progress_fd, &msg, sizeof(msg)) != (ssize_t)sizeof(msg))
+		log_dbg("Failed to report batch progress.");
+
+	check_signal(&r);
+	return r;
+}
+
 static int reencrypt_luks2_resume(struct crypt_device *cd)
 {
 	int r;
@@ -1279,6 +1379,8 @@ static int reencrypt_luks2_resume(struct crypt_device *cd)
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
 		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
 		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
+		.fd_output = ARG_SET(OPT_PROGRESS_FD_ID),
+		.fd = ARG_INT32(OPT_PROGRESS_FD_ID),
 		.interrupt_message = _("\nReencryption interrupted."),
 		.device = tools_get_device_name(crypt_get_device_name(cd), &backing_file)
 	};
@@ -1286,8 +1388,22 @@ static int reencrypt_luks2_resume(struct crypt_device *cd)
 	if (ARG_SET(OPT_FORCE_OFFLINE_REENCRYPT_ID) && !ARG_SET(OPT_BATCH_MODE_ID))
 		log_std(_("Resuming LUKS reencryption in forced offline mode.\n"));
 
+	if (ARG_SET(OPT_IO_IDLE_ID))
+		reencrypt_set_io_idle();
+
+	if (ARG_SET(OPT_PROGRESS_STATS_ID)) {
+		r = crypt_reencrypt_set_stats_callback(cd, tools_reencrypt_stats, &prog_parms);
+		if (r < 0) {
+			free(backing_file);
+			return r;
+		}
+	}
+
 	set_int_handler(0);
-	r = crypt_reencrypt_run(cd, tools_progress, &prog_parms);
+	if (batch_progress_fd >= 0)
+		r = crypt_reencrypt_run(cd, reencrypt_batch_progress, NULL);
+	else
+		r = crypt_reencrypt_run(cd, tools_progress, &prog_parms);
 	free(backing_file);
 	return r;
 }
@@ -1458,7 +1574,7 @@ static int _reencrypt(struct crypt_device *cd, enum device_status_info dev_st, c
 	return reencrypt_luks2_resume(cd);
 }
 
-int reencrypt(int action_argc, const char **action_argv)
+static int reencrypt_device(int action_argc, const char **action_argv)
 {
 	enum device_status_info dev_st;
 	int r = -EINVAL;
@@ -1526,3 +1642,242 @@ out:
 	crypt_free(cd);
 	return r;
 }
+
+static int read_sysfs_devno(const char *path, dev_t *devno)
+{
+	FILE *f;
+	unsigned int maj, min;
+	int r;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	r = fscanf(f, "%u:%u", &maj, &min) == 2 ? 0 : -EINVAL;
+	fclose(f);
+
+	if (!r)
+		*devno = makedev(maj, min);
+	return r;
+}
+
+/*
+ * Devices sharing the same underlying disk (partitions, device-mapper
+ * stacks) must not run in parallel, the seeks would kill the throughput.
+ * Files are grouped by the filesystem they are stored on.
+ */
+static dev_t reencrypt_batch_disk(const char *device)
+{
+	struct stat st;
+	struct dirent *entry;
+	DIR *dir;
+	dev_t devno;
+	char path[PATH_MAX];
+	int i;
+
+	if (stat(device, &st) < 0)
+		return 0;
+
+	if (!S_ISBLK(st.st_mode))
+		return st.st_dev;
+
+	devno = st.st_rdev;
+
+	/* walk down the stack to the first underlying device */
+	for (i = 0; i < 16; i++) {
+		if (snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves",
+			     major(devno), minor(devno)) < 0)
+			break;
+		dir = opendir(path);
+		if (!dir)
+			break;
+		while ((entry = readdir(dir)) && entry->d_name[0] == '.');
+		if (!entry || snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves/%s/dev",
+				       major(devno), minor(devno), entry->d_name) < 0 ||
+		    read_sysfs_devno(path, &devno)) {
+			closedir(dir);
+			break;
+		}
+		closedir(dir);
+	}
+
+	/* partition to whole disk */
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+		     major(devno), minor(devno)) > 0 && !access(path, F_OK) &&
+	    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+		     major(devno), minor(devno)) > 0)
+		read_sysfs_devno(path, &devno);
+
+	return devno;
+}
+
+struct reencrypt_batch_dev {
+	const char *device;
+	dev_t disk;
+	pid_t pid;
+	bool started;
+	bool running;
+	uint64_t size;
+	uint64_t offset;
+};
+
+static int reencrypt_batch_next(struct reencrypt_batch_dev *devs, int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		if (devs[i].started)
+			continue;
+		for (j = 0; j < count; j++)
+			if (devs[j].running && devs[i].disk && devs[j].disk == devs[i].disk)
+				break;
+		if (j == count)
+			return i;
+	}
+
+	return -1;
+}
+
+static pid_t reencrypt_batch_start(struct reencrypt_batch_dev *dev, int index, int fd)
+{
+	pid_t pid;
+	int r;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	/* worker process */
+	batch_progress_fd = fd;
+	batch_index = index;
+	r = reencrypt_device(1, &dev->device);
+	tools_cleanup();
+	_exit(r < 0 ? -r : 0);
+}
+
+static void reencrypt_batch_report(struct reencrypt_batch_dev *devs, int count,
+				   struct tools_progress_params *prog_parms, bool final)
+{
+	uint64_t size = 0, offset = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		size += devs[i].size;
+		offset += devs[i].offset;
+	}
+
+	/* total size grows as workers start, report final line only once */
+	if (size && (offset < size || final))
+		tools_progress(size, offset, prog_parms);
+}
+
+/*
+ * Reencrypt all devices on command line, running at most --parallel
+ * worker processes at once, each through crypt_reencrypt_run().
+ */
+static int reencrypt_batch(int action_argc, const char **action_argv)
+{
+	struct reencrypt_batch_dev *devs;
+	struct reencrypt_batch_msg msg;
+	struct pollfd pfd;
+	int fds[2], i, status, running = 0, r = 0, r_dev;
+	bool stop = false;
+	pid_t pid;
+	struct tools_progress_params prog_parms = {
+		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
+		.fd_output = ARG_SET(OPT_PROGRESS_FD_ID),
+		.fd = ARG_INT32(OPT_PROGRESS_FD_ID),
+		.device = "*"
+	};
+
+	devs = calloc(action_argc, sizeof(*devs));
+	if (!devs)
+		return -ENOMEM;
+
+	if (pipe(fds) < 0) {
+		free(devs);
+		return -errno;
+	}
+
+	for (i = 0; i < action_argc; i++) {
+		devs[i].device = action_argv[i];
+		devs[i].disk = reencrypt_batch_disk(uuid_or_device(devs[i].device));
+		log_dbg("Batch device %s on disk %u:%u.", devs[i].device,
+			major(devs[i].disk), minor(devs[i].disk));
+	}
+
+	batch_workers = ARG_UINT32(OPT_PARALLEL_ID) ?: 1;
+	if (batch_workers > (uint32_t)action_argc)
+		batch_workers = action_argc;
+
+	set_int_handler(0);
+
+	do {
+		while (!quit && !stop && running < (int)batch_workers &&
+		       (i = reencrypt_batch_next(devs, action_argc)) >= 0) {
+			pid = reencrypt_batch_start(&devs[i], i, fds[1]);
+			if (pid < 0) {
+				log_err(_("Cannot start reencryption of device %s."), devs[i].device);
+				r = -errno;
+				stop = true;
+				break;
+			}
+			log_dbg("Started reencryption of device %s (pid %d).", devs[i].device, (int)pid);
+			devs[i].pid = pid;
+			devs[i].started = devs[i].running = true;
+			running++;
+		}
+
+		if (!running)
+			break;
+
+		pfd.fd = fds[0];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 500) > 0 && (pfd.revents & POLLIN) &&
+		    read(fds[0], &msg, sizeof(msg)) == (ssize_t)sizeof(msg) &&
+		    msg.index < (uint32_t)action_argc) {
+			devs[msg.index].size = msg.size;
+			devs[msg.index].offset = msg.offset;
+			reencrypt_batch_report(devs, action_argc, &prog_parms, false);
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < action_argc; i++)
+				if (devs[i].running && devs[i].pid == pid)
+					break;
+			if (i == action_argc)
+				continue;
+
+			devs[i].running = false;
+			running--;
+
+			r_dev = WIFEXITED(status) ? -WEXITSTATUS(status) : -EINTR;
+			if (r_dev) {
+				log_err(_("Reencryption of device %s failed."), devs[i].device);
+				if (!r)
+					r = r_dev;
+			} else
+				devs[i].offset = devs[i].size;
+		}
+	} while (running || (!quit && !stop && reencrypt_batch_next(devs, action_argc) >= 0));
+
+	if (!quit && !stop)
+		reencrypt_batch_report(devs, action_argc, &prog_parms, true);
+	else
+		log_err(_("\nReencryption interrupted."));
+
+	close(fds[0]);
+	close(fds[1]);
+	free(devs);
+	return r;
+}
+
+int reencrypt(int action_argc, const char **action_argv)
+{
+	if (ARG_SET(OPT_PARALLEL_ID) && action_argc > 1)
+		return reencrypt_batch(action_argc, action_argv);
+
+	return reencrypt_device(action_argc, action_argv);
+}
@@ -723,6 +723,8 @@ static int copy_data_forward(struct reenc_ctx *rc, int fd_old, int fd_new,
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
 		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
 		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
+		.fd_output = ARG_SET(OPT_PROGRESS_FD_ID),
+		.fd = ARG_INT32(OPT_PROGRESS_FD_ID),
 		.interrupt_message = _("\nReencryption interrupted."),
 		.device = tools_get_device_name(rc->device, &backing_file)
 	};
@@ -795,6 +797,8 @@ static int copy_data_backward(struct reenc_ctx *rc, int fd_old, int fd_new,
 		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
 		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
 		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
+		.fd_output = ARG_SET(OPT_PROGRESS_FD_ID),
+		.fd = ARG_INT32(OPT_PROGRESS_FD_ID),
 		.interrupt_message = _("\nReencryption interrupted."),
 		.device = tools_get_device_name(rc->device, &backing_file)
 	};
@@ -433,6 +433,21 @@ int tools_write_mk(const char *file, const char *key, int keysize)
 	return r;
 }
 
+/* print JSON string literal with escaped quotes and control characters */
+void tools_json_print_string(const char *str)
+{
+	log_std("\"");
+	for (; str && *str; str++) {
+		if (*str == '"' || *str == '\\')
+			log_std("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			log_std("\\u%04x", (unsigned char)*str);
+		else
+			log_std("%c", *str);
+	}
+	log_std("\"");
+}
+
 void tools_package_version(const char *name, bool use_pwlibs)
 {
 	log_std("%s %s flags: %s%s\n", name, PACKAGE_VERSION,
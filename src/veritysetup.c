@@ -19,11 +19,19 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
+
 #include "cryptsetup.h"
 #include "veritysetup_args.h"
 
 #define PACKAGE_VERITY "veritysetup"
 
+#define VERITY_INPUT_BUFFER_SIZE (1024 * 1024)
+
+/* hash areas of images sharing one hash device are aligned to this size */
+#define VERITY_MULTI_ALIGN 4096
+#define VERITY_MULTI_MAX_THREADS 64
+
 static const char **action_argv;
 static int action_argc;
 static struct tools_log_params log_parms;
@@ -72,14 +80,122 @@ static int _prepare_format(struct crypt_params_verity *params,
 	return 0;
 }
 
+static int _write_root_hash_file(struct crypt_device *cd)
+{
+	char *root_hash_bytes;
+	size_t root_hash_size;
+	int root_hash_fd = -1, i, r;
+
+	root_hash_size = crypt_get_volume_key_size(cd);
+	root_hash_bytes = malloc(root_hash_size);
+	if (!root_hash_bytes)
+		return -ENOMEM;
+
+	r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, root_hash_bytes, &root_hash_size, NULL, 0);
+	if (r < 0)
+		goto out;
+
+	root_hash_fd = open(ARG_STR(OPT_ROOT_HASH_FILE_ID), O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
+	if (root_hash_fd == -1) {
+		log_err(_("Cannot create root hash file %s for writing."), ARG_STR(OPT_ROOT_HASH_FILE_ID));
+		r = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < (int)root_hash_size; i++)
+		if (dprintf(root_hash_fd, "%02hhx", root_hash_bytes[i]) != 2) {
+			log_err(_("Cannot write to root hash file %s."), ARG_STR(OPT_ROOT_HASH_FILE_ID));
+			r = -EIO;
+			goto out;
+		}
+
+	log_dbg("Created root hash file %s.", ARG_STR(OPT_ROOT_HASH_FILE_ID));
+	r = 0;
+out:
+	free(root_hash_bytes);
+	if (root_hash_fd != -1)
+		close(root_hash_fd);
+	return r;
+}
+
+/* Image is written to data device and hashed in one pass, data device is never read */
+static int _format_from_input(struct crypt_device *cd, int fd)
+{
+	struct crypt_verity_hash_stream *stream = NULL;
+	char *buf;
+	ssize_t len;
+	int r;
+
+	buf = malloc(VERITY_INPUT_BUFFER_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	r = crypt_verity_hash_stream_init(cd, CRYPT_VERITY_STREAM_WRITE_DATA, &stream);
+
+	while (!r && (len = read_buffer(fd, buf, VERITY_INPUT_BUFFER_SIZE)) > 0)
+		r = crypt_verity_hash_stream_write(cd, stream, buf, len);
+
+	if (!r && len < 0) {
+		log_err(_("Cannot read data input %s."), ARG_STR(OPT_DATA_INPUT_ID));
+		r = -EIO;
+	}
+
+	if (!r)
+		r = crypt_verity_hash_stream_final(cd, stream, NULL, NULL);
+
+	crypt_verity_hash_stream_free(stream);
+	free(buf);
+	return r;
+}
+
+static int _open_data_input(struct crypt_params_verity *params)
+{
+	struct stat st;
+	int fd;
+
+	if (!strcmp(ARG_STR(OPT_DATA_INPUT_ID), "-"))
+		fd = dup(STDIN_FILENO);
+	else
+		fd = open(ARG_STR(OPT_DATA_INPUT_ID), O_RDONLY);
+
+	if (fd < 0) {
+		log_err(_("Cannot open data input %s."), ARG_STR(OPT_DATA_INPUT_ID));
+		return -EINVAL;
+	}
+
+	/* input size is known only for a regular file */
+	if (!params->data_size && !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		if (st.st_size % params->data_block_size) {
+			log_err(_("Data input size is not a multiple of data block size."));
+			close(fd);
+			return -EINVAL;
+		}
+		params->data_size = st.st_size / params->data_block_size;
+	}
+
+	return fd;
+}
+
 static int action_format(void)
 {
 	struct crypt_device *cd = NULL;
 	struct crypt_params_verity params = {};
 	uint32_t flags = CRYPT_VERITY_CREATE_HASH;
-	char *root_hash_bytes = NULL;
-	size_t root_hash_size;
-	int root_hash_fd = -1, i, r;
+	int r, input_fd = -1;
+
+	if (ARG_SET(OPT_DATA_INPUT_ID)) {
+		flags &= ~CRYPT_VERITY_CREATE_HASH;
+
+		/* Try to create data image if doesn't exist */
+		r = open(action_argv[0], O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
+		if (r < 0 && errno != EEXIST) {
+			log_err(_("Cannot create data image %s for writing."), action_argv[0]);
+			return -EINVAL;
+		} else if (r >= 0) {
+			log_dbg("Created data image %s.", action_argv[0]);
+			close(r);
+		}
+	}
 
 	/* Try to create hash image if doesn't exist */
 	r = open(action_argv[1], O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
@@ -105,6 +221,10 @@ static int action_format(void)
 	if ((r = crypt_init(&cd, action_argv[1])))
 		goto out;
 
+	if (ARG_SET(OPT_FEC_MEMORY_ID) &&
+	    (r = crypt_set_verity_fec_memory(cd, ARG_UINT64(OPT_FEC_MEMORY_ID))))
+		goto out;
+
 	if (ARG_SET(OPT_NO_SUPERBLOCK_ID))
 		flags |= CRYPT_VERITY_NO_HEADER;
 
@@ -112,50 +232,235 @@ static int action_format(void)
 	if (r < 0)
 		goto out;
 
+	if (ARG_SET(OPT_DATA_INPUT_ID)) {
+		input_fd = _open_data_input(&params);
+		if (input_fd < 0) {
+			r = input_fd;
+			goto out;
+		}
+	}
+
 	r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, ARG_STR(OPT_UUID_ID), NULL, 0, &params);
 	if (r < 0)
 		goto out;
 
+	if (input_fd >= 0 && (r = _format_from_input(cd, input_fd)) < 0)
+		goto out;
+
 	crypt_dump(cd);
 
 	/* Create or overwrite the root hash file */
-	if (ARG_SET(OPT_ROOT_HASH_FILE_ID)) {
-		root_hash_size = crypt_get_volume_key_size(cd);
-		root_hash_bytes = malloc(root_hash_size);
-		if (!root_hash_bytes) {
-			r = -ENOMEM;
+	if (ARG_SET(OPT_ROOT_HASH_FILE_ID))
+		r = _write_root_hash_file(cd);
+out:
+	if (input_fd >= 0)
+		close(input_fd);
+	crypt_free(cd);
+	free(CONST_CAST(char*)params.salt);
+	return r;
+}
+
+struct format_multi_image {
+	const char *data_device;
+	struct crypt_device *cd;
+	struct crypt_params_verity params;
+	int r;
+};
+
+struct format_multi {
+	struct format_multi_image *images;
+	unsigned count;
+	unsigned next;
+	pthread_mutex_t lock;
+};
+
+static void *_format_multi_worker(void *arg)
+{
+	struct format_multi *m = arg;
+	struct format_multi_image *img;
+	unsigned i;
+
+	while (1) {
+		pthread_mutex_lock(&m->lock);
+		i = m->next++;
+		pthread_mutex_unlock(&m->lock);
+		if (i >= m->count)
+			break;
+
+		img = &m->images[i];
+		img->r = crypt_format(img->cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, &img->params);
+	}
+
+	return NULL;
+}
+
+static int _format_multi_manifest(struct format_multi_image *img)
+{
+	char *root_hash;
+	size_t root_hash_size, i;
+	int r;
+
+	root_hash_size = crypt_get_volume_key_size(img->cd);
+	root_hash = malloc(root_hash_size);
+	if (!root_hash)
+		return -ENOMEM;
+
+	r = crypt_volume_key_get(img->cd, CRYPT_ANY_SLOT, root_hash, &root_hash_size, NULL, 0);
+	if (r >= 0) {
+		log_std("%s %" PRIu64 " ", img->data_device, img->params.hash_area_offset);
+		for (i = 0; i < root_hash_size; i++)
+			log_std("%02hhx", root_hash[i]);
+		log_std("\n");
+		r = 0;
+	}
+
+	free(root_hash);
+	return r;
+}
+
+/*
+ * All data images are hashed into one hash device, hash areas follow each other
+ * from --hash-offset. Images are formatted concurrently by a pool of threads,
+ * online CPUs are split among the images in progress for their hashing threads.
+ */
+static int action_format_multi(void)
+{
+	struct format_multi m = { .count = action_argc - 1 };
+	pthread_t threads[VERITY_MULTI_MAX_THREADS];
+	const char *hash_device = action_argv[0];
+	uint32_t flags = CRYPT_VERITY_CREATE_HASH;
+	uint64_t offset, size;
+	unsigned i, cpus, workers, started = 0;
+	int r;
+
+	if (ARG_SET(OPT_DATA_BLOCKS_ID) || ARG_SET(OPT_FEC_DEVICE_ID) || ARG_SET(OPT_UUID_ID)) {
+		log_err(_("Options --data-blocks, --fec-device and --uuid cannot be used with multiple images."));
+		return -EINVAL;
+	}
+
+	if (ARG_SET(OPT_NO_SUPERBLOCK_ID))
+		flags |= CRYPT_VERITY_NO_HEADER;
+
+	/* Try to create hash image if doesn't exist */
+	r = open(hash_device, O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
+	if (r < 0 && errno != EEXIST) {
+		log_err(_("Cannot create hash image %s for writing."), hash_device);
+		return -EINVAL;
+	} else if (r >= 0) {
+		log_dbg("Created hash image %s.", hash_device);
+		close(r);
+	}
+
+	m.images = calloc(m.count, sizeof(*m.images));
+	if (!m.images)
+		return -ENOMEM;
+
+	cpus = (unsigned)sysconf(_SC_NPROCESSORS_ONLN) ?: 1;
+	workers = ARG_UINT32(OPT_THREADS_ID) ?: cpus;
+	if (workers > m.count)
+		workers = m.count;
+	if (workers > VERITY_MULTI_MAX_THREADS)
+		workers = VERITY_MULTI_MAX_THREADS;
+
+	offset = ARG_UINT64(OPT_HASH_OFFSET_ID);
+	for (i = 0; i < m.count; i++) {
+		m.images[i].data_device = action_argv[i + 1];
+		m.images[i].r = -EINVAL;
+
+		if ((r = crypt_init_data_device(&m.images[i].cd, hash_device, m.images[i].data_device)))
 			goto out;
-		}
 
-		r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, root_hash_bytes, &root_hash_size, NULL, 0);
+		r = _prepare_format(&m.images[i].params, m.images[i].data_device, flags);
 		if (r < 0)
 			goto out;
+		m.images[i].params.hash_area_offset = offset;
 
-		root_hash_fd = open(ARG_STR(OPT_ROOT_HASH_FILE_ID), O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
-		if (root_hash_fd == -1) {
-			log_err(_("Cannot create root hash file %s for writing."), ARG_STR(OPT_ROOT_HASH_FILE_ID));
-			r = -EINVAL;
+		r = crypt_verity_hash_area_size(m.images[i].cd, &m.images[i].params, &size);
+		if (r < 0)
 			goto out;
-		}
 
-		for (i = 0; i < (int)root_hash_size; i++)
-			if (dprintf(root_hash_fd, "%02hhx", root_hash_bytes[i]) != 2) {
-				log_err(_("Cannot write to root hash file %s."), ARG_STR(OPT_ROOT_HASH_FILE_ID));
-				r = -EIO;
-				goto out;
-			}
+		if ((r = crypt_set_verity_threads(m.images[i].cd, cpus / workers ?: 1)))
+			goto out;
+
+		log_dbg("Image %s uses hash area %" PRIu64 "-%" PRIu64 ".",
+			m.images[i].data_device, offset, offset + size);
+		offset += (size + VERITY_MULTI_ALIGN - 1) / VERITY_MULTI_ALIGN * VERITY_MULTI_ALIGN;
+	}
 
-		log_dbg("Created root hash file %s.", ARG_STR(OPT_ROOT_HASH_FILE_ID));
+	if (pthread_mutex_init(&m.lock, NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 1; i < workers; i++)
+		if (!pthread_create(&threads[started], NULL, _format_multi_worker, &m))
+			started++;
+
+	/* caller thread works too, so images are formatted even if no thread starts */
+	_format_multi_worker(&m);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&m.lock);
+
+	r = 0;
+	for (i = 0; i < m.count; i++) {
+		if (m.images[i].r < 0) {
+			log_err(_("Cannot format image %s."), m.images[i].data_device);
+			r = m.images[i].r;
+		} else if (!r)
+			r = _format_multi_manifest(&m.images[i]);
 	}
 out:
-	crypt_free(cd);
-	free(CONST_CAST(char*)params.salt);
-	free(root_hash_bytes);
-	if (root_hash_fd != -1)
-		close(root_hash_fd);
+	for (i = 0; i < m.count; i++) {
+		crypt_free(m.images[i].cd);
+		free(CONST_CAST(char*)m.images[i].params.salt);
+	}
+	free(m.images);
+	return r;
+}
+
+/* x^n without libm */
+static double _power(double x, uint64_t n)
+{
+	double r = 1.0;
+
+	while (n) {
+		if (n & 1)
+			r *= x;
+		x *= x;
+		n >>= 1;
+	}
+
 	return r;
 }
 
+static int _verify_sample(struct crypt_device *cd, const char *root_hash, size_t root_hash_size)
+{
+	struct crypt_params_verity vp;
+	uint64_t samples = ARG_UINT64(OPT_SAMPLE_ID), verified;
+	uint32_t flags = ARG_SET(OPT_SAMPLE_STRIDED_ID) ? CRYPT_VERITY_SAMPLE_STRIDED : 0;
+	int r;
+
+	r = crypt_verity_verify_sample(cd, root_hash, root_hash_size, samples, flags, &verified);
+	if (r < 0)
+		return r;
+
+	r = crypt_get_verity_info(cd, &vp);
+	if (r < 0 || !vp.data_size)
+		return r;
+
+	log_std(_("Hash tree verified, %" PRIu64 " of %" PRIu64 " data blocks verified (%.2f%%).\n"),
+		verified, vp.data_size, 100.0 * verified / vp.data_size);
+
+	/* parts are sampled independently, miss probability is at most (1 - 0.01)^samples */
+	if (!flags && verified < vp.data_size)
+		log_std(_("Corruption of at least 1%% of data area is detected with probability %.4f%%.\n"),
+			100.0 * (1.0 - _power(0.99, samples)));
+
+	return 0;
+}
+
 static int _activate(const char *dm_device,
 		      const char *data_device,
 		      const char *hash_device,
@@ -174,6 +479,10 @@ static int _activate(const char *dm_device,
 	if ((r = crypt_init_data_device(&cd, hash_device, data_device)))
 		goto out;
 
+	if (ARG_SET(OPT_FEC_MEMORY_ID) &&
+	    (r = crypt_set_verity_fec_memory(cd, ARG_UINT64(OPT_FEC_MEMORY_ID))))
+		goto out;
+
 	if (ARG_SET(OPT_IGNORE_CORRUPTION_ID))
 		activate_flags |= CRYPT_ACTIVATE_IGNORE_CORRUPTION;
 	if (ARG_SET(OPT_RESTART_ON_CORRUPTION_ID))
@@ -243,6 +552,15 @@ static int _activate(const char *dm_device,
 		goto out;
 	}
 
+	/* signature cached by previous activation, file is read only if missing */
+	if (dm_device && (flags & CRYPT_VERITY_ROOT_HASH_SIGNATURE_CACHE)) {
+		r = crypt_activate_by_signed_key(cd, dm_device, root_hash_bytes, hash_size,
+						 NULL, 0, activate_flags);
+		if (!r || (r != -ENOKEY && !ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID)))
+			goto out;
+		log_dbg("Cached root hash signature not used (%d).", r);
+	}
+
 	if (ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID)) {
 		// FIXME: check max file size
 		if (stat(ARG_STR(OPT_ROOT_HASH_SIGNATURE_ID), &st) || !S_ISREG(st.st_mode) || !st.st_size) {
@@ -257,6 +575,11 @@ static int _activate(const char *dm_device,
 			goto out;
 		}
 	}
+	if (!dm_device && ARG_SET(OPT_SAMPLE_ID)) {
+		r = _verify_sample(cd, root_hash_bytes, hash_size);
+		goto out;
+	}
+
 	r = crypt_activate_by_signed_key(cd, dm_device,
 					 root_hash_bytes,
 					 hash_size,
@@ -284,7 +607,8 @@ static int action_open(void)
 			 action_argv[0],
 			 action_argv[2],
 			 ARG_SET(OPT_ROOT_HASH_FILE_ID) ? NULL : action_argv[3],
-			 ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID) ? CRYPT_VERITY_ROOT_HASH_SIGNATURE : 0);
+			 (ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID) ? CRYPT_VERITY_ROOT_HASH_SIGNATURE : 0) |
+			 (ARG_SET(OPT_ROOT_HASH_SIGNATURE_CACHE_ID) ? CRYPT_VERITY_ROOT_HASH_SIGNATURE_CACHE : 0));
 }
 
 static int action_verify(void)
@@ -301,6 +625,110 @@ static int action_verify(void)
 			 CRYPT_VERITY_CHECK_HASH);
 }
 
+/* Parse list of inclusive data block ranges "a-b,c,..." */
+static int _parse_changed_blocks(const char *arg, struct crypt_verity_range **ranges,
+				 unsigned int *count)
+{
+	struct crypt_verity_range *r = NULL, *tmp;
+	unsigned int n = 0;
+	uint64_t first, last;
+	const char *p = arg;
+	char *endp;
+
+	while (*p) {
+		errno = 0;
+		first = last = strtoull(p, &endp, 10);
+		if (errno || endp == p)
+			goto err;
+		if (*endp == '-') {
+			p = endp + 1;
+			last = strtoull(p, &endp, 10);
+			if (errno || endp == p || last < first)
+				goto err;
+		}
+		if (*endp != ',' && *endp != '\0')
+			goto err;
+		p = *endp ? endp + 1 : endp;
+
+		tmp = realloc(r, (n + 1) * sizeof(*r));
+		if (!tmp) {
+			free(r);
+			return -ENOMEM;
+		}
+		r = tmp;
+		r[n].offset = first;
+		r[n].length = last - first + 1;
+		n++;
+	}
+
+	if (!n)
+		goto err;
+
+	*ranges = r;
+	*count = n;
+	return 0;
+err:
+	log_err(_("Invalid changed blocks list %s."), arg);
+	free(r);
+	return -EINVAL;
+}
+
+static int action_update(void)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity params = {};
+	struct crypt_verity_range *ranges = NULL;
+	unsigned int ranges_count = 0;
+	int r;
+
+	if (!ARG_SET(OPT_OLD_DATA_DEVICE_ID) && !ARG_SET(OPT_CHANGED_BLOCKS_ID)) {
+		log_err(_("Option --old-data-device or --changed-blocks is required."));
+		return -EINVAL;
+	}
+
+	if (ARG_SET(OPT_CHANGED_BLOCKS_ID) &&
+	    (r = _parse_changed_blocks(ARG_STR(OPT_CHANGED_BLOCKS_ID), &ranges, &ranges_count)))
+		return r;
+
+	if ((r = crypt_init_data_device(&cd, action_argv[1], action_argv[0])))
+		goto out;
+
+	if (ARG_SET(OPT_FEC_MEMORY_ID) &&
+	    (r = crypt_set_verity_fec_memory(cd, ARG_UINT64(OPT_FEC_MEMORY_ID))))
+		goto out;
+
+	if (!ARG_SET(OPT_NO_SUPERBLOCK_ID)) {
+		params.hash_area_offset = ARG_UINT64(OPT_HASH_OFFSET_ID);
+		params.fec_area_offset = ARG_UINT64(OPT_FEC_OFFSET_ID);
+		params.fec_device = ARG_STR(OPT_FEC_DEVICE_ID);
+		params.fec_roots = ARG_UINT32(OPT_FEC_ROOTS_ID);
+		r = crypt_load(cd, CRYPT_VERITY, &params);
+		if (r)
+			log_err(_("Device %s is not a valid VERITY device."), action_argv[1]);
+	} else {
+		r = _prepare_format(&params, action_argv[0], CRYPT_VERITY_NO_HEADER);
+		if (r < 0)
+			goto out;
+		r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, &params);
+	}
+	if (r < 0)
+		goto out;
+
+	r = crypt_verity_update(cd, ARG_STR(OPT_OLD_DATA_DEVICE_ID), ranges, ranges_count);
+	if (r < 0)
+		goto out;
+
+	crypt_dump(cd);
+
+	if (ARG_SET(OPT_ROOT_HASH_FILE_ID))
+		r = _write_root_hash_file(cd);
+out:
+	crypt_free(cd);
+	free(CONST_CAST(char*)params.salt);
+	free(ranges);
+	return r;
+}
+
 static int action_close(void)
 {
 	struct crypt_device *cd = NULL;
@@ -487,11 +915,13 @@ static struct action_type {
 	const char *desc;
 } action_types[] = {
 	{ "format",	action_format, 2, N_("<data_device> <hash_device>"),N_("format device") },
+	{ "format-multi", action_format_multi, 2, N_("<hash_device> <data_device> [<data_device>...]"),N_("format more data devices with one shared hash device") },
 	{ "verify",	action_verify, 2, N_("<data_device> <hash_device> [<root_hash>]"),N_("verify device") },
 	{ "open",	action_open,   3, N_("<data_device> <name> <hash_device> [<root_hash>]"),N_("open device as <name>") },
 	{ "close",	action_close,  1, N_("<name>"),N_("close device (remove mapping)") },
 	{ "status",	action_status, 1, N_("<name>"),N_("show active device status") },
 	{ "dump",	action_dump,   1, N_("<hash_device>"),N_("show on-disk information") },
+	{ "update",	action_update, 2, N_("<data_device> <hash_device>"),N_("update hash tree for changed data blocks") },
 	{ NULL, NULL, 0, NULL, NULL }
 };
 
@@ -23,18 +23,23 @@
 
 ARG(OPT_CANCEL_DEFERRED, '\0', POPT_ARG_NONE, N_("Cancel a previously set deferred device removal"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEFERRED_ACTIONS)
 
+ARG(OPT_CHANGED_BLOCKS, '\0', POPT_ARG_STRING, N_("List of changed data blocks (e.g. 0-9,15)"), N_("list"), CRYPT_ARG_STRING, {}, OPT_CHANGED_BLOCKS_ACTIONS)
+
 ARG(OPT_CHECK_AT_MOST_ONCE, '\0', POPT_ARG_NONE, N_("Verify data block only the first time it is read"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_DATA_BLOCK_SIZE, '\0', POPT_ARG_STRING, N_("Block size on the data device"), N_("bytes"), CRYPT_ARG_UINT32, { .u32_value = DEFAULT_VERITY_DATA_BLOCK }, {})
 
 ARG(OPT_DATA_BLOCKS, '\0', POPT_ARG_STRING, N_("The number of blocks in the data file"), N_("blocks"), CRYPT_ARG_UINT64, {}, {})
 
+ARG(OPT_DATA_INPUT, '\0', POPT_ARG_STRING, N_("Write data read from file (or stdin) to data device and hash it in the same pass"), N_("path"), CRYPT_ARG_STRING, {}, OPT_DATA_INPUT_ACTIONS)
 ARG(OPT_DEBUG, '\0', POPT_ARG_NONE, N_("Show debug messages"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_DEFERRED, '\0', POPT_ARG_NONE, N_("Device removal is deferred until the last user closes it"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEFERRED_ACTIONS)
 
 ARG(OPT_FEC_DEVICE, '\0', POPT_ARG_STRING, N_("Path to device with error correction data"), N_("path"), CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_FEC_MEMORY, '\0', POPT_ARG_STRING, N_("Memory limit for FEC calculation buffers"), N_("kilobytes"), CRYPT_ARG_UINT64, {}, OPT_FEC_MEMORY_ACTIONS)
+
 ARG(OPT_FEC_OFFSET, '\0', POPT_ARG_STRING, N_("Starting offset on the FEC device"), N_("bytes"), CRYPT_ARG_UINT64, {}, {})
 
 ARG(OPT_FEC_ROOTS, '\0', POPT_ARG_STRING, N_("FEC parity bytes"), N_("bytes"), CRYPT_ARG_UINT32, { .u32_value = DEFAULT_VERITY_FEC_ROOTS }, {})
@@ -53,6 +58,8 @@ ARG(OPT_IGNORE_ZERO_BLOCKS, '\0', POPT_ARG_NONE, N_("Do not verify zeroed blocks
 
 ARG(OPT_NO_SUPERBLOCK, '\0', POPT_ARG_NONE, N_("Do not use verity superblock"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_OLD_DATA_DEVICE, '\0', POPT_ARG_STRING, N_("Path to previous version of data device"), N_("path"), CRYPT_ARG_STRING, {}, OPT_OLD_DATA_DEVICE_ACTIONS)
+
 ARG(OPT_PANIC_ON_CORRUPTION, '\0', POPT_ARG_NONE, N_("Panic kernel if corruption is detected"), NULL, CRYPT_ARG_BOOL, {}, OPT_PANIC_ON_CORRUPTION_ACTIONS)
 
 ARG(OPT_RESTART_ON_CORRUPTION, '\0', POPT_ARG_NONE, N_("Restart kernel if corruption is detected"), NULL, CRYPT_ARG_BOOL, {}, OPT_RESTART_ON_CORRUPTION_ACTIONS)
@@ -61,8 +68,16 @@ ARG(OPT_ROOT_HASH_FILE, '\0', POPT_ARG_STRING, N_("Path to root hash file"), NUL
 
 ARG(OPT_ROOT_HASH_SIGNATURE, '\0', POPT_ARG_STRING, N_("Path to root hash signature file"), NULL, CRYPT_ARG_STRING, {}, OPT_ROOT_HASH_SIGNATURE_ACTIONS)
 
+ARG(OPT_ROOT_HASH_SIGNATURE_CACHE, '\0', POPT_ARG_NONE, N_("Cache root hash signature in user keyring for repeated activations"), NULL, CRYPT_ARG_BOOL, {}, OPT_ROOT_HASH_SIGNATURE_CACHE_ACTIONS)
+
 ARG(OPT_SALT, 's', POPT_ARG_STRING, N_("Salt"), N_("hex string"), CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_SAMPLE, '\0', POPT_ARG_STRING, N_("Verify only data blocks covered by the number of sampled hash blocks"), N_("number"), CRYPT_ARG_UINT64, {}, OPT_SAMPLE_ACTIONS)
+
+ARG(OPT_SAMPLE_STRIDED, '\0', POPT_ARG_NONE, N_("Sample hash blocks in regular strides instead of random"), NULL, CRYPT_ARG_BOOL, {}, OPT_SAMPLE_STRIDED_ACTIONS)
+
+ARG(OPT_THREADS, '\0', POPT_ARG_STRING, N_("Number of data images hashed concurrently"), N_("threads"), CRYPT_ARG_UINT32, {}, OPT_THREADS_ACTIONS)
+
 ARG(OPT_USE_TASKLETS, '\0', POPT_ARG_NONE, N_("Use kernel tasklets for performance"), NULL, CRYPT_ARG_BOOL, {}, OPT_USE_TASKLETS_ACTIONS)
 
 ARG(OPT_UUID, '\0', POPT_ARG_STRING, N_("UUID for device to use"), NULL, CRYPT_ARG_STRING, {}, {})
@@ -28,17 +28,27 @@
 #define CLOSE_ACTION	"close"
 #define DUMP_ACTION	"dump"
 #define FORMAT_ACTION	"format"
+#define FORMAT_MULTI_ACTION	"format-multi"
 #define OPEN_ACTION	"open"
 #define STATUS_ACTION	"status"
+#define UPDATE_ACTION	"update"
 #define VERIFY_ACTION	"verify"
 
+#define OPT_CHANGED_BLOCKS_ACTIONS		{ UPDATE_ACTION }
+#define OPT_DATA_INPUT_ACTIONS			{ FORMAT_ACTION }
 #define OPT_DEFERRED_ACTIONS			{ CLOSE_ACTION }
+#define OPT_FEC_MEMORY_ACTIONS			{ FORMAT_ACTION, VERIFY_ACTION, UPDATE_ACTION }
 #define OPT_IGNORE_CORRUPTION_ACTIONS		{ OPEN_ACTION }
 #define OPT_IGNORE_ZERO_BLOCKS_ACTIONS		{ OPEN_ACTION }
 #define OPT_RESTART_ON_CORRUPTION_ACTIONS	{ OPEN_ACTION }
+#define OPT_OLD_DATA_DEVICE_ACTIONS		{ UPDATE_ACTION }
 #define OPT_PANIC_ON_CORRUPTION_ACTIONS		{ OPEN_ACTION }
-#define OPT_ROOT_HASH_FILE_ACTIONS		{ FORMAT_ACTION, OPEN_ACTION, VERIFY_ACTION }
+#define OPT_ROOT_HASH_FILE_ACTIONS		{ FORMAT_ACTION, OPEN_ACTION, VERIFY_ACTION, UPDATE_ACTION }
 #define OPT_ROOT_HASH_SIGNATURE_ACTIONS		{ OPEN_ACTION }
+#define OPT_ROOT_HASH_SIGNATURE_CACHE_ACTIONS	{ OPEN_ACTION }
+#define OPT_SAMPLE_ACTIONS			{ VERIFY_ACTION }
+#define OPT_SAMPLE_STRIDED_ACTIONS		{ VERIFY_ACTION }
+#define OPT_THREADS_ACTIONS			{ FORMAT_MULTI_ACTION }
 #define OPT_USE_TASKLETS_ACTIONS		{ OPEN_ACTION }
 
 enum {
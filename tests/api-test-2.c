@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <sys/types.h>
@@ -62,6 +63,7 @@ typedef int32_t key_serial_t;
 #define REQS_LUKS2_HEADER "luks2_header_requirements"
 #define NO_REQS_LUKS2_HEADER "luks2_header_requirements_free"
 #define BACKUP_FILE "csetup_backup_file"
+#define ARCHIVE_FILE "csetup_backup_archive"
 #define IMAGE1 "compatimage2.img"
 #define IMAGE_EMPTY "empty.img"
 #define IMAGE_EMPTY_SMALL "empty_small.img"
@@ -69,6 +71,7 @@ typedef int32_t key_serial_t;
 #define IMAGE_PV_LUKS2_SEC "blkid-luks2-pv.img"
 
 #define KEYFILE1 "key1.file"
+#define PBKDF_CACHE_FILE "pbkdf-cache.file"
 #define KEY1 "compatkey"
 
 #define KEYFILE2 "key2.file"
@@ -355,6 +358,7 @@ static void _cleanup(void)
 	remove(REQS_LUKS2_HEADER);
 	remove(NO_REQS_LUKS2_HEADER);
 	remove(BACKUP_FILE);
+	remove(ARCHIVE_FILE);
 	remove(IMAGE_PV_LUKS2_SEC);
 	remove(IMAGE_PV_LUKS2_SEC ".bcp");
 	remove(IMAGE_EMPTY_SMALL);
@@ -546,6 +550,8 @@ static int test_validate(struct crypt_device *cd __attribute__((unused)), const
 
 static void UseLuks2Device(void)
 {
+	struct crypt_activate_batch_entry batch[2];
+	struct crypt_active_device cad;
 	char key[128];
 	size_t key_size;
 
@@ -590,6 +596,46 @@ static void UseLuks2Device(void)
 	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 
+	// batch activation
+	memset(batch, 0, sizeof(batch));
+	batch[0].cd = batch[1].cd = cd;
+	batch[0].name = CDEVICE_1;
+	batch[0].keyslot = CRYPT_ANY_SLOT;
+	batch[0].passphrase = KEY1;
+	batch[0].passphrase_size = strlen(KEY1);
+	batch[1].name = CDEVICE_2;
+	batch[1].volume_key = key;
+	batch[1].volume_key_size = key_size;
+	batch[1].flags = CRYPT_ACTIVATE_SHARED;
+	FAIL_(crypt_activate_batch(NULL, 1), "no entries");
+	FAIL_(crypt_activate_batch(batch, 0), "no entries");
+	OK_(crypt_activate_batch(batch, 2));
+	EQ_(batch[0].result, 0);
+	EQ_(batch[1].result, 0);
+	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	GE_(crypt_status(cd, CDEVICE_2), CRYPT_ACTIVE);
+	FAIL_(crypt_activate_batch(batch, 2), "already open");
+	EQ_(batch[0].result, -EEXIST);
+	EQ_(batch[1].result, -EEXIST);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	OK_(crypt_deactivate(cd, CDEVICE_2));
+
+	// sharded dm-crypt mapping
+	FAIL_(crypt_set_dm_crypt_shards(NULL, 4), "no context");
+	FAIL_(crypt_set_dm_crypt_shards(cd, 100000), "too many shards");
+	OK_(crypt_set_dm_crypt_shards(cd, 4));
+	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0));
+	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	OK_(crypt_set_dm_crypt_shards(cd, 0));
+
+	// no inline encryption hardware on test device, dm-crypt fallback
+	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, CRYPT_ACTIVATE_INLINE_CRYPT));
+	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+	EQ_(cad.flags & CRYPT_ACTIVATE_INLINE_CRYPT, 0);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+
 	key[1] = ~key[1];
 	FAIL_(crypt_volume_key_verify(cd, key, key_size), "key mismatch");
 	FAIL_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0), "key mismatch");
@@ -665,6 +711,25 @@ static void SuspendDevice(void)
 	FAIL_(crypt_resume_by_volume_key(cd, CDEVICE_1, key, key_size), "wrong key");
 	OK_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key, &key_size, KEY1, strlen(KEY1)));
 	OK_(crypt_resume_by_volume_key(cd, CDEVICE_1, key, key_size));
+
+#ifdef KERNEL_KEYRING
+	/* Resume by wrapped volume key, wrapping PBKDF follows context */
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	FAIL_(crypt_suspend_wrapped_key(cd, CDEVICE_1, NULL, 0, "wrap", 4, 0), "no timeout");
+	suspend_status = crypt_suspend_wrapped_key(cd, CDEVICE_1, NULL, 0, "wrap", 4, 60);
+	if (suspend_status == -ENOKEY)
+		OK_(crypt_suspend_wrapped_key(cd, CDEVICE_1, key, key_size, "wrap", 4, 60));
+	else
+		OK_(suspend_status);
+	FAIL_(crypt_suspend_wrapped_key(cd, CDEVICE_1, key, key_size, "wrap", 4, 60), "already suspended");
+	EQ_(crypt_resume_by_wrapped_key(cd, CDEVICE_1, "wrong", 5), -EPERM);
+	OK_(crypt_resume_by_wrapped_key(cd, CDEVICE_1, "wrap", 4));
+	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+	EQ_(0, cad.flags & CRYPT_ACTIVATE_SUSPENDED);
+	OK_(crypt_suspend(cd, CDEVICE_1));
+	EQ_(crypt_resume_by_wrapped_key(cd, CDEVICE_1, "wrap", 4), -ENOKEY);
+	OK_(crypt_resume_by_volume_key(cd, CDEVICE_1, key, key_size));
+#endif
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 	CRYPT_FREE(cd);
 
@@ -922,6 +987,10 @@ static void AddDeviceLuks2(void)
 	EQ_(2, crypt_activate_by_keyfile(cd, NULL, CRYPT_ANY_SLOT, KEYFILE2, 0, 0));
 	EQ_(3, crypt_activate_by_keyfile_offset(cd, NULL, CRYPT_ANY_SLOT, KEYFILE2, 0, 1, 0));
 	EQ_(4, crypt_activate_by_keyfile_offset(cd, NULL, CRYPT_ANY_SLOT, KEYFILE1, 0, 1, 0));
+	/* keyslot hint must not change the result (second run uses stored hint) */
+	EQ_(3, crypt_activate_by_keyfile_offset(cd, NULL, CRYPT_ANY_SLOT, KEYFILE2, 0, 1, CRYPT_ACTIVATE_KEYSLOT_HINT));
+	EQ_(3, crypt_activate_by_keyfile_offset(cd, NULL, CRYPT_ANY_SLOT, KEYFILE2, 0, 1, CRYPT_ACTIVATE_KEYSLOT_HINT));
+	EQ_(2, crypt_activate_by_keyfile(cd, NULL, CRYPT_ANY_SLOT, KEYFILE2, 0, CRYPT_ACTIVATE_KEYSLOT_HINT));
 	FAIL_(crypt_activate_by_keyfile_offset(cd, CDEVICE_2, CRYPT_ANY_SLOT, KEYFILE2, strlen(KEY2), 2, 0), "not enough data");
 	FAIL_(crypt_activate_by_keyfile_offset(cd, CDEVICE_2, CRYPT_ANY_SLOT, KEYFILE2, 0, strlen(KEY2) + 1, 0), "cannot seek");
 	FAIL_(crypt_activate_by_keyfile_offset(cd, CDEVICE_2, CRYPT_ANY_SLOT, KEYFILE2, 0, 2, 0), "wrong key");
@@ -975,6 +1044,9 @@ static void AddDeviceLuks2(void)
 	reset_log();
 	OK_(crypt_dump_json(cd, &tmp_buf, 0));
 	OK_(!(tmp_buf && strlen(tmp_buf) != 0));
+	OK_(crypt_dump_json(cd, &tmp_buf, CRYPT_DUMP_JSON_COMPACT));
+	OK_(!(tmp_buf && strlen(tmp_buf) != 0));
+	EQ_(!!strchr(tmp_buf, '\n'), 0);
 
 	FAIL_(crypt_set_uuid(cd, "blah"), "wrong UUID format");
 	OK_(crypt_set_uuid(cd, DEVICE_TEST_UUID));
@@ -1039,6 +1111,67 @@ static void AddDeviceLuks2(void)
 	_cleanup_dmdevices();
 }
 
+static void Luks2FormatBatch(void)
+{
+	struct crypt_format_batch_entry e[3] = {};
+	char key[3][32];
+	size_t key_size;
+	uint64_t r_payload_offset;
+	int i;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_payload_offset + 1));
+	OK_(create_dmdevice_over_loop(L_DEVICE_0S, 8));
+	OK_(create_dmdevice_over_loop(L_DEVICE_1S, r_payload_offset + 1));
+
+	OK_(crypt_init(&e[0].cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_init(&e[1].cd, DMDIR L_DEVICE_0S));
+	OK_(crypt_init(&e[2].cd, DMDIR L_DEVICE_1S));
+	OK_(crypt_set_pbkdf_type(e[0].cd, &min_pbkdf2));
+
+	FAIL_(crypt_format_batch(e, 0, CRYPT_LUKS2, "aes", "xts-plain64", 32, PASSPHRASE, strlen(PASSPHRASE)), "No devices");
+	FAIL_(crypt_format_batch(e, 3, CRYPT_PLAIN, "aes", "xts-plain64", 32, PASSPHRASE, strlen(PASSPHRASE)), "Not LUKS");
+
+	// second device is too small, the others are formatted
+	EQ_(crypt_format_batch(e, 3, CRYPT_LUKS2, "aes", "xts-plain64", 32, PASSPHRASE, strlen(PASSPHRASE)), e[1].result);
+	OK_(e[0].result);
+	FAIL_(e[1].result, "Device too small");
+	OK_(e[2].result);
+	NULL_(crypt_get_type(e[1].cd));
+	for (i = 0; i < 3; i++)
+		CRYPT_FREE(e[i].cd);
+
+	for (i = 0; i < 3; i += 2) {
+		OK_(crypt_init(&cd, i ? DMDIR L_DEVICE_1S : DMDIR L_DEVICE_OK));
+		OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+		EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+		key_size = sizeof(key[i]);
+		EQ_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key[i], &key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+		EQ_(key_size, 32);
+		CRYPT_FREE(cd);
+	}
+	// every device has its own volume key
+	EQ_(!memcmp(key[0], key[2], sizeof(key[0])), 0);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	FAIL_(crypt_load(cd, CRYPT_LUKS2, NULL), "Not formatted");
+	CRYPT_FREE(cd);
+
+	// failure of the first device stops the batch
+	OK_(crypt_init(&e[0].cd, DMDIR L_DEVICE_0S));
+	OK_(crypt_init(&e[1].cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_set_pbkdf_type(e[0].cd, &min_pbkdf2));
+	OK_(crypt_wipe(e[1].cd, NULL, CRYPT_WIPE_ZERO, 0, 1024 * 1024, 1024 * 1024, 0, NULL, NULL));
+	FAIL_(crypt_format_batch(e, 2, CRYPT_LUKS2, "aes", "xts-plain64", 32, NULL, 0), "Device too small");
+	FAIL_(e[0].result, "Device too small");
+	EQ_(e[1].result, -EINVAL);
+	NULL_(crypt_get_type(e[1].cd));
+	FAIL_(crypt_load(e[1].cd, CRYPT_LUKS2, NULL), "Not formatted");
+	CRYPT_FREE(e[0].cd);
+	CRYPT_FREE(e[1].cd);
+
+	_cleanup_dmdevices();
+}
+
 static void Luks2MetadataSize(void)
 {
 	struct crypt_pbkdf_type pbkdf = {
@@ -1465,6 +1598,95 @@ static void Luks2HeaderLoad(void)
 	EQ_(strcmp(CRYPT_LUKS2, crypt_get_type(cd)), 0);
 	CRYPT_FREE(cd);
 
+	/* metadata cache must follow on-disk changes */
+	OK_(crypt_metadata_cache(NULL, 1));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_set_uuid(cd, DEVICE_TEST_UUID));
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(strcmp(DEVICE_TEST_UUID, crypt_get_uuid(cd)));
+	CRYPT_FREE(cd);
+	OK_(_system("dd if=/dev/zero of=" DMDIR L_DEVICE_0S " bs=512 count=8 2>/dev/null", 1));
+	OK_(_system("dd if=/dev/zero of=" DMDIR L_DEVICE_0S " bs=512 seek=32 count=8 2>/dev/null", 1));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_0S));
+	FAIL_(crypt_load(cd, CRYPT_LUKS2, NULL), "Header not found");
+	CRYPT_FREE(cd);
+	OK_(crypt_metadata_cache(NULL, 0));
+
+	_cleanup_dmdevices();
+}
+
+static void Luks2InitMemory(void)
+{
+	struct crypt_active_device cad;
+	uint64_t r_payload_offset;
+	size_t image_size;
+	char *image, zeros[4096] = {};
+	int fd;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_payload_offset + 1));
+	image_size = r_payload_offset * TST_SECTOR_SIZE;
+	image = malloc(image_size);
+	NOTNULL_(image);
+
+	// bad sizes
+	FAIL_(crypt_init_memory(NULL, NULL, 0, image_size, NULL), "No context");
+	FAIL_(crypt_init_memory(&cd, NULL, 0, 0, NULL), "No size");
+	NULL_(cd);
+	FAIL_(crypt_init_memory(&cd, NULL, sizeof(zeros), 0, NULL), "No buffer");
+	NULL_(cd);
+	FAIL_(crypt_init_memory(&cd, NULL, 0, image_size + 1, NULL), "Size not aligned to sector");
+	FAIL_(crypt_init_memory(&cd, zeros, sizeof(zeros) - 1, 0, NULL), "Size not aligned to sector");
+	NULL_(cd);
+
+	OK_(crypt_init_memory(&cd, NULL, 0, 1024 * 1024, NULL));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	FAIL_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL), "Device too small");
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init_memory(&cd, zeros, sizeof(zeros), 0, NULL));
+	FAIL_(crypt_load(cd, CRYPT_LUKS2, NULL), "No header");
+	CRYPT_FREE(cd);
+
+	// format in memory and read the image back
+	OK_(crypt_init_memory(&cd, NULL, 0, image_size + TST_SECTOR_SIZE, &fd));
+	GE_(fd, 0);
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_get_data_offset(cd), r_payload_offset);
+	EQ_((int)pread(fd, image, image_size, 0), (int)image_size);
+	CRYPT_FREE(cd);
+	OK_(memcmp(image, "LUKS\xba\xbe", 6));
+
+	// load in-memory header and activate the data device with it
+	OK_(crypt_init_memory(&cd, image, image_size, 0, NULL));
+	FAIL_(crypt_load(cd, CRYPT_LUKS1, NULL), "Wrong type");
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(strcmp(crypt_get_type(cd), CRYPT_LUKS2));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE1, strlen(PASSPHRASE1), 0), "Wrong passphrase");
+	EQ_(crypt_keyslot_add_by_passphrase(cd, 1, PASSPHRASE, strlen(PASSPHRASE), PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	OK_(crypt_set_data_device(cd, DMDIR L_DEVICE_OK));
+	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, 1, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+	EQ_(cad.offset, r_payload_offset);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	CRYPT_FREE(cd);
+
+	// the source buffer is not modified by the memory device
+	OK_(crypt_init_memory(&cd, image, image_size, 0, NULL));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_INACTIVE);
+	CRYPT_FREE(cd);
+
+	free(image);
 	_cleanup_dmdevices();
 }
 
@@ -1567,6 +1789,89 @@ static void Luks2HeaderBackup(void)
 	_cleanup_dmdevices();
 }
 
+static void Luks2BackupArchive(void)
+{
+	struct crypt_backup_archive *arc = NULL;
+	char uuid[UUID_STRING_L];
+	uint64_t r_payload_offset;
+	struct stat st;
+	off_t size;
+	int fd;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	strncpy(uuid, crypt_get_uuid(cd), sizeof(uuid) - 1);
+	uuid[sizeof(uuid) - 1] = '\0';
+
+	// unchanged header is stored only once
+	FAIL_(crypt_backup_archive_open(&arc, ARCHIVE_FILE, CRYPT_BACKUP_ARCHIVE_READONLY), "No archive");
+	OK_(crypt_backup_archive_open(&arc, ARCHIVE_FILE, 0));
+	OK_(crypt_backup_archive_add(arc, cd, CRYPT_LUKS2));
+	OK_(stat(ARCHIVE_FILE, &st));
+	size = st.st_size;
+	EQ_(crypt_backup_archive_add(arc, cd, CRYPT_LUKS2), 1);
+	crypt_backup_archive_free(arc);
+	OK_(crypt_backup_archive_open(&arc, ARCHIVE_FILE, 0));
+	EQ_(crypt_backup_archive_add(arc, cd, CRYPT_LUKS2), 1);
+	OK_(stat(ARCHIVE_FILE, &st));
+	EQ_(st.st_size, size);
+
+	// changed header is a new version
+	EQ_(crypt_keyslot_add_by_passphrase(cd, 1, PASSPHRASE, strlen(PASSPHRASE), PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	OK_(crypt_backup_archive_add(arc, cd, CRYPT_LUKS2));
+	OK_(stat(ARCHIVE_FILE, &st));
+	GE_(st.st_size, size + 1);
+	crypt_backup_archive_free(arc);
+	CRYPT_FREE(cd);
+
+	// restore the latest version over wiped header
+	OK_(_system("dd if=/dev/zero of=" DMDIR L_DEVICE_OK " bs=512 count=8 2>/dev/null", 1));
+	OK_(_system("dd if=/dev/zero of=" DMDIR L_DEVICE_OK " bs=512 seek=32 count=8 2>/dev/null", 1));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	FAIL_(crypt_load(cd, CRYPT_LUKS2, NULL), "Header wiped");
+	OK_(crypt_backup_archive_open(&arc, ARCHIVE_FILE, CRYPT_BACKUP_ARCHIVE_READONLY));
+	FAIL_(crypt_backup_archive_add(arc, cd, CRYPT_LUKS2), "Read-only archive");
+	EQ_(crypt_backup_archive_restore(arc, cd, CRYPT_LUKS2, DEVICE_TEST_UUID), -ENOENT);
+	OK_(crypt_backup_archive_restore(arc, cd, CRYPT_LUKS2, uuid));
+	crypt_backup_archive_free(arc);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(strcmp(crypt_get_uuid(cd), uuid));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+
+	// corrupted chunk (every chunk is referenced by the only entry)
+	remove(ARCHIVE_FILE);
+	OK_(crypt_backup_archive_open(&arc, ARCHIVE_FILE, 0));
+	OK_(crypt_backup_archive_add(arc, cd, CRYPT_LUKS2));
+	crypt_backup_archive_free(arc);
+	fd = open(ARCHIVE_FILE, O_RDWR);
+	NOTFAIL_(fd, "Cannot open archive.");
+	// first chunk payload follows file header (16 bytes) and record header (48 bytes)
+	EQ_(pwrite(fd, "X", 1, 64 + 1), 1);
+	close(fd);
+	OK_(crypt_backup_archive_open(&arc, ARCHIVE_FILE, CRYPT_BACKUP_ARCHIVE_READONLY));
+	FAIL_(crypt_backup_archive_restore(arc, cd, CRYPT_LUKS2, uuid), "Corrupted archive");
+	crypt_backup_archive_free(arc);
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	CRYPT_FREE(cd);
+
+	// not an archive
+	fd = open(ARCHIVE_FILE, O_RDWR);
+	NOTFAIL_(fd, "Cannot open archive.");
+	EQ_(pwrite(fd, "X", 1, 0), 1);
+	close(fd);
+	FAIL_(crypt_backup_archive_open(&arc, ARCHIVE_FILE, 0), "Bad magic");
+
+	remove(ARCHIVE_FILE);
+	_cleanup_dmdevices();
+}
+
 static void ResizeDeviceLuks2(void)
 {
 	struct crypt_pbkdf_type pbkdf = {
@@ -1942,6 +2247,17 @@ static void Tokens(void)
 	struct crypt_token_params_luks2_keyring params = {
 		.key_description = "desc"
 	};
+	struct crypt_token_params_luks2_usbkey usbkey = {
+		.uuid = "1234-ABCD",
+		.key_offset = 4096,
+		.key_size = 64,
+		.timeout = 5
+	}, usbkey_invalid = {
+		.uuid = "1234-ABCD",
+		.partuuid = "1234-ABCD",
+		.key_size = 64
+	}, usbkey_params;
+	struct crypt_token_open_stats token_stats;
 	uint64_t r_payload_offset;
 
 	OK_(crypt_token_register(&th));
@@ -2003,6 +2319,11 @@ static void Tokens(void)
 	EQ_(crypt_token_assign_keyslot(cd, 0, 3), 0);
 
 	EQ_(crypt_activate_by_token(cd, NULL, 2, passptr, 0), 0);
+	OK_(crypt_token_open_stats(cd, 2, &token_stats));
+	EQ_(token_stats.result, 0);
+	OK_(strcmp(token_stats.type, th3.name));
+	EQ_(crypt_token_open_stats(cd, 0, &token_stats), -ENOENT);
+	FAIL_(crypt_token_open_stats(cd, 32, &token_stats), "Invalid token id.");
 	EQ_(crypt_activate_by_token(cd, NULL, 0, passptr1, CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY), 3);
 	// FIXME: useless error message here (or missing one to be specific)
 	FAIL_(crypt_activate_by_token(cd, CDEVICE_1, 0, passptr1, 0), "No volume key available in token keyslots");
@@ -2049,6 +2370,26 @@ static void Tokens(void)
 	EQ_(crypt_token_luks2_keyring_get(cd, 10, &params), 10);
 	OK_(strcmp(params.key_description, "my_desc"));
 
+	// builtin luks2-usbkey token
+	FAIL_(crypt_token_luks2_usbkey_set(cd, CRYPT_ANY_TOKEN, &usbkey_invalid), "Both uuid and partuuid set.");
+	EQ_(crypt_token_luks2_usbkey_set(cd, 13, &usbkey), 13);
+	EQ_(crypt_token_status(cd, 13, &dummy), CRYPT_TOKEN_INTERNAL);
+	OK_(strcmp(dummy, "luks2-usbkey"));
+	FAIL_(crypt_token_luks2_keyring_get(cd, 13, &params), "Token is not luks2-keyring type");
+	FAIL_(crypt_token_luks2_usbkey_get(cd, 10, &usbkey_params), "Token is not luks2-usbkey type");
+	EQ_(crypt_token_luks2_usbkey_get(cd, 13, &usbkey_params), 13);
+	OK_(strcmp(usbkey_params.uuid, "1234-ABCD"));
+	OK_(!!usbkey_params.partuuid);
+	EQ_(usbkey_params.key_offset, 4096);
+	EQ_(usbkey_params.key_size, 64);
+	EQ_(usbkey_params.timeout, 5);
+	EQ_(crypt_token_json_set(cd, 13, NULL), 13);
+	FAIL_(crypt_token_json_set(cd, 13, "{\"type\":\"luks2-usbkey\",\"keyslots\":[],\"uuid\":\"../sda\","
+		"\"key_offset\":\"0\",\"key_size\":64}"), "UUID is used in device path.");
+	FAIL_(crypt_token_json_set(cd, 13, "{\"type\":\"luks2-usbkey\",\"keyslots\":[],\"uuid\":\"1234-ABCD\","
+		"\"key_offset\":\"0\",\"key_size\":0}"), "Key size must not be zero.");
+	EQ_(crypt_token_status(cd, 13, NULL), CRYPT_TOKEN_INACTIVE);
+
 	OK_(crypt_token_is_assigned(cd, 10, 1));
 	// unassigned tests
 	EQ_(crypt_token_is_assigned(cd, 10, 21), -ENOENT);
@@ -2142,6 +2483,41 @@ static void Tokens(void)
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 	CRYPT_FREE(cd);
 
+	// metadata batch
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	FAIL_(crypt_metadata_commit(cd), "No batch started");
+	OK_(crypt_metadata_begin(cd));
+	FAIL_(crypt_metadata_begin(cd), "Batch already started");
+	EQ_(crypt_token_json_set(cd, 20, TEST_TOKEN_JSON("\"0\"")), 20);
+	FAIL_(crypt_load(cd, CRYPT_LUKS2, NULL), "Uncommitted batch");
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_token_status(cd, 20, NULL), CRYPT_TOKEN_INACTIVE);
+	OK_(crypt_metadata_begin(cd));
+	EQ_(crypt_token_json_set(cd, 20, TEST_TOKEN_JSON("\"0\"")), 20);
+	EQ_(crypt_token_json_set(cd, 21, TEST_TOKEN_JSON("\"1\"")), 21);
+	FAIL_(crypt_token_json_set(cd, 22, TEST_TOKEN_JSON_INVALID("\"1\"")), "Token validation failed");
+	EQ_(crypt_token_json_set(cd, 20, NULL), 20);
+	OK_(crypt_metadata_commit(cd));
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_1S));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_token_status(cd, 20, NULL), CRYPT_TOKEN_INACTIVE);
+	EQ_(crypt_token_status(cd, 21, NULL), CRYPT_TOKEN_EXTERNAL);
+	EQ_(crypt_token_status(cd, 22, NULL), CRYPT_TOKEN_INACTIVE);
+
+	// token prefetch, secret is used instead of handler open (once)
+	EQ_(crypt_token_json_set(cd, 22, TEST_TOKEN_JSON("\"8\"")), 22);
+	FAIL_(crypt_token_prefetch(cd, 23, NULL, passptr1), "No such token");
+	OK_(crypt_token_prefetch(cd, 22, NULL, passptr1));
+	FAIL_(crypt_token_prefetch(cd, 22, NULL, passptr1), "Prefetch already started");
+	EQ_(crypt_activate_by_token(cd, NULL, 22, passptr, 0), 8);
+	EQ_(crypt_activate_by_token(cd, NULL, 22, passptr, 0), -EPERM);
+	EQ_(crypt_token_json_set(cd, 22, NULL), 22);
+	CRYPT_FREE(cd);
+
 	EQ_(crypt_token_max(CRYPT_LUKS2), 32);
 	FAIL_(crypt_token_max(CRYPT_LUKS1), "No token support in LUKS1");
 	FAIL_(crypt_token_max(NULL), "No LUKS format specified");
@@ -2920,6 +3296,15 @@ static void Pbkdf(void)
 
 	NULL_(pbkdf = crypt_get_pbkdf_default(CRYPT_PLAIN));
 
+	// calibration cache
+	crypt_pbkdf_cache_invalidate(NULL);
+	FAIL_(crypt_pbkdf_cache_export(NULL, NULL), "No file");
+	FAIL_(crypt_pbkdf_cache_import(NULL, NULL), "No file");
+	FAIL_(crypt_pbkdf_cache_import(NULL, PBKDF_CACHE_FILE), "File does not exist");
+	OK_(crypt_pbkdf_cache_export(NULL, PBKDF_CACHE_FILE));
+	EQ_(crypt_pbkdf_cache_import(NULL, PBKDF_CACHE_FILE), 0);
+	remove(PBKDF_CACHE_FILE);
+
 	_cleanup_dmdevices();
 }
 
@@ -2974,6 +3359,11 @@ static void Luks2KeyslotAdd(void)
 	/* otoh passphrase check should pass */
 	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY), 1);
 	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY), 1);
+	/* parallel keyslot trial must give the same results */
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_ACTIVATE_PARALLEL_KEYSLOTS), "No keyslot assigned to volume with this passphrase");
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY | CRYPT_ACTIVATE_PARALLEL_KEYSLOTS), 1);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY | CRYPT_ACTIVATE_PARALLEL_KEYSLOTS), 0);
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, "wrong", 5, CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY | CRYPT_ACTIVATE_PARALLEL_KEYSLOTS), "Wrong passphrase");
 	/* in general crypt_keyslot_add_by_key must allow any reasonable key size
 	 * even though such keyslot will not be usable for segment encryption */
 	EQ_(crypt_keyslot_add_by_key(cd, 2, key2, key_size-1, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_VOLUME_KEY_NO_SEGMENT), 2);
@@ -3070,6 +3460,9 @@ static void Luks2KeyslotParams(void)
 	const char *vk_hex2 = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1e";
 	size_t key_size_ret, key_size = strlen(vk_hex) / 2, keyslot_key_size = 16;
 	uint64_t r_payload_offset;
+	struct crypt_keyslot_context *kcs[2];
+	struct crypt_pbkdf_type pbkdf;
+	int rewrap_slots[] = { 0, 10 };
 
 	crypt_decode_key(key, vk_hex, key_size);
 	crypt_decode_key(key2, vk_hex2, key_size);
@@ -3167,6 +3560,26 @@ static void Luks2KeyslotParams(void)
 	OK_(strcmp(crypt_keyslot_get_encryption(cd, 0, &key_size_ret), cipher_keyslot));
 	EQ_(key_size_ret, keyslot_key_size);
 
+	/* Re-wrap more keyslots at once, every credential must open its keyslot */
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, PASSPHRASE1, strlen(PASSPHRASE1), &kcs[0]));
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, PASSPHRASE, strlen(PASSPHRASE), &kcs[1]));
+	OK_(crypt_set_pbkdf_type(cd, &min_argon2));
+	OK_(crypt_keyslot_rewrap_by_keyslot_context(cd, rewrap_slots, kcs, 2));
+	OK_(crypt_keyslot_get_pbkdf(cd, 0, &pbkdf));
+	OK_(strcmp(pbkdf.type, CRYPT_KDF_ARGON2ID));
+	OK_(crypt_keyslot_get_pbkdf(cd, 10, &pbkdf));
+	OK_(strcmp(pbkdf.type, CRYPT_KDF_ARGON2ID));
+	EQ_(0, crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE1, strlen(PASSPHRASE1), 0));
+	EQ_(10, crypt_activate_by_passphrase(cd, NULL, 10, PASSPHRASE, strlen(PASSPHRASE), 0));
+	rewrap_slots[1] = 1;
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	FAIL_(crypt_keyslot_rewrap_by_keyslot_context(cd, rewrap_slots, kcs, 2), "wrong passphrase for keyslot 1");
+	OK_(crypt_keyslot_get_pbkdf(cd, 0, &pbkdf));
+	OK_(strcmp(pbkdf.type, CRYPT_KDF_ARGON2ID));
+	EQ_(0, crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE1, strlen(PASSPHRASE1), 0));
+	crypt_keyslot_context_free(kcs[0]);
+	crypt_keyslot_context_free(kcs[1]);
+
 	CRYPT_FREE(cd);
 
 	/* LUKS1 compatible calls */
@@ -3267,6 +3680,180 @@ static void Luks2ActivateByKeyring(void)
 #endif
 }
 
+static struct {
+	int r;
+	int calls;
+} async_done;
+
+static void async_done_cb(struct crypt_async *async __attribute__((unused)), int r,
+			  void *usrptr __attribute__((unused)))
+{
+	async_done.r = r;
+	async_done.calls++;
+}
+
+/* application executor that holds the task until the test runs it */
+static struct {
+	void (*task)(void *task_arg);
+	void *task_arg;
+} held;
+
+static int held_submit(void (*task)(void *task_arg), void *task_arg, void *usrptr __attribute__((unused)))
+{
+	if (held.task)
+		return -EBUSY;
+
+	held.task = task;
+	held.task_arg = task_arg;
+	return 0;
+}
+
+static int async_wait(struct crypt_async *async)
+{
+	struct pollfd pfd = { .fd = crypt_async_fd(async), .events = POLLIN };
+
+	return poll(&pfd, 1, 30000) == 1 ? 0 : -ETIMEDOUT;
+}
+
+static void Luks2ActivateAsync(void)
+{
+	struct crypt_async *async = NULL, *async2 = NULL;
+	uint64_t r_payload_offset;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	FAIL_(crypt_activate_by_passphrase_async(cd, CDEVICE_1, 0, NULL, 0, 0, NULL, NULL, &async), "No passphrase");
+	FAIL_(crypt_activate_by_passphrase_async(NULL, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), 0, NULL, NULL, &async), "No device");
+	EQ_(crypt_async_result(NULL), -EINVAL);
+
+	// completion
+	memset(&async_done, 0, sizeof(async_done));
+	OK_(crypt_activate_by_passphrase_async(cd, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), 0,
+					       async_done_cb, NULL, &async));
+	OK_(async_wait(async));
+	EQ_(crypt_async_result(async), 0);
+	EQ_(crypt_async_progress(async), CRYPT_ASYNC_DONE);
+	EQ_(crypt_async_cancel(async), -EALREADY);
+	EQ_(async_done.calls, 1);
+	EQ_(async_done.r, 0);
+	crypt_async_free(async);
+	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+
+	// error (wrong passphrase)
+	memset(&async_done, 0, sizeof(async_done));
+	OK_(crypt_activate_by_passphrase_async(cd, CDEVICE_1, 0, PASSPHRASE1, strlen(PASSPHRASE1), 0,
+					       async_done_cb, NULL, &async));
+	OK_(async_wait(async));
+	EQ_(crypt_async_result(async), -EPERM);
+	EQ_(async_done.calls, 1);
+	EQ_(async_done.r, -EPERM);
+	crypt_async_free(async);
+	EQ_(crypt_status(cd, CDEVICE_1), CRYPT_INACTIVE);
+
+	// cancellation before the task runs
+	memset(&async_done, 0, sizeof(async_done));
+	memset(&held, 0, sizeof(held));
+	OK_(crypt_set_executor(held_submit, 0, NULL));
+	OK_(crypt_activate_by_passphrase_async(cd, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), 0,
+					       async_done_cb, NULL, &async));
+	NOTNULL_(held.task);
+	EQ_(crypt_async_progress(async), CRYPT_ASYNC_QUEUED);
+	EQ_(crypt_async_result(async), -EINPROGRESS);
+	FAIL_(crypt_activate_by_passphrase_async(cd, CDEVICE_2, 0, PASSPHRASE, strlen(PASSPHRASE), 0,
+						 NULL, NULL, &async2), "Activation already running");
+	EQ_(crypt_set_executor(NULL, 0, NULL), -EBUSY);
+	OK_(crypt_async_cancel(async));
+	held.task(held.task_arg);
+	OK_(async_wait(async));
+	EQ_(crypt_async_result(async), -ECANCELED);
+	EQ_(async_done.calls, 1);
+	EQ_(async_done.r, -ECANCELED);
+	crypt_async_free(async);
+	OK_(crypt_set_executor(NULL, 0, NULL));
+	EQ_(crypt_status(cd, CDEVICE_1), CRYPT_INACTIVE);
+
+	// without executor thread it completes in the caller
+	OK_(crypt_set_executor(NULL, 1, NULL));
+	memset(&async_done, 0, sizeof(async_done));
+	OK_(crypt_activate_by_passphrase_async(cd, NULL, 0, PASSPHRASE, strlen(PASSPHRASE), 0,
+					       async_done_cb, NULL, &async));
+	EQ_(async_done.calls, 1);
+	EQ_(crypt_async_result(async), 0);
+	crypt_async_free(async);
+	OK_(crypt_set_executor(NULL, 0, NULL));
+
+	CRYPT_FREE(cd);
+	_cleanup_dmdevices();
+}
+
+static void Luks2VolumeKeySession(void)
+{
+	struct crypt_keyslot_context *kc, *kc1;
+	uint64_t r_payload_offset, ks0_offset, ks0_length, ks1_offset, ks1_length;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_OK, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	FAIL_(crypt_volume_key_session(cd, 60, 0), "No LUKS device");
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, NULL, 32, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	OK_(crypt_keyslot_area(cd, 0, &ks0_offset, &ks0_length));
+	OK_(crypt_keyslot_area(cd, 1, &ks1_offset, &ks1_length));
+
+	FAIL_(crypt_volume_key_session(NULL, 60, 0), "No context");
+	FAIL_(crypt_volume_key_session(cd, 60, 0x80), "Unknown flag");
+
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, PASSPHRASE, strlen(PASSPHRASE), &kc));
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, PASSPHRASE1, strlen(PASSPHRASE1), &kc1));
+
+	// unlocked key is kept, keyslot binary area is no longer needed
+	OK_(crypt_volume_key_session(cd, 60, 0));
+	EQ_(crypt_keyslot_add_by_keyslot_context(cd, 0, kc, 2, kc1, 0), 2);
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, ks0_offset, ks0_length, 0, 0, NULL, NULL));
+	EQ_(crypt_keyslot_add_by_keyslot_context(cd, 0, kc, 3, kc1, 0), 3);
+
+	// session end wipes the key, a new session does not see it
+	OK_(crypt_volume_key_session(cd, 0, 0));
+	FAIL_(crypt_keyslot_add_by_keyslot_context(cd, 0, kc, 4, kc1, 0), "Session ended");
+	OK_(crypt_volume_key_session(cd, 0, 0));
+	OK_(crypt_volume_key_session(cd, 60, 0));
+	FAIL_(crypt_keyslot_add_by_keyslot_context(cd, 0, kc, 4, kc1, 0), "Key wiped on session end");
+	EQ_(crypt_keyslot_status(cd, 4), CRYPT_SLOT_INACTIVE);
+
+	// entry expires with session lifetime
+	OK_(crypt_volume_key_session(cd, 3, 0));
+	EQ_(crypt_keyslot_add_by_keyslot_context(cd, 1, kc1, 4, kc, 0), 4);
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, ks1_offset, ks1_length, 0, 0, NULL, NULL));
+	EQ_(crypt_keyslot_add_by_keyslot_context(cd, 1, kc1, 5, kc, 0), 5);
+	sleep(4);
+	FAIL_(crypt_keyslot_add_by_keyslot_context(cd, 1, kc1, 6, kc, 0), "Session entry expired");
+
+	// key stays in the context only, it is wiped with the context
+	EQ_(crypt_keyslot_add_by_keyslot_context(cd, 2, kc1, 6, kc, 0), 6);
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_volume_key_session(cd, 60, 0));
+	FAIL_(crypt_keyslot_add_by_keyslot_context(cd, 0, kc, 7, kc1, 0), "No key from freed context");
+	FAIL_(crypt_keyslot_add_by_keyslot_context(cd, 1, kc1, 7, kc, 0), "No key from freed context");
+	EQ_(crypt_keyslot_add_by_keyslot_context(cd, 2, kc1, 7, kc, 0), 7);
+
+	crypt_keyslot_context_free(kc);
+	crypt_keyslot_context_free(kc1);
+	CRYPT_FREE(cd);
+	_cleanup_dmdevices();
+}
+
 static void Luks2Requirements(void)
 {
 	int r;
@@ -3828,6 +4415,14 @@ static void Luks2Flags(void)
 	OK_(crypt_persistent_flags_get(cd, CRYPT_FLAGS_ACTIVATION, &flags));
 	EQ_(flags,CRYPT_ACTIVATE_ALLOW_DISCARDS | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS);
 
+	/* suggested performance flags (no probe) */
+	FAIL_(crypt_activation_flags_tune(cd, ~CRYPT_TUNE_PROBE, &flags), "Invalid tune flags");
+	FAIL_(crypt_activation_flags_tune(cd, 0, NULL), "No output");
+	flags = ~UINT32_C(0);
+	OK_(crypt_activation_flags_tune(cd, 0, &flags));
+	EQ_(flags & ~(CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS |
+		      CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE), 0);
+
 	/* label and subsystem (second label */
 	OK_(crypt_set_label(cd, "label", "subsystem"));
 	OK_(strcmp("label", crypt_get_label(cd)));
@@ -3850,6 +4445,13 @@ static int test_progress(uint64_t size __attribute__((unused)),
 	return 1;
 }
 
+static void test_reencrypt_stats(const struct crypt_reencrypt_step_stats *stats,
+	void *usrptr)
+{
+	if (stats->length && stats->total_us >= stats->read_us)
+		(*(unsigned *)usrptr)++;
+}
+
 static void Luks2Reencryption(void)
 {
 /* reencryption currently depends on kernel keyring support */
@@ -3857,6 +4459,7 @@ static void Luks2Reencryption(void)
 	 *  - reencryption requires luks2 parameters. can we avoid it?
 	 */
 	uint32_t getflags;
+	unsigned stats_steps;
 	uint64_t r_header_size, r_size_1;
 	struct crypt_active_device cad;
 	struct crypt_pbkdf_type pbkdf = {
@@ -3959,7 +4562,10 @@ static void Luks2Reencryption(void)
 
 	rparams.flags = 0;
 	OK_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 9, "aes", "xts-plain64", &rparams));
+	stats_steps = 0;
+	OK_(crypt_reencrypt_set_stats_callback(cd, test_reencrypt_stats, &stats_steps));
 	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	GE_(stats_steps, 1);
 
 	/* check keyslots are reassigned to segment after reencryption */
 	EQ_(crypt_keyslot_status(cd, 0), CRYPT_SLOT_INACTIVE);
@@ -4019,8 +4625,19 @@ static void Luks2Reencryption(void)
 	FAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 9, "aes", "xts-plain64", &rparams), "Invalid resilience hash.");
 
 	rparams.hash = "sha256";
+	OK_(crypt_reencrypt_set_threads(cd, 4));
+	OK_(crypt_reencrypt_set_step_latency(cd, 1));
+	/* two single block hotzones in one checksums batch */
+	rparams.max_hotzone_size = 8;
+	OK_(crypt_reencrypt_set_hotzone_batch(cd, 2));
+	OK_(crypt_reencrypt_set_throttle(cd, 1024 * 1024, 0));
 	OK_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 21, 9, "aes", "xts-plain64", &rparams));
 	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	OK_(crypt_reencrypt_set_threads(cd, 0));
+	OK_(crypt_reencrypt_set_step_latency(cd, 0));
+	rparams.max_hotzone_size = 0;
+	OK_(crypt_reencrypt_set_hotzone_batch(cd, 0));
+	OK_(crypt_reencrypt_set_throttle(cd, 0, 0));
 
 	/* FIXME: this is a bug, but not critical (data shift parameter is ignored after initialization) */
 	//rparams.data_shift = 8;
@@ -4724,6 +5341,92 @@ static void Luks2Reencryption(void)
 	CRYPT_FREE(cd);
 	_cleanup_dmdevices();
 }
+
+static int data_area_io(const char *device, uint64_t offset, char *buf, size_t size, bool write)
+{
+	int fd, r = 0;
+
+	fd = open(device, write ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		return -EINVAL;
+
+	if (write && (pwrite(fd, buf, size, offset) != (ssize_t)size || fsync(fd)))
+		r = -EIO;
+	else if (!write && pread(fd, buf, size, offset) != (ssize_t)size)
+		r = -EIO;
+
+	close(fd);
+	return r;
+}
+
+static void Luks2ReencryptionReadAhead(void)
+{
+	struct crypt_params_luks2 params2 = {
+		.pbkdf = &min_pbkdf2,
+		.sector_size = 512
+	};
+	struct crypt_params_reencrypt rparams = {
+		.mode = CRYPT_REENCRYPT_REENCRYPT,
+		.resilience = "checksum",
+		.hash = "sha256",
+		.max_hotzone_size = 8,
+		.luks2 = &params2,
+	};
+	const char *devices[] = { DMDIR L_DEVICE_0S, DMDIR L_DEVICE_1S };
+	const char *vk_hex = "bb21babe733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	const char *vk_hex_new = "6f0ccb7c21366d2efbcd0c3ecaa6c19a8f8f1d1f8c5c1f5f20b0e68ca6bd9f0d";
+	char key[32], key_new[32], *data, *out[2];
+	uint64_t r_payload_offset, data_size = 256 * TST_SECTOR_SIZE, i;
+	int dir, dev;
+
+	if (!t_dm_crypt_keyring_support())
+		return;
+
+	crypt_decode_key(key, vk_hex, sizeof(key));
+	crypt_decode_key(key_new, vk_hex_new, sizeof(key_new));
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(L_DEVICE_0S, r_payload_offset + 256));
+	OK_(create_dmdevice_over_loop(L_DEVICE_1S, r_payload_offset + 256));
+
+	data = malloc(data_size);
+	out[0] = malloc(data_size);
+	out[1] = malloc(data_size);
+	NOTNULL_(data);
+	NOTNULL_(out[0]);
+	NOTNULL_(out[1]);
+	for (i = 0; i < data_size; i++)
+		data[i] = (char)(i * 31 + i / TST_SECTOR_SIZE);
+
+	/* the same data and keys, read-ahead enabled on the first device only */
+	for (dir = 0; dir < 2; dir++) {
+		rparams.direction = dir ? CRYPT_REENCRYPT_BACKWARD : CRYPT_REENCRYPT_FORWARD;
+		for (dev = 0; dev < 2; dev++) {
+			OK_(crypt_init(&cd, devices[dev]));
+			OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, sizeof(key), &params2));
+			EQ_(crypt_get_data_offset(cd), r_payload_offset);
+			EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, sizeof(key), PASSPHRASE, strlen(PASSPHRASE)), 0);
+			EQ_(crypt_keyslot_add_by_key(cd, 1, key_new, sizeof(key_new), PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+			OK_(data_area_io(devices[dev], r_payload_offset * TST_SECTOR_SIZE, data, data_size, true));
+
+			rparams.flags = dev ? CRYPT_REENCRYPT_NO_READ_AHEAD : 0;
+			OK_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams));
+			OK_(crypt_reencrypt_run(cd, NULL, NULL));
+			EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+			CRYPT_FREE(cd);
+
+			OK_(data_area_io(devices[dev], r_payload_offset * TST_SECTOR_SIZE, out[dev], data_size, false));
+		}
+
+		EQ_(memcmp(out[0], data, data_size) != 0, 1);
+		OK_(memcmp(out[0], out[1], data_size));
+	}
+
+	free(data);
+	free(out[0]);
+	free(out[1]);
+	_cleanup_dmdevices();
+}
 #endif
 
 static void LuksKeyslotAdd(void)
@@ -4972,10 +5675,13 @@ int main(int argc, char *argv[])
 	crypt_set_debug_level(_debug ? CRYPT_DEBUG_JSON : CRYPT_DEBUG_NONE);
 
 	RUN_(AddDeviceLuks2, "Format and use LUKS2 device");
+	RUN_(Luks2FormatBatch, "Format batch of LUKS2 devices");
 	RUN_(Luks2MetadataSize, "LUKS2 metadata settings");
 	RUN_(Luks2HeaderLoad, "LUKS2 header load");
+	RUN_(Luks2InitMemory, "LUKS2 header in memory device");
 	RUN_(Luks2HeaderRestore, "LUKS2 header restore");
 	RUN_(Luks2HeaderBackup, "LUKS2 header backup");
+	RUN_(Luks2BackupArchive, "LUKS2 header backup archive");
 	RUN_(ResizeDeviceLuks2, "LUKS2 device resize tests");
 	RUN_(UseLuks2Device, "Use pre-formated LUKS2 device");
 	RUN_(SuspendDevice, "LUKS2 Suspend/Resume");
@@ -4987,12 +5693,15 @@ int main(int argc, char *argv[])
 	RUN_(Luks2KeyslotParams, "Add a new keyslot with different encryption");
 	RUN_(Luks2KeyslotAdd, "Add a new keyslot by unused key");
 	RUN_(Luks2ActivateByKeyring, "LUKS2 activation by passphrase in keyring");
+	RUN_(Luks2ActivateAsync, "LUKS2 asynchronous activation");
+	RUN_(Luks2VolumeKeySession, "LUKS2 volume key session");
 	RUN_(Luks2Requirements, "LUKS2 requirements flags");
 	RUN_(Luks2Integrity, "LUKS2 with data integrity");
 	RUN_(Luks2Refresh, "Active device table refresh");
 	RUN_(Luks2Flags, "LUKS2 persistent flags");
 #if KERNEL_KEYRING && USE_LUKS2_REENCRYPTION
 	RUN_(Luks2Reencryption, "LUKS2 reencryption");
+	RUN_(Luks2ReencryptionReadAhead, "LUKS2 offline reencryption with hotzone read-ahead");
 #endif
 	RUN_(LuksKeyslotAdd, "Adding keyslot via new API");
 	RUN_(Luks2Repair, "LUKS2 repair"); // test disables metadata locking. Run always last!
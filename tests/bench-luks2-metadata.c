@@ -0,0 +1,272 @@
+/*
+ * microbenchmark for LUKS2 metadata operations (load, write, dump, tokens, keyslots)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Headers of different metadata area size and object count are generated
+ * on an image file (keyslots with minimal PBKDF2, tokens with a blob
+ * of given size), then every metadata operation is timed separately.
+ * Results are printed as JSON. The image file is overwritten.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcryptsetup.h"
+
+#define BENCH_PASSPHRASE	"bench"
+#define BENCH_KEY_SIZE		64
+/* keyslot area for one 64 bytes key with 4000 AF stripes, 4096 aligned */
+#define BENCH_KEYSLOT_AREA	(64 * 4000 + 4096 - ((64 * 4000) % 4096))
+
+struct bench_config {
+	uint64_t metadata_size;
+	int keyslots;
+	int tokens;
+	size_t token_blob;
+};
+
+static const struct bench_config configs[] = {
+	{ 0x004000,  1,  0,     0 },
+	{ 0x004000,  4,  4,   256 },
+	{ 0x010000,  8, 16,  1024 },
+	{ 0x040000, 16, 31,  4096 },
+	{ 0x400000, 31, 31, 65536 },
+};
+
+enum bench_op {
+	OP_LOAD = 0,
+	OP_WRITE,
+	OP_DUMP_JSON,
+	OP_TOKEN_ADD_REMOVE,
+	OP_KEYSLOT_ADD_DESTROY,
+	BENCH_OP_COUNT
+};
+
+static const char *op_names[BENCH_OP_COUNT] = {
+	"load",
+	"write",
+	"dump_json",
+	"token_add_remove",
+	"keyslot_add_destroy"
+};
+
+static struct crypt_pbkdf_type min_pbkdf2 = {
+	.type = CRYPT_KDF_PBKDF2,
+	.hash = "sha256",
+	.iterations = 1000,
+	.flags = CRYPT_PBKDF_NO_BENCHMARK
+};
+
+static void bench_log(int level __attribute__((unused)),
+		      const char *msg __attribute__((unused)),
+		      void *usrptr __attribute__((unused)))
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *token_json(size_t blob)
+{
+	static const char fmt[] = "{\"type\":\"bench\",\"keyslots\":[],\"blob\":\"%s\"}";
+	char *json, *data;
+
+	data = malloc(blob + 1);
+	if (!data)
+		return NULL;
+	memset(data, 'a', blob);
+	data[blob] = '\0';
+
+	json = malloc(sizeof(fmt) + blob);
+	if (json)
+		snprintf(json, sizeof(fmt) + blob, fmt, data);
+
+	free(data);
+	return json;
+}
+
+static uint64_t keyslots_size(const struct bench_config *c)
+{
+	/* one spare area for keyslot add benchmark */
+	return (uint64_t)(c->keyslots + 1) * BENCH_KEYSLOT_AREA;
+}
+
+static int bench_format(const char *image, const struct bench_config *c, const char *json)
+{
+	struct crypt_device *cd = NULL;
+	uint64_t size = 2 * c->metadata_size + keyslots_size(c) + 4 * 1024 * 1024;
+	int fd, i, r;
+
+	fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -EIO;
+	r = ftruncate(fd, size) ? -EIO : 0;
+	close(fd);
+	if (r)
+		return r;
+
+	r = crypt_init(&cd, image);
+	if (r)
+		return r;
+
+	r = crypt_set_pbkdf_type(cd, &min_pbkdf2);
+	if (!r)
+		r = crypt_set_metadata_size(cd, c->metadata_size, keyslots_size(c));
+	if (!r)
+		r = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, BENCH_KEY_SIZE, NULL);
+
+	/* one commit for all objects, only the measured operations write separately */
+	if (!r)
+		r = crypt_metadata_begin(cd);
+	for (i = 0; !r && i < c->keyslots; i++) {
+		r = crypt_keyslot_add_by_volume_key(cd, i, NULL, 0, BENCH_PASSPHRASE, strlen(BENCH_PASSPHRASE));
+		r = r == i ? 0 : (r < 0 ? r : -EINVAL);
+	}
+	for (i = 0; !r && i < c->tokens; i++) {
+		r = crypt_token_json_set(cd, i, json);
+		r = r == i ? 0 : (r < 0 ? r : -EINVAL);
+	}
+	if (!r)
+		r = crypt_metadata_commit(cd);
+
+	crypt_free(cd);
+	return r;
+}
+
+static int bench_op_run(struct crypt_device **cd, const char *image, enum bench_op op,
+			const struct bench_config *c, const char *json)
+{
+	const char *dump;
+	int r;
+
+	switch (op) {
+	case OP_LOAD:
+		crypt_free(*cd);
+		*cd = NULL;
+		r = crypt_init(cd, image);
+		if (!r)
+			r = crypt_load(*cd, CRYPT_LUKS2, NULL);
+		return r;
+	case OP_WRITE:
+		return crypt_set_label(*cd, "bench", NULL);
+	case OP_DUMP_JSON:
+		return crypt_dump_json(*cd, &dump, 0);
+	case OP_TOKEN_ADD_REMOVE:
+		r = crypt_token_json_set(*cd, CRYPT_ANY_TOKEN, json);
+		if (r < 0)
+			return r;
+		r = crypt_token_json_set(*cd, r, NULL);
+		return r < 0 ? r : 0;
+	case OP_KEYSLOT_ADD_DESTROY:
+		r = crypt_keyslot_add_by_volume_key(*cd, c->keyslots, NULL, 0,
+						    BENCH_PASSPHRASE, strlen(BENCH_PASSPHRASE));
+		if (r < 0)
+			return r;
+		return crypt_keyslot_destroy(*cd, r);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void bench_config_run(const char *image, const struct bench_config *c,
+			     unsigned iterations, bool *first)
+{
+	struct crypt_device *cd = NULL;
+	double start, secs;
+	unsigned i;
+	char *json;
+	int op, r;
+
+	json = token_json(c->token_blob);
+	if (!json)
+		return;
+
+	r = bench_format(image, c, json);
+
+	for (op = 0; op < BENCH_OP_COUNT; op++) {
+		/* load and validation are not measured for other operations */
+		if (!r && !cd && !(r = crypt_init(&cd, image)))
+			r = crypt_load(cd, CRYPT_LUKS2, NULL);
+		if (!r && op == OP_KEYSLOT_ADD_DESTROY)
+			r = crypt_set_pbkdf_type(cd, &min_pbkdf2);
+
+		start = now();
+		for (i = 0; !r && i < iterations; i++)
+			r = bench_op_run(&cd, image, op, c, json);
+		secs = now() - start;
+
+		printf("%s\n    { \"op\": \"%s\", \"metadata_size\": %llu, \"keyslots\": %d, "
+		       "\"tokens\": %d, \"token_blob\": %zu, ", *first ? "" : ",", op_names[op],
+		       (unsigned long long)c->metadata_size, c->keyslots, c->tokens, c->token_blob);
+		*first = false;
+
+		if (r < 0) {
+			printf("\"error\": %d }", r);
+			continue;
+		}
+
+		printf("\"ops\": %u, \"seconds\": %.6f, \"us_per_op\": %.2f }",
+		       iterations, secs, secs * 1e6 / iterations);
+	}
+
+	crypt_free(cd);
+	free(json);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Use:\tbench-luks2-metadata image_file [iterations].\n"
+			"\tWARNING: image file is overwritten.\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned i, iterations = 100;
+	bool first = true;
+
+	if (argc < 2 || (argc >= 3 && sscanf(argv[2], "%u", &iterations) != 1) || !iterations) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	crypt_set_log_callback(NULL, bench_log, NULL);
+	/* image file is private, do not measure locking */
+	crypt_metadata_locking(NULL, 0);
+
+	printf("{\n  \"image\": \"%s\",\n  \"iterations\": %u,\n  \"results\": [", argv[1], iterations);
+
+	for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+		bench_config_run(argv[1], &configs[i], iterations, &first);
+
+	printf("\n  ]\n}\n");
+
+	return EXIT_SUCCESS;
+}
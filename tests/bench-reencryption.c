@@ -0,0 +1,252 @@
+/*
+ * benchmark for LUKS2 reencryption throughput
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The device is formatted as LUKS2 (minimal PBKDF2) and reencrypted once for
+ * every combination of resilience, hotzone size, direction and (optionally)
+ * online mode. Latency and bandwidth are those of the device itself, use
+ * for example dm-delay, null_blk or scsi_debug device to model slow storage:
+ *
+ *   dmsetup create slow --table "0 $SECTORS delay /dev/loop0 0 10"
+ *
+ * Header commits are counted from the LUKS2 header sequence id.
+ * Results are printed as JSON. The device is overwritten.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcryptsetup.h"
+
+#define BENCH_PASSPHRASE	"bench"
+#define BENCH_KEY_SIZE		64
+#define BENCH_NAME		"bench_reencrypt"
+#define BENCH_DATA_SHIFT	(8 * 1024 * 2)	/* 8 MiB in sectors */
+#define BENCH_MAX_STEPS		65536
+
+static const char *resiliences[] = { "none", "checksum", "journal", "datashift" };
+static const uint64_t hotzones[] = { 1 << 20, 8 << 20, 64 << 20 };
+
+static struct crypt_pbkdf_type min_pbkdf2 = {
+	.type = CRYPT_KDF_PBKDF2,
+	.hash = "sha256",
+	.iterations = 1000,
+	.flags = CRYPT_PBKDF_NO_BENCHMARK
+};
+
+struct bench_steps {
+	uint64_t total_us[BENCH_MAX_STEPS];
+	unsigned count;
+	uint64_t bytes;
+};
+
+static void bench_log(int level __attribute__((unused)),
+		      const char *msg __attribute__((unused)),
+		      void *usrptr __attribute__((unused)))
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_stats(const struct crypt_reencrypt_step_stats *stats, void *usrptr)
+{
+	struct bench_steps *s = usrptr;
+
+	if (s->count < BENCH_MAX_STEPS)
+		s->total_us[s->count++] = stats->total_us;
+	s->bytes += stats->length;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct bench_steps *s, unsigned p)
+{
+	if (!s->count)
+		return 0;
+
+	return s->total_us[(s->count - 1) * p / 100];
+}
+
+/* binary LUKS2 header: big-endian sequence id at offset 16 */
+static int header_seqid(const char *device, uint64_t *seqid)
+{
+	unsigned char buf[8];
+	int fd, i;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		return -EIO;
+	i = pread(fd, buf, sizeof(buf), 16);
+	close(fd);
+	if (i != (int)sizeof(buf))
+		return -EIO;
+
+	for (*seqid = 0, i = 0; i < 8; i++)
+		*seqid = (*seqid << 8) | buf[i];
+
+	return 0;
+}
+
+static int bench_setup(const char *device, bool online, struct crypt_device **cd)
+{
+	int r;
+
+	r = crypt_init(cd, device);
+	if (!r)
+		r = crypt_set_pbkdf_type(*cd, &min_pbkdf2);
+	if (!r)
+		r = crypt_format(*cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, BENCH_KEY_SIZE, NULL);
+	if (!r)
+		r = crypt_keyslot_add_by_volume_key(*cd, 0, NULL, 0, BENCH_PASSPHRASE, strlen(BENCH_PASSPHRASE));
+	if (!r)
+		r = crypt_keyslot_add_by_key(*cd, 1, NULL, BENCH_KEY_SIZE, BENCH_PASSPHRASE,
+					     strlen(BENCH_PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT);
+	if (r == 1)
+		r = 0;
+	if (!r && online)
+		r = crypt_activate_by_passphrase(*cd, BENCH_NAME, 0, BENCH_PASSPHRASE,
+						 strlen(BENCH_PASSPHRASE), 0);
+	return r < 0 ? r : 0;
+}
+
+static void bench_run(const char *device, const char *resilience, uint64_t hotzone,
+		      crypt_reencrypt_direction_info direction, bool online, bool *first)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_luks2 params2 = { .sector_size = 512 };
+	struct crypt_params_reencrypt rparams = {
+		.mode = CRYPT_REENCRYPT_REENCRYPT,
+		.direction = direction,
+		.resilience = resilience,
+		.hash = "sha256",
+		.max_hotzone_size = hotzone >> 9,
+		.luks2 = &params2,
+	};
+	struct bench_steps *s;
+	uint64_t seqid_start = 0, seqid_end = 0;
+	double start, secs = 0;
+	int r;
+
+	if (!strcmp(resilience, "datashift"))
+		rparams.data_shift = BENCH_DATA_SHIFT;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return;
+
+	r = bench_setup(device, online, &cd);
+	if (!r)
+		r = crypt_reencrypt_init_by_passphrase(cd, online ? BENCH_NAME : NULL,
+				BENCH_PASSPHRASE, strlen(BENCH_PASSPHRASE), 0, 1,
+				"aes", "xts-plain64", &rparams);
+	if (r >= 0)
+		r = crypt_reencrypt_set_stats_callback(cd, bench_stats, s);
+	if (!r)
+		r = header_seqid(device, &seqid_start);
+	if (!r) {
+		start = now();
+		r = crypt_reencrypt_run(cd, NULL, NULL);
+		secs = now() - start;
+	}
+	if (!r)
+		r = header_seqid(device, &seqid_end);
+
+	if (online)
+		(void)crypt_deactivate(cd, BENCH_NAME);
+	crypt_free(cd);
+
+	printf("%s\n    { \"resilience\": \"%s\", \"hotzone\": %llu, \"direction\": \"%s\", "
+	       "\"online\": %s, ", *first ? "" : ",", resilience, (unsigned long long)hotzone,
+	       direction == CRYPT_REENCRYPT_FORWARD ? "forward" : "backward",
+	       online ? "true" : "false");
+	*first = false;
+
+	if (r < 0 || !secs || !s->bytes) {
+		printf("\"error\": %d }", r < 0 ? r : -EINVAL);
+		free(s);
+		return;
+	}
+
+	qsort(s->total_us, s->count, sizeof(*s->total_us), cmp_u64);
+
+	printf("\"bytes\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"steps\": %u, "
+	       "\"step_us_p50\": %llu, \"step_us_p90\": %llu, \"step_us_p99\": %llu, "
+	       "\"commits_per_gb\": %.2f }",
+	       (unsigned long long)s->bytes, secs, s->bytes / secs / 1e6, s->count,
+	       (unsigned long long)percentile(s, 50), (unsigned long long)percentile(s, 90),
+	       (unsigned long long)percentile(s, 99),
+	       (seqid_end - seqid_start) * 1e9 / s->bytes);
+	free(s);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Use:\tbench-reencryption device [online].\n"
+			"\tWARNING: device is overwritten.\n");
+}
+
+int main(int argc, char **argv)
+{
+	bool first = true;
+	unsigned i, j;
+	int d, online;
+
+	if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "online"))) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	crypt_set_log_callback(NULL, bench_log, NULL);
+
+	printf("{\n  \"device\": \"%s\",\n  \"results\": [", argv[1]);
+
+	for (online = 0; online <= (argc == 3); online++)
+		for (i = 0; i < sizeof(resiliences) / sizeof(resiliences[0]); i++)
+			for (j = 0; j < sizeof(hotzones) / sizeof(hotzones[0]); j++)
+				for (d = CRYPT_REENCRYPT_FORWARD; d <= CRYPT_REENCRYPT_BACKWARD; d++) {
+					/* data shift moves data backward only */
+					if (!strcmp(resiliences[i], "datashift") &&
+					    d == CRYPT_REENCRYPT_FORWARD)
+						continue;
+					bench_run(argv[1], resiliences[i], hotzones[j], d, online, &first);
+				}
+
+	printf("\n  ]\n}\n");
+
+	return EXIT_SUCCESS;
+}
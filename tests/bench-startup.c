@@ -0,0 +1,171 @@
+/*
+ * microbenchmark for startup latency of metadata-only operations
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Compares the cost of reading one sector of a LUKS device with an in-process
+ * isLuks (crypt_init, crypt_load, crypt_free) and luksUUID, and optionally with
+ * the whole "cryptsetup isLuks" process (fork, exec, library and tool startup).
+ * Results are printed as JSON. The device is only read.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libcryptsetup.h"
+
+#define BENCH_SECTOR	4096
+
+enum bench_op {
+	OP_SECTOR_READ = 0,
+	OP_ISLUKS,
+	OP_LUKSUUID,
+	OP_EXEC_ISLUKS,
+	BENCH_OP_COUNT
+};
+
+static const char *op_names[BENCH_OP_COUNT] = {
+	"sector_read",
+	"isluks",
+	"luksuuid",
+	"exec_isluks"
+};
+
+static void bench_log(int level __attribute__((unused)),
+		      const char *msg __attribute__((unused)),
+		      void *usrptr __attribute__((unused)))
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sector_read(const char *device)
+{
+	char buf[BENCH_SECTOR];
+	int fd, r;
+
+	fd = open(device, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	r = pread(fd, buf, sizeof(buf), 0) == sizeof(buf) ? 0 : -EIO;
+	close(fd);
+	return r;
+}
+
+static int exec_isluks(const char *cryptsetup, const char *device)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (!pid) {
+		execl(cryptsetup, cryptsetup, "isLuks", device, (char *)NULL);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -EINVAL;
+}
+
+static int bench_op_run(enum bench_op op, const char *device, const char *cryptsetup)
+{
+	struct crypt_device *cd;
+	int r;
+
+	switch (op) {
+	case OP_SECTOR_READ:
+		return sector_read(device);
+	case OP_ISLUKS:
+	case OP_LUKSUUID:
+		r = crypt_init(&cd, device);
+		if (r)
+			return r;
+		r = crypt_load(cd, CRYPT_LUKS, NULL);
+		if (!r && op == OP_LUKSUUID && !crypt_get_uuid(cd))
+			r = -EINVAL;
+		crypt_free(cd);
+		return r;
+	case OP_EXEC_ISLUKS:
+		return exec_isluks(cryptsetup, device);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Use:\tbench-startup luks_device [iterations] [cryptsetup_binary].\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned i, iterations = 1000;
+	double start, secs;
+	int op, r;
+
+	if (argc < 2 || (argc >= 3 && sscanf(argv[2], "%u", &iterations) != 1) || !iterations) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	crypt_set_log_callback(NULL, bench_log, NULL);
+
+	printf("{\n  \"device\": \"%s\",\n  \"iterations\": %u,\n  \"results\": [", argv[1], iterations);
+
+	for (op = 0; op < BENCH_OP_COUNT; op++) {
+		if (op == OP_EXEC_ISLUKS && argc < 4)
+			continue;
+
+		r = 0;
+		start = now();
+		for (i = 0; !r && i < iterations; i++)
+			r = bench_op_run(op, argv[1], argc >= 4 ? argv[3] : NULL);
+		secs = now() - start;
+
+		printf("%s\n    { \"op\": \"%s\", ", op ? "," : "", op_names[op]);
+		if (r < 0)
+			printf("\"error\": %d }", r);
+		else
+			printf("\"ops\": %u, \"seconds\": %.6f, \"us_per_op\": %.2f }",
+			       iterations, secs, secs * 1e6 / iterations);
+	}
+
+	printf("\n  ]\n}\n");
+
+	return EXIT_SUCCESS;
+}
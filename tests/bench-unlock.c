@@ -0,0 +1,325 @@
+/*
+ * benchmark for LUKS2 unlock latency (passphrase, keyfile and token)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Headers with different keyslot count and PBKDF are generated on an image
+ * file. Every keyslot has its own passphrase and one token of the built-in
+ * "bench_token" type, only one keyslot (the first or the last one) matches.
+ * Unlock with CRYPT_ANY_SLOT (CRYPT_ANY_TOKEN) is then timed and split
+ * into phases from crypt_get_perf_stats(). Run as root, the image is attached
+ * to a loop device (see test_utils.c) and really activated, otherwise
+ * the keyslots are checked only.
+ * Results are printed as JSON. The image file is overwritten.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "api_test.h"
+#include "libcryptsetup.h"
+
+#define BENCH_PASSPHRASE	"bench"
+#define BENCH_KEY_SIZE		64
+#define BENCH_NAME		"bench_unlock"
+#define BENCH_IMAGE_SIZE	(32 * 1024 * 1024)
+
+enum bench_method {
+	METHOD_PASSPHRASE = 0,
+	METHOD_KEYFILE,
+	METHOD_TOKEN,
+	BENCH_METHOD_COUNT
+};
+
+static const char *method_names[BENCH_METHOD_COUNT] = {
+	"passphrase",
+	"keyfile",
+	"token"
+};
+
+static const int keyslot_counts[] = { 1, 8, 32 };
+
+static const struct crypt_pbkdf_type pbkdfs[] = {
+	{ .type = CRYPT_KDF_PBKDF2, .hash = "sha256", .iterations = 1000,
+	  .flags = CRYPT_PBKDF_NO_BENCHMARK },
+	{ .type = CRYPT_KDF_ARGON2ID, .hash = "sha256", .iterations = 4,
+	  .max_memory_kb = 32 * 1024, .parallel_threads = 1, .flags = CRYPT_PBKDF_NO_BENCHMARK },
+};
+
+struct bench_phases {
+	double load_us;
+	double unlock_us;
+	struct crypt_perf_stats perf;
+};
+
+static void bench_log(int level __attribute__((unused)),
+		      const char *msg __attribute__((unused)),
+		      void *usrptr __attribute__((unused)))
+{
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* token stores passphrase of its keyslot */
+static int bench_token_open(struct crypt_device *cd, int token,
+	char **buffer, size_t *buffer_len, void *usrptr __attribute__((unused)))
+{
+	const char *json, *pass;
+	int r;
+
+	r = crypt_token_json_get(cd, token, &json);
+	if (r < 0)
+		return r;
+
+	pass = strstr(json, "\"pass\":\"");
+	if (!pass)
+		return -EINVAL;
+	pass += strlen("\"pass\":\"");
+
+	*buffer = strndup(pass, strcspn(pass, "\""));
+	if (!*buffer)
+		return -ENOMEM;
+	*buffer_len = strlen(*buffer);
+
+	return 0;
+}
+
+static const crypt_token_handler bench_token = {
+	.name = "bench_token",
+	.open = bench_token_open,
+};
+
+static void keyslot_passphrase(char *buf, size_t size, int keyslot, int match)
+{
+	if (keyslot == match)
+		snprintf(buf, size, "%s", BENCH_PASSPHRASE);
+	else
+		snprintf(buf, size, "%s%d", BENCH_PASSPHRASE, keyslot);
+}
+
+static int create_image(const char *image)
+{
+	int fd, r;
+
+	fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -EIO;
+	r = ftruncate(fd, BENCH_IMAGE_SIZE) ? -EIO : 0;
+	close(fd);
+	return r;
+}
+
+static int bench_format(const char *device, int keyslots, int match,
+			const struct crypt_pbkdf_type *pbkdf)
+{
+	struct crypt_device *cd = NULL;
+	char pass[32], json[128];
+	int i, r;
+
+	r = crypt_init(&cd, device);
+	if (r)
+		return r;
+
+	r = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, BENCH_KEY_SIZE, NULL);
+	if (!r)
+		r = crypt_set_pbkdf_type(cd, pbkdf);
+	if (!r)
+		r = crypt_metadata_begin(cd);
+	for (i = 0; !r && i < keyslots; i++) {
+		keyslot_passphrase(pass, sizeof(pass), i, match);
+		r = crypt_keyslot_add_by_volume_key(cd, i, NULL, 0, pass, strlen(pass));
+		r = r == i ? 0 : (r < 0 ? r : -EINVAL);
+		if (r)
+			break;
+		snprintf(json, sizeof(json), "{\"type\":\"%s\",\"keyslots\":[\"%d\"],\"pass\":\"%s\"}",
+			 bench_token.name, i, pass);
+		r = crypt_token_json_set(cd, i, json);
+		r = r == i ? 0 : (r < 0 ? r : -EINVAL);
+	}
+	if (!r)
+		r = crypt_metadata_commit(cd);
+
+	crypt_free(cd);
+	return r;
+}
+
+static int bench_unlock(const char *device, const char *keyfile, const char *name,
+			enum bench_method method, struct bench_phases *p)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_perf_stats perf;
+	double start, loaded;
+	int r;
+
+	start = now();
+	r = crypt_init(&cd, device);
+	if (!r)
+		r = crypt_load(cd, CRYPT_LUKS2, NULL);
+	loaded = now();
+
+	if (!r) {
+		if (method == METHOD_PASSPHRASE)
+			r = crypt_activate_by_passphrase(cd, name, CRYPT_ANY_SLOT,
+				BENCH_PASSPHRASE, strlen(BENCH_PASSPHRASE), 0);
+		else if (method == METHOD_KEYFILE)
+			r = crypt_activate_by_keyfile_device_offset(cd, name, CRYPT_ANY_SLOT,
+				keyfile, 0, 0, 0);
+		else
+			r = crypt_activate_by_token_pin(cd, name, NULL, CRYPT_ANY_TOKEN,
+				NULL, 0, NULL, 0);
+	}
+
+	if (r >= 0) {
+		p->load_us += (loaded - start) * 1e6;
+		p->unlock_us += (now() - loaded) * 1e6;
+		if (!crypt_get_perf_stats(cd, &perf)) {
+			p->perf.header_reads += perf.header_reads;
+			p->perf.kdf_runs += perf.kdf_runs;
+			p->perf.kdf_wall_us += perf.kdf_wall_us;
+			p->perf.dm_ioctls += perf.dm_ioctls;
+			p->perf.udev_wait_us += perf.udev_wait_us;
+		}
+	}
+
+	if (r >= 0 && name)
+		(void)crypt_deactivate(cd, name);
+	crypt_free(cd);
+	return r < 0 ? r : 0;
+}
+
+static void bench_config_run(const char *device, const char *keyfile,
+			     const char *name, int keyslots, bool last,
+			     const struct crypt_pbkdf_type *pbkdf,
+			     unsigned iterations, bool *first)
+{
+	struct bench_phases p;
+	unsigned i;
+	int method, r, r_format;
+
+	r_format = bench_format(device, keyslots, last ? keyslots - 1 : 0, pbkdf);
+
+	for (method = 0; method < BENCH_METHOD_COUNT; method++) {
+		memset(&p, 0, sizeof(p));
+		r = r_format;
+		for (i = 0; !r && i < iterations; i++)
+			r = bench_unlock(device, keyfile, name, method, &p);
+
+		printf("%s\n    { \"method\": \"%s\", \"pbkdf\": \"%s\", \"keyslots\": %d, "
+		       "\"tokens\": %d, \"position\": \"%s\", ", *first ? "" : ",",
+		       method_names[method], pbkdf->type, keyslots,
+		       method == METHOD_TOKEN ? keyslots : 0, last ? "last" : "first");
+		*first = false;
+
+		if (r < 0) {
+			printf("\"error\": %d }", r);
+			continue;
+		}
+
+		printf("\"ops\": %u, \"total_us\": %.1f, \"load_us\": %.1f, \"unlock_us\": %.1f, "
+		       "\"kdf_runs\": %.1f, \"kdf_us\": %.1f, \"header_reads\": %.1f, "
+		       "\"dm_ioctls\": %.1f, \"udev_wait_us\": %.1f }", iterations,
+		       (p.load_us + p.unlock_us) / iterations, p.load_us / iterations,
+		       p.unlock_us / iterations, (double)p.perf.kdf_runs / iterations,
+		       (double)p.perf.kdf_wall_us / iterations, (double)p.perf.header_reads / iterations,
+		       (double)p.perf.dm_ioctls / iterations, (double)p.perf.udev_wait_us / iterations);
+	}
+}
+
+static int write_keyfile(const char *keyfile)
+{
+	int fd, r;
+
+	fd = open(keyfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -EIO;
+	r = write(fd, BENCH_PASSPHRASE, strlen(BENCH_PASSPHRASE)) == (ssize_t)strlen(BENCH_PASSPHRASE) ? 0 : -EIO;
+	close(fd);
+	return r;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Use:\tbench-unlock image_file [iterations].\n"
+			"\tWARNING: image file is overwritten.\n");
+}
+
+int main(int argc, char **argv)
+{
+	char keyfile[PATH_MAX], *loop = NULL;
+	const char *device, *name = NULL;
+	unsigned i, j, iterations = 5;
+	int last, ro = 0;
+	bool first = true;
+
+	if (argc < 2 || (argc >= 3 && sscanf(argv[2], "%u", &iterations) != 1) || !iterations) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (snprintf(keyfile, sizeof(keyfile), "%s.key", argv[1]) >= (int)sizeof(keyfile) ||
+	    create_image(argv[1]) || write_keyfile(keyfile) || crypt_token_register(&bench_token)) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	crypt_set_log_callback(NULL, bench_log, NULL);
+
+	device = argv[1];
+	if (!getuid()) {
+		if (loop_attach(&loop, argv[1], 0, 0, &ro)) {
+			fprintf(stderr, "Cannot attach loop device.\n");
+			unlink(keyfile);
+			return EXIT_FAILURE;
+		}
+		device = loop;
+		name = BENCH_NAME;
+	}
+
+	printf("{\n  \"image\": \"%s\",\n  \"activate\": %s,\n  \"iterations\": %u,\n  \"results\": [",
+	       argv[1], name ? "true" : "false", iterations);
+
+	for (i = 0; i < sizeof(pbkdfs) / sizeof(pbkdfs[0]); i++)
+		for (j = 0; j < sizeof(keyslot_counts) / sizeof(keyslot_counts[0]); j++)
+			for (last = 0; last <= (keyslot_counts[j] > 1); last++)
+				bench_config_run(device, keyfile, name, keyslot_counts[j],
+						 last, &pbkdfs[i], iterations, &first);
+
+	printf("\n  ]\n}\n");
+
+	if (loop) {
+		loop_detach(loop);
+		free(loop);
+	}
+	unlink(keyfile);
+
+	return EXIT_SUCCESS;
+}
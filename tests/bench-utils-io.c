@@ -0,0 +1,250 @@
+/*
+ * microbenchmark for utils_io.c (blockwise low level functions)
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Measures throughput and read/write syscall counts (from /proc/self/io)
+ * of blockwise functions for aligned and unaligned buffers and block sizes
+ * 512 - 64k, including hangover (partial block) cases. Results are printed
+ * as JSON. Run it on a tmpfs file or a spare loop device, data are overwritten.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils_io.h"
+
+#define BENCH_BLOCKS		8
+#define BENCH_MAX_BSIZE		(64 * 1024)
+/* four test areas plus hangover */
+#define BENCH_MIN_SIZE		(5 * BENCH_BLOCKS * BENCH_MAX_BSIZE)
+
+enum bench_fn {
+	READ_BLOCKWISE = 0,
+	WRITE_BLOCKWISE,
+	READ_LSEEK_BLOCKWISE,
+	WRITE_LSEEK_BLOCKWISE,
+	PREAD_BLOCKWISE,
+	PWRITE_BLOCKWISE,
+	BENCH_FN_COUNT
+};
+
+static const char *fn_names[BENCH_FN_COUNT] = {
+	"read_blockwise",
+	"write_blockwise",
+	"read_lseek_blockwise",
+	"write_lseek_blockwise",
+	"pread_blockwise",
+	"pwrite_blockwise"
+};
+
+enum bench_case {
+	CASE_ALIGNED = 0,	/* aligned buffer, whole blocks */
+	CASE_UNALIGNED_BUF,	/* misaligned buffer, whole blocks */
+	CASE_HANGOVER,		/* aligned buffer, partial head and tail block */
+	BENCH_CASE_COUNT
+};
+
+static const char *case_names[BENCH_CASE_COUNT] = {
+	"aligned",
+	"unaligned_buffer",
+	"hangover"
+};
+
+static size_t mem_alignment = 4096;
+static struct io_scratch scratch;
+
+/* read and write syscall counters of this process, -1 if not available */
+static void io_syscalls(long long *syscr, long long *syscw)
+{
+	char line[128];
+	FILE *f;
+
+	*syscr = *syscw = -1;
+
+	f = fopen("/proc/self/io", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "syscr:", 6))
+			*syscr = atoll(line + 6);
+		else if (!strncmp(line, "syscw:", 6))
+			*syscw = atoll(line + 6);
+	}
+
+	fclose(f);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t bench_op(enum bench_fn fn, int fd, size_t bsize, char *buf, size_t length, off_t offset)
+{
+	switch (fn) {
+	case READ_BLOCKWISE:
+		if (lseek(fd, offset, SEEK_SET) < 0)
+			return -EIO;
+		return read_blockwise(fd, bsize, mem_alignment, buf, length);
+	case WRITE_BLOCKWISE:
+		if (lseek(fd, offset, SEEK_SET) < 0)
+			return -EIO;
+		return write_blockwise(fd, bsize, mem_alignment, buf, length);
+	case READ_LSEEK_BLOCKWISE:
+		return read_lseek_blockwise(fd, bsize, mem_alignment, buf, length, offset);
+	case WRITE_LSEEK_BLOCKWISE:
+		return write_lseek_blockwise(fd, bsize, mem_alignment, buf, length, offset);
+	case PREAD_BLOCKWISE:
+		return pread_blockwise(fd, bsize, mem_alignment, &scratch, buf, length, offset);
+	case PWRITE_BLOCKWISE:
+		return pwrite_blockwise(fd, bsize, mem_alignment, &scratch, buf, length, offset);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void bench_run(int fd, enum bench_fn fn, enum bench_case c, size_t bsize,
+		      char *mem, unsigned iterations, bool *first)
+{
+	long long syscr0, syscw0, syscr1, syscw1;
+	size_t length = BENCH_BLOCKS * bsize;
+	off_t offset = 0;
+	char *buf = mem;
+	double start, secs;
+	unsigned i;
+	ssize_t r = 0;
+
+	if (c == CASE_UNALIGNED_BUF)
+		buf = mem + 1;
+	else if (c == CASE_HANGOVER) {
+		length += bsize / 2 + 1;
+		/* lseek variants cannot start in the middle of a block */
+		if (fn != READ_BLOCKWISE && fn != WRITE_BLOCKWISE)
+			offset = bsize / 2 + 1;
+	}
+
+	io_syscalls(&syscr0, &syscw0);
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		/* spread over device so no single block is always cached in scratch */
+		r = bench_op(fn, fd, bsize, buf, length, offset + (i % 4) * BENCH_BLOCKS * BENCH_MAX_BSIZE);
+		if (r < 0 || (size_t)r != length)
+			break;
+	}
+	secs = now() - start;
+	io_syscalls(&syscr1, &syscw1);
+
+	printf("%s\n    { \"fn\": \"%s\", \"case\": \"%s\", \"bsize\": %zu, \"length\": %zu, "
+	       "\"offset\": %lld, ", *first ? "" : ",", fn_names[fn], case_names[c],
+	       bsize, length, (long long)offset);
+	*first = false;
+
+	if (i < iterations) {
+		printf("\"error\": %zd }", r < 0 ? r : (ssize_t)-EIO);
+		return;
+	}
+
+	printf("\"ops\": %u, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"us_per_op\": %.2f",
+	       iterations, secs, secs > 0 ? (double)length * iterations / secs / (1024 * 1024) : 0.0,
+	       secs * 1e6 / iterations);
+
+	if (syscr0 >= 0 && syscr1 >= 0)
+		printf(", \"syscr_per_op\": %.2f, \"syscw_per_op\": %.2f",
+		       (double)(syscr1 - syscr0) / iterations,
+		       (double)(syscw1 - syscw0) / iterations);
+	printf(" }");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Use:\tbench-utils-io file/device [iterations] [buffered].\n"
+			"\tWARNING: data on file/device are overwritten.\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned iterations = 1000;
+	bool first = true, direct = true;
+	size_t bsize;
+	char *mem = NULL;
+	off_t size;
+	long ps;
+	int fd, fn, c;
+
+	if (argc < 2 || (argc >= 3 && sscanf(argv[2], "%u", &iterations) != 1) || !iterations) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (argc >= 4 && !strcmp(argv[3], "buffered"))
+		direct = false;
+
+	ps = sysconf(_SC_PAGESIZE);
+	if (ps > 0)
+		mem_alignment = (size_t)ps;
+
+	fd = open(argv[1], O_RDWR | (direct ? O_DIRECT : 0));
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size < BENCH_MIN_SIZE) {
+		fprintf(stderr, "File/device %s must have at least %d bytes.\n", argv[1], BENCH_MIN_SIZE);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	/* one extra block for unaligned buffer and hangover */
+	if (posix_memalign((void **)&mem, mem_alignment, (BENCH_BLOCKS + 2) * BENCH_MAX_BSIZE)) {
+		fprintf(stderr, "Failed to allocate aligned buffer.\n");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	memset(mem, 0xa5, (BENCH_BLOCKS + 2) * BENCH_MAX_BSIZE);
+
+	printf("{\n  \"device\": \"%s\",\n  \"direct_io\": %s,\n  \"iterations\": %u,\n"
+	       "  \"mem_alignment\": %zu,\n  \"results\": [", argv[1],
+	       direct ? "true" : "false", iterations, mem_alignment);
+
+	for (bsize = 512; bsize <= BENCH_MAX_BSIZE; bsize <<= 1)
+		for (fn = 0; fn < BENCH_FN_COUNT; fn++)
+			for (c = 0; c < BENCH_CASE_COUNT; c++)
+				bench_run(fd, fn, c, bsize, mem, iterations, &first);
+
+	printf("\n  ]\n}\n");
+
+	io_scratch_free(&scratch);
+	free(mem);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "crypto_backend/crypto_backend.h"
 
@@ -270,6 +271,59 @@ static struct kdf_test_vector kdf_test_vectors[] = {
 		"\x7d\x8e\xdd\x58\x01\xb4\x59\x72"
 		"\x99\x92\x16\x30\x5e\xa4\x36\x8d"
 		"\x76\x14\x80\xf3\xe3\x7a\x22\xb9", 32
+	}, {
+	/* Multiple output blocks (multi-lane PBKDF2) */
+		"pbkdf2", "sha256", 64, 4096, 0, 0,
+		"password", 8,
+		"salt", 4,
+		"\xc5\xe4\x78\xd5\x92\x88\xc8\x41"
+		"\xaa\x53\x0d\xb6\x84\x5c\x4c\x8d"
+		"\x96\x28\x93\xa0\x01\xce\x4e\x11"
+		"\xa4\x96\x38\x73\xaa\x98\x13\x4a"
+		"\xf7\xad\x98\xc1\xb4\x58\xce\x3f"
+		"\xd7\x4c\xa3\x5b\xeb\xa3\xcd\xa7"
+		"\xb8\xd1\x03\x8d\x6a\x87\x07\x1b"
+		"\x91\x8f\x83\x74\x05\xf3\xfe\x77"
+		"\x28\xff\xe7\xf0\x97\x6f\xc3\x5d"
+		"\xd8\x2f\xc0\xe5\xe4\x6c\xe9\xce", 80
+	}, {
+		"pbkdf2", "sha256", 64, 1, 0, 0,
+		"passwordPASSWORDpassword", 24,
+		"saltSALTsaltSALTsaltSALTsaltSALTsalt", 36,
+		"\x05\x1e\x94\x5b\x44\x15\x58\x46"
+		"\xde\x9d\x87\x9b\x8c\x06\x2e\xee"
+		"\x1f\x5f\xc6\xef\x37\xe3\x3c\x8a"
+		"\x8e\xe0\xa7\x70\xd4\x5b\xe8\xda"
+		"\x44\x1d\x11\x13\x17\x2e\x4b\x85"
+		"\xbc\x67\x6e\x70\xf6\x00\xe1\xbb"
+		"\x40\x8a\x25\x48\xd1\xab\xe0\x7b"
+		"\xe1\x27\x29\x02\x67\x77\x61\x81"
+		"\xca\x26\x6a\xe4\x5a\xdc\xe4\x59"
+		"\x1e\x31\xf3\x3d\xc8\xfc\x92\xf3"
+		"\x27\x88\x7f\x94\x3a\x16\x3b\x34"
+		"\xbf\x66\xb0\x6c\x51\x8a\x87\x6b"
+		"\x24\xdd\xf5\xb1", 100
+	}, {
+		"pbkdf2", "sha512", 128, 4096, 0, 0,
+		"passwordPASSWORDpassword", 24,
+		"saltSALTsaltSALTsaltSALTsaltSALTsalt", 36,
+		"\x8c\x05\x11\xf4\xc6\xe5\x97\xc6"
+		"\xac\x63\x15\xd8\xf0\x36\x2e\x22"
+		"\x5f\x3c\x50\x14\x95\xba\x23\xb8"
+		"\x68\xc0\x05\x17\x4d\xc4\xee\x71"
+		"\x11\x5b\x59\xf9\xe6\x0c\xd9\x53"
+		"\x2f\xa3\x3e\x0f\x75\xae\xfe\x30"
+		"\x22\x5c\x58\x3a\x18\x6c\xd8\x2b"
+		"\xd4\xda\xea\x97\x24\xa3\xd3\xb8"
+		"\x04\xf7\x5b\xdd\x41\x49\x4f\xa3"
+		"\x24\xca\xb2\x4b\xcc\x68\x0f\xb3"
+		"\xb9\x6a\x30\xcf\x5d\x21\xfa\xc3"
+		"\xc2\x87\x59\x13\x91\x9f\x33\x99"
+		"\xb1\xd9\xce\x7e\xb5\x4c\x95\xba"
+		"\x49\x11\x85\x96\xcf\x74\x65\x71"
+		"\x9b\xbe\x02\xc4\xec\xab\x1b\x15"
+		"\x41\x29\x8c\x32\x1d\x13\xc6\xf6"
+		"\xd4\x14\xc2\x81\x63\xb0\x51\xa1", 136
 	}, {
 		"pbkdf2", "whirlpool", 64, 1200, 0, 0,
 		"XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX"
@@ -951,8 +1005,42 @@ static struct cipher_iv_test_vector cipher_iv_test_vectors[] = {
 		"\xdb\xe7\xd2\x25\xb0\x4f\x5d\x36\x20\xc4\xc2\xb4\xe8\x7e\xae\xe9"
 		"\x95\x10\x45\x5d\xdd\xc4\xcd\x33\xad\xbd\x39\x49\xf2\x85\x82\x4c"
 	},
+}},
+{
+	"aes", "xts",
+	"\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c"
+	"\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f", 32,
+	"plain64", UINT32_MAX-7, 8192,
+	"\x9f\x1d\xcb\xc3\x5c\x35\x0d\x60\x27\xf9\x8b\xe0\xf5\xc8\xb4\x3b"
+	"\x42\xca\x52\xb7\x60\x44\x59\xc0\xc4\x2b\xe3\xaa\x88\x91\x3d\x47", {
+	{	512, false,
+		"\xe9\xd7\x24\x51\x47\xc8\xbd\x9a\xf0\x65\x13\x4b\xef\xc5\x1c\x6e"
+		"\xbc\x82\x77\x08\x42\x66\xa4\x64\xdf\xac\x2b\xa9\x68\xf0\x3f\x6b"
+	},{	1024, false,
+		"\xea\x0c\x21\xf9\xb2\xda\xd8\xca\xb7\x1f\xcf\x13\x32\xaa\x2f\x5b"
+		"\x97\x18\x80\xd1\x54\x30\x64\x64\xbb\xf8\xf7\x5f\x28\xbd\x64\x98"
+	},{	1024, true,
+		"\x65\x73\xd7\x2e\xf4\x06\x66\xae\x3a\x5a\xcb\xc2\x08\x01\xa3\xdb"
+		"\x83\x55\xfc\xa5\x8a\x86\x31\xfa\xda\xf4\x6d\x67\xd6\xe9\x21\x2c"
+	},{	2048, false,
+		"\xbd\x60\x66\x4d\xf7\x8e\x13\x8e\x22\xa7\xf3\x35\xb5\xec\xf1\xc0"
+		"\x90\xcc\x83\x40\x71\xa0\xe1\xa7\x9a\xc1\xd8\x8c\x18\x8c\xd3\x78"
+	},{	2048, true,
+		"\x79\x48\x7c\x3f\x48\x81\xa9\x40\xd8\xef\x6a\x36\xd0\x33\xf0\xee"
+		"\xfc\xa5\xd4\xea\x91\xff\x76\x0b\xdc\x63\xab\x57\x16\x84\x32\xe4"
+	},{	4096, false,
+		"\xbd\x82\xe3\x40\x4b\xce\x6e\x15\x23\xfc\x0f\xe3\x12\x78\xf6\xc7"
+		"\x51\xfc\x3e\xf4\x9a\xe6\xd0\xbd\x6e\x25\xae\x7e\x1d\xf7\xd4\x49"
+	},{	4096, true,
+		"\x0a\x4b\xcf\x80\x4d\x2a\x1d\xf1\x2d\xdc\x32\x9f\x6a\x7c\x88\x52"
+		"\xdc\xd2\x1e\x53\x5a\x65\xff\x85\x35\xf7\x82\xad\x98\x5b\xf7\xb5"
+	},
 }}};
 
+static const char *base64_invalid_vectors[] = {
+	"Zm9vYmFy*m9v", "Zm9vYm=y", "Zm9vYg==Zm9v", "Zm9vY", "Zm9v=mFy", "Zm9vYh==", "Zm9vYmF\x80"
+};
+
 /* Base64 test vectors */
 struct base64_test_vector {
 	size_t decoded_len;
@@ -1053,6 +1141,164 @@ static int pbkdf_test_vectors(void)
 	return EXIT_SUCCESS;
 }
 
+/* All PBKDF2 vectors of one hash computed at once in SIMD lanes */
+static int pbkdf2_multi_test(const char *hash)
+{
+	struct crypt_pbkdf2_job jobs[ARRAY_SIZE(kdf_test_vectors)];
+	char result[ARRAY_SIZE(kdf_test_vectors)][256];
+	unsigned int i, count = 0, idx[ARRAY_SIZE(kdf_test_vectors)];
+	const struct kdf_test_vector *vec;
+	int r;
+
+	for (i = 0; i < ARRAY_SIZE(kdf_test_vectors); i++) {
+		vec = &kdf_test_vectors[i];
+		if (strcmp(vec->type, "pbkdf2") || strcmp(vec->hash, hash))
+			continue;
+		crypt_backend_memzero(result[count], sizeof(result[count]));
+		jobs[count] = (struct crypt_pbkdf2_job) {
+			.password = vec->password, .password_length = vec->password_length,
+			.salt = vec->salt, .salt_length = vec->salt_length,
+			.iterations = vec->iterations,
+			.key = result[count], .key_length = vec->output_length
+		};
+		idx[count++] = i;
+	}
+
+	printf("PBKDF2 multi-lane %s (%u vectors) ", hash, count);
+	r = crypt_pbkdf2_multi(hash, jobs, count);
+	if (r == -ENOTSUP || (r < 0 && fips_mode())) {
+		printf("[N/A]\n");
+		return EXIT_SUCCESS;
+	}
+	if (r < 0) {
+		printf("[FAILED]\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < count; i++) {
+		vec = &kdf_test_vectors[idx[i]];
+		if (memcmp(result[i], vec->output, vec->output_length)) {
+			printf("[FAILED vector %02u]\n", idx[i]);
+			printhex(" got", result[i], vec->output_length);
+			printhex("want", vec->output, vec->output_length);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("[OK]\n");
+
+	return EXIT_SUCCESS;
+}
+
+/* Multi-buffer hash compared to backend hash of prefix || message || suffix */
+static int hash_multi_test(const char *hash)
+{
+	static const size_t affix_lengths[] = { 0, 32, 64, 100, 200 };
+	static const size_t lengths[] = { 1, 55, 56, 64, 119, 512, 4096 };
+	char *data = NULL, affix[256], digests[11 * 64], digest[64];
+	struct crypt_hash_multi *mctx;
+	struct crypt_hash *ctx;
+	unsigned i, j, k, l, count = 11;
+	size_t hash_size;
+	int r = EXIT_FAILURE;
+
+	printf("HASH multi-buffer %s ", hash);
+	if (crypt_hash_multi_init(&mctx, hash, NULL, 0, NULL, 0) == -ENOTSUP) {
+		printf("[N/A]\n");
+		return EXIT_SUCCESS;
+	}
+	crypt_hash_multi_destroy(mctx);
+
+	hash_size = crypt_hash_size(hash);
+	data = malloc(count * 4096);
+	if (!data)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < count * 4096; i++)
+		data[i] = (char)(i * 7 + i / 251);
+	for (i = 0; i < sizeof(affix); i++)
+		affix[i] = (char)(255 - i);
+
+	for (i = 0; i < ARRAY_SIZE(affix_lengths); i++)
+	for (j = 0; j < ARRAY_SIZE(affix_lengths); j++)
+	for (k = 0; k < ARRAY_SIZE(lengths); k++) {
+		if (crypt_hash_multi_init(&mctx, hash, affix, affix_lengths[i],
+					  affix + 16, affix_lengths[j]))
+			goto out;
+		if (crypt_hash_multi(mctx, data, lengths[k], count, digests)) {
+			crypt_hash_multi_destroy(mctx);
+			goto out;
+		}
+		crypt_hash_multi_destroy(mctx);
+
+		for (l = 0; l < count; l++) {
+			if (crypt_hash_init(&ctx, hash))
+				goto out;
+			if (crypt_hash_write(ctx, affix, affix_lengths[i]) ||
+			    crypt_hash_write(ctx, data + l * lengths[k], lengths[k]) ||
+			    crypt_hash_write(ctx, affix + 16, affix_lengths[j]) ||
+			    crypt_hash_final(ctx, digest, hash_size)) {
+				crypt_hash_destroy(ctx);
+				goto out;
+			}
+			crypt_hash_destroy(ctx);
+
+			if (memcmp(digest, digests + l * hash_size, hash_size)) {
+				printf("[FAILED prefix %zu, suffix %zu, length %zu, message %u]\n",
+				       affix_lengths[i], affix_lengths[j], lengths[k], l);
+				printhex(" got", digests + l * hash_size, hash_size);
+				printhex("want", digest, hash_size);
+				free(data);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	r = EXIT_SUCCESS;
+out:
+	printf(r ? "[FAILED]\n" : "[OK]\n");
+	free(data);
+	return r;
+}
+
+static int sha256_native_test(void)
+{
+	char data[300], digest[32], want[32];
+	struct crypt_hash *ctx;
+	size_t length;
+	unsigned i;
+
+	printf("SHA256 native ");
+	if (crypt_sha256_native("", 0, digest) == -ENOTSUP) {
+		printf("[N/A]\n");
+		return EXIT_SUCCESS;
+	}
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (char)(i * 13 + i / 7);
+
+	/* all padding variants (one and two tail blocks) and multiblock messages */
+	for (length = 0; length <= sizeof(data); length++) {
+		if (crypt_hash_init(&ctx, "sha256"))
+			return EXIT_FAILURE;
+		if (crypt_hash_write(ctx, data, length) ||
+		    crypt_hash_final(ctx, want, sizeof(want))) {
+			crypt_hash_destroy(ctx);
+			return EXIT_FAILURE;
+		}
+		crypt_hash_destroy(ctx);
+
+		if (crypt_sha256_native(data, length, digest) ||
+		    memcmp(digest, want, sizeof(want))) {
+			printf("[FAILED length %zu]\n", length);
+			printhex(" got", digest, sizeof(digest));
+			printhex("want", want, sizeof(want));
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("[OK]\n");
+	return EXIT_SUCCESS;
+}
+
 static int crc32_test(const struct hash_test_vector *vector, unsigned int i)
 {
 	uint32_t crc32;
@@ -1075,12 +1321,39 @@ static int crc32_test(const struct hash_test_vector *vector, unsigned int i)
 	return EXIT_SUCCESS;
 }
 
+/* bulk (slicing, PCLMULQDQ or ARMv8) paths must match running per-byte CRC */
+static int crc32_bulk_test(void)
+{
+	unsigned char data[600];
+	uint32_t crcs[sizeof(data)], crc;
+	size_t offset, length;
+	unsigned i;
+
+	printf("CRC32 bulk ");
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (unsigned char)(i * 13 + i / 7);
+
+	for (offset = 0; offset < 16; offset++)
+		for (length = 1; length + offset <= sizeof(data); length++) {
+			crypt_crc32_trace(~0, data + offset, length, crcs);
+			crc = crypt_crc32(~0, data + offset, length);
+			if (crc != crcs[length - 1]) {
+				printf("[FAILED offset %zu length %zu]\n", offset, length);
+				return EXIT_FAILURE;
+			}
+		}
+
+	printf("[OK]\n");
+	return EXIT_SUCCESS;
+}
+
 static int hash_test(void)
 {
 	const struct hash_test_vector *vector;
 	unsigned int i, j;
 	int r;
-	struct crypt_hash *h;
+	struct crypt_hash *h, *h2;
 	char result[64];
 
 	for (i = 0; i < ARRAY_SIZE(hash_test_vectors); i++) {
@@ -1150,6 +1423,36 @@ static int hash_test(void)
 				return EXIT_FAILURE;
 			}
 
+			/*
+			 * Explicit reset drops written data, copied context continues
+			 * from the state of the first half of data
+			 */
+			crypt_backend_memzero(result, sizeof(result));
+			r = crypt_hash_write(h, "garbage", 7);
+			if (!r)
+				r = crypt_hash_reset(h);
+			if (!r)
+				r = crypt_hash_write(h, vector->data, vector->data_length / 2);
+			if (!r)
+				r = crypt_hash_init(&h2, vector->out[j].name);
+			if (!r) {
+				r = crypt_hash_copy(h2, h);
+				if (!r)
+					r = crypt_hash_write(h2, vector->data + vector->data_length / 2,
+							     vector->data_length - vector->data_length / 2);
+				if (!r)
+					r = crypt_hash_final(h2, result, vector->out[j].length);
+				crypt_hash_destroy(h2);
+			}
+
+			if (r || memcmp(result, vector->out[j].out, vector->out[j].length)) {
+				printf("[FAILED (COPY CONTEXT)]\n");
+				printhex(" got", result, vector->out[j].length);
+				printhex("want", vector->out[j].out, vector->out[j].length);
+				crypt_hash_destroy(h);
+				return EXIT_FAILURE;
+			}
+
 			crypt_hash_destroy(h);
 		}
 		printf("\n");
@@ -1433,6 +1736,88 @@ static int base64_test(void)
 		free(s);
 	}
 
+	/* Whitespace is ignored, invalid characters and misplaced padding are rejected */
+	printf("BASE64 STRICT ");
+	s = NULL;
+	if (crypt_base64_decode(&s, &s_len, "Zm9v\nYmFy Zm9v\tYmE=\n", 20) < 0 ||
+	    s_len != 11 || memcmp(s, "foobarfooba", 11)) {
+		printf("[WHITESPACE FAILED]\n");
+		free(s);
+		return EXIT_FAILURE;
+	}
+	free(s);
+	for (i = 0; i < ARRAY_SIZE(base64_invalid_vectors); i++) {
+		s = NULL;
+		if (!crypt_base64_decode(&s, &s_len, base64_invalid_vectors[i],
+					 strlen(base64_invalid_vectors[i]))) {
+			printf("[INVALID %u ACCEPTED]\n", i);
+			free(s);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("[OK]\n");
+
+	return EXIT_SUCCESS;
+}
+
+/* RFC 8439, A.1 test vectors #1 and #2 (zero key and nonce, block counter 0 and 1) */
+static const char chacha20_zero_keystream[] =
+	"\x76\xb8\xe0\xad\xa0\xf1\x3d\x90\x40\x5d\x6a\xe5\x53\x86\xbd\x28"
+	"\xbd\xd2\x19\xb8\xa0\x8d\xed\x1a\xa8\x36\xef\xcc\x8b\x77\x0d\xc7"
+	"\xda\x41\x59\x7c\x51\x57\x48\x8d\x77\x24\xe0\x3f\xb8\xd8\x4a\x37"
+	"\x6a\x43\xb8\xf4\x15\x18\xa1\x1c\xc3\x87\xb6\x69\xb2\xee\x65\x86"
+	"\x9f\x07\xe7\xbe\x55\x51\x38\x7a\x98\xba\x97\x7c\x73\x2d\x08\x0d"
+	"\xcb\x0f\x29\xa0\x48\xe3\x65\x69\x12\xc6\x53\x3e\x32\xee\x7a\xed"
+	"\x29\xb7\x21\x76\x9c\xe6\x4e\x43\xd5\x71\x33\xb0\x74\xd8\x39\xd5"
+	"\x31\xed\x1f\x28\x51\x0a\xfb\x45\xac\xe1\x0a\x1f\x4b\x79\x4d\x6f";
+
+static int chacha20_test(void)
+{
+	static const size_t parts[] = { 1, 63, 7, 57 };
+	struct crypt_chacha20 *ctx;
+	char key[32] = {}, nonce[8] = {}, out[128], big[1024], ref[1024];
+	unsigned int i;
+	size_t off;
+
+	printf("CHACHA20 ");
+	if (crypt_chacha20_init(&ctx, key, sizeof(key), nonce, sizeof(nonce))) {
+		printf("[INIT FAILED]\n");
+		return EXIT_FAILURE;
+	}
+
+	crypt_chacha20_keystream(ctx, out, sizeof(out));
+	if (memcmp(out, chacha20_zero_keystream, sizeof(out))) {
+		printf("[FAILED]\n");
+		crypt_chacha20_destroy(ctx);
+		return EXIT_FAILURE;
+	}
+	printf("[stream]");
+
+	/* partial blocks continue the keystream */
+	crypt_chacha20_seek(ctx, 0);
+	for (i = 0, off = 0; i < ARRAY_SIZE(parts); off += parts[i++])
+		crypt_chacha20_keystream(ctx, &out[off], parts[i]);
+	if (memcmp(out, chacha20_zero_keystream, sizeof(out))) {
+		printf("[PARTIAL FAILED]\n");
+		crypt_chacha20_destroy(ctx);
+		return EXIT_FAILURE;
+	}
+	printf("[partial]");
+
+	/* multi-block generation must match block by block keystream */
+	crypt_chacha20_seek(ctx, UINT64_C(0xfffffffe));
+	crypt_chacha20_keystream(ctx, big, sizeof(big));
+	crypt_chacha20_seek(ctx, UINT64_C(0xfffffffe));
+	for (off = 0; off < sizeof(big); off += 64)
+		crypt_chacha20_keystream(ctx, &ref[off], 64);
+	if (memcmp(big, ref, sizeof(big))) {
+		printf("[MULTI FAILED]\n");
+		crypt_chacha20_destroy(ctx);
+		return EXIT_FAILURE;
+	}
+	printf("[multi]\n");
+
+	crypt_chacha20_destroy(ctx);
 	return EXIT_SUCCESS;
 }
 
@@ -1502,6 +1887,161 @@ static int memcmp_test(void)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Benchmark mode (--benchmark): every primitive is run at sizes used by
+ * the library for BENCH_SECONDS and results are printed as JSON.
+ * To compare backends, run it from builds configured with each one.
+ */
+#define BENCH_SECONDS 0.2
+#define BENCH_BLOCK 4096
+
+enum bench_op { BENCH_HASH, BENCH_HMAC, BENCH_VERITY, BENCH_ENCRYPT, BENCH_DECRYPT,
+		BENCH_PBKDF, BENCH_BITLK };
+
+struct bench_case {
+	const char *name;
+	enum bench_op op;
+	const char *alg;
+	const char *mode;
+	size_t size;
+	uint32_t iterations;
+	uint32_t memory_kb;
+};
+
+static const struct bench_case bench_cases[] = {
+	{ "hash",    BENCH_HASH,    "sha256", NULL, 512 },
+	{ "hash",    BENCH_HASH,    "sha256", NULL, 4096 },
+	{ "hash",    BENCH_HASH,    "sha512", NULL, 4096 },
+	{ "hmac",    BENCH_HMAC,    "sha256", NULL, 4096 },
+	{ "verity",  BENCH_VERITY,  "sha256", NULL, 4096 },
+	{ "encrypt", BENCH_ENCRYPT, "aes", "xts-plain64", 512 },
+	{ "encrypt", BENCH_ENCRYPT, "aes", "xts-plain64", 4096 },
+	{ "decrypt", BENCH_DECRYPT, "aes", "xts-plain64", 4096 },
+	{ "encrypt", BENCH_ENCRYPT, "aes", "cbc-essiv:sha256", 512 },
+	{ "pbkdf",   BENCH_PBKDF,   "pbkdf2", "sha256", 64, 100000 },
+	{ "pbkdf",   BENCH_PBKDF,   "argon2id", NULL, 64, 4, 64 * 1024 },
+	{ "bitlk_kdf", BENCH_BITLK, "sha256", NULL, 88, 0x100000 },
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_one(const struct bench_case *c, char *buf, const char *key,
+		     struct crypt_storage *s)
+{
+	struct crypt_hash *hd = NULL;
+	struct crypt_hmac *hmac = NULL;
+	char digest[64];
+	uint32_t i;
+	int r = 0;
+
+	switch (c->op) {
+	case BENCH_HASH:
+	case BENCH_VERITY:
+	case BENCH_BITLK:
+		if (crypt_hash_init(&hd, c->alg))
+			return -ENOTSUP;
+		for (i = 0; !r && i < (c->op == BENCH_BITLK ? c->iterations : 1); i++) {
+			/* verity block hash is salt followed by data block */
+			if (c->op == BENCH_VERITY)
+				r = crypt_hash_write(hd, key, 32);
+			if (!r)
+				r = crypt_hash_write(hd, buf, c->size);
+			if (!r)
+				r = crypt_hash_final(hd, digest, crypt_hash_size(c->alg));
+			/* BitLocker KDF feeds the last digest back */
+			if (!r && c->op == BENCH_BITLK)
+				memcpy(buf, digest, 32);
+		}
+		crypt_hash_destroy(hd);
+		return r;
+	case BENCH_HMAC:
+		if (crypt_hmac_init(&hmac, c->alg, key, 32))
+			return -ENOTSUP;
+		r = crypt_hmac_write(hmac, buf, c->size);
+		if (!r)
+			r = crypt_hmac_final(hmac, digest, crypt_hmac_size(c->alg));
+		crypt_hmac_destroy(hmac);
+		return r;
+	case BENCH_ENCRYPT:
+	case BENCH_DECRYPT:
+		/* one 4 KiB block per run, in sectors of the case size */
+		if (c->op == BENCH_ENCRYPT)
+			return crypt_storage_encrypt(s, 0, BENCH_BLOCK, buf);
+		return crypt_storage_decrypt(s, 0, BENCH_BLOCK, buf);
+	case BENCH_PBKDF:
+		return crypt_pbkdf(c->alg, c->mode ?: "sha256", "foo", 3, key, 16,
+				   digest, c->size, c->iterations, c->memory_kb, 1);
+	}
+
+	return -EINVAL;
+}
+
+static int benchmark(void)
+{
+	const struct bench_case *c;
+	struct crypt_storage *s;
+	char key[64], *buf;
+	double start, secs = 0;
+	uint64_t ops;
+	unsigned i;
+	int r;
+
+	buf = aligned_alloc(4096, BENCH_BLOCK);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0x5a, BENCH_BLOCK);
+	memset(key, 0xa5, sizeof(key));
+
+	printf("{\n  \"backend\": \"%s\",\n  \"results\": [", crypt_backend_version());
+
+	for (i = 0; i < ARRAY_SIZE(bench_cases); i++) {
+		c = &bench_cases[i];
+		ops = 0;
+		s = NULL;
+		r = 0;
+
+		/* key setup is not measured */
+		if ((c->op == BENCH_ENCRYPT || c->op == BENCH_DECRYPT) &&
+		    crypt_storage_init(&s, c->size, c->alg, c->mode, key, 64, false))
+			r = -ENOTSUP;
+
+		start = bench_now();
+		while (!r) {
+			r = bench_one(c, buf, key, s);
+			ops++;
+			if ((secs = bench_now() - start) >= BENCH_SECONDS)
+				break;
+		}
+		crypt_storage_destroy(s);
+
+		printf("%s\n    { \"op\": \"%s\", \"alg\": \"%s%s%s\", \"size\": %zu, ",
+		       i ? "," : "", c->name, c->alg, c->mode ? "-" : "", c->mode ?: "", c->size);
+
+		if (r < 0) {
+			printf("\"error\": %d }", r);
+			continue;
+		}
+
+		if (c->op == BENCH_PBKDF || c->op == BENCH_BITLK)
+			printf("\"iterations\": %u, \"ms_per_op\": %.3f }",
+			       c->iterations, secs * 1e3 / ops);
+		else
+			printf("\"ops_per_s\": %.0f, \"mb_per_s\": %.2f }", ops / secs,
+			       ops * (c->op == BENCH_ENCRYPT || c->op == BENCH_DECRYPT ?
+				      BENCH_BLOCK : c->size) / secs / 1e6);
+	}
+
+	printf("\n  ]\n}\n");
+	free(buf);
+	return 0;
+}
+
 static void __attribute__((noreturn)) exit_test(const char *msg, int r)
 {
 	if (msg)
@@ -1510,7 +2050,7 @@ static void __attribute__((noreturn)) exit_test(const char *msg, int r)
 	exit(r);
 }
 
-int main(__attribute__ ((unused)) int argc, __attribute__ ((unused))char *argv[])
+int main(int argc, char *argv[])
 {
 	setvbuf(stdout, NULL, _IONBF, 0);
 
@@ -1522,14 +2062,29 @@ int main(__attribute__ ((unused)) int argc, __attribute__ ((unused))char *argv[]
 	if (crypt_backend_init(fips_mode()))
 		exit_test("Crypto backend init error.", EXIT_FAILURE);
 
+	if (argc > 1 && !strcmp(argv[1], "--benchmark"))
+		exit_test(NULL, benchmark() ? EXIT_FAILURE : EXIT_SUCCESS);
+
 	printf("Test vectors using %s crypto backend.\n", crypt_backend_version());
 
 	if (pbkdf_test_vectors())
 		exit_test("PBKDF test failed.", EXIT_FAILURE);
 
+	if (pbkdf2_multi_test("sha256") || pbkdf2_multi_test("sha512"))
+		exit_test("PBKDF2 multi-lane test failed.", EXIT_FAILURE);
+
 	if (hash_test())
 		exit_test("HASH test failed.", EXIT_FAILURE);
 
+	if (hash_multi_test("sha256") || hash_multi_test("sha512"))
+		exit_test("HASH multi-buffer test failed.", EXIT_FAILURE);
+
+	if (sha256_native_test())
+		exit_test("SHA256 native test failed.", EXIT_FAILURE);
+
+	if (crc32_bulk_test())
+		exit_test("CRC32 bulk test failed.", EXIT_FAILURE);
+
 	if (hmac_test())
 		exit_test("HMAC test failed.", EXIT_FAILURE);
 
@@ -1542,6 +2097,9 @@ int main(__attribute__ ((unused)) int argc, __attribute__ ((unused))char *argv[]
 	if (base64_test())
 		exit_test("BASE64 test failed.", EXIT_FAILURE);
 
+	if (chacha20_test())
+		exit_test("CHACHA20 test failed.", EXIT_FAILURE);
+
 	if (memcmp_test())
 		exit_test("Memcmp test failed.", EXIT_FAILURE);
 
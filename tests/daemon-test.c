@@ -0,0 +1,329 @@
+/*
+ * cryptsetup-daemon socket protocol test
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The daemon ($CRYPTSETUP_PATH/cryptsetup-daemon) is started on a local socket
+ * and requests are sent with key descriptors passed over SCM_RIGHTS.
+ * Without root the daemon runs with --allow-uid of the current user and only
+ * requests that do not need device-mapper are checked. As root a LUKS2 image
+ * on loop device is really opened, and close by an unprivileged peer
+ * that does not own the mapping is checked to fail.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "api_test.h"
+#include "libcryptsetup.h"
+
+#define SOCKET_PATH	"./daemon-test.sock"
+#define IMAGE		"./daemon-test.img"
+#define PASSPHRASE	"daemon-test"
+#define DEV_NAME	"daemon_test"
+#define NOBODY_UID	65534
+
+static pid_t daemon_pid = -1;
+static char *loop = NULL;
+
+static void cleanup(void)
+{
+	if (daemon_pid > 0) {
+		kill(daemon_pid, SIGTERM);
+		waitpid(daemon_pid, NULL, 0);
+		daemon_pid = -1;
+	}
+	if (loop) {
+		(void) crypt_deactivate(NULL, DEV_NAME);
+		loop_detach(loop);
+		free(loop);
+		loop = NULL;
+	}
+	unlink(SOCKET_PATH);
+	unlink(IMAGE);
+}
+
+static void fail(int line, const char *msg, const char *got)
+{
+	fprintf(stderr, "FAIL line %d: %s%s%s\n", line, msg, got ? ", got: " : "", got ?: "");
+	cleanup();
+	exit(EXIT_FAILURE);
+}
+
+#define CHECK(x, msg) do { if (!(x)) fail(__LINE__, msg, NULL); } while (0)
+#define CHECK_REPLY(r, prefix) do { if (strncmp(r, prefix, strlen(prefix))) \
+					fail(__LINE__, "unexpected reply " prefix, r); } while (0)
+
+static void log_quiet(int level __attribute__((unused)), const char *msg __attribute__((unused)),
+		      void *usrptr __attribute__((unused)))
+{
+}
+
+static int start_daemon(const char *allow_uid, const char *group)
+{
+	const char *path = getenv("CRYPTSETUP_PATH") ?: "..";
+	char daemon[4096];
+	struct stat st;
+	int i;
+
+	snprintf(daemon, sizeof(daemon), "%s/cryptsetup-daemon", path);
+	if (access(daemon, X_OK))
+		return -ENOENT;
+
+	unlink(SOCKET_PATH);
+	daemon_pid = fork();
+	if (daemon_pid < 0)
+		return -errno;
+	if (!daemon_pid) {
+		execl(daemon, daemon, "--socket", SOCKET_PATH, "--allow-uid", allow_uid,
+		      "--socket-group", group, NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 100; i++) {
+		if (!stat(SOCKET_PATH, &st) && S_ISSOCK(st.st_mode))
+			return 0;
+		usleep(50000);
+	}
+
+	return -ETIMEDOUT;
+}
+
+/*
+ * Send requests, attach fds (may be empty) to the first message,
+ * shut down writing side and read all replies.
+ */
+static int request(const char *req, const int *fds, int nfds, char *reply, size_t reply_size)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char control[CMSG_SPACE(sizeof(int) * 4)] = {};
+	struct iovec iov = { .iov_base = (void *)req, .iov_len = strlen(req) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	size_t size = 0;
+	ssize_t r;
+	int fd;
+
+	strcpy(addr.sun_path, SOCKET_PATH);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto err;
+
+	if (nfds) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	if (sendmsg(fd, &msg, 0) != (ssize_t)strlen(req) || shutdown(fd, SHUT_WR))
+		goto err;
+
+	while (size < reply_size - 1 && (r = read(fd, reply + size, reply_size - 1 - size)) > 0)
+		size += r;
+	reply[size] = '\0';
+	close(fd);
+	return 0;
+err:
+	if (fd >= 0)
+		close(fd);
+	return -EIO;
+}
+
+static int key_pipe(const char *key)
+{
+	int p[2];
+
+	if (pipe(p))
+		return -1;
+	if (write(p[1], key, strlen(key)) != (ssize_t)strlen(key)) {
+		close(p[0]);
+		p[0] = -1;
+	}
+	close(p[1]);
+	return p[0];
+}
+
+static int format_image(const char *device)
+{
+	struct crypt_pbkdf_type pbkdf = { .type = CRYPT_KDF_PBKDF2, .hash = "sha256",
+					  .iterations = 1000, .flags = CRYPT_PBKDF_NO_BENCHMARK };
+	struct crypt_device *cd = NULL;
+	int r;
+
+	r = crypt_init(&cd, device);
+	if (!r)
+		r = crypt_set_pbkdf_type(cd, &pbkdf);
+	if (!r)
+		r = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 64, NULL);
+	if (!r)
+		r = crypt_keyslot_add_by_volume_key(cd, 0, NULL, 0, PASSPHRASE, strlen(PASSPHRASE));
+	crypt_free(cd);
+	return r < 0 ? r : 0;
+}
+
+static void test_protocol(const char *device)
+{
+	char req[512], reply[4096];
+	int fds[2];
+
+	/* device-mapper status needs root */
+	if (!getuid()) {
+		CHECK(!request("status " DEV_NAME "\n", NULL, 0, reply, sizeof(reply)), "request");
+		CHECK_REPLY(reply, "OK inactive\n");
+	}
+
+	CHECK(!request("bogus request\nstatus\n", NULL, 0, reply, sizeof(reply)), "request");
+	CHECK_REPLY(reply, "ERR -22 ");
+	CHECK(strchr(reply, '\n') && !strncmp(strchr(reply, '\n') + 1, "ERR -22 ", 8), "second reply");
+
+	/* keyfile path is no longer accepted, the key comes as descriptor only */
+	snprintf(req, sizeof(req), "open %s " DEV_NAME " /etc/passwd\n", device);
+	CHECK(!request(req, NULL, 0, reply, sizeof(reply)), "request");
+	CHECK_REPLY(reply, "ERR -22 ");
+
+	snprintf(req, sizeof(req), "open %s " DEV_NAME " keyfd\n", device);
+	CHECK(!request(req, NULL, 0, reply, sizeof(reply)), "request");
+	CHECK_REPLY(reply, "ERR -9 ");
+
+	/* write-only descriptor cannot be used as a key */
+	fds[0] = open(IMAGE, O_WRONLY);
+	CHECK(fds[0] >= 0, "open image");
+	snprintf(req, sizeof(req), "open %s " DEV_NAME " keyfd\n", device);
+	CHECK(!request(req, fds, 1, reply, sizeof(reply)), "request");
+	close(fds[0]);
+	CHECK_REPLY(reply, "ERR -9 ");
+
+	/* pipe that is never written nor closed must not block the daemon */
+	CHECK(!pipe(fds), "pipe");
+	CHECK(!request(req, fds, 1, reply, sizeof(reply)), "request");
+	close(fds[0]);
+	close(fds[1]);
+	CHECK_REPLY(reply, "ERR -110 ");
+
+	/* token unlock is not done on behalf of non-root peer */
+	if (getuid()) {
+		snprintf(req, sizeof(req), "open %s " DEV_NAME "\n", device);
+		CHECK(!request(req, NULL, 0, reply, sizeof(reply)), "request");
+		CHECK_REPLY(reply, "ERR -1 ");
+	}
+}
+
+static void test_close_owner(const char *device)
+{
+	char req[512], reply[4096];
+	pid_t pid;
+	int fd, status;
+
+	fd = key_pipe(PASSPHRASE);
+	CHECK(fd >= 0, "key pipe");
+	snprintf(req, sizeof(req), "open %s " DEV_NAME " keyfd\nstatus " DEV_NAME "\n", device);
+	CHECK(!request(req, &fd, 1, reply, sizeof(reply)), "request");
+	close(fd);
+	CHECK_REPLY(reply, "OK\nOK active\n");
+
+	/* allowed, but not owning peer */
+	pid = fork();
+	CHECK(pid >= 0, "fork");
+	if (!pid) {
+		snprintf(req, sizeof(req), "open %s " DEV_NAME "_token\nclose " DEV_NAME "\n", device);
+		if (setgid(0) || setuid(NOBODY_UID) ||
+		    request(req, NULL, 0, reply, sizeof(reply)))
+			_exit(2);
+		_exit(strncmp(reply, "ERR -1 ", 7) || !strchr(reply, '\n') ||
+		      strncmp(strchr(reply, '\n') + 1, "ERR -1 ", 7) ? 1 : 0);
+	}
+	CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status),
+	      "token open and close by non-owner must fail");
+
+	CHECK(!request("close " DEV_NAME "\nstatus " DEV_NAME "\n", NULL, 0, reply, sizeof(reply)),
+	      "request");
+	CHECK_REPLY(reply, "OK\nOK inactive\n");
+}
+
+int main(void)
+{
+	char uid[32], reply[64];
+	struct group *gr;
+	struct stat st;
+	int fd, ro = 0;
+	const char *device = IMAGE;
+
+	crypt_set_log_callback(NULL, log_quiet, NULL);
+
+	fd = open(IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, 32 * 1024 * 1024)) {
+		fprintf(stderr, "Cannot create image.\n");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	if (format_image(IMAGE)) {
+		cleanup();
+		printf("TEST SKIPPED: cannot format LUKS2 image.\n");
+		return 77;
+	}
+
+	gr = getgrgid(getgid());
+	if (!gr)
+		fail(__LINE__, "no group for gid", NULL);
+
+	snprintf(uid, sizeof(uid), "%d", getuid() ? (int)getuid() : NOBODY_UID);
+	if (start_daemon(uid, gr->gr_name)) {
+		cleanup();
+		printf("TEST SKIPPED: cannot start cryptsetup-daemon.\n");
+		return 77;
+	}
+
+	CHECK(!stat(SOCKET_PATH, &st) && (st.st_mode & 0777) == 0660 && st.st_gid == gr->gr_gid,
+	      "socket must be 0660 with the socket group");
+
+	if (!getuid()) {
+		CHECK(!loop_attach(&loop, IMAGE, 0, 0, &ro), "loop attach");
+		device = loop;
+	}
+
+	test_protocol(device);
+
+	if (!getuid())
+		test_close_owner(device);
+	else {
+		/* mapping not opened by this peer */
+		CHECK(!request("close " DEV_NAME "\n", NULL, 0, reply, sizeof(reply)), "request");
+		CHECK_REPLY(reply, "ERR -1 ");
+	}
+
+	cleanup();
+	printf("cryptsetup-daemon tests passed.\n");
+	return EXIT_SUCCESS;
+}
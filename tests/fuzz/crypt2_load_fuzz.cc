@@ -83,30 +83,15 @@ out:
 }
 
 int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
-	int fd;
 	struct crypt_device *cd = NULL;
-	char name[] = "/tmp/test-script-fuzz.XXXXXX";
 
 	if (calculate_checksum(data, size))
 		return 0;
 
-	fd = mkostemp(name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC);
-	if (fd == -1)
-		err(EXIT_FAILURE, "mkostemp() failed");
-
-	/* enlarge header */
-	if (ftruncate(fd, FILESIZE) == -1)
-		goto out;
-
-	if (write_buffer(fd, data, size) != (ssize_t)size)
-		goto out;
-
-	if (crypt_init(&cd, name) == 0)
+	/* in-memory device enlarged to header size, no temporary file */
+	if (crypt_init_memory(&cd, (const char *)data, size, FILESIZE, NULL) == 0)
 		(void)crypt_load(cd, CRYPT_LUKS2, NULL);
 	crypt_free(cd);
-out:
-	close(fd);
-	unlink(name);
 	return 0;
 }
 }
@@ -0,0 +1,144 @@
+/*
+ * cryptsetup built-in executor shutdown test
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#define TASKS		8
+#define TASK_USEC	200000
+
+static unsigned int tasks_done;
+
+static void *slow_task(void *arg __attribute__((unused)))
+{
+	usleep(TASK_USEC);
+	__atomic_add_fetch(&tasks_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *fast_task(void *arg __attribute__((unused)))
+{
+	__atomic_add_fetch(&tasks_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+/*
+ * Shutdown waits for all running pool tasks before it returns.
+ */
+static int test_drain(void)
+{
+	struct crypt_thread t[TASKS];
+	int i, started = 0, r = EXIT_SUCCESS;
+
+	tasks_done = 0;
+	for (i = 0; i < TASKS; i++)
+		if (!crypt_thread_start(&t[i], slow_task, NULL, CRYPT_THREAD_CONCURRENT))
+			started++;
+
+	if (!started) {
+		printf("TEST SKIPPED: cannot start pool threads.\n");
+		return 77;
+	}
+
+	crypt_executor_exit();
+
+	if (__atomic_load_n(&tasks_done, __ATOMIC_ACQUIRE) != (unsigned)started) {
+		fprintf(stderr, "Shutdown returned with %u of %d tasks done.\n",
+			tasks_done, started);
+		r = EXIT_FAILURE;
+	}
+
+	for (i = 0; i < TASKS; i++)
+		crypt_thread_join(&t[i]);
+
+	return r;
+}
+
+/*
+ * Idle workers are stopped at once, not after the idle timeout,
+ * and the pool is usable again after shutdown.
+ */
+static int test_idle_shutdown(void)
+{
+	struct crypt_thread t;
+	double start;
+
+	tasks_done = 0;
+	if (crypt_thread_start(&t, fast_task, NULL, CRYPT_THREAD_CONCURRENT))
+		return EXIT_FAILURE;
+	crypt_thread_join(&t);
+
+	/* worker is idle now */
+	start = now();
+	crypt_executor_exit();
+	if (now() - start > 5.0) {
+		fprintf(stderr, "Idle worker not stopped on shutdown.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (crypt_thread_start(&t, fast_task, NULL, CRYPT_THREAD_CONCURRENT))
+		return EXIT_FAILURE;
+	crypt_thread_join(&t);
+
+	if (tasks_done != 2) {
+		fprintf(stderr, "Task after shutdown did not run.\n");
+		return EXIT_FAILURE;
+	}
+
+	crypt_executor_exit();
+	return EXIT_SUCCESS;
+}
+
+/* Shutdown without any pool worker returns immediately */
+static int test_empty_shutdown(void)
+{
+	crypt_executor_exit();
+	crypt_executor_exit();
+	return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+	int r;
+
+	r = test_empty_shutdown();
+	if (r == EXIT_SUCCESS)
+		r = test_drain();
+	if (r == EXIT_SUCCESS)
+		r = test_idle_shutdown();
+
+	return r;
+}
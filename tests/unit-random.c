@@ -0,0 +1,151 @@
+/*
+ * cryptsetup in-process random generator fork test
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "internal.h"
+
+#define RND_LEN		64
+#define FORK_ROUNDS	32
+
+static volatile bool stop_worker;
+
+static void *random_worker(void *arg __attribute__((unused)))
+{
+	char buf[RND_LEN];
+
+	while (!stop_worker)
+		if (crypt_random_get(NULL, buf, sizeof(buf), CRYPT_RND_SALT) < 0)
+			return (void *)1;
+
+	return NULL;
+}
+
+/*
+ * Child must not repeat bytes the parent generates next from the same state.
+ */
+static int test_fork_output(void)
+{
+	char parent[RND_LEN], child[RND_LEN];
+	int status, p[2];
+	pid_t pid;
+
+	/* make the generator state exist before fork */
+	if (crypt_random_get(NULL, parent, sizeof(parent), CRYPT_RND_NORMAL) < 0 || pipe(p))
+		return EXIT_FAILURE;
+
+	pid = fork();
+	if (pid < 0)
+		return EXIT_FAILURE;
+	if (!pid) {
+		close(p[0]);
+		if (crypt_random_get(NULL, child, sizeof(child), CRYPT_RND_NORMAL) < 0 ||
+		    write(p[1], child, sizeof(child)) != (ssize_t)sizeof(child))
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(p[1]);
+	if (crypt_random_get(NULL, parent, sizeof(parent), CRYPT_RND_NORMAL) < 0 ||
+	    read(p[0], child, sizeof(child)) != (ssize_t)sizeof(child)) {
+		close(p[0]);
+		waitpid(pid, NULL, 0);
+		return EXIT_FAILURE;
+	}
+	close(p[0]);
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		return EXIT_FAILURE;
+
+	if (!memcmp(parent, child, sizeof(parent))) {
+		fprintf(stderr, "Child repeated parent random output.\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Fork while other thread uses the generator, child must not inherit held lock.
+ */
+static int test_fork_threaded(void)
+{
+	char buf[RND_LEN];
+	pthread_t thread;
+	int i, status, r = EXIT_SUCCESS;
+	void *ret = NULL;
+	pid_t pid;
+
+	if (pthread_create(&thread, NULL, random_worker, NULL))
+		return EXIT_FAILURE;
+
+	for (i = 0; i < FORK_ROUNDS && r == EXIT_SUCCESS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			r = EXIT_FAILURE;
+			break;
+		}
+		if (!pid) {
+			/* deadlock ends with SIGALRM */
+			alarm(5);
+			_exit(crypt_random_get(NULL, buf, sizeof(buf), CRYPT_RND_SALT) < 0 ?
+			      EXIT_FAILURE : EXIT_SUCCESS);
+		}
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "Random generator failed in forked child.\n");
+			r = EXIT_FAILURE;
+		}
+	}
+
+	stop_worker = true;
+	if (pthread_join(thread, &ret) || ret)
+		r = EXIT_FAILURE;
+
+	return r;
+}
+
+int main(void)
+{
+	int r;
+
+	if (crypt_fips_mode()) {
+		printf("TEST SKIPPED: in-process generator is not used in FIPS mode.\n");
+		return 77;
+	}
+
+	if (crypt_random_init(NULL)) {
+		printf("TEST SKIPPED: cannot initialize RNG.\n");
+		return 77;
+	}
+
+	r = test_fork_output();
+	if (r == EXIT_SUCCESS)
+		r = test_fork_threaded();
+
+	crypt_random_exit();
+	return r;
+}
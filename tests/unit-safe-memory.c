@@ -0,0 +1,227 @@
+/*
+ * cryptsetup safe memory allocation test
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "libcryptsetup.h"
+
+/* must match lib/utils_safe_memory.c */
+#define ARENA_SIZE	(64 * 1024)
+#define ARENA_CHUNK	32
+#define ALLOC_SMALL	8
+#define ALLOC_LARGE	1024	/* 2048 bytes chunk class */
+#define ALLOC_COUNT	(ARENA_SIZE / 2048)
+
+static char *arena_start;
+static bool arena_locked;
+
+static bool in_arena(const char *p)
+{
+	return p >= arena_start && p < arena_start + ARENA_SIZE;
+}
+
+static bool is_zero(const char *p, size_t size)
+{
+	while (size--)
+		if (*p++)
+			return false;
+	return true;
+}
+
+/* Freed chunk is the first one reused for the same size class */
+static int test_reuse(void)
+{
+	char *p1, *p2;
+
+	p1 = crypt_safe_alloc(ALLOC_SMALL);
+	if (!p1)
+		return EXIT_FAILURE;
+	memset(p1, 0xaa, ALLOC_SMALL);
+	crypt_safe_free(p1);
+
+	p2 = crypt_safe_alloc(ALLOC_SMALL);
+	if (p2 != p1 || !is_zero(p2, ALLOC_SMALL)) {
+		fprintf(stderr, "Arena chunk not reused or not wiped.\n");
+		crypt_safe_free(p2);
+		return EXIT_FAILURE;
+	}
+	crypt_safe_free(p2);
+
+	return EXIT_SUCCESS;
+}
+
+/* Allocation over arena capacity falls back to malloc, all memory is usable */
+static int test_fallback(void)
+{
+	char *p[ALLOC_COUNT + 8];
+	int i, arena_count = 0, r = EXIT_SUCCESS;
+
+	for (i = 0; i < (int)(sizeof(p) / sizeof(*p)); i++) {
+		p[i] = crypt_safe_alloc(ALLOC_LARGE);
+		if (!p[i] || !is_zero(p[i], ALLOC_LARGE)) {
+			fprintf(stderr, "Allocation %d failed.\n", i);
+			r = EXIT_FAILURE;
+			break;
+		}
+		memset(p[i], 0x55, ALLOC_LARGE);
+		if (in_arena(p[i]))
+			arena_count++;
+	}
+
+	/* first slab is used by small class, the rest is shared by large chunks */
+	if (r == EXIT_SUCCESS && (!arena_count || arena_count >= ALLOC_COUNT ||
+	    in_arena(p[ALLOC_COUNT + 7]))) {
+		fprintf(stderr, "Unexpected arena use (%d chunks).\n", arena_count);
+		r = EXIT_FAILURE;
+	}
+
+	while (i--)
+		crypt_safe_free(p[i]);
+
+	/* all arena chunks are free again */
+	p[0] = crypt_safe_alloc(ALLOC_LARGE);
+	if (r == EXIT_SUCCESS && (!p[0] || !in_arena(p[0]))) {
+		fprintf(stderr, "Freed arena chunk not reused.\n");
+		r = EXIT_FAILURE;
+	}
+	crypt_safe_free(p[0]);
+
+	return r;
+}
+
+static unsigned long locked_kb(void)
+{
+	char line[256];
+	unsigned long kb = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmLck: %lu kB", &kb) == 1)
+			break;
+	fclose(f);
+
+	return kb;
+}
+
+/* Child locks the arena again (memory locks are not inherited) */
+static int test_fork(void)
+{
+	int status;
+	pid_t pid;
+	char *p;
+
+	pid = fork();
+	if (pid < 0)
+		return EXIT_FAILURE;
+	if (!pid) {
+		if (arena_locked && locked_kb() < ARENA_SIZE / 1024)
+			_exit(EXIT_FAILURE);
+		p = crypt_safe_alloc(ALLOC_SMALL);
+		if (!p || !in_arena(p))
+			_exit(EXIT_FAILURE);
+		crypt_safe_free(p);
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "Arena not locked or not usable in forked child.\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* arena allocates chunks of one class sequentially from the first slab */
+static bool arena_used(void)
+{
+	char *p1, *p2;
+	bool r;
+
+	p1 = crypt_safe_alloc(ALLOC_SMALL);
+	p2 = crypt_safe_alloc(ALLOC_SMALL);
+	r = p1 && p2 && p2 - p1 == ARENA_CHUNK;
+	if (r)
+		arena_start = p1 - (uintptr_t)p1 % ARENA_CHUNK;
+	crypt_safe_free(p2);
+	crypt_safe_free(p1);
+
+	return r;
+}
+
+/* Arena that cannot be locked is used unlocked, not skipped */
+static int test_no_memlock(void)
+{
+	struct rlimit rlim;
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return EXIT_FAILURE;
+	if (!pid) {
+		/* arena is created on the first allocation in the child */
+		if (getrlimit(RLIMIT_MEMLOCK, &rlim))
+			_exit(EXIT_FAILURE);
+		rlim.rlim_cur = 0;
+		if (setrlimit(RLIMIT_MEMLOCK, &rlim) || !arena_used())
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "Arena not used without RLIMIT_MEMLOCK.\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+	int r;
+
+	r = test_no_memlock();
+	if (r != EXIT_SUCCESS)
+		return r;
+
+	if (!arena_used()) {
+		printf("TEST SKIPPED: safe memory arena not available.\n");
+		return 77;
+	}
+	arena_locked = locked_kb() >= ARENA_SIZE / 1024;
+
+	r = test_reuse();
+	if (r == EXIT_SUCCESS)
+		r = test_fallback();
+	if (r == EXIT_SUCCESS)
+		r = test_fork();
+
+	return r;
+}
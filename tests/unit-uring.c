@@ -0,0 +1,196 @@
+/*
+ * cryptsetup io_uring bulk I/O helper test
+ *
+ * Copyright (C) 2022 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils_uring.h"
+
+#define TEST_FILE	"unit-uring.img"
+#define TEST_DEPTH	8
+#define TEST_CHUNK	4096
+/* more chunks than ring depth, the last one is partial */
+#define TEST_LENGTH	(64 * TEST_CHUNK + 512)
+
+static void *wbuf, *rbuf;
+
+static void pattern(char *buf, size_t length, unsigned seed)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		buf[i] = (char)(i * 31 + i / TEST_CHUNK + seed);
+}
+
+static int check_rw(struct crypt_uring *ring, unsigned seed, const char *msg)
+{
+	ssize_t r;
+
+	pattern(wbuf, TEST_LENGTH, seed);
+	memset(rbuf, 0, TEST_LENGTH);
+
+	r = crypt_uring_rw(ring, true, wbuf, TEST_LENGTH, TEST_CHUNK, TEST_CHUNK);
+	if (r != TEST_LENGTH) {
+		fprintf(stderr, "%s: write returned %zd.\n", msg, r);
+		return EXIT_FAILURE;
+	}
+
+	r = crypt_uring_rw(ring, false, rbuf, TEST_LENGTH, TEST_CHUNK, TEST_CHUNK);
+	if (r != TEST_LENGTH) {
+		fprintf(stderr, "%s: read returned %zd.\n", msg, r);
+		return EXIT_FAILURE;
+	}
+
+	if (memcmp(wbuf, rbuf, TEST_LENGTH)) {
+		fprintf(stderr, "%s: data read differs.\n", msg);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Data written in chunks kept in flight are read back the same */
+static int test_rw(int fd)
+{
+	struct crypt_uring *ring;
+	int r;
+
+	if (crypt_uring_init(&ring, fd, TEST_DEPTH))
+		return EXIT_FAILURE;
+
+	r = check_rw(ring, 0, "Bulk I/O");
+	crypt_uring_destroy(ring);
+
+	return r;
+}
+
+/* Registered buffers are used for fixed I/O */
+static int test_fixed_buffers(int fd)
+{
+	struct crypt_uring *ring;
+	struct iovec iov[2] = {
+		{ .iov_base = wbuf, .iov_len = TEST_LENGTH },
+		{ .iov_base = rbuf, .iov_len = TEST_LENGTH },
+	};
+	int r;
+
+	if (crypt_uring_init(&ring, fd, TEST_DEPTH))
+		return EXIT_FAILURE;
+
+	if (crypt_uring_register_buffers(ring, iov, 2)) {
+		printf("Cannot register buffers, fixed buffers test skipped.\n");
+		crypt_uring_destroy(ring);
+		return EXIT_SUCCESS;
+	}
+
+	r = check_rw(ring, 1, "Fixed buffers I/O");
+	crypt_uring_destroy(ring);
+
+	return r;
+}
+
+/* Failed request is reported and the ring is usable afterwards */
+static int test_errors(int fd)
+{
+	struct crypt_uring *ring;
+	ssize_t r;
+	int ro_fd, ret = EXIT_FAILURE;
+
+	if (crypt_uring_init(&ring, fd, TEST_DEPTH))
+		return EXIT_FAILURE;
+
+	/* short read past the end of file */
+	r = crypt_uring_rw(ring, false, rbuf, TEST_LENGTH, 2 * TEST_LENGTH, TEST_CHUNK);
+	if (r >= 0) {
+		fprintf(stderr, "Read past end of file returned %zd.\n", r);
+		goto out;
+	}
+
+	if (check_rw(ring, 2, "I/O after failed read"))
+		goto out;
+
+	crypt_uring_destroy(ring);
+	ring = NULL;
+
+	ro_fd = open(TEST_FILE, O_RDONLY);
+	if (ro_fd < 0 || crypt_uring_init(&ring, ro_fd, TEST_DEPTH)) {
+		if (ro_fd >= 0)
+			close(ro_fd);
+		goto out;
+	}
+
+	r = crypt_uring_rw(ring, true, wbuf, TEST_LENGTH, TEST_CHUNK, TEST_CHUNK);
+	if (r >= 0)
+		fprintf(stderr, "Write to read-only file returned %zd.\n", r);
+	else if (crypt_uring_rw(ring, false, rbuf, TEST_LENGTH, TEST_CHUNK, TEST_CHUNK) != TEST_LENGTH)
+		fprintf(stderr, "Read after failed write failed.\n");
+	else
+		ret = EXIT_SUCCESS;
+
+	crypt_uring_destroy(ring);
+	ring = NULL;
+	close(ro_fd);
+out:
+	crypt_uring_destroy(ring);
+	return ret;
+}
+
+int main(void)
+{
+	struct crypt_uring *ring;
+	int fd, r;
+
+	fd = open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot create test file.\n");
+		return EXIT_FAILURE;
+	}
+
+	r = crypt_uring_init(&ring, fd, TEST_DEPTH);
+	if (r) {
+		printf("TEST SKIPPED: io_uring not available (%d).\n", r);
+		close(fd);
+		unlink(TEST_FILE);
+		return 77;
+	}
+	crypt_uring_destroy(ring);
+
+	if (posix_memalign(&wbuf, TEST_CHUNK, TEST_LENGTH) ||
+	    posix_memalign(&rbuf, TEST_CHUNK, TEST_LENGTH))
+		r = EXIT_FAILURE;
+	else
+		r = test_rw(fd);
+
+	if (r == EXIT_SUCCESS)
+		r = test_fixed_buffers(fd);
+	if (r == EXIT_SUCCESS)
+		r = test_errors(fd);
+
+	free(wbuf);
+	free(rbuf);
+	close(fd);
+	unlink(TEST_FILE);
+
+	return r;
+}
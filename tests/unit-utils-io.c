@@ -35,7 +35,10 @@ enum fn_enum {
 	READ_BLOCKWISE,
 	WRITE_BLOCKWISE,
 	READ_LSEEK_BLOCKWISE,
-	WRITE_LSEEK_BLOCKWISE
+	WRITE_LSEEK_BLOCKWISE,
+	PREAD_BLOCKWISE,
+	PWRITE_BLOCKWISE,
+	BULK_READER
 } test_fn;
 
 char		*test_file;
@@ -233,6 +236,106 @@ out:
 	return ret;
 }
 
+static int test_pread_blockwise(void)
+{
+	struct io_scratch scratch = {};
+	void *buffer = NULL;
+	int fd = -1;
+	ssize_t ret = -EINVAL;
+
+	if (posix_memalign(&buffer, test_mem_alignment, test_length)) {
+		fprintf(stderr, "Failed to allocate aligned buffer.\n");
+		goto out;
+	}
+
+	fd = open(test_file, O_RDONLY | O_DIRECT);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", test_file);
+		goto out;
+	}
+
+	/* second call reuses scratch buffer */
+	ret = pread_blockwise(fd, test_bsize, test_mem_alignment, &scratch, buffer, test_length, test_offset);
+	if (ret >= 0)
+		ret = pread_blockwise(fd, test_bsize, test_mem_alignment, &scratch, buffer, test_length, test_offset);
+	if (ret < 0)
+		goto out;
+
+	ret = (size_t) ret == test_length ? 0 : -EIO;
+out:
+	if (fd >= 0)
+		close(fd);
+	io_scratch_free(&scratch);
+	free(buffer);
+	return ret;
+}
+
+static int test_pwrite_blockwise(void)
+{
+	struct io_scratch scratch = {};
+	void *buffer = NULL;
+	int fd = -1;
+	ssize_t ret = -EINVAL;
+
+	if (posix_memalign(&buffer, test_mem_alignment, test_length)) {
+		fprintf(stderr, "Failed to allocate aligned buffer.\n");
+		goto out;
+	}
+
+	fd = open(test_file, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", test_file);
+		goto out;
+	}
+
+	ret = pwrite_blockwise(fd, test_bsize, test_mem_alignment, &scratch, buffer, test_length, test_offset);
+	if (ret >= 0)
+		ret = pwrite_blockwise(fd, test_bsize, test_mem_alignment, &scratch, buffer, test_length, test_offset);
+	if (ret < 0)
+		goto out;
+
+	ret = (size_t) ret == test_length ? 0 : -EIO;
+out:
+	if (fd >= 0)
+		close(fd);
+	io_scratch_free(&scratch);
+	free(buffer);
+	return ret;
+}
+
+/* bulk read in chunks of 3 blocks with background prefetch (on several whole chunks) */
+static int test_bulk_reader(void)
+{
+	struct bulk_reader *br = NULL;
+	const char *data;
+	size_t total = 0;
+	int fd = -1;
+	ssize_t ret = -EINVAL;
+
+	fd = open(test_file, O_RDONLY | O_DIRECT);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", test_file);
+		goto out;
+	}
+
+	ret = bulk_reader_init(&br, fd, test_bsize, test_mem_alignment, test_offset, test_length,
+			       3 * test_bsize, BULK_READ_PREFETCH | BULK_READ_DROP_BEHIND);
+	if (ret < 0)
+		goto out;
+
+	while ((ret = bulk_reader_next(br, &data)) > 0)
+		total += ret;
+	if (ret < 0)
+		goto out;
+
+	ret = total == test_length ? 0 : -EIO;
+out:
+	bulk_reader_destroy(br);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
 static void usage(void)
 {
 	fprintf(stderr, "Use:\tunit-utils-io file/device blockwise_fn length  [bsize] [offset].\n");
@@ -291,6 +394,24 @@ static int parse_input_params(int argc, char **argv)
 			return 1;
 		}
 		test_fn = WRITE_LSEEK_BLOCKWISE;
+	} else if (!strcmp(argv[2], "pread_blockwise")) {
+		if (argc < 6) {
+			usage();
+			return 1;
+		}
+		test_fn = PREAD_BLOCKWISE;
+	} else if (!strcmp(argv[2], "pwrite_blockwise")) {
+		if (argc < 6) {
+			usage();
+			return 1;
+		}
+		test_fn = PWRITE_BLOCKWISE;
+	} else if (!strcmp(argv[2], "bulk_reader")) {
+		if (argc < 6) {
+			usage();
+			return 1;
+		}
+		test_fn = BULK_READER;
 	} else {
 		usage();
 		return 1;
@@ -343,6 +464,15 @@ int main(int argc, char **argv)
 	case WRITE_LSEEK_BLOCKWISE:
 		r = test_write_lseek_blockwise();
 		break;
+	case PREAD_BLOCKWISE:
+		r = test_pread_blockwise();
+		break;
+	case PWRITE_BLOCKWISE:
+		r = test_pwrite_blockwise();
+		break;
+	case BULK_READER:
+		r = test_bulk_reader();
+		break;
 	default :
 		fprintf(stderr, "Internal test error.\n");
 		return r;
@@ -29,6 +29,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <json-c/json.h>
 #include "libcryptsetup.h"
 #include "ssh-utils.h"
@@ -44,6 +46,16 @@
 
 #define l_dbg(cd, x...) crypt_logf(cd, CRYPT_LOG_DEBUG, x)
 
+/*
+ * Authenticated sessions (with opened sftp channel) are kept for reuse
+ * by other tokens with the same server, user and private key, so
+ * unlocking many devices from one key server needs only one handshake.
+ * Private key is still imported (and PIN checked) for every open.
+ * Idle sessions are closed on next lookup or when plugin is unloaded.
+ */
+#define SSH_CACHE_MAX		8
+#define SSH_CACHE_IDLE_SEC	60
+
 
 const char *cryptsetup_token_version(void);
 int cryptsetup_token_open_pin(struct crypt_device *cd, int token, const char *pin,
@@ -59,6 +71,144 @@ const char *cryptsetup_token_version(void)
 	return TOKEN_VERSION_MAJOR "." TOKEN_VERSION_MINOR;
 }
 
+struct ssh_cached {
+	char *server;
+	char *user;
+	char *keypath;
+	ssh_session ssh;
+	sftp_session sftp;
+	time_t last_used;
+};
+
+static struct ssh_cached ssh_cache[SSH_CACHE_MAX];
+static pthread_mutex_t ssh_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t ssh_cache_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return ts.tv_sec;
+}
+
+static void ssh_cached_free(struct ssh_cached *c)
+{
+	if (c->sftp)
+		sftp_free(c->sftp);
+	if (c->ssh) {
+		ssh_disconnect(c->ssh);
+		ssh_free(c->ssh);
+	}
+	free(c->server);
+	free(c->user);
+	free(c->keypath);
+	memset(c, 0, sizeof(*c));
+}
+
+static void __attribute__((destructor)) ssh_cache_exit(void)
+{
+	int i;
+
+	for (i = 0; i < SSH_CACHE_MAX; i++)
+		ssh_cached_free(&ssh_cache[i]);
+}
+
+/* Must be called with ssh_cache_lock held */
+static struct ssh_cached *ssh_cache_get(const char *server, const char *user, const char *keypath)
+{
+	struct ssh_cached *c = NULL;
+	time_t now = ssh_cache_now();
+	int i;
+
+	for (i = 0; i < SSH_CACHE_MAX; i++) {
+		if (!ssh_cache[i].ssh)
+			continue;
+		if (now - ssh_cache[i].last_used > SSH_CACHE_IDLE_SEC || !ssh_is_connected(ssh_cache[i].ssh))
+			ssh_cached_free(&ssh_cache[i]);
+		else if (!c && !strcmp(ssh_cache[i].server, server) &&
+			 !strcmp(ssh_cache[i].user, user) && !strcmp(ssh_cache[i].keypath, keypath))
+			c = &ssh_cache[i];
+	}
+
+	return c;
+}
+
+/* Must be called with ssh_cache_lock held, session is freed if it cannot be stored */
+static void ssh_cache_put(const char *server, const char *user, const char *keypath,
+	ssh_session ssh, sftp_session sftp)
+{
+	struct ssh_cached *c = &ssh_cache[0];
+	int i;
+
+	/* free slot or the least recently used one */
+	for (i = 0; i < SSH_CACHE_MAX; i++) {
+		if (!ssh_cache[i].ssh) {
+			c = &ssh_cache[i];
+			break;
+		}
+		if (ssh_cache[i].last_used < c->last_used)
+			c = &ssh_cache[i];
+	}
+	ssh_cached_free(c);
+
+	c->ssh = ssh;
+	c->sftp = sftp;
+	c->last_used = ssh_cache_now();
+	c->server = strdup(server);
+	c->user = strdup(user);
+	c->keypath = strdup(keypath);
+	if (!c->server || !c->user || !c->keypath)
+		ssh_cached_free(c);
+}
+
+static int ssh_download(struct crypt_device *cd, const char *server, const char *user,
+	const char *keypath, const char *path, ssh_key pkey, char **password, size_t *password_len)
+{
+	struct ssh_cached *c;
+	sftp_session sftp = NULL;
+	ssh_session ssh;
+	int r;
+
+	pthread_mutex_lock(&ssh_cache_lock);
+
+	c = ssh_cache_get(server, user, keypath);
+	if (c) {
+		l_dbg(cd, "Reusing ssh session to %s.", server);
+		r = sshplugin_sftp_download(cd, c->ssh, c->sftp, path, password, password_len);
+		if (!r) {
+			c->last_used = ssh_cache_now();
+			goto out;
+		}
+		/* stale session, try a new one */
+		ssh_cached_free(c);
+	}
+
+	ssh = sshplugin_session_init(cd, server, user);
+	if (!ssh) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = sshplugin_public_key_auth(cd, ssh, pkey);
+	if (r == SSH_AUTH_SUCCESS)
+		sftp = sshplugin_sftp_init(cd, ssh);
+
+	r = sftp ? sshplugin_sftp_download(cd, ssh, sftp, path, password, password_len) : -EINVAL;
+	if (!r)
+		ssh_cache_put(server, user, keypath, ssh, sftp);
+	else {
+		if (sftp)
+			sftp_free(sftp);
+		ssh_disconnect(ssh);
+		ssh_free(ssh);
+	}
+out:
+	pthread_mutex_unlock(&ssh_cache_lock);
+	return r;
+}
+
 static json_object *get_token_jobj(struct crypt_device *cd, int token)
 {
 	const char *json_slot;
@@ -77,7 +227,6 @@ int cryptsetup_token_open_pin(struct crypt_device *cd, int token, const char *pi
 	int r;
 	json_object *jobj_server, *jobj_user, *jobj_path, *jobj_token, *jobj_keypath;
 	ssh_key pkey;
-	ssh_session ssh;
 
 	jobj_token = get_token_jobj(cd, token);
 	if (!jobj_token)
@@ -99,23 +248,11 @@ int cryptsetup_token_open_pin(struct crypt_device *cd, int token, const char *pi
 		return -EAGAIN;
 	}
 
-	ssh = sshplugin_session_init(cd, json_object_get_string(jobj_server),
-				   json_object_get_string(jobj_user));
-	if (!ssh) {
-		json_object_put(jobj_token);
-		ssh_key_free(pkey);
-		return -EINVAL;
-	}
+	r = ssh_download(cd, json_object_get_string(jobj_server), json_object_get_string(jobj_user),
+			 json_object_get_string(jobj_keypath), json_object_get_string(jobj_path),
+			 pkey, password, password_len);
 
-	r = sshplugin_public_key_auth(cd, ssh, pkey);
 	ssh_key_free(pkey);
-
-	if (r == SSH_AUTH_SUCCESS)
-		r = sshplugin_download_password(cd, ssh, json_object_get_string(jobj_path),
-					      password, password_len);
-
-	ssh_disconnect(ssh);
-	ssh_free(ssh);
 	json_object_put(jobj_token);
 
 	return r ? -EINVAL : r;
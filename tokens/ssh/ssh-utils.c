@@ -31,28 +31,38 @@
 
 #define KEYFILE_LENGTH_MAX 8192
 
-int sshplugin_download_password(struct crypt_device *cd, ssh_session ssh,
-	const char *path, char **password, size_t *password_len)
+sftp_session sshplugin_sftp_init(struct crypt_device *cd, ssh_session ssh)
 {
-	char *pass = NULL;
-	size_t pass_len;
-	int r;
-	sftp_attributes sftp_attr = NULL;
-	sftp_session sftp = NULL;
-	sftp_file file = NULL;
+	sftp_session sftp;
 
 	sftp = sftp_new(ssh);
 	if (!sftp) {
 		crypt_log(cd, CRYPT_LOG_ERROR, _("Cannot create sftp session: "));
-		r = SSH_FX_FAILURE;
 		goto out;
 	}
 
-	r = sftp_init(sftp);
-	if (r != SSH_OK) {
+	if (sftp_init(sftp) != SSH_OK) {
 		crypt_log(cd, CRYPT_LOG_ERROR, _("Cannot init sftp session: "));
-		goto out;
+		sftp_free(sftp);
+		sftp = NULL;
 	}
+out:
+	if (!sftp) {
+		crypt_log(cd, CRYPT_LOG_ERROR, ssh_get_error(ssh));
+		crypt_log(cd, CRYPT_LOG_ERROR, "\n");
+	}
+
+	return sftp;
+}
+
+int sshplugin_sftp_download(struct crypt_device *cd, ssh_session ssh, sftp_session sftp,
+	const char *path, char **password, size_t *password_len)
+{
+	char *pass = NULL;
+	size_t pass_len;
+	int r;
+	sftp_attributes sftp_attr = NULL;
+	sftp_file file = NULL;
 
 	file = sftp_open(sftp, path, O_RDONLY, 0);
 	if (!file) {
@@ -99,11 +109,25 @@ out:
 
 	if (file)
 		sftp_close(file);
-	if (sftp)
-		sftp_free(sftp);
 	return r == SSH_OK ? 0 : -EINVAL;
 }
 
+int sshplugin_download_password(struct crypt_device *cd, ssh_session ssh,
+	const char *path, char **password, size_t *password_len)
+{
+	sftp_session sftp;
+	int r;
+
+	sftp = sshplugin_sftp_init(cd, ssh);
+	if (!sftp)
+		return -EINVAL;
+
+	r = sshplugin_sftp_download(cd, ssh, sftp, path, password, password_len);
+
+	sftp_free(sftp);
+	return r;
+}
+
 ssh_session sshplugin_session_init(struct crypt_device *cd, const char *host, const char *user)
 {
 	int r, port = 22;
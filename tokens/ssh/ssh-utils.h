@@ -23,6 +23,9 @@
 #include <libssh/sftp.h>
 #include <libcryptsetup.h>
 
+sftp_session sshplugin_sftp_init(struct crypt_device *cd, ssh_session ssh);
+int sshplugin_sftp_download(struct crypt_device *cd, ssh_session ssh, sftp_session sftp,
+	const char *path, char **password, size_t *password_len);
 int sshplugin_download_password(struct crypt_device *cd, ssh_session ssh,
 	const char *path, char **password, size_t *password_len);
 ssh_session sshplugin_session_init(struct crypt_device *cd, const char *host, const char *user);